@@ -9,6 +9,19 @@
 #include "mcp_server.h"
 #include "assets.h"
 #include "settings.h"
+#include "json_arena.h"
+#include "boot_timeline.h"
+#include "wakeup_coalescer.h"
+#include "power_governor.h"
+#include "perf_counters.h"
+#include "perf_profile.h"
+#include "heap_monitor.h"
+#include "task_profile.h"
+#include "tts_cache.h"
+#include "protocol_trace.h"
+#include "trace_markers.h"
+#include "turn_timeline.h"
+#include "lp_sound_wake.h"
 
 #include <cstring>
 #include <esp_log.h>
@@ -19,6 +32,9 @@
 
 #define TAG "Application"
 
+// The fade out of the frame being played when the reply is aborted
+#define ABORT_SPEAKING_FADE_MS 10
+
 
 Application::Application() {
     event_group_ = xEventGroupCreate();
@@ -33,24 +49,15 @@ Application::Application() {
     aec_mode_ = kAecOff;
 #endif
 
-    esp_timer_create_args_t clock_timer_args = {
-        .callback = [](void* arg) {
-            Application* app = (Application*)arg;
-            xEventGroupSetBits(app->event_group_, MAIN_EVENT_CLOCK_TICK);
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "clock_timer",
-        .skip_unhandled_events = true
-    };
-    esp_timer_create(&clock_timer_args, &clock_timer_handle_);
+    // The status bar clock shares the wake windows of the other periodic work
+    clock_job_ = WakeupCoalescer::GetInstance().Add("clock", 1000, [this](int periods) {
+        pending_clock_ticks_ += periods;
+        xEventGroupSetBits(event_group_, MAIN_EVENT_CLOCK_TICK);
+    });
 }
 
 Application::~Application() {
-    if (clock_timer_handle_ != nullptr) {
-        esp_timer_stop(clock_timer_handle_);
-        esp_timer_delete(clock_timer_handle_);
-    }
+    WakeupCoalescer::GetInstance().Remove(clock_job_);
     vEventGroupDelete(event_group_);
 }
 
@@ -59,39 +66,135 @@ bool Application::SetDeviceState(DeviceState state) {
 }
 
 void Application::Initialize() {
+#if CONFIG_JSON_ARENA_SIZE > 0
+    JsonArena::Install(CONFIG_JSON_ARENA_SIZE);
+#endif
+    BootTimeline::Mark("initialize");
     auto& board = Board::GetInstance();
+    BootTimeline::Mark("board");
     SetDeviceState(kDeviceStateStarting);
 
-    // Setup the display
-    auto display = board.GetDisplay();
+    // Setup the display, the board creates it on the first call
+    board.GetDisplay();
 
     // Print board name/version info
-    display->SetChatMessage("system", SystemInfo::GetUserAgent().c_str());
+    display_queue_.SetChatMessage("system", SystemInfo::GetUserAgent().c_str());
+    // From here on the UI updates do not wait for the renders
+    display_queue_.Start();
+    BootTimeline::Mark("display");
 
     // Setup the audio service
     auto codec = board.GetAudioCodec();
     audio_service_.Initialize(codec);
+    BootTimeline::Mark("audio_initialize");
     audio_service_.Start();
+#if CONFIG_LP_SOUND_WAKE
+    // What woke the device from deep sleep, the wake word may have begun before the boot
+    {
+        std::vector<int16_t> pre_roll;
+        int pre_roll_rate = 0;
+        if (LpSoundWake::ReadPreRoll(pre_roll, pre_roll_rate)) {
+            audio_service_.FeedWakeWordPreRoll(pre_roll, pre_roll_rate);
+        }
+    }
+#endif
+    // The profile the server pushed last time, until the version check brings the current one
+    PerfProfile::GetInstance().Load();
+    audio_service_.ApplyPerfProfile();
 
     AudioServiceCallbacks callbacks;
     callbacks.on_send_queue_available = [this]() {
-        xEventGroupSetBits(event_group_, MAIN_EVENT_SEND_AUDIO);
+        if (network_tx_.running()) {
+            network_tx_.NotifyAudio();
+        } else {
+            xEventGroupSetBits(event_group_, MAIN_EVENT_SEND_AUDIO);
+        }
     };
     callbacks.on_wake_word_detected = [this](const std::string& wake_word) {
         xEventGroupSetBits(event_group_, MAIN_EVENT_WAKE_WORD_DETECTED);
     };
+    callbacks.on_local_command = [](const std::string& tool, const std::string& arguments) {
+        McpServer::GetInstance().CallLocalTool(tool, arguments);
+    };
     callbacks.on_vad_change = [this](bool speaking) {
+        if (!speaking) {
+            TurnTimeline::GetInstance().Mark(kTurnEventVadEnd);
+        }
+#if CONFIG_LOCAL_ENDPOINT
+        endpointer_.OnVadChange(speaking);
+#endif
+#if CONFIG_FOLLOW_UP_TURN
+        follow_up_trigger_.OnVadChange(speaking);
+#endif
         xEventGroupSetBits(event_group_, MAIN_EVENT_VAD_CHANGE);
     };
+    callbacks.on_narrowband_change = [this](bool narrowband) {
+        Schedule([this, narrowband]() {
+            if (protocol_ && protocol_->IsAudioChannelOpened()) {
+                network_tx_.Post([this, narrowband]() {
+                    if (protocol_) {
+                        protocol_->SendAudioProfile(narrowband);
+                    }
+                });
+            }
+        });
+    };
+#if CONFIG_LOCAL_ENDPOINT
+    endpointer_.OnEndOfSpeech([this]() {
+        Schedule([this]() {
+            // The server may have stopped the turn meanwhile
+            if (GetDeviceState() == kDeviceStateListening && listening_mode_ == kListeningModeAutoStop) {
+                ESP_LOGI(TAG, "Stop listening at the local end of speech");
+                HandleStopListeningEvent();
+            }
+        }, kSchedulePriorityUrgent);
+    });
+#endif
+#if CONFIG_FOLLOW_UP_TURN
+    follow_up_trigger_.OnVoice([this]() {
+        Schedule([this]() {
+            ContinueFollowUp();
+        }, kSchedulePriorityUrgent);
+    });
+#endif
     audio_service_.SetCallbacks(callbacks);
+    network_tx_.Start(&audio_service_, [this](AudioStreamPacketPtr* packets, size_t count) -> size_t {
+        return protocol_ ? protocol_->SendAudioBatch(packets, count) : 0;
+    });
+    BootTimeline::Mark("audio_service");
+
+    // Load the assets and the wake word models while the network comes up and the version is checked,
+    // unless a pending assets download is going to replace them. With a second slot the assets stay
+    // in use during the download, only the wake word waits for the models of the new ones.
+    auto& assets = Assets::GetInstance();
+    Settings assets_settings("assets", false);
+    assets_pending_ = !assets_settings.GetString("download_url").empty();
+    assets_prepared_ = assets.partition_valid() && (!assets_pending_ || assets.double_buffered());
+    xTaskCreate([](void* arg) {
+        Application* app = static_cast<Application*>(arg);
+        app->PrepareTask();
+        vTaskDelete(NULL);
+    }, "boot_prepare", 4096 * 2, this, 2, nullptr);
 
     // Add state change listeners
     state_machine_.AddStateChangeListener([this](DeviceState old_state, DeviceState new_state) {
         xEventGroupSetBits(event_group_, MAIN_EVENT_STATE_CHANGED);
     });
+    // The top CPU frequency follows the state from the first transition on
+    state_machine_.AddStateChangeListener([](DeviceState old_state, DeviceState new_state) {
+        PowerGovernor::GetInstance().OnStateChanged(new_state);
+    });
+    PowerGovernor::GetInstance().OnStateChanged(GetDeviceState());
+    // The WiFi modem wakes up with the wake word, before the channel opens
+    state_machine_.AddStateChangeListener([](DeviceState old_state, DeviceState new_state) {
+        Board::GetInstance().OnDeviceStateChanged(new_state);
+    });
+    PowerGovernor::GetInstance().Start();
 
     // Start the clock timer to update the status bar
-    esp_timer_start_periodic(clock_timer_handle_, 1000000);
+    WakeupCoalescer::GetInstance().Start(clock_job_);
+    // Sample the fragmentation of the heap from the start, for its trend
+    HeapMonitor::GetInstance();
 
     // Add MCP common tools (only once during initialization)
     auto& mcp_server = McpServer::GetInstance();
@@ -100,36 +203,42 @@ void Application::Initialize() {
 
     // Set network event callback for UI updates and network state handling
     board.SetNetworkEventCallback([this](NetworkEvent event, const std::string& data) {
-        auto display = Board::GetInstance().GetDisplay();
+        // The network of the device status
+        McpServer::InvalidateCachedResults();
         
         switch (event) {
             case NetworkEvent::Scanning:
-                display->ShowNotification(Lang::Strings::SCANNING_WIFI, 30000);
+                display_queue_.ShowNotification(Lang::Strings::SCANNING_WIFI, 30000);
                 xEventGroupSetBits(event_group_, MAIN_EVENT_NETWORK_DISCONNECTED);
                 break;
             case NetworkEvent::Connecting: {
                 if (data.empty()) {
                     // Cellular network - registering without carrier info yet
-                    display->SetStatus(Lang::Strings::REGISTERING_NETWORK);
+                    display_queue_.SetStatus(Lang::Strings::REGISTERING_NETWORK);
                 } else {
                     // WiFi or cellular with carrier info
                     std::string msg = Lang::Strings::CONNECT_TO;
                     msg += data;
                     msg += "...";
-                    display->ShowNotification(msg.c_str(), 30000);
+                    display_queue_.ShowNotification(msg.c_str(), 30000);
                 }
                 break;
             }
             case NetworkEvent::Connected: {
                 std::string msg = Lang::Strings::CONNECTED_TO;
                 msg += data;
-                display->ShowNotification(msg.c_str(), 30000);
+                display_queue_.ShowNotification(msg.c_str(), 30000);
                 xEventGroupSetBits(event_group_, MAIN_EVENT_NETWORK_CONNECTED);
                 break;
             }
             case NetworkEvent::Disconnected:
                 xEventGroupSetBits(event_group_, MAIN_EVENT_NETWORK_DISCONNECTED);
                 break;
+            case NetworkEvent::Switched:
+                Schedule([this]() {
+                    HandleNetworkSwitchedEvent();
+                });
+                break;
             case NetworkEvent::WifiConfigModeEnter:
                 // WiFi config mode enter is handled by WifiBoard internally
                 break;
@@ -138,7 +247,7 @@ void Application::Initialize() {
                 break;
             // Cellular modem specific events
             case NetworkEvent::ModemDetecting:
-                display->SetStatus(Lang::Strings::DETECTING_MODULE);
+                display_queue_.SetStatus(Lang::Strings::DETECTING_MODULE);
                 break;
             case NetworkEvent::ModemErrorNoSim:
                 Alert(Lang::Strings::ERROR, Lang::Strings::PIN_ERROR, "triangle_exclamation", Lang::Sounds::OGG_ERR_PIN);
@@ -150,21 +259,23 @@ void Application::Initialize() {
                 Alert(Lang::Strings::ERROR, Lang::Strings::MODEM_INIT_ERROR, "triangle_exclamation", Lang::Sounds::OGG_EXCLAMATION);
                 break;
             case NetworkEvent::ModemErrorTimeout:
-                display->SetStatus(Lang::Strings::REGISTERING_NETWORK);
+                display_queue_.SetStatus(Lang::Strings::REGISTERING_NETWORK);
                 break;
         }
     });
 
     // Start network asynchronously
     board.StartNetwork();
+    BootTimeline::Mark("network_start");
 
     // Update the status bar immediately to show the network state
-    display->UpdateStatusBar(true);
+    display_queue_.UpdateStatusBar(true);
 }
 
 void Application::Run() {
     // Set the priority of the main task to 10
     vTaskPrioritySet(nullptr, 10);
+    main_loop_monitor_.Start(CONFIG_MAIN_LOOP_STALL_BUDGET_MS);
 
     const EventBits_t ALL_EVENTS = 
         MAIN_EVENT_SCHEDULE |
@@ -185,51 +296,64 @@ void Application::Run() {
         auto bits = xEventGroupWaitBits(event_group_, ALL_EVENTS, pdTRUE, pdFALSE, portMAX_DELAY);
 
         if (bits & MAIN_EVENT_ERROR) {
+            MainLoopScope scope(main_loop_monitor_, "error");
             SetDeviceState(kDeviceStateIdle);
             Alert(Lang::Strings::ERROR, last_error_message_.c_str(), "circle_xmark", Lang::Sounds::OGG_EXCLAMATION);
         }
 
         if (bits & MAIN_EVENT_NETWORK_CONNECTED) {
+            MainLoopScope scope(main_loop_monitor_, "network_connected");
             HandleNetworkConnectedEvent();
         }
 
         if (bits & MAIN_EVENT_NETWORK_DISCONNECTED) {
+            MainLoopScope scope(main_loop_monitor_, "network_disconnected");
             HandleNetworkDisconnectedEvent();
         }
 
         if (bits & MAIN_EVENT_ACTIVATION_DONE) {
+            MainLoopScope scope(main_loop_monitor_, "activation_done");
             HandleActivationDoneEvent();
         }
 
         if (bits & MAIN_EVENT_STATE_CHANGED) {
+            MainLoopScope scope(main_loop_monitor_, "state_changed");
             HandleStateChangedEvent();
         }
 
         if (bits & MAIN_EVENT_TOGGLE_CHAT) {
+            MainLoopScope scope(main_loop_monitor_, "toggle_chat");
             HandleToggleChatEvent();
         }
 
         if (bits & MAIN_EVENT_START_LISTENING) {
+            MainLoopScope scope(main_loop_monitor_, "start_listening");
             HandleStartListeningEvent();
         }
 
         if (bits & MAIN_EVENT_STOP_LISTENING) {
+            MainLoopScope scope(main_loop_monitor_, "stop_listening");
             HandleStopListeningEvent();
         }
 
         if (bits & MAIN_EVENT_SEND_AUDIO) {
-            while (auto packet = audio_service_.PopPacketFromSendQueue()) {
-                if (protocol_ && !protocol_->SendAudio(std::move(packet))) {
+            MainLoopScope scope(main_loop_monitor_, "send_audio");
+            AudioStreamPacketPtr packets[MAX_SEND_PACKETS_PER_BATCH];
+            while (size_t count = audio_service_.PopPacketsFromSendQueue(packets, MAX_SEND_PACKETS_PER_BATCH)) {
+                // Counted by the network tx like the batches of its task
+                if (network_tx_.SendAudioBatch(packets, count) < count) {
                     break;
                 }
             }
         }
 
         if (bits & MAIN_EVENT_WAKE_WORD_DETECTED) {
+            MainLoopScope scope(main_loop_monitor_, "wake_word_detected");
             HandleWakeWordDetectedEvent();
         }
 
         if (bits & MAIN_EVENT_VAD_CHANGE) {
+            MainLoopScope scope(main_loop_monitor_, "vad_change");
             if (GetDeviceState() == kDeviceStateListening) {
                 auto led = Board::GetInstance().GetLed();
                 led->OnStateChanged();
@@ -237,22 +361,75 @@ void Application::Run() {
         }
 
         if (bits & MAIN_EVENT_SCHEDULE) {
-            std::unique_lock<std::mutex> lock(mutex_);
-            auto tasks = std::move(main_tasks_);
-            lock.unlock();
-            for (auto& task : tasks) {
+            // Only the tasks queued so far, the ones they schedule wait for the next round of events
+            size_t count = scheduler_.pending();
+            MainTask task;
+            std::source_location site;
+            while (count-- > 0 && scheduler_.Pop(task, site)) {
+                MainLoopScope scope(main_loop_monitor_, site.file_name(), site.line());
                 task();
+                task.Reset();
+            }
+            if (scheduler_.pending() > 0) {
+                xEventGroupSetBits(event_group_, MAIN_EVENT_SCHEDULE);
             }
         }
 
         if (bits & MAIN_EVENT_CLOCK_TICK) {
-            clock_ticks_++;
-            auto display = Board::GetInstance().GetDisplay();
-            display->UpdateStatusBar();
+            MainLoopScope scope(main_loop_monitor_, "clock_tick");
+            // A long wake window while asleep brings several ticks at once
+            int ticks = pending_clock_ticks_.exchange(0);
+            bool check_status = false;
+            bool print_stats = false;
+            bool print_stacks = false;
+            for (int i = 0; i < ticks; i++) {
+                clock_ticks_++;
+                check_status |= clock_ticks_ % DEVICE_STATUS_CHECK_INTERVAL_S == 0;
+                print_stats |= clock_ticks_ % 10 == 0;
+                print_stacks |= clock_ticks_ % 60 == 0;
+            }
+            display_queue_.UpdateStatusBar();
+            if (protocol_ && protocol_->IsAudioChannelOpened()) {
+                static auto rtt = PerfCounters::GetInstance().Gauge("protocol.rtt_ms");
+                static auto tx_bitrate = PerfCounters::GetInstance().Gauge("protocol.tx_bitrate_bps");
+                auto stats = protocol_->GetTransportStats();
+                rtt->Set(stats.rtt_ms);
+                tx_bitrate->Set(stats.tx_bitrate_bps);
+                audio_service_.UpdateTransportStats(stats);
+                Board::GetInstance().UpdateLinkStats(stats.tx_packets, stats.tx_failures);
+            }
+            if (check_status) {
+                McpServer::GetInstance().CheckDeviceStatus();
+            }
+#if CONFIG_FOLLOW_UP_TURN
+            // clock_ticks_ counts from the idle the reply ended in
+            if (follow_up_active_ && clock_ticks_ >= CONFIG_FOLLOW_UP_WINDOW_S) {
+                ESP_LOGI(TAG, "No follow-up in %d s", CONFIG_FOLLOW_UP_WINDOW_S);
+                static auto expired = PerfCounters::GetInstance().Counter("follow_up.expired");
+                expired->Add();
+                EndFollowUp();
+            }
+#endif
+#if CONFIG_OTA_BACKGROUND_UPGRADE
+            // clock_ticks_ counts from the last state change
+            if (upgrade_reboot_pending_ && GetDeviceState() == kDeviceStateIdle
+                && clock_ticks_ >= CONFIG_OTA_BACKGROUND_REBOOT_IDLE_S && audio_service_.IsIdle()
+                && !(protocol_ && protocol_->IsAudioChannelOpened())) {
+                ESP_LOGI(TAG, "Rebooting into the firmware downloaded in the background");
+                Reboot();
+            }
+#endif
         
             // Print debug info every 10 seconds
-            if (clock_ticks_ % 10 == 0) {
+            if (print_stats) {
                 SystemInfo::PrintHeapStats();
+#if CONFIG_AUDIO_LATENCY_TRACE
+                audio_service_.latency_tracer().PrintStats();
+#endif
+            }
+            // The stack high-water marks once a minute, for tuning the task topology
+            if (print_stacks) {
+                TaskProfiles::PrintStackUsage();
             }
         }
     }
@@ -260,6 +437,7 @@ void Application::Run() {
 
 void Application::HandleNetworkConnectedEvent() {
     ESP_LOGI(TAG, "Network connected");
+    BootTimeline::Mark("network_connected");
     auto state = GetDeviceState();
 
     if (state == kDeviceStateStarting || state == kDeviceStateWifiConfiguring) {
@@ -279,8 +457,7 @@ void Application::HandleNetworkConnectedEvent() {
     }
 
     // Update the status bar immediately to show the network state
-    auto display = Board::GetInstance().GetDisplay();
-    display->UpdateStatusBar(true);
+    display_queue_.UpdateStatusBar(true);
 }
 
 void Application::HandleNetworkDisconnectedEvent() {
@@ -288,12 +465,48 @@ void Application::HandleNetworkDisconnectedEvent() {
     auto state = GetDeviceState();
     if (state == kDeviceStateConnecting || state == kDeviceStateListening || state == kDeviceStateSpeaking) {
         ESP_LOGI(TAG, "Closing audio channel due to network disconnection");
-        protocol_->CloseAudioChannel();
+        CloseAudioChannel();
     }
 
     // Update the status bar immediately to show the network state
-    auto display = Board::GetInstance().GetDisplay();
-    display->UpdateStatusBar(true);
+    display_queue_.UpdateStatusBar(true);
+}
+
+void Application::HandleNetworkSwitchedEvent() {
+    display_queue_.UpdateStatusBar(true);
+    if (!protocol_) {
+        return;
+    }
+
+    auto state = GetDeviceState();
+    bool in_conversation = protocol_->IsAudioChannelOpened() &&
+        (state == kDeviceStateListening || state == kDeviceStateSpeaking);
+    ESP_LOGI(TAG, "Moving the protocol to the new network%s", in_conversation ? " with the conversation" : "");
+
+    // The connections of the old network are dropped without a goodbye, the state is kept
+    migrating_ = true;
+    if (protocol_->IsAudioChannelOpened()) {
+        CloseAudioChannel(false);
+    }
+    migrating_ = false;
+    {
+        auto tx_lock = network_tx_.LockTransport();
+        protocol_->Start();
+    }
+
+    if (!in_conversation) {
+        return;
+    }
+    if (!OpenAudioChannel()) {
+        SetDeviceState(kDeviceStateIdle);
+        return;
+    }
+    // The new session listens from here on, the rest of a reply was lost with the old one
+    bool processing = audio_service_.IsAudioProcessorRunning();
+    SetListeningMode(listening_mode_);
+    if (processing) {
+        PostStartListening();
+    }
 }
 
 void Application::HandleActivationDoneEvent() {
@@ -301,21 +514,45 @@ void Application::HandleActivationDoneEvent() {
 
     SystemInfo::PrintHeapStats();
     SetDeviceState(kDeviceStateIdle);
+    BootTimeline::Finish();
+#if CONFIG_PROTOCOL_TRACE
+    if (protocol_) {
+        ProtocolTrace::GetInstance().StartPendingReplay(*protocol_);
+    }
+#endif
+
+#if CONFIG_FAST_START
+    std::string wake_word = std::move(boot_wake_word_);
+    boot_wake_word_.clear();
+    if (!wake_word.empty() && esp_timer_get_time() / 1000 - boot_wake_word_time_ms_ > CONFIG_FAST_START_WAKE_WORD_HOLD_S * 1000) {
+        ESP_LOGW(TAG, "Wake word %s detected during the boot is dropped, held for too long", wake_word.c_str());
+        wake_word.clear();
+    }
+#endif
 
     has_server_time_ = ota_->HasServerTime();
 
-    auto display = Board::GetInstance().GetDisplay();
     std::string message = std::string(Lang::Strings::VERSION) + ota_->GetCurrentVersion();
-    display->ShowNotification(message.c_str());
-    display->SetChatMessage("system", "");
-
-    // Play the success sound to indicate the device is ready
-    audio_service_.PlaySound(Lang::Sounds::OGG_SUCCESS);
+    display_queue_.ShowNotification(message.c_str());
+    display_queue_.SetChatMessage("system", "");
 
     // Release OTA object after activation is complete
     ota_.reset();
     auto& board = Board::GetInstance();
     board.SetPowerSaveLevel(PowerSaveLevel::LOW_POWER);
+
+#if CONFIG_FAST_START
+    if (!wake_word.empty()) {
+        // Idle is left before its state change is handled, so the staged speech is kept
+        SetDeviceState(kDeviceStateConnecting);
+        Schedule([this, wake_word]() {
+            ContinueWakeWordInvoke(wake_word);
+        });
+        return;
+    }
+#endif
+    // Play the success sound to indicate the device is ready
+    audio_service_.PlaySound(Lang::Sounds::OGG_SUCCESS);
 }
 
 void Application::ActivationTask() {
@@ -325,25 +562,83 @@ void Application::ActivationTask() {
     // Check for new assets version
     CheckAssetsVersion();
 
+    // The config of the last check starts the protocol right away, the check runs afterwards
+    if (ota_->LoadCachedConfig()) {
+        InitializeProtocol();
+        BootTimeline::Mark("protocol");
+        xEventGroupWaitBits(event_group_, MAIN_EVENT_BOOT_PREPARED, pdFALSE, pdTRUE, portMAX_DELAY);
+        xEventGroupSetBits(event_group_, MAIN_EVENT_ACTIVATION_DONE);
+
+        // ota_ is released by the main task once the activation is done
+        Ota ota;
+        bool was_mqtt = ota.LoadCachedConfig() && ota.HasMqttConfig();
+        CheckNewVersion(ota, true);
+        BootTimeline::Mark("version_checked");
+        bool has_server_time = ota.HasServerTime();
+        Schedule([this, has_server_time]() {
+            has_server_time_ = has_server_time_ || has_server_time;
+        });
+        if (ota.HasMqttConfig() != was_mqtt && (ota.HasMqttConfig() || ota.HasWebsocketConfig())) {
+            ESP_LOGI(TAG, "The protocol changed, it is used from the next boot");
+        }
+        return;
+    }
+
     // Check for new firmware version
-    CheckNewVersion();
+    BootTimeline::Mark("version_check");
+    CheckNewVersion(*ota_, false);
+    BootTimeline::Mark("version_checked");
 
     // Initialize the protocol
     InitializeProtocol();
+    BootTimeline::Mark("protocol");
+
+    // Idle needs the wake word, wait for the models loading in parallel
+    xEventGroupWaitBits(event_group_, MAIN_EVENT_BOOT_PREPARED, pdFALSE, pdTRUE, portMAX_DELAY);
 
     // Signal completion to main loop
     xEventGroupSetBits(event_group_, MAIN_EVENT_ACTIVATION_DONE);
 }
 
+void Application::PrepareTask() {
+    if (assets_prepared_) {
+        Assets::GetInstance().Apply();
+        display_queue_.SetChatMessage("system", "");
+        display_queue_.SetEmotion("microchip_ai");
+        BootTimeline::Mark("theme");
+
+        // The models come with the assets, without them there is nothing to load yet
+        if (!assets_pending_ && audio_service_.PrepareWakeWord()) {
+            BootTimeline::Mark("wake_word");
+#if CONFIG_FAST_START
+            Schedule([this]() {
+                auto state = GetDeviceState();
+                if (state == kDeviceStateStarting || state == kDeviceStateActivating) {
+                    audio_service_.EnableWakeWordDetection(true);
+                }
+            });
+#endif
+        }
+    }
+    xEventGroupSetBits(event_group_, MAIN_EVENT_BOOT_PREPARED);
+
+    // The feedback sounds then start on the next DMA chunk, the others are cached once played
+    for (auto& sound : {Lang::Sounds::OGG_POPUP, Lang::Sounds::OGG_SUCCESS, Lang::Sounds::OGG_VIBRATION}) {
+        audio_service_.PreloadSound(sound);
+    }
+}
+
 void Application::CheckAssetsVersion() {
     // Only allow CheckAssetsVersion to be called once
     if (assets_version_checked_) {
         return;
     }
     assets_version_checked_ = true;
+    if (assets_prepared_ && !assets_pending_) {
+        return;
+    }
 
     auto& board = Board::GetInstance();
-    auto display = board.GetDisplay();
     auto& assets = Assets::GetInstance();
 
     if (!assets.partition_valid()) {
@@ -366,14 +661,14 @@ void Application::CheckAssetsVersion() {
         vTaskDelay(pdMS_TO_TICKS(3000));
         SetDeviceState(kDeviceStateUpgrading);
         board.SetPowerSaveLevel(PowerSaveLevel::PERFORMANCE);
-        display->SetChatMessage("system", Lang::Strings::PLEASE_WAIT);
+        display_queue_.SetChatMessage("system", Lang::Strings::PLEASE_WAIT);
 
-        bool success = assets.Download(download_url, [this, display](int progress, size_t speed) -> void {
+        bool success = assets.Download(download_url, [this](int progress, size_t speed) -> void {
             char buffer[32];
             snprintf(buffer, sizeof(buffer), "%d%% %uKB/s", progress, speed / 1024);
-            Schedule([display, message = std::string(buffer)]() {
-                display->SetChatMessage("system", message.c_str());
-            });
+            Schedule([this, message = std::string(buffer)]() {
+                display_queue_.SetChatMessage("system", message.c_str());
+            }, kSchedulePriorityBackground, "progress");
         });
 
         board.SetPowerSaveLevel(PowerSaveLevel::LOW_POWER);
@@ -389,21 +684,22 @@ void Application::CheckAssetsVersion() {
 
     // Apply assets
     assets.Apply();
-    display->SetChatMessage("system", "");
-    display->SetEmotion("microchip_ai");
+    display_queue_.SetChatMessage("system", "");
+    display_queue_.SetEmotion("microchip_ai");
 }
 
-void Application::CheckNewVersion() {
-    const int MAX_RETRY = 10;
+void Application::CheckNewVersion(Ota& ota, bool background) {
+    // The device is in use already while the check runs in the background
+    const int MAX_RETRY = background ? 3 : 10;
     int retry_count = 0;
     int retry_delay = 10; // Initial retry delay in seconds
 
-    auto& board = Board::GetInstance();
     while (true) {
-        auto display = board.GetDisplay();
-        display->SetStatus(Lang::Strings::CHECKING_NEW_VERSION);
+        if (!background) {
+            display_queue_.SetStatus(Lang::Strings::CHECKING_NEW_VERSION);
+        }
 
-        esp_err_t err = ota_->CheckVersion();
+        esp_err_t err = ota.CheckVersion();
         if (err != ESP_OK) {
             retry_count++;
             if (retry_count >= MAX_RETRY) {
@@ -411,16 +707,18 @@ void Application::CheckNewVersion() {
                 return;
             }
 
-            char error_message[128];
-            snprintf(error_message, sizeof(error_message), "code=%d, url=%s", err, ota_->GetCheckVersionUrl().c_str());
-            char buffer[256];
-            snprintf(buffer, sizeof(buffer), Lang::Strings::CHECK_NEW_VERSION_FAILED, retry_delay, error_message);
-            Alert(Lang::Strings::ERROR, buffer, "cloud_slash", Lang::Sounds::OGG_EXCLAMATION);
+            if (!background) {
+                char error_message[128];
+                snprintf(error_message, sizeof(error_message), "code=%d, url=%s", err, ota.GetCheckVersionUrl().c_str());
+                char buffer[256];
+                snprintf(buffer, sizeof(buffer), Lang::Strings::CHECK_NEW_VERSION_FAILED, retry_delay, error_message);
+                Alert(Lang::Strings::ERROR, buffer, "cloud_slash", Lang::Sounds::OGG_EXCLAMATION);
+            }
 
             ESP_LOGW(TAG, "Check new version failed, retry in %d seconds (%d/%d)", retry_delay, retry_count, MAX_RETRY);
             for (int i = 0; i < retry_delay; i++) {
                 vTaskDelay(pdMS_TO_TICKS(1000));
-                if (GetDeviceState() == kDeviceStateIdle) {
+                if (!background && GetDeviceState() == kDeviceStateIdle) {
                     break;
                 }
             }
@@ -429,31 +727,49 @@ void Application::CheckNewVersion() {
         }
         retry_count = 0;
         retry_delay = 10; // Reset retry delay
-
-        if (ota_->HasNewVersion()) {
-            if (UpgradeFirmware(ota_->GetFirmwareUrl(), ota_->GetFirmwareVersion())) {
+        audio_service_.ApplyPerfProfile();
+
+        if (ota.HasNewVersion()) {
+#if CONFIG_OTA_BACKGROUND_UPGRADE
+            // The device is in use already, it keeps working while the firmware downloads
+            if (background) {
+                if (UpgradeFirmwareInBackground(ota.GetFirmwareUrl(), ota.GetFirmwareVersion(), ota.GetFirmwarePatchUrl())) {
+                    ota.MarkCurrentVersionValid();
+                    return; // The reboot waits for an idle moment
+                }
+            } else if (UpgradeFirmware(ota.GetFirmwareUrl(), ota.GetFirmwareVersion(), ota.GetFirmwarePatchUrl())) {
+                return; // This line will never be reached after reboot
+            }
+#else
+            if (UpgradeFirmware(ota.GetFirmwareUrl(), ota.GetFirmwareVersion(), ota.GetFirmwarePatchUrl())) {
                 return; // This line will never be reached after reboot
             }
+#endif
             // If upgrade failed, continue to normal operation
         }
 
         // No new version, mark the current version as valid
-        ota_->MarkCurrentVersionValid();
-        if (!ota_->HasActivationCode() && !ota_->HasActivationChallenge()) {
+        ota.MarkCurrentVersionValid();
+        if (!ota.HasActivationCode() && !ota.HasActivationChallenge()) {
             // Exit the loop if done checking new version
             break;
         }
+        if (background) {
+            // Such a response is not cached, the next boot activates before starting the protocol
+            ESP_LOGW(TAG, "The device needs activation, it is activated on the next boot");
+            break;
+        }
 
-        display->SetStatus(Lang::Strings::ACTIVATION);
+        display_queue_.SetStatus(Lang::Strings::ACTIVATION);
         // Activation code is shown to the user and waiting for the user to input
-        if (ota_->HasActivationCode()) {
-            ShowActivationCode(ota_->GetActivationCode(), ota_->GetActivationMessage());
+        if (ota.HasActivationCode()) {
+            ShowActivationCode(ota.GetActivationCode(), ota.GetActivationMessage());
         }
 
         // This will block the loop until the activation is done or timeout
         for (int i = 0; i < 10; ++i) {
             ESP_LOGI(TAG, "Activating... %d/%d", i + 1, 10);
-            esp_err_t err = ota_->Activate();
+            esp_err_t err = ota.Activate();
             if (err == ESP_OK) {
                 break;
             } else if (err == ESP_ERR_TIMEOUT) {
@@ -470,18 +786,20 @@ void Application::CheckNewVersion() {
 
 void Application::InitializeProtocol() {
     auto& board = Board::GetInstance();
-    auto display = board.GetDisplay();
     auto codec = board.GetAudioCodec();
 
-    display->SetStatus(Lang::Strings::LOADING_PROTOCOL);
+    display_queue_.SetStatus(Lang::Strings::LOADING_PROTOCOL);
 
-    if (ota_->HasMqttConfig()) {
-        protocol_ = std::make_unique<MqttProtocol>();
-    } else if (ota_->HasWebsocketConfig()) {
-        protocol_ = std::make_unique<WebsocketProtocol>();
-    } else {
-        ESP_LOGW(TAG, "No protocol specified in the OTA config, using MQTT");
-        protocol_ = std::make_unique<MqttProtocol>();
+    {
+        auto tx_lock = network_tx_.LockTransport();
+        if (ota_->HasMqttConfig()) {
+            protocol_ = std::make_unique<MqttProtocol>();
+        } else if (ota_->HasWebsocketConfig()) {
+            protocol_ = std::make_unique<WebsocketProtocol>();
+        } else {
+            ESP_LOGW(TAG, "No protocol specified in the OTA config, using MQTT");
+            protocol_ = std::make_unique<MqttProtocol>();
+        }
     }
 
     protocol_->OnConnected([this]() {
@@ -493,76 +811,103 @@ void Application::InitializeProtocol() {
         xEventGroupSetBits(event_group_, MAIN_EVENT_ERROR);
     });
     
-    protocol_->OnIncomingAudio([this](std::unique_ptr<AudioStreamPacket> packet) {
-        if (GetDeviceState() == kDeviceStateSpeaking) {
-            audio_service_.PushPacketToDecodeQueue(std::move(packet));
+    protocol_->OnIncomingAudio([this](AudioStreamPacketPtr packet) {
+        if (GetDeviceState() != kDeviceStateSpeaking || aborted_) {
+            return false;
+        }
+#if CONFIG_TTS_CACHE
+        // Recorded for the cache, or held behind a sentence played from it
+        if (TtsCache::GetInstance().HoldAudio(packet)) {
+            return true;
+        }
+#endif
+        auto& turn_timeline = TurnTimeline::GetInstance();
+        if (turn_timeline.awaiting_audio()) {
+            turn_timeline.OnIncomingAudio(packet->timestamp, protocol_->GetTransportStats().rtt_ms);
         }
+        return audio_service_.PushPacketToDecodeQueue(std::move(packet));
+    });
+
+    protocol_->OnTransportFeedback([this](const TransportFeedback& feedback) {
+        audio_service_.ReportTransportFeedback(feedback);
     });
     
     protocol_->OnAudioChannelOpened([this, codec, &board]() {
         board.SetPowerSaveLevel(PowerSaveLevel::PERFORMANCE);
-        if (protocol_->server_sample_rate() != codec->output_sample_rate()) {
+        network_tx_.ResetPacer();
+        auto type = board.GetBoardType();
+        audio_service_.SetCellularUplink(type == "ml307" || type == "nt26");
+        audio_service_.SetMediaMode(protocol_->media_stream());
+        audio_service_.SetNarrowbandAllowed(protocol_->narrowband());
+        if (protocol_->media_stream()) {
+            ESP_LOGI(TAG, "Media stream: %d Hz, %d channels, played at %d Hz mono", protocol_->server_sample_rate(),
+                protocol_->server_channels(), codec->output_sample_rate());
+        } else if (protocol_->server_sample_rate() != codec->output_sample_rate()) {
             ESP_LOGW(TAG, "Server sample rate %d does not match device output sample rate %d, resampling may cause distortion",
                 protocol_->server_sample_rate(), codec->output_sample_rate());
         }
     });
     
     protocol_->OnAudioChannelClosed([this, &board]() {
+        // The measured send time of each network, to compare the links
+        auto stats = protocol_->GetTransportStats();
+        ESP_LOGI(TAG, "Audio channel on %s: %lu packets sent, %lu failed, %lu us per send",
+            board.GetBoardType().c_str(), stats.tx_packets, stats.tx_failures, stats.send_time_us);
+        if (migrating_) {
+            return;
+        }
+        audio_service_.SetMediaMode(false);
         board.SetPowerSaveLevel(PowerSaveLevel::LOW_POWER);
         Schedule([this]() {
-            auto display = Board::GetInstance().GetDisplay();
-            display->SetChatMessage("system", "");
+            display_queue_.SetChatMessage("system", "");
+#if CONFIG_FOLLOW_UP_TURN
+            // Already idle if it waited for a follow-up
+            EndFollowUp();
+#endif
             SetDeviceState(kDeviceStateIdle);
         });
     });
     
-    protocol_->OnIncomingJson([this, display](const cJSON* root) {
+    protocol_->OnIncomingControl([this](const ControlMessage& message) {
+        HandleControlMessage(message);
+    });
+    protocol_->OnIncomingJson([this](const cJSON* root) {
+        // The server may have more to send, a sleeping modem would delay it
+        Board::GetInstance().OnNetworkTraffic();
         // Parse JSON data
         auto type = cJSON_GetObjectItem(root, "type");
+        ControlMessageType control_type = kControlMessageNone;
         if (strcmp(type->valuestring, "tts") == 0) {
+            control_type = kControlMessageTts;
+        } else if (strcmp(type->valuestring, "stt") == 0) {
+            control_type = kControlMessageStt;
+        } else if (strcmp(type->valuestring, "llm") == 0) {
+            control_type = kControlMessageLlm;
+        }
+        if (control_type != kControlMessageNone) {
+            // The same messages as the binary control ones, handled in one place
+            ControlMessage message;
+            message.type = control_type;
             auto state = cJSON_GetObjectItem(root, "state");
-            if (strcmp(state->valuestring, "start") == 0) {
-                Schedule([this]() {
-                    aborted_ = false;
-                    SetDeviceState(kDeviceStateSpeaking);
-                });
-            } else if (strcmp(state->valuestring, "stop") == 0) {
-                Schedule([this]() {
-                    if (GetDeviceState() == kDeviceStateSpeaking) {
-                        if (listening_mode_ == kListeningModeManualStop) {
-                            SetDeviceState(kDeviceStateIdle);
-                        } else {
-                            SetDeviceState(kDeviceStateListening);
-                        }
-                    }
-                });
-            } else if (strcmp(state->valuestring, "sentence_start") == 0) {
-                auto text = cJSON_GetObjectItem(root, "text");
-                if (cJSON_IsString(text)) {
-                    ESP_LOGI(TAG, "<< %s", text->valuestring);
-                    Schedule([display, message = std::string(text->valuestring)]() {
-                        display->SetChatMessage("assistant", message.c_str());
-                    });
-                }
+            if (cJSON_IsString(state)) {
+                message.state = ControlMessage::ParseState(state->valuestring);
             }
-        } else if (strcmp(type->valuestring, "stt") == 0) {
             auto text = cJSON_GetObjectItem(root, "text");
             if (cJSON_IsString(text)) {
-                ESP_LOGI(TAG, ">> %s", text->valuestring);
-                Schedule([display, message = std::string(text->valuestring)]() {
-                    display->SetChatMessage("user", message.c_str());
-                });
+                message.text = text->valuestring;
             }
-        } else if (strcmp(type->valuestring, "llm") == 0) {
             auto emotion = cJSON_GetObjectItem(root, "emotion");
             if (cJSON_IsString(emotion)) {
-                Schedule([display, emotion_str = std::string(emotion->valuestring)]() {
-                    display->SetEmotion(emotion_str.c_str());
-                });
+                message.emotion = emotion->valuestring;
+            }
+            auto hash = cJSON_GetObjectItem(root, "hash");
+            if (cJSON_IsString(hash)) {
+                message.hash = hash->valuestring;
             }
+            HandleControlMessage(message);
         } else if (strcmp(type->valuestring, "mcp") == 0) {
             auto payload = cJSON_GetObjectItem(root, "payload");
-            if (cJSON_IsObject(payload)) {
+            if (cJSON_IsObject(payload) || cJSON_IsArray(payload)) {
                 McpServer::GetInstance().ParseMessage(payload);
             }
         } else if (strcmp(type->valuestring, "system") == 0) {
@@ -590,11 +935,13 @@ void Application::InitializeProtocol() {
 #if CONFIG_RECEIVE_CUSTOM_MESSAGE
         } else if (strcmp(type->valuestring, "custom") == 0) {
             auto payload = cJSON_GetObjectItem(root, "payload");
-            ESP_LOGI(TAG, "Received custom message: %s", cJSON_PrintUnformatted(root));
             if (cJSON_IsObject(payload)) {
-                Schedule([this, display, payload_str = std::string(cJSON_PrintUnformatted(payload))]() {
-                    display->SetChatMessage("system", payload_str.c_str());
+                auto json_str = cJSON_PrintUnformatted(payload);
+                ESP_LOGI(TAG, "Received custom message: %s", json_str);
+                Schedule([this, payload_str = std::string(json_str)]() {
+                    display_queue_.SetChatMessage("system", payload_str.c_str());
                 });
+                cJSON_free(json_str);
             } else {
                 ESP_LOGW(TAG, "Invalid custom message format: missing payload");
             }
@@ -607,6 +954,80 @@ void Application::InitializeProtocol() {
     protocol_->Start();
 }
 
+/* tts, stt and llm messages, from JSON or from the binary control messages */
+void Application::HandleControlMessage(const ControlMessage& message) {
+    if (message.type == kControlMessageTts) {
+        if (message.state == kControlStateStart) {
+            TurnTimeline::GetInstance().Mark(kTurnEventTtsStart);
+            Schedule([this]() {
+                aborted_ = false;
+                tts_sentence_shown_ = false;
+                SetDeviceState(kDeviceStateSpeaking);
+            }, kSchedulePriorityUrgent);
+        } else if (message.state == kControlStateStop) {
+#if CONFIG_TTS_CACHE
+            TtsCache::GetInstance().EndSentence(true);
+#endif
+            Schedule([this]() {
+                if (GetDeviceState() == kDeviceStateSpeaking) {
+                    if (listening_mode_ == kListeningModeManualStop) {
+#if CONFIG_FOLLOW_UP_TURN
+                        follow_up_pending_ = true;
+#endif
+                        SetDeviceState(kDeviceStateIdle);
+                    } else {
+                        SetDeviceState(kDeviceStateListening);
+                    }
+                }
+            }, kSchedulePriorityUrgent);
+        } else if (message.state == kControlStateSentenceStart) {
+#if CONFIG_TTS_CACHE
+            // Here on the network task, so the audio that follows finds the sentence started
+            std::string hash(message.hash);
+            if (TtsCache::GetInstance().StartSentence(hash) && protocol_) {
+                network_tx_.Post([this, hash]() {
+                    if (protocol_) {
+                        protocol_->SendTtsCached(hash);
+                    }
+                });
+            }
+#endif
+            if (message.text.empty()) {
+                return;
+            }
+            std::string text(message.text);
+            ESP_LOGI(TAG, "<< %s", text.c_str());
+            Schedule([this, text = std::move(text)]() {
+                if (tts_sentence_shown_) {
+                    display_queue_.AppendChatMessage("assistant", text.c_str());
+                } else {
+                    display_queue_.SetChatMessage("assistant", text.c_str());
+                    tts_sentence_shown_ = true;
+                }
+            });
+        }
+    } else if (message.type == kControlMessageStt) {
+        TurnTimeline::GetInstance().Mark(kTurnEventStt);
+        if (!message.text.empty()) {
+            std::string text(message.text);
+            ESP_LOGI(TAG, ">> %s", text.c_str());
+            Schedule([this, text = std::move(text)]() {
+                display_queue_.SetChatMessage("user", text.c_str());
+            });
+        }
+    } else if (message.type == kControlMessageLlm) {
+        TurnTimeline::GetInstance().Mark(kTurnEventLlm);
+        if (!message.emotion.empty()) {
+            // Only the latest emotion matters if several are waiting
+            Schedule([this, emotion = std::string(message.emotion)]() {
+                display_queue_.SetEmotion(emotion.c_str());
+            }, kSchedulePriorityNormal, "emotion");
+        }
+    } else {
+        ESP_LOGW(TAG, "Unknown control message type: %u", message.type);
+    }
+}
+
 void Application::ShowActivationCode(const std::string& code, const std::string& message) {
     struct digit_sound {
         char digit;
@@ -639,10 +1060,9 @@ void Application::ShowActivationCode(const std::string& code, const std::string&
 
 void Application::Alert(const char* status, const char* message, const char* emotion, const std::string_view& sound) {
     ESP_LOGW(TAG, "Alert [%s] %s: %s", emotion, status, message);
-    auto display = Board::GetInstance().GetDisplay();
-    display->SetStatus(status);
-    display->SetEmotion(emotion);
-    display->SetChatMessage("system", message);
+    display_queue_.SetStatus(status);
+    display_queue_.SetEmotion(emotion);
+    display_queue_.SetChatMessage("system", message);
     if (!sound.empty()) {
         audio_service_.PlaySound(sound);
     }
@@ -650,10 +1070,9 @@ void Application::Alert(const char* status, const char* message, const char* emo
 
 void Application::DismissAlert() {
     if (GetDeviceState() == kDeviceStateIdle) {
-        auto display = Board::GetInstance().GetDisplay();
-        display->SetStatus(Lang::Strings::STANDBY);
-        display->SetEmotion("neutral");
-        display->SetChatMessage("system", "");
+        display_queue_.SetStatus(Lang::Strings::STANDBY);
+        display_queue_.SetEmotion("neutral");
+        display_queue_.SetChatMessage("system", "");
     }
 }
 
@@ -704,10 +1123,28 @@ void Application::HandleToggleChatEvent() {
     } else if (state == kDeviceStateSpeaking) {
         AbortSpeaking(kAbortReasonNone);
     } else if (state == kDeviceStateListening) {
-        protocol_->CloseAudioChannel();
+        CloseAudioChannel();
     }
 }
 
+bool Application::OpenAudioChannel() {
+    auto tx_lock = network_tx_.LockTransport();
+    return protocol_->OpenAudioChannel();
+}
+
+void Application::CloseAudioChannel(bool send_goodbye) {
+    auto tx_lock = network_tx_.LockTransport();
+    protocol_->CloseAudioChannel(send_goodbye);
+}
+
+void Application::PostStartListening() {
+    network_tx_.Post([this, mode = listening_mode_]() {
+        if (protocol_) {
+            protocol_->SendStartListening(mode);
+        }
+    });
+}
+
 void Application::ContinueOpenAudioChannel(ListeningMode mode) {
     // Check state again in case it was changed during scheduling
     if (GetDeviceState() != kDeviceStateConnecting) {
@@ -715,7 +1152,7 @@ void Application::ContinueOpenAudioChannel(ListeningMode mode) {
     }
 
     if (!protocol_->IsAudioChannelOpened()) {
-        if (!protocol_->OpenAudioChannel()) {
+        if (!OpenAudioChannel()) {
             return;
         }
     }
@@ -765,13 +1202,23 @@ void Application::HandleStopListeningEvent() {
         return;
     } else if (state == kDeviceStateListening) {
         if (protocol_) {
-            protocol_->SendStopListening();
+            TurnTimeline::GetInstance().Mark(kTurnEventStopListening);
+            network_tx_.Post([this]() {
+                if (protocol_) {
+                    protocol_->SendStopListening();
+                }
+            });
         }
         SetDeviceState(kDeviceStateIdle);
     }
 }
 
 void Application::HandleWakeWordDetectedEvent() {
+#if CONFIG_FAST_START
+    if (HoldBootWakeWord()) {
+        return;
+    }
+#endif
     if (!protocol_) {
         return;
     }
@@ -784,6 +1231,11 @@ void Application::HandleWakeWordDetectedEvent() {
 
         if (!protocol_->IsAudioChannelOpened()) {
             SetDeviceState(kDeviceStateConnecting);
+            // Capture the speech after the wake word while the channel opens, it is sent once listening
+            if (audio_service_.StartUplinkStaging()) {
+                audio_service_.EnableVoiceProcessing(true);
+                audio_service_.EnableWakeWordDetection(false);
+            }
             // Schedule to let the state change be processed first (UI update),
             // then continue with OpenAudioChannel which may block for ~1 second
             Schedule([this, wake_word]() {
@@ -801,6 +1253,80 @@ void Application::HandleWakeWordDetectedEvent() {
     }
 }
 
+#if CONFIG_FAST_START
+/* Before the protocol is up, the speech after the wake word is staged until the boot is done */
+bool Application::HoldBootWakeWord() {
+    auto state = GetDeviceState();
+    // The activation without a cached config may show a code, a wake word restarts its check
+    if (state != kDeviceStateStarting && !(state == kDeviceStateActivating && protocol_)) {
+        return false;
+    }
+    if (!boot_wake_word_.empty()) {
+        return true;
+    }
+    audio_service_.EncodeWakeWord();
+    boot_wake_word_ = audio_service_.GetLastWakeWord();
+    boot_wake_word_time_ms_ = esp_timer_get_time() / 1000;
+    ESP_LOGI(TAG, "Wake word %s detected during the boot, held until the protocol is up", boot_wake_word_.c_str());
+    audio_service_.EnableWakeWordDetection(false);
+    if (audio_service_.StartUplinkStaging()) {
+        audio_service_.EnableVoiceProcessing(true);
+    }
+    display_queue_.SetStatus(Lang::Strings::CONNECTING);
+    return true;
+}
+#endif
+
+#if CONFIG_FOLLOW_UP_TURN
+/* After a reply, the audio processor and the encoder keep running on the open channel for a while */
+bool Application::StartFollowUp() {
+    if (!protocol_ || !protocol_->IsAudioChannelOpened()) {
+        return false;
+    }
+    // Starting the audio processor resets the decoder, the tail of the reply plays out first
+    audio_service_.WaitForPlaybackQueueEmpty();
+    audio_service_.StartFollowUpStandby();
+    if (!audio_service_.IsAudioProcessorRunning()) {
+        audio_service_.EnableVoiceProcessing(true);
+    }
+    audio_service_.EnableWakeWordDetection(false);
+    follow_up_active_ = true;
+    follow_up_trigger_.Start(audio_service_.IsVoiceDetected());
+    ESP_LOGI(TAG, "Waiting %d s for a follow-up", CONFIG_FOLLOW_UP_WINDOW_S);
+    return true;
+}
+
+/* The user spoke again, the turn starts on the channel and the audio processor already running */
+void Application::ContinueFollowUp() {
+    if (!follow_up_active_ || GetDeviceState() != kDeviceStateIdle) {
+        return;
+    }
+    if (!protocol_ || !protocol_->IsAudioChannelOpened()) {
+        EndFollowUp();
+        return;
+    }
+    follow_up_active_ = false;
+    follow_up_trigger_.Stop();
+    static auto turns = PerfCounters::GetInstance().Counter("follow_up.turns");
+    turns->Add();
+    // The pre-roll waits in the staging buffer until the start listening message is sent on listening
+    audio_service_.StartUplinkStaging();
+    audio_service_.StopFollowUpStandby(true);
+    SetListeningMode(aec_mode_ == kAecOff ? kListeningModeAutoStop : kListeningModeRealtime);
+}
+
+void Application::EndFollowUp() {
+    if (!follow_up_active_) {
+        return;
+    }
+    follow_up_active_ = false;
+    follow_up_trigger_.Stop();
+    audio_service_.StopFollowUpStandby(false);
+    audio_service_.EnableVoiceProcessing(false);
+    audio_service_.EnableWakeWordDetection(true);
+}
+#endif
+
 void Application::ContinueWakeWordInvoke(const std::string& wake_word) {
     // Check state again in case it was changed during scheduling
     if (GetDeviceState() != kDeviceStateConnecting) {
@@ -808,7 +1334,10 @@ void Application::ContinueWakeWordInvoke(const std::string& wake_word) {
     }
 
     if (!protocol_->IsAudioChannelOpened()) {
-        if (!protocol_->OpenAudioChannel()) {
+        if (!OpenAudioChannel()) {
+            if (audio_service_.IsUplinkStaging()) {
+                audio_service_.EnableVoiceProcessing(false);
+            }
             audio_service_.EnableWakeWordDetection(true);
             return;
         }
@@ -818,10 +1347,14 @@ void Application::ContinueWakeWordInvoke(const std::string& wake_word) {
 #if CONFIG_SEND_WAKE_WORD_DATA
     // Encode and send the wake word data to the server
     while (auto packet = audio_service_.PopWakeWordPacket()) {
-        protocol_->SendAudio(std::move(packet));
+        network_tx_.SendAudio(std::move(packet));
     }
     // Set the chat state to wake word detected
-    protocol_->SendWakeWordDetected(wake_word);
+    network_tx_.Post([this, wake_word]() {
+        if (protocol_) {
+            protocol_->SendWakeWordDetected(wake_word);
+        }
+    });
     SetListeningMode(aec_mode_ == kAecOff ? kListeningModeAutoStop : kListeningModeRealtime);
 #else
     // Set flag to play popup sound after state changes to listening
@@ -834,29 +1367,57 @@ void Application::ContinueWakeWordInvoke(const std::string& wake_word) {
 void Application::HandleStateChangedEvent() {
     DeviceState new_state = state_machine_.GetState();
     clock_ticks_ = 0;
+#if CONFIG_FOLLOW_UP_TURN
+    bool follow_up = follow_up_pending_;
+    follow_up_pending_ = false;
+    // A button, the server or an error ended the wait, the new state starts its audio afresh
+    if (follow_up_active_ && new_state != kDeviceStateIdle) {
+        EndFollowUp();
+    }
+#endif
 
     auto& board = Board::GetInstance();
-    auto display = board.GetDisplay();
     auto led = board.GetLed();
     led->OnStateChanged();
+    // An idle screen only runs its slow animations
+    display_queue_.SetInteractive(new_state != kDeviceStateIdle && new_state != kDeviceStateUnknown
+        && new_state != kDeviceStateWifiConfiguring);
+#if CONFIG_LOCAL_ENDPOINT
+    // Only auto stop turns end on the device, and only if the server did not turn it off
+    if (new_state == kDeviceStateListening && listening_mode_ == kListeningModeAutoStop && protocol_ &&
+        protocol_->local_endpoint()) {
+        endpointer_.Start(audio_service_.IsVoiceDetected());
+    } else {
+        endpointer_.Stop();
+    }
+#endif
+    // The microphone streams the whole realtime conversation, its silences need not go out
+    audio_service_.EnableUplinkGate(listening_mode_ == kListeningModeRealtime &&
+        (new_state == kDeviceStateListening || new_state == kDeviceStateSpeaking));
     
     switch (new_state) {
         case kDeviceStateUnknown:
         case kDeviceStateIdle:
-            display->SetStatus(Lang::Strings::STANDBY);
-            display->ClearChatMessages();  // Clear messages first
-            display->SetEmotion("neutral"); // Then set emotion (wechat mode checks child count)
+            display_queue_.SetStatus(Lang::Strings::STANDBY);
+            display_queue_.ClearChatMessages();  // Clear messages first
+            display_queue_.SetEmotion("neutral"); // Then set emotion (wechat mode checks child count)
+#if CONFIG_FOLLOW_UP_TURN
+            if (follow_up && StartFollowUp()) {
+                break;
+            }
+#endif
             audio_service_.EnableVoiceProcessing(false);
             audio_service_.EnableWakeWordDetection(true);
             break;
         case kDeviceStateConnecting:
-            display->SetStatus(Lang::Strings::CONNECTING);
-            display->SetEmotion("neutral");
-            display->SetChatMessage("system", "");
+            display_queue_.SetStatus(Lang::Strings::CONNECTING);
+            display_queue_.SetEmotion("neutral");
+            display_queue_.SetChatMessage("system", "");
             break;
         case kDeviceStateListening:
-            display->SetStatus(Lang::Strings::LISTENING);
-            display->SetEmotion("neutral");
+            display_queue_.SetStatus(Lang::Strings::LISTENING);
+            display_queue_.SetEmotion("neutral");
+            TurnTimeline::GetInstance().Start();
 
             // Make sure the audio processor is running
             if (!audio_service_.IsAudioProcessorRunning()) {
@@ -867,10 +1428,18 @@ void Application::HandleStateChangedEvent() {
                 }
                 
                 // Send the start listening command
-                protocol_->SendStartListening(listening_mode_);
+                PostStartListening();
                 audio_service_.EnableVoiceProcessing(true);
                 audio_service_.EnableWakeWordDetection(false);
+            } else if (audio_service_.IsUplinkStaging()) {
+                // Voice processing started at the wake word, the staged speech follows the start listening message
+                PostStartListening();
+                audio_service_.StopUplinkStaging(true);
             }
+#if CONFIG_WAKE_WORD_BARGE_IN
+            // The wake word kept running while speaking in realtime mode
+            audio_service_.EnableWakeWordDetection(false);
+#endif
 
             // Play popup sound after ResetDecoder (in EnableVoiceProcessing) has been called
             if (play_popup_on_listening_) {
@@ -879,16 +1448,25 @@ void Application::HandleStateChangedEvent() {
             }
             break;
         case kDeviceStateSpeaking:
-            display->SetStatus(Lang::Strings::SPEAKING);
+            display_queue_.SetStatus(Lang::Strings::SPEAKING);
 
             if (listening_mode_ != kListeningModeRealtime) {
                 audio_service_.EnableVoiceProcessing(false);
                 // Only AFE wake word can be detected in speaking mode
                 audio_service_.EnableWakeWordDetection(audio_service_.IsAfeWakeWord());
             }
+#if CONFIG_WAKE_WORD_BARGE_IN
+            if (listening_mode_ == kListeningModeRealtime && audio_service_.IsSharedAfe()) {
+                // The wake word runs on the AEC output next to the encoder, to interrupt the reply locally
+                audio_service_.EnableWakeWordDetection(true);
+            }
+#endif
             audio_service_.ResetDecoder();
             break;
         case kDeviceStateWifiConfiguring:
+#if CONFIG_FAST_START
+            boot_wake_word_.clear();
+#endif
             audio_service_.EnableVoiceProcessing(false);
             audio_service_.EnableWakeWordDetection(false);
             break;
@@ -896,21 +1474,34 @@ void Application::HandleStateChangedEvent() {
             // Do nothing
             break;
     }
+
+#if CONFIG_AUDIO_WARM_OUTPUT
+    // Keep the speaker powered while the server may be talking
+    audio_service_.SetOutputWarm(new_state == kDeviceStateSpeaking ||
+        (new_state == kDeviceStateListening && listening_mode_ == kListeningModeRealtime));
+#endif
 }
 
-void Application::Schedule(std::function<void()>&& callback) {
-    {
-        std::lock_guard<std::mutex> lock(mutex_);
-        main_tasks_.push_back(std::move(callback));
-    }
+void Application::Schedule(MainTask&& callback, SchedulePriority priority, const char* coalesce_key,
+    const std::source_location& site) {
+    scheduler_.Push(std::move(callback), priority, coalesce_key, site);
     xEventGroupSetBits(event_group_, MAIN_EVENT_SCHEDULE);
 }
 
 void Application::AbortSpeaking(AbortReason reason) {
     ESP_LOGI(TAG, "Abort speaking");
     aborted_ = true;
+#if CONFIG_TTS_CACHE
+    TtsCache::GetInstance().EndSentence(false);
+#endif
+    // Stop at once instead of playing out the queued reply until the server stops
+    audio_service_.FlushPlayback(ABORT_SPEAKING_FADE_MS);
     if (protocol_) {
-        protocol_->SendAbortSpeaking(reason);
+        network_tx_.Post([this, reason]() {
+            if (protocol_) {
+                protocol_->SendAbortSpeaking(reason);
+            }
+        }, NetworkTx::kAhead);
     }
 }
 
@@ -923,27 +1514,26 @@ void Application::Reboot() {
     ESP_LOGI(TAG, "Rebooting...");
     // Disconnect the audio channel
     if (protocol_ && protocol_->IsAudioChannelOpened()) {
-        protocol_->CloseAudioChannel();
+        CloseAudioChannel();
+    }
+    {
+        auto tx_lock = network_tx_.LockTransport();
+        protocol_.reset();
     }
-    protocol_.reset();
     audio_service_.Stop();
 
     vTaskDelay(pdMS_TO_TICKS(1000));
     esp_restart();
 }
 
-bool Application::UpgradeFirmware(const std::string& url, const std::string& version) {
+bool Application::UpgradeFirmware(const std::string& url, const std::string& version, const std::string& patch_url) {
     auto& board = Board::GetInstance();
-    auto display = board.GetDisplay();
 
     std::string upgrade_url = url;
     std::string version_info = version.empty() ? "(Manual upgrade)" : version;
 
-    // Close audio channel if it's open
-    if (protocol_ && protocol_->IsAudioChannelOpened()) {
-        ESP_LOGI(TAG, "Closing audio channel before firmware upgrade");
-        protocol_->CloseAudioChannel();
-    }
+    // The channel stays open for the progress notifications, the audio stops below and the
+    // reboot closes the channel
     ESP_LOGI(TAG, "Starting firmware upgrade from URL: %s", upgrade_url.c_str());
 
     Alert(Lang::Strings::OTA_UPGRADE, Lang::Strings::UPGRADING, "download", Lang::Sounds::OGG_UPGRADE);
@@ -952,19 +1542,34 @@ bool Application::UpgradeFirmware(const std::string& url, const std::string& ver
     SetDeviceState(kDeviceStateUpgrading);
 
     std::string message = std::string(Lang::Strings::NEW_VERSION) + version_info;
-    display->SetChatMessage("system", message.c_str());
+    display_queue_.SetChatMessage("system", message.c_str());
 
     board.SetPowerSaveLevel(PowerSaveLevel::PERFORMANCE);
     audio_service_.Stop();
     vTaskDelay(pdMS_TO_TICKS(1000));
 
-    bool upgrade_success = Ota::Upgrade(upgrade_url, [this, display](int progress, size_t speed) {
+    auto progress_callback = [this](int progress, size_t speed) {
         char buffer[32];
         snprintf(buffer, sizeof(buffer), "%d%% %uKB/s", progress, speed / 1024);
-        Schedule([display, message = std::string(buffer)]() {
-            display->SetChatMessage("system", message.c_str());
-        });
-    });
+        // For the client that called the upgrade_firmware tool
+        if (protocol_) {
+            McpServer::NotifyLog("ota", buffer);
+        }
+        Schedule([this, message = std::string(buffer)]() {
+            display_queue_.SetChatMessage("system", message.c_str());
+        }, kSchedulePriorityBackground, "progress");
+    };
+    // A patch that is not for the running firmware fails before anything is written
+    bool upgrade_success = false;
+    if (!patch_url.empty()) {
+        upgrade_success = Ota::Upgrade(patch_url, progress_callback);
+        if (!upgrade_success) {
+            ESP_LOGW(TAG, "Failed to upgrade with the patch, downloading the full firmware");
+        }
+    }
+    if (!upgrade_success) {
+        upgrade_success = Ota::Upgrade(upgrade_url, progress_callback);
+    }
 
     if (!upgrade_success) {
         // Upgrade failed, restart audio service and continue running
@@ -977,13 +1582,47 @@ bool Application::UpgradeFirmware(const std::string& url, const std::string& ver
     } else {
         // Upgrade success, reboot immediately
         ESP_LOGI(TAG, "Firmware upgrade successful, rebooting...");
-        display->SetChatMessage("system", "Upgrade successful, rebooting...");
+        display_queue_.SetChatMessage("system", "Upgrade successful, rebooting...");
         vTaskDelay(pdMS_TO_TICKS(1000)); // Brief pause to show message
         Reboot();
         return true;
     }
 }
 
+#if CONFIG_OTA_BACKGROUND_UPGRADE
+bool Application::UpgradeFirmwareInBackground(const std::string& url, const std::string& version, const std::string& patch_url) {
+    ESP_LOGI(TAG, "Downloading firmware %s in the background", version.c_str());
+    // The voice goes first, the download holds through a conversation
+    auto paused = [this]() {
+        return GetDeviceState() != kDeviceStateIdle || (protocol_ && protocol_->IsAudioChannelOpened());
+    };
+    size_t max_speed = CONFIG_OTA_BACKGROUND_MAX_KBPS * 1024;
+
+    UBaseType_t priority = uxTaskPriorityGet(NULL);
+    vTaskPrioritySet(NULL, tskIDLE_PRIORITY + 1);
+    bool upgrade_success = false;
+    if (!patch_url.empty()) {
+        upgrade_success = Ota::Upgrade(patch_url, nullptr, max_speed, paused);
+        if (!upgrade_success) {
+            ESP_LOGW(TAG, "Failed to upgrade with the patch, downloading the full firmware");
+        }
+    }
+    if (!upgrade_success) {
+        upgrade_success = Ota::Upgrade(url, nullptr, max_speed, paused);
+    }
+    vTaskPrioritySet(NULL, priority);
+
+    if (!upgrade_success) {
+        ESP_LOGE(TAG, "Background firmware upgrade failed, it is tried again on the next boot");
+        return false;
+    }
+    ESP_LOGI(TAG, "Firmware %s is ready, rebooting once the device is idle for %d seconds",
+        version.c_str(), CONFIG_OTA_BACKGROUND_REBOOT_IDLE_S);
+    upgrade_reboot_pending_ = true;
+    return true;
+}
+#endif
+
 void Application::WakeWordInvoke(const std::string& wake_word) {
     if (!protocol_) {
         return;
@@ -1007,11 +1646,11 @@ void Application::WakeWordInvoke(const std::string& wake_word) {
     } else if (state == kDeviceStateSpeaking) {
         Schedule([this]() {
             AbortSpeaking(kAbortReasonNone);
-        });
+        }, kSchedulePriorityUrgent);
     } else if (state == kDeviceStateListening) {   
         Schedule([this]() {
             if (protocol_) {
-                protocol_->CloseAudioChannel();
+                CloseAudioChannel();
             }
         });
     }
@@ -1034,53 +1673,95 @@ bool Application::CanEnterSleepMode() {
     return true;
 }
 
-void Application::SendMcpMessage(const std::string& payload) {
-    // Always schedule to run in main task for thread safety
-    Schedule([this, payload = std::move(payload)]() {
+void Application::SendMcpMessage(std::string payload) {
+    // Always schedule to run in main task for thread safety, the network tx task sends it in order
+    Schedule([this, payload = std::move(payload)]() mutable {
+        network_tx_.Post([this, payload = std::move(payload)]() {
+            if (protocol_) {
+                protocol_->SendMcpMessage(payload);
+            }
+        });
+    });
+}
+
+void Application::PostMcpMessage(std::string payload) {
+    network_tx_.Post([this, payload = std::move(payload)]() {
         if (protocol_) {
             protocol_->SendMcpMessage(payload);
         }
     });
 }
 
+bool Application::SendMcpBlob(uint32_t blob_id, uint32_t offset, std::string data, bool final) {
+    if (!CanSendMcpBlobs()) {
+        return false;
+    }
+    size_t size = data.size();
+    mcp_blob_pending_ += size;
+    // Ordered with the MCP messages, the reply that refers to the blob follows its frames
+    Schedule([this, blob_id, offset, data = std::move(data), final, size]() mutable {
+        bool queued = network_tx_.Post([this, blob_id, offset, data = std::move(data), final, size]() {
+            if (protocol_ && !protocol_->SendBlobFrame(blob_id, offset, data, final)) {
+                ESP_LOGW(TAG, "Failed to send blob %lu at %lu", blob_id, offset);
+            }
+            mcp_blob_pending_ -= size;
+        });
+        if (!queued) {
+            ESP_LOGW(TAG, "Failed to queue blob %lu at %lu", blob_id, offset);
+            mcp_blob_pending_ -= size;
+        }
+    });
+    return true;
+}
+
+void Application::SetMcpChunkSize(size_t size) {
+    // Ordered with the messages sent by the main task
+    Schedule([this, size]() {
+        network_tx_.Post([this, size]() {
+            if (protocol_) {
+                protocol_->SetMcpChunkSize(size);
+            }
+        });
+    });
+}
+
 void Application::SetAecMode(AecMode mode) {
     aec_mode_ = mode;
     Schedule([this]() {
-        auto& board = Board::GetInstance();
-        auto display = board.GetDisplay();
         switch (aec_mode_) {
         case kAecOff:
             audio_service_.EnableDeviceAec(false);
-            display->ShowNotification(Lang::Strings::RTC_MODE_OFF);
+            display_queue_.ShowNotification(Lang::Strings::RTC_MODE_OFF);
             break;
         case kAecOnServerSide:
             audio_service_.EnableDeviceAec(false);
-            display->ShowNotification(Lang::Strings::RTC_MODE_ON);
+            display_queue_.ShowNotification(Lang::Strings::RTC_MODE_ON);
             break;
         case kAecOnDeviceSide:
             audio_service_.EnableDeviceAec(true);
-            display->ShowNotification(Lang::Strings::RTC_MODE_ON);
+            display_queue_.ShowNotification(Lang::Strings::RTC_MODE_ON);
             break;
         }
 
         // If the AEC mode is changed, close the audio channel
         if (protocol_ && protocol_->IsAudioChannelOpened()) {
-            protocol_->CloseAudioChannel();
+            CloseAudioChannel();
         }
     });
 }
 
-void Application::PlaySound(const std::string_view& sound) {
-    audio_service_.PlaySound(sound);
+void Application::PlaySound(const std::string_view& sound, SoundPriority priority) {
+    audio_service_.PlaySound(sound, priority);
 }
 
 void Application::ResetProtocol() {
     Schedule([this]() {
         // Close audio channel if opened
         if (protocol_ && protocol_->IsAudioChannelOpened()) {
-            protocol_->CloseAudioChannel();
+            CloseAudioChannel();
         }
         // Reset protocol
+        auto tx_lock = network_tx_.LockTransport();
         protocol_.reset();
     });
 }
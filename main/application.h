@@ -10,12 +10,19 @@
 #include <mutex>
 #include <deque>
 #include <memory>
+#include <atomic>
 
 #include "protocol.h"
 #include "ota.h"
 #include "audio_service.h"
 #include "device_state.h"
 #include "device_state_machine.h"
+#include "main_scheduler.h"
+#include "main_loop_monitor.h"
+#include "display_queue.h"
+#include "network_tx.h"
+#include "endpointer.h"
+#include "follow_up_trigger.h"
 
 // Main event bits
 #define MAIN_EVENT_SCHEDULE             (1 << 0)
@@ -31,6 +38,8 @@
 #define MAIN_EVENT_START_LISTENING      (1 << 10)
 #define MAIN_EVENT_STOP_LISTENING       (1 << 11)
 #define MAIN_EVENT_STATE_CHANGED        (1 << 12)
+// Not handled by Run(), stays set once the boot preparation is done
+#define MAIN_EVENT_BOOT_PREPARED        (1 << 13)
 
 
 enum AecMode {
@@ -74,8 +83,12 @@ public:
 
     /**
      * Schedule a callback to be executed in the main task
+     * Callbacks scheduled from the same task run in order, whatever their priority
+     * A callback with a coalescing key replaces the last queued one if it has the same key
+     * The caller's source location names the callback in the main loop timings
      */
-    void Schedule(std::function<void()>&& callback);
+    void Schedule(MainTask&& callback, SchedulePriority priority = kSchedulePriorityNormal, const char* coalesce_key = nullptr,
+        const std::source_location& site = std::source_location::current());
 
     /**
      * Alert with status, message, emotion and optional sound
@@ -105,13 +118,27 @@ public:
 
     void Reboot();
     void WakeWordInvoke(const std::string& wake_word);
-    bool UpgradeFirmware(const std::string& url, const std::string& version = "");
+    bool UpgradeFirmware(const std::string& url, const std::string& version = "", const std::string& patch_url = "");
     bool CanEnterSleepMode();
-    void SendMcpMessage(const std::string& payload);
+    void SendMcpMessage(std::string payload);
+    // Posted to the network tx right away, for the work that keeps the main task busy
+    void PostMcpMessage(std::string payload);
+    // A part of a binary MCP blob, false if the protocol does not take blob frames
+    bool SendMcpBlob(uint32_t blob_id, uint32_t offset, std::string data, bool final);
+    bool CanSendMcpBlobs() { return protocol_ && protocol_->blob_frames(); }
+    // The blob bytes queued for the main task
+    size_t mcp_blob_pending() const { return mcp_blob_pending_.load(std::memory_order_relaxed); }
+    // The MCP chunk size the client negotiated, 0 to send messages whole
+    void SetMcpChunkSize(size_t size);
     void SetAecMode(AecMode mode);
     AecMode GetAecMode() const { return aec_mode_; }
-    void PlaySound(const std::string_view& sound);
+    void PlaySound(const std::string_view& sound, SoundPriority priority = kSoundPriorityNormal);
     AudioService& GetAudioService() { return audio_service_; }
+    DisplayQueue& GetDisplayQueue() { return display_queue_; }
+    NetworkTx& GetNetworkTx() { return network_tx_; }
+    // Statistics of the current audio channel, all zero without a protocol
+    TransportStats GetTransportStats() { return protocol_ ? protocol_->GetTransportStats() : TransportStats(); }
+    MainLoopMonitor& GetMainLoopMonitor() { return main_loop_monitor_; }
     
     /**
      * Reset protocol resources (thread-safe)
@@ -124,24 +151,47 @@ private:
     Application();
     ~Application();
 
-    std::mutex mutex_;
-    std::deque<std::function<void()>> main_tasks_;
+    MainScheduler scheduler_;
+    MainLoopMonitor main_loop_monitor_;
     std::unique_ptr<Protocol> protocol_;
     EventGroupHandle_t event_group_ = nullptr;
-    esp_timer_handle_t clock_timer_handle_ = nullptr;
+    int clock_job_ = -1;
+    std::atomic<int> pending_clock_ticks_ = 0;
     DeviceStateMachine state_machine_;
     ListeningMode listening_mode_ = kListeningModeAutoStop;
     AecMode aec_mode_ = kAecOff;
     std::string last_error_message_;
     AudioService audio_service_;
+    DisplayQueue display_queue_;
+    NetworkTx network_tx_;
     std::unique_ptr<Ota> ota_;
 
     bool has_server_time_ = false;
-    bool aborted_ = false;
+    std::atomic<size_t> mcp_blob_pending_ = 0;
+    std::atomic<bool> aborted_ = false;    // Drops the rest of the reply, read by the protocol task
+    bool tts_sentence_shown_ = false;   // The sentences after the first of a reply grow its bubble
     bool assets_version_checked_ = false;
+    bool assets_prepared_ = false;     // Applied by PrepareTask() instead of CheckAssetsVersion()
+    bool assets_pending_ = false;      // A download of new assets is pending from the last boot
     bool play_popup_on_listening_ = false;  // Flag to play popup sound after state changes to listening
+    bool migrating_ = false;    // The audio channel is closed to move it to another network
+#if CONFIG_OTA_BACKGROUND_UPGRADE
+    std::atomic<bool> upgrade_reboot_pending_ = false;   // A firmware downloaded in the background waits for an idle moment
+#endif
+#if CONFIG_FAST_START
+    std::string boot_wake_word_;    // Heard before the protocol was up, invoked once the boot is done
+    int64_t boot_wake_word_time_ms_ = 0;
+#endif
     int clock_ticks_ = 0;
     TaskHandle_t activation_task_handle_ = nullptr;
+#if CONFIG_LOCAL_ENDPOINT
+    Endpointer endpointer_{CONFIG_LOCAL_ENDPOINT_HANGOVER_MS, CONFIG_LOCAL_ENDPOINT_MIN_SPEECH_MS};
+#endif
+#if CONFIG_FOLLOW_UP_TURN
+    FollowUpTrigger follow_up_trigger_{CONFIG_FOLLOW_UP_MIN_SPEECH_MS};
+    bool follow_up_pending_ = false;    // The reply ended, the idle that follows waits for a follow-up
+    bool follow_up_active_ = false;     // Idle with the audio processor and the channel kept warm
+#endif
 
 
     // Event handlers
@@ -151,19 +201,39 @@ private:
     void HandleStopListeningEvent();
     void HandleNetworkConnectedEvent();
     void HandleNetworkDisconnectedEvent();
+    void HandleNetworkSwitchedEvent();
     void HandleActivationDoneEvent();
     void HandleWakeWordDetectedEvent();
+    // The protocol is opened and closed under the transport lock of the network tx task
+    bool OpenAudioChannel();
+    void CloseAudioChannel(bool send_goodbye = true);
+    void PostStartListening();
     void ContinueOpenAudioChannel(ListeningMode mode);
     void ContinueWakeWordInvoke(const std::string& wake_word);
+#if CONFIG_FAST_START
+    bool HoldBootWakeWord();
+#endif
+#if CONFIG_FOLLOW_UP_TURN
+    bool StartFollowUp();
+    void ContinueFollowUp();
+    // Back to the plain idle, the wake word listens again
+    void EndFollowUp();
+#endif
 
     // Activation task (runs in background)
     void ActivationTask();
+    void PrepareTask();
 
     // Helper methods
     void CheckAssetsVersion();
-    void CheckNewVersion();
+#if CONFIG_OTA_BACKGROUND_UPGRADE
+    bool UpgradeFirmwareInBackground(const std::string& url, const std::string& version, const std::string& patch_url);
+#endif
+    // In the background, with the protocol running on the cached config, nothing is shown
+    void CheckNewVersion(Ota& ota, bool background);
     void InitializeProtocol();
     void ShowActivationCode(const std::string& code, const std::string& message);
+    void HandleControlMessage(const ControlMessage& message);
     void SetListeningMode(ListeningMode mode);
     
     // State change handler called by state machine
@@ -1,5 +1,10 @@
 #include "assets.h"
 #include "board.h"
+#include "boot_timeline.h"
+#include "settings.h"
+#include "partition_writer.h"
+#include "patch_decoder.h"
+#include "resumable_download.h"
 #include "display.h"
 #include "application.h"
 #include "lvgl_theme.h"
@@ -7,6 +12,11 @@
 #include "expression_emote.h"
 #if HAVE_LVGL
 #include "display/lcd_display.h"
+#include "gif/gif_frame_cache.h"
+#include "gif/gifdec.h"
+#include "glyph_cache.h"
+#include "asset_image_cache.h"
+#include "assets/lang_config.h"
 #include <spi_flash_mmap.h>
 #endif
 
@@ -14,10 +24,20 @@
 #include <esp_timer.h>
 #include <esp_heap_caps.h>
 #include <cbin_font.h>
+#include <cstring>
+#include <algorithm>
 
 
 #define TAG "Assets"
 #define PARTITION_LABEL "assets"
+// The optional second slot, the assets are downloaded to the slot not in use
+#define PARTITION_B_LABEL "assets_b"
+#define ACTIVE_SLOT_KEY "slot"
+// The image checked in full last, so the boot after it skips the check
+#define VERIFIED_CHECKSUM_KEY "verified_sum"
+#define VERIFIED_LENGTH_KEY "verified_len"
+#define VERIFY_CHUNK_SIZE (64 * 1024)
+#define STAGING_READ_SIZE 4096
 
 struct mmap_assets_table {
     char asset_name[32];          /*!< Name of the asset */
@@ -42,16 +62,135 @@ Assets::~Assets() {
 }
 
 bool Assets::FindPartition(Assets* assets) {
-    assets->partition_ = esp_partition_find_first(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, PARTITION_LABEL);
-    if (assets->partition_ == nullptr) {
+    auto slot_a = esp_partition_find_first(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, PARTITION_LABEL);
+    auto slot_b = esp_partition_find_first(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, PARTITION_B_LABEL);
+    if (slot_a == nullptr) {
         ESP_LOGI(TAG, "No assets partition found");
+        assets->partition_ = nullptr;
+        assets->staging_partition_ = nullptr;
         return false;
     }
+    if (slot_b == nullptr) {
+        assets->partition_ = slot_a;
+        assets->staging_partition_ = nullptr;
+        return true;
+    }
+
+    Settings settings("assets", false);
+    bool use_b = settings.GetInt(ACTIVE_SLOT_KEY, 0) == 1;
+    assets->partition_ = use_b ? slot_b : slot_a;
+    assets->staging_partition_ = use_b ? slot_a : slot_b;
     return true;
 }
 
+bool Assets::VerifyPartition(const esp_partition_t* partition, uint32_t& checksum, uint32_t& length) {
+    uint32_t header[3];
+    if (esp_partition_read(partition, 0, header, sizeof(header)) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read the header of %s", partition->label);
+        return false;
+    }
+    uint32_t stored_files = header[0];
+    checksum = header[1];
+    length = header[2];
+    if (length > partition->size - 12 || stored_files > length / sizeof(mmap_assets_table)) {
+        ESP_LOGE(TAG, "The header of %s is not valid", partition->label);
+        return false;
+    }
+
+    auto buffer = (char*)heap_caps_malloc(STAGING_READ_SIZE, MALLOC_CAP_8BIT);
+    if (buffer == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the verify buffer");
+        return false;
+    }
+    auto start_time = esp_timer_get_time();
+    uint32_t calculated_checksum = 0;
+    bool read_ok = true;
+    for (uint32_t offset = 0; offset < length && read_ok; offset += STAGING_READ_SIZE) {
+        uint32_t chunk = std::min<uint32_t>(STAGING_READ_SIZE, length - offset);
+        read_ok = esp_partition_read(partition, 12 + offset, buffer, chunk) == ESP_OK;
+        // The same sum as the mapped image is checked with
+        for (uint32_t i = 0; i < chunk && read_ok; i++) {
+            calculated_checksum += buffer[i];
+        }
+    }
+    heap_caps_free(buffer);
+    calculated_checksum &= 0xFFFF;
+    if (!read_ok || calculated_checksum != checksum) {
+        ESP_LOGE(TAG, "The calculated checksum (0x%lx) of %s does not match the stored checksum (0x%lx)",
+            calculated_checksum, partition->label, checksum);
+        return false;
+    }
+    ESP_LOGI(TAG, "The assets in %s are verified in %d ms", partition->label, int((esp_timer_get_time() - start_time) / 1000));
+    return true;
+}
+
+#if HAVE_LVGL && CONFIG_GIF_DECODE_BENCHMARK
+// Decodes and renders one loop of the GIF, as LvglGif does when nothing is cached
+static void BenchmarkGif(const char* name, const void* data) {
+    gd_GIF* gif = gd_open_gif_data(data);
+    if (gif == nullptr) {
+        return;
+    }
+    int frames = 0;
+    int64_t start_us = esp_timer_get_time();
+    while (true) {
+        uint32_t position = gif->f_rw_p;
+        int result = gd_get_frame(gif);
+        if (result <= 0 || (gif->f_rw_p < position && frames > 0)) {
+            break;
+        }
+        gd_render_frame(gif, gif->canvas);
+        frames++;
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start_us;
+    ESP_LOGI(TAG, "GIF %s %dx%d: %d frames, %.2f ms/frame", name, gif->width, gif->height, frames,
+        frames > 0 ? elapsed_us / 1000.0 / frames : 0.0);
+    gd_close_gif(gif);
+}
+#endif
+
 bool Assets::Apply() {
-    return strategy_ ? strategy_->Apply(this) : false;
+    if (!strategy_) {
+        return false;
+    }
+    if (!staged_) {
+        return strategy_->Apply(this);
+    }
+
+    // Nothing is drawn from the assets before until the new ones are in the themes
+    auto start_time = esp_timer_get_time();
+    DisplayLockGuard lock(Board::GetInstance().GetDisplay());
+    if (!SwitchPartition()) {
+        // The assets before are mapped again, at an address of their own
+        strategy_->Apply(this);
+        return false;
+    }
+    int switch_ms = int((esp_timer_get_time() - start_time) / 1000);
+    bool success = strategy_->Apply(this);
+    ESP_LOGI(TAG, "Switched to the assets in %s in %d ms, applied in %d ms", partition_->label, switch_ms,
+        int((esp_timer_get_time() - start_time) / 1000));
+    return success;
+}
+
+bool Assets::SwitchPartition() {
+    staged_ = false;
+    // The slots trade places once the partition is found again
+    auto previous = partition_;
+    auto next = staging_partition_;
+    UnApplyPartition();
+    Settings settings("assets", true);
+    settings.SetInt(ACTIVE_SLOT_KEY, strcmp(next->label, PARTITION_B_LABEL) == 0 ? 1 : 0);
+    if (InitializePartition()) {
+        return true;
+    }
+
+    // The staged image was verified, but the old one is still there to go back to
+    ESP_LOGE(TAG, "Failed to initialize the assets in %s, going back to %s", next->label, previous->label);
+    settings.SetInt(ACTIVE_SLOT_KEY, strcmp(previous->label, PARTITION_B_LABEL) == 0 ? 1 : 0);
+    settings.EraseKey(VERIFIED_CHECKSUM_KEY);
+    settings.EraseKey(VERIFIED_LENGTH_KEY);
+    InitializePartition();
+    return false;
 }
 
 bool Assets::InitializePartition() {
@@ -68,6 +207,12 @@ bool Assets::GetAssetData(const std::string& name, void*& ptr, size_t& size) {
     return strategy_ ? strategy_->GetAssetData(this, name, ptr, size) : false;
 }
 
+void Assets::ReleaseAssetData(const void* ptr) {
+    if (strategy_) {
+        strategy_->ReleaseAssetData(this, ptr);
+    }
+}
+
 bool Assets::LoadSrmodelsFromIndex(Assets* assets, cJSON* root) {
     void* ptr = nullptr;
     size_t size = 0;
@@ -81,6 +226,7 @@ bool Assets::LoadSrmodelsFromIndex(Assets* assets, cJSON* root) {
         }
 
         root = cJSON_ParseWithLength(static_cast<char*>(ptr), size);
+        assets->ReleaseAssetData(ptr);
         if (root == nullptr) {
             ESP_LOGE(TAG, "The index.json file is not valid");
             return false;
@@ -88,18 +234,20 @@ bool Assets::LoadSrmodelsFromIndex(Assets* assets, cJSON* root) {
         need_delete_root = true;
     }
 
+    cJSON* speaker_dsp = cJSON_GetObjectItem(root, "speaker_dsp");
+    if (speaker_dsp != nullptr) {
+        Application::GetInstance().GetAudioService().ConfigureSpeakerDsp(speaker_dsp);
+    }
+
     cJSON* srmodels = cJSON_GetObjectItem(root, "srmodels");
     if (cJSON_IsString(srmodels)) {
         std::string srmodels_file = srmodels->valuestring;
         if (assets->GetAssetData(srmodels_file, ptr, size)) {
-            if (assets->models_list_ != nullptr) {
-                esp_srmodel_deinit(assets->models_list_);
-                assets->models_list_ = nullptr;
-            }
-            assets->models_list_ = srmodel_load(static_cast<uint8_t*>(ptr));
-            if (assets->models_list_ != nullptr) {
+            // The audio service owns the list, and frees the old one once the new models took over
+            auto models_list = srmodel_load(static_cast<uint8_t*>(ptr));
+            if (models_list != nullptr) {
                 auto& app = Application::GetInstance();
-                app.GetAudioService().SetModelsList(assets->models_list_);
+                app.GetAudioService().SetModelsList(models_list);
                 if (need_delete_root) {
                     cJSON_Delete(root);
                 }
@@ -127,30 +275,69 @@ uint32_t Assets::LvglStrategy::CalculateChecksum(const char* data, uint32_t leng
     return checksum & 0xFFFF;
 }
 
+bool Assets::LvglStrategy::CalculateChecksum(const esp_partition_t* partition, uint32_t offset, uint32_t length, uint32_t& checksum) {
+    auto buffer = (char*)heap_caps_malloc(STAGING_READ_SIZE, MALLOC_CAP_8BIT);
+    if (buffer == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the checksum buffer");
+        return false;
+    }
+    uint32_t sum = 0;
+    bool read_ok = true;
+    for (uint32_t i = 0; i < length && read_ok; i += STAGING_READ_SIZE) {
+        uint32_t chunk = std::min<uint32_t>(STAGING_READ_SIZE, length - i);
+        read_ok = esp_partition_read(partition, offset + i, buffer, chunk) == ESP_OK;
+        for (uint32_t j = 0; j < chunk && read_ok; j++) {
+            sum += buffer[j];
+        }
+    }
+    heap_caps_free(buffer);
+    checksum = sum & 0xFFFF;
+    return read_ok;
+}
+
 bool Assets::LvglStrategy::InitializePartition(Assets* assets) {
     assets->partition_valid_ = false;
-    assets_.clear();
+    table_ = nullptr;
+    table_size_ = 0;
 
     if (!Assets::FindPartition(assets)) {
         return false;
     }
+    partition_ = assets->partition_;
 
     int free_pages = spi_flash_mmap_get_free_pages(SPI_FLASH_MMAP_DATA);
-    uint32_t storage_size = free_pages * 64 * 1024;
+    uint32_t storage_size = free_pages * SPI_FLASH_MMU_PAGE_SIZE;
     ESP_LOGI(TAG, "The storage free size is %ld KB", storage_size / 1024);
-    ESP_LOGI(TAG, "The partition size is %ld KB", assets->partition_->size / 1024);
-    if (storage_size < assets->partition_->size) {
-        ESP_LOGE(TAG, "The free size %ld KB is less than assets partition required %ld KB", storage_size / 1024, assets->partition_->size / 1024);
-        return false;
+    ESP_LOGI(TAG, "The partition size is %ld KB", partition_->size / 1024);
+
+    // A partition larger than the free pages keeps only its header and table mapped, the assets
+    // are mapped in windows of their own when they are first asked for
+    windowed_ = storage_size < partition_->size;
+    mmap_length_ = partition_->size;
+    if (windowed_) {
+        uint32_t header[3];
+        if (esp_partition_read(partition_, 0, header, sizeof(header)) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to read the header of %s", partition_->label);
+            return false;
+        }
+        uint64_t index_length = 12 + (uint64_t)header[0] * sizeof(mmap_assets_table);
+        if (index_length > partition_->size) {
+            ESP_LOGE(TAG, "The stored_files (%lu) do not fit the partition", header[0]);
+            return false;
+        }
+        mmap_length_ = index_length;
+        ESP_LOGW(TAG, "The free size %ld KB is less than the assets partition %ld KB, mapping the assets in windows",
+            storage_size / 1024, partition_->size / 1024);
     }
 
-    esp_err_t err = esp_partition_mmap(assets->partition_, 0, assets->partition_->size, ESP_PARTITION_MMAP_DATA, (const void**)&mmap_root_, &mmap_handle_);
+    esp_err_t err = esp_partition_mmap(partition_, 0, mmap_length_, ESP_PARTITION_MMAP_DATA, (const void**)&mmap_root_, &mmap_handle_);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Failed to mmap assets partition: %s", esp_err_to_name(err));
         return false;
     }
 
     assets->partition_valid_ = true;
+    BootTimeline::Mark("assets_mapped");
 
     uint32_t stored_files = *(uint32_t*)(mmap_root_ + 0);
     uint32_t stored_chksum = *(uint32_t*)(mmap_root_ + 4);
@@ -161,53 +348,274 @@ bool Assets::LvglStrategy::InitializePartition(Assets* assets) {
         return false;
     }
 
-    auto start_time = esp_timer_get_time();
-    uint32_t calculated_checksum = CalculateChecksum(mmap_root_ + 12, stored_len);
-    auto end_time = esp_timer_get_time();
-    ESP_LOGI(TAG, "The checksum calculation time is %d ms", int((end_time - start_time) / 1000));
-
-    if (calculated_checksum != stored_chksum) {
-        ESP_LOGE(TAG, "The calculated checksum (0x%lx) does not match the stored checksum (0x%lx)", calculated_checksum, stored_chksum);
+    if (stored_files > stored_len / sizeof(mmap_assets_table)) {
+        ESP_LOGE(TAG, "The stored_files (%lu) do not fit the stored_len (0x%lx)", stored_files, stored_len);
         return false;
     }
 
+    // An image checked in full at a previous boot is checked again in the background
+    Settings settings("assets", false);
+    bool verified = settings.GetInt(VERIFIED_CHECKSUM_KEY, -1) == (int32_t)stored_chksum
+        && settings.GetInt(VERIFIED_LENGTH_KEY, -1) == (int32_t)stored_len;
+    if (verified) {
+        ESP_LOGI(TAG, "The checksum was verified before, checking it again in the background");
+        StartVerifyTask(stored_chksum, stored_len);
+    } else {
+        auto start_time = esp_timer_get_time();
+        uint32_t calculated_checksum = 0;
+        if (!windowed_) {
+            calculated_checksum = CalculateChecksum(mmap_root_ + 12, stored_len);
+        } else if (!CalculateChecksum(partition_, 12, stored_len, calculated_checksum)) {
+            ESP_LOGE(TAG, "Failed to read the assets partition");
+            return false;
+        }
+        auto end_time = esp_timer_get_time();
+        ESP_LOGI(TAG, "The checksum calculation time is %d ms", int((end_time - start_time) / 1000));
+
+        if (calculated_checksum != stored_chksum) {
+            ESP_LOGE(TAG, "The calculated checksum (0x%lx) does not match the stored checksum (0x%lx)", calculated_checksum, stored_chksum);
+            return false;
+        }
+
+        Settings writable("assets", true);
+        writable.SetInt(VERIFIED_CHECKSUM_KEY, stored_chksum);
+        writable.SetInt(VERIFIED_LENGTH_KEY, stored_len);
+    }
+
     checksum_valid_ = true;
+    data_length_ = stored_len;
+    BootTimeline::Mark("assets_checked");
 
-    for (uint32_t i = 0; i < stored_files; i++) {
-        auto item = (const mmap_assets_table*)(mmap_root_ + 12 + i * sizeof(mmap_assets_table));
-        auto asset = Asset{
-            .size = static_cast<size_t>(item->asset_size),
-            .offset = static_cast<size_t>(12 + sizeof(mmap_assets_table) * stored_files + item->asset_offset)
-        };
-        assets_[item->asset_name] = asset;
+    // The assets are looked up in the mmapped table itself
+    table_ = (const mmap_assets_table*)(mmap_root_ + 12);
+    table_size_ = stored_files;
+    table_sorted_ = true;
+    for (uint32_t i = 1; i < table_size_ && table_sorted_; i++) {
+        table_sorted_ = strncmp(table_[i - 1].asset_name, table_[i].asset_name, sizeof(table_[i].asset_name)) < 0;
+    }
+    if (!table_sorted_) {
+        ESP_LOGW(TAG, "The assets are not sorted by name, repack them for a faster lookup");
     }
     return checksum_valid_;
 }
 
+void Assets::LvglStrategy::StartVerifyTask(uint32_t checksum, uint32_t length) {
+    StopVerifyTask();
+    verify_cancel_ = false;
+    verifying_ = true;
+    struct Args {
+        LvglStrategy* strategy;
+        uint32_t checksum;
+        uint32_t length;
+    };
+    auto args = new Args{this, checksum, length};
+    if (xTaskCreate([](void* arg) {
+        auto args = static_cast<Args*>(arg);
+        args->strategy->VerifyTask(args->checksum, args->length);
+        args->strategy->verifying_ = false;
+        delete args;
+        vTaskDelete(NULL);
+    }, "assets_verify", 2048, args, tskIDLE_PRIORITY + 1, nullptr) != pdPASS) {
+        ESP_LOGW(TAG, "Failed to create the assets verify task");
+        verifying_ = false;
+        delete args;
+    }
+}
+
+void Assets::LvglStrategy::StopVerifyTask() {
+    verify_cancel_ = true;
+    while (verifying_) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+}
+
+void Assets::LvglStrategy::VerifyTask(uint32_t checksum, uint32_t length) {
+    auto start_time = esp_timer_get_time();
+    uint32_t calculated_checksum = 0;
+    for (uint32_t offset = 0; offset < length; offset += VERIFY_CHUNK_SIZE) {
+        if (verify_cancel_) {
+            return;
+        }
+        // The sum is kept to 16 bits, so the chunks add up to the sum of the whole image
+        uint32_t chunk = std::min<uint32_t>(VERIFY_CHUNK_SIZE, length - offset);
+        if (!windowed_) {
+            calculated_checksum += CalculateChecksum(mmap_root_ + 12 + offset, chunk);
+        } else {
+            // Read without a window, the pages stay for the assets
+            uint32_t chunk_checksum = 0;
+            if (!CalculateChecksum(partition_, 12 + offset, chunk, chunk_checksum)) {
+                ESP_LOGW(TAG, "Failed to read the assets partition, the background check stops");
+                return;
+            }
+            calculated_checksum += chunk_checksum;
+        }
+        vTaskDelay(1);
+    }
+    calculated_checksum &= 0xFFFF;
+    if (calculated_checksum == checksum) {
+        ESP_LOGI(TAG, "The checksum is verified in the background in %d ms", int((esp_timer_get_time() - start_time) / 1000));
+        return;
+    }
+    // The assets in use stay, the next boot checks the image in full and rejects it
+    ESP_LOGE(TAG, "The calculated checksum (0x%lx) does not match the stored checksum (0x%lx)", calculated_checksum, checksum);
+    Settings settings("assets", true);
+    settings.EraseKey(VERIFIED_CHECKSUM_KEY);
+    settings.EraseKey(VERIFIED_LENGTH_KEY);
+}
+
+// Compares a name in the table, which is not terminated at the full length, to a name
+static int CompareAssetName(const char (&asset_name)[32], const std::string& name) {
+    int result = strncmp(asset_name, name.c_str(), sizeof(asset_name));
+    if (result == 0 && name.size() > sizeof(asset_name)) {
+        return -1;
+    }
+    return result;
+}
+
+const mmap_assets_table* Assets::LvglStrategy::FindAsset(const std::string& name) const {
+    if (!table_sorted_) {
+        for (uint32_t i = 0; i < table_size_; i++) {
+            if (CompareAssetName(table_[i].asset_name, name) == 0) {
+                return &table_[i];
+            }
+        }
+        return nullptr;
+    }
+    uint32_t low = 0, high = table_size_;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        int result = CompareAssetName(table_[middle].asset_name, name);
+        if (result == 0) {
+            return &table_[middle];
+        }
+        if (result < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return nullptr;
+}
+
+const char* Assets::LvglStrategy::MapRange(uint32_t offset, uint32_t length) {
+    if (offset + length <= mmap_length_) {
+        return mmap_root_ + offset;
+    }
+
+    std::lock_guard<std::mutex> lock(windows_mutex_);
+    for (auto it = windows_.begin(); it != windows_.end(); ++it) {
+        if (offset >= it->offset && offset + length <= it->offset + it->length) {
+            windows_.splice(windows_.begin(), windows_, it);
+            it->users++;
+            return it->data + (offset - it->offset);
+        }
+    }
+
+    // Whole MMU pages of the flash, so the assets next to it are found in the same window
+    uint32_t address = partition_->address;
+    uint32_t start = (address + offset) & ~(SPI_FLASH_MMU_PAGE_SIZE - 1);
+    uint32_t end = (address + offset + length + SPI_FLASH_MMU_PAGE_SIZE - 1) & ~(SPI_FLASH_MMU_PAGE_SIZE - 1);
+    int pages = (end - start) / SPI_FLASH_MMU_PAGE_SIZE;
+    start = std::max(start, address) - address;
+    end = std::min(end, address + partition_->size) - address;
+
+    // The windows nobody holds go first, the least recently used of them first
+    while (spi_flash_mmap_get_free_pages(SPI_FLASH_MMAP_DATA) < pages) {
+        auto victim = std::find_if(windows_.rbegin(), windows_.rend(), [](const MapWindow& window) {
+            return window.users == 0;
+        });
+        if (victim == windows_.rend()) {
+            break;
+        }
+        esp_partition_munmap(victim->handle);
+        windows_.erase(std::next(victim).base());
+        window_evictions_++;
+    }
+
+    MapWindow window = {
+        .offset = start,
+        .length = end - start,
+        .data = nullptr,
+        .handle = 0,
+        .users = 1,
+    };
+    esp_err_t err = esp_partition_mmap(partition_, window.offset, window.length, ESP_PARTITION_MMAP_DATA,
+        (const void**)&window.data, &window.handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to map %lu KB of the assets at 0x%lx: %s, %u windows mapped",
+            window.length / 1024, window.offset, esp_err_to_name(err), windows_.size());
+        return nullptr;
+    }
+    windows_.push_front(window);
+    ESP_LOGD(TAG, "Mapped %lu KB of the assets at 0x%lx, %u windows, %lu evicted",
+        window.length / 1024, window.offset, windows_.size(), window_evictions_);
+    return window.data + (offset - window.offset);
+}
+
+void Assets::LvglStrategy::ReleaseAssetData(Assets* assets, const void* ptr) {
+    (void)assets; // Unused parameter
+    auto data = static_cast<const char*>(ptr);
+    std::lock_guard<std::mutex> lock(windows_mutex_);
+    for (auto& window : windows_) {
+        if (data >= window.data && data < window.data + window.length) {
+            if (window.users > 0) {
+                window.users--;
+            }
+            return;
+        }
+    }
+}
+
+void Assets::LvglStrategy::UnmapWindows() {
+    std::lock_guard<std::mutex> lock(windows_mutex_);
+    for (auto& window : windows_) {
+        esp_partition_munmap(window.handle);
+    }
+    windows_.clear();
+    window_evictions_ = 0;
+}
+
 void Assets::LvglStrategy::UnApplyPartition(Assets* assets) {
+    // The verify task reads the mapped partition
+    StopVerifyTask();
+    UnmapWindows();
     if (mmap_handle_ != 0) {
         esp_partition_munmap(mmap_handle_);
         mmap_handle_ = 0;
         mmap_root_ = nullptr;
     }
+    mmap_length_ = 0;
+    windowed_ = false;
     checksum_valid_ = false;
-    assets_.clear();
+    table_ = nullptr;
+    table_size_ = 0;
+    data_length_ = 0;
     (void)assets; // Unused parameter
 }
 
 bool Assets::LvglStrategy::GetAssetData(Assets* assets, const std::string& name, void*& ptr, size_t& size) {
-    auto asset = assets_.find(name);
-    if (asset == assets_.end()) {
+    auto asset = FindAsset(name);
+    if (asset == nullptr) {
+        return false;
+    }
+    // The data follows the table, an image not checked yet may point anywhere
+    uint32_t data_offset = sizeof(mmap_assets_table) * table_size_ + asset->asset_offset;
+    if (asset->asset_offset > data_length_ || asset->asset_size > data_length_ || data_offset + 2 + asset->asset_size > data_length_) {
+        ESP_LOGE(TAG, "The asset %s is out of the image", name.c_str());
+        return false;
+    }
+    auto data = MapRange(12 + data_offset, 2 + asset->asset_size);
+    if (data == nullptr) {
         return false;
     }
-    auto data = (const char*)(mmap_root_ + asset->second.offset);
     if (data[0] != 'Z' || data[1] != 'Z') {
         ESP_LOGE(TAG, "The asset %s is not valid with magic %02x%02x", name.c_str(), data[0], data[1]);
+        ReleaseAssetData(assets, data);
         return false;
     }
 
     ptr = static_cast<void*>(const_cast<char*>(data + 2));
-    size = asset->second.size;
+    size = asset->asset_size;
     return true;
 }
 
@@ -220,6 +628,8 @@ bool Assets::LvglStrategy::Apply(Assets* assets) {
     }
 
     cJSON* root = cJSON_ParseWithLength(static_cast<char*>(ptr), size);
+    // The parsed copy is used from here on
+    assets->ReleaseAssetData(ptr);
     if (root == nullptr) {
         ESP_LOGE(TAG, "The index.json file is not valid");
         return false;
@@ -248,6 +658,16 @@ bool Assets::LvglStrategy::Apply(Assets* assets) {
                 ESP_LOGE(TAG, "Failed to load fonts.bin");
                 return false;
             }
+#if CONFIG_CBIN_FONT_GLYPH_CACHE_PREWARM
+            GlyphCache::GetInstance().Prewarm(text_font->font(), Lang::GLYPHS);
+#endif
+            // The glyphs out of a subset font, parsed when a text first needs one of them
+            cJSON* fallback = cJSON_GetObjectItem(root, "text_font_fallback");
+            void* fallback_ptr = nullptr;
+            size_t fallback_size = 0;
+            if (cJSON_IsString(fallback) && assets->GetAssetData(fallback->valuestring, fallback_ptr, fallback_size)) {
+                text_font->SetFallback(std::make_shared<LvglLazyCBinFont>(fallback_ptr, text_font->font()));
+            }
             if (light_theme != nullptr) {
                 light_theme->set_text_font(text_font);
             }
@@ -259,9 +679,20 @@ bool Assets::LvglStrategy::Apply(Assets* assets) {
         }
     }
 
+    {
+        // The QOI, JPEG and PNG emoji and backgrounds are decoded when they are first drawn
+        DisplayLockGuard lock(Board::GetInstance().GetDisplay());
+        AssetImageCache::GetInstance().Register();
+    }
+    // The pixels decoded so far belong to the images of the assets before
+    AssetImageCache::GetInstance().Clear();
+
     cJSON* emoji_collection = cJSON_GetObjectItem(root, "emoji_collection");
     if (cJSON_IsArray(emoji_collection)) {
+        // The frames decoded so far belong to the GIFs of the assets before
+        GifFrameCache::GetInstance().Clear();
         auto custom_emoji_collection = std::make_shared<EmojiCollection>();
+        std::vector<const void*> gifs;
         int emoji_count = cJSON_GetArraySize(emoji_collection);
         for (int i = 0; i < emoji_count; i++) {
             cJSON* emoji = cJSON_GetArrayItem(emoji_collection, i);
@@ -274,7 +705,22 @@ bool Assets::LvglStrategy::Apply(Assets* assets) {
                         ESP_LOGE(TAG, "Emoji %s image file %s is not found", name->valuestring, file->valuestring);
                         continue;
                     }
-                    custom_emoji_collection->AddEmoji(name->valuestring, new LvglRawImage(ptr, size));
+                    auto image = new LvglRawImage(ptr, size);
+                    if (image->IsGif()) {
+                        gifs.push_back(image->image_dsc()->data);
+#if CONFIG_GIF_DECODE_BENCHMARK
+                        BenchmarkGif(name->valuestring, image->image_dsc()->data);
+#endif
+                    }
+                    custom_emoji_collection->AddEmoji(name->valuestring, image);
+                }
+            }
+        }
+        // A small set is decoded now, so the emotions do not decode while they loop
+        if (!gifs.empty() && gifs.size() <= GIF_PRERENDER_MAX_COUNT) {
+            for (auto gif : gifs) {
+                if (!GifFrameCache::GetInstance().Prerender(gif)) {
+                    break;
                 }
             }
         }
@@ -305,7 +751,12 @@ bool Assets::LvglStrategy::Apply(Assets* assets) {
                     ESP_LOGE(TAG, "The background image file %s is not found", background_image->valuestring);
                     return false;
                 }
-                auto background_image = std::make_shared<LvglCBinImage>(ptr);
+                std::shared_ptr<LvglImage> background_image;
+                if (AssetImageCache::IsCompressed(ptr, size)) {
+                    background_image = std::make_shared<LvglRawImage>(ptr, size);
+                } else {
+                    background_image = std::make_shared<LvglCBinImage>(ptr);
+                }
                 light_theme->set_background_image(background_image);
             }
         }
@@ -326,7 +777,12 @@ bool Assets::LvglStrategy::Apply(Assets* assets) {
                     ESP_LOGE(TAG, "The background image file %s is not found", background_image->valuestring);
                     return false;
                 }
-                auto background_image = std::make_shared<LvglCBinImage>(ptr);
+                std::shared_ptr<LvglImage> background_image;
+                if (AssetImageCache::IsCompressed(ptr, size)) {
+                    background_image = std::make_shared<LvglRawImage>(ptr, size);
+                } else {
+                    background_image = std::make_shared<LvglCBinImage>(ptr);
+                }
                 dark_theme->set_background_image(background_image);
             }
         }
@@ -370,7 +826,7 @@ bool Assets::EmoteStrategy::InitializePartition(Assets* assets) {
         const emote_data_t data = {
             .type = EMOTE_SOURCE_PARTITION,
             .source = {
-                .partition_label = PARTITION_LABEL,
+                .partition_label = assets->partition_->label,
             },
             .flags = {
                 .mmap_enable = true, //must be true here!!!
@@ -425,131 +881,67 @@ bool Assets::EmoteStrategy::Apply(Assets* assets) {
 
 bool Assets::Download(std::string url, std::function<void(int progress, size_t speed)> progress_callback) {
     ESP_LOGI(TAG, "Downloading new version of assets from %s", url.c_str());
-
-    // 取消当前资源分区的内存映射
-    UnApplyPartition();
-
-    // 下载新的资源文件
-    auto network = Board::GetInstance().GetNetwork();
-    auto http = network->CreateHttp(0);
-    
-    if (!http->Open("GET", url)) {
-        ESP_LOGE(TAG, "Failed to open HTTP connection");
+    if (partition_ == nullptr) {
         return false;
     }
 
-    if (http->GetStatusCode() != 200) {
-        ESP_LOGE(TAG, "Failed to get assets, status code: %d", http->GetStatusCode());
-        return false;
+    // 有第二个槽时写入未使用的槽，当前资源在下载期间保持可用
+    auto target = staging_partition_;
+    staged_ = false;
+    if (target == nullptr) {
+        // 取消当前资源分区的内存映射
+        UnApplyPartition();
+
+        // 新写入的资源在重新初始化时完整校验一次
+        Settings settings("assets", true);
+        settings.EraseKey(VERIFIED_CHECKSUM_KEY);
+        settings.EraseKey(VERIFIED_LENGTH_KEY);
+        target = partition_;
     }
 
-    size_t content_length = http->GetBodyLength();
-    if (content_length == 0) {
-        ESP_LOGE(TAG, "Failed to get content length");
+    // 由写入任务擦除和写入扇区，同时本任务从网络读取下一个扇区
+    PartitionWriter writer(target);
+    if (!writer.valid()) {
+        ESP_LOGE(TAG, "Failed to create the partition writer");
         return false;
     }
 
-    if (content_length > partition_->size) {
-        ESP_LOGE(TAG, "Assets file size (%u) is larger than partition size (%lu)", content_length, partition_->size);
-        return false;
+    // 下载的可以是资源文件本身，也可以是针对已安装资源的补丁
+    uint8_t installed[PATCH_BASE_ID_SIZE] = {};
+    if (esp_partition_read(partition_, 0, installed, sizeof(installed)) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to read the installed assets header");
     }
+    PatchDecoder decoder(writer, partition_, installed, target == partition_);
 
-    // 定义扇区大小为4KB（ESP32的标准扇区大小）
-    const size_t SECTOR_SIZE = esp_partition_get_main_flash_sector_size();
-    
-    // 计算需要擦除的扇区数量
-    size_t sectors_to_erase = (content_length + SECTOR_SIZE - 1) / SECTOR_SIZE; // 向上取整
-    size_t total_erase_size = sectors_to_erase * SECTOR_SIZE;
-    
-    ESP_LOGI(TAG, "Sector size: %u, content length: %u, sectors to erase: %u, total erase size: %u", 
-             SECTOR_SIZE, content_length, sectors_to_erase, total_erase_size);
-    
-    // 写入新的资源文件到分区，一边erase一边写入
-    char* buffer = (char*)heap_caps_malloc(SECTOR_SIZE, MALLOC_CAP_INTERNAL);
-    if (buffer == nullptr) {
-        ESP_LOGE(TAG, "Failed to allocate buffer");
+    ResumableDownload download(url, writer.sector_size());
+    download.SetMaxLength(target->size);
+    bool success = download.Run([&decoder](const char* data, size_t length) {
+        return decoder.Write(data, length);
+    }, [&decoder]() {
+        return decoder.Reset();
+    }, progress_callback);
+
+    // 等待写入任务写完最后的扇区
+    if (!success || !decoder.Finish() || !writer.Flush()) {
+        ESP_LOGE(TAG, "Failed to write the assets partition");
         return false;
     }
-    size_t total_written = 0;
-    size_t recent_written = 0;
-    size_t current_sector = 0;
-    auto last_calc_time = esp_timer_get_time();
-    
-    while (true) {
-        int ret = http->Read(buffer, SECTOR_SIZE);
-        if (ret < 0) {
-            ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
-            heap_caps_free(buffer);
-            return false;
-        }
-
-        if (ret == 0) {
-            break;
-        }
 
-        // 检查是否需要擦除新的扇区
-        size_t write_end_offset = total_written + ret;
-        size_t needed_sectors = (write_end_offset + SECTOR_SIZE - 1) / SECTOR_SIZE;
-        
-        // 擦除需要的新扇区
-        while (current_sector < needed_sectors) {
-            size_t sector_start = current_sector * SECTOR_SIZE;
-            size_t sector_end = (current_sector + 1) * SECTOR_SIZE;
-            
-            // 确保擦除范围不超过分区大小
-            if (sector_end > partition_->size) {
-                ESP_LOGE(TAG, "Sector end (%u) exceeds partition size (%lu)", sector_end, partition_->size);
-                heap_caps_free(buffer);
-                return false;
-            }
-            
-            ESP_LOGD(TAG, "Erasing sector %u (offset: %u, size: %u)", current_sector, sector_start, SECTOR_SIZE);
-            esp_err_t err = esp_partition_erase_range(partition_, sector_start, SECTOR_SIZE);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to erase sector %u at offset %u: %s", current_sector, sector_start, esp_err_to_name(err));
-                heap_caps_free(buffer);
-                return false;
-            }
-            
-            current_sector++;
-        }
+    ESP_LOGI(TAG, "Assets download completed, total downloaded: %u bytes", download.content_length());
 
-        // 写入数据到分区
-        esp_err_t err = esp_partition_write(partition_, total_written, buffer, ret);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to write to assets partition at offset %u: %s", total_written, esp_err_to_name(err));
-            heap_caps_free(buffer);
+    if (target != partition_) {
+        // 校验通过后记为已校验，切换时不必再完整校验
+        uint32_t checksum = 0, length = 0;
+        if (!VerifyPartition(target, checksum, length)) {
             return false;
         }
-
-        total_written += ret;
-        recent_written += ret;
-
-        // 计算进度和速度
-        if (esp_timer_get_time() - last_calc_time >= 1000000 || total_written == content_length || ret == 0) {
-            size_t progress = total_written * 100 / content_length;
-            size_t speed = recent_written; // 每秒的字节数
-            ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %u B/s, Sectors erased: %u", 
-                     progress, total_written, content_length, speed, current_sector);
-            if (progress_callback) {
-                progress_callback(progress, speed);
-            }
-            last_calc_time = esp_timer_get_time();
-            recent_written = 0; // 重置最近写入的字节数
-        }
-    }
-    
-    http->Close();
-    heap_caps_free(buffer);
-
-    if (total_written != content_length) {
-        ESP_LOGE(TAG, "Downloaded size (%u) does not match expected size (%u)", total_written, content_length);
-        return false;
+        Settings settings("assets", true);
+        settings.SetInt(VERIFIED_CHECKSUM_KEY, checksum);
+        settings.SetInt(VERIFIED_LENGTH_KEY, length);
+        staged_ = true;
+        return true;
     }
 
-    ESP_LOGI(TAG, "Assets download completed, total written: %u bytes, total sectors erased: %u", 
-             total_written, current_sector);
-
     // 重新初始化资源分区
     if (!InitializePartition()) {
         ESP_LOGE(TAG, "Failed to re-initialize assets partition");
@@ -10,15 +10,17 @@
 #include <model_path.h>
 #include <map>
 #include <string>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
 #if HAVE_LVGL
 #include <spi_flash_mmap.h>
 #endif
 
-struct Asset {
-    size_t size;
-    size_t offset;
-};
+struct mmap_assets_table;
 
 class Assets {
 public:
@@ -28,11 +30,17 @@ public:
     }
     ~Assets();
 
+    // With a second slot the assets in use stay while the new ones are downloaded to the other
+    // slot and verified, Apply() then switches to them
     bool Download(std::string url, std::function<void(int progress, size_t speed)> progress_callback);
     bool Apply();
     bool GetAssetData(const std::string& name, void*& ptr, size_t& size);
+    // For data only read once, e.g. index.json. The data of a pack larger than the MMU can map
+    // at once stays mapped until it is released or the assets are switched
+    void ReleaseAssetData(const void* ptr);
 
     inline bool partition_valid() const { return partition_valid_; }
+    inline bool double_buffered() const { return staging_partition_ != nullptr; }
     inline std::string default_assets_url() const { return default_assets_url_; }
 
 private:
@@ -43,6 +51,9 @@ private:
     bool InitializePartition();
     void UnApplyPartition();
     static bool FindPartition(Assets* assets);
+    // Checks the image of a partition that is not mapped, e.g. the one just downloaded
+    static bool VerifyPartition(const esp_partition_t* partition, uint32_t& checksum, uint32_t& length);
+    bool SwitchPartition();
     static bool LoadSrmodelsFromIndex(Assets* assets, cJSON* root = nullptr);
   
     class AssetStrategy {
@@ -52,6 +63,7 @@ private:
         virtual bool InitializePartition(Assets* assets) = 0;
         virtual void UnApplyPartition(Assets* assets) = 0;
         virtual bool GetAssetData(Assets* assets, const std::string& name, void*& ptr, size_t& size) = 0;
+        virtual void ReleaseAssetData(Assets* assets, const void* ptr) { (void)assets; (void)ptr; }
     };
     
     class LvglStrategy : public AssetStrategy {
@@ -60,12 +72,44 @@ private:
         bool InitializePartition(Assets* assets) override;
         void UnApplyPartition(Assets* assets) override;
         bool GetAssetData(Assets* assets, const std::string& name, void*& ptr, size_t& size) override;
+        void ReleaseAssetData(Assets* assets, const void* ptr) override;
     private:
+        // A part of the partition mapped on its own, when the whole partition does not fit the free MMU pages
+        struct MapWindow {
+            uint32_t offset;
+            uint32_t length;
+            const char* data;
+            esp_partition_mmap_handle_t handle;
+            int users;      // The assets handed out of it and not released, it is only unmapped at 0
+        };
         static uint32_t CalculateChecksum(const char* data, uint32_t length);
-        std::map<std::string, Asset> assets_;
+        // The same sum, read from the flash without mapping it
+        static bool CalculateChecksum(const esp_partition_t* partition, uint32_t offset, uint32_t length, uint32_t& checksum);
+        // Returns the partition at offset, mapping a window for it if the range is not mapped yet
+        const char* MapRange(uint32_t offset, uint32_t length);
+        void UnmapWindows();
+        const mmap_assets_table* FindAsset(const std::string& name) const;
+        // Checks the image verified at a previous boot again at a low priority
+        void StartVerifyTask(uint32_t checksum, uint32_t length);
+        void StopVerifyTask();
+        void VerifyTask(uint32_t checksum, uint32_t length);
+        // The table of the mmapped partition, sorted by name unless the assets were packed before the names were
+        const mmap_assets_table* table_ = nullptr;
+        uint32_t table_size_ = 0;
+        bool table_sorted_ = false;
+        const esp_partition_t* partition_ = nullptr;
+        // The whole partition, or only the header and the table with windowed_
         esp_partition_mmap_handle_t mmap_handle_ = 0;
         const char* mmap_root_ = nullptr;
+        uint32_t mmap_length_ = 0;
+        bool windowed_ = false;
+        std::mutex windows_mutex_;
+        std::list<MapWindow> windows_;     // The most recently used first
+        uint32_t window_evictions_ = 0;
+        uint32_t data_length_ = 0;
         bool checksum_valid_ = false;
+        std::atomic<bool> verifying_{false};
+        std::atomic<bool> verify_cancel_{false};
     };
     
     class EmoteStrategy : public AssetStrategy {
@@ -81,9 +125,11 @@ private:
 
 protected:
     const esp_partition_t* partition_ = nullptr;
+    // The other slot, nullptr without one
+    const esp_partition_t* staging_partition_ = nullptr;
+    bool staged_ = false;      // The staging partition holds verified assets not applied yet
     bool partition_valid_ = false;
     std::string default_assets_url_;
-    srmodel_list_t* models_list_ = nullptr;
 };
 
 #endif
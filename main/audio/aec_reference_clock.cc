@@ -0,0 +1,87 @@
+#include "aec_reference_clock.h"
+
+#include <esp_timer.h>
+#include <algorithm>
+
+void AecReferenceClock::OnOutput(uint32_t timestamp_ms, size_t samples, int sample_rate) {
+    if (samples == 0 || sample_rate <= 0) {
+        return;
+    }
+    int64_t now_us = esp_timer_get_time();
+    int64_t duration_us = (int64_t)samples * 1000000 / sample_rate;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    // A chunk plays right after the one before it, unless the DMA ran dry in between
+    int64_t start_us = output_end_us_ >= now_us ? output_end_us_ : now_us;
+    // Never later than the DMA can hold, in case the codec clock runs a little fast
+    start_us = std::min(start_us, now_us + std::max<int64_t>(output_latency_us_ - duration_us, 0));
+    output_end_us_ = start_us + duration_us;
+
+    if (timestamp_ms == 0) {
+        return;
+    }
+    // Extend the last segment when the stream simply goes on
+    if (segment_count_ > 0) {
+        auto& last = segments_[(segment_next_ + kMaxSegments - 1) % kMaxSegments];
+        uint32_t expected_ms = last.timestamp_ms + (uint32_t)((last.end_us - last.start_us) / 1000);
+        if (last.end_us == start_us && (uint32_t)(timestamp_ms - expected_ms + 1) <= 2) {
+            last.end_us = output_end_us_;
+            return;
+        }
+    }
+    segments_[segment_next_] = {start_us, output_end_us_, timestamp_ms};
+    segment_next_ = (segment_next_ + 1) % kMaxSegments;
+    segment_count_ = std::min(segment_count_ + 1, kMaxSegments);
+}
+
+uint32_t AecReferenceClock::GetPlayingTimestamp(int64_t time_us) {
+    for (size_t i = 1; i <= segment_count_; i++) {
+        auto& segment = segments_[(segment_next_ + kMaxSegments - i) % kMaxSegments];
+        if (time_us >= segment.end_us) {
+            // Segments are in play order, so nothing older covers the time either
+            return 0;
+        }
+        if (time_us >= segment.start_us) {
+            return segment.timestamp_ms + (uint32_t)((time_us - segment.start_us) / 1000);
+        }
+    }
+    return 0;
+}
+
+void AecReferenceClock::MarkCapture(size_t frames, int64_t time_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    captured_frames_ += frames;
+    size_t index = (capture_head_ + capture_count_) % kMaxCaptureMarks;
+    if (capture_count_ == kMaxCaptureMarks) {
+        // The processor fell far behind, forget the oldest capture
+        capture_head_ = (capture_head_ + 1) % kMaxCaptureMarks;
+    } else {
+        capture_count_++;
+    }
+    capture_marks_[index] = {captured_frames_, time_us};
+}
+
+uint32_t AecReferenceClock::TakeCapture(size_t frames) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t first_frame = processed_frames_;
+    processed_frames_ += frames;
+    // The first frame was captured in the first mark that ends after it
+    while (capture_count_ > 0) {
+        auto& mark = capture_marks_[capture_head_];
+        if (mark.end_frame > first_frame) {
+            int64_t time_us = mark.end_time_us - (int64_t)(mark.end_frame - first_frame) * 1000000 / kCaptureSampleRate;
+            return GetPlayingTimestamp(time_us);
+        }
+        capture_head_ = (capture_head_ + 1) % kMaxCaptureMarks;
+        capture_count_--;
+    }
+    return 0;
+}
+
+void AecReferenceClock::ResetCapture() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capture_head_ = 0;
+    capture_count_ = 0;
+    captured_frames_ = 0;
+    processed_frames_ = 0;
+}
@@ -0,0 +1,68 @@
+#ifndef AEC_REFERENCE_CLOCK_H
+#define AEC_REFERENCE_CLOCK_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+/*
+ * Echo reference for server-side AEC, enabled with CONFIG_USE_SERVER_AEC.
+ *
+ * The output side tells the clock every chunk it writes to the codec. Consecutive chunks
+ * play back to back, so the time a chunk reaches the speaker follows from the sample
+ * count of the chunks before it, and the clock keeps a short timeline of which server
+ * timestamp was playing when.
+ *
+ * The input side marks the time each block of mic audio was captured, and when the
+ * audio processor outputs a frame, TakeCapture() returns the server timestamp that was
+ * playing when its first sample was captured, to the millisecond. Nothing is queued per
+ * frame, so a late or dropped frame on either side does not shift the frames after it.
+ */
+class AecReferenceClock {
+public:
+    static constexpr int kCaptureSampleRate = 16000;
+
+    // Audio queued in the output DMA once a write returns
+    void SetOutputLatency(int64_t latency_us) { output_latency_us_ = latency_us; }
+    int64_t output_latency_us() const { return output_latency_us_; }
+
+    // Output side: samples at sample_rate were written, timestamp_ms is 0 for local audio
+    void OnOutput(uint32_t timestamp_ms, size_t samples, int sample_rate);
+
+    // Input side: frames of 16kHz audio were captured by time_us
+    void MarkCapture(size_t frames, int64_t time_us);
+    // Returns the timestamp playing when the first of the next frames was captured, 0 for none
+    uint32_t TakeCapture(size_t frames);
+    void ResetCapture();
+
+private:
+    struct Segment {
+        int64_t start_us;
+        int64_t end_us;
+        uint32_t timestamp_ms;
+    };
+    struct CaptureMark {
+        uint64_t end_frame;
+        int64_t end_time_us;
+    };
+    static constexpr size_t kMaxSegments = 32;
+    static constexpr size_t kMaxCaptureMarks = 16;
+
+    std::mutex mutex_;
+    int64_t output_latency_us_ = 0;
+    int64_t output_end_us_ = 0;     // When the last sample written so far will be played
+    std::array<Segment, kMaxSegments> segments_;
+    size_t segment_next_ = 0;
+    size_t segment_count_ = 0;
+
+    std::array<CaptureMark, kMaxCaptureMarks> capture_marks_;
+    size_t capture_head_ = 0;
+    size_t capture_count_ = 0;
+    uint64_t captured_frames_ = 0;
+    uint64_t processed_frames_ = 0;
+
+    uint32_t GetPlayingTimestamp(int64_t time_us);
+};
+
+#endif // AEC_REFERENCE_CLOCK_H
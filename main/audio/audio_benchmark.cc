@@ -0,0 +1,136 @@
+#include "audio_benchmark.h"
+#include "audio_service.h"
+#include "system_info.h"
+#include "assets/lang_config.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <cmath>
+#include <vector>
+
+#define TAG "AudioBenchmark"
+
+#define BENCHMARK_AUDIO_SECONDS 10
+#define BENCHMARK_CHUNK_SAMPLES 512     // Same as the AFE output
+#define BENCHMARK_CPU_SAMPLE_MS 1000
+
+static const AudioEncoderConfig kBenchmarkConfigs[] = {
+    { .bitrate = ESP_OPUS_BITRATE_AUTO, .frame_duration_ms = OPUS_FRAME_DURATION_MS, .enable_fec = false, .enable_dtx = true },
+    { .bitrate = ESP_OPUS_BITRATE_AUTO, .frame_duration_ms = 20, .enable_fec = false, .enable_dtx = true },
+    { .bitrate = 16000, .frame_duration_ms = OPUS_FRAME_DURATION_MS, .enable_fec = true, .enable_dtx = true },
+};
+
+/* A vowel-like tone with a moving pitch, a syllable envelope and some noise, so DTX does not kick in */
+static void GenerateSpeechLike(std::vector<int16_t>& pcm, size_t offset) {
+    static uint32_t noise = 12345;
+    for (size_t i = 0; i < pcm.size(); i++) {
+        float t = (offset + i) / 16000.0f;
+        float pitch = 140.0f + 40.0f * sinf(2 * M_PI * 0.5f * t);
+        float envelope = 0.55f + 0.45f * sinf(2 * M_PI * 4.0f * t);
+        float voice = sinf(2 * M_PI * pitch * t) + 0.5f * sinf(2 * M_PI * 2.7f * pitch * t) + 0.25f * sinf(2 * M_PI * 5.1f * pitch * t);
+        noise = noise * 1103515245 + 12345;
+        float hiss = ((int32_t)(noise >> 16) - 32768) / 32768.0f;
+        pcm[i] = (int16_t)((voice * envelope * 0.35f + hiss * 0.02f) * 32767);
+    }
+}
+
+static void PrintHeap(const char* phase) {
+    ESP_LOGI(TAG, "[%s] heap min free: total %u, internal %u, spiram %u, stack high water %u", phase,
+        SystemInfo::GetMinimumFreeHeapSize(), heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL),
+        heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM), uxTaskGetStackHighWaterMark(nullptr));
+}
+
+static void PrintTiming(const char* phase, const char* stage, const FrameTiming& timing) {
+    if (timing.frames == 0) {
+        return;
+    }
+    uint32_t mean_us = timing.total_us / timing.frames;
+    ESP_LOGI(TAG, "[%s] %-8s %5lu frames, %7.1f frames/s, mean %5lu us, worst %5lu us", phase, stage,
+        timing.frames, mean_us > 0 ? 1000000.0f / mean_us : 0.0f, mean_us, timing.max_us);
+}
+
+/* Sample the CPU usage of every task in the background while a phase runs */
+static void StartCpuSampling() {
+    xTaskCreate([](void* arg) {
+        SystemInfo::PrintTaskCpuUsage(pdMS_TO_TICKS(BENCHMARK_CPU_SAMPLE_MS));
+        vTaskDelete(NULL);
+    }, "benchmark_cpu", 4096, nullptr, 1, nullptr);
+}
+
+void AudioBenchmark::Run(AudioCodec* codec) {
+    ESP_LOGI(TAG, "Board %s, input %d Hz x %d, output %d Hz x %d", BOARD_NAME, codec->input_sample_rate(),
+        codec->input_channels(), codec->output_sample_rate(), codec->output_channels());
+
+    // Never destroyed, the service tasks keep running after the benchmark
+    static AudioService audio_service;
+    audio_service.Initialize(codec);
+    audio_service.Start();
+    PrintHeap("start");
+
+    std::vector<std::vector<uint8_t>> packets;
+    for (auto& config : kBenchmarkConfigs) {
+        char phase[32];
+        snprintf(phase, sizeof(phase), "%dms/%dbps%s", config.frame_duration_ms, config.bitrate, config.enable_fec ? "/fec" : "");
+        audio_service.SetEncoderConfig(config);
+        audio_service.ResetDebugStatistics();
+
+        /* Encode: the feed blocks while the encode queue is full, so this runs at the encoder speed */
+        const size_t total_samples = BENCHMARK_AUDIO_SECONDS * 16000;
+        const size_t expected_frames = total_samples / (16000 / 1000 * config.frame_duration_ms);
+        packets.clear();
+        auto drain = [&]() {
+            AudioStreamPacketPtr batch[MAX_SEND_PACKETS_PER_BATCH];
+            while (size_t count = audio_service.PopPacketsFromSendQueue(batch, MAX_SEND_PACKETS_PER_BATCH)) {
+                for (size_t i = 0; i < count; i++) {
+                    packets.emplace_back(batch[i]->payload.begin(), batch[i]->payload.end());
+                }
+            }
+        };
+        StartCpuSampling();
+        int64_t start_us = esp_timer_get_time();
+        for (size_t offset = 0; offset < total_samples; offset += BENCHMARK_CHUNK_SAMPLES) {
+            std::vector<int16_t> pcm(std::min<size_t>(BENCHMARK_CHUNK_SAMPLES, total_samples - offset));
+            GenerateSpeechLike(pcm, offset);
+            audio_service.FeedEncoder(std::move(pcm));
+            drain();
+        }
+        while (packets.size() < expected_frames && esp_timer_get_time() - start_us < BENCHMARK_AUDIO_SECONDS * 1000000LL) {
+            vTaskDelay(pdMS_TO_TICKS(1));
+            drain();
+        }
+        int64_t encode_us = esp_timer_get_time() - start_us;
+        ESP_LOGI(TAG, "[%s] encoded %u frames in %lld ms, %.1fx realtime", phase, packets.size(), encode_us / 1000,
+            BENCHMARK_AUDIO_SECONDS * 1000000.0f / encode_us);
+        vTaskDelay(pdMS_TO_TICKS(BENCHMARK_CPU_SAMPLE_MS));
+
+        /* Decode: the packets are played back, so this runs in real time */
+        StartCpuSampling();
+        for (auto& payload : packets) {
+            auto packet = AudioStreamPacket::Create();
+            packet->sample_rate = 16000;
+            packet->frame_duration = config.frame_duration_ms;
+            packet->payload.assign(payload.begin(), payload.end());
+            audio_service.PushPacketToDecodeQueue(std::move(packet), true);
+        }
+        audio_service.WaitForPlaybackQueueEmpty();
+
+        auto stats = audio_service.GetDebugStatistics();
+        PrintTiming(phase, "encode", stats.encode_time);
+        PrintTiming(phase, "decode", stats.decode_time);
+        PrintTiming(phase, "resample", stats.resample_time);
+        PrintHeap(phase);
+    }
+
+    /* Prerecorded Opus from the assets */
+    audio_service.ResetDebugStatistics();
+    audio_service.PlaySound(Lang::Sounds::OGG_SUCCESS);
+    audio_service.WaitForPlaybackQueueEmpty();
+    auto stats = audio_service.GetDebugStatistics();
+    PrintTiming("sound", "decode", stats.decode_time);
+    PrintTiming("sound", "resample", stats.resample_time);
+    PrintHeap("end");
+    ESP_LOGI(TAG, "Benchmark finished");
+}
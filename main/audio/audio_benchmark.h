@@ -0,0 +1,21 @@
+#ifndef AUDIO_BENCHMARK_H
+#define AUDIO_BENCHMARK_H
+
+#include "audio_codec.h"
+
+/*
+ * Offline benchmark of the audio pipeline, built with CONFIG_AUDIO_BENCHMARK.
+ *
+ * Synthetic speech-like PCM is pushed through AudioService's encoder for each encoder
+ * config, the packets are looped back through the decoder, resampler and codec output,
+ * and a prerecorded sound asset is played last. No network or server is needed.
+ *
+ * For every run it logs frames/s, mean and worst frame compute time, the CPU usage
+ * of each task and the heap low-water marks, so boards can be compared across builds.
+ */
+class AudioBenchmark {
+public:
+    static void Run(AudioCodec* codec);
+};
+
+#endif // AUDIO_BENCHMARK_H
@@ -1,6 +1,8 @@
 #include "audio_codec.h"
 #include "board.h"
 #include "settings.h"
+#include "mcp_server.h"
+#include "trace_markers.h"
 
 #include <esp_log.h>
 #include <cstring>
@@ -14,12 +16,33 @@ AudioCodec::AudioCodec() {
 AudioCodec::~AudioCodec() {
 }
 
+bool IRAM_ATTR AudioCodec::OnInputOverrun(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx) {
+    auto codec = static_cast<AudioCodec*>(user_ctx);
+    codec->input_overruns_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+std::string AudioCodec::input_format() const {
+    int ref_num = input_reference_ ? 1 : 0;
+    std::string format(input_channels_ - ref_num, 'M');
+    format.append(ref_num, 'R');
+    return format;
+}
+
 void AudioCodec::OutputData(std::vector<int16_t>& data) {
+    TRACE_SCOPE(kTraceI2sWrite);
     Write(data.data(), data.size());
 }
 
+void AudioCodec::OutputData(const int16_t* data, size_t samples) {
+    TRACE_SCOPE(kTraceI2sWrite);
+    Write(data, samples);
+}
+
 bool AudioCodec::InputData(std::vector<int16_t>& data) {
+    TRACE_BEGIN(kTraceI2sRead);
     int samples = Read(data.data(), data.size());
+    TRACE_END(kTraceI2sRead);
     if (samples > 0) {
         return true;
     }
@@ -39,6 +62,13 @@ void AudioCodec::Start() {
     }
 
     if (rx_handle_ != nullptr) {
+        // A channel a codec enabled already takes no callbacks, it is only not counted then
+        i2s_event_callbacks_t callbacks = {};
+        callbacks.on_recv_q_ovf = OnInputOverrun;
+        esp_err_t err = i2s_channel_register_event_callback(rx_handle_, &callbacks, this);
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Input overruns are not counted: %s", esp_err_to_name(err));
+        }
         ESP_ERROR_CHECK(i2s_channel_enable(rx_handle_));
     }
 
@@ -47,12 +77,18 @@ void AudioCodec::Start() {
     ESP_LOGI(TAG, "Audio codec started");
 }
 
+/* A duplex codec shares the frame clock of its input, and the rate of a codec chip is set when it opens */
+bool AudioCodec::SetOutputSampleRate(int sample_rate) {
+    return sample_rate == output_sample_rate_;
+}
+
 void AudioCodec::SetOutputVolume(int volume) {
     output_volume_ = volume;
     ESP_LOGI(TAG, "Set output volume to %d", output_volume_);
     
     Settings settings("audio", true);
     settings.SetInt("output_volume", output_volume_);
+    McpServer::InvalidateCachedResults();
 }
 
 void AudioCodec::SetInputGain(float gain) {
@@ -5,14 +5,16 @@
 #include <freertos/event_groups.h>
 #include <driver/i2s_std.h>
 
+#include <atomic>
 #include <vector>
 #include <string>
 #include <functional>
 
 #include "board.h"
 
-#define AUDIO_CODEC_DMA_DESC_NUM 6
-#define AUDIO_CODEC_DMA_FRAME_NUM 240
+// A board with long gaps between the reads, e.g. the wake word running on one core with the display, may need more
+#define AUDIO_CODEC_DMA_DESC_NUM CONFIG_AUDIO_CODEC_DMA_DESC_NUM
+#define AUDIO_CODEC_DMA_FRAME_NUM CONFIG_AUDIO_CODEC_DMA_FRAME_NUM
 
 class AudioCodec {
 public:
@@ -25,8 +27,11 @@ public:
     virtual void EnableOutput(bool enable);
 
     virtual void OutputData(std::vector<int16_t>& data);
+    void OutputData(const int16_t* data, size_t samples);
     virtual bool InputData(std::vector<int16_t>& data);
     virtual void Start();
+    // Runs the output at another rate if its I2S clock is its own, false if it cannot follow
+    virtual bool SetOutputSampleRate(int sample_rate);
 
     inline bool duplex() const { return duplex_; }
     inline bool input_reference() const { return input_reference_; }
@@ -38,6 +43,10 @@ public:
     inline float input_gain() const { return input_gain_; }
     inline bool input_enabled() const { return input_enabled_; }
     inline bool output_enabled() const { return output_enabled_; }
+    // The DMA buffers of captured audio the driver dropped because they were not read in time
+    inline uint32_t input_overruns() const { return input_overruns_.load(std::memory_order_relaxed); }
+    // The AFE input format of the interleaved input channels, 'M' for a microphone and 'R' for the reference
+    virtual std::string input_format() const;
 
 protected:
     i2s_chan_handle_t tx_handle_ = nullptr;
@@ -53,9 +62,13 @@ protected:
     int output_channels_ = 1;
     int output_volume_ = 70;
     float input_gain_ = 0.0;
+    std::atomic<uint32_t> input_overruns_{0};
 
     virtual int Read(int16_t* dest, int samples) = 0;
     virtual int Write(const int16_t* data, int samples) = 0;
+
+private:
+    static bool OnInputOverrun(i2s_chan_handle_t handle, i2s_event_data_t* event, void* user_ctx);
 };
 
 #endif // _AUDIO_CODEC_H
@@ -0,0 +1,202 @@
+#include "audio_dsp.h"
+
+#if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4
+#define AUDIO_DSP_UNROLLED 1
+#else
+#define AUDIO_DSP_UNROLLED 0
+#endif
+
+static inline int16_t Saturate(int32_t value) {
+    return value > INT16_MAX ? INT16_MAX : value < INT16_MIN ? INT16_MIN : (int16_t)value;
+}
+
+/* The stride is a constant, so the loop unrolls without a multiply or a branch per sample */
+template <int kChannels>
+static void ExtractChannelOf(const int16_t* input, int16_t* output, size_t frames) {
+    const int16_t* in = input;
+    size_t i = 0;
+#if AUDIO_DSP_UNROLLED
+    for (; i + 4 <= frames; i += 4, in += 4 * kChannels) {
+        int16_t s0 = in[0], s1 = in[kChannels], s2 = in[2 * kChannels], s3 = in[3 * kChannels];
+        output[i] = s0;
+        output[i + 1] = s1;
+        output[i + 2] = s2;
+        output[i + 3] = s3;
+    }
+#endif
+    for (; i < frames; ++i, in += kChannels) {
+        output[i] = *in;
+    }
+}
+
+void AudioDsp::ExtractChannel(const int16_t* input, int16_t* output, size_t frames, int channels, int channel) {
+    const int16_t* in = input + channel;
+    switch (channels) {
+        case 1: ExtractChannelOf<1>(in, output, frames); return;
+        case 2: ExtractChannelOf<2>(in, output, frames); return;
+        case 3: ExtractChannelOf<3>(in, output, frames); return;
+        case 4: ExtractChannelOf<4>(in, output, frames); return;
+        default: break;
+    }
+    for (size_t i = 0; i < frames; ++i, in += channels) {
+        output[i] = *in;
+    }
+}
+
+void AudioDsp::Deinterleave(const int16_t* __restrict input, int16_t* __restrict left,
+    int16_t* __restrict right, size_t frames) {
+    size_t i = 0;
+#if AUDIO_DSP_UNROLLED
+    for (; i + 4 <= frames; i += 4, input += 8) {
+        left[i] = input[0];
+        right[i] = input[1];
+        left[i + 1] = input[2];
+        right[i + 1] = input[3];
+        left[i + 2] = input[4];
+        right[i + 2] = input[5];
+        left[i + 3] = input[6];
+        right[i + 3] = input[7];
+    }
+#endif
+    for (; i < frames; ++i, input += 2) {
+        left[i] = input[0];
+        right[i] = input[1];
+    }
+}
+
+void AudioDsp::Interleave(const int16_t* __restrict left, const int16_t* __restrict right,
+    int16_t* __restrict output, size_t frames) {
+    size_t i = 0;
+#if AUDIO_DSP_UNROLLED
+    for (; i + 4 <= frames; i += 4, output += 8) {
+        output[0] = left[i];
+        output[1] = right[i];
+        output[2] = left[i + 1];
+        output[3] = right[i + 1];
+        output[4] = left[i + 2];
+        output[5] = right[i + 2];
+        output[6] = left[i + 3];
+        output[7] = right[i + 3];
+    }
+#endif
+    for (; i < frames; ++i, output += 2) {
+        output[0] = left[i];
+        output[1] = right[i];
+    }
+}
+
+void AudioDsp::ApplyGain(const int16_t* input, int16_t* output, size_t samples, int32_t gain_q8) {
+    size_t i = 0;
+#if AUDIO_DSP_UNROLLED
+    for (; i + 4 <= samples; i += 4) {
+        int32_t s0 = input[i] * gain_q8;
+        int32_t s1 = input[i + 1] * gain_q8;
+        int32_t s2 = input[i + 2] * gain_q8;
+        int32_t s3 = input[i + 3] * gain_q8;
+        output[i] = Saturate(s0 >> 8);
+        output[i + 1] = Saturate(s1 >> 8);
+        output[i + 2] = Saturate(s2 >> 8);
+        output[i + 3] = Saturate(s3 >> 8);
+    }
+#endif
+    for (; i < samples; ++i) {
+        output[i] = Saturate((input[i] * gain_q8) >> 8);
+    }
+}
+
+void AudioDsp::Mix(int16_t* __restrict output, const int16_t* __restrict input, size_t samples) {
+    size_t i = 0;
+#if AUDIO_DSP_UNROLLED
+    for (; i + 4 <= samples; i += 4) {
+        int32_t s0 = output[i] + input[i];
+        int32_t s1 = output[i + 1] + input[i + 1];
+        int32_t s2 = output[i + 2] + input[i + 2];
+        int32_t s3 = output[i + 3] + input[i + 3];
+        output[i] = Saturate(s0);
+        output[i + 1] = Saturate(s1);
+        output[i + 2] = Saturate(s2);
+        output[i + 3] = Saturate(s3);
+    }
+#endif
+    for (; i < samples; ++i) {
+        output[i] = Saturate(output[i] + input[i]);
+    }
+}
+
+void AudioDsp::ConvertInt32ToInt16(const int32_t* __restrict input, int16_t* __restrict output, size_t samples, int shift) {
+    size_t i = 0;
+#if AUDIO_DSP_UNROLLED
+    for (; i + 4 <= samples; i += 4) {
+        int32_t s0 = input[i] >> shift;
+        int32_t s1 = input[i + 1] >> shift;
+        int32_t s2 = input[i + 2] >> shift;
+        int32_t s3 = input[i + 3] >> shift;
+        output[i] = Saturate(s0);
+        output[i + 1] = Saturate(s1);
+        output[i + 2] = Saturate(s2);
+        output[i + 3] = Saturate(s3);
+    }
+#endif
+    for (; i < samples; ++i) {
+        output[i] = Saturate(input[i] >> shift);
+    }
+}
+
+void AudioDsp::ConvertInt16ToInt32(const int16_t* __restrict input, int32_t* __restrict output, size_t samples, int32_t gain) {
+    size_t i = 0;
+#if AUDIO_DSP_UNROLLED
+    for (; i + 4 <= samples; i += 4) {
+        output[i] = input[i] * gain;
+        output[i + 1] = input[i + 1] * gain;
+        output[i + 2] = input[i + 2] * gain;
+        output[i + 3] = input[i + 3] * gain;
+    }
+#endif
+    for (; i < samples; ++i) {
+        output[i] = input[i] * gain;
+    }
+}
+
+template <int kChannels>
+static uint64_t SumOfSquaresOf(const int16_t* input, size_t frames) {
+    uint64_t sum = 0;
+    size_t i = 0;
+#if AUDIO_DSP_UNROLLED
+    for (; i + 4 <= frames; i += 4, input += 4 * kChannels) {
+        int32_t s0 = input[0], s1 = input[kChannels], s2 = input[2 * kChannels], s3 = input[3 * kChannels];
+        sum += (uint32_t)(s0 * s0) + (uint32_t)(s1 * s1);
+        sum += (uint32_t)(s2 * s2) + (uint32_t)(s3 * s3);
+    }
+#endif
+    for (; i < frames; ++i, input += kChannels) {
+        int32_t s = *input;
+        sum += (uint32_t)(s * s);
+    }
+    return sum;
+}
+
+uint32_t AudioDsp::MeanSquare(const int16_t* input, size_t frames, int channels) {
+    if (frames == 0) {
+        return 0;
+    }
+    uint64_t sum = 0;
+    switch (channels) {
+        case 1: sum = SumOfSquaresOf<1>(input, frames); break;
+        case 2: sum = SumOfSquaresOf<2>(input, frames); break;
+        case 3: sum = SumOfSquaresOf<3>(input, frames); break;
+        case 4: sum = SumOfSquaresOf<4>(input, frames); break;
+        default:
+            for (size_t i = 0; i < frames; ++i, input += channels) {
+                int32_t s = *input;
+                sum += (uint32_t)(s * s);
+            }
+            break;
+    }
+    return sum / frames;
+}
+
+void AudioDsp::FadeOut(int16_t* samples, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        samples[i] = (int32_t)samples[i] * (int32_t)(count - i) / (int32_t)count;
+    }
+}
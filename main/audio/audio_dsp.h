@@ -0,0 +1,41 @@
+#ifndef AUDIO_DSP_H
+#define AUDIO_DSP_H
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Small PCM kernels shared by the audio service, processors and codecs.
+ *
+ * On ESP32-S3 / ESP32-P4 the kernels are unrolled so the loops map onto the wide loads
+ * and zero-overhead loops of these cores, other targets use the plain loops to keep the
+ * code small. All results saturate to the int16 range.
+ *
+ * The kernels with a channel count run a copy specialized for one to four channels, the layouts
+ * of the codecs, so the stride is a constant of the loop. Other counts take the generic loop.
+ */
+class AudioDsp {
+public:
+    // Copy one channel out of interleaved samples, input and output may be the same buffer
+    static void ExtractChannel(const int16_t* input, int16_t* output, size_t frames, int channels, int channel);
+    static void Deinterleave(const int16_t* input, int16_t* left, int16_t* right, size_t frames);
+    static void Interleave(const int16_t* left, const int16_t* right, int16_t* output, size_t frames);
+
+    // output = input * gain_q8 / 256, gain_q8 up to 65536, input and output may be the same buffer
+    static void ApplyGain(const int16_t* input, int16_t* output, size_t samples, int32_t gain_q8);
+    // output = output + input
+    static void Mix(int16_t* output, const int16_t* input, size_t samples);
+
+    // output = input >> shift, e.g. 32-bit I2S microphone samples to 16-bit
+    static void ConvertInt32ToInt16(const int32_t* input, int16_t* output, size_t samples, int shift);
+    // output = input * gain, gain must not exceed 65536 so that the product fits in 32 bits
+    static void ConvertInt16ToInt32(const int16_t* input, int32_t* output, size_t samples, int32_t gain);
+
+    // Ramp the samples down from full scale to silence, for a stop that does not click
+    static void FadeOut(int16_t* samples, size_t count);
+
+    // The mean square of the first channel of interleaved samples
+    static uint32_t MeanSquare(const int16_t* input, size_t frames, int channels);
+};
+
+#endif // AUDIO_DSP_H
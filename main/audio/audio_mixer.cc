@@ -0,0 +1,157 @@
+#include "audio_mixer.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+static inline int16_t Saturate(int32_t value) {
+    return (int16_t)std::clamp<int32_t>(value, INT16_MIN, INT16_MAX);
+}
+
+void AudioMixer::Initialize(size_t capacity_samples) {
+    for (int i = 0; i < kMixerInputCount; i++) {
+        if (i != kMixerInputStream) {
+            inputs_[i].buffer.resize(capacity_samples);
+        }
+    }
+}
+
+void AudioMixer::SetDucking(MixerInput input, int32_t gain_q8) {
+    inputs_[input].ducking = true;
+    inputs_[input].ducking_gain_q8 = gain_q8;
+}
+
+size_t AudioMixer::Space(MixerInput input) const {
+    auto& in = inputs_[input];
+    return in.buffer.size() - (in.write_pos.load(std::memory_order_relaxed) - in.read_pos.load(std::memory_order_acquire));
+}
+
+size_t AudioMixer::Available(MixerInput input) const {
+    auto& in = inputs_[input];
+    return in.write_pos.load(std::memory_order_acquire) - in.read_pos.load(std::memory_order_relaxed);
+}
+
+bool AudioMixer::HasAudio() const {
+    for (int i = 0; i < kMixerInputCount; i++) {
+        if (i != kMixerInputStream && Available(static_cast<MixerInput>(i)) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t AudioMixer::Write(MixerInput input, const int16_t* pcm, size_t samples) {
+    auto& in = inputs_[input];
+    size_t n = std::min(samples, Space(input));
+    if (n == 0) {
+        return 0;
+    }
+    size_t write_pos = in.write_pos.load(std::memory_order_relaxed);
+    size_t offset = write_pos % in.buffer.size();
+    size_t first = std::min(n, in.buffer.size() - offset);
+    memcpy(in.buffer.data() + offset, pcm, first * sizeof(int16_t));
+    memcpy(in.buffer.data(), pcm + first, (n - first) * sizeof(int16_t));
+    in.write_pos.store(write_pos + n, std::memory_order_release);
+    return n;
+}
+
+size_t AudioMixer::Prepare() {
+    size_t most = 0;
+    for (int i = 0; i < kMixerInputCount; i++) {
+        auto& in = inputs_[i];
+        if (i == kMixerInputStream) {
+            continue;
+        }
+        if (in.clear.exchange(false)) {
+            in.read_pos.store(in.write_pos.load(std::memory_order_acquire), std::memory_order_release);
+        }
+        most = std::max(most, Available(static_cast<MixerInput>(i)));
+    }
+    return most;
+}
+
+void AudioMixer::Mix(int16_t* pcm, size_t samples) {
+    Prepare();
+
+    /* Work out the stream gain, lowered while a ducking input has audio */
+    int32_t stream_target = inputs_[kMixerInputStream].gain_q8;
+    bool has_audio = false;
+    for (int i = 0; i < kMixerInputCount; i++) {
+        auto& in = inputs_[i];
+        if (i == kMixerInputStream) {
+            continue;
+        }
+        if (Available(static_cast<MixerInput>(i)) > 0) {
+            has_audio = true;
+            if (in.ducking) {
+                stream_target = std::min(stream_target, inputs_[kMixerInputStream].gain_q8 * in.ducking_gain_q8 / kUnityGain);
+            }
+        }
+    }
+    /* Leave the stream untouched unless there is something to mix or a ramp to finish */
+    if (!has_audio && stream_gain_q8_ == stream_target && stream_target == kUnityGain && limiter_gain_ == kLimiterUnity) {
+        return;
+    }
+    if (samples == 0) {
+        return;
+    }
+
+    /* The stream, with the gain ramping to its target over the chunk */
+    mix_.resize(samples);
+    int32_t gain_start = stream_gain_q8_;
+    int32_t gain_step = stream_target - gain_start;
+    for (size_t i = 0; i < samples; i++) {
+        int32_t gain = gain_start + gain_step * (int32_t)i / (int32_t)samples;
+        mix_[i] = (pcm[i] * gain) >> 8;
+    }
+    stream_gain_q8_ = stream_target;
+
+    /* The buffered inputs */
+    for (int i = 0; i < kMixerInputCount; i++) {
+        auto& in = inputs_[i];
+        if (i == kMixerInputStream) {
+            continue;
+        }
+        size_t n = std::min(samples, Available(static_cast<MixerInput>(i)));
+        if (n == 0) {
+            continue;
+        }
+        size_t read_pos = in.read_pos.load(std::memory_order_relaxed);
+        size_t offset = read_pos % in.buffer.size();
+        size_t first = std::min(n, in.buffer.size() - offset);
+        const int16_t* src = in.buffer.data() + offset;
+        for (size_t j = 0; j < first; j++) {
+            mix_[j] += (src[j] * in.gain_q8) >> 8;
+        }
+        for (size_t j = first; j < n; j++) {
+            mix_[j] += (in.buffer[j - first] * in.gain_q8) >> 8;
+        }
+        in.read_pos.store(read_pos + n, std::memory_order_release);
+    }
+
+    /* Peak limiter: attack at once to keep the chunk in range, release over a few chunks */
+    int32_t peak = 0;
+    for (size_t i = 0; i < samples; i++) {
+        peak = std::max(peak, std::abs(mix_[i]));
+    }
+    int32_t limit = peak > INT16_MAX ? (int32_t)((int64_t)INT16_MAX * kLimiterUnity / peak) : kLimiterUnity;
+    int32_t limiter_start = limiter_gain_;
+    int32_t limiter_end = std::min(limit, limiter_start + ((kLimiterUnity - limiter_start) >> kLimiterReleaseShift));
+    if (limit < limiter_start) {
+        limiter_start = limit;
+        limiter_end = limit;
+    }
+    if (peak == 0 || (limiter_start == kLimiterUnity && limiter_end == kLimiterUnity)) {
+        for (size_t i = 0; i < samples; i++) {
+            pcm[i] = Saturate(mix_[i]);
+        }
+    } else {
+        int32_t limiter_step = limiter_end - limiter_start;
+        for (size_t i = 0; i < samples; i++) {
+            int32_t gain = limiter_start + limiter_step * (int32_t)i / (int32_t)samples;
+            pcm[i] = Saturate((int32_t)(((int64_t)mix_[i] * gain) >> 15));
+        }
+    }
+    // Snap to unity once the release is within 1%
+    limiter_gain_ = kLimiterUnity - limiter_end < (kLimiterUnity >> 7) ? kLimiterUnity : limiter_end;
+}
@@ -0,0 +1,75 @@
+#ifndef AUDIO_MIXER_H
+#define AUDIO_MIXER_H
+
+#include <array>
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include "memory_placement.h"
+
+enum MixerInput {
+    kMixerInputStream,  // The frame being played, mixed in place
+    kMixerInputSound,   // Local sounds played over the stream
+    kMixerInputCount,
+};
+
+/*
+ * Mixes local sounds into the output stream, mono PCM at the codec output rate.
+ *
+ * Every input but the stream has a ring buffer that one producer task fills ahead of time,
+ * Mix() then adds what is buffered to the frame about to be written to the codec, so a sound
+ * starts on the next DMA chunk whether a stream is playing or not.
+ *
+ * Each input has its own gain, and while a ducking input has audio the stream is lowered to
+ * the ducking gain. Gain changes ramp over one chunk, and the sum goes through a fixed-point
+ * peak limiter instead of clipping.
+ *
+ * Write() is called by the producer of an input, Mix() and Available() by the task that
+ * writes to the codec. Clear() may be called from any task.
+ */
+class AudioMixer {
+public:
+    static constexpr int32_t kUnityGain = 256;  // Gains are Q8
+
+    void Initialize(size_t capacity_samples);
+    void SetGain(MixerInput input, int32_t gain_q8) { inputs_[input].gain_q8 = gain_q8; }
+    // Lower the stream to gain_q8 while input has audio
+    void SetDucking(MixerInput input, int32_t gain_q8);
+
+    // Returns the samples written, less than samples if the buffer is full
+    size_t Write(MixerInput input, const int16_t* pcm, size_t samples);
+    size_t Space(MixerInput input) const;
+    size_t Available(MixerInput input) const;
+    bool HasAudio() const;
+    // Drop the buffered audio of input, done by the consumer on its next Mix()
+    void Clear(MixerInput input) { inputs_[input].clear = true; }
+
+    // Consumer side: apply the pending clears, returns the most samples buffered by an input
+    size_t Prepare();
+    // Mix the buffered inputs into pcm, which holds the stream audio or silence
+    void Mix(int16_t* pcm, size_t samples);
+
+private:
+    // Limiter gain is Q15, the peak is held for the chunk and released over a few chunks
+    static constexpr int32_t kLimiterUnity = 32768;
+    static constexpr int kLimiterReleaseShift = 2;
+
+    struct Input {
+        HotVector<int16_t> buffer;
+        std::atomic<size_t> write_pos = 0;  // Positions only grow, the buffer is indexed modulo its size
+        std::atomic<size_t> read_pos = 0;
+        std::atomic<bool> clear = false;
+        int32_t gain_q8 = kUnityGain;
+        bool ducking = false;
+        int32_t ducking_gain_q8 = kUnityGain;
+    };
+
+    std::array<Input, kMixerInputCount> inputs_;
+    HotVector<int32_t> mix_;
+    int32_t stream_gain_q8_ = kUnityGain;   // Gain applied to the stream at the end of the last chunk
+    int32_t limiter_gain_ = kLimiterUnity;
+};
+
+#endif // AUDIO_MIXER_H
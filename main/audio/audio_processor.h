@@ -5,6 +5,7 @@
 #include <vector>
 #include <functional>
 
+#include <cJSON.h>
 #include <model_path.h>
 #include "audio_codec.h"
 
@@ -13,14 +14,19 @@ public:
     virtual ~AudioProcessor() = default;
     
     virtual void Initialize(AudioCodec* codec, int frame_duration_ms, srmodel_list_t* models_list) = 0;
+    // Change the output frame size, only while the processor is stopped
+    virtual void SetFrameDuration(int frame_duration_ms) = 0;
     virtual void Feed(std::vector<int16_t>&& data) = 0;
     virtual void Start() = 0;
     virtual void Stop() = 0;
     virtual bool IsRunning() = 0;
+    // A frame of frame_duration_ms, the callback may leave an empty buffer of its own in data for the next one
     virtual void OnOutput(std::function<void(std::vector<int16_t>&& data)> callback) = 0;
     virtual void OnVadStateChange(std::function<void(bool speaking)> callback) = 0;
     virtual size_t GetFeedSize() = 0;
     virtual void EnableDeviceAec(bool enable) = 0;
+    // The stats of the processor for get_performance_stats, nullptr if it has none
+    virtual cJSON* GetStatsJson() { return nullptr; }
 };
 
 #endif
@@ -1,26 +1,16 @@
 #include "audio_service.h"
+#include "audio_dsp.h"
+#include "assets.h"
+#include "board.h"
+#include "perf_counters.h"
+#include "perf_profile.h"
+#include "task_profile.h"
+#include "trace_markers.h"
+#include "turn_timeline.h"
 #include <esp_log.h>
+#include <cinttypes>
 #include <cstring>
-
-#define RATE_CVT_CFG(_src_rate, _dest_rate, _channel)        \
-    (esp_ae_rate_cvt_cfg_t)                                  \
-    {                                                        \
-        .src_rate        = (uint32_t)(_src_rate),            \
-        .dest_rate       = (uint32_t)(_dest_rate),           \
-        .channel         = (uint8_t)(_channel),              \
-        .bits_per_sample = ESP_AUDIO_BIT16,                  \
-        .complexity      = 2,                                \
-        .perf_type       = ESP_AE_RATE_CVT_PERF_TYPE_SPEED,  \
-    }
-
-#define OPUS_DEC_CFG(_sample_rate, _frame_duration_ms)                                                    \
-    (esp_opus_dec_cfg_t)                                                                                  \
-    {                                                                                                     \
-        .sample_rate    = (uint32_t)(_sample_rate),                                                       \
-        .channel        = ESP_AUDIO_MONO,                                                                 \
-        .frame_duration = (esp_opus_dec_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM(_frame_duration_ms),  \
-        .self_delimited = false,                                                                          \
-    }
+#include <algorithm>
 
 #if CONFIG_USE_AUDIO_PROCESSOR
 #include "processors/afe_audio_processor.h"
@@ -37,6 +27,52 @@
 
 #define TAG "AudioService"
 
+/*
+ * Encoder settings from the best link to the worst one. The adaptation starts at the
+ * default level, and only steps down to 20ms frames if low latency mode is enabled.
+ */
+static const AudioEncoderConfig kEncoderLevels[] = {
+    { .bitrate = ESP_OPUS_BITRATE_AUTO, .frame_duration_ms = 20, .enable_fec = false, .enable_dtx = true },
+    { .bitrate = ESP_OPUS_BITRATE_AUTO, .frame_duration_ms = OPUS_FRAME_DURATION_MS, .enable_fec = false, .enable_dtx = true },
+    { .bitrate = 16000, .frame_duration_ms = OPUS_FRAME_DURATION_MS, .enable_fec = true, .enable_dtx = true },
+    { .bitrate = 8000, .frame_duration_ms = OPUS_FRAME_DURATION_MS, .enable_fec = true, .enable_dtx = true },
+#if CONFIG_AUDIO_NARROWBAND_MODE
+    // Only with the server's consent, see SetNarrowbandAllowed()
+    { .bitrate = 6000, .frame_duration_ms = 120, .enable_fec = true, .enable_dtx = true, .voip = true },
+#endif
+};
+#define ENCODER_DEFAULT_LEVEL 1
+#define ENCODER_MAX_LEVEL (int)(sizeof(kEncoderLevels) / sizeof(kEncoderLevels[0]) - 1)
+#if CONFIG_AUDIO_NARROWBAND_MODE
+#define ENCODER_NARROWBAND_LEVEL ENCODER_MAX_LEVEL
+#else
+#define ENCODER_NARROWBAND_LEVEL (ENCODER_MAX_LEVEL + 1)
+#endif
+#if CONFIG_AUDIO_ADAPTIVE_ENCODER_LOW_LATENCY
+#define ENCODER_MIN_LEVEL 0
+#else
+#define ENCODER_MIN_LEVEL ENCODER_DEFAULT_LEVEL
+#endif
+
+/* Frame compute times are only measured in the benchmark build, elsewhere this compiles away */
+static inline int64_t FrameTimerStart() {
+#if CONFIG_AUDIO_BENCHMARK
+    return esp_timer_get_time();
+#else
+    return 0;
+#endif
+}
+
+static inline void FrameTimerStop(FrameTiming& timing, int64_t start_us) {
+    if (start_us == 0) {
+        return;
+    }
+    uint32_t elapsed_us = esp_timer_get_time() - start_us;
+    timing.frames++;
+    timing.total_us += elapsed_us;
+    timing.max_us = std::max(timing.max_us, elapsed_us);
+}
+
 AudioService::AudioService() {
     event_group_ = xEventGroupCreate();
 }
@@ -48,49 +84,77 @@ AudioService::~AudioService() {
     if (opus_encoder_ != nullptr) {
         esp_opus_enc_close(opus_encoder_);
     }
-    if (opus_decoder_ != nullptr) {
-        esp_opus_dec_close(opus_decoder_);
-    }
-    if (input_resampler_ != nullptr) {
-        esp_ae_rate_cvt_close(input_resampler_);
-    }
-    if (output_resampler_ != nullptr) {
-        esp_ae_rate_cvt_close(output_resampler_);
+    for (auto& slot : decoder_cache_) {
+        if (slot.decoder != nullptr) {
+            esp_opus_dec_close(slot.decoder);
+        }
     }
+    CloseSoundDecoder();
 }
 
 void AudioService::Initialize(AudioCodec* codec) {
     codec_ = codec;
     codec_->Start();
+#if CONFIG_AUDIO_NATIVE_OUTPUT_RATE
+    /* Before anything is sized for the output rate: the server TTS then plays without a resampler */
+    if (codec_->output_sample_rate() != AUDIO_SERVER_SAMPLE_RATE && !codec_->SetOutputSampleRate(AUDIO_SERVER_SAMPLE_RATE)) {
+        ESP_LOGI(TAG, "The codec output stays at %d Hz, the server audio is resampled", codec_->output_sample_rate());
+    }
+#endif
+#if CONFIG_AUDIO_SPEAKER_DSP
+    Board::GetInstance().GetSpeakerDspConfig(speaker_dsp_config_);
+    speaker_dsp_.Configure(speaker_dsp_config_, codec_->output_sample_rate());
+#endif
 
-    esp_opus_dec_cfg_t opus_dec_cfg = OPUS_DEC_CFG(codec->output_sample_rate(), OPUS_FRAME_DURATION_MS);
-    auto ret = esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &opus_decoder_);
-    if (opus_decoder_ == nullptr) {
-        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", ret);
-    } else {
-        decoder_sample_rate_ = codec->output_sample_rate();
-        decoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
-        decoder_frame_size_ = decoder_sample_rate_ / 1000 * OPUS_FRAME_DURATION_MS;
+#if CONFIG_USE_AUDIO_DEBUGGER
+    audio_debugger_ = std::make_unique<AudioDebugger>();
+    std::string input_format = codec_->input_format();
+    for (size_t i = 0; i < input_format.size(); i++) {
+        if (input_format[i] == 'R') {
+            debug_reference_mask_ |= 1 << i;
+        }
     }
-    esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG();
-    ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &opus_encoder_);
-    if (opus_encoder_ == nullptr) {
-        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
-    } else {
-        encoder_sample_rate_ = 16000;
-        encoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
-        esp_opus_enc_get_frame_size(opus_encoder_, &encoder_frame_size_, &encoder_outbuf_size_);
-        encoder_frame_size_ = encoder_frame_size_ / sizeof(int16_t);
+#endif
+
+    /* Open the formats of the server TTS and the local sounds ahead of time, the output rate last so it is active */
+    if (DECODER_CACHE_SIZE > 1) {
+        SetDecodeSampleRate(AUDIO_SERVER_SAMPLE_RATE, OPUS_FRAME_DURATION_MS);
+        SetDecodeSampleRate(16000, OPUS_FRAME_DURATION_MS);
     }
+    SetDecodeSampleRate(codec->output_sample_rate(), OPUS_FRAME_DURATION_MS);
+    jitter_buffer_.SetPrebuffer(CONFIG_AUDIO_PLAYBACK_PREBUFFER_MS);
+
+    mixer_.Initialize(codec->output_sample_rate() / 1000 * MIXER_SOUND_BUFFER_MS);
+    mixer_.SetDucking(kMixerInputSound, MIXER_DUCKING_GAIN_Q8);
+    sound_cache_.Initialize(codec->output_sample_rate());
+    sound_player_.Initialize([this](AudioStreamPacketPtr packet, SoundPriority priority, uint32_t generation) {
+        if (priority == kSoundPriorityMix) {
+            return MixSoundPacket(std::move(packet), generation);
+        }
+        return PushSoundPacket(std::move(packet), generation);
+    }, [this](const int16_t* pcm, size_t samples, SoundPriority priority, uint32_t generation) {
+        return MixSoundPcm(pcm, samples, priority, generation);
+    }, [this]() {
+        CloseSoundDecoder();
+        /* A sound that failed to load leaves nothing for the output task to finish */
+        NotifyWaiter(playback_empty_waiter_);
+        /* The sounds played for the first time are decoded while nothing plays */
+        sound_cache_.DecodePending();
+    });
+
+    encoder_config_ = kEncoderLevels[ENCODER_DEFAULT_LEVEL];
+    encoder_level_ = ENCODER_DEFAULT_LEVEL;
+#if CONFIG_AUDIO_ADAPTIVE_ENCODER
+    adaptive_encoder_ = true;
+#endif
+    OpenEncoder(encoder_config_);
 
     if (codec->input_sample_rate() != 16000) {
-        esp_ae_rate_cvt_cfg_t input_resampler_cfg = RATE_CVT_CFG(
-            codec->input_sample_rate(), ESP_AUDIO_SAMPLE_RATE_16K, codec->input_channels());
-        auto resampler_ret = esp_ae_rate_cvt_open(&input_resampler_cfg, &input_resampler_);
-        if (input_resampler_ == nullptr) {
-            ESP_LOGE(TAG, "Failed to create input resampler, error code: %d", resampler_ret);
-        }
+        input_resampler_.Open(codec->input_sample_rate(), 16000, codec->input_channels());
     }
+#if CONFIG_USE_SERVER_AEC
+    aec_reference_clock_.SetOutputLatency((int64_t)AUDIO_CODEC_DMA_DESC_NUM * AUDIO_CODEC_DMA_FRAME_NUM * 1000000 / codec->output_sample_rate());
+#endif
 
 #if CONFIG_USE_AUDIO_PROCESSOR
     audio_processor_ = std::make_unique<AfeAudioProcessor>();
@@ -99,7 +163,24 @@ void AudioService::Initialize(AudioCodec* codec) {
 #endif
 
     audio_processor_->OnOutput([this](std::vector<int16_t>&& data) {
-        PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(data));
+#if CONFIG_AUDIO_LATENCY_SELF_TEST
+        /* The chirp is not for the server */
+        if (latency_probe_active_) {
+            std::lock_guard<std::mutex> probe_lock(latency_probe_mutex_);
+            if (latency_probe_ != nullptr) {
+                latency_probe_->OnProcessed(data.data(), data.size(), esp_timer_get_time());
+                return;
+            }
+        }
+#endif
+#if CONFIG_UPLINK_AGC
+        uplink_agc_.Process(data.data(), data.size(), voice_detected_);
+#endif
+#if CONFIG_USE_AUDIO_DEBUGGER
+        audio_debugger_->Feed(kAudioDebugTapProcessed, data.data(), data.size(), 1, 16000);
+#endif
+        int64_t capture_time_us = latency_tracer_.TakeCapture(data.size());
+        PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(data), capture_time_us);
     });
 
     audio_processor_->OnVadStateChange([this](bool speaking) {
@@ -126,44 +207,53 @@ void AudioService::Start() {
     service_stopped_ = false;
     xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING | AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING);
 
-    esp_timer_start_periodic(audio_power_timer_, 1000000);
+    last_input_time_ = last_output_time_ = std::chrono::steady_clock::now();
+    UpdatePowerState(nullptr, 0);
+    ScheduleAudioPowerCheck();
 
-#if CONFIG_USE_AUDIO_PROCESSOR
     /* Start the audio input task */
-    xTaskCreatePinnedToCore([](void* arg) {
+    TaskProfiles::Create(kTaskAudioInput, [](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
         audio_service->AudioInputTask();
+        audio_service->audio_input_task_handle_ = nullptr;
         vTaskDelete(NULL);
-    }, "audio_input", 2048 * 3, this, 8, &audio_input_task_handle_, 0);
+    }, this, &audio_input_task_handle_);
 
     /* Start the audio output task */
-    xTaskCreate([](void* arg) {
+    TaskProfiles::Create(kTaskAudioOutput, [](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
         audio_service->AudioOutputTask();
+        audio_service->audio_output_task_handle_ = nullptr;
         vTaskDelete(NULL);
-    }, "audio_output", 2048 * 2, this, 4, &audio_output_task_handle_);
-#else
-    /* Start the audio input task */
-    xTaskCreate([](void* arg) {
+    }, this, &audio_output_task_handle_);
+
+#if CONFIG_AUDIO_SPLIT_OPUS_TASKS
+    /* Start the opus decoder task, so a slow encode never stalls playback */
+    TaskProfiles::Create(kTaskOpusDecoder, [](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
-        audio_service->AudioInputTask();
+        audio_service->OpusDecoderTask();
+        audio_service->opus_decoder_task_handle_ = nullptr;
         vTaskDelete(NULL);
-    }, "audio_input", 2048 * 2, this, 8, &audio_input_task_handle_);
+    }, this, &opus_decoder_task_handle_);
 
-    /* Start the audio output task */
-    xTaskCreate([](void* arg) {
+    /* Start the opus encoder task */
+    TaskProfiles::Create(kTaskOpusEncoder, [](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
-        audio_service->AudioOutputTask();
+        audio_service->OpusEncoderTask();
+        audio_service->opus_encoder_task_handle_ = nullptr;
         vTaskDelete(NULL);
-    }, "audio_output", 2048, this, 4, &audio_output_task_handle_);
-#endif
-
+    }, this, &opus_encoder_task_handle_);
+#else
     /* Start the opus codec task */
-    xTaskCreate([](void* arg) {
+    TaskProfiles::Create(kTaskOpusCodec, [](void* arg) {
         AudioService* audio_service = (AudioService*)arg;
         audio_service->OpusCodecTask();
+        audio_service->opus_decoder_task_handle_ = nullptr;
+        audio_service->opus_encoder_task_handle_ = nullptr;
         vTaskDelete(NULL);
-    }, "opus_codec", 2048 * 12, this, 2, &opus_codec_task_handle_);
+    }, this, &opus_decoder_task_handle_);
+    opus_encoder_task_handle_ = opus_decoder_task_handle_;
+#endif
 }
 
 void AudioService::Stop() {
@@ -173,38 +263,73 @@ void AudioService::Stop() {
         AS_EVENT_WAKE_WORD_RUNNING |
         AS_EVENT_AUDIO_PROCESSOR_RUNNING);
 
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    audio_encode_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    audio_encode_queue_.Clear();
+    audio_decode_queue_.Clear();
+    audio_playback_queue_.Clear();
+    audio_testing_queue_.Clear();
+    decoder_resets_++;
+    encoder_pcm_reset_ = true;
+    NotifyTask(opus_decoder_task_handle_);
+    NotifyTask(opus_encoder_task_handle_);
+    NotifyTask(audio_output_task_handle_);
+    NotifyWaiter(decode_space_waiter_);
+    NotifyWaiter(encode_space_waiter_);
+    NotifyWaiter(playback_empty_waiter_);
+}
+
+void AudioService::NotifyTask(TaskHandle_t task) {
+    if (task != nullptr) {
+        xTaskNotifyGive(task);
+    }
+}
+
+void AudioService::NotifyWaiter(std::atomic<TaskHandle_t>& waiter) {
+    TaskHandle_t task = waiter.exchange(nullptr);
+    if (task != nullptr) {
+        xTaskNotifyGive(task);
+    }
+}
+
+void AudioService::WaitOn(std::atomic<TaskHandle_t>& waiter, const std::function<bool()>& ready) {
+    TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    while (!ready()) {
+        waiter.store(self);
+        if (ready()) {
+            TaskHandle_t expected = self;
+            waiter.compare_exchange_strong(expected, nullptr);
+            break;
+        }
+        // The timeout covers a waiter slot overwritten by another task
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(20));
+    }
 }
 
 bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples) {
     if (!codec_->input_enabled()) {
-        esp_timer_stop(audio_power_timer_);
-        esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
+        int64_t start_us = esp_timer_get_time();
         codec_->EnableInput(true);
+        UpdatePowerState(&input_power_up_, esp_timer_get_time() - start_us);
+        last_input_time_ = std::chrono::steady_clock::now();
+        ScheduleAudioPowerCheck();
     }
 
-    if (codec_->input_sample_rate() != sample_rate) {
+    if (codec_->input_sample_rate() != sample_rate && input_resampler_.IsOpen()) {
+        /* Read into the persistent input buffer and resample straight into data */
+        std::lock_guard<std::mutex> lock(input_resampler_mutex_);
+        int channels = codec_->input_channels();
+        input_buffer_.resize(samples * codec_->input_sample_rate() / sample_rate * channels);
+        if (!codec_->InputData(input_buffer_)) {
+            return false;
+        }
+        size_t input_frames = input_buffer_.size() / channels;
+        data.resize(input_resampler_.MaxOutputFrames(input_frames) * channels);
+        size_t frames = input_resampler_.Process(input_buffer_.data(), input_frames, data.data(), data.size() / channels);
+        data.resize(frames * channels);
+    } else if (codec_->input_sample_rate() != sample_rate) {
         data.resize(samples * codec_->input_sample_rate() / sample_rate * codec_->input_channels());
         if (!codec_->InputData(data)) {
             return false;
         }
-        if (input_resampler_ != nullptr) {
-            std::lock_guard<std::mutex> lock(input_resampler_mutex_);
-            uint32_t in_sample_num = data.size() / codec_->input_channels();
-            uint32_t output_samples = 0;
-            esp_ae_rate_cvt_get_max_out_sample_num(input_resampler_, in_sample_num, &output_samples);
-            auto resampled = std::vector<int16_t>(output_samples * codec_->input_channels());
-            uint32_t actual_output = output_samples;
-            esp_ae_rate_cvt_process(input_resampler_, (esp_ae_sample_t)data.data(), in_sample_num,
-                                   (esp_ae_sample_t)resampled.data(), &actual_output);
-            resampled.resize(actual_output * codec_->input_channels());
-            data = std::move(resampled);
-        }
     } else {
         data.resize(samples * codec_->input_channels());
         if (!codec_->InputData(data)) {
@@ -216,22 +341,32 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
     last_input_time_ = std::chrono::steady_clock::now();
     debug_statistics_.input_count++;
 
+    uint32_t overruns = codec_->input_overruns();
+    if (overruns != input_overruns_seen_) {
+        ESP_LOGW(TAG, "%lu DMA buffers of input were dropped, %lu in total", overruns - input_overruns_seen_, overruns);
+        input_overruns_seen_ = overruns;
+    }
+
 #if CONFIG_USE_AUDIO_DEBUGGER
     // 音频调试：发送原始音频数据
-    if (audio_debugger_ == nullptr) {
-        audio_debugger_ = std::make_unique<AudioDebugger>();
-    }
-    audio_debugger_->Feed(data);
+    audio_debugger_->Feed(kAudioDebugTapInput, data.data(), data.size(), codec_->input_channels(), sample_rate,
+        debug_reference_mask_);
 #endif
 
     return true;
 }
 
 void AudioService::AudioInputTask() {
+    const EventBits_t running_bits = AS_EVENT_AUDIO_TESTING_RUNNING | AS_EVENT_WAKE_WORD_RUNNING |
+        AS_EVENT_AUDIO_PROCESSOR_RUNNING;
+    /* Kept across the frames, the encode queue hands the buffer of its pooled task back in exchange */
+    std::vector<int16_t> data;
     while (true) {
-        EventBits_t bits = xEventGroupWaitBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING |
-            AS_EVENT_WAKE_WORD_RUNNING | AS_EVENT_AUDIO_PROCESSOR_RUNNING,
-            pdFALSE, pdFALSE, portMAX_DELAY);
+        if ((xEventGroupGetBits(event_group_) & running_bits) == 0) {
+            input_power_lock_.Hold(false);
+        }
+        EventBits_t bits = xEventGroupWaitBits(event_group_, running_bits, pdFALSE, pdFALSE, portMAX_DELAY);
+        input_power_lock_.Hold(true);
 
         if (service_stopped_) {
             break;
@@ -244,33 +379,60 @@ void AudioService::AudioInputTask() {
 
         /* Used for audio testing in NetworkConfiguring mode by clicking the BOOT button */
         if (bits & AS_EVENT_AUDIO_TESTING_RUNNING) {
-            if (audio_testing_queue_.size() >= AUDIO_TESTING_MAX_DURATION_MS / OPUS_FRAME_DURATION_MS) {
+            if (audio_testing_queue_.Size() >= MAX_TESTING_PACKETS_IN_QUEUE) {
                 ESP_LOGW(TAG, "Audio testing queue is full, stopping audio testing");
                 EnableAudioTesting(false);
                 continue;
             }
-            std::vector<int16_t> data;
             int samples = OPUS_FRAME_DURATION_MS * 16000 / 1000;
             if (ReadAudioData(data, 16000, samples)) {
-                // If input channels is 2, we need to fetch the left channel data
-                if (codec_->input_channels() == 2) {
-                    auto mono_data = std::vector<int16_t>(data.size() / 2);
-                    for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-                        mono_data[i] = data[j];
-                    }
-                    data = std::move(mono_data);
+                // With more than one input channel, fetch the first microphone
+                int channels = codec_->input_channels();
+                if (channels > 1) {
+                    size_t frames = data.size() / channels;
+                    AudioDsp::ExtractChannel(data.data(), data.data(), frames, channels, 0);
+                    data.resize(frames);
                 }
                 PushTaskToEncodeQueue(kAudioTaskTypeEncodeToTestingQueue, std::move(data));
                 continue;
             }
         }
 
-        /* Feed the wake word */
-        if (bits & AS_EVENT_WAKE_WORD_RUNNING) {
-            std::vector<int16_t> data;
-            int samples = wake_word_->GetFeedSize();
+        /* Feed the wake word, unless it runs on the audio processor's AFE */
+        if ((bits & AS_EVENT_WAKE_WORD_RUNNING) && !shared_afe_) {
+            std::lock_guard<std::mutex> wake_word_lock(wake_word_mutex_);
+            int samples = wake_word_ != nullptr ? wake_word_->GetFeedSize() : 0;
+            if (samples > 0 && !wake_word_pre_roll_.empty()) {
+                // The sound that woke the device from deep sleep goes first, on the microphone channels
+                int channels = codec_->input_channels();
+                int mic_channels = codec_->input_reference() ? channels - 1 : channels;
+                size_t frames = std::min<size_t>(samples, wake_word_pre_roll_.size());
+                data.assign(samples * channels, 0);
+                for (size_t i = 0; i < frames; i++) {
+                    for (int c = 0; c < mic_channels; c++) {
+                        data[i * channels + c] = wake_word_pre_roll_[i];
+                    }
+                }
+                wake_word_pre_roll_.erase(wake_word_pre_roll_.begin(), wake_word_pre_roll_.begin() + frames);
+                if (wake_word_pre_roll_.empty()) {
+                    std::vector<int16_t>().swap(wake_word_pre_roll_);
+                }
+                wake_word_->Feed(data);
+                continue;
+            }
             if (samples > 0) {
                 if (ReadAudioData(data, 16000, samples)) {
+#if CONFIG_WAKE_WORD_VOICE_GATE
+                    if (voice_gate_reset_.exchange(false)) {
+                        voice_gate_.Reset();
+                    }
+                    if (!voice_gate_.Pass(data, codec_->input_channels())) {
+                        continue;
+                    }
+                    voice_gate_.Drain([this](const std::vector<int16_t>& held) {
+                        wake_word_->Feed(held);
+                    });
+#endif
                     wake_word_->Feed(data);
                     continue;
                 }
@@ -278,11 +440,22 @@ void AudioService::AudioInputTask() {
         }
 
         /* Feed the audio processor */
-        if (bits & AS_EVENT_AUDIO_PROCESSOR_RUNNING) {
-            std::vector<int16_t> data;
+        if ((bits & AS_EVENT_AUDIO_PROCESSOR_RUNNING) || (shared_afe_ && (bits & AS_EVENT_WAKE_WORD_RUNNING))) {
             int samples = audio_processor_->GetFeedSize();
             if (samples > 0) {
                 if (ReadAudioData(data, 16000, samples)) {
+                    latency_tracer_.MarkCapture(data.size() / codec_->input_channels(), LatencyTracer::Now());
+#if CONFIG_USE_SERVER_AEC
+                    aec_reference_clock_.MarkCapture(data.size() / codec_->input_channels(), esp_timer_get_time());
+#endif
+#if CONFIG_AUDIO_LATENCY_SELF_TEST
+                    if (latency_probe_active_) {
+                        std::lock_guard<std::mutex> probe_lock(latency_probe_mutex_);
+                        if (latency_probe_ != nullptr) {
+                            latency_probe_->OnInput(data.data(), data.size() / codec_->input_channels(), esp_timer_get_time());
+                        }
+                    }
+#endif
                     audio_processor_->Feed(std::move(data));
                     continue;
                 }
@@ -293,519 +466,1736 @@ void AudioService::AudioInputTask() {
         break;
     }
 
+    input_power_lock_.Hold(false);
     ESP_LOGW(TAG, "Audio input task stopped");
 }
 
 void AudioService::AudioOutputTask() {
     while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() { return !audio_playback_queue_.empty() || service_stopped_; });
+        AudioTaskPtr task;
+        if (!audio_playback_queue_.Pop(task)) {
+            if (service_stopped_) {
+                break;
+            }
+            /* Nothing to mix the sounds into, play them on their own */
+            if (mixer_.HasAudio()) {
+                PlayMixer();
+                continue;
+            }
+            if (audio_decode_queue_.Empty() && jitter_buffer_.size() == 0) {
+                NotifyWaiter(playback_empty_waiter_);
+                /* A cached sound waits for the stream to end */
+                NotifyWaiter(sound_space_waiter_);
+            }
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
         if (service_stopped_) {
             break;
         }
+        /* There is room in the playback queue again */
+        NotifyTask(opus_decoder_task_handle_);
 
-        auto task = std::move(audio_playback_queue_.front());
-        audio_playback_queue_.pop_front();
-        audio_queue_cv_.notify_all();
-        lock.unlock();
-
-        if (!codec_->output_enabled()) {
-            esp_timer_stop(audio_power_timer_);
-            esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
-            codec_->EnableOutput(true);
-        }
-        codec_->OutputData(task->pcm);
-
-        /* Update the last output time */
-        last_output_time_ = std::chrono::steady_clock::now();
-        debug_statistics_.playback_count++;
-
-#if CONFIG_USE_SERVER_AEC
-        /* Record the timestamp for server AEC */
-        if (task->timestamp > 0) {
-            lock.lock();
-            timestamp_queue_.push_back(task->timestamp);
-        }
-#endif
+        PlayTask(*task);
     }
 
     ESP_LOGW(TAG, "Audio output task stopped");
 }
 
-void AudioService::OpusCodecTask() {
-    while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() {
-            return service_stopped_ ||
-                (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) ||
-                (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE);
-        });
-        if (service_stopped_) {
-            break;
-        }
-
-        /* Decode the audio from decode queue */
-        if (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE) {
-            auto packet = std::move(audio_decode_queue_.front());
-            audio_decode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
-
-            auto task = std::make_unique<AudioTask>();
-            task->type = kAudioTaskTypeDecodeToPlaybackQueue;
-            task->timestamp = packet->timestamp;
-
-            SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
-            if (opus_decoder_ != nullptr) {
-                task->pcm.resize(decoder_frame_size_);
-                esp_audio_dec_in_raw_t raw = {
-                    .buffer = (uint8_t *)(packet->payload.data()),
-                    .len = (uint32_t)(packet->payload.size()),
-                    .consumed = 0,
-                    .frame_recover = ESP_AUDIO_DEC_RECOVERY_NONE,
-                };
-                esp_audio_dec_out_frame_t out_frame = {
-                    .buffer = (uint8_t *)(task->pcm.data()),
-                    .len = (uint32_t)(task->pcm.size() * sizeof(int16_t)),
-                    .decoded_size = 0,
-                };
-                esp_audio_dec_info_t dec_info = {};
-                std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
-                auto ret = esp_opus_dec_decode(opus_decoder_, &raw, &out_frame, &dec_info);
-                decoder_lock.unlock();
-                if (ret == ESP_AUDIO_ERR_OK) {
-                    task->pcm.resize(out_frame.decoded_size / sizeof(int16_t));
-                    if (decoder_sample_rate_ != codec_->output_sample_rate() && output_resampler_ != nullptr) {
-                        uint32_t target_size = 0;
-                        esp_ae_rate_cvt_get_max_out_sample_num(output_resampler_, task->pcm.size(), &target_size);
-                        std::vector<int16_t> resampled(target_size);
-                        uint32_t actual_output = target_size;
-                        esp_ae_rate_cvt_process(output_resampler_, (esp_ae_sample_t)task->pcm.data(), task->pcm.size(),
-                                                (esp_ae_sample_t)resampled.data(), &actual_output);
-                        resampled.resize(actual_output);
-                        task->pcm = std::move(resampled);
-                    }
-                    lock.lock();
-                    audio_playback_queue_.push_back(std::move(task));
-                    audio_queue_cv_.notify_all();
-                    debug_statistics_.decode_count++;
-                } else {
-                    ESP_LOGE(TAG, "Failed to decode audio after resize, error code: %d", ret);
-                    lock.lock();
-                }
-            } else {
-                ESP_LOGE(TAG, "Audio decoder is not configured");
-                lock.lock();
+void AudioService::PlayTask(AudioTask& task) {
+    EnableOutputPower();
+    {
+        /* Write in DMA sized chunks, so a reset stops the frame being played within a DMA buffer */
+        std::lock_guard<std::mutex> lock(output_mutex_);
+        uint32_t flushes = playback_flushes_;
+        uint32_t resets = decoder_resets_;
+        const size_t chunk = AUDIO_CODEC_DMA_FRAME_NUM;
+        auto& turn_timeline = TurnTimeline::GetInstance();
+        for (size_t offset = 0; offset < task.pcm.size(); offset += chunk) {
+            size_t samples = std::min(chunk, task.pcm.size() - offset);
+            bool flushed = playback_flushes_ != flushes;
+            if (flushed) {
+                /* Ramp down instead of cutting the wave off, which clicks */
+                samples = std::min<size_t>(task.pcm.size() - offset, flush_fade_ms_ * codec_->output_sample_rate() / 1000);
+                AudioDsp::FadeOut(task.pcm.data() + offset, samples);
+            } else if (decoder_resets_ != resets) {
+                break;
             }
-            debug_statistics_.decode_count++;
-        }
-        /* Encode the audio to send queue */
-        if (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) {
-            auto task = std::move(audio_encode_queue_.front());
-            audio_encode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
-
-            auto packet = std::make_unique<AudioStreamPacket>();
-            packet->frame_duration = OPUS_FRAME_DURATION_MS;
-            packet->sample_rate = 16000;
-            packet->timestamp = task->timestamp;
-
-            if (opus_encoder_ != nullptr && task->pcm.size() == encoder_frame_size_) {
-                std::vector<uint8_t> buf(encoder_outbuf_size_);
-                esp_audio_enc_in_frame_t in = {
-                    .buffer = (uint8_t *)(task->pcm.data()),
-                    .len = (uint32_t)(encoder_frame_size_ * sizeof(int16_t)),
-                };
-                esp_audio_enc_out_frame_t out = {
-                    .buffer = buf.data(),
-                    .len = (uint32_t)encoder_outbuf_size_,
-                    .encoded_bytes = 0,
-                };
-                auto ret = esp_opus_enc_process(opus_encoder_, &in, &out);
-                if (ret == ESP_AUDIO_ERR_OK) {
-                    packet->payload.assign(buf.data(), buf.data() + out.encoded_bytes);
-
-                    if (task->type == kAudioTaskTypeEncodeToSendQueue) {
-                        {
-                            std::lock_guard<std::mutex> lock2(audio_queue_mutex_);
-                            audio_send_queue_.push_back(std::move(packet));
-                        }
-                        if (callbacks_.on_send_queue_available) {
-                            callbacks_.on_send_queue_available();
-                        }
-                    } else if (task->type == kAudioTaskTypeEncodeToTestingQueue) {
-                        std::lock_guard<std::mutex> lock2(audio_queue_mutex_);
-                        audio_testing_queue_.push_back(std::move(packet));
+            if (samples > 0) {
+                /* Mixed right before the write, so a sound starts on the next chunk */
+                mixer_.Mix(task.pcm.data() + offset, samples);
+                speaker_dsp_.Process(task.pcm.data() + offset, samples);
+                codec_->OutputData(task.pcm.data() + offset, samples);
+                if (offset == 0 && turn_timeline.awaiting_playback()) {
+                    turn_timeline.OnPlayback();
+                }
+#if CONFIG_AUDIO_LATENCY_SELF_TEST
+                if (latency_probe_active_) {
+                    std::lock_guard<std::mutex> probe_lock(latency_probe_mutex_);
+                    if (latency_probe_ != nullptr) {
+                        latency_probe_->OnOutput(task.pcm.data() + offset, samples, esp_timer_get_time());
                     }
-                    debug_statistics_.encode_count++;
-                } else {
-                    ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
                 }
-            } else {
-                ESP_LOGE(TAG, "Failed to encode audio: encoder not configured or invalid frame size (got %u, expected %u)",
-                         task->pcm.size(), encoder_frame_size_);
+#endif
+#if CONFIG_USE_AUDIO_DEBUGGER
+                audio_debugger_->Feed(kAudioDebugTapPlayback, task.pcm.data() + offset, samples, 1, codec_->output_sample_rate());
+#endif
+#if CONFIG_USE_SERVER_AEC
+                /* Recorded per chunk, so the echo reference follows the samples actually written */
+                uint32_t timestamp = task.timestamp > 0 ? task.timestamp + offset * 1000 / codec_->output_sample_rate() : 0;
+                aec_reference_clock_.OnOutput(timestamp, samples, codec_->output_sample_rate());
+#endif
+            }
+            if (flushed) {
+                /* The faded tail is still in the look-ahead, it must not start the next reply */
+                speaker_dsp_.Reset();
+                break;
             }
-            lock.lock();
         }
     }
+    NotifyWaiter(sound_space_waiter_);
+    int64_t now_us = LatencyTracer::Now();
+    latency_tracer_.Record(kLatencyStagePlayback, task.trace_stage_us, now_us);
+    latency_tracer_.Record(kLatencyStageDownlink, task.trace_origin_us, now_us);
 
-    ESP_LOGW(TAG, "Opus codec task stopped");
-}
+    /* Update the last output time */
+    last_output_time_ = std::chrono::steady_clock::now();
+    debug_statistics_.playback_count++;
 
-void AudioService::SetDecodeSampleRate(int sample_rate, int frame_duration) {
-    if (decoder_sample_rate_ == sample_rate && decoder_duration_ms_ == frame_duration) {
-        return;
-    }
-    std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
-    if (opus_decoder_ != nullptr) {
-        esp_opus_dec_close(opus_decoder_);
-        opus_decoder_ = nullptr;
-    }
-    decoder_lock.unlock();
-    esp_opus_dec_cfg_t opus_dec_cfg = OPUS_DEC_CFG(sample_rate, frame_duration);
-    auto ret = esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &opus_decoder_);
-    if (opus_decoder_ == nullptr) {
-        ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", ret);
-        return;
-    }
-    decoder_sample_rate_ = sample_rate;
-    decoder_duration_ms_ = frame_duration;
-    decoder_frame_size_ = decoder_sample_rate_ / 1000 * frame_duration;
+}
 
-    auto codec = Board::GetInstance().GetAudioCodec();
-    if (decoder_sample_rate_ != codec->output_sample_rate()) {
-        ESP_LOGI(TAG, "Resampling audio from %d to %d", decoder_sample_rate_, codec->output_sample_rate());
-        if (output_resampler_ != nullptr) {
-            esp_ae_rate_cvt_close(output_resampler_);
-            output_resampler_ = nullptr;
-        }
-        esp_ae_rate_cvt_cfg_t output_resampler_cfg = RATE_CVT_CFG(
-            decoder_sample_rate_, codec->output_sample_rate(), ESP_AUDIO_MONO);
-        auto resampler_ret = esp_ae_rate_cvt_open(&output_resampler_cfg, &output_resampler_);
-        if (output_resampler_ == nullptr) {
-            ESP_LOGE(TAG, "Failed to create output resampler, error code: %d", resampler_ret);
+/* Play one chunk of the mixed sounds over silence */
+void AudioService::PlayMixer() {
+    EnableOutputPower();
+    {
+        std::lock_guard<std::mutex> lock(output_mutex_);
+        size_t samples = std::min<size_t>(mixer_.Prepare(), AUDIO_CODEC_DMA_FRAME_NUM);
+        if (samples > 0) {
+            mixer_output_.assign(samples, 0);
+            mixer_.Mix(mixer_output_.data(), samples);
+            speaker_dsp_.Process(mixer_output_.data(), samples);
+            codec_->OutputData(mixer_output_.data(), samples);
+#if CONFIG_USE_AUDIO_DEBUGGER
+            audio_debugger_->Feed(kAudioDebugTapPlayback, mixer_output_.data(), samples, 1, codec_->output_sample_rate());
+#endif
+#if CONFIG_USE_SERVER_AEC
+            aec_reference_clock_.OnOutput(0, samples, codec_->output_sample_rate());
+#endif
         }
     }
+    NotifyWaiter(sound_space_waiter_);
+    last_output_time_ = std::chrono::steady_clock::now();
 }
 
-void AudioService::PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm) {
-    auto task = std::make_unique<AudioTask>();
-    task->type = type;
-    task->pcm = std::move(pcm);
-    /* Push the task to the encode queue */
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-
-    /* If the task is to send queue, we need to set the timestamp */
-    if (type == kAudioTaskTypeEncodeToSendQueue && !timestamp_queue_.empty()) {
-        if (timestamp_queue_.size() <= MAX_TIMESTAMPS_IN_QUEUE) {
-            task->timestamp = timestamp_queue_.front();
-        } else {
-            ESP_LOGW(TAG, "Timestamp queue (%u) is full, dropping timestamp", timestamp_queue_.size());
+void AudioService::OpusCodecTask() {
+    while (!service_stopped_) {
+        decoder_power_lock_.Hold(true);
+        bool busy = DecodeNextPacket();
+        busy = EncodeNextTask() || busy;
+        if (!busy) {
+            decoder_power_lock_.Hold(false);
+            ulTaskNotifyTake(pdTRUE, DecoderWaitTicks());
         }
-        timestamp_queue_.pop_front();
     }
+    decoder_power_lock_.Hold(false);
 
-    audio_queue_cv_.wait(lock, [this]() { return audio_encode_queue_.size() < MAX_ENCODE_TASKS_IN_QUEUE; });
-    audio_encode_queue_.push_back(std::move(task));
-    audio_queue_cv_.notify_all();
+    ESP_LOGW(TAG, "Opus codec task stopped");
 }
 
-bool AudioService::PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait) {
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-    if (audio_decode_queue_.size() >= MAX_DECODE_PACKETS_IN_QUEUE) {
-        if (wait) {
-            audio_queue_cv_.wait(lock, [this]() { return audio_decode_queue_.size() < MAX_DECODE_PACKETS_IN_QUEUE; });
-        } else {
-            return false;
+void AudioService::OpusDecoderTask() {
+    while (!service_stopped_) {
+        decoder_power_lock_.Hold(true);
+        if (!DecodeNextPacket()) {
+            decoder_power_lock_.Hold(false);
+            ulTaskNotifyTake(pdTRUE, DecoderWaitTicks());
         }
     }
-    audio_decode_queue_.push_back(std::move(packet));
-    audio_queue_cv_.notify_all();
-    return true;
-}
+    decoder_power_lock_.Hold(false);
 
-std::unique_ptr<AudioStreamPacket> AudioService::PopPacketFromSendQueue() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    if (audio_send_queue_.empty()) {
-        return nullptr;
-    }
-    auto packet = std::move(audio_send_queue_.front());
-    audio_send_queue_.pop_front();
-    audio_queue_cv_.notify_all();
-    return packet;
+    ESP_LOGW(TAG, "Opus decoder task stopped");
 }
 
-void AudioService::EncodeWakeWord() {
-    if (wake_word_) {
-        wake_word_->EncodeWakeWordData();
+void AudioService::OpusEncoderTask() {
+    while (!service_stopped_) {
+        encoder_power_lock_.Hold(true);
+        if (!EncodeNextTask()) {
+            encoder_power_lock_.Hold(false);
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
     }
-}
+    encoder_power_lock_.Hold(false);
 
-const std::string& AudioService::GetLastWakeWord() const {
-    return wake_word_->GetLastDetectedWakeWord();
+    ESP_LOGW(TAG, "Opus encoder task stopped");
 }
 
-std::unique_ptr<AudioStreamPacket> AudioService::PopWakeWordPacket() {
-    auto packet = std::make_unique<AudioStreamPacket>();
-    if (wake_word_->GetWakeWordOpus(packet->payload)) {
-        return packet;
+TickType_t AudioService::DecoderWaitTicks() {
+    /* While the jitter buffer holds packets back, check again when their delay is over */
+    if (jitter_buffer_.size() > 0 && !audio_playback_queue_.Full()) {
+        return pdMS_TO_TICKS(JITTER_BUFFER_POLL_INTERVAL_MS);
     }
-    return nullptr;
+    return portMAX_DELAY;
 }
 
-void AudioService::EnableWakeWordDetection(bool enable) {
-    if (!wake_word_) {
-        return;
+bool AudioService::DecodeNextPacket() {
+    uint32_t resets = decoder_resets_;
+    if (resets != decoder_resets_seen_) {
+        decoder_resets_seen_ = resets;
+        ESP_LOGI(TAG, "Jitter buffer: jitter %d ms, delay %d ms, lost %lu, late %lu, underruns %lu", jitter_buffer_.jitter_ms(),
+            jitter_buffer_.target_delay_ms(), jitter_buffer_.lost_count(), jitter_buffer_.late_count(),
+            jitter_buffer_.underrun_count());
+        jitter_buffer_.Reset();
+#if CONFIG_AUDIO_DRIFT_COMPENSATION
+        drift_compensator_.Reset();
+        drift_underruns_ = jitter_buffer_.underrun_count();
+#endif
+        /* Drop the history of the reply before, the resampler keeps its buffers */
+        if (output_resampler_ != nullptr) {
+            output_resampler_->Reset();
+        }
+    }
+    jitter_buffer_.SetMinDelayFrames(std::max<int>(jitter_min_frames_, profile_jitter_min_frames_));
+    bool media = media_mode_;
+    if (media != jitter_media_) {
+        jitter_media_ = media;
+        jitter_buffer_.SetCapacity(media ? MAX_JITTER_BUFFER_PACKETS : MAX_DECODE_PACKETS_IN_QUEUE);
+#if CONFIG_AUDIO_MEDIA_STREAM
+        jitter_buffer_.SetPrebuffer(media ? CONFIG_AUDIO_MEDIA_PREBUFFER_MS : CONFIG_AUDIO_PLAYBACK_PREBUFFER_MS);
+#endif
+    }
+    audio_testing_queue_.Reclaim();
+
+    /* Move the packets that arrived into the jitter buffer */
+    int64_t now_ms = esp_timer_get_time() / 1000;
+    AudioStreamPacketPtr packet;
+    while (!jitter_buffer_.Full() && audio_decode_queue_.Pop(packet)) {
+        NotifyWaiter(decode_space_waiter_);
+        jitter_buffer_.Put(std::move(packet), now_ms);
+    }
+    audio_decode_queue_.Reclaim();
+    if (audio_playback_queue_.Full()) {
+        return false;
     }
 
-    ESP_LOGD(TAG, "%s wake word detection", enable ? "Enabling" : "Disabling");
-    if (enable) {
-        if (!wake_word_initialized_) {
-            if (!wake_word_->Initialize(codec_, models_list_)) {
-                ESP_LOGE(TAG, "Failed to initialize wake word");
-                return;
-            }
-            wake_word_initialized_ = true;
-        }
-        // Reset input resampler to clear cached data from previous mode (e.g. AudioProcessor)
-        // This prevents buffer overflow when switching between different feed sizes
-        {
-            std::lock_guard<std::mutex> lock(input_resampler_mutex_);
-            if (input_resampler_ != nullptr) {
-                esp_ae_rate_cvt_reset(input_resampler_);
-            }
+    /* Decode the audio from the jitter buffer, or replay the testing queue once audio testing stops */
+    bool testing_running = xEventGroupGetBits(event_group_) & AS_EVENT_AUDIO_TESTING_RUNNING;
+    auto result = jitter_buffer_.Get(packet, now_ms);
+    if (result == JitterBuffer::kJitterBufferEmpty) {
+        if (testing_running || !audio_testing_queue_.Pop(packet)) {
+            return false;
         }
-        wake_word_->Start();
-        xEventGroupSetBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
-    } else {
-        wake_word_->Stop();
-        xEventGroupClearBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
+        result = JitterBuffer::kJitterBufferPacket;
+    }
+    bool lost = result == JitterBuffer::kJitterBufferLost;
+    if (lost && opus_decoder_ == nullptr) {
+        return true;
     }
-}
 
-void AudioService::EnableVoiceProcessing(bool enable) {
-    ESP_LOGD(TAG, "%s voice processing", enable ? "Enabling" : "Disabling");
-    if (enable) {
-        if (!audio_processor_initialized_) {
-            audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS, models_list_);
-            audio_processor_initialized_ = true;
-        }
+    auto task = audio_task_pool_.Acquire();
+    task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+    task->timestamp = lost ? 0 : packet->timestamp;
 
-        /* We should make sure no audio is playing */
-        ResetDecoder();
-        audio_input_need_warmup_ = true;
-        // Reset input resampler to clear cached data from previous mode (e.g. WakeWord)
-        // This prevents buffer overflow when switching between different feed sizes
-        {
-            std::lock_guard<std::mutex> lock(input_resampler_mutex_);
-            if (input_resampler_ != nullptr) {
-                esp_ae_rate_cvt_reset(input_resampler_);
+    if (!lost) {
+        SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
+    }
+    if (opus_decoder_ != nullptr) {
+        /* Decode into the scratch buffer if the output has to be resampled, otherwise straight into the task */
+        bool resample = output_resampler_ != nullptr;
+        auto& pcm = resample ? decode_buffer_ : task->pcm;
+        pcm.resize(decoder_frame_size_);
+        /* A lost frame is concealed by the decoder from the audio before it */
+        esp_audio_dec_in_raw_t raw = {
+            .buffer = lost ? nullptr : (uint8_t *)(packet->payload.data()),
+            .len = lost ? 0 : (uint32_t)(packet->payload.size()),
+            .consumed = 0,
+            .frame_recover = lost ? ESP_AUDIO_DEC_RECOVERY_PLC : ESP_AUDIO_DEC_RECOVERY_NONE,
+        };
+        esp_audio_dec_out_frame_t out_frame = {
+            .buffer = (uint8_t *)(pcm.data()),
+            .len = (uint32_t)(pcm.size() * sizeof(int16_t)),
+            .decoded_size = 0,
+        };
+        esp_audio_dec_info_t dec_info = {};
+        std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
+        static auto decode_time = PerfCounters::GetInstance().Histogram("audio.decode_us");
+        int64_t decode_start_us = FrameTimerStart();
+        int64_t perf_start_us = esp_timer_get_time();
+        TRACE_BEGIN(kTraceOpusDecode);
+        auto ret = esp_opus_dec_decode(opus_decoder_, &raw, &out_frame, &dec_info);
+        TRACE_END(kTraceOpusDecode);
+        decode_time->Record(esp_timer_get_time() - perf_start_us);
+        FrameTimerStop(debug_statistics_.decode_time, decode_start_us);
+        decoder_lock.unlock();
+        if (ret == ESP_AUDIO_ERR_OK) {
+            pcm.resize(out_frame.decoded_size / sizeof(int16_t));
+            if (resample) {
+                /* The pooled task keeps its capacity, so this only allocates for the first frames */
+                task->pcm.resize(output_resampler_->MaxOutputFrames(pcm.size()));
+                int64_t resample_start_us = FrameTimerStart();
+                size_t frames = output_resampler_->Process(pcm.data(), pcm.size(), task->pcm.data(), task->pcm.size());
+                FrameTimerStop(debug_statistics_.resample_time, resample_start_us);
+                task->pcm.resize(frames);
+            }
+#if CONFIG_AUDIO_DRIFT_COMPENSATION
+            /* An underrun already moved the playout, the settled backlog is taken again */
+            if (jitter_buffer_.underrun_count() != drift_underruns_) {
+                drift_underruns_ = jitter_buffer_.underrun_count();
+                drift_compensator_.Reset();
+            }
+            drift_compensator_.Observe(GetBufferedPlaybackMs(), decoder_duration_ms_);
+            drift_compensator_.Process(task->pcm);
+#endif
+            if (!lost && packet->trace_origin_us > 0) {
+                task->trace_origin_us = packet->trace_origin_us;
+                task->trace_stage_us = LatencyTracer::Now();
+                latency_tracer_.Record(kLatencyStageDecode, task->trace_origin_us, task->trace_stage_us);
+            }
+#if CONFIG_AUDIO_DIRECT_PLAYBACK
+            if (!resample && audio_playback_queue_.Empty()) {
+                /* The frame is already at the codec rate, play it from here and skip the playback queue */
+                PlayTask(*task);
+                if (audio_decode_queue_.Empty() && jitter_buffer_.size() == 0) {
+                    NotifyWaiter(playback_empty_waiter_);
+                }
+                debug_statistics_.decode_count++;
+                return true;
             }
+#endif
+            /* Only the decoder pushes to the playback queue, so the space checked above is still there */
+            audio_playback_queue_.Push(std::move(task));
+            NotifyTask(audio_output_task_handle_);
+            debug_statistics_.decode_count++;
+        } else {
+            ESP_LOGE(TAG, "Failed to decode audio after resize, error code: %d", ret);
         }
-        audio_processor_->Start();
-        xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_PROCESSOR_RUNNING);
     } else {
-        audio_processor_->Stop();
-        xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_PROCESSOR_RUNNING);
+        ESP_LOGE(TAG, "Audio decoder is not configured");
     }
+    debug_statistics_.decode_count++;
+    return true;
 }
 
-void AudioService::EnableAudioTesting(bool enable) {
-    ESP_LOGI(TAG, "%s audio testing", enable ? "Enabling" : "Disabling");
-    if (enable) {
-        xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
-    } else {
-        xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
-        /* Copy audio_testing_queue_ to audio_decode_queue_ */
-        std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-        audio_decode_queue_ = std::move(audio_testing_queue_);
-        audio_queue_cv_.notify_all();
+bool AudioService::EncodeNextTask() {
+    if (encoder_config_changed_.exchange(false)) {
+        std::unique_lock<std::mutex> lock(encoder_config_mutex_);
+        AudioEncoderConfig config = encoder_config_;
+        lock.unlock();
+        OpenEncoder(config);
     }
-}
-
-void AudioService::EnableDeviceAec(bool enable) {
-    ESP_LOGI(TAG, "%s device AEC", enable ? "Enabling" : "Disabling");
-    if (!audio_processor_initialized_) {
-        audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS, models_list_);
-        audio_processor_initialized_ = true;
+    if (encoder_pcm_reset_.exchange(false)) {
+        encoder_pcm_.clear();
     }
-
-    audio_processor_->EnableDeviceAec(enable);
-}
-
-void AudioService::SetCallbacks(AudioServiceCallbacks& callbacks) {
-    callbacks_ = callbacks;
-}
-
-void AudioService::PlaySound(const std::string_view& ogg) {
-    if (!codec_->output_enabled()) {
-        esp_timer_stop(audio_power_timer_);
-        esp_timer_start_periodic(audio_power_timer_, AUDIO_POWER_CHECK_INTERVAL_MS * 1000);
-        codec_->EnableOutput(true);
+    audio_encode_queue_.Reclaim();
+    if (SendQueueFull()) {
+        return false;
     }
 
-    const uint8_t* buf = reinterpret_cast<const uint8_t*>(ogg.data());
-    size_t size = ogg.size();
-    size_t offset = 0;
-
-    auto find_page = [&](size_t start)->size_t {
-        for (size_t i = start; i + 4 <= size; ++i) {
-            if (buf[i] == 'O' && buf[i+1] == 'g' && buf[i+2] == 'g' && buf[i+3] == 'S') return i;
+    /* Collect PCM until there is a full encoder frame */
+    if (opus_encoder_ == nullptr || encoder_pcm_.size() < (size_t)encoder_frame_size_) {
+        AudioTaskPtr task;
+        if (!audio_encode_queue_.Pop(task)) {
+            return false;
         }
-        return static_cast<size_t>(-1);
-    };
-
-    bool seen_head = false;
-    bool seen_tags = false;
-    int sample_rate = 16000; // 默认值
+        NotifyWaiter(encode_space_waiter_);
+        if (opus_encoder_ == nullptr) {
+            ESP_LOGE(TAG, "Failed to encode audio: encoder not configured");
+            return true;
+        }
+        if (task->type != encoder_pcm_type_) {
+            encoder_pcm_.clear();
+            encoder_pcm_type_ = task->type;
+        }
+        if (encoder_pcm_.empty() || task->timestamp > 0) {
+            encoder_pcm_timestamp_ = task->timestamp;
+        }
+        if (encoder_pcm_.empty()) {
+            encoder_pcm_origin_us_ = task->trace_origin_us;
+            encoder_pcm_stage_us_ = task->trace_stage_us;
+        }
+        encoder_tail_origin_us_ = task->trace_origin_us;
+        encoder_tail_stage_us_ = task->trace_stage_us;
+        encoder_pcm_.insert(encoder_pcm_.end(), task->pcm.begin(), task->pcm.end());
+        if (encoder_pcm_.size() < (size_t)encoder_frame_size_) {
+            return true;
+        }
+    }
 
-    while (true) {
-        size_t pos = find_page(offset);
-        if (pos == static_cast<size_t>(-1)) break;
-        offset = pos;
-        if (offset + 27 > size) break;
-
-        const uint8_t* page = buf + offset;
-        uint8_t page_segments = page[26];
-        size_t seg_table_off = offset + 27;
-        if (seg_table_off + page_segments > size) break;
-
-        size_t body_size = 0;
-        for (size_t i = 0; i < page_segments; ++i) body_size += page[27 + i];
-
-        size_t body_off = seg_table_off + page_segments;
-        if (body_off + body_size > size) break;
-
-        // Parse packets using lacing
-        size_t cur = body_off;
-        size_t seg_idx = 0;
-        while (seg_idx < page_segments) {
-            size_t pkt_len = 0;
-            size_t pkt_start = cur;
-            bool continued = false;
-            do {
-                uint8_t l = page[27 + seg_idx++];
-                pkt_len += l;
-                cur += l;
-                continued = (l == 255);
-            } while (continued && seg_idx < page_segments);
-
-            if (pkt_len == 0) continue;
-            const uint8_t* pkt_ptr = buf + pkt_start;
-
-            if (!seen_head) {
-                // 解析OpusHead包
-                if (pkt_len >= 19 && std::memcmp(pkt_ptr, "OpusHead", 8) == 0) {
-                    seen_head = true;
-                    // OpusHead结构：[0-7] "OpusHead", [8] version, [9] channel_count, [10-11] pre_skip
-                    // [12-15] input_sample_rate, [16-17] output_gain, [18] mapping_family
-                    if (pkt_len >= 12) {
-                        uint8_t version = pkt_ptr[8];
-                        uint8_t channel_count = pkt_ptr[9];
-                        if (pkt_len >= 16) {
-                            // 读取输入采样率 (little-endian)
-                            sample_rate = pkt_ptr[12] | (pkt_ptr[13] << 8) |
-                                        (pkt_ptr[14] << 16) | (pkt_ptr[15] << 24);
-                            ESP_LOGI(TAG, "OpusHead: version=%d, channels=%d, sample_rate=%d",
-                                   version, channel_count, sample_rate);
-                        }
-                    }
-                }
-                continue;
-            }
-            if (!seen_tags) {
-                // Expect OpusTags in second packet
-                if (pkt_len >= 8 && std::memcmp(pkt_ptr, "OpusTags", 8) == 0) {
-                    seen_tags = true;
-                }
-                continue;
-            }
+    auto packet = AudioStreamPacket::Create();
+    packet->frame_duration = encoder_duration_ms_;
+    packet->sample_rate = encoder_sample_rate_;
+    /* The server AEC timestamp belongs to the first frame cut from a task */
+    packet->timestamp = encoder_pcm_timestamp_;
+    encoder_pcm_timestamp_ = 0;
+    packet->trace_origin_us = encoder_pcm_origin_us_;
+    packet->trace_stage_us = encoder_pcm_stage_us_;
+
+    /* Encode straight into the pooled payload, it keeps its capacity between frames */
+    packet->payload.resize(encoder_outbuf_size_);
+    esp_audio_enc_in_frame_t in = {
+        .buffer = (uint8_t *)(encoder_pcm_.data()),
+        .len = (uint32_t)(encoder_frame_size_ * sizeof(int16_t)),
+    };
+    esp_audio_enc_out_frame_t out = {
+        .buffer = packet->payload.data(),
+        .len = (uint32_t)encoder_outbuf_size_,
+        .encoded_bytes = 0,
+    };
+    static auto encode_time = PerfCounters::GetInstance().Histogram("audio.encode_us");
+    int64_t encode_start_us = FrameTimerStart();
+    int64_t perf_start_us = esp_timer_get_time();
+    TRACE_BEGIN(kTraceOpusEncode);
+    auto ret = esp_opus_enc_process(opus_encoder_, &in, &out);
+    TRACE_END(kTraceOpusEncode);
+    int64_t encode_us = esp_timer_get_time() - perf_start_us;
+    encode_time->Record(encode_us);
+    FrameTimerStop(debug_statistics_.encode_time, encode_start_us);
+    encoder_pcm_.erase(encoder_pcm_.begin(), encoder_pcm_.begin() + encoder_frame_size_);
+    /* What is left over came from the newest task */
+    encoder_pcm_origin_us_ = encoder_tail_origin_us_;
+    encoder_pcm_stage_us_ = encoder_tail_stage_us_;
+    if (ret != ESP_AUDIO_ERR_OK) {
+        ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
+        return true;
+    }
+    packet->payload.resize(out.encoded_bytes);
+    AdaptComplexity(encode_us);
+
+    if (encoder_pcm_type_ == kAudioTaskTypeEncodeToSendQueue) {
+        if (packet->trace_stage_us > 0) {
+            int64_t now_us = LatencyTracer::Now();
+            latency_tracer_.Record(kLatencyStageEncode, packet->trace_stage_us, now_us);
+            packet->trace_stage_us = now_us;
+        }
+#if CONFIG_FOLLOW_UP_TURN
+        if (HoldFollowUpPreroll(packet)) {
+            debug_statistics_.encode_count++;
+            return true;
+        }
+#endif
+#if CONFIG_UPLINK_VAD_GATE
+        if (uplink_gate_reset_.exchange(false)) {
+            uplink_gate_.Reset();
+        }
+        if (uplink_gate_enabled_) {
+            uplink_gate_.Process(std::move(packet), voice_detected_, [this](AudioStreamPacketPtr&& gated) {
+                PushPacketToSendQueue(std::move(gated));
+            });
+        } else {
+            PushPacketToSendQueue(std::move(packet));
+        }
+#else
+        PushPacketToSendQueue(std::move(packet));
+#endif
+    } else if (encoder_pcm_type_ == kAudioTaskTypeEncodeToTestingQueue) {
+        if (!audio_testing_queue_.Push(std::move(packet))) {
+            ESP_LOGW(TAG, "Audio testing queue is full, dropping packet");
+        }
+    }
+    debug_statistics_.encode_count++;
+    return true;
+}
+
+bool AudioService::OpenEncoder(const AudioEncoderConfig& config) {
+    int frame_duration = AS_OPUS_GET_FRAME_DRU_ENUM(config.frame_duration_ms);
+    if (frame_duration < 0) {
+        ESP_LOGE(TAG, "Invalid encoder frame duration: %d ms", config.frame_duration_ms);
+        return false;
+    }
+    esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG();
+    opus_enc_cfg.bitrate = config.bitrate;
+    opus_enc_cfg.frame_duration = (esp_opus_enc_frame_duration_t)frame_duration;
+    opus_enc_cfg.enable_fec = config.enable_fec;
+    opus_enc_cfg.enable_dtx = config.enable_dtx;
+    opus_enc_cfg.complexity = encoder_complexity_;
+    if (config.voip) {
+        opus_enc_cfg.application_mode = ESP_OPUS_ENC_APPLICATION_VOIP;
+    }
+
+    void* encoder = nullptr;
+    auto ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &encoder);
+    if (encoder == nullptr) {
+        ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
+        return false;
+    }
+    if (opus_encoder_ != nullptr) {
+        esp_opus_enc_close(opus_encoder_);
+    }
+    opus_encoder_ = encoder;
+    encoder_sample_rate_ = 16000;
+    encoder_duration_ms_ = config.frame_duration_ms;
+    esp_opus_enc_get_frame_size(opus_encoder_, &encoder_frame_size_, &encoder_outbuf_size_);
+    encoder_frame_size_ = encoder_frame_size_ / sizeof(int16_t);
+    active_encoder_config_ = config;
+    ESP_LOGI(TAG, "Opus encoder: bitrate %d, frame %d ms, fec %d, dtx %d, complexity %d%s", config.bitrate,
+        config.frame_duration_ms, config.enable_fec, config.enable_dtx, encoder_complexity_, config.voip ? ", voip" : "");
+    return true;
+}
+
+void AudioService::StoreEncoderConfig(const AudioEncoderConfig& config) {
+    std::lock_guard<std::mutex> lock(encoder_config_mutex_);
+    encoder_config_ = config;
+    encoder_config_changed_ = true;
+    NotifyTask(opus_encoder_task_handle_);
+}
+
+void AudioService::SetEncoderConfig(const AudioEncoderConfig& config) {
+    adaptive_encoder_ = false;
+    StoreEncoderConfig(config);
+}
+
+AudioEncoderConfig AudioService::GetEncoderConfig() {
+    std::lock_guard<std::mutex> lock(encoder_config_mutex_);
+    return encoder_config_;
+}
+
+void AudioService::SetCellularUplink(bool cellular) {
+    cellular_uplink_ = cellular;
+}
+
+void AudioService::SetNarrowbandAllowed(bool allowed) {
+    narrowband_allowed_ = allowed;
+    // A new session starts out wideband on the server side
+    narrowband_session_ = true;
+}
+
+/* The frames of a level are stretched on a modem link, where a packet costs more than its bytes */
+AudioEncoderConfig AudioService::GetLevelConfig(int level) const {
+    AudioEncoderConfig config = kEncoderLevels[level];
+    if (config.frame_duration_ms == OPUS_FRAME_DURATION_MS) {
+        config.frame_duration_ms = profile_frame_ms_;
+    }
+#if CONFIG_AUDIO_CELLULAR_FRAME_DURATION_MS > 0
+    if (encoder_cellular_) {
+        config.frame_duration_ms = std::max(config.frame_duration_ms, CONFIG_AUDIO_CELLULAR_FRAME_DURATION_MS);
+    }
+#endif
+    return config;
+}
+
+void AudioService::ApplyPerfProfile() {
+    auto& profile = PerfProfile::GetInstance();
+    int frame_ms = profile.Get(PerfProfile::kFrameMs, OPUS_FRAME_DURATION_MS);
+    profile_max_complexity_ = std::min(profile.Get(PerfProfile::kMaxComplexity, CONFIG_AUDIO_ENCODER_MAX_COMPLEXITY),
+        CONFIG_AUDIO_ENCODER_MAX_COMPLEXITY);
+    profile_jitter_min_frames_ = profile.Get(PerfProfile::kJitterMinFrames, 1);
+    decode_queue_limit_ = profile.Get(PerfProfile::kDecodeQueuePackets, MAX_DECODE_PACKETS_IN_QUEUE);
+    send_queue_limit_ = profile.Get(PerfProfile::kSendQueuePackets, MAX_SEND_PACKETS_IN_QUEUE);
+    if (frame_ms != profile_frame_ms_.exchange(frame_ms)) {
+        profile_changed_ = true;
+    }
+    ESP_LOGI(TAG, "Profile: frame %d ms, max complexity %d, jitter floor %d, decode queue %u, send queue %u", frame_ms,
+        profile_max_complexity_.load(), profile_jitter_min_frames_.load(), (unsigned)decode_queue_limit_.load(),
+        (unsigned)send_queue_limit_.load());
+}
+
+void AudioService::EnableAdaptiveEncoder(bool enable) {
+    adaptive_encoder_ = enable;
+}
+
+void AudioService::ReportTransportFeedback(const TransportFeedback& feedback) {
+    if (!feedback.sent) {
+        transport_failures_++;
+    } else if (feedback.send_time_us > ENCODER_SLOW_SEND_US) {
+        transport_slow_sends_++;
+    }
+}
+
+void AudioService::ReportTransportCongestion() {
+    transport_congested_ = true;
+}
+
+/* Turn the transport counters into the signals the encoder and the jitter buffer use */
+void AudioService::UpdateTransportStats(const TransportStats& stats) {
+    // The counters start over with every channel, which any of them going back shows
+    auto& last = last_transport_stats_;
+    if (stats.rx_packets < last.rx_packets || stats.rx_reordered < last.rx_reordered ||
+        stats.tx_packets < last.tx_packets || stats.tx_failures < last.tx_failures) {
+        last = TransportStats();
+    }
+    uint32_t received = stats.rx_packets - last.rx_packets;
+    // A late packet fills its gap, so the lost count alone may go back
+    uint32_t lost = stats.rx_lost > last.rx_lost ? stats.rx_lost - last.rx_lost : 0;
+    uint32_t reordered = stats.rx_reordered - last.rx_reordered;
+    last = stats;
+
+    if (received + lost >= 5 && lost * 100 > (received + lost) * TRANSPORT_LOSSY_PERCENT) {
+        transport_lossy_ = true;
+    }
+    if (reordered > 0) {
+        transport_reorder_intervals_ = TRANSPORT_REORDER_HOLD_INTERVALS;
+    } else if (transport_reorder_intervals_ > 0) {
+        transport_reorder_intervals_--;
+    }
+    // A frame more is enough to put a swapped pair back in order instead of dropping one as late
+    jitter_min_frames_ = transport_reorder_intervals_ > 0 ? 2 : 1;
+}
+
+/*
+ * Called by the encoder task for every packet it sends. Once per interval the deepest send
+ * queue and the transport feedback decide whether to step to a more robust encoder level,
+ * or back to a better one after a few good intervals in a row.
+ */
+void AudioService::AdaptEncoder() {
+    send_queue_peak_ = std::max(send_queue_peak_, audio_send_queue_.Size());
+    int64_t now_ms = esp_timer_get_time() / 1000;
+    if (now_ms - encoder_adapt_time_ms_ < ENCODER_ADAPT_INTERVAL_MS) {
+        return;
+    }
+    encoder_adapt_time_ms_ = now_ms;
+    uint32_t failures = transport_failures_.exchange(0);
+    uint32_t slow_sends = transport_slow_sends_.exchange(0);
+    bool lossy = transport_lossy_.exchange(false);
+    bool congested = transport_congested_.exchange(false);
+    int queued_ms = send_queue_peak_ * encoder_duration_ms_;
+    send_queue_peak_ = 0;
+    if (!adaptive_encoder_) {
+        return;
+    }
+
+    bool cellular = cellular_uplink_;
+    bool profile_changed = profile_changed_.exchange(false);
+    if (cellular != encoder_cellular_ || profile_changed) {
+        if (cellular != encoder_cellular_) {
+            ESP_LOGI(TAG, "Uplink is %s", cellular ? "a modem link" : "no modem link");
+        }
+        encoder_cellular_ = cellular;
+        StoreEncoderConfig(GetLevelConfig(encoder_level_));
+    }
+
+    if (narrowband_session_.exchange(false)) {
+        encoder_narrowband_ = false;
+    }
+    int max_level = narrowband_allowed_ ? ENCODER_MAX_LEVEL : std::min(ENCODER_MAX_LEVEL, ENCODER_NARROWBAND_LEVEL - 1);
+    int level = std::min(encoder_level_, max_level);
+    if (failures > 0 || slow_sends > 2 || lossy || congested || queued_ms >= ENCODER_CONGESTED_QUEUE_MS) {
+        level = std::min(level + 1, max_level);
+        encoder_good_intervals_ = 0;
+    } else if (slow_sends == 0 && !lossy && !congested && queued_ms <= encoder_duration_ms_) {
+        if (++encoder_good_intervals_ >= ENCODER_RECOVER_INTERVALS) {
+            level = std::max(level - 1, ENCODER_MIN_LEVEL);
+            encoder_good_intervals_ = 0;
+        }
+    } else {
+        encoder_good_intervals_ = 0;
+    }
+
+    if (level != encoder_level_) {
+        ESP_LOGI(TAG, "Uplink %s (queued %d ms, %lu failed, %lu slow%s%s), encoder level %d -> %d",
+            level > encoder_level_ ? "congested" : "recovered", queued_ms, failures, slow_sends, lossy ? ", lossy" : "",
+            congested ? ", behind" : "", encoder_level_, level);
+        encoder_level_ = level;
+        StoreEncoderConfig(GetLevelConfig(level));
+    }
+
+    /* The server is told, so it may send the TTS narrowband too */
+    bool narrowband = level >= ENCODER_NARROWBAND_LEVEL;
+    if (narrowband != encoder_narrowband_) {
+        encoder_narrowband_ = narrowband;
+        if (callbacks_.on_narrowband_change) {
+            callbacks_.on_narrowband_change(narrowband);
+        }
+    }
+}
+
+/*
+ * Called by the encoder task after every frame. Once per interval the slowest frame of it
+ * decides: above ENCODER_COMPLEXITY_LOWER_LOAD of the frame duration the complexity goes down
+ * a step, and it goes up a step after a few intervals below ENCODER_COMPLEXITY_RAISE_LOAD.
+ * A full encode queue means the task fell behind, it drops two steps without waiting.
+ */
+void AudioService::AdaptComplexity(int64_t encode_us) {
+#if CONFIG_AUDIO_ENCODER_MAX_COMPLEXITY > 0
+    int load = encode_us * 100 / (encoder_duration_ms_ * 1000);
+    encoder_load_peak_ = std::max(encoder_load_peak_, load);
+    bool backlog = audio_encode_queue_.Full();
+    int64_t now_ms = esp_timer_get_time() / 1000;
+    if (!backlog && now_ms - complexity_time_ms_ < ENCODER_ADAPT_INTERVAL_MS) {
+        return;
+    }
+    complexity_time_ms_ = now_ms;
+    int peak = encoder_load_peak_;
+    encoder_load_peak_ = 0;
+
+    int complexity = encoder_complexity_;
+    if (backlog || peak > ENCODER_COMPLEXITY_LOWER_LOAD) {
+        complexity = std::max(0, complexity - (backlog ? 2 : 1));
+        encoder_light_intervals_ = 0;
+    } else if (peak < ENCODER_COMPLEXITY_RAISE_LOAD) {
+        if (++encoder_light_intervals_ >= ENCODER_COMPLEXITY_RAISE_INTERVALS) {
+            complexity = complexity + 1;
+            encoder_light_intervals_ = 0;
+        }
+    } else {
+        encoder_light_intervals_ = 0;
+    }
+    complexity = std::min<int>(complexity, profile_max_complexity_);
+    if (complexity != encoder_complexity_) {
+        ESP_LOGI(TAG, "Encoder load %d%%%s, complexity %d -> %d", peak, backlog ? ", backlog" : "",
+            encoder_complexity_, complexity);
+        encoder_complexity_ = complexity;
+        static auto complexity_gauge = PerfCounters::GetInstance().Gauge("audio.encoder_complexity");
+        complexity_gauge->Set(complexity);
+        OpenEncoder(active_encoder_config_);
+    }
+#else
+    (void)encode_us;
+#endif
+}
+
+/* Opus decodes a stream at any of its rates, so a music stream goes to the output rate without a resampler */
+static int GetDecodeRate(int sample_rate, int output_rate) {
+    bool opus_rate = output_rate == 8000 || output_rate == 12000 || output_rate == 16000 || output_rate == 24000 ||
+        output_rate == 48000;
+    return sample_rate > 24000 && opus_rate ? output_rate : sample_rate;
+}
+
+/* Switch to the cached decoder of this format, or reopen the least recently used one */
+void AudioService::SetDecodeSampleRate(int sample_rate, int frame_duration) {
+    if (opus_decoder_ != nullptr && decoder_sample_rate_ == sample_rate && decoder_duration_ms_ == frame_duration) {
+        return;
+    }
+    auto slot = std::find_if(decoder_cache_.begin(), decoder_cache_.end(), [&](const DecoderSlot& slot) {
+        return slot.decoder != nullptr && slot.sample_rate == sample_rate && slot.duration_ms == frame_duration;
+    });
+    bool cached = slot != decoder_cache_.end();
+    if (!cached) {
+        slot = std::min_element(decoder_cache_.begin(), decoder_cache_.end(), [](const DecoderSlot& a, const DecoderSlot& b) {
+            return a.last_used < b.last_used;
+        });
+    }
+
+    std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
+    opus_decoder_ = nullptr;
+    output_resampler_ = nullptr;
+    if (!cached && slot->decoder != nullptr) {
+        esp_opus_dec_close(slot->decoder);
+        slot->decoder = nullptr;
+    }
+    decoder_lock.unlock();
+
+    if (cached) {
+        /* Left over from an earlier stream */
+        esp_opus_dec_reset(slot->decoder);
+        slot->resampler.Reset();
+    } else {
+        slot->resampler.Close();
+        int decode_rate = GetDecodeRate(sample_rate, codec_->output_sample_rate());
+        esp_opus_dec_cfg_t opus_dec_cfg = OPUS_DEC_CFG(decode_rate, frame_duration);
+        auto ret = esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &slot->decoder);
+        if (slot->decoder == nullptr) {
+            ESP_LOGE(TAG, "Failed to create audio decoder, error code: %d", ret);
+            slot->last_used = 0;
+            return;
+        }
+        slot->sample_rate = sample_rate;
+        slot->decode_rate = decode_rate;
+        slot->duration_ms = frame_duration;
+        if (decode_rate != codec_->output_sample_rate()) {
+            ESP_LOGI(TAG, "Resampling audio from %d to %d", decode_rate, codec_->output_sample_rate());
+            slot->resampler.Open(decode_rate, codec_->output_sample_rate(), 1);
+        } else if (decode_rate != sample_rate) {
+            ESP_LOGI(TAG, "Decoding the %d Hz stream at %d Hz", sample_rate, decode_rate);
+        }
+    }
+    slot->last_used = ++decoder_use_count_;
+
+    decoder_lock.lock();
+    opus_decoder_ = slot->decoder;
+    output_resampler_ = slot->resampler.IsOpen() ? &slot->resampler : nullptr;
+    decoder_lock.unlock();
+    decoder_sample_rate_ = sample_rate;
+    decoder_duration_ms_ = frame_duration;
+    decoder_frame_size_ = slot->decode_rate / 1000 * frame_duration;
+}
+
+void AudioService::SetMediaMode(bool media) {
+    if (media_mode_.exchange(media) == media) {
+        return;
+    }
+    ESP_LOGI(TAG, "Media mode %s", media ? "on" : "off");
+#if CONFIG_AUDIO_SPLIT_OPUS_TASKS
+    /* Below the microphone path, a late decode only eats into the deeper prebuffer */
+    if (opus_decoder_task_handle_ != nullptr) {
+        UBaseType_t priority = TaskProfiles::Get(kTaskOpusDecoder).priority;
+        if (media) {
+            UBaseType_t voice = std::min({TaskProfiles::Get(kTaskAudioInput).priority,
+                TaskProfiles::Get(kTaskAudioProcessor).priority, TaskProfiles::Get(kTaskOpusEncoder).priority});
+            priority = std::min<UBaseType_t>(priority, voice > 1 ? voice - 1 : 1);
+        }
+        vTaskPrioritySet(opus_decoder_task_handle_, priority);
+    }
+#endif
+    NotifyTask(opus_decoder_task_handle_);
+}
+
+void AudioService::PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm, int64_t capture_time_us) {
+    auto task = audio_task_pool_.Acquire();
+    task->type = type;
+    /* The caller gets the buffer of the pooled task back, so a producer that keeps it never allocates */
+    task->pcm.swap(pcm);
+    pcm.clear();
+    if (capture_time_us > 0) {
+        task->trace_origin_us = capture_time_us;
+        task->trace_stage_us = LatencyTracer::Now();
+        latency_tracer_.Record(kLatencyStageProcess, task->trace_origin_us, task->trace_stage_us);
+    }
+
+#if CONFIG_USE_SERVER_AEC
+    /* The server timestamp playing when the frame was captured */
+    if (type == kAudioTaskTypeEncodeToSendQueue) {
+        task->timestamp = aec_reference_clock_.TakeCapture(task->pcm.size());
+    }
+#endif
+
+    /* Push the task to the encode queue */
+    std::lock_guard<std::mutex> lock(encode_producer_mutex_);
+    WaitOn(encode_space_waiter_, [this]() { return service_stopped_ || !audio_encode_queue_.Full(); });
+    if (service_stopped_) {
+        return;
+    }
+    audio_encode_queue_.Push(std::move(task));
+    NotifyTask(opus_encoder_task_handle_);
+}
+
+bool AudioService::PushPacketToDecodeQueue(AudioStreamPacketPtr packet, bool wait) {
+    /* Only packets from the server are traced, local sounds are queued all at once */
+    if (packet->sequence != 0) {
+        packet->trace_origin_us = LatencyTracer::Now();
+    }
+    std::lock_guard<std::mutex> lock(decode_producer_mutex_);
+    if (DecodeQueueFull()) {
+        if (!wait) {
+            return false;
+        }
+        WaitOn(decode_space_waiter_, [this]() { return service_stopped_ || !DecodeQueueFull(); });
+    }
+    if (!audio_decode_queue_.Push(std::move(packet))) {
+        return false;
+    }
+    NotifyTask(opus_decoder_task_handle_);
+    return true;
+}
+
+AudioStreamPacketPtr AudioService::PopPacketFromSendQueue() {
+    AudioStreamPacketPtr packet;
+    if (!audio_send_queue_.Pop(packet)) {
+        return nullptr;
+    }
+    /* There is room in the send queue again */
+    NotifyTask(opus_encoder_task_handle_);
+    RecordSendLatency(*packet);
+    return packet;
+}
+
+void AudioService::PushPacketToSendQueue(AudioStreamPacketPtr packet) {
+#if CONFIG_UPLINK_STAGING_BUFFER_MS > 0
+    /* Live packets queue behind the staged ones until those are all sent, to keep the order.
+       Only the staging itself is bounded, by the speech it holds, the live packets get the
+       room of the send queue on top */
+    if (uplink_staging_ || !uplink_staging_queue_.Empty()) {
+        int duration = packet->frame_duration;
+        if (uplink_staging_ && uplink_staged_ms_ + duration > CONFIG_UPLINK_STAGING_BUFFER_MS) {
+            uplink_staging_dropped_++;
+        } else if (!uplink_staging_queue_.Push(std::move(packet))) {
+            ESP_LOGW(TAG, "Uplink staging buffer is full, dropping packet");
+        } else if (uplink_staging_) {
+            uplink_staged_ms_ += duration;
+        }
+        if (!uplink_staging_ && callbacks_.on_send_queue_available) {
+            callbacks_.on_send_queue_available();
+        }
+        AdaptEncoder();
+        return;
+    }
+#endif
+    audio_send_queue_.Push(std::move(packet));
+    if (callbacks_.on_send_queue_available) {
+        callbacks_.on_send_queue_available();
+    }
+    AdaptEncoder();
+}
+
+bool AudioService::StartUplinkStaging() {
+#if CONFIG_UPLINK_STAGING_BUFFER_MS > 0
+    uplink_staging_queue_.Clear();
+    uplink_staged_ms_ = 0;
+    uplink_staging_dropped_ = 0;
+    uplink_staging_ = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void AudioService::StopUplinkStaging(bool flush) {
+    if (!uplink_staging_) {
+        return;
+    }
+#if CONFIG_UPLINK_STAGING_BUFFER_MS > 0
+    if (!flush) {
+        uplink_staging_queue_.Clear();
+    }
+    ESP_LOGI(TAG, "Uplink staging stopped, %u packets to send, %" PRIu32 " dropped past %d ms",
+        uplink_staging_queue_.Size(), uplink_staging_dropped_.load(), CONFIG_UPLINK_STAGING_BUFFER_MS);
+    staging_flush_start_ms_ = esp_timer_get_time() / 1000;
+    staging_flushed_ms_ = 0;
+#endif
+    uplink_staging_ = false;
+    if (flush && callbacks_.on_send_queue_available) {
+        callbacks_.on_send_queue_available();
+    }
+}
+
+void AudioService::EnableUplinkGate(bool enable) {
+#if CONFIG_UPLINK_VAD_GATE
+    if (uplink_gate_enabled_.exchange(enable) != enable) {
+        ESP_LOGI(TAG, "Uplink gate %s", enable ? "enabled" : "disabled");
+        uplink_gate_reset_ = true;
+    }
+#endif
+}
+
+void AudioService::StartFollowUpStandby() {
+#if CONFIG_FOLLOW_UP_TURN
+    follow_up_drop_ = true;
+    follow_up_standby_ = true;
+#endif
+}
+
+void AudioService::StopFollowUpStandby(bool send) {
+#if CONFIG_FOLLOW_UP_TURN
+    if (!send) {
+        follow_up_drop_ = true;
+    }
+    follow_up_standby_ = false;
+#endif
+}
+
+#if CONFIG_FOLLOW_UP_TURN
+/* In the standby the newest packets wait as pre-roll, the first packet after it sends them ahead */
+bool AudioService::HoldFollowUpPreroll(AudioStreamPacketPtr& packet) {
+    if (follow_up_drop_.exchange(false)) {
+        follow_up_preroll_.clear();
+    }
+    if (follow_up_standby_) {
+        follow_up_preroll_.push_back(std::move(packet));
+        if (follow_up_preroll_.size() > FOLLOW_UP_PREROLL_PACKETS) {
+            follow_up_preroll_.pop_front();
+        }
+        return true;
+    }
+    while (!follow_up_preroll_.empty()) {
+        PushPacketToSendQueue(std::move(follow_up_preroll_.front()));
+        follow_up_preroll_.pop_front();
+    }
+    return false;
+}
+#endif
+
+/* The staged packets go first, at once or at their realtime pace */
+size_t AudioService::PopStagedPackets(AudioStreamPacketPtr* packets, size_t max_count) {
+    size_t count = 0;
+#if CONFIG_UPLINK_STAGING_BUFFER_MS > 0
+    if (uplink_staging_) {
+        return 0;
+    }
+    while (count < max_count) {
+#if !CONFIG_UPLINK_STAGING_FAST_FLUSH
+        if (staging_flushed_ms_ > esp_timer_get_time() / 1000 - staging_flush_start_ms_) {
+            break;
+        }
+#endif
+        if (!uplink_staging_queue_.Pop(packets[count])) {
+            break;
+        }
+        staging_flushed_ms_ += packets[count]->frame_duration;
+        RecordSendLatency(*packets[count]);
+        count++;
+    }
+#endif
+    return count;
+}
+
+size_t AudioService::PopPacketsFromSendQueue(AudioStreamPacketPtr* packets, size_t max_count) {
+    size_t count = PopStagedPackets(packets, max_count);
+    while (count < max_count && audio_send_queue_.Pop(packets[count])) {
+        RecordSendLatency(*packets[count]);
+        count++;
+    }
+    if (count > 0) {
+        /* Wake the encoder once for the whole batch */
+        NotifyTask(opus_encoder_task_handle_);
+    }
+    return count;
+}
+
+void AudioService::RecordSendLatency(const AudioStreamPacket& packet) {
+    if (packet.trace_stage_us > 0) {
+        int64_t now_us = LatencyTracer::Now();
+        latency_tracer_.Record(kLatencyStageSend, packet.trace_stage_us, now_us);
+        latency_tracer_.Record(kLatencyStageUplink, packet.trace_origin_us, now_us);
+    }
+}
+
+void AudioService::EncodeWakeWord() {
+    std::lock_guard<std::mutex> lock(wake_word_mutex_);
+    if (wake_word_) {
+        wake_word_->EncodeWakeWordData();
+    }
+}
+
+std::string AudioService::GetLastWakeWord() const {
+    std::lock_guard<std::mutex> lock(last_wake_word_mutex_);
+    return last_wake_word_;
+}
+
+AudioStreamPacketPtr AudioService::PopWakeWordPacket() {
+    std::lock_guard<std::mutex> lock(wake_word_mutex_);
+    auto packet = AudioStreamPacket::Create();
+    if (wake_word_ && wake_word_->GetWakeWordOpus(packet->payload)) {
+        return packet;
+    }
+    return nullptr;
+}
+
+void AudioService::EnableWakeWordDetection(bool enable) {
+    if (!wake_word_) {
+        return;
+    }
+
+    ESP_LOGD(TAG, "%s wake word detection", enable ? "Enabling" : "Disabling");
+    if (enable) {
+        if (!InitializeWakeWord()) {
+            return;
+        }
+        // Reset input resampler to clear cached data from previous mode (e.g. AudioProcessor)
+        // This prevents buffer overflow when switching between different feed sizes
+        if (!shared_afe_) {
+            std::lock_guard<std::mutex> lock(input_resampler_mutex_);
+            input_resampler_.Reset();
+        }
+#if CONFIG_WAKE_WORD_VOICE_GATE
+        voice_gate_reset_ = true;
+#endif
+        std::lock_guard<std::mutex> lock(wake_word_mutex_);
+        if (wake_word_) {
+            wake_word_->Start();
+            xEventGroupSetBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
+        }
+    } else {
+        std::lock_guard<std::mutex> lock(wake_word_mutex_);
+        if (wake_word_) {
+            wake_word_->Stop();
+        }
+        xEventGroupClearBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
+    }
+}
+
+bool AudioService::PrepareWakeWord() {
+    return wake_word_ != nullptr && InitializeWakeWord();
+}
+
+/* Linear interpolation is enough for the low rate of the pre-roll, there is nothing above it to alias */
+void AudioService::FeedWakeWordPreRoll(const std::vector<int16_t>& pcm, int sample_rate) {
+    if (pcm.size() < 2 || sample_rate <= 0 || sample_rate > 16000) {
+        return;
+    }
+    size_t frames = (pcm.size() - 1) * 16000 / sample_rate + 1;
+    std::lock_guard<std::mutex> lock(wake_word_mutex_);
+    wake_word_pre_roll_.resize(frames);
+    for (size_t i = 0; i < frames; i++) {
+        int64_t position_q16 = ((int64_t)i * sample_rate << 16) / 16000;
+        size_t index = std::min<size_t>(position_q16 >> 16, pcm.size() - 1);
+        size_t next = std::min(index + 1, pcm.size() - 1);
+        int32_t fraction = position_q16 & 0xffff;
+        wake_word_pre_roll_[i] = pcm[index] + (((int64_t)pcm[next] - pcm[index]) * fraction >> 16);
+    }
+    ESP_LOGI(TAG, "Pre-roll of %u ms for the wake word", frames / 16);
+}
+
+bool AudioService::InitializeWakeWord() {
+    std::lock_guard<std::mutex> lock(initialize_mutex_);
+    if (wake_word_initialized_) {
+        return true;
+    }
+#if CONFIG_USE_SHARED_AFE
+    if (auto afe_wake_word = dynamic_cast<AfeWakeWord*>(wake_word_.get())) {
+        if (!audio_processor_initialized_) {
+            audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS, models_list_);
+            audio_processor_initialized_ = true;
+            processor_models_list_ = models_list_;
+        }
+        afe_wake_word->UseSharedAfe(static_cast<AfeAudioProcessor*>(audio_processor_.get()));
+    }
+#endif
+    if (!wake_word_->Initialize(codec_, models_list_)) {
+        ESP_LOGE(TAG, "Failed to initialize wake word");
+        return false;
+    }
+    wake_word_initialized_ = true;
+#if CONFIG_USE_SHARED_AFE
+    shared_afe_ = IsAfeWakeWord() && static_cast<AfeWakeWord*>(wake_word_.get())->IsSharedAfe();
+#endif
+    return true;
+}
+
+void AudioService::EnableVoiceProcessing(bool enable) {
+    ESP_LOGD(TAG, "%s voice processing", enable ? "Enabling" : "Disabling");
+    if (enable) {
+        InitializeAudioProcessor();
+        /* Let the processor output frames as long as the encoder frames, for the lowest latency */
+        audio_processor_->SetFrameDuration(std::min(GetEncoderConfig().frame_duration_ms, OPUS_FRAME_DURATION_MS));
+        encoder_pcm_reset_ = true;
+        latency_tracer_.ResetCapture();
+#if CONFIG_USE_SERVER_AEC
+        aec_reference_clock_.ResetCapture();
+#endif
+
+        /* We should make sure no audio is playing */
+        ResetDecoder();
+        // A shared AFE that runs the wake word is already warm, with the same feed size
+        if (!shared_afe_ || !IsWakeWordRunning()) {
+            audio_input_need_warmup_ = true;
+            // Reset input resampler to clear cached data from previous mode (e.g. WakeWord)
+            // This prevents buffer overflow when switching between different feed sizes
+            std::lock_guard<std::mutex> lock(input_resampler_mutex_);
+            input_resampler_.Reset();
+        }
+        audio_processor_->Start();
+        xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_PROCESSOR_RUNNING);
+    } else {
+        audio_processor_->Stop();
+        xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_PROCESSOR_RUNNING);
+        // Speech staged for a channel that never opened
+        StopUplinkStaging(false);
+    }
+}
+
+void AudioService::EnableAudioTesting(bool enable) {
+    ESP_LOGI(TAG, "%s audio testing", enable ? "Enabling" : "Disabling");
+    if (enable) {
+        audio_testing_queue_.Clear();
+        xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
+    } else {
+        xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
+        /* The opus decoder plays back audio_testing_queue_ once testing is stopped */
+        NotifyTask(opus_decoder_task_handle_);
+    }
+}
+
+void AudioService::EnableDeviceAec(bool enable) {
+    ESP_LOGI(TAG, "%s device AEC", enable ? "Enabling" : "Disabling");
+    InitializeAudioProcessor();
+    audio_processor_->EnableDeviceAec(enable);
+}
+
+void AudioService::InitializeAudioProcessor() {
+    std::lock_guard<std::mutex> lock(initialize_mutex_);
+    if (!audio_processor_initialized_) {
+        audio_processor_->Initialize(codec_, OPUS_FRAME_DURATION_MS, models_list_);
+        audio_processor_initialized_ = true;
+        processor_models_list_ = models_list_;
+    }
+}
+
+void AudioService::SetCallbacks(AudioServiceCallbacks& callbacks) {
+    callbacks_ = callbacks;
+}
+
+void AudioService::PlaySound(const std::string_view& ogg, SoundPriority priority) {
+    auto pcm = sound_cache_.Find(ogg);
+    if (pcm == nullptr) {
+        PlaySound(std::make_unique<MemorySoundSource>(ogg), priority);
+        return;
+    }
+    EnableOutputPower();
+    if (priority == kSoundPriorityHigh) {
+        ResetDecoder();
+    }
+    sound_player_.Play(std::move(pcm), priority);
+}
+
+bool AudioService::PreloadSound(const std::string_view& ogg) {
+    return sound_cache_.Preload(ogg);
+}
+
+bool AudioService::PlaySoundAsset(const std::string& name, SoundPriority priority) {
+    void* ptr = nullptr;
+    size_t size = 0;
+    if (!Assets::GetInstance().GetAssetData(name, ptr, size)) {
+        ESP_LOGE(TAG, "Sound asset %s not found", name.c_str());
+        return false;
+    }
+    // The asset stays mapped, so it is read from flash while it plays
+    PlaySound(std::make_unique<MemorySoundSource>(std::string_view(static_cast<const char*>(ptr), size)), priority);
+    return true;
+}
+
+void AudioService::PlaySoundUrl(const std::string& url, SoundPriority priority) {
+    PlaySound(std::make_unique<HttpSoundSource>(url), priority);
+}
+
+void AudioService::PlaySound(std::unique_ptr<SoundSource> source, SoundPriority priority) {
+    EnableOutputPower();
+    if (priority == kSoundPriorityHigh) {
+        ResetDecoder();
+    }
+    sound_player_.Play(std::move(source), priority);
+}
+
+/* Decode a packet of a mixed sound in the sound player task, blocks while the mixer is full */
+bool AudioService::MixSoundPacket(AudioStreamPacketPtr packet, uint32_t generation) {
+    auto cancelled = [this, generation]() { return service_stopped_ || sound_player_.generation() != generation; };
+    if (sound_decoder_ == nullptr || sound_decoder_sample_rate_ != packet->sample_rate ||
+        sound_decoder_duration_ms_ != packet->frame_duration) {
+        CloseSoundDecoder();
+        esp_opus_dec_cfg_t opus_dec_cfg = OPUS_DEC_CFG(packet->sample_rate, packet->frame_duration);
+        auto ret = esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &sound_decoder_);
+        if (sound_decoder_ == nullptr) {
+            ESP_LOGE(TAG, "Failed to create sound decoder, error code: %d", ret);
+            return false;
+        }
+        sound_decoder_sample_rate_ = packet->sample_rate;
+        sound_decoder_duration_ms_ = packet->frame_duration;
+        if (sound_decoder_sample_rate_ != codec_->output_sample_rate()) {
+            sound_resampler_.Open(sound_decoder_sample_rate_, codec_->output_sample_rate(), 1);
+        }
+    }
+
+    sound_pcm_.resize(sound_decoder_sample_rate_ / 1000 * sound_decoder_duration_ms_);
+    esp_audio_dec_in_raw_t raw = {
+        .buffer = (uint8_t *)(packet->payload.data()),
+        .len = (uint32_t)(packet->payload.size()),
+        .consumed = 0,
+        .frame_recover = ESP_AUDIO_DEC_RECOVERY_NONE,
+    };
+    esp_audio_dec_out_frame_t out_frame = {
+        .buffer = (uint8_t *)(sound_pcm_.data()),
+        .len = (uint32_t)(sound_pcm_.size() * sizeof(int16_t)),
+        .decoded_size = 0,
+    };
+    esp_audio_dec_info_t dec_info = {};
+    auto ret = esp_opus_dec_decode(sound_decoder_, &raw, &out_frame, &dec_info);
+    if (ret != ESP_AUDIO_ERR_OK) {
+        ESP_LOGE(TAG, "Failed to decode sound, error code: %d", ret);
+        return true;
+    }
+    const int16_t* pcm = sound_pcm_.data();
+    size_t samples = out_frame.decoded_size / sizeof(int16_t);
+    if (sound_resampler_.IsOpen()) {
+        sound_resampled_.resize(sound_resampler_.MaxOutputFrames(samples));
+        samples = sound_resampler_.Process(pcm, samples, sound_resampled_.data(), sound_resampled_.size());
+        pcm = sound_resampled_.data();
+    }
 
-            // Audio packet (Opus)
-            auto packet = std::make_unique<AudioStreamPacket>();
-            packet->sample_rate = sample_rate;
-            packet->frame_duration = 60;
-            packet->payload.resize(pkt_len);
-            std::memcpy(packet->payload.data(), pkt_ptr, pkt_len);
-            PushPacketToDecodeQueue(std::move(packet), true);
+    return WriteSoundToMixer(pcm, samples, cancelled);
+}
+
+/* Play a cached sound in the sound player task, a normal one after the stream like a decoded one */
+bool AudioService::MixSoundPcm(const int16_t* pcm, size_t samples, SoundPriority priority, uint32_t generation) {
+    auto cancelled = [this, generation]() { return service_stopped_ || sound_player_.generation() != generation; };
+    if (priority == kSoundPriorityNormal) {
+        WaitOn(sound_space_waiter_, [this, &cancelled]() {
+            return cancelled() || (audio_decode_queue_.Empty() && jitter_buffer_.size() == 0 && audio_playback_queue_.Empty());
+        });
+        if (cancelled()) {
+            return false;
         }
+    }
+    return WriteSoundToMixer(pcm, samples, cancelled);
+}
 
-        offset = body_off + body_size;
+bool AudioService::WriteSoundToMixer(const int16_t* pcm, size_t samples, const std::function<bool()>& cancelled) {
+    while (samples > 0) {
+        size_t written = mixer_.Write(kMixerInputSound, pcm, samples);
+        pcm += written;
+        samples -= written;
+        NotifyTask(audio_output_task_handle_);
+        if (samples > 0) {
+            WaitOn(sound_space_waiter_, [this, &cancelled]() {
+                return cancelled() || mixer_.Space(kMixerInputSound) > 0;
+            });
+        }
+        if (cancelled()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void AudioService::CloseSoundDecoder() {
+    if (sound_decoder_ != nullptr) {
+        esp_opus_dec_close(sound_decoder_);
+        sound_decoder_ = nullptr;
+    }
+    sound_resampler_.Close();
+    sound_decoder_sample_rate_ = 0;
+    sound_decoder_duration_ms_ = 0;
+}
+
+void AudioService::StopSound() {
+    /* The packets of the sound already in the queues go too */
+    ResetDecoder();
+}
+
+bool AudioService::PushSoundPacket(AudioStreamPacketPtr packet, uint32_t generation) {
+    auto cancelled = [this, generation]() { return sound_player_.generation() != generation; };
+    std::lock_guard<std::mutex> lock(decode_producer_mutex_);
+    WaitOn(decode_space_waiter_, [this, &cancelled]() {
+        return service_stopped_ || cancelled() || !DecodeQueueFull();
+    });
+    if (service_stopped_ || cancelled() || !audio_decode_queue_.Push(std::move(packet))) {
+        return false;
     }
+    NotifyTask(opus_decoder_task_handle_);
+    return true;
 }
 
 bool AudioService::IsIdle() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    return audio_encode_queue_.empty() && audio_decode_queue_.empty() && audio_playback_queue_.empty() && audio_testing_queue_.empty();
+    return sound_player_.IsIdle() && !mixer_.HasAudio() && audio_encode_queue_.Empty() && audio_decode_queue_.Empty() && jitter_buffer_.size() == 0 &&
+        audio_playback_queue_.Empty() && audio_testing_queue_.Empty();
+}
+
+int AudioService::GetBufferedPlaybackMs() const {
+    size_t packets = audio_decode_queue_.Size() + jitter_buffer_.size() + audio_playback_queue_.Size();
+    return packets * decoder_duration_ms_;
 }
 
 void AudioService::WaitForPlaybackQueueEmpty() {
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-    audio_queue_cv_.wait(lock, [this]() { 
-        return service_stopped_ || (audio_decode_queue_.empty() && audio_playback_queue_.empty()); 
+    WaitOn(playback_empty_waiter_, [this]() {
+        return service_stopped_ || (sound_player_.IsIdle() && !mixer_.HasAudio() && audio_decode_queue_.Empty() &&
+            jitter_buffer_.size() == 0 && audio_playback_queue_.Empty());
     });
 }
 
 void AudioService::ResetDecoder() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
+    /* Stop the sound player first, so it does not push packets after the queue is cleared */
+    sound_player_.Cancel();
+    NotifyWaiter(decode_space_waiter_);
+    NotifyWaiter(sound_space_waiter_);
+    mixer_.Clear(kMixerInputSound);
+
     std::unique_lock<std::mutex> decoder_lock(decoder_mutex_);
     if (opus_decoder_ != nullptr) {
         esp_opus_dec_reset(opus_decoder_);
     }
     decoder_lock.unlock();
-    timestamp_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    {
+        // Wait for a sound packet being pushed right now
+        std::lock_guard<std::mutex> lock(decode_producer_mutex_);
+        audio_decode_queue_.Clear();
+    }
+    audio_playback_queue_.Clear();
+    audio_testing_queue_.Clear();
+    decoder_resets_++;
+    /* Let the consumers release the discarded items */
+    NotifyTask(opus_decoder_task_handle_);
+    NotifyTask(audio_output_task_handle_);
+    NotifyWaiter(decode_space_waiter_);
+}
+
+void AudioService::FlushPlayback(int fade_ms) {
+    flush_fade_ms_ = fade_ms;
+    playback_flushes_++;
+    ResetDecoder();
+}
+
+void AudioService::EnableOutputPower() {
+    std::lock_guard<std::mutex> lock(output_power_mutex_);
+    if (!codec_->output_enabled()) {
+        int64_t start_us = esp_timer_get_time();
+        codec_->EnableOutput(true);
+        UpdatePowerState(&output_power_up_, esp_timer_get_time() - start_us);
+        last_output_time_ = std::chrono::steady_clock::now();
+        ScheduleAudioPowerCheck();
+    }
+}
+
+void AudioService::SetOutputWarm(bool warm) {
+    if (output_warm_ == warm) {
+        return;
+    }
+    ESP_LOGD(TAG, "%s warm output", warm ? "Enabling" : "Disabling");
+    output_warm_ = warm;
+    if (warm) {
+        /* Power up the codec now, instead of when the first frame is ready */
+        EnableOutputPower();
+    } else {
+        /* The power timer turns the output off after the usual timeout */
+        last_output_time_ = std::chrono::steady_clock::now();
+        ScheduleAudioPowerCheck();
+    }
 }
 
 void AudioService::CheckAndUpdateAudioPowerState() {
     auto now = std::chrono::steady_clock::now();
     auto input_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_input_time_).count();
     auto output_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_output_time_).count();
-    if (input_elapsed > AUDIO_POWER_TIMEOUT_MS && codec_->input_enabled()) {
+    if (input_elapsed >= AUDIO_POWER_TIMEOUT_MS && codec_->input_enabled()) {
         codec_->EnableInput(false);
+        UpdatePowerState(nullptr, 0);
+    }
+    {
+        std::lock_guard<std::mutex> lock(output_power_mutex_);
+        if (!output_warm_ && output_elapsed >= AUDIO_POWER_TIMEOUT_MS && codec_->output_enabled()) {
+            codec_->EnableOutput(false);
+            UpdatePowerState(nullptr, 0);
+        }
+    }
+    ScheduleAudioPowerCheck();
+}
+
+void AudioService::ScheduleAudioPowerCheck() {
+    // The timer fires when the first of the powered directions may time out, instead of polling
+    auto now = std::chrono::steady_clock::now();
+    int64_t delay_ms = -1;
+    if (codec_->input_enabled()) {
+        delay_ms = AUDIO_POWER_TIMEOUT_MS - std::chrono::duration_cast<std::chrono::milliseconds>(now - last_input_time_).count();
+    }
+    if (codec_->output_enabled() && !output_warm_) {
+        int64_t output_ms = AUDIO_POWER_TIMEOUT_MS - std::chrono::duration_cast<std::chrono::milliseconds>(now - last_output_time_).count();
+        delay_ms = delay_ms < 0 ? output_ms : std::min(delay_ms, output_ms);
+    }
+    esp_timer_stop(audio_power_timer_);
+    if (codec_->input_enabled() || (codec_->output_enabled() && !output_warm_)) {
+        esp_timer_start_once(audio_power_timer_, std::max<int64_t>(delay_ms, AUDIO_POWER_CHECK_MIN_MS) * 1000);
+    }
+}
+
+void AudioService::UpdatePowerState(PowerUpStats* power_up, int64_t power_up_us) {
+    int state = (codec_->input_enabled() ? 1 : 0) | (codec_->output_enabled() ? 2 : 0);
+    int64_t now_us = esp_timer_get_time();
+    std::lock_guard<std::mutex> lock(power_stats_mutex_);
+    power_state_time_us_[power_state_] += now_us - power_state_since_us_;
+    power_state_ = state;
+    power_state_since_us_ = now_us;
+    if (power_up != nullptr) {
+        power_up->count++;
+        power_up->last_us = power_up_us;
+        power_up->max_us = std::max<uint32_t>(power_up->max_us, power_up_us);
+    }
+}
+
+cJSON* AudioService::GetPowerStatsJson() {
+    static const char* const names[] = {"off_ms", "input_ms", "output_ms", "both_ms"};
+    int64_t now_us = esp_timer_get_time();
+    std::lock_guard<std::mutex> lock(power_stats_mutex_);
+    auto root = cJSON_CreateObject();
+    for (int i = 0; i < 4; i++) {
+        int64_t time_us = power_state_time_us_[i] + (i == power_state_ ? now_us - power_state_since_us_ : 0);
+        cJSON_AddNumberToObject(root, names[i], time_us / 1000);
+    }
+    for (auto [name, power_up] : {std::make_pair("input_power_up", &input_power_up_), std::make_pair("output_power_up", &output_power_up_)}) {
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "count", power_up->count);
+        cJSON_AddNumberToObject(item, "last_ms", power_up->last_us / 1000.0);
+        cJSON_AddNumberToObject(item, "max_ms", power_up->max_us / 1000.0);
+        cJSON_AddItemToObject(root, name, item);
+    }
+#if CONFIG_WAKE_WORD_VOICE_GATE
+    cJSON_AddNumberToObject(root, "wake_word_duty_cycle", voice_gate_.duty_cycle());
+#endif
+    return root;
+}
+
+void AudioService::ConfigureSpeakerDsp(const cJSON* json) {
+#if CONFIG_AUDIO_SPEAKER_DSP
+    std::lock_guard<std::mutex> lock(output_mutex_);
+    if (SpeakerDsp::ParseJson(json, speaker_dsp_config_)) {
+        speaker_dsp_.Configure(speaker_dsp_config_, codec_->output_sample_rate());
+    }
+#else
+    (void)json;
+#endif
+}
+
+cJSON* AudioService::GetSpeakerDspStatsJson() {
+    std::lock_guard<std::mutex> lock(output_mutex_);
+    return speaker_dsp_.GetStatsJson();
+}
+
+cJSON* AudioService::GetUplinkAgcStatsJson() {
+#if CONFIG_UPLINK_AGC
+    return uplink_agc_.GetStatsJson();
+#else
+    auto json = cJSON_CreateObject();
+    cJSON_AddBoolToObject(json, "enabled", false);
+    return json;
+#endif
+}
+
+cJSON* AudioService::GetAudioProcessorStatsJson() {
+    return audio_processor_ != nullptr ? audio_processor_->GetStatsJson() : nullptr;
+}
+
+#if CONFIG_AUDIO_LATENCY_SELF_TEST
+bool AudioService::EncodeLatencyTestSignal(const LatencyProbe& probe, std::vector<AudioStreamPacketPtr>& packets) {
+    /* An encoder of its own, the one of the uplink keeps its state and its config */
+    esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG();
+    opus_enc_cfg.enable_dtx = false;
+    void* encoder = nullptr;
+    auto ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &encoder);
+    if (encoder == nullptr) {
+        ESP_LOGE(TAG, "Latency test: failed to create the encoder, error code: %d", ret);
+        return false;
+    }
+    int frame_size = 0;
+    int outbuf_size = 0;
+    esp_opus_enc_get_frame_size(encoder, &frame_size, &outbuf_size);
+    frame_size /= sizeof(int16_t);
+
+    std::vector<int16_t> pcm;
+    probe.GenerateSignal(pcm);
+    pcm.resize((pcm.size() + frame_size - 1) / frame_size * frame_size, 0);
+    for (size_t offset = 0; offset < pcm.size(); offset += frame_size) {
+        auto packet = AudioStreamPacket::Create();
+        packet->sample_rate = 16000;
+        packet->frame_duration = OPUS_FRAME_DURATION_MS;
+        packet->payload.resize(outbuf_size);
+        esp_audio_enc_in_frame_t in = {
+            .buffer = (uint8_t *)(pcm.data() + offset),
+            .len = (uint32_t)(frame_size * sizeof(int16_t)),
+        };
+        esp_audio_enc_out_frame_t out = {
+            .buffer = packet->payload.data(),
+            .len = (uint32_t)outbuf_size,
+            .encoded_bytes = 0,
+        };
+        ret = esp_opus_enc_process(encoder, &in, &out);
+        if (ret != ESP_AUDIO_ERR_OK) {
+            ESP_LOGE(TAG, "Latency test: failed to encode, error code: %d", ret);
+            break;
+        }
+        packet->payload.resize(out.encoded_bytes);
+        packets.push_back(std::move(packet));
+    }
+    esp_opus_enc_close(encoder);
+    return ret == ESP_AUDIO_ERR_OK;
+}
+
+cJSON* AudioService::RunLatencyTest() {
+    /* The uplink may go on, only the output has to be free */
+    if (!sound_player_.IsIdle() || mixer_.HasAudio() || !audio_decode_queue_.Empty() || jitter_buffer_.size() > 0 ||
+        !audio_playback_queue_.Empty() || !audio_testing_queue_.Empty()) {
+        ESP_LOGW(TAG, "Latency test: audio is playing");
+        return nullptr;
     }
-    if (output_elapsed > AUDIO_POWER_TIMEOUT_MS && codec_->output_enabled()) {
-        codec_->EnableOutput(false);
+    std::string format = codec_->input_format();
+    size_t mic_channel = format.find('M');
+    size_t reference_channel = format.find('R');
+    LatencyProbe probe(codec_->output_sample_rate(), codec_->input_channels(),
+        mic_channel != std::string::npos ? (int)mic_channel : 0,
+        reference_channel != std::string::npos ? (int)reference_channel : -1);
+    std::vector<AudioStreamPacketPtr> packets;
+    if (!probe.Allocate() || !EncodeLatencyTestSignal(probe, packets)) {
+        return nullptr;
+    }
+
+    /* The chirp must not wake the device up, and the processor has to run to hear it */
+    bool wake_word = IsWakeWordRunning();
+    bool processing = IsAudioProcessorRunning();
+    if (wake_word) {
+        EnableWakeWordDetection(false);
+    }
+    if (!processing) {
+        EnableVoiceProcessing(true);
     }
-    if (!codec_->input_enabled() && !codec_->output_enabled()) {
-        esp_timer_stop(audio_power_timer_);
+    {
+        std::lock_guard<std::mutex> lock(latency_probe_mutex_);
+        latency_probe_ = &probe;
+    }
+    latency_probe_active_ = true;
+    /* Past the input warm-up, so the input task reads as the audio comes in */
+    vTaskDelay(pdMS_TO_TICKS(LATENCY_TEST_SETTLE_MS));
+
+    ESP_LOGI(TAG, "Latency test: playing the chirp");
+    probe.MarkQueued(esp_timer_get_time());
+    for (auto& packet : packets) {
+        PushPacketToDecodeQueue(std::move(packet), true);
+    }
+    int64_t deadline_us = esp_timer_get_time() + LATENCY_TEST_TIMEOUT_MS * 1000;
+    while (!probe.Done(true) && esp_timer_get_time() < deadline_us) {
+        vTaskDelay(pdMS_TO_TICKS(20));
+    }
+
+    latency_probe_active_ = false;
+    {
+        std::lock_guard<std::mutex> lock(latency_probe_mutex_);
+        latency_probe_ = nullptr;
     }
+    WaitForPlaybackQueueEmpty();
+    if (!processing) {
+        EnableVoiceProcessing(false);
+    }
+    if (wake_word) {
+        EnableWakeWordDetection(true);
+    }
+
+    int64_t dma_frame_us = (int64_t)AUDIO_CODEC_DMA_FRAME_NUM * 1000000 / codec_->input_sample_rate();
+    int64_t aec_latency_us = 0;
+#if CONFIG_USE_SERVER_AEC
+    aec_latency_us = aec_reference_clock_.output_latency_us();
+#endif
+    auto json = probe.Analyze(dma_frame_us, aec_latency_us);
+    cJSON_AddStringToObject(json, "board", BOARD_NAME);
+    cJSON_AddStringToObject(json, "input_format", format.c_str());
+    cJSON_AddNumberToObject(json, "input_sample_rate", codec_->input_sample_rate());
+    cJSON_AddNumberToObject(json, "output_sample_rate", codec_->output_sample_rate());
+    cJSON_AddNumberToObject(json, "output_volume", codec_->output_volume());
+    char* report = cJSON_PrintUnformatted(json);
+    if (report != nullptr) {
+        ESP_LOGI(TAG, "Latency test: %s", report);
+        cJSON_free(report);
+    }
+    return json;
 }
+#endif
 
 void AudioService::SetModelsList(srmodel_list_t* models_list) {
-    models_list_ = models_list;
+    std::unique_lock<std::mutex> lock(initialize_mutex_);
+    if (!wake_word_initialized_) {
+        auto retired = models_list_;
+        models_list_ = models_list;
+        {
+            std::lock_guard<std::mutex> wake_word_lock(wake_word_mutex_);
+            wake_word_ = CreateWakeWord(models_list_);
+        }
+        RetireModelsList(retired);
+        return;
+    }
+    if (shared_afe_) {
+        // The wake word is a part of the AFE of the audio processor, it cannot change alone
+        ESP_LOGW(TAG, "The wake word runs on the shared AFE, the new models apply after a restart");
+        esp_srmodel_deinit(models_list);
+        return;
+    }
+
+    // The loader takes the latest list, one that it has not picked up yet is dropped
+    if (pending_models_list_ != nullptr) {
+        esp_srmodel_deinit(pending_models_list_);
+    }
+    pending_models_list_ = models_list;
+    if (wake_word_loading_) {
+        return;
+    }
+
+    const auto& input = TaskProfiles::Get(kTaskAudioInput);
+    BaseType_t core = tskNO_AFFINITY;
+#if !CONFIG_FREERTOS_UNICORE
+    if (input.core >= 0) {
+        core = input.core == 0 ? 1 : 0;
+    }
+#endif
+    wake_word_loading_ = xTaskCreatePinnedToCore([](void* arg) {
+        auto audio_service = (AudioService*)arg;
+        audio_service->WakeWordLoaderTask();
+        vTaskDelete(NULL);
+    }, "wake_word_loader", WAKE_WORD_LOADER_STACK_SIZE, this, WAKE_WORD_LOADER_PRIORITY, nullptr, core) == pdPASS;
+    if (!wake_word_loading_) {
+        ESP_LOGE(TAG, "Failed to create the wake word loader");
+        esp_srmodel_deinit(pending_models_list_);
+        pending_models_list_ = nullptr;
+    }
+}
+
+void AudioService::WakeWordLoaderTask() {
+    while (true) {
+        std::unique_lock<std::mutex> lock(initialize_mutex_);
+        auto models_list = pending_models_list_;
+        pending_models_list_ = nullptr;
+        if (models_list == nullptr) {
+            wake_word_loading_ = false;
+            return;
+        }
+        lock.unlock();
 
+        // The old wake word keeps listening while the models load
+        int64_t start_us = esp_timer_get_time();
+        auto wake_word = CreateWakeWord(models_list);
+        if (wake_word && !wake_word->Initialize(codec_, models_list)) {
+            ESP_LOGE(TAG, "Failed to initialize the new wake word, keeping the old one");
+            wake_word.reset();
+            esp_srmodel_deinit(models_list);
+            continue;
+        }
+        int64_t load_us = esp_timer_get_time() - start_us;
+
+        lock.lock();
+        auto retired_list = models_list_;
+        models_list_ = models_list;
+        std::unique_ptr<WakeWord> retired;
+        {
+            // The input task is between two chunks while it does not hold the lock
+            std::lock_guard<std::mutex> wake_word_lock(wake_word_mutex_);
+            bool running = IsWakeWordRunning();
+            if (wake_word_) {
+                wake_word_->Stop();
+            }
+            if (wake_word && running) {
+                wake_word->Start();
+            } else if (!wake_word) {
+                xEventGroupClearBits(event_group_, AS_EVENT_WAKE_WORD_RUNNING);
+            }
+            retired = std::move(wake_word_);
+            wake_word_ = std::move(wake_word);
+#if CONFIG_WAKE_WORD_VOICE_GATE
+            // The chunks the gate holds have the feed size of the old wake word
+            voice_gate_reset_ = true;
+#endif
+        }
+        wake_word_initialized_ = wake_word_ != nullptr;
+        lock.unlock();
+
+        // Stops the tasks of the old wake word, then frees its models
+        retired.reset();
+        lock.lock();
+        RetireModelsList(retired_list);
+        lock.unlock();
+        ESP_LOGI(TAG, "Wake word models swapped, loaded in %lld ms", load_us / 1000);
+    }
+}
+
+void AudioService::RetireModelsList(srmodel_list_t* models_list) {
+    if (models_list != nullptr && models_list != models_list_ && models_list != processor_models_list_) {
+        esp_srmodel_deinit(models_list);
+    }
+}
+
+std::unique_ptr<WakeWord> AudioService::CreateWakeWord(srmodel_list_t* models_list) {
+    std::unique_ptr<WakeWord> wake_word;
 #if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4
-    if (esp_srmodel_filter(models_list_, ESP_MN_PREFIX, NULL) != nullptr) {
-        wake_word_ = std::make_unique<CustomWakeWord>();
-    } else if (esp_srmodel_filter(models_list_, ESP_WN_PREFIX, NULL) != nullptr) {
-        wake_word_ = std::make_unique<AfeWakeWord>();
-    } else {
-        wake_word_ = nullptr;
+    if (esp_srmodel_filter(models_list, ESP_MN_PREFIX, NULL) != nullptr) {
+        wake_word = std::make_unique<CustomWakeWord>();
+    } else if (esp_srmodel_filter(models_list, ESP_WN_PREFIX, NULL) != nullptr) {
+        wake_word = std::make_unique<AfeWakeWord>();
     }
 #else
-    if (esp_srmodel_filter(models_list_, ESP_WN_PREFIX, NULL) != nullptr) {
-        wake_word_ = std::make_unique<EspWakeWord>();
-    } else {
-        wake_word_ = nullptr;
+    if (esp_srmodel_filter(models_list, ESP_WN_PREFIX, NULL) != nullptr) {
+        wake_word = std::make_unique<EspWakeWord>();
     }
 #endif
 
-    if (wake_word_) {
-        wake_word_->OnWakeWordDetected([this](const std::string& wake_word) {
+    if (wake_word) {
+        wake_word->OnWakeWordDetected([this](const std::string& wake_word) {
+            {
+                std::lock_guard<std::mutex> lock(last_wake_word_mutex_);
+                last_wake_word_ = wake_word;
+            }
             if (callbacks_.on_wake_word_detected) {
                 callbacks_.on_wake_word_detected(wake_word);
             }
         });
+        wake_word->OnCommandDetected([this](const std::string& tool, const std::string& arguments) {
+            if (callbacks_.on_local_command) {
+                callbacks_.on_local_command(tool, arguments);
+            }
+        });
     }
+    return wake_word;
 }
 
 bool AudioService::IsAfeWakeWord() {
 #if CONFIG_IDF_TARGET_ESP32S3 || CONFIG_IDF_TARGET_ESP32P4
+    std::lock_guard<std::mutex> lock(wake_word_mutex_);
     return wake_word_ != nullptr && dynamic_cast<AfeWakeWord*>(wake_word_.get()) != nullptr;
 #else
     return false;
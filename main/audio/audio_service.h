@@ -2,10 +2,11 @@
 #define AUDIO_SERVICE_H
 
 #include <memory>
-#include <deque>
-#include <condition_variable>
+#include <array>
 #include <chrono>
 #include <mutex>
+#include <atomic>
+#include <deque>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -15,7 +16,6 @@
 #include "esp_audio_enc.h"
 #include "esp_opus_enc.h"
 #include "esp_opus_dec.h"
-#include "esp_ae_rate_cvt.h"
 #include "esp_audio_types.h"
 
 #include "audio_codec.h"
@@ -23,29 +23,102 @@
 #include "processors/audio_debugger.h"
 #include "wake_word.h"
 #include "protocol.h"
+#include "spsc_queue.h"
+#include "jitter_buffer.h"
+#include "drift_compensator.h"
+#include "stream_resampler.h"
+#include "latency_tracer.h"
+#include "voice_gate.h"
+#include "uplink_gate.h"
+#include "uplink_agc.h"
+#include "sound_player.h"
+#include "sound_cache.h"
+#include "memory_placement.h"
+#include "audio_mixer.h"
+#include "aec_reference_clock.h"
+#include "latency_probe.h"
+#include "speaker_dsp.h"
+#include "power_governor.h"
 
 
 /*
  * There are two types of audio data flow:
  * 1. (MIC) -> [Processors] -> {Encode Queue} -> [Opus Encoder] -> {Send Queue} -> (Server)
- * 2. (Server) -> {Decode Queue} -> [Opus Decoder] -> {Playback Queue} -> (Speaker)
+ * 2. (Server) -> {Decode Queue} -> [Jitter Buffer] -> [Opus Decoder] -> {Playback Queue} -> [Mixer] -> (Speaker)
  *
  * We use one task for MIC / Speaker / Processors, and one task for Opus Encoder / Opus Decoder.
+ * With CONFIG_AUDIO_SPLIT_OPUS_TASKS the encoder and the decoder run in two tasks that can be
+ * pinned to different cores, so a slow encode never delays playback.
  * 
  * Decode Queue and Send Queue are the main queues, because Opus packets are quite smaller than PCM packets.
+ * The decoder moves incoming packets into the Jitter Buffer, which puts them back in sequence order and
+ * holds back just enough audio to ride out the measured network jitter. Missing frames are concealed.
+ * 
+ * Sounds played with kSoundPriorityMix are decoded by the sound player into the mixer, which adds
+ * them to the playback stream chunk by chunk (or plays them alone) while ducking the stream.
  * 
+ * Every queue is a bounded lock-free SPSC ring. Pushing to a queue only notifies the task that
+ * consumes it, and popping only notifies the task that produces it, so the tasks never wake each
+ * other for nothing.
  */
 
 #define OPUS_FRAME_DURATION_MS 60
+// The rate of the server TTS unless its hello says otherwise
+#define AUDIO_SERVER_SAMPLE_RATE 24000
 #define MAX_ENCODE_TASKS_IN_QUEUE 2
 #define MAX_PLAYBACK_TASKS_IN_QUEUE 2
 #define MAX_DECODE_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
+// A media stream lets the jitter buffer grow to all its slots, see SetMediaMode()
+#if CONFIG_AUDIO_MEDIA_STREAM
+#define MAX_JITTER_BUFFER_PACKETS JitterBuffer::kMaxCapacity
+#else
+#define MAX_JITTER_BUFFER_PACKETS MAX_DECODE_PACKETS_IN_QUEUE
+#endif
 #define MAX_SEND_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
+#define MAX_SEND_PACKETS_PER_BATCH 8
+// The staging is bounded by its speech, so its slots fit the shortest encoder frame, and the live
+// packets that queue behind it get the slots of the send queue
+#define UPLINK_STAGING_MIN_FRAME_MS 20
+#define UPLINK_STAGING_PACKETS \
+    (CONFIG_UPLINK_STAGING_BUFFER_MS / UPLINK_STAGING_MIN_FRAME_MS + MAX_SEND_PACKETS_IN_QUEUE)
+#if CONFIG_FOLLOW_UP_TURN
+// The voice the follow-up trigger waits for, and the onset the VAD takes to notice it
+#define FOLLOW_UP_PREROLL_PACKETS ((CONFIG_FOLLOW_UP_MIN_SPEECH_MS + 300) / OPUS_FRAME_DURATION_MS + 1)
+#endif
 #define AUDIO_TESTING_MAX_DURATION_MS 10000
-#define MAX_TIMESTAMPS_IN_QUEUE 3
+#define MAX_TESTING_PACKETS_IN_QUEUE (AUDIO_TESTING_MAX_DURATION_MS / OPUS_FRAME_DURATION_MS)
+// How often the decoder checks the jitter buffer while it holds packets back
+#define JITTER_BUFFER_POLL_INTERVAL_MS 10
+// The one-shot task that loads new wake word models next to the running ones
+#define WAKE_WORD_LOADER_STACK_SIZE (4096 * 2)
+#define WAKE_WORD_LOADER_PRIORITY 1
+// Mixed sounds are decoded this far ahead of the output
+#define MIXER_SOUND_BUFFER_MS 240
+// Gain of the stream while a mixed sound plays, Q8
+#define MIXER_DUCKING_GAIN_Q8 96
+#define DECODER_CACHE_SIZE CONFIG_AUDIO_DECODER_CACHE_SIZE
+
+// Encoder adaptation, see AdaptEncoder()
+#define ENCODER_ADAPT_INTERVAL_MS 1000
+#define ENCODER_CONGESTED_QUEUE_MS 300
+#define ENCODER_SLOW_SEND_US 30000
+#define ENCODER_RECOVER_INTERVALS 5
+// Encoder complexity, see AdaptComplexity(): the encode time of a frame in percent of its duration
+#define ENCODER_COMPLEXITY_RAISE_LOAD 25
+#define ENCODER_COMPLEXITY_LOWER_LOAD 50
+#define ENCODER_COMPLEXITY_RAISE_INTERVALS 3
+// Downlink loss above this is taken as a lossy link in both directions
+#define TRANSPORT_LOSSY_PERCENT 5
+// The jitter buffer holds an extra frame until the transport has not reordered for this long
+#define TRANSPORT_REORDER_HOLD_INTERVALS 10
+
+// The latency test waits this long for the input to run, and at most this long for the chirp
+#define LATENCY_TEST_SETTLE_MS 300
+#define LATENCY_TEST_TIMEOUT_MS 3000
 
 #define AUDIO_POWER_TIMEOUT_MS 15000
-#define AUDIO_POWER_CHECK_INTERVAL_MS 1000
+// The power timer never fires sooner than this after a check
+#define AUDIO_POWER_CHECK_MIN_MS 100
 
 #define AS_EVENT_AUDIO_TESTING_RUNNING      (1 << 0)
 #define AS_EVENT_WAKE_WORD_RUNNING          (1 << 1)
@@ -75,11 +148,41 @@
         .enable_vbr         = true,                                                                               \
     }
 
+#define OPUS_DEC_CFG(_sample_rate, _frame_duration_ms)                                                    \
+    (esp_opus_dec_cfg_t)                                                                                  \
+    {                                                                                                     \
+        .sample_rate    = (uint32_t)(_sample_rate),                                                       \
+        .channel        = ESP_AUDIO_MONO,                                                                 \
+        .frame_duration = (esp_opus_dec_frame_duration_t)AS_OPUS_GET_FRAME_DRU_ENUM(_frame_duration_ms),  \
+        .self_delimited = false,                                                                          \
+    }
+
+/* An Opus decoder and the resampler from its rate to the codec output rate, kept open for reuse */
+struct DecoderSlot {
+    void* decoder = nullptr;
+    int sample_rate = 0;        // Of the stream
+    int decode_rate = 0;        // The decoder output, the output rate for a media stream
+    int duration_ms = 0;
+    StreamResampler resampler;  // Only open if the rate differs from the output rate
+    uint32_t last_used = 0;
+};
+
+struct AudioEncoderConfig {
+    int bitrate = ESP_OPUS_BITRATE_AUTO;
+    int frame_duration_ms = OPUS_FRAME_DURATION_MS;
+    bool enable_fec = false;
+    bool enable_dtx = true;
+    bool voip = false;          // The VoIP mode of Opus, narrowband SILK at the low bitrates
+};
+
 struct AudioServiceCallbacks {
     std::function<void(void)> on_send_queue_available;
     std::function<void(const std::string&)> on_wake_word_detected;
+    std::function<void(const std::string& tool, const std::string& arguments)> on_local_command;
     std::function<void(bool)> on_vad_change;
     std::function<void(void)> on_audio_testing_queue_full;
+    // From the encoder task, when the uplink enters or leaves the narrowband level
+    std::function<void(bool)> on_narrowband_change;
 };
 
 
@@ -93,6 +196,27 @@ struct AudioTask {
     AudioTaskType type;
     std::vector<int16_t> pcm;
     uint32_t timestamp;
+    int64_t trace_origin_us = 0;
+    int64_t trace_stage_us = 0;
+
+    void Reset() {
+        pcm.clear();
+        timestamp = 0;
+        trace_origin_us = 0;
+        trace_stage_us = 0;
+    }
+};
+
+using AudioTaskPtr = PooledPtr<AudioTask>;
+
+// Enough PCM frames to fill the encode and playback queues, plus the ones being encoded and decoded
+#define AUDIO_TASK_POOL_SIZE (MAX_ENCODE_TASKS_IN_QUEUE + MAX_PLAYBACK_TASKS_IN_QUEUE + 2)
+
+// Compute time spent on each frame
+struct FrameTiming {
+    uint32_t frames = 0;
+    uint32_t max_us = 0;
+    uint64_t total_us = 0;
 };
 
 struct DebugStatistics {
@@ -100,6 +224,16 @@ struct DebugStatistics {
     uint32_t decode_count = 0;
     uint32_t encode_count = 0;
     uint32_t playback_count = 0;
+    // Only measured with CONFIG_AUDIO_BENCHMARK
+    FrameTiming encode_time;
+    FrameTiming decode_time;
+    FrameTiming resample_time;
+};
+
+struct PowerUpStats {
+    uint32_t count = 0;
+    uint32_t last_us = 0;
+    uint32_t max_us = 0;
 };
 
 class AudioService {
@@ -111,85 +245,373 @@ public:
     void Start();
     void Stop();
     void EncodeWakeWord();
-    std::unique_ptr<AudioStreamPacket> PopWakeWordPacket();
-    const std::string& GetLastWakeWord() const;
+    AudioStreamPacketPtr PopWakeWordPacket();
+    std::string GetLastWakeWord() const;
     bool IsVoiceDetected() const { return voice_detected_; }
     bool IsIdle();
     void WaitForPlaybackQueueEmpty();
+    // The reply queued ahead of the speaker, may be read by any task
+    int GetBufferedPlaybackMs() const;
     bool IsWakeWordRunning() const { return xEventGroupGetBits(event_group_) & AS_EVENT_WAKE_WORD_RUNNING; }
     bool IsAudioProcessorRunning() const { return xEventGroupGetBits(event_group_) & AS_EVENT_AUDIO_PROCESSOR_RUNNING; }
     bool IsAfeWakeWord();
+    // The wake word runs on the audio processor's AFE, so it can run while encoding
+    bool IsSharedAfe() const { return shared_afe_; }
 
     void EnableWakeWordDetection(bool enable);
+    // Loads the wake word models ahead of the first EnableWakeWordDetection(), may run on any task
+    bool PrepareWakeWord();
+    // Mono audio heard before the boot, the wake word gets it ahead of the microphone once it runs
+    void FeedWakeWordPreRoll(const std::vector<int16_t>& pcm, int sample_rate);
     void EnableVoiceProcessing(bool enable);
     void EnableAudioTesting(bool enable);
     void EnableDeviceAec(bool enable);
+    // Keep the codec output powered while audio is expected, so playback starts without the power-up delay
+    void SetOutputWarm(bool warm);
 
     void SetCallbacks(AudioServiceCallbacks& callbacks);
 
-    bool PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait = false);
-    std::unique_ptr<AudioStreamPacket> PopPacketFromSendQueue();
-    void PlaySound(const std::string_view& sound);
+    bool PushPacketToDecodeQueue(AudioStreamPacketPtr packet, bool wait = false);
+    AudioStreamPacketPtr PopPacketFromSendQueue();
+    // Pop up to max_count packets at once, returns the number of packets stored in packets
+    size_t PopPacketsFromSendQueue(AudioStreamPacketPtr* packets, size_t max_count);
+    // Marks the end of the audio queued so far, for a message that goes after it
+    uint32_t MarkSendQueue() const { return audio_send_queue_.Head(); }
+    // The packets still queued ahead of a mark
+    size_t SendQueueBefore(uint32_t mark) const { return audio_send_queue_.CountBefore(mark); }
+    // Hold the encoded packets back while the audio channel opens, returns false if disabled
+    bool StartUplinkStaging();
+    // Send the staged packets ahead of the live ones, or drop them when the channel did not open
+    void StopUplinkStaging(bool flush);
+    bool IsUplinkStaging() const { return uplink_staging_; }
+    // Drop the uplink packets of the silences, for the realtime mode
+    void EnableUplinkGate(bool enable);
+    // Keep encoding after a reply with only the newest packets kept, for a follow-up turn
+    void StartFollowUpStandby();
+    // Send the kept packets ahead of the live ones, or drop them when no turn follows
+    void StopFollowUpStandby(bool send);
+    // Sounds play in the background, one after the other unless the priority is high
+    void PlaySound(const std::string_view& sound, SoundPriority priority = kSoundPriorityNormal);
+    // Decodes an embedded sound to PCM now, so it starts on the next DMA chunk when played
+    bool PreloadSound(const std::string_view& sound);
+    bool PlaySoundAsset(const std::string& name, SoundPriority priority = kSoundPriorityNormal);
+    void PlaySoundUrl(const std::string& url, SoundPriority priority = kSoundPriorityNormal);
+    void StopSound();
     bool ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples);
     void ResetDecoder();
+    // Drops the queued reply and fades out the frame being played over fade_ms, for an abort
+    void FlushPlayback(int fade_ms);
+    /*
+     * Takes the models list over. Before the wake word is initialized it is just replaced. Once
+     * it is, the new wake word loads on a task of the other core while the old one keeps
+     * listening, then takes over between two feed chunks and the old one is freed, so an assets
+     * update changes the wake words and the commands without stopping the audio.
+     */
     void SetModelsList(srmodel_list_t* models_list);
+    // A session that may stream music: a deeper jitter buffer, and the decoder below the voice tasks
+    void SetMediaMode(bool media);
+
+    /*
+     * The encoder settings can be changed at any time, the encoder task picks them up before its
+     * next frame. A manual config turns the adaptation off until EnableAdaptiveEncoder(true).
+     */
+    void SetEncoderConfig(const AudioEncoderConfig& config);
+    AudioEncoderConfig GetEncoderConfig();
+    void EnableAdaptiveEncoder(bool enable);
+    void ReportTransportFeedback(const TransportFeedback& feedback);
+    // A batch of packets took longer to send than the audio it carries
+    void ReportTransportCongestion();
+    // Called about once a second while the audio channel is open
+    void UpdateTransportStats(const TransportStats& stats);
+    // Each packet of a modem link is an AT command, there the encoder frames are made longer
+    void SetCellularUplink(bool cellular);
+    // The server hello accepted the narrowband level, called for every audio channel
+    void SetNarrowbandAllowed(bool allowed);
+    // Takes the values of the PerfProfile, after it was loaded or the server pushed a new one
+    void ApplyPerfProfile();
+
+    DebugStatistics GetDebugStatistics() const { return debug_statistics_; }
+    void ResetDebugStatistics() { debug_statistics_ = DebugStatistics(); }
+
+#if CONFIG_AUDIO_BENCHMARK
+    // Feed 16kHz mono PCM to the encoder as if the audio processor had produced it
+    void FeedEncoder(std::vector<int16_t>&& pcm) {
+        PushTaskToEncodeQueue(kAudioTaskTypeEncodeToSendQueue, std::move(pcm));
+    }
+#endif
+
+    // Per stage latencies, only collected with CONFIG_AUDIO_LATENCY_TRACE
+    LatencyTracer& latency_tracer() { return latency_tracer_; }
+#if CONFIG_AUDIO_LATENCY_SELF_TEST
+    /*
+     * Plays a chirp through the decoder and the speaker and records it with the microphone and
+     * the audio processor, see LatencyProbe. Blocks for about a second and a half, the wake word
+     * pauses meanwhile and the processor output is not encoded. nullptr if audio is playing or
+     * the recordings do not fit, otherwise the caller owns the report.
+     */
+    cJSON* RunLatencyTest();
+#endif
+    SoundCache& sound_cache() { return sound_cache_; }
+    // The time the codec spent in each power state and what powering it up took, the caller owns the object
+    cJSON* GetPowerStatsJson();
+    // Replaces the speaker tuning, from the assets; the keys missing keep their values
+    void ConfigureSpeakerDsp(const cJSON* json);
+    cJSON* GetSpeakerDspStatsJson();
+    cJSON* GetUplinkAgcStatsJson();
+    // nullptr if the audio processor has no stats
+    cJSON* GetAudioProcessorStatsJson();
 
 private:
     AudioCodec* codec_ = nullptr;
     AudioServiceCallbacks callbacks_;
     std::unique_ptr<AudioProcessor> audio_processor_;
     std::unique_ptr<WakeWord> wake_word_;
+    // Held by the input task while it feeds, so a new wake word only takes over between chunks
+    mutable std::mutex wake_word_mutex_;
+    std::vector<int16_t> wake_word_pre_roll_;     // 16 kHz mono, guarded by wake_word_mutex_
+    // Set by the input task during a feed, which holds wake_word_mutex_, so it has its own lock
+    mutable std::mutex last_wake_word_mutex_;
+    std::string last_wake_word_;
     std::unique_ptr<AudioDebugger> audio_debugger_;
+    uint8_t debug_reference_mask_ = 0;     // The input channels of the AEC reference
     void* opus_encoder_ = nullptr;
+    // The decoder and resampler in use, owned by decoder_cache_
     void* opus_decoder_ = nullptr;
+    StreamResampler* output_resampler_ = nullptr;
+    std::array<DecoderSlot, DECODER_CACHE_SIZE> decoder_cache_;
+    uint32_t decoder_use_count_ = 0;
     std::mutex decoder_mutex_;
     std::mutex input_resampler_mutex_;
-    esp_ae_rate_cvt_handle_t input_resampler_ = nullptr;
-    esp_ae_rate_cvt_handle_t output_resampler_ = nullptr;
+    StreamResampler input_resampler_;
+    // Persistent scratch buffers, the input one is guarded by input_resampler_mutex_,
+    // the decode one is only used by the decoder task
+    std::vector<int16_t> input_buffer_;
+    std::vector<int16_t> decode_buffer_;
     
     // Encoder/Decoder state
     int encoder_sample_rate_ = 16000;
     int encoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
     int encoder_frame_size_ = 0;
     int encoder_outbuf_size_ = 0;
+    std::mutex encoder_config_mutex_;
+    AudioEncoderConfig encoder_config_;
+    std::atomic<bool> encoder_config_changed_ = false;
+    // Encoder task only
+    AudioEncoderConfig active_encoder_config_;
+    int encoder_level_ = 1;
+    int encoder_good_intervals_ = 0;
+    int64_t encoder_adapt_time_ms_ = 0;
+    size_t send_queue_peak_ = 0;
+    int encoder_complexity_ = 0;
+    int encoder_load_peak_ = 0;         // Of the interval, in percent of the frame duration
+    int encoder_light_intervals_ = 0;
+    int64_t complexity_time_ms_ = 0;
+    // PCM waiting for a full encoder frame, the processor frames do not have to match the encoder
+    HotVector<int16_t> encoder_pcm_;
+    AudioTaskType encoder_pcm_type_ = kAudioTaskTypeEncodeToSendQueue;
+    uint32_t encoder_pcm_timestamp_ = 0;
+    // Trace times of the oldest PCM in the accumulator, and of the newest task added to it
+    int64_t encoder_pcm_origin_us_ = 0;
+    int64_t encoder_pcm_stage_us_ = 0;
+    int64_t encoder_tail_origin_us_ = 0;
+    int64_t encoder_tail_stage_us_ = 0;
+    std::atomic<bool> encoder_pcm_reset_ = false;
+    // Uplink feedback
+    std::atomic<bool> adaptive_encoder_ = false;
+    std::atomic<uint32_t> transport_failures_ = 0;
+    std::atomic<uint32_t> transport_slow_sends_ = 0;
+    std::atomic<bool> transport_lossy_ = false;
+    std::atomic<bool> transport_congested_ = false;
+    std::atomic<bool> cellular_uplink_ = false;
+    bool encoder_cellular_ = false;     // Encoder task only, the link the level config was made for
+    std::atomic<bool> narrowband_allowed_ = false;
+    std::atomic<bool> narrowband_session_ = false;
+    bool encoder_narrowband_ = false;   // Encoder task only, what the server was told
+    TransportStats last_transport_stats_;
+    int transport_reorder_intervals_ = 0;
+    std::atomic<int> jitter_min_frames_ = 1;    // Applied by the decoder task
+    // Of the PerfProfile, the queue limits are at most the capacities
+    std::atomic<int> profile_frame_ms_ = OPUS_FRAME_DURATION_MS;
+    std::atomic<int> profile_max_complexity_ = CONFIG_AUDIO_ENCODER_MAX_COMPLEXITY;
+    std::atomic<int> profile_jitter_min_frames_ = 1;
+    std::atomic<size_t> decode_queue_limit_ = MAX_DECODE_PACKETS_IN_QUEUE;
+    std::atomic<size_t> send_queue_limit_ = MAX_SEND_PACKETS_IN_QUEUE;
+    std::atomic<bool> profile_changed_ = false;     // The encoder task makes the level config again
+    std::atomic<bool> media_mode_ = false;      // Applied by the decoder task
+    bool jitter_media_ = false;                 // Decoder task only, the mode the jitter buffer is set for
+#if CONFIG_AUDIO_DRIFT_COMPENSATION
+    DriftCompensator drift_compensator_{CONFIG_AUDIO_DRIFT_MAX_PPM};     // Decoder task only
+    uint32_t drift_underruns_ = 0;
+#endif
     int decoder_sample_rate_ = 0;
     int decoder_duration_ms_ = OPUS_FRAME_DURATION_MS;
     int decoder_frame_size_ = 0;
     DebugStatistics debug_statistics_;
+    uint32_t input_overruns_seen_ = 0;  // Of the codec, by the input task
+#if CONFIG_WAKE_WORD_VOICE_GATE
+    VoiceGate voice_gate_{CONFIG_WAKE_WORD_VOICE_GATE_PREROLL_MS, CONFIG_WAKE_WORD_VOICE_GATE_HANGOVER_MS};
+    std::atomic<bool> voice_gate_reset_ = false;    // Asks the input task to drop the old pre-roll
+#endif
+#if CONFIG_UPLINK_VAD_GATE
+    UplinkGate uplink_gate_{CONFIG_UPLINK_VAD_GATE_PREROLL_MS, CONFIG_UPLINK_VAD_GATE_HANGOVER_MS, CONFIG_UPLINK_VAD_GATE_KEEPALIVE_MS};
+    std::atomic<bool> uplink_gate_enabled_ = false;
+    std::atomic<bool> uplink_gate_reset_ = false;   // Asks the encoder task to drop the old pre-roll
+#endif
+#if CONFIG_UPLINK_AGC
+    // Keeps its gain from one conversation to the next, the speaker is likely where they were
+    UplinkAgc uplink_agc_{CONFIG_UPLINK_AGC_TARGET_DBFS, CONFIG_UPLINK_AGC_MAX_GAIN_DB};
+#endif
+    LatencyTracer latency_tracer_;
     srmodel_list_t* models_list_ = nullptr;
 
     EventGroupHandle_t event_group_;
+    // Held while the task processes, the AFE and wake word tasks behind the input run with it
+    PowerLock input_power_lock_{"audio_input"};
+    PowerLock decoder_power_lock_{"audio_decoder"};
+    PowerLock encoder_power_lock_{"audio_encoder"};
 
     // Audio encode / decode
     TaskHandle_t audio_input_task_handle_ = nullptr;
     TaskHandle_t audio_output_task_handle_ = nullptr;
-    TaskHandle_t opus_codec_task_handle_ = nullptr;
-    std::mutex audio_queue_mutex_;
-    std::condition_variable audio_queue_cv_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_decode_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_send_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_testing_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_encode_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_playback_queue_;
+    TaskHandle_t opus_decoder_task_handle_ = nullptr;
+    TaskHandle_t opus_encoder_task_handle_ = nullptr;
+    ObjectPool<AudioTask, AUDIO_TASK_POOL_SIZE> audio_task_pool_;
+    SpscQueue<AudioStreamPacketPtr, MAX_DECODE_PACKETS_IN_QUEUE> audio_decode_queue_;
+    SpscQueue<AudioStreamPacketPtr, MAX_SEND_PACKETS_IN_QUEUE> audio_send_queue_;
+#if CONFIG_UPLINK_STAGING_BUFFER_MS > 0
+    // Packets encoded while the channel opens, and the live ones until the staged ones are sent
+    SpscQueue<AudioStreamPacketPtr, UPLINK_STAGING_PACKETS> uplink_staging_queue_;
+    std::atomic<int> uplink_staged_ms_ = 0;     // The speech staged, added by the encoder task
+    std::atomic<uint32_t> uplink_staging_dropped_ = 0;
+#endif
+    std::atomic<bool> uplink_staging_ = false;
+#if CONFIG_FOLLOW_UP_TURN
+    std::deque<AudioStreamPacketPtr> follow_up_preroll_;    // Owned by the encoder task
+    std::atomic<bool> follow_up_standby_ = false;
+    std::atomic<bool> follow_up_drop_ = false;      // Asks the encoder task to drop the pre-roll
+#endif
+    int64_t staging_flush_start_ms_ = 0;    // Owned by the task that sends, for the realtime pace
+    int64_t staging_flushed_ms_ = 0;
+    SpscQueue<AudioStreamPacketPtr, MAX_TESTING_PACKETS_IN_QUEUE> audio_testing_queue_;
+    SpscQueue<AudioTaskPtr, MAX_ENCODE_TASKS_IN_QUEUE> audio_encode_queue_;
+    SpscQueue<AudioTaskPtr, MAX_PLAYBACK_TASKS_IN_QUEUE> audio_playback_queue_;
+    // Owned by the decoder task, other tasks request a reset by bumping decoder_resets_
+    JitterBuffer jitter_buffer_{MAX_DECODE_PACKETS_IN_QUEUE};
+    // Each consumer compares with the count it saw last, so none of them clears it for the others
+    std::atomic<uint32_t> decoder_resets_ = 0;
+    uint32_t decoder_resets_seen_ = 0;  // Owned by the decoder task
+    std::atomic<uint32_t> playback_flushes_ = 0;    // A frame popped before a flush fades out
+    std::atomic<int> flush_fade_ms_ = 0;
+    std::mutex output_power_mutex_;
+    std::mutex output_mutex_;   // Held while a frame is written to the codec
+    std::atomic<bool> output_warm_ = false;
+    // The decode and encode queues may be fed from more than one task (network, PlaySound, processors),
+    // these mutexes only serialize the producers and are never taken by the consumer
+    std::mutex decode_producer_mutex_;
+    std::mutex encode_producer_mutex_;
+    // Tasks blocked on a full queue or waiting for playback to finish
+    std::atomic<TaskHandle_t> decode_space_waiter_ = nullptr;
+    std::atomic<TaskHandle_t> encode_space_waiter_ = nullptr;
+    std::atomic<TaskHandle_t> playback_empty_waiter_ = nullptr;
+    std::atomic<TaskHandle_t> sound_space_waiter_ = nullptr;
+    // Streams PlaySound() sounds into the decode queue from its own task
+    SoundPlayer sound_player_;
+    // The PCM of the embedded sounds played before, see PreloadSound()
+    SoundCache sound_cache_;
+    // Mixed sounds are decoded in the sound player task, the mixer is read under output_mutex_
+    AudioMixer mixer_;
+    // The last stage before the codec, under output_mutex_
+    SpeakerDsp speaker_dsp_;
+    SpeakerDspConfig speaker_dsp_config_;
+    void* sound_decoder_ = nullptr;
+    int sound_decoder_sample_rate_ = 0;
+    int sound_decoder_duration_ms_ = 0;
+    StreamResampler sound_resampler_;
+    HotVector<int16_t> sound_pcm_;
+    HotVector<int16_t> sound_resampled_;
+    HotVector<int16_t> mixer_output_;
     // For server AEC
-    std::deque<uint32_t> timestamp_queue_;
+    AecReferenceClock aec_reference_clock_;
+#if CONFIG_AUDIO_LATENCY_SELF_TEST
+    // Set while RunLatencyTest() records, the flag keeps the lock off the audio tasks otherwise
+    std::atomic<bool> latency_probe_active_ = false;
+    std::mutex latency_probe_mutex_;
+    LatencyProbe* latency_probe_ = nullptr;
+#endif
 
+    // The first initialization may come from the boot task, see PrepareWakeWord()
+    std::mutex initialize_mutex_;
     bool wake_word_initialized_ = false;
     bool audio_processor_initialized_ = false;
+    // The latest models for the loader task, and the list the audio processor was built from
+    srmodel_list_t* pending_models_list_ = nullptr;
+    srmodel_list_t* processor_models_list_ = nullptr;
+    bool wake_word_loading_ = false;
+    // The wake word runs on the audio processor's AFE, see CONFIG_USE_SHARED_AFE
+    bool shared_afe_ = false;
     bool voice_detected_ = false;
     bool service_stopped_ = true;
     bool audio_input_need_warmup_ = false;
 
     esp_timer_handle_t audio_power_timer_ = nullptr;
+    std::mutex power_stats_mutex_;
+    int power_state_ = 0;               // Bit 0 is the input, bit 1 the output
+    int64_t power_state_since_us_ = 0;
+    int64_t power_state_time_us_[4] = {};
+    PowerUpStats input_power_up_;
+    PowerUpStats output_power_up_;
     std::chrono::steady_clock::time_point last_input_time_;
     std::chrono::steady_clock::time_point last_output_time_;
 
     void AudioInputTask();
     void AudioOutputTask();
     void OpusCodecTask();
-    void PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm);
+    void OpusDecoderTask();
+    void OpusEncoderTask();
+    bool DecodeNextPacket();
+    TickType_t DecoderWaitTicks();
+    bool EncodeNextTask();
+    bool OpenEncoder(const AudioEncoderConfig& config);
+    void StoreEncoderConfig(const AudioEncoderConfig& config);
+    void AdaptEncoder();
+    void AdaptComplexity(int64_t encode_us);
+    AudioEncoderConfig GetLevelConfig(int level) const;
+    bool DecodeQueueFull() const { return audio_decode_queue_.Size() >= decode_queue_limit_; }
+    bool SendQueueFull() const { return audio_send_queue_.Size() >= send_queue_limit_; }
+    void NotifyTask(TaskHandle_t task);
+    void NotifyWaiter(std::atomic<TaskHandle_t>& waiter);
+    void WaitOn(std::atomic<TaskHandle_t>& waiter, const std::function<bool()>& ready);
+    void PushPacketToSendQueue(AudioStreamPacketPtr packet);
+    size_t PopStagedPackets(AudioStreamPacketPtr* packets, size_t max_count);
+#if CONFIG_FOLLOW_UP_TURN
+    bool HoldFollowUpPreroll(AudioStreamPacketPtr& packet);
+#endif
+    // Leaves pcm holding an empty buffer recycled from the task pool
+    void PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm, int64_t capture_time_us = 0);
+    void RecordSendLatency(const AudioStreamPacket& packet);
     void SetDecodeSampleRate(int sample_rate, int frame_duration);
     void CheckAndUpdateAudioPowerState();
+    void ScheduleAudioPowerCheck();
+    // Accounts the time of the previous power state, and the power-up that led to the new one if any
+    void UpdatePowerState(PowerUpStats* power_up, int64_t power_up_us);
+    void EnableOutputPower();
+    void PlayTask(AudioTask& task);
+    void PlayMixer();
+    void InitializeAudioProcessor();
+    bool InitializeWakeWord();
+    std::unique_ptr<WakeWord> CreateWakeWord(srmodel_list_t* models_list);
+    void WakeWordLoaderTask();
+    // Frees a models list nothing runs on any more
+    void RetireModelsList(srmodel_list_t* models_list);
+    void PlaySound(std::unique_ptr<SoundSource> source, SoundPriority priority);
+    bool PushSoundPacket(AudioStreamPacketPtr packet, uint32_t generation);
+    bool MixSoundPacket(AudioStreamPacketPtr packet, uint32_t generation);
+    bool MixSoundPcm(const int16_t* pcm, size_t samples, SoundPriority priority, uint32_t generation);
+    bool WriteSoundToMixer(const int16_t* pcm, size_t samples, const std::function<bool()>& cancelled);
+    void CloseSoundDecoder();
+#if CONFIG_AUDIO_LATENCY_SELF_TEST
+    bool EncodeLatencyTestSignal(const LatencyProbe& probe, std::vector<AudioStreamPacketPtr>& packets);
+#endif
 };
 
 #endif
\ No newline at end of file
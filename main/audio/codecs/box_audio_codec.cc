@@ -1,4 +1,5 @@
 #include "box_audio_codec.h"
+#include "codec_register_cache.h"
 
 #include <esp_log.h>
 #include <driver/i2c_master.h>
@@ -8,10 +9,12 @@
 
 BoxAudioCodec::BoxAudioCodec(void* i2c_master_handle, int input_sample_rate, int output_sample_rate,
     gpio_num_t mclk, gpio_num_t bclk, gpio_num_t ws, gpio_num_t dout, gpio_num_t din,
-    gpio_num_t pa_pin, uint8_t es8311_addr, uint8_t es7210_addr, bool input_reference) {
+    gpio_num_t pa_pin, uint8_t es8311_addr, uint8_t es7210_addr, bool input_reference, uint16_t input_mic_mask) {
     duplex_ = true; // 是否双工
     input_reference_ = input_reference; // 是否使用参考输入，实现回声消除
-    input_channels_ = input_reference_ ? 2 : 1; // 输入通道数
+    // 参考信号占用通道 1
+    input_mic_mask_ = input_reference_ ? (input_mic_mask & ~ESP_CODEC_DEV_MAKE_CHANNEL_MASK(1)) : input_mic_mask;
+    input_channels_ = __builtin_popcount(input_mic_mask_) + (input_reference_ ? 1 : 0); // 输入通道数
     input_sample_rate_ = input_sample_rate;
     output_sample_rate_ = output_sample_rate;
     input_gain_ = 30;
@@ -33,7 +36,7 @@ BoxAudioCodec::BoxAudioCodec(void* i2c_master_handle, int input_sample_rate, int
         .addr = es8311_addr,
         .bus_handle = i2c_master_handle,
     };
-    out_ctrl_if_ = audio_codec_new_i2c_ctrl(&i2c_cfg);
+    out_ctrl_if_ = CodecRegisterCache::Wrap(audio_codec_new_i2c_ctrl(&i2c_cfg));
     assert(out_ctrl_if_ != NULL);
 
     gpio_if_ = audio_codec_new_gpio();
@@ -60,7 +63,7 @@ BoxAudioCodec::BoxAudioCodec(void* i2c_master_handle, int input_sample_rate, int
 
     // Input
     i2c_cfg.addr = es7210_addr;
-    in_ctrl_if_ = audio_codec_new_i2c_ctrl(&i2c_cfg);
+    in_ctrl_if_ = CodecRegisterCache::Wrap(audio_codec_new_i2c_ctrl(&i2c_cfg));
     assert(in_ctrl_if_ != NULL);
 
     es7210_codec_cfg_t es7210_cfg = {};
@@ -179,6 +182,18 @@ void BoxAudioCodec::CreateDuplexChannels(gpio_num_t mclk, gpio_num_t bclk, gpio_
     ESP_LOGI(TAG, "Duplex channels created");
 }
 
+std::string BoxAudioCodec::input_format() const {
+    std::string format;
+    for (int i = 0; i < 4; i++) {
+        if (input_reference_ && i == 1) {
+            format.push_back('R');
+        } else if (input_mic_mask_ & ESP_CODEC_DEV_MAKE_CHANNEL_MASK(i)) {
+            format.push_back('M');
+        }
+    }
+    return format;
+}
+
 void BoxAudioCodec::SetOutputVolume(int volume) {
     ESP_ERROR_CHECK(esp_codec_dev_set_out_vol(output_dev_, volume));
     AudioCodec::SetOutputVolume(volume);
@@ -193,7 +208,7 @@ void BoxAudioCodec::EnableInput(bool enable) {
         esp_codec_dev_sample_info_t fs = {
             .bits_per_sample = 16,
             .channel = 4,
-            .channel_mask = ESP_CODEC_DEV_MAKE_CHANNEL_MASK(0),
+            .channel_mask = input_mic_mask_,
             .sample_rate = (uint32_t)output_sample_rate_,
             .mclk_multiple = 0,
         };
@@ -201,7 +216,7 @@ void BoxAudioCodec::EnableInput(bool enable) {
             fs.channel_mask |= ESP_CODEC_DEV_MAKE_CHANNEL_MASK(1);
         }
         ESP_ERROR_CHECK(esp_codec_dev_open(input_dev_, &fs));
-        ESP_ERROR_CHECK(esp_codec_dev_set_in_channel_gain(input_dev_, ESP_CODEC_DEV_MAKE_CHANNEL_MASK(0), input_gain_));
+        ESP_ERROR_CHECK(esp_codec_dev_set_in_channel_gain(input_dev_, input_mic_mask_, input_gain_));
     } else {
         ESP_ERROR_CHECK(esp_codec_dev_close(input_dev_));
     }
@@ -0,0 +1,104 @@
+#include "codec_register_cache.h"
+
+#include <esp_codec_dev.h>
+#include <esp_log.h>
+#include <cstdlib>
+#include <cstring>
+
+#define TAG "CodecRegisterCache"
+
+// Register 0x00 resets the ES codecs, which puts every other register back to its default
+#define CODEC_RESET_REG 0x00
+
+#if CONFIG_AUDIO_CODEC_REGISTER_CACHE
+namespace {
+
+// Freed by audio_codec_delete_ctrl_if() with free(), so it is a plain struct with the interface first
+struct CachedCtrl {
+    audio_codec_ctrl_if_t base;
+    const audio_codec_ctrl_if_t* ctrl;
+    uint8_t values[256];
+    uint32_t valid[256 / 32];
+    uint32_t skipped;
+};
+
+bool IsCached(const CachedCtrl* cached, int reg) {
+    return (cached->valid[reg / 32] >> (reg % 32)) & 1;
+}
+
+int Open(const audio_codec_ctrl_if_t* base, void* cfg, int cfg_size) {
+    auto cached = (const CachedCtrl*)base;
+    return cached->ctrl->open(cached->ctrl, cfg, cfg_size);
+}
+
+bool IsOpen(const audio_codec_ctrl_if_t* base) {
+    auto cached = (const CachedCtrl*)base;
+    return cached->ctrl->is_open(cached->ctrl);
+}
+
+int ReadReg(const audio_codec_ctrl_if_t* base, int reg, int reg_len, void* data, int data_len) {
+    auto cached = (const CachedCtrl*)base;
+    if (reg_len == 1 && data_len == 1 && reg >= 0 && reg < 256 && IsCached(cached, reg)) {
+        *(uint8_t*)data = cached->values[reg];
+        return ESP_CODEC_DEV_OK;
+    }
+    return cached->ctrl->read_reg(cached->ctrl, reg, reg_len, data, data_len);
+}
+
+int WriteReg(const audio_codec_ctrl_if_t* base, int reg, int reg_len, void* data, int data_len) {
+    // The interface is const for the drivers, the cache is the only state that changes
+    auto cached = (CachedCtrl*)base;
+    if (reg_len != 1 || data_len != 1 || reg < 0 || reg >= 256) {
+        return cached->ctrl->write_reg(cached->ctrl, reg, reg_len, data, data_len);
+    }
+    if (reg == CODEC_RESET_REG) {
+        memset(cached->valid, 0, sizeof(cached->valid));
+        return cached->ctrl->write_reg(cached->ctrl, reg, reg_len, data, data_len);
+    }
+    uint8_t value = *(uint8_t*)data;
+    if (IsCached(cached, reg) && cached->values[reg] == value) {
+        cached->skipped++;
+        return ESP_CODEC_DEV_OK;
+    }
+    int ret = cached->ctrl->write_reg(cached->ctrl, reg, reg_len, data, data_len);
+    if (ret == ESP_CODEC_DEV_OK) {
+        cached->values[reg] = value;
+        cached->valid[reg / 32] |= 1u << (reg % 32);
+    } else {
+        // What the codec holds now is unknown
+        cached->valid[reg / 32] &= ~(1u << (reg % 32));
+    }
+    return ret;
+}
+
+int Close(const audio_codec_ctrl_if_t* base) {
+    auto cached = (const CachedCtrl*)base;
+    ESP_LOGI(TAG, "%lu register writes were skipped", cached->skipped);
+    audio_codec_delete_ctrl_if(cached->ctrl);
+    return ESP_CODEC_DEV_OK;
+}
+
+} // namespace
+#endif
+
+const audio_codec_ctrl_if_t* CodecRegisterCache::Wrap(const audio_codec_ctrl_if_t* ctrl) {
+#if CONFIG_AUDIO_CODEC_REGISTER_CACHE
+    if (ctrl == nullptr) {
+        return nullptr;
+    }
+    auto cached = (CachedCtrl*)calloc(1, sizeof(CachedCtrl));
+    if (cached == nullptr) {
+        ESP_LOGW(TAG, "No memory for the register cache");
+        return ctrl;
+    }
+    cached->base.open = Open;
+    cached->base.is_open = IsOpen;
+    cached->base.read_reg = ReadReg;
+    cached->base.write_reg = WriteReg;
+    cached->base.close = Close;
+    cached->ctrl = ctrl;
+    return &cached->base;
+#else
+    return ctrl;
+#endif
+}
@@ -0,0 +1,24 @@
+#ifndef _CODEC_REGISTER_CACHE_H
+#define _CODEC_REGISTER_CACHE_H
+
+#include <esp_codec_dev_defaults.h>
+
+/*
+ * Keeps the last value written to each 8-bit register of a codec, so a write of the same
+ * value again is skipped and the read of a written register does not touch the bus.
+ *
+ * The ES83xx drivers write most of their registers again on every esp_codec_dev_open(), set
+ * the volume and the mute bits with read-modify-write, and the audio service opens and
+ * closes the device with the input and output power. With the cache only the registers
+ * that changed go over I2C.
+ *
+ * Registers that were never written are always read from the codec. Wrap() returns the
+ * interface as it is unless CONFIG_AUDIO_CODEC_REGISTER_CACHE is set.
+ */
+class CodecRegisterCache {
+public:
+    // The wrapper takes the interface over, audio_codec_delete_ctrl_if() deletes both
+    static const audio_codec_ctrl_if_t* Wrap(const audio_codec_ctrl_if_t* ctrl);
+};
+
+#endif // _CODEC_REGISTER_CACHE_H
@@ -1,4 +1,5 @@
 #include "es8389_audio_codec.h"
+#include "codec_register_cache.h"
 
 #include <esp_log.h>
 
@@ -31,7 +32,7 @@ Es8389AudioCodec::Es8389AudioCodec(void* i2c_master_handle, i2c_port_t i2c_port,
         .addr = es8389_addr,
         .bus_handle = i2c_master_handle,
     };
-    ctrl_if_ = audio_codec_new_i2c_ctrl(&i2c_cfg);
+    ctrl_if_ = CodecRegisterCache::Wrap(audio_codec_new_i2c_ctrl(&i2c_cfg));
     assert(ctrl_if_ != NULL);
 
     gpio_if_ = audio_codec_new_gpio();
@@ -1,4 +1,5 @@
 #include "no_audio_codec.h"
+#include "audio_dsp.h"
 
 #include <esp_log.h>
 #include <cmath>
@@ -15,6 +16,30 @@ NoAudioCodec::~NoAudioCodec() {
     }
 }
 
+/* The speaker of a simplex codec has an I2S port of its own, its clock is set again while it is stopped */
+bool NoAudioCodec::SetOutputSampleRate(int sample_rate) {
+    if (duplex_ || tx_handle_ == nullptr) {
+        return AudioCodec::SetOutputSampleRate(sample_rate);
+    }
+    if (sample_rate == output_sample_rate_) {
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(data_if_mutex_);
+    bool running = i2s_channel_disable(tx_handle_) == ESP_OK;
+    i2s_std_clk_config_t clk_cfg = I2S_STD_CLK_DEFAULT_CONFIG((uint32_t)sample_rate);
+    esp_err_t err = i2s_channel_reconfig_std_clock(tx_handle_, &clk_cfg);
+    if (running) {
+        ESP_ERROR_CHECK(i2s_channel_enable(tx_handle_));
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to run the output at %d Hz: %s", sample_rate, esp_err_to_name(err));
+        return false;
+    }
+    ESP_LOGI(TAG, "Output rate %d -> %d Hz", output_sample_rate_, sample_rate);
+    output_sample_rate_ = sample_rate;
+    return true;
+}
+
 NoAudioCodecDuplex::NoAudioCodecDuplex(int input_sample_rate, int output_sample_rate, gpio_num_t bclk, gpio_num_t ws, gpio_num_t dout, gpio_num_t din) {
     duplex_ = true;
     input_sample_rate_ = input_sample_rate;
@@ -216,41 +241,32 @@ NoAudioCodecSimplex::NoAudioCodecSimplex(int input_sample_rate, int output_sampl
 
 int NoAudioCodec::Write(const int16_t* data, int samples) {
     std::lock_guard<std::mutex> lock(data_if_mutex_);
-    std::vector<int32_t> buffer(samples);
+    write_buffer_.resize(samples);
 
     // output_volume_: 0-100
-    // volume_factor_: 0-65536
-    int32_t volume_factor = pow(double(output_volume_) / 100.0, 2) * 65536;
-    for (int i = 0; i < samples; i++) {
-        int64_t temp = int64_t(data[i]) * volume_factor; // 使用 int64_t 进行乘法运算
-        if (temp > INT32_MAX) {
-            buffer[i] = INT32_MAX;
-        } else if (temp < INT32_MIN) {
-            buffer[i] = INT32_MIN;
-        } else {
-            buffer[i] = static_cast<int32_t>(temp);
-        }
+    // volume_factor_: 0-65536, so the 32-bit product never overflows
+    if (output_volume_ != factor_volume_) {
+        factor_volume_ = output_volume_;
+        volume_factor_ = pow(double(output_volume_) / 100.0, 2) * 65536;
     }
+    AudioDsp::ConvertInt16ToInt32(data, write_buffer_.data(), samples, volume_factor_);
 
     size_t bytes_written;
-    ESP_ERROR_CHECK(i2s_channel_write(tx_handle_, buffer.data(), samples * sizeof(int32_t), &bytes_written, portMAX_DELAY));
+    ESP_ERROR_CHECK(i2s_channel_write(tx_handle_, write_buffer_.data(), samples * sizeof(int32_t), &bytes_written, portMAX_DELAY));
     return bytes_written / sizeof(int32_t);
 }
 
 int NoAudioCodec::Read(int16_t* dest, int samples) {
     size_t bytes_read;
 
-    std::vector<int32_t> bit32_buffer(samples);
-    if (i2s_channel_read(rx_handle_, bit32_buffer.data(), samples * sizeof(int32_t), &bytes_read, portMAX_DELAY) != ESP_OK) {
+    read_buffer_.resize(samples);
+    if (i2s_channel_read(rx_handle_, read_buffer_.data(), samples * sizeof(int32_t), &bytes_read, portMAX_DELAY) != ESP_OK) {
         ESP_LOGE(TAG, "Read Failed!");
         return 0;
     }
 
     samples = bytes_read / sizeof(int32_t);
-    for (int i = 0; i < samples; i++) {
-        int32_t value = bit32_buffer[i] >> 12;
-        dest[i] = (value > INT16_MAX) ? INT16_MAX : (value < -INT16_MAX) ? -INT16_MAX : (int16_t)value;
-    }
+    AudioDsp::ConvertInt32ToInt16(read_buffer_.data(), dest, samples, 12);
     return samples;
 }
 
@@ -349,11 +365,7 @@ int NoAudioCodecSimplexPdm::Read(int16_t* dest, int samples) {
 
     samples = bytes_read / sizeof(int16_t);
     if (input_gain_ > 0) {
-        int gain_factor = (int)input_gain_;
-        for (int i = 0; i < samples; i++) {
-            int32_t amplified = dest[i] * gain_factor;
-            dest[i] = (amplified > INT16_MAX) ? INT16_MAX : (amplified < -INT16_MAX) ? -INT16_MAX : (int16_t)amplified;
-        }
+        AudioDsp::ApplyGain(dest, dest, samples, (int32_t)(input_gain_ * 256));
     }
     return samples;
 }
@@ -6,16 +6,24 @@
 #include <driver/gpio.h>
 #include <driver/i2s_pdm.h>
 #include <mutex>
+#include <vector>
 
 class NoAudioCodec : public AudioCodec {
 protected:
     std::mutex data_if_mutex_;
+    // Reused 32-bit I2S buffers, the read one belongs to the audio input task
+    std::vector<int32_t> write_buffer_;
+    std::vector<int32_t> read_buffer_;
+    // The volume factor of Write(), computed again when the volume changes
+    int factor_volume_ = -1;
+    int32_t volume_factor_ = 0;
 
     virtual int Write(const int16_t* data, int samples) override;
     virtual int Read(int16_t* dest, int samples) override;
 
 public:
     virtual ~NoAudioCodec();
+    virtual bool SetOutputSampleRate(int sample_rate) override;
 };
 
 class NoAudioCodecDuplex : public NoAudioCodec {
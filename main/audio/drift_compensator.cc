@@ -0,0 +1,93 @@
+#include "drift_compensator.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cmath>
+
+#define TAG "DriftCompensator"
+
+// The stream plays this long before the backlog it settled at becomes the reference
+#define DRIFT_SETTLE_MS 5000
+// Time constant of the smoothed backlog, the packets of a burst come and go in much less
+#define DRIFT_SMOOTHING_MS 4000
+// The correction for each ms the backlog is off, and what the integral adds per ms and second
+#define DRIFT_PROPORTIONAL_PPM_PER_MS 10.0f
+#define DRIFT_INTEGRAL_PPM_PER_MS_S 0.2f
+
+DriftCompensator::DriftCompensator(int max_ppm)
+    : max_ppm_(max_ppm),
+      ppm_gauge_(PerfCounters::GetInstance().Gauge("audio.drift_ppm")),
+      dropped_(PerfCounters::GetInstance().Counter("audio.drift_dropped_samples")),
+      inserted_(PerfCounters::GetInstance().Counter("audio.drift_inserted_samples")) {
+}
+
+void DriftCompensator::Reset() {
+    if (played_ms_ >= DRIFT_SETTLE_MS) {
+        ESP_LOGI(TAG, "Stream of %d s, backlog %d ms of %d ms, correction %d ppm", played_ms_ / 1000,
+            (int)backlog_ms_, (int)reference_ms_, ppm_);
+    }
+    played_ms_ = 0;
+    backlog_ms_ = 0;
+    reference_ms_ = 0;
+    integral_ppm_ = 0;
+    ppm_ = 0;
+    owed_samples_ = 0;
+    ppm_gauge_->Set(0);
+}
+
+void DriftCompensator::Observe(int backlog_ms, int frame_ms) {
+    if (played_ms_ == 0) {
+        backlog_ms_ = backlog_ms;
+    } else {
+        backlog_ms_ += (backlog_ms - backlog_ms_) * frame_ms / DRIFT_SMOOTHING_MS;
+    }
+    played_ms_ += frame_ms;
+    if (played_ms_ < DRIFT_SETTLE_MS) {
+        reference_ms_ = backlog_ms_;
+        return;
+    }
+
+    float error_ms = backlog_ms_ - reference_ms_;
+    integral_ppm_ += error_ms * DRIFT_INTEGRAL_PPM_PER_MS_S * frame_ms / 1000;
+    integral_ppm_ = std::clamp<float>(integral_ppm_, -max_ppm_, max_ppm_);
+    int ppm = std::clamp<int>(std::lround(error_ms * DRIFT_PROPORTIONAL_PPM_PER_MS + integral_ppm_), -max_ppm_, max_ppm_);
+    if (ppm != ppm_) {
+        ppm_ = ppm;
+        ppm_gauge_->Set(ppm);
+    }
+}
+
+void DriftCompensator::Process(std::vector<int16_t>& pcm) {
+    if (ppm_ == 0 || pcm.size() < 16) {
+        return;
+    }
+    owed_samples_ += (float)pcm.size() * ppm_ / 1000000;
+    int change = 0;
+    if (owed_samples_ >= 1) {
+        change = -1;
+    } else if (owed_samples_ <= -1) {
+        change = 1;
+    } else {
+        return;
+    }
+    owed_samples_ += change;
+
+    /* Spread the sample across the whole frame, so there is no step where it was taken or added */
+    size_t input_frames = pcm.size();
+    size_t output_frames = input_frames + change;
+    scratch_.resize(output_frames);
+    int64_t step_q16 = ((int64_t)(input_frames - 1) << 16) / (int64_t)(output_frames - 1);
+    for (size_t i = 0; i < output_frames; i++) {
+        int64_t position_q16 = step_q16 * i;
+        size_t index = std::min<size_t>(position_q16 >> 16, input_frames - 1);
+        size_t next = std::min(index + 1, input_frames - 1);
+        int32_t fraction = position_q16 & 0xffff;
+        scratch_[i] = pcm[index] + (((int64_t)pcm[next] - pcm[index]) * fraction >> 16);
+    }
+    pcm.swap(scratch_);
+    if (change < 0) {
+        dropped_->Add();
+    } else {
+        inserted_->Add();
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef DRIFT_COMPENSATOR_H
+#define DRIFT_COMPENSATOR_H
+
+#include "perf_counters.h"
+
+#include <cstdint>
+#include <vector>
+
+/*
+ * Keeps the playout latency of a long stream where it settled while the clock of the server and
+ * the I2S clock of the codec drift apart, enabled with CONFIG_AUDIO_DRIFT_COMPENSATION.
+ *
+ * A hundred ppm between the two crystals is 0.36 s an hour: the decode queue fills towards its
+ * capacity, or drains into underruns. The audio buffered ahead of the playout is smoothed over a
+ * few seconds, and once a stream has played for a while the level it settled at is the reference.
+ * The difference to it turns into a correction in ppm, the frames are then squeezed or stretched
+ * by one sample whenever the correction adds up to a whole one. One sample across a frame is far
+ * below what an ear tells apart, the pitch moves by the correction at most.
+ *
+ * Reset() starts over, at every reply and after an underrun. Used by the decoder task only.
+ */
+class DriftCompensator {
+public:
+    explicit DriftCompensator(int max_ppm);
+
+    void Reset();
+    // The audio buffered ahead of the playout once a frame of frame_ms was decoded
+    void Observe(int backlog_ms, int frame_ms);
+    // Squeezes or stretches a mono frame by the whole samples the correction owes
+    void Process(std::vector<int16_t>& pcm);
+    int ppm() const { return ppm_; }
+
+private:
+    int max_ppm_;
+    int played_ms_ = 0;             // Since the reset, the reference is taken after the settling
+    float backlog_ms_ = 0;          // Smoothed
+    float reference_ms_ = 0;
+    float integral_ppm_ = 0;
+    int ppm_ = 0;                   // Positive while the backlog grows, the frames are squeezed
+    float owed_samples_ = 0;
+    std::vector<int16_t> scratch_;
+    PerfGauge* ppm_gauge_;
+    PerfCounter* dropped_;
+    PerfCounter* inserted_;
+};
+
+#endif // DRIFT_COMPENSATOR_H
@@ -0,0 +1,74 @@
+#include "endpointer.h"
+
+#include <esp_log.h>
+
+#define TAG "Endpointer"
+
+Endpointer::Endpointer(int hangover_ms, int min_speech_ms)
+    : hangover_us_((int64_t)hangover_ms * 1000), min_speech_us_((int64_t)min_speech_ms * 1000) {
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            static_cast<Endpointer*>(arg)->OnTimer();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "endpointer",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer_));
+}
+
+Endpointer::~Endpointer() {
+    if (timer_ != nullptr) {
+        esp_timer_stop(timer_);
+        esp_timer_delete(timer_);
+    }
+}
+
+void Endpointer::Start(bool speaking) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    esp_timer_stop(timer_);
+    active_ = true;
+    speaking_ = speaking;
+    speech_start_us_ = esp_timer_get_time();
+    speech_us_ = 0;
+}
+
+void Endpointer::Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    active_ = false;
+    esp_timer_stop(timer_);
+}
+
+void Endpointer::OnVadChange(bool speaking) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!active_ || speaking == speaking_) {
+        return;
+    }
+    speaking_ = speaking;
+    int64_t now = esp_timer_get_time();
+    if (speaking) {
+        speech_start_us_ = now;
+        esp_timer_stop(timer_);
+        return;
+    }
+    speech_us_ += now - speech_start_us_;
+    if (speech_us_ >= min_speech_us_) {
+        esp_timer_start_once(timer_, hangover_us_);
+    }
+}
+
+void Endpointer::OnTimer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Stopped or spoken again meanwhile
+        if (!active_ || speaking_) {
+            return;
+        }
+        active_ = false;
+    }
+    ESP_LOGI(TAG, "End of speech after %d ms of voice", int(speech_us_ / 1000));
+    if (on_end_of_speech_) {
+        on_end_of_speech_();
+    }
+}
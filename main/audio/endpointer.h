@@ -0,0 +1,47 @@
+#ifndef ENDPOINTER_H
+#define ENDPOINTER_H
+
+#include <esp_timer.h>
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+/*
+ * Decides on the device that the user stopped speaking, for the auto stop listening mode.
+ *
+ * Fed with the VAD changes of the audio processor. Once the voiced time of the turn reaches
+ * the minimum speech, a silence that lasts the hangover ends the turn and the callback is
+ * called from the esp_timer task, once per Start(). Speech before the hangover runs out
+ * extends the turn. A cough or a click too short for the minimum speech never ends it, the
+ * server VAD does then. The methods may be called from any task.
+ */
+class Endpointer {
+public:
+    Endpointer(int hangover_ms, int min_speech_ms);
+    ~Endpointer();
+    Endpointer(const Endpointer&) = delete;
+    Endpointer& operator=(const Endpointer&) = delete;
+
+    void OnEndOfSpeech(std::function<void()> callback) { on_end_of_speech_ = std::move(callback); }
+    // A turn starts, with the VAD state at that moment
+    void Start(bool speaking);
+    void Stop();
+    void OnVadChange(bool speaking);
+
+private:
+    int64_t hangover_us_;
+    int64_t min_speech_us_;
+    esp_timer_handle_t timer_ = nullptr;
+    std::function<void()> on_end_of_speech_;
+
+    std::mutex mutex_;
+    bool active_ = false;
+    bool speaking_ = false;
+    int64_t speech_start_us_ = 0;   // Of the voiced stretch going on
+    int64_t speech_us_ = 0;         // Of the voiced stretches that ended
+
+    void OnTimer();
+};
+
+#endif // ENDPOINTER_H
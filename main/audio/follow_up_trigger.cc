@@ -0,0 +1,69 @@
+#include "follow_up_trigger.h"
+
+#include <esp_log.h>
+
+#define TAG "FollowUpTrigger"
+
+FollowUpTrigger::FollowUpTrigger(int min_speech_ms) : min_speech_us_((int64_t)min_speech_ms * 1000) {
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            static_cast<FollowUpTrigger*>(arg)->OnTimer();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "follow_up",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer_));
+}
+
+FollowUpTrigger::~FollowUpTrigger() {
+    if (timer_ != nullptr) {
+        esp_timer_stop(timer_);
+        esp_timer_delete(timer_);
+    }
+}
+
+void FollowUpTrigger::Start(bool speaking) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    esp_timer_stop(timer_);
+    active_ = true;
+    speaking_ = speaking;
+    // Voice going on already counts from here
+    if (speaking) {
+        esp_timer_start_once(timer_, min_speech_us_);
+    }
+}
+
+void FollowUpTrigger::Stop() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    active_ = false;
+    esp_timer_stop(timer_);
+}
+
+void FollowUpTrigger::OnVadChange(bool speaking) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!active_ || speaking == speaking_) {
+        return;
+    }
+    speaking_ = speaking;
+    esp_timer_stop(timer_);
+    if (speaking) {
+        esp_timer_start_once(timer_, min_speech_us_);
+    }
+}
+
+void FollowUpTrigger::OnTimer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Stopped or paused meanwhile
+        if (!active_ || !speaking_) {
+            return;
+        }
+        active_ = false;
+    }
+    ESP_LOGI(TAG, "Follow-up speech after %d ms of voice", int(min_speech_us_ / 1000));
+    if (on_voice_) {
+        on_voice_();
+    }
+}
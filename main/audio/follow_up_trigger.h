@@ -0,0 +1,43 @@
+#ifndef FOLLOW_UP_TRIGGER_H
+#define FOLLOW_UP_TRIGGER_H
+
+#include <esp_timer.h>
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+/*
+ * Decides that the user spoke again after a reply, for the follow-up turn without the wake word.
+ *
+ * Fed with the VAD changes of the audio processor while the device waits for a follow-up. Voice
+ * that lasts the minimum speech without a pause calls the callback from the esp_timer task, once
+ * per Start(). The bar is higher than the wake word path, which trusts any VAD onset, so a door
+ * or a cough does not start a turn. The methods may be called from any task.
+ */
+class FollowUpTrigger {
+public:
+    explicit FollowUpTrigger(int min_speech_ms);
+    ~FollowUpTrigger();
+    FollowUpTrigger(const FollowUpTrigger&) = delete;
+    FollowUpTrigger& operator=(const FollowUpTrigger&) = delete;
+
+    void OnVoice(std::function<void()> callback) { on_voice_ = std::move(callback); }
+    // The wait starts, with the VAD state at that moment
+    void Start(bool speaking);
+    void Stop();
+    void OnVadChange(bool speaking);
+
+private:
+    int64_t min_speech_us_;
+    esp_timer_handle_t timer_ = nullptr;
+    std::function<void()> on_voice_;
+
+    std::mutex mutex_;
+    bool active_ = false;
+    bool speaking_ = false;
+
+    void OnTimer();
+};
+
+#endif // FOLLOW_UP_TRIGGER_H
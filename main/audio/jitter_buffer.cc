@@ -0,0 +1,165 @@
+#include "jitter_buffer.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cstdlib>
+
+#define TAG "JitterBuffer"
+
+JitterBuffer::JitterBuffer(size_t capacity) : capacity_(std::min(capacity, kMaxCapacity)) {
+}
+
+void JitterBuffer::Reset() {
+    for (auto& slot : slots_) {
+        slot.packet.reset();
+    }
+    count_ = 0;
+    started_ = false;
+    buffering_ = true;
+    underrun_ = false;
+    has_transit_ = false;
+    // The jitter estimate is kept, the network does not change with the stream
+}
+
+bool JitterBuffer::Put(AudioStreamPacketPtr&& packet, int64_t now_ms) {
+    if (packet->frame_duration > 0) {
+        frame_duration_ms_ = packet->frame_duration;
+    }
+
+    bool local = packet->sequence == 0;
+    uint32_t sequence = local ? (started_ ? last_sequence_ + 1 : 1) : packet->sequence;
+    if (!started_) {
+        started_ = true;
+        next_sequence_ = sequence;
+        last_sequence_ = sequence - 1;
+    }
+
+    int32_t offset = static_cast<int32_t>(sequence - next_sequence_);
+    if (offset < 0) {
+        if (offset < -static_cast<int32_t>(kMaxCapacity * 2)) {
+            // The server started numbering again
+            ESP_LOGI(TAG, "Sequence restarted at %lu, expected %lu", sequence, next_sequence_);
+            Reset();
+            return Put(std::move(packet), now_ms);
+        }
+        late_count_++;
+        return false;
+    }
+    if (offset >= static_cast<int32_t>(capacity_)) {
+        // Too far ahead, give up on the missing packets
+        SkipTo(sequence - capacity_ + 1);
+    }
+
+    auto& slot = SlotOf(sequence);
+    if (slot.packet) {
+        // Duplicate
+        return false;
+    }
+    if (buffering_ && count_ == 0) {
+        buffering_since_ms_ = now_ms;
+    }
+    slot.packet = std::move(packet);
+    slot.arrival_ms = now_ms;
+    slot.local = local;
+    count_++;
+    if (static_cast<int32_t>(sequence - last_sequence_) > 0) {
+        last_sequence_ = sequence;
+    }
+    if (!local) {
+        UpdateJitter(sequence, now_ms);
+    }
+    return true;
+}
+
+JitterBuffer::Result JitterBuffer::Get(AudioStreamPacketPtr& packet, int64_t now_ms) {
+    if (count_ == 0) {
+        // Underrun, build up the target delay again before playing the next packet
+        if (!buffering_) {
+            buffering_ = true;
+            underrun_ = true;
+        }
+        return kJitterBufferEmpty;
+    }
+
+    auto& head = SlotOf(next_sequence_);
+    if (buffering_) {
+        bool local_head = head.packet && head.local;
+        int depth = static_cast<int32_t>(last_sequence_ - next_sequence_) + 1;
+        int prebuffer_frames = (prebuffer_ms_ + frame_duration_ms_ - 1) / frame_duration_ms_;
+        int frames = std::min(std::max(target_frames_, prebuffer_frames), static_cast<int>(capacity_));
+        int delay_ms = std::max(target_delay_ms(), prebuffer_ms_);
+        if (!local_head && depth < frames && now_ms - buffering_since_ms_ < delay_ms) {
+            return kJitterBufferEmpty;
+        }
+        buffering_ = false;
+        if (underrun_ && !local_head) {
+            // Only counted once the stream goes on, running dry at its end is not an underrun
+            underrun_count_++;
+        }
+        underrun_ = false;
+    }
+
+    if (head.packet) {
+        packet = std::move(head.packet);
+        count_--;
+        next_sequence_++;
+        return kJitterBufferPacket;
+    }
+
+    // The next packet is missing but later ones are here, wait for it a little
+    int64_t earliest_arrival_ms = now_ms;
+    for (uint32_t sequence = next_sequence_ + 1; sequence != last_sequence_ + 1; ++sequence) {
+        auto& slot = SlotOf(sequence);
+        if (slot.packet) {
+            earliest_arrival_ms = std::min(earliest_arrival_ms, slot.arrival_ms);
+        }
+    }
+    int depth = static_cast<int32_t>(last_sequence_ - next_sequence_);
+    if (depth <= target_frames_ && now_ms - earliest_arrival_ms < frame_duration_ms_) {
+        return kJitterBufferEmpty;
+    }
+    next_sequence_++;
+    lost_count_++;
+    return kJitterBufferLost;
+}
+
+void JitterBuffer::UpdateJitter(uint32_t sequence, int64_t arrival_ms) {
+    int64_t transit_ms = arrival_ms - static_cast<int64_t>(sequence) * frame_duration_ms_;
+    if (has_transit_) {
+        int32_t d = static_cast<int32_t>(std::min<int64_t>(std::llabs(transit_ms - last_transit_ms_), 1000));
+        jitter_q4_ += d - ((jitter_q4_ + 8) >> 4);
+    }
+    last_transit_ms_ = transit_ms;
+    has_transit_ = true;
+
+    // Hold back about three times the jitter, plus the frame being played
+    int frames = 1 + (3 * jitter_ms() + frame_duration_ms_ - 1) / frame_duration_ms_;
+    frames = std::max(frames, min_target_frames_);
+    frames = std::min(frames, std::min(kMaxTargetFrames, static_cast<int>(capacity_)));
+    if (frames != target_frames_) {
+        ESP_LOGD(TAG, "Jitter %d ms, target delay %d -> %d frames", jitter_ms(), target_frames_, frames);
+        target_frames_ = frames;
+    }
+}
+
+void JitterBuffer::SkipTo(uint32_t sequence) {
+    uint32_t gap = sequence - next_sequence_;
+    if (gap > kMaxCapacity) {
+        for (auto& slot : slots_) {
+            slot.packet.reset();
+        }
+        count_ = 0;
+        lost_count_ += gap;
+        next_sequence_ = sequence;
+        return;
+    }
+    while (next_sequence_ != sequence) {
+        auto& slot = SlotOf(next_sequence_);
+        if (slot.packet) {
+            slot.packet.reset();
+            count_--;
+        }
+        lost_count_++;
+        next_sequence_++;
+    }
+}
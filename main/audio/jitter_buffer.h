@@ -0,0 +1,99 @@
+#ifndef JITTER_BUFFER_H
+#define JITTER_BUFFER_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "protocol.h"
+
+/*
+ * Adaptive jitter buffer for the incoming Opus stream.
+ *
+ * Packets are stored by sequence number, so reordered packets are played in order and
+ * packets that arrive after their turn are dropped. The interarrival jitter is tracked
+ * like RFC 3550 does, and the playout delay target follows it: on a good Wi-Fi link the
+ * buffer releases a frame almost immediately, on a 4G link it holds a few frames back.
+ *
+ * Get() tells the caller when the next frame is missing, so that it can be concealed
+ * with Opus PLC.
+ *
+ * Packets without a sequence (local sounds) are appended in order and never delayed.
+ *
+ * A fixed prebuffer can be set on top of the jitter target, it is built up when a stream
+ * starts and again after an underrun, so the first words play without gaps.
+ *
+ * Not thread safe, it is owned by the Opus decoder task. Only size() may be read from other tasks.
+ */
+class JitterBuffer {
+public:
+    enum Result {
+        kJitterBufferEmpty,     // Nothing to play now
+        kJitterBufferPacket,    // The next packet in order
+        kJitterBufferLost,      // The next packet is missing, conceal it
+    };
+
+    static constexpr size_t kMaxCapacity = 64;
+
+    explicit JitterBuffer(size_t capacity);
+
+    void Reset();
+    void SetPrebuffer(int prebuffer_ms) { prebuffer_ms_ = prebuffer_ms; }
+    // Up to kMaxCapacity, the packets already in stay when it shrinks and Full() holds the rest back
+    void SetCapacity(size_t capacity) { capacity_ = std::min(capacity, kMaxCapacity); }
+    // Never hold back fewer frames than this, e.g. while the transport reorders packets
+    void SetMinDelayFrames(int frames) { min_target_frames_ = frames; }
+    bool Full() const { return count_ >= capacity_; }
+    size_t size() const { return count_; }
+
+    // Returns false if the packet came too late and was dropped
+    bool Put(AudioStreamPacketPtr&& packet, int64_t now_ms);
+    Result Get(AudioStreamPacketPtr& packet, int64_t now_ms);
+
+    int jitter_ms() const { return jitter_q4_ >> 4; }
+    int target_delay_ms() const { return target_frames_ * frame_duration_ms_; }
+    uint32_t lost_count() const { return lost_count_; }
+    uint32_t late_count() const { return late_count_; }
+    // Times the buffer ran dry in the middle of a stream
+    uint32_t underrun_count() const { return underrun_count_; }
+
+private:
+    static constexpr int kMaxTargetFrames = 16;
+
+    struct Slot {
+        AudioStreamPacketPtr packet;
+        int64_t arrival_ms = 0;
+        bool local = false;
+    };
+
+    std::array<Slot, kMaxCapacity> slots_;
+    size_t capacity_;
+    std::atomic<size_t> count_ = 0;
+    bool started_ = false;
+    bool buffering_ = true;
+    bool underrun_ = false;
+    int prebuffer_ms_ = 0;
+    uint32_t next_sequence_ = 0;
+    uint32_t last_sequence_ = 0;        // Highest sequence put so far
+    int64_t buffering_since_ms_ = 0;
+
+    // Interarrival jitter in 1/16 ms, as in RFC 3550
+    bool has_transit_ = false;
+    int64_t last_transit_ms_ = 0;
+    int32_t jitter_q4_ = 0;
+    int frame_duration_ms_ = 60;
+    int target_frames_ = 1;
+    int min_target_frames_ = 1;
+
+    uint32_t lost_count_ = 0;
+    uint32_t late_count_ = 0;
+    uint32_t underrun_count_ = 0;
+
+    Slot& SlotOf(uint32_t sequence) { return slots_[sequence % kMaxCapacity]; }
+    void UpdateJitter(uint32_t sequence, int64_t arrival_ms);
+    void SkipTo(uint32_t sequence);
+};
+
+#endif // JITTER_BUFFER_H
@@ -0,0 +1,236 @@
+#include "latency_probe.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <algorithm>
+#include <cmath>
+#include <new>
+
+#define TAG "LatencyProbe"
+
+#define CHIRP_AMPLITUDE 0.5f
+#define CHIRP_TAPER_MS 5
+// The correlation yields the CPU this often, so the idle task gets to run
+#define FIND_YIELD_LAGS 256
+
+void LatencyProbe::Recording::Reserve(size_t samples, int rate) {
+    pcm.reserve(samples);
+    capacity = samples;
+    sample_rate = rate;
+}
+
+size_t LatencyProbe::Recording::Append(const int16_t* data, size_t samples, size_t stride, int64_t time_us) {
+    if (Full()) {
+        return 0;
+    }
+    size_t count = std::min(samples, capacity - pcm.size());
+    for (size_t i = 0; i < count; i++) {
+        pcm.push_back(data[i * stride]);
+    }
+    /* The block was done at time_us, the part that did not fit ends earlier */
+    marks[mark_count++] = {pcm.size(), time_us - (int64_t)(samples - count) * 1000000 / sample_rate};
+    return count;
+}
+
+int64_t LatencyProbe::Recording::TimeOf(size_t index) const {
+    for (size_t i = 0; i < mark_count; i++) {
+        if (marks[i].end > index) {
+            return marks[i].time_us - (int64_t)(marks[i].end - index) * 1000000 / sample_rate;
+        }
+    }
+    return mark_count > 0 ? marks[mark_count - 1].time_us : 0;
+}
+
+LatencyProbe::LatencyProbe(int output_sample_rate, int input_channels, int mic_channel, int reference_channel)
+    : output_sample_rate_(output_sample_rate), input_channels_(input_channels), mic_channel_(mic_channel),
+      reference_channel_(reference_channel) {
+}
+
+bool LatencyProbe::Allocate() {
+    try {
+        output_.Reserve(kOutputRecordMs * output_sample_rate_ / 1000, output_sample_rate_);
+        size_t input_samples = kInputRecordMs * kCaptureSampleRate / 1000;
+        mic_.Reserve(input_samples, kCaptureSampleRate);
+        if (reference_channel_ >= 0) {
+            reference_.Reserve(input_samples, kCaptureSampleRate);
+        }
+        processed_.Reserve(input_samples, kCaptureSampleRate);
+    } catch (const std::bad_alloc&) {
+        ESP_LOGE(TAG, "No memory for the recordings");
+        return false;
+    }
+    return true;
+}
+
+void LatencyProbe::GenerateChirp(int16_t* pcm, size_t samples, int sample_rate, bool quadrature) {
+    float duration = (float)samples / sample_rate;
+    float sweep = (kChirpEndHz - kChirpStartHz) / duration;
+    size_t taper = CHIRP_TAPER_MS * sample_rate / 1000;
+    for (size_t i = 0; i < samples; i++) {
+        float t = (float)i / sample_rate;
+        float phase = 2 * M_PI * (kChirpStartHz * t + 0.5f * sweep * t * t);
+        float value = quadrature ? sinf(phase) : cosf(phase);
+        /* Raised cosine edges, a hard start would click and smear the correlation */
+        size_t edge = std::min(i, samples - 1 - i);
+        if (edge < taper) {
+            value *= 0.5f - 0.5f * cosf(M_PI * edge / taper);
+        }
+        pcm[i] = (int16_t)(value * CHIRP_AMPLITUDE * 32767);
+    }
+}
+
+void LatencyProbe::GenerateSignal(std::vector<int16_t>& pcm) const {
+    size_t lead = kLeadMs * kCaptureSampleRate / 1000;
+    size_t chirp = kChirpMs * kCaptureSampleRate / 1000;
+    size_t tail = kTailMs * kCaptureSampleRate / 1000;
+    pcm.assign(lead + chirp + tail, 0);
+    GenerateChirp(pcm.data() + lead, chirp, kCaptureSampleRate);
+}
+
+void LatencyProbe::OnOutput(const int16_t* pcm, size_t samples, int64_t time_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    output_.Append(pcm, samples, 1, time_us);
+    output_started_ = true;
+}
+
+void LatencyProbe::OnInput(const int16_t* data, size_t frames, int64_t time_us) {
+    if (!output_started_) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    mic_.Append(data + mic_channel_, frames, input_channels_, time_us);
+    if (reference_channel_ >= 0) {
+        reference_.Append(data + reference_channel_, frames, input_channels_, time_us);
+    }
+}
+
+void LatencyProbe::OnProcessed(const int16_t* pcm, size_t samples, int64_t time_us) {
+    if (!output_started_) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    processed_.Append(pcm, samples, 1, time_us);
+}
+
+bool LatencyProbe::Done(bool processed) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return output_.Full() && mic_.Full() && (reference_channel_ < 0 || reference_.Full()) &&
+        (!processed || processed_.Full());
+}
+
+LatencyProbe::Match LatencyProbe::FindChirp(const Recording& recording) {
+    Match match;
+    size_t length = kChirpMs * recording.sample_rate / 1000;
+    const auto& pcm = recording.pcm;
+    if (length == 0 || pcm.size() < length) {
+        return match;
+    }
+    std::vector<int16_t> in_phase(length);
+    std::vector<int16_t> quadrature(length);
+    GenerateChirp(in_phase.data(), length, recording.sample_rate);
+    GenerateChirp(quadrature.data(), length, recording.sample_rate, true);
+    double chirp_energy = 0;
+    for (size_t i = 0; i < length; i++) {
+        chirp_energy += (double)in_phase[i] * in_phase[i];
+    }
+
+    int64_t window = 0;
+    for (size_t i = 0; i < length; i++) {
+        window += (int32_t)pcm[i] * pcm[i];
+    }
+    float best = 0;
+    for (size_t lag = 0; lag + length <= pcm.size(); lag++) {
+        if (window > 0) {
+            int64_t a = 0;
+            int64_t b = 0;
+            const int16_t* x = pcm.data() + lag;
+            for (size_t i = 0; i < length; i++) {
+                a += (int32_t)x[i] * in_phase[i];
+                b += (int32_t)x[i] * quadrature[i];
+            }
+            /* The envelope of the correlation, so a phase shift of the speaker does not move the peak */
+            float peak = sqrtf(((double)a * a + (double)b * b) / ((double)window * chirp_energy));
+            if (peak > best) {
+                best = peak;
+                match.index = lag;
+                match.rms = sqrtf((double)window / length);
+            }
+        }
+        if (lag + length < pcm.size()) {
+            window += (int32_t)pcm[lag + length] * pcm[lag + length] - (int32_t)pcm[lag] * pcm[lag];
+        }
+        if (lag % FIND_YIELD_LAGS == FIND_YIELD_LAGS - 1) {
+            vTaskDelay(1);
+        }
+    }
+    match.peak = best;
+    return match;
+}
+
+static double ToMs(int64_t us) {
+    return std::round(us / 100.0) / 10.0;
+}
+
+cJSON* LatencyProbe::Analyze(int64_t dma_frame_us, int64_t aec_latency_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto json = cJSON_CreateObject();
+    Match output = FindChirp(output_);
+    Match mic = FindChirp(mic_);
+    Match processed = FindChirp(processed_);
+    Match reference = reference_channel_ >= 0 ? FindChirp(reference_) : Match();
+
+    auto peaks = cJSON_CreateObject();
+    cJSON_AddNumberToObject(peaks, "output", output.peak);
+    cJSON_AddNumberToObject(peaks, "mic", mic.peak);
+    if (reference_channel_ >= 0) {
+        cJSON_AddNumberToObject(peaks, "reference", reference.peak);
+    }
+    cJSON_AddNumberToObject(peaks, "processed", processed.peak);
+    cJSON_AddItemToObject(json, "peaks", peaks);
+
+    if (output.peak < kMinPeak) {
+        cJSON_AddStringToObject(json, "error", "The chirp was not found in the output");
+        return json;
+    }
+    /* All packets were queued at once, the stream could not start before that */
+    int64_t written_us = output_.TimeOf(output.index);
+    int64_t stream_written_us = written_us - kLeadMs * 1000;
+    cJSON_AddNumberToObject(json, "pipeline_ms", ToMs(stream_written_us - queued_us_));
+
+    if (mic.peak < kMinPeak) {
+        cJSON_AddStringToObject(json, "error", "The microphone did not hear the chirp, check the volume");
+        return json;
+    }
+    int64_t mic_us = mic_.TimeOf(mic.index);
+    int64_t round_trip_us = mic_us - written_us;
+    cJSON_AddNumberToObject(json, "round_trip_ms", ToMs(round_trip_us));
+    cJSON_AddNumberToObject(json, "output_latency_ms", ToMs(round_trip_us - dma_frame_us));
+
+    int64_t input_us = dma_frame_us;
+    if (processed_.pcm.empty()) {
+        // Nothing was fed to the processor
+    } else if (processed.peak >= kMinPeak) {
+        int64_t processor_us = processed_.TimeOf(processed.index) - mic_us;
+        cJSON_AddNumberToObject(json, "processor_ms", ToMs(processor_us));
+        input_us += processor_us;
+        if (processed.rms > 0) {
+            cJSON_AddNumberToObject(json, "processor_attenuation_db", std::round(20 * log10f(mic.rms / processed.rms)));
+        }
+    } else {
+        /* The AEC took the chirp out, which is its job */
+        cJSON_AddBoolToObject(json, "processor_removed_chirp", true);
+    }
+    cJSON_AddNumberToObject(json, "input_latency_ms", ToMs(input_us));
+
+    if (reference_channel_ >= 0 && reference.peak >= kMinPeak) {
+        int lag = (int)mic.index - (int)reference.index;
+        cJSON_AddNumberToObject(json, "reference_to_mic_ms", ToMs((int64_t)lag * 1000000 / kCaptureSampleRate));
+    }
+    if (aec_latency_us > 0) {
+        /* The server AEC clock expects the echo of a sample output_latency after it is written */
+        cJSON_AddNumberToObject(json, "server_aec_latency_ms", ToMs(aec_latency_us));
+        cJSON_AddNumberToObject(json, "server_aec_error_ms", ToMs(round_trip_us - aec_latency_us));
+    }
+    return json;
+}
@@ -0,0 +1,116 @@
+#ifndef LATENCY_PROBE_H
+#define LATENCY_PROBE_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <atomic>
+#include <vector>
+
+#include <cJSON.h>
+
+#include "memory_placement.h"
+
+/*
+ * Acoustic round-trip self-test, see AudioService::RunLatencyTest().
+ *
+ * The test signal is a chirp after a short silence. It is queued to the decoder as Opus
+ * packets, so it goes through the jitter buffer, the decoder, the resampler and the output
+ * like a reply. The probe records what is written to the codec, the microphone and the
+ * reference channel as they are read, and the audio processor output, with the time each
+ * block was written or read. The recording of the input starts with the first chunk
+ * written, nothing of the chirp can arrive before it.
+ *
+ * Analyze() finds the chirp in every recording by normalized cross-correlation, and turns
+ * the sample it starts at into the time that sample was written or read:
+ *
+ *   queued -> written      the software path of a reply, including the prebuffer
+ *   written -> mic read    output DMA, the air, input DMA: the round trip
+ *   mic read -> processed  the audio processor
+ *   reference -> mic       the lag the device AEC has to cover
+ *
+ * The input DMA only hands over whole DMA frames, so one frame of it is taken as the input
+ * latency before the read, and the rest of the round trip as the output latency.
+ */
+class LatencyProbe {
+public:
+    static constexpr int kCaptureSampleRate = 16000;
+    static constexpr int kLeadMs = 60;          // Silence before the chirp, the decoder starts on it
+    static constexpr int kChirpMs = 120;
+    static constexpr int kTailMs = 120;         // Silence after it, flushes the encoder
+    static constexpr int kChirpStartHz = 300;
+    static constexpr int kChirpEndHz = 3400;
+    static constexpr int kOutputRecordMs = 400;
+    static constexpr int kInputRecordMs = 600;
+    // A correlation peak below this is not the chirp
+    static constexpr float kMinPeak = 0.3f;
+
+    LatencyProbe(int output_sample_rate, int input_channels, int mic_channel, int reference_channel);
+
+    // false if the recordings do not fit in memory
+    bool Allocate();
+    // The 16kHz test signal to encode: silence, the chirp and silence
+    void GenerateSignal(std::vector<int16_t>& pcm) const;
+
+    void MarkQueued(int64_t time_us) { queued_us_ = time_us; }
+    // Output task: samples at the output rate were written to the codec by time_us
+    void OnOutput(const int16_t* pcm, size_t samples, int64_t time_us);
+    // Input task: interleaved 16kHz frames were read by time_us
+    void OnInput(const int16_t* data, size_t frames, int64_t time_us);
+    // Audio processor output, 16kHz mono
+    void OnProcessed(const int16_t* pcm, size_t samples, int64_t time_us);
+    // All recordings are full, the processor one only if it gets fed
+    bool Done(bool processed) const;
+
+    /*
+     * Runs the correlations, which take a while, after the recording stopped.
+     * dma_frame_us is the input DMA frame, aec_latency_us what the server AEC clock takes
+     * for the output latency, 0 without it. The caller owns the object.
+     */
+    cJSON* Analyze(int64_t dma_frame_us, int64_t aec_latency_us);
+
+private:
+    struct Mark {
+        size_t end;             // Samples recorded up to this block
+        int64_t time_us;
+    };
+    struct Recording {
+        ColdVector<int16_t> pcm;
+        std::array<Mark, 64> marks;
+        size_t mark_count = 0;
+        size_t capacity = 0;
+        int sample_rate = 0;
+
+        bool Full() const { return pcm.size() >= capacity || mark_count >= marks.size(); }
+        void Reserve(size_t samples, int rate);
+        // Appends at most what fits, returns the samples taken
+        size_t Append(const int16_t* data, size_t samples, size_t stride, int64_t time_us);
+        // The time the sample at index was written or read
+        int64_t TimeOf(size_t index) const;
+    };
+    struct Match {
+        size_t index = 0;
+        float peak = 0;
+        float rms = 0;          // Of the matched window
+    };
+
+    int output_sample_rate_;
+    int input_channels_;
+    int mic_channel_;
+    int reference_channel_;     // -1 without a reference
+    int64_t queued_us_ = 0;
+    std::atomic<bool> output_started_ = false;
+
+    mutable std::mutex mutex_;
+    Recording output_;
+    Recording mic_;
+    Recording reference_;
+    Recording processed_;
+
+    // The quadrature chirp is shifted by 90 degrees, the two together find the chirp whatever its phase
+    static void GenerateChirp(int16_t* pcm, size_t samples, int sample_rate, bool quadrature = false);
+    static Match FindChirp(const Recording& recording);
+};
+
+#endif // LATENCY_PROBE_H
@@ -0,0 +1,129 @@
+#include "latency_tracer.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "LatencyTracer"
+
+const char* LatencyTracer::StageName(LatencyStage stage) {
+    switch (stage) {
+        case kLatencyStageProcess: return "process";
+        case kLatencyStageEncode: return "encode";
+        case kLatencyStageSend: return "send";
+        case kLatencyStageUplink: return "uplink";
+        case kLatencyStageDecode: return "decode";
+        case kLatencyStagePlayback: return "playback";
+        case kLatencyStageDownlink: return "downlink";
+        default: return "unknown";
+    }
+}
+
+void LatencyTracer::AddSample(LatencyStage stage, int64_t latency_us) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& window = windows_[stage];
+    window.samples_us[window.next] = static_cast<uint32_t>(std::min<int64_t>(latency_us, UINT32_MAX));
+    window.next = (window.next + 1) % kWindowSize;
+    if (window.count < kWindowSize) {
+        window.count++;
+    }
+}
+
+void LatencyTracer::MarkCapture(size_t frames, int64_t time_us) {
+    if (!Enabled() || time_us <= 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(capture_mutex_);
+    captured_frames_ += frames;
+    size_t index = (capture_head_ + capture_count_) % kMaxCaptureMarks;
+    if (capture_count_ == kMaxCaptureMarks) {
+        // The processor fell far behind, forget the oldest capture
+        capture_head_ = (capture_head_ + 1) % kMaxCaptureMarks;
+    } else {
+        capture_count_++;
+    }
+    capture_marks_[index] = {captured_frames_, time_us};
+}
+
+int64_t LatencyTracer::TakeCapture(size_t frames) {
+    if (!Enabled()) {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(capture_mutex_);
+    processed_frames_ += frames;
+    // The last processed frame was captured with the first mark that covers it
+    while (capture_count_ > 0) {
+        auto& mark = capture_marks_[capture_head_];
+        if (mark.end_frame >= processed_frames_) {
+            return mark.time_us;
+        }
+        capture_head_ = (capture_head_ + 1) % kMaxCaptureMarks;
+        capture_count_--;
+    }
+    return 0;
+}
+
+void LatencyTracer::ResetCapture() {
+    std::lock_guard<std::mutex> lock(capture_mutex_);
+    capture_head_ = 0;
+    capture_count_ = 0;
+    captured_frames_ = 0;
+    processed_frames_ = 0;
+}
+
+LatencyStats LatencyTracer::GetStats(LatencyStage stage) {
+    std::array<uint32_t, kWindowSize> samples;
+    size_t count;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& window = windows_[stage];
+        count = window.count;
+        std::copy(window.samples_us.begin(), window.samples_us.begin() + count, samples.begin());
+    }
+
+    LatencyStats stats;
+    stats.count = count;
+    if (count == 0) {
+        return stats;
+    }
+    auto end = samples.begin() + count;
+    auto p50 = samples.begin() + (count - 1) / 2;
+    std::nth_element(samples.begin(), p50, end);
+    stats.p50_us = *p50;
+    auto p99 = samples.begin() + (count - 1) * 99 / 100;
+    std::nth_element(samples.begin(), p99, end);
+    stats.p99_us = *p99;
+    return stats;
+}
+
+void LatencyTracer::Reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& window : windows_) {
+        window.next = 0;
+        window.count = 0;
+    }
+}
+
+void LatencyTracer::PrintStats() {
+    for (int i = 0; i < kLatencyStageCount; i++) {
+        auto stage = static_cast<LatencyStage>(i);
+        auto stats = GetStats(stage);
+        if (stats.count > 0) {
+            ESP_LOGI(TAG, "%-8s p50 %6.1f ms  p99 %6.1f ms  (%lu frames)", StageName(stage),
+                stats.p50_us / 1000.0f, stats.p99_us / 1000.0f, stats.count);
+        }
+    }
+}
+
+cJSON* LatencyTracer::GetStatsJson() {
+    auto root = cJSON_CreateObject();
+    for (int i = 0; i < kLatencyStageCount; i++) {
+        auto stage = static_cast<LatencyStage>(i);
+        auto stats = GetStats(stage);
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "p50_ms", stats.p50_us / 1000.0);
+        cJSON_AddNumberToObject(item, "p99_ms", stats.p99_us / 1000.0);
+        cJSON_AddNumberToObject(item, "count", stats.count);
+        cJSON_AddItemToObject(root, StageName(stage), item);
+    }
+    return root;
+}
@@ -0,0 +1,99 @@
+#ifndef LATENCY_TRACER_H
+#define LATENCY_TRACER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#include <cJSON.h>
+#include <esp_timer.h>
+#include <sdkconfig.h>
+
+enum LatencyStage {
+    kLatencyStageProcess,   // Mic capture -> audio processor output
+    kLatencyStageEncode,    // Audio processor output -> Opus packet
+    kLatencyStageSend,      // Opus packet -> handed to the protocol
+    kLatencyStageUplink,    // Mic capture -> handed to the protocol
+    kLatencyStageDecode,    // Received -> decoded, including the jitter buffer
+    kLatencyStagePlayback,  // Decoded -> written to I2S
+    kLatencyStageDownlink,  // Received -> written to I2S
+    kLatencyStageCount,
+};
+
+struct LatencyStats {
+    uint32_t p50_us = 0;
+    uint32_t p99_us = 0;
+    uint32_t count = 0;
+};
+
+/*
+ * Per stage latency of the audio pipeline, enabled with CONFIG_AUDIO_LATENCY_TRACE.
+ *
+ * Frames carry the time they entered their current stage, and Record() adds the time
+ * spent in that stage to a rolling window. Percentiles are computed on request.
+ *
+ * When tracing is disabled Now() returns 0, and Record() ignores frames without a
+ * start time, so the calls compile to nothing.
+ */
+class LatencyTracer {
+public:
+    static constexpr size_t kWindowSize = 128;
+
+    static constexpr bool Enabled() {
+#if CONFIG_AUDIO_LATENCY_TRACE
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    static int64_t Now() {
+        return Enabled() ? esp_timer_get_time() : 0;
+    }
+
+    void Record(LatencyStage stage, int64_t start_us, int64_t end_us) {
+        if (start_us > 0 && end_us >= start_us) {
+            AddSample(stage, end_us - start_us);
+        }
+    }
+
+    // Map the audio processor output back to the time its input was captured
+    void MarkCapture(size_t frames, int64_t time_us);
+    int64_t TakeCapture(size_t frames);
+    void ResetCapture();
+
+    LatencyStats GetStats(LatencyStage stage);
+    void Reset();
+    void PrintStats();
+    // Returns {"<stage>": {"p50_ms", "p99_ms", "count"}, ...}, owned by the caller
+    cJSON* GetStatsJson();
+
+    static const char* StageName(LatencyStage stage);
+
+private:
+    struct Window {
+        std::array<uint32_t, kWindowSize> samples_us;
+        size_t next = 0;
+        uint32_t count = 0;
+    };
+    struct CaptureMark {
+        uint64_t end_frame;
+        int64_t time_us;
+    };
+    static constexpr size_t kMaxCaptureMarks = 16;
+
+    std::mutex mutex_;
+    std::array<Window, kLatencyStageCount> windows_;
+
+    std::mutex capture_mutex_;
+    std::array<CaptureMark, kMaxCaptureMarks> capture_marks_;
+    size_t capture_head_ = 0;
+    size_t capture_count_ = 0;
+    uint64_t captured_frames_ = 0;
+    uint64_t processed_frames_ = 0;
+
+    void AddSample(LatencyStage stage, int64_t latency_us);
+};
+
+#endif // LATENCY_TRACER_H
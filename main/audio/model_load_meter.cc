@@ -0,0 +1,21 @@
+#include "model_load_meter.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+
+#define TAG "ModelLoadMeter"
+
+ModelLoadMeter::ModelLoadMeter()
+    : start_us_(esp_timer_get_time()),
+      free_internal_(heap_caps_get_free_size(MALLOC_CAP_INTERNAL)),
+      free_spiram_(heap_caps_get_free_size(MALLOC_CAP_SPIRAM)) {
+}
+
+void ModelLoadMeter::Finish(const char* name) {
+    int elapsed_ms = (esp_timer_get_time() - start_us_) / 1000;
+    // Another task may free memory meanwhile, a negative difference is reported as it is
+    int internal = (int)free_internal_ - (int)heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    int spiram = (int)free_spiram_ - (int)heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+    ESP_LOGI(TAG, "%s: %d ms, %d bytes of internal RAM, %d bytes of PSRAM", name, elapsed_ms, internal, spiram);
+}
@@ -0,0 +1,37 @@
+#ifndef MODEL_LOAD_METER_H
+#define MODEL_LOAD_METER_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sdkconfig.h>
+
+// Where the AFE puts the buffers and the hot layers of its models, the weights stay in the mmapped assets
+#if CONFIG_SR_MODEL_MEMORY_MORE_INTERNAL
+#define SR_MODEL_MEMORY_ALLOC_MODE AFE_MEMORY_ALLOC_MORE_INTERNAL
+#elif CONFIG_SR_MODEL_MEMORY_BALANCED
+#define SR_MODEL_MEMORY_ALLOC_MODE AFE_MEMORY_ALLOC_INTERNAL_PSRAM_BALANCE
+#else
+#define SR_MODEL_MEMORY_ALLOC_MODE AFE_MEMORY_ALLOC_MORE_PSRAM
+#endif
+
+/*
+ * Logs the time a model took to create and the internal RAM and PSRAM it took, from the
+ * construction of the meter to Finish().
+ *
+ * The models loaded from the assets with srmodel_load() are read in place from the mmapped
+ * partition, so what is reported is the RAM the runtime allocates for them.
+ */
+class ModelLoadMeter {
+public:
+    ModelLoadMeter();
+
+    void Finish(const char* name);
+
+private:
+    int64_t start_us_;
+    size_t free_internal_;
+    size_t free_spiram_;
+};
+
+#endif // MODEL_LOAD_METER_H
@@ -0,0 +1,93 @@
+#ifndef OBJECT_POOL_H
+#define OBJECT_POOL_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+/*
+ * Fixed-capacity object pool with recycle-on-destruct handles.
+ *
+ * Objects are constructed once together with the pool. When a PooledPtr goes out of
+ * scope the object is handed back to its pool and T::Reset() is called, so members
+ * like std::vector keep their capacity and steady-state traffic never touches malloc.
+ * If the pool is exhausted Acquire() falls back to a heap allocated object, which is
+ * deleted normally by the same handle type.
+ */
+template <typename T>
+class ObjectPoolBase {
+public:
+    virtual void Release(T* item) = 0;
+
+protected:
+    ~ObjectPoolBase() = default;
+};
+
+template <typename T>
+struct PoolDeleter {
+    ObjectPoolBase<T>* pool = nullptr;
+
+    void operator()(T* item) const {
+        if (pool != nullptr) {
+            pool->Release(item);
+        } else {
+            delete item;
+        }
+    }
+};
+
+template <typename T>
+using PooledPtr = std::unique_ptr<T, PoolDeleter<T>>;
+
+template <typename T, size_t Capacity>
+class ObjectPool : public ObjectPoolBase<T> {
+public:
+    static_assert(Capacity > 0 && Capacity <= UINT16_MAX, "ObjectPool capacity out of range");
+
+    ObjectPool() {
+        for (size_t i = 0; i < Capacity; ++i) {
+            free_[i] = Capacity - 1 - i;
+        }
+        free_count_ = Capacity;
+    }
+    ObjectPool(const ObjectPool&) = delete;
+    ObjectPool& operator=(const ObjectPool&) = delete;
+
+    PooledPtr<T> Acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (free_count_ > 0) {
+                T* item = &items_[free_[--free_count_]];
+                return PooledPtr<T>(item, PoolDeleter<T>{this});
+            }
+        }
+        fallback_count_++;
+        return PooledPtr<T>(new T(), PoolDeleter<T>{});
+    }
+
+    void Release(T* item) override {
+        item->Reset();
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_[free_count_++] = static_cast<uint16_t>(item - items_.data());
+    }
+
+    size_t available() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return free_count_;
+    }
+
+    // Number of times the pool ran dry and Acquire() had to use the heap
+    uint32_t fallback_count() const { return fallback_count_; }
+
+private:
+    std::array<T, Capacity> items_;
+    std::array<uint16_t, Capacity> free_;
+    size_t free_count_ = 0;
+    std::mutex mutex_;
+    std::atomic<uint32_t> fallback_count_ = 0;
+};
+
+#endif // OBJECT_POOL_H
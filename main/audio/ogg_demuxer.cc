@@ -0,0 +1,159 @@
+#include "ogg_demuxer.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "OggDemuxer"
+
+void OggDemuxer::Reset() {
+    state_ = kStateHeader;
+    filled_ = 0;
+    segment_index_ = 0;
+    segment_left_ = 0;
+    packet_.clear();
+    seen_head_ = false;
+    seen_tags_ = false;
+    sample_rate_ = 16000;
+    channels_ = 1;
+}
+
+bool OggDemuxer::Feed(const uint8_t* data, size_t size) {
+    while (size > 0) {
+        if (state_ == kStateHeader) {
+            size_t n = std::min(size, kPageHeaderSize - filled_);
+            memcpy(header_ + filled_, data, n);
+            filled_ += n;
+            data += n;
+            size -= n;
+            if (filled_ < kPageHeaderSize) {
+                break;
+            }
+            if (memcmp(header_, "OggS", 4) != 0) {
+                // Resync on the next capture pattern
+                auto next = std::find(header_ + 1, header_ + kPageHeaderSize, 'O');
+                filled_ = header_ + kPageHeaderSize - next;
+                memmove(header_, next, filled_);
+                continue;
+            }
+            if (!(header_[5] & 0x01) && !packet_.empty()) {
+                ESP_LOGW(TAG, "Dropped a packet cut by a missing page");
+                packet_.clear();
+            }
+            filled_ = 0;
+            state_ = kStateSegments;
+            if (header_[26] == 0) {
+                state_ = kStateHeader;
+            }
+        } else if (state_ == kStateSegments) {
+            size_t n = std::min(size, header_[26] - filled_);
+            memcpy(segments_ + filled_, data, n);
+            filled_ += n;
+            data += n;
+            size -= n;
+            if (filled_ < header_[26]) {
+                break;
+            }
+            filled_ = 0;
+            segment_index_ = 0;
+            segment_left_ = segments_[0];
+            state_ = kStateBody;
+            if (segment_left_ == 0 && !EndSegment()) {
+                return false;
+            }
+        } else {
+            size_t n = std::min(size, segment_left_);
+            packet_.insert(packet_.end(), data, data + n);
+            segment_left_ -= n;
+            data += n;
+            size -= n;
+            if (segment_left_ == 0 && !EndSegment()) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* Called when the current segment is complete, a segment shorter than 255 bytes ends a packet */
+bool OggDemuxer::EndSegment() {
+    while (true) {
+        bool packet_end = segments_[segment_index_] < 255;
+        segment_index_++;
+        if (packet_end && !FinishPacket()) {
+            return false;
+        }
+        if (segment_index_ == header_[26]) {
+            state_ = kStateHeader;
+            return true;
+        }
+        segment_left_ = segments_[segment_index_];
+        if (segment_left_ > 0) {
+            return true;
+        }
+    }
+}
+
+bool OggDemuxer::FinishPacket() {
+    bool keep_going = true;
+    if (packet_.empty()) {
+        return true;
+    }
+    if (!seen_head_) {
+        // OpusHead: [0-7] "OpusHead", [8] version, [9] channel_count, [10-11] pre_skip,
+        // [12-15] input_sample_rate, [16-17] output_gain, [18] mapping_family
+        if (packet_.size() >= 19 && memcmp(packet_.data(), "OpusHead", 8) == 0) {
+            seen_head_ = true;
+            channels_ = packet_[9];
+            sample_rate_ = packet_[12] | (packet_[13] << 8) | (packet_[14] << 16) | (packet_[15] << 24);
+            ESP_LOGI(TAG, "OpusHead: version=%d, channels=%d, sample_rate=%d", packet_[8], channels_, sample_rate_);
+        }
+    } else if (!seen_tags_) {
+        // OpusTags is the second packet and may span several pages
+        if (packet_.size() >= 8 && memcmp(packet_.data(), "OpusTags", 8) == 0) {
+            seen_tags_ = true;
+        }
+    } else if (packet_callback_) {
+        keep_going = packet_callback_(packet_.data(), packet_.size());
+    }
+    packet_.clear();
+    return keep_going;
+}
+
+int OggDemuxer::GetOpusPacketDurationMs(const uint8_t* data, size_t size) {
+    // Frame sizes in 1/10 ms for the SILK, hybrid and CELT configs of the TOC byte
+    static const int kSilkFrames[] = {100, 200, 400, 600};
+    static const int kHybridFrames[] = {100, 200};
+    static const int kCeltFrames[] = {25, 50, 100, 200};
+    if (size == 0) {
+        return 0;
+    }
+    int config = data[0] >> 3;
+    int frame_tenths;
+    if (config < 12) {
+        frame_tenths = kSilkFrames[config & 3];
+    } else if (config < 16) {
+        frame_tenths = kHybridFrames[config & 1];
+    } else {
+        frame_tenths = kCeltFrames[config & 3];
+    }
+
+    int frames;
+    switch (data[0] & 3) {
+        case 0:
+            frames = 1;
+            break;
+        case 1:
+        case 2:
+            frames = 2;
+            break;
+        default:
+            if (size < 2) {
+                return 0;
+            }
+            frames = data[1] & 0x3F;
+            break;
+    }
+    int tenths = frame_tenths * frames;
+    return tenths % 10 == 0 ? tenths / 10 : 0;
+}
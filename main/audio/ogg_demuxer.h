@@ -0,0 +1,60 @@
+#ifndef OGG_DEMUXER_H
+#define OGG_DEMUXER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <functional>
+
+/*
+ * Incremental Ogg/Opus demuxer.
+ *
+ * Bytes can be fed in chunks of any size. Only the page header and the segment table are
+ * buffered, the page body is copied straight into the current packet, so a whole file never
+ * has to be in RAM and packets that continue on the next page are joined.
+ *
+ * The OpusHead and OpusTags packets are consumed, every audio packet goes to the callback.
+ */
+class OggDemuxer {
+public:
+    // Return false to stop demuxing
+    using PacketCallback = std::function<bool(const uint8_t* data, size_t size)>;
+
+    void OnPacket(PacketCallback callback) { packet_callback_ = callback; }
+    // Returns false once the callback asked to stop
+    bool Feed(const uint8_t* data, size_t size);
+    void Reset();
+
+    int sample_rate() const { return sample_rate_; }
+    int channels() const { return channels_; }
+
+    // Duration of an Opus packet from its TOC byte, 0 if it is not a whole number of ms
+    static int GetOpusPacketDurationMs(const uint8_t* data, size_t size);
+
+private:
+    static constexpr size_t kPageHeaderSize = 27;
+
+    enum State {
+        kStateHeader,
+        kStateSegments,
+        kStateBody,
+    };
+
+    PacketCallback packet_callback_;
+    State state_ = kStateHeader;
+    uint8_t header_[kPageHeaderSize];
+    uint8_t segments_[255];
+    size_t filled_ = 0;         // Bytes of the header or the segment table received so far
+    size_t segment_index_ = 0;
+    size_t segment_left_ = 0;   // Bytes of the current segment still to come
+    std::vector<uint8_t> packet_;
+    bool seen_head_ = false;
+    bool seen_tags_ = false;
+    int sample_rate_ = 16000;
+    int channels_ = 1;
+
+    bool EndSegment();
+    bool FinishPacket();
+};
+
+#endif // OGG_DEMUXER_H
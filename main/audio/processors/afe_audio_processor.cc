@@ -1,7 +1,25 @@
 #include "afe_audio_processor.h"
+#include "task_profile.h"
+#include "model_load_meter.h"
+#include "trace_markers.h"
+#include "audio_dsp.h"
+
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <cmath>
 
 #define PROCESSOR_RUNNING 0x01
+#define WAKE_WORD_RUNNING 0x02
+
+// The mean square of a full scale sine is half of this
+#define FULL_SCALE_ENERGY (32768.0 * 32768.0)
+// The room must stay quiet this long before the noise suppression turns off
+#define NS_QUIET_HOLD_US 5000000
+// A reference quieter than about -66 dBFS is no playback
+#define PLAYBACK_MIN_ENERGY 256
+#define STATE_NS 1
+#define STATE_AEC 2
 
 #define TAG "AfeAudioProcessor"
 
@@ -14,18 +32,13 @@ void AfeAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms, srm
     codec_ = codec;
     frame_samples_ = frame_duration_ms * 16000 / 1000;
 
-    // Pre-allocate output buffer capacity
-    output_buffer_.reserve(frame_samples_);
+    output_frame_.reserve(frame_samples_);
 
-    int ref_num = codec_->input_reference() ? 1 : 0;
-
-    std::string input_format;
-    for (int i = 0; i < codec_->input_channels() - ref_num; i++) {
-        input_format.push_back('M');
-    }
-    for (int i = 0; i < ref_num; i++) {
-        input_format.push_back('R');
-    }
+    std::string input_format = codec_->input_format();
+    int mic_num = std::count(input_format.begin(), input_format.end(), 'M');
+    channels_ = std::max<int>(1, input_format.size());
+    mic_channel_ = std::max<int>(0, input_format.find('M'));
+    ref_channel_ = input_format.find('R') == std::string::npos ? -1 : input_format.find('R');
 
     srmodel_list_t *models;
     if (models_list == nullptr) {
@@ -37,8 +50,23 @@ void AfeAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms, srm
     char* ns_model_name = esp_srmodel_filter(models, ESP_NSNET_PREFIX, NULL);
     char* vad_model_name = esp_srmodel_filter(models, ESP_VADN_PREFIX, NULL);
     
+#if CONFIG_USE_SHARED_AFE
+    // One SR graph runs AEC, NS and VAD once for both WakeNet and the encoder
+    char* wakenet_model_name = esp_srmodel_filter(models, ESP_WN_PREFIX, NULL);
+    afe_config_t* afe_config = afe_config_init(input_format.c_str(), models, AFE_TYPE_SR, AFE_MODE_HIGH_PERF);
+    afe_config->aec_mode = AEC_MODE_SR_HIGH_PERF;
+    afe_config->wakenet_init = wakenet_model_name != nullptr;
+#elif CONFIG_USE_MULTI_MIC_AFE
+    // The SR graph separates the speaker from two or more microphones by blind source separation
+    afe_config_t* afe_config = afe_config_init(input_format.c_str(), NULL, mic_num > 1 ? AFE_TYPE_SR : AFE_TYPE_VC, AFE_MODE_HIGH_PERF);
+    afe_config->aec_mode = mic_num > 1 ? AEC_MODE_SR_HIGH_PERF : AEC_MODE_VOIP_HIGH_PERF;
+    afe_config->se_init = mic_num > 1;
+    afe_config->wakenet_init = false;
+#else
     afe_config_t* afe_config = afe_config_init(input_format.c_str(), NULL, AFE_TYPE_VC, AFE_MODE_HIGH_PERF);
     afe_config->aec_mode = AEC_MODE_VOIP_HIGH_PERF;
+#endif
+    ESP_LOGI(TAG, "AFE input format %s, %d microphones", input_format.c_str(), mic_num);
     afe_config->vad_mode = VAD_MODE_0;
     afe_config->vad_min_noise_ms = 100;
     if (vad_model_name != nullptr) {
@@ -54,24 +82,40 @@ void AfeAudioProcessor::Initialize(AudioCodec* codec, int frame_duration_ms, srm
     }
 
     afe_config->agc_init = false;
-    afe_config->memory_alloc_mode = AFE_MEMORY_ALLOC_MORE_PSRAM;
+    afe_config->memory_alloc_mode = SR_MODEL_MEMORY_ALLOC_MODE;
 
 #ifdef CONFIG_USE_DEVICE_AEC
     afe_config->aec_init = true;
     afe_config->vad_init = false;
+#elif CONFIG_USE_SHARED_AFE
+    // Keep the wake word from triggering on our own playback
+    afe_config->aec_init = codec_->input_reference();
+    afe_config->vad_init = true;
 #else
     afe_config->aec_init = false;
     afe_config->vad_init = true;
 #endif
 
+    ModelLoadMeter meter;
     afe_iface_ = esp_afe_handle_from_config(afe_config);
     afe_data_ = afe_iface_->create_from_config(afe_config);
+    meter.Finish(afe_config->wakenet_init ? "AFE with NS, VAD and WakeNet" : "AFE with NS and VAD");
+    wakenet_ready_ = afe_config->wakenet_init;
+    ns_available_ = afe_config->ns_init;
+    ns_enabled_ = ns_available_;
+    aec_allowed_ = afe_config->aec_init;
+    aec_enabled_ = afe_config->aec_init;
+    adaptive_state_ = (ns_enabled_ ? STATE_NS : 0) | (aec_enabled_ ? STATE_AEC : 0);
+    if (wakenet_ready_) {
+        // Enabled by the wake word when it starts
+        afe_iface_->disable_wakenet(afe_data_);
+    }
     
-    xTaskCreate([](void* arg) {
+    TaskProfiles::Create(kTaskAudioProcessor, [](void* arg) {
         auto this_ = (AfeAudioProcessor*)arg;
         this_->AudioProcessorTask();
         vTaskDelete(NULL);
-    }, "audio_communication", 4096, this, 3, NULL);
+    }, this);
 }
 
 AfeAudioProcessor::~AfeAudioProcessor() {
@@ -81,6 +125,10 @@ AfeAudioProcessor::~AfeAudioProcessor() {
     vEventGroupDelete(event_group_);
 }
 
+void AfeAudioProcessor::SetFrameDuration(int frame_duration_ms) {
+    frame_samples_ = frame_duration_ms * 16000 / 1000;
+}
+
 size_t AfeAudioProcessor::GetFeedSize() {
     if (afe_data_ == nullptr) {
         return 0;
@@ -92,7 +140,131 @@ void AfeAudioProcessor::Feed(std::vector<int16_t>&& data) {
     if (afe_data_ == nullptr) {
         return;
     }
+#if CONFIG_AFE_ADAPTIVE_PROCESSING
+    AdaptProcessing(data);
+#endif
+    TRACE_BEGIN(kTraceAfeFeed);
     afe_iface_->feed(afe_data_, data.data());
+    TRACE_END(kTraceAfeFeed);
+}
+
+/*
+ * The noise floor falls at once to a quieter chunk and rises over about 15 s, so speech
+ * hardly moves it but a fan that stays on does. The NS turns on above the floor of the
+ * config, and off 6 dB below it once the room stayed quiet for NS_QUIET_HOLD_US. The AEC
+ * runs from the first chunk of playback in the reference until the hold of the config.
+ */
+void AfeAudioProcessor::AdaptProcessing(const std::vector<int16_t>& data) {
+    size_t frames = data.size() / channels_;
+    if (frames == 0) {
+        return;
+    }
+    int64_t now_us = esp_timer_get_time();
+    uint32_t energy = AudioDsp::MeanSquare(data.data() + mic_channel_, frames, channels_);
+    if (noise_floor_ == 0) {
+        noise_floor_ = std::max<uint32_t>(energy, 1);
+    } else if (energy < noise_floor_) {
+        noise_floor_ = noise_floor_ - noise_floor_ / 4 + energy / 4;
+    } else {
+        noise_floor_ += (energy - noise_floor_) / 512;
+    }
+
+    static const uint32_t ns_on_energy = FULL_SCALE_ENERGY * std::pow(10.0, CONFIG_AFE_ADAPTIVE_NS_FLOOR_DBFS / 10.0);
+    bool ns = ns_enabled_;
+    if (ns_available_) {
+        if (noise_floor_ > ns_on_energy) {
+            ns = true;
+            quiet_since_us_ = 0;
+        } else if (noise_floor_ < ns_on_energy / 4) {
+            if (quiet_since_us_ == 0) {
+                quiet_since_us_ = now_us;
+            } else if (now_us - quiet_since_us_ >= NS_QUIET_HOLD_US) {
+                ns = false;
+            }
+        } else {
+            quiet_since_us_ = 0;
+        }
+    }
+
+    bool aec = aec_enabled_;
+    if (aec_allowed_ && ref_channel_ >= 0) {
+        if (AudioDsp::MeanSquare(data.data() + ref_channel_, frames, channels_) > PLAYBACK_MIN_ENERGY) {
+            last_playback_us_ = now_us;
+        }
+        aec = last_playback_us_ > 0 && now_us - last_playback_us_ < CONFIG_AFE_ADAPTIVE_AEC_HOLD_MS * 1000LL;
+    }
+
+    if (ns != ns_enabled_) {
+        ns_enabled_ = ns;
+        if (ns) {
+            afe_iface_->enable_ns(afe_data_);
+        } else {
+            afe_iface_->disable_ns(afe_data_);
+        }
+        ESP_LOGI(TAG, "Noise floor %.1f dBFS, noise suppression %s", 10 * std::log10(noise_floor_ / FULL_SCALE_ENERGY),
+            ns ? "on" : "off");
+        switches_++;
+    }
+    if (aec != aec_enabled_) {
+        aec_enabled_ = aec;
+        if (aec) {
+            afe_iface_->enable_aec(afe_data_);
+        } else {
+            afe_iface_->disable_aec(afe_data_);
+        }
+        ESP_LOGI(TAG, "AEC %s", aec ? "on with the playback" : "off, no playback");
+        switches_++;
+    }
+    adaptive_state_ = (ns_enabled_ ? STATE_NS : 0) | (aec_enabled_ ? STATE_AEC : 0);
+}
+
+void AfeAudioProcessor::AccountState(int state, uint64_t audio_us, uint64_t run_us) {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    state_stats_[state].audio_us += audio_us;
+    state_stats_[state].run_us += run_us;
+}
+
+cJSON* AfeAudioProcessor::GetStatsJson() {
+#if CONFIG_AFE_ADAPTIVE_PROCESSING
+    auto json = cJSON_CreateObject();
+    cJSON_AddBoolToObject(json, "ns", adaptive_state_ & STATE_NS);
+    cJSON_AddBoolToObject(json, "aec", adaptive_state_ & STATE_AEC);
+    cJSON_AddNumberToObject(json, "switches", switches_);
+
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    uint64_t total_us = 0;
+    for (const auto& stats : state_stats_) {
+        total_us += stats.audio_us;
+    }
+    // The fetch task's share of a core in each state, against the most complete state measured
+    auto cpu_percent = [](const StateStats& stats) {
+        return stats.audio_us > 0 ? stats.run_us * 100.0 / stats.audio_us : 0.0;
+    };
+    int full = 3;
+    while (full > 0 && state_stats_[full].audio_us == 0) {
+        full--;
+    }
+    double saved = 0;
+    auto states = cJSON_CreateArray();
+    for (int i = 0; i < 4; i++) {
+        const auto& stats = state_stats_[i];
+        if (stats.audio_us == 0) {
+            continue;
+        }
+        auto item = cJSON_CreateObject();
+        cJSON_AddBoolToObject(item, "ns", i & STATE_NS);
+        cJSON_AddBoolToObject(item, "aec", i & STATE_AEC);
+        cJSON_AddNumberToObject(item, "time_percent", stats.audio_us * 100.0 / total_us);
+        cJSON_AddNumberToObject(item, "cpu_percent", cpu_percent(stats));
+        cJSON_AddItemToArray(states, item);
+        saved += (double)stats.audio_us / total_us * std::max(0.0, cpu_percent(state_stats_[full]) - cpu_percent(stats));
+    }
+    cJSON_AddItemToObject(json, "states", states);
+    cJSON_AddNumberToObject(json, "cpu_saved_percent", saved);
+    return json;
+#else
+    return nullptr;
+#endif
 }
 
 void AfeAudioProcessor::Start() {
@@ -100,12 +272,37 @@ void AfeAudioProcessor::Start() {
 }
 
 void AfeAudioProcessor::Stop() {
-    xEventGroupClearBits(event_group_, PROCESSOR_RUNNING);
-    if (afe_data_ != nullptr) {
+    auto bits = xEventGroupClearBits(event_group_, PROCESSOR_RUNNING);
+    // The wake word keeps using the buffered audio
+    if (afe_data_ != nullptr && !(bits & WAKE_WORD_RUNNING)) {
         afe_iface_->reset_buffer(afe_data_);
     }
 }
 
+void AfeAudioProcessor::EnableWakeWord(bool enable) {
+    if (!wakenet_ready_) {
+        return;
+    }
+    if (enable) {
+        afe_iface_->enable_wakenet(afe_data_);
+        xEventGroupSetBits(event_group_, WAKE_WORD_RUNNING);
+    } else {
+        auto bits = xEventGroupClearBits(event_group_, WAKE_WORD_RUNNING);
+        afe_iface_->disable_wakenet(afe_data_);
+        if (!(bits & PROCESSOR_RUNNING)) {
+            afe_iface_->reset_buffer(afe_data_);
+        }
+    }
+}
+
+bool AfeAudioProcessor::IsWakeWordRunning() {
+    return xEventGroupGetBits(event_group_) & WAKE_WORD_RUNNING;
+}
+
+void AfeAudioProcessor::OnWakeWordResult(std::function<void(afe_fetch_result_t* result)> callback) {
+    wake_word_result_callback_ = callback;
+}
+
 bool AfeAudioProcessor::IsRunning() {
     return xEventGroupGetBits(event_group_) & PROCESSOR_RUNNING;
 }
@@ -123,12 +320,18 @@ void AfeAudioProcessor::AudioProcessorTask() {
     auto feed_size = afe_iface_->get_feed_chunksize(afe_data_);
     ESP_LOGI(TAG, "Audio communication task started, feed size: %d fetch size: %d",
         feed_size, fetch_size);
+#if CONFIG_AFE_ADAPTIVE_PROCESSING && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+    auto last_run_time = ulTaskGetRunTimeCounter(nullptr);
+#endif
 
     while (true) {
-        xEventGroupWaitBits(event_group_, PROCESSOR_RUNNING, pdFALSE, pdTRUE, portMAX_DELAY);
+        xEventGroupWaitBits(event_group_, PROCESSOR_RUNNING | WAKE_WORD_RUNNING, pdFALSE, pdFALSE, portMAX_DELAY);
 
+        TRACE_BEGIN(kTraceAfeFetch);
         auto res = afe_iface_->fetch_with_delay(afe_data_, portMAX_DELAY);
-        if ((xEventGroupGetBits(event_group_) & PROCESSOR_RUNNING) == 0) {
+        TRACE_END(kTraceAfeFetch);
+        auto bits = xEventGroupGetBits(event_group_);
+        if ((bits & (PROCESSOR_RUNNING | WAKE_WORD_RUNNING)) == 0) {
             continue;
         }
         if (res == nullptr || res->ret_value == ESP_FAIL) {
@@ -138,6 +341,20 @@ void AfeAudioProcessor::AudioProcessorTask() {
             continue;
         }
 
+#if CONFIG_AFE_ADAPTIVE_PROCESSING && CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+        // The run time of this task since the last fetch, which processed the audio of this one
+        auto run_time = ulTaskGetRunTimeCounter(nullptr);
+        AccountState(adaptive_state_, res->data_size / sizeof(int16_t) * 1000000ULL / 16000, run_time - last_run_time);
+        last_run_time = run_time;
+#endif
+
+        if ((bits & WAKE_WORD_RUNNING) && wake_word_result_callback_) {
+            wake_word_result_callback_(res);
+        }
+        if ((bits & PROCESSOR_RUNNING) == 0) {
+            continue;
+        }
+
         // VAD state change
         if (vad_state_change_callback_) {
             if (res->vad_state == VAD_SPEECH && !is_speaking_) {
@@ -150,22 +367,23 @@ void AfeAudioProcessor::AudioProcessorTask() {
         }
 
         if (output_callback_) {
+            /*
+             * The fetch results are copied once, into the frame being filled. The audio service
+             * swaps a full frame for the empty buffer of a pooled encode task, which keeps its
+             * capacity, so no frame is allocated, moved up or erased.
+             */
+            const int16_t* data = res->data;
             size_t samples = res->data_size / sizeof(int16_t);
-            
-            // Add data to buffer
-            output_buffer_.insert(output_buffer_.end(), res->data, res->data + samples);
-            
-            // Output complete frames when buffer has enough data
-            while (output_buffer_.size() >= frame_samples_) {
-                if (output_buffer_.size() == frame_samples_) {
-                    // If buffer size equals frame size, move the entire buffer
-                    output_callback_(std::move(output_buffer_));
-                    output_buffer_.clear();
-                    output_buffer_.reserve(frame_samples_);
-                } else {
-                    // If buffer size exceeds frame size, copy one frame and remove it
-                    output_callback_(std::vector<int16_t>(output_buffer_.begin(), output_buffer_.begin() + frame_samples_));
-                    output_buffer_.erase(output_buffer_.begin(), output_buffer_.begin() + frame_samples_);
+            size_t frame_samples = frame_samples_;
+            while (samples > 0) {
+                size_t take = std::min(samples, frame_samples - std::min(frame_samples, output_frame_.size()));
+                output_frame_.insert(output_frame_.end(), data, data + take);
+                data += take;
+                samples -= take;
+                if (output_frame_.size() >= frame_samples) {
+                    output_callback_(std::move(output_frame_));
+                    output_frame_.clear();
+                    output_frame_.reserve(frame_samples);
                 }
             }
         }
@@ -177,10 +395,14 @@ void AfeAudioProcessor::EnableDeviceAec(bool enable) {
 #if CONFIG_USE_DEVICE_AEC
         afe_iface_->disable_vad(afe_data_);
         afe_iface_->enable_aec(afe_data_);
+        aec_allowed_ = true;
+        aec_enabled_ = true;
 #else
         ESP_LOGE(TAG, "Device AEC is not supported");
 #endif
     } else {
+        aec_allowed_ = false;
+        aec_enabled_ = false;
         afe_iface_->disable_aec(afe_data_);
         afe_iface_->enable_vad(afe_data_);
     }
@@ -6,6 +6,8 @@
 #include <freertos/task.h>
 #include <freertos/event_groups.h>
 
+#include <atomic>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <functional>
@@ -19,6 +21,7 @@ public:
     ~AfeAudioProcessor();
 
     void Initialize(AudioCodec* codec, int frame_duration_ms, srmodel_list_t* models_list) override;
+    void SetFrameDuration(int frame_duration_ms) override;
     void Feed(std::vector<int16_t>&& data) override;
     void Start() override;
     void Stop() override;
@@ -27,6 +30,13 @@ public:
     void OnVadStateChange(std::function<void(bool speaking)> callback) override;
     size_t GetFeedSize() override;
     void EnableDeviceAec(bool enable) override;
+    cJSON* GetStatsJson() override;
+
+    // With CONFIG_USE_SHARED_AFE the same AFE also runs WakeNet, the wake word gets every fetch result
+    bool HasWakeNet() const { return wakenet_ready_; }
+    void EnableWakeWord(bool enable);
+    bool IsWakeWordRunning();
+    void OnWakeWordResult(std::function<void(afe_fetch_result_t* result)> callback);
 
 private:
     EventGroupHandle_t event_group_ = nullptr;
@@ -34,11 +44,39 @@ private:
     esp_afe_sr_data_t* afe_data_ = nullptr;
     std::function<void(std::vector<int16_t>&& data)> output_callback_;
     std::function<void(bool speaking)> vad_state_change_callback_;
+    std::function<void(afe_fetch_result_t* result)> wake_word_result_callback_;
     AudioCodec* codec_ = nullptr;
     int frame_samples_ = 0;
     bool is_speaking_ = false;
-    std::vector<int16_t> output_buffer_;
+    bool wakenet_ready_ = false;
+    std::vector<int16_t> output_frame_;     // Swapped with the buffer of an encode task when full
+
+    /*
+     * CONFIG_AFE_ADAPTIVE_PROCESSING: the input task follows the noise floor of the microphone
+     * and the playback reference in Feed(), and turns the NS and the AEC of the running AFE
+     * on and off. The processor task measures its run time in each of the four states.
+     */
+    int channels_ = 1;
+    int mic_channel_ = 0;
+    int ref_channel_ = -1;
+    bool ns_available_ = false;
+    std::atomic<bool> aec_allowed_ = false;     // The AEC of the config, or of EnableDeviceAec()
+    bool ns_enabled_ = true;
+    std::atomic<bool> aec_enabled_ = false;
+    uint32_t noise_floor_ = 0;
+    int64_t quiet_since_us_ = 0;
+    int64_t last_playback_us_ = 0;
+    std::atomic<int> adaptive_state_ = 3;       // ns | aec << 1
+    struct StateStats {
+        uint64_t audio_us = 0;
+        uint64_t run_us = 0;
+    };
+    std::mutex stats_mutex_;
+    StateStats state_stats_[4];
+    std::atomic<uint32_t> switches_ = 0;
 
+    void AdaptProcessing(const std::vector<int16_t>& data);
+    void AccountState(int state, uint64_t audio_us, uint64_t run_us);
     void AudioProcessorTask();
 };
 
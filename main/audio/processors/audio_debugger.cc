@@ -3,33 +3,129 @@
 
 #if CONFIG_USE_AUDIO_DEBUGGER
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <errno.h>
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
 #include <string>
 #endif
 
 #define TAG "AudioDebugger"
 
+// Below the Wi-Fi MTU, so a datagram is never fragmented
+#define AUDIO_DEBUG_DATAGRAM_SIZE 1400
+// A batch is sent after this long even if it is not full
+#define AUDIO_DEBUG_BATCH_MS 20
+#define AUDIO_DEBUG_MAGIC 0x4441    // "AD"
+#define AUDIO_DEBUG_VERSION 1
+#define AUDIO_DEBUG_MAX_CHANNELS 4
+
+enum AudioDebugEncoding {
+    kAudioDebugEncodingPcm16 = 0,
+    kAudioDebugEncodingImaAdpcm = 1,    // Per channel: int16 first sample, uint8 step index, a byte of padding, 4-bit codes
+};
+
+struct __attribute__((packed)) AudioDebugRecordHeader {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t tap;
+    uint8_t channels;
+    uint8_t reference_mask;
+    uint8_t encoding;
+    uint8_t reserved;
+    uint32_t sequence;      // Of the records of the tap, a gap means lost records
+    uint32_t sample_rate;
+    uint16_t frames;
+    uint16_t size;          // Of the samples after the header
+};
+
+#if CONFIG_USE_AUDIO_DEBUGGER
+static const int16_t kImaStepTable[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+static const int8_t kImaIndexTable[16] = {-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+
+// Encodes one channel of interleaved samples, returns the bytes written
+static size_t EncodeImaAdpcm(const int16_t* input, size_t frames, int channels, uint8_t* output) {
+    int predictor = input[0];
+    int index = 0;
+    // The step index is found from the first difference, so each record decodes on its own
+    if (frames > 1) {
+        int diff = std::abs(input[channels] - input[0]);
+        while (index < 88 && kImaStepTable[index] < diff / 4) {
+            index++;
+        }
+    }
+    output[0] = predictor & 0xFF;
+    output[1] = (predictor >> 8) & 0xFF;
+    output[2] = index;
+    output[3] = 0;
+    uint8_t* codes = output + 4;
+    memset(codes, 0, (frames + 1) / 2);
+    for (size_t i = 0; i < frames; i++) {
+        int step = kImaStepTable[index];
+        int diff = input[i * channels] - predictor;
+        int code = 0;
+        if (diff < 0) {
+            code = 8;
+            diff = -diff;
+        }
+        int delta = step >> 3;
+        if (diff >= step) { code |= 4; diff -= step; delta += step; }
+        step >>= 1;
+        if (diff >= step) { code |= 2; diff -= step; delta += step; }
+        step >>= 1;
+        if (diff >= step) { code |= 1; delta += step; }
+        predictor += (code & 8) ? -delta : delta;
+        predictor = std::clamp(predictor, -32768, 32767);
+        index = std::clamp(index + kImaIndexTable[code], 0, 88);
+        codes[i / 2] |= (i & 1) ? code << 4 : code;
+    }
+    return 4 + (frames + 1) / 2;
+}
+#endif
 
 AudioDebugger::AudioDebugger() {
 #if CONFIG_USE_AUDIO_DEBUGGER
+    datagram_.reserve(AUDIO_DEBUG_DATAGRAM_SIZE);
+#endif
+}
+
+AudioDebugger::~AudioDebugger() {
+#if CONFIG_USE_AUDIO_DEBUGGER
+    if (udp_sockfd_ >= 0) {
+        close(udp_sockfd_);
+        ESP_LOGI(TAG, "Closed UDP socket");
+    }
+#endif
+}
+
+// The socket is opened on the first audio, once the network stack is up
+void AudioDebugger::Open() {
+#if CONFIG_USE_AUDIO_DEBUGGER
+    opened_ = true;
     udp_sockfd_ = socket(AF_INET, SOCK_DGRAM, 0);
     if (udp_sockfd_ >= 0) {
         // 解析配置的服务器地址 "IP:PORT"
         std::string server_addr = CONFIG_AUDIO_DEBUG_UDP_SERVER;
         size_t colon_pos = server_addr.find(':');
-        
+
         if (colon_pos != std::string::npos) {
             std::string ip = server_addr.substr(0, colon_pos);
             int port = std::stoi(server_addr.substr(colon_pos + 1));
-            
+
             memset(&udp_server_addr_, 0, sizeof(udp_server_addr_));
             udp_server_addr_.sin_family = AF_INET;
             udp_server_addr_.sin_port = htons(port);
             inet_pton(AF_INET, ip.c_str(), &udp_server_addr_.sin_addr);
-            
+
             ESP_LOGI(TAG, "Initialized server address: %s", CONFIG_AUDIO_DEBUG_UDP_SERVER);
         } else {
             ESP_LOGW(TAG, "Invalid server address: %s, should be IP:PORT", CONFIG_AUDIO_DEBUG_UDP_SERVER);
@@ -42,27 +138,93 @@ AudioDebugger::AudioDebugger() {
 #endif
 }
 
-AudioDebugger::~AudioDebugger() {
+void AudioDebugger::Feed(AudioDebugTap tap, const int16_t* data, size_t samples, int channels, int sample_rate, uint8_t reference_mask) {
 #if CONFIG_USE_AUDIO_DEBUGGER
-    if (udp_sockfd_ >= 0) {
-        close(udp_sockfd_);
-        ESP_LOGI(TAG, "Closed UDP socket");
+    if (channels < 1 || channels > AUDIO_DEBUG_MAX_CHANNELS) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!opened_) {
+        Open();
+    }
+    if (udp_sockfd_ < 0) {
+        return;
+    }
+
+    // The frames of the largest record that fits in a datagram
+    size_t space = (AUDIO_DEBUG_DATAGRAM_SIZE - sizeof(AudioDebugRecordHeader)) / channels;
+#if CONFIG_AUDIO_DEBUG_ADPCM
+    size_t max_frames = (space - 4) * 2;
+#else
+    size_t max_frames = space / sizeof(int16_t);
+#endif
+    size_t frames = samples / channels;
+    for (size_t offset = 0; offset < frames; offset += max_frames) {
+        AppendRecord(tap, data + offset * channels, std::min(max_frames, frames - offset), channels, sample_rate, reference_mask);
+    }
+    if (!datagram_.empty() && esp_timer_get_time() - datagram_start_us_ >= AUDIO_DEBUG_BATCH_MS * 1000) {
+        Send();
     }
 #endif
 }
 
-void AudioDebugger::Feed(const std::vector<int16_t>& data) {
+void AudioDebugger::AppendRecord(AudioDebugTap tap, const int16_t* data, size_t frames, int channels, int sample_rate, uint8_t reference_mask) {
 #if CONFIG_USE_AUDIO_DEBUGGER
-    if (udp_sockfd_ >= 0) {
-        ssize_t sent = sendto(udp_sockfd_, data.data(), data.size() * sizeof(int16_t), 0,
-                             (struct sockaddr*)&udp_server_addr_, sizeof(udp_server_addr_));
-        if (sent < 0) {
-            ESP_LOGW(TAG, "Failed to send audio data to %s: %d", CONFIG_AUDIO_DEBUG_UDP_SERVER, errno);
-        } else {
-            ESP_LOGD(TAG, "Sent %d bytes audio data to %s", sent, CONFIG_AUDIO_DEBUG_UDP_SERVER);
-        }
+#if CONFIG_AUDIO_DEBUG_ADPCM
+    size_t size = (4 + (frames + 1) / 2) * channels;
+#else
+    size_t size = frames * channels * sizeof(int16_t);
+#endif
+    if (datagram_.size() + sizeof(AudioDebugRecordHeader) + size > AUDIO_DEBUG_DATAGRAM_SIZE) {
+        Send();
     }
+    if (datagram_.empty()) {
+        datagram_start_us_ = esp_timer_get_time();
+    }
+
+    AudioDebugRecordHeader header = {
+        .magic = AUDIO_DEBUG_MAGIC,
+        .version = AUDIO_DEBUG_VERSION,
+        .tap = (uint8_t)tap,
+        .channels = (uint8_t)channels,
+        .reference_mask = reference_mask,
+#if CONFIG_AUDIO_DEBUG_ADPCM
+        .encoding = kAudioDebugEncodingImaAdpcm,
+#else
+        .encoding = kAudioDebugEncodingPcm16,
+#endif
+        .reserved = 0,
+        .sequence = sequences_[tap]++,
+        .sample_rate = (uint32_t)sample_rate,
+        .frames = (uint16_t)frames,
+        .size = (uint16_t)size,
+    };
+    size_t position = datagram_.size();
+    datagram_.resize(position + sizeof(header) + size);
+    memcpy(datagram_.data() + position, &header, sizeof(header));
+    uint8_t* payload = datagram_.data() + position + sizeof(header);
+#if CONFIG_AUDIO_DEBUG_ADPCM
+    for (int channel = 0; channel < channels; channel++) {
+        payload += EncodeImaAdpcm(data + channel, frames, channels, payload);
+    }
+#else
+    memcpy(payload, data, size);
+#endif
 #endif
 }
 
- 
\ No newline at end of file
+void AudioDebugger::Send() {
+#if CONFIG_USE_AUDIO_DEBUGGER
+    // Never blocks the audio tasks, a datagram the Wi-Fi has no room for is dropped
+    ssize_t sent = sendto(udp_sockfd_, datagram_.data(), datagram_.size(), MSG_DONTWAIT,
+                         (struct sockaddr*)&udp_server_addr_, sizeof(udp_server_addr_));
+    if (sent < 0) {
+        if (send_errors_++ % 100 == 0) {
+            ESP_LOGW(TAG, "Failed to send audio data to %s: %d, %lu failures", CONFIG_AUDIO_DEBUG_UDP_SERVER, errno, send_errors_);
+        }
+    } else {
+        ESP_LOGD(TAG, "Sent %d bytes audio data to %s", sent, CONFIG_AUDIO_DEBUG_UDP_SERVER);
+    }
+    datagram_.clear();
+#endif
+}
@@ -3,20 +3,48 @@
 
 #include <vector>
 #include <cstdint>
+#include <cstddef>
+#include <mutex>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 
+// Where the audio was taken, one stream per tap
+enum AudioDebugTap {
+    kAudioDebugTapInput,        // As captured, the microphones and the AEC reference interleaved
+    kAudioDebugTapProcessed,    // The audio processor output, what is encoded
+    kAudioDebugTapPlayback,     // As written to I2S, with the sounds mixed in
+    kAudioDebugTapCount,
+};
+
+/*
+ * Sends the audio of the taps to CONFIG_AUDIO_DEBUG_UDP_SERVER for scripts/audio_debug_server.py.
+ *
+ * Each block of a tap is a record of a header and the samples, PCM or IMA ADPCM with
+ * CONFIG_AUDIO_DEBUG_ADPCM. The records of all the taps are batched into datagrams of up to
+ * AUDIO_DEBUG_DATAGRAM_SIZE bytes. Feed() may be called by any task.
+ */
 class AudioDebugger {
 public:
     AudioDebugger();
     ~AudioDebugger();
 
-    void Feed(const std::vector<int16_t>& data);
+    // reference_mask marks the channels that carry the AEC reference
+    void Feed(AudioDebugTap tap, const int16_t* data, size_t samples, int channels, int sample_rate, uint8_t reference_mask = 0);
 
 private:
+    std::mutex mutex_;
     int udp_sockfd_ = -1;
+    bool opened_ = false;
     struct sockaddr_in udp_server_addr_;
+    std::vector<uint8_t> datagram_;
+    int64_t datagram_start_us_ = 0;
+    uint32_t sequences_[kAudioDebugTapCount] = {};
+    uint32_t send_errors_ = 0;
+
+    void Open();
+    void AppendRecord(AudioDebugTap tap, const int16_t* data, size_t frames, int channels, int sample_rate, uint8_t reference_mask);
+    void Send();
 };
 
-#endif 
\ No newline at end of file
+#endif
@@ -0,0 +1,172 @@
+#include "sound_cache.h"
+#include "audio_service.h"
+#include "ogg_demuxer.h"
+#include "stream_resampler.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+
+#define TAG "SoundCache"
+
+#define SOUND_CACHE_SIZE (CONFIG_AUDIO_SOUND_CACHE_SIZE_KB * 1024)
+// The longest Opus frame
+#define SOUND_MAX_FRAME_MS 120
+
+void SoundCache::Initialize(int output_sample_rate) {
+    output_sample_rate_ = output_sample_rate;
+}
+
+SoundCache::Pcm SoundCache::Find(std::string_view ogg) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (SOUND_CACHE_SIZE == 0 || output_sample_rate_ == 0) {
+        return nullptr;
+    }
+    auto it = sounds_.find(ogg.data());
+    if (it != sounds_.end()) {
+        if (it->second != nullptr) {
+            hits_++;
+        }
+        return it->second;
+    }
+    misses_++;
+    if (std::find(pending_.begin(), pending_.end(), ogg) == pending_.end()) {
+        pending_.push_back(ogg);
+    }
+    return nullptr;
+}
+
+void SoundCache::DecodePending() {
+    while (true) {
+        std::string_view ogg;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (pending_.empty()) {
+                return;
+            }
+            ogg = pending_.back();
+            pending_.pop_back();
+        }
+        Store(ogg, Decode(ogg));
+    }
+}
+
+bool SoundCache::Preload(std::string_view ogg) {
+    if (SOUND_CACHE_SIZE == 0 || output_sample_rate_ == 0) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = sounds_.find(ogg.data());
+        if (it != sounds_.end()) {
+            return it->second != nullptr;
+        }
+    }
+    auto pcm = Decode(ogg);
+    Store(ogg, pcm);
+    return pcm != nullptr;
+}
+
+void SoundCache::Store(std::string_view ogg, Pcm pcm) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (sounds_.find(ogg.data()) != sounds_.end()) {
+        return;
+    }
+    // A sound that does not fit is remembered too, so it is not decoded again
+    size_t size = pcm != nullptr ? pcm->size() * sizeof(int16_t) : 0;
+    if (used_ + size > SOUND_CACHE_SIZE) {
+        pcm = nullptr;
+        size = 0;
+    }
+    sounds_[ogg.data()] = pcm;
+    used_ += size;
+}
+
+SoundCache::Pcm SoundCache::Decode(std::string_view ogg) {
+    auto start_time = esp_timer_get_time();
+    const size_t max_samples = SOUND_CACHE_SIZE / 2 / sizeof(int16_t);
+    auto pcm = std::make_shared<ColdVector<int16_t>>();
+
+    void* decoder = nullptr;
+    int decoder_duration = 0;
+    int sample_rate = 0;
+    StreamResampler resampler;
+    HotVector<int16_t> frame;
+    HotVector<int16_t> resampled;
+    bool failed = false;
+
+    OggDemuxer demuxer;
+    demuxer.OnPacket([&](const uint8_t* data, size_t size) {
+        if (decoder == nullptr) {
+            sample_rate = demuxer.sample_rate();
+            decoder_duration = OggDemuxer::GetOpusPacketDurationMs(data, size);
+            if (decoder_duration == 0) {
+                decoder_duration = OPUS_FRAME_DURATION_MS;
+            }
+            esp_opus_dec_cfg_t opus_dec_cfg = OPUS_DEC_CFG(sample_rate, decoder_duration);
+            if (esp_opus_dec_open(&opus_dec_cfg, sizeof(esp_opus_dec_cfg_t), &decoder) != ESP_AUDIO_ERR_OK || decoder == nullptr) {
+                failed = true;
+                return false;
+            }
+            if (sample_rate != output_sample_rate_ && !resampler.Open(sample_rate, output_sample_rate_, 1)) {
+                failed = true;
+                return false;
+            }
+            frame.resize(sample_rate / 1000 * SOUND_MAX_FRAME_MS);
+        }
+
+        esp_audio_dec_in_raw_t raw = {
+            .buffer = const_cast<uint8_t*>(data),
+            .len = (uint32_t)size,
+            .consumed = 0,
+            .frame_recover = ESP_AUDIO_DEC_RECOVERY_NONE,
+        };
+        esp_audio_dec_out_frame_t out_frame = {
+            .buffer = (uint8_t*)frame.data(),
+            .len = (uint32_t)(frame.size() * sizeof(int16_t)),
+            .decoded_size = 0,
+        };
+        esp_audio_dec_info_t dec_info = {};
+        if (esp_opus_dec_decode(decoder, &raw, &out_frame, &dec_info) != ESP_AUDIO_ERR_OK) {
+            // Played as it comes, a bad packet is left out like the stream decoder does
+            return true;
+        }
+        const int16_t* samples = frame.data();
+        size_t count = out_frame.decoded_size / sizeof(int16_t);
+        if (resampler.IsOpen()) {
+            resampled.resize(resampler.MaxOutputFrames(count));
+            count = resampler.Process(samples, count, resampled.data(), resampled.size());
+            samples = resampled.data();
+        }
+        if (pcm->size() + count > max_samples) {
+            failed = true;
+            return false;
+        }
+        pcm->insert(pcm->end(), samples, samples + count);
+        return true;
+    });
+    demuxer.Feed(reinterpret_cast<const uint8_t*>(ogg.data()), ogg.size());
+    if (decoder != nullptr) {
+        esp_opus_dec_close(decoder);
+    }
+
+    if (failed || pcm->empty()) {
+        ESP_LOGW(TAG, "Sound of %u bytes not cached", ogg.size());
+        return nullptr;
+    }
+    pcm->shrink_to_fit();
+    ESP_LOGI(TAG, "Sound of %u bytes decoded to %u ms at %d Hz in %d ms", ogg.size(),
+        pcm->size() * 1000 / output_sample_rate_, output_sample_rate_, int((esp_timer_get_time() - start_time) / 1000));
+    return pcm;
+}
+
+cJSON* SoundCache::GetStatsJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto root = cJSON_CreateObject();
+    int sounds = std::count_if(sounds_.begin(), sounds_.end(), [](const auto& entry) { return entry.second != nullptr; });
+    cJSON_AddNumberToObject(root, "sounds", sounds);
+    cJSON_AddNumberToObject(root, "bytes", used_);
+    cJSON_AddNumberToObject(root, "hits", hits_);
+    cJSON_AddNumberToObject(root, "misses", misses_);
+    return root;
+}
@@ -0,0 +1,54 @@
+#ifndef SOUND_CACHE_H
+#define SOUND_CACHE_H
+
+#include <cJSON.h>
+
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include "memory_placement.h"
+
+/*
+ * The short UI sounds decoded once to mono PCM at the codec output rate.
+ *
+ * A sound in the cache skips the OGG demuxer, the Opus decoder and the resampler, and its PCM
+ * goes straight to the mixer, so it starts on the next DMA chunk. The sounds are keyed by
+ * their data, which is embedded in the firmware, and a sound played the first time is asked
+ * for with Find() and decoded by DecodePending() once the player is idle. The PCM is kept in
+ * PSRAM, up to CONFIG_AUDIO_SOUND_CACHE_SIZE_KB, and a sound over half of that is never
+ * cached.
+ *
+ * Find() may be called by any task, DecodePending() and Preload() decode in the caller.
+ */
+class SoundCache {
+public:
+    using Pcm = std::shared_ptr<const ColdVector<int16_t>>;
+
+    void Initialize(int output_sample_rate);
+    // nullptr on a miss, the sound is then decoded by the next DecodePending()
+    Pcm Find(std::string_view ogg);
+    void DecodePending();
+    bool Preload(std::string_view ogg);
+    // The caller owns the returned object
+    cJSON* GetStatsJson();
+
+private:
+    std::mutex mutex_;
+    std::unordered_map<const char*, Pcm> sounds_;
+    std::vector<std::string_view> pending_;
+    int output_sample_rate_ = 0;
+    size_t used_ = 0;
+    uint32_t hits_ = 0;
+    uint32_t misses_ = 0;
+
+    // Holds the PCM of the whole sound, nullptr if it does not fit
+    Pcm Decode(std::string_view ogg);
+    void Store(std::string_view ogg, Pcm pcm);
+};
+
+#endif // SOUND_CACHE_H
@@ -0,0 +1,166 @@
+#include "sound_player.h"
+#include "ogg_demuxer.h"
+#include "board.h"
+#include "http_pool.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "SoundPlayer"
+
+#define SOUND_TASK_STACK_SIZE (4096)
+#define SOUND_READ_CHUNK_SIZE 512
+// Used when the duration of the first packet cannot be told from its TOC byte
+#define SOUND_DEFAULT_FRAME_DURATION_MS 60
+
+int MemorySoundSource::Read(uint8_t* buffer, size_t size) {
+    size_t n = std::min(size, data_.size() - offset_);
+    memcpy(buffer, data_.data() + offset_, n);
+    offset_ += n;
+    return n;
+}
+
+HttpSoundSource::~HttpSoundSource() {
+    if (http_) {
+        http_->Close();
+    }
+}
+
+int HttpSoundSource::Read(uint8_t* buffer, size_t size) {
+    if (failed_) {
+        return -1;
+    }
+    if (!http_) {
+        http_ = HttpPool::GetInstance().CreateHttp(3);
+        if (!http_->Open("GET", url_)) {
+            ESP_LOGE(TAG, "Failed to open %s", url_.c_str());
+            failed_ = true;
+            return -1;
+        }
+        if (http_->GetStatusCode() != 200) {
+            ESP_LOGE(TAG, "Failed to get %s, status code: %d", url_.c_str(), http_->GetStatusCode());
+            failed_ = true;
+            return -1;
+        }
+    }
+    return http_->Read(reinterpret_cast<char*>(buffer), size);
+}
+
+SoundPlayer::~SoundPlayer() {
+    if (task_handle_ != nullptr) {
+        vTaskDelete(task_handle_);
+    }
+}
+
+void SoundPlayer::Initialize(PacketSink sink, PcmSink pcm_sink, std::function<void()> on_idle) {
+    sink_ = sink;
+    pcm_sink_ = pcm_sink;
+    on_idle_ = on_idle;
+}
+
+void SoundPlayer::Play(std::unique_ptr<SoundSource> source, SoundPriority priority) {
+    Sound sound;
+    sound.source = std::move(source);
+    sound.priority = priority;
+    Enqueue(std::move(sound));
+}
+
+void SoundPlayer::Play(SoundCache::Pcm pcm, SoundPriority priority) {
+    Sound sound;
+    sound.pcm = std::move(pcm);
+    sound.priority = priority;
+    Enqueue(std::move(sound));
+}
+
+void SoundPlayer::Enqueue(Sound&& sound) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (task_handle_ == nullptr) {
+        xTaskCreate([](void* arg) {
+            auto this_ = (SoundPlayer*)arg;
+            this_->SoundTask();
+        }, "sound_player", SOUND_TASK_STACK_SIZE, this, 3, &task_handle_);
+    }
+    queue_.push_back(std::move(sound));
+    cv_.notify_all();
+}
+
+void SoundPlayer::Cancel() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.clear();
+    generation_++;
+}
+
+bool SoundPlayer::IsIdle() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return !playing_ && queue_.empty();
+}
+
+void SoundPlayer::SoundTask() {
+    while (true) {
+        Sound sound;
+        uint32_t generation;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this]() { return !queue_.empty(); });
+            sound = std::move(queue_.front());
+            queue_.pop_front();
+            generation = generation_;
+            playing_ = true;
+        }
+
+        if (sound.pcm != nullptr) {
+            pcm_sink_(sound.pcm->data(), sound.pcm->size(), sound.priority, generation);
+        } else {
+            Stream(sound, generation);
+        }
+        sound.source.reset();
+        sound.pcm.reset();
+
+        bool idle;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            playing_ = false;
+            idle = queue_.empty();
+        }
+        if (idle && on_idle_) {
+            on_idle_();
+        }
+    }
+}
+
+void SoundPlayer::Stream(Sound& sound, uint32_t generation) {
+    OggDemuxer demuxer;
+    int frame_duration = 0;
+    int packets = 0;
+    demuxer.OnPacket([&](const uint8_t* data, size_t size) {
+        // One duration for the whole sound, so the decoder is not reopened between packets
+        if (frame_duration == 0) {
+            frame_duration = OggDemuxer::GetOpusPacketDurationMs(data, size);
+            if (frame_duration == 0) {
+                frame_duration = SOUND_DEFAULT_FRAME_DURATION_MS;
+            }
+        }
+        auto packet = AudioStreamPacket::Create();
+        packet->sample_rate = demuxer.sample_rate();
+        packet->frame_duration = frame_duration;
+        packet->payload.assign(data, data + size);
+        packets++;
+        return sink_(std::move(packet), sound.priority, generation);
+    });
+
+    uint8_t buffer[SOUND_READ_CHUNK_SIZE];
+    while (generation == generation_) {
+        int ret = sound.source->Read(buffer, sizeof(buffer));
+        if (ret < 0) {
+            ESP_LOGE(TAG, "Failed to read the sound");
+            break;
+        }
+        if (ret == 0 || !demuxer.Feed(buffer, ret)) {
+            break;
+        }
+    }
+    if (generation != generation_) {
+        ESP_LOGI(TAG, "Sound cancelled after %d packets", packets);
+    }
+}
@@ -0,0 +1,107 @@
+#ifndef SOUND_PLAYER_H
+#define SOUND_PLAYER_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <http.h>
+
+#include <string>
+#include <string_view>
+#include <memory>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+#include "protocol.h"
+#include "sound_cache.h"
+
+enum SoundPriority {
+    kSoundPriorityNormal,   // Queued after the audio already playing
+    kSoundPriorityHigh,     // Interrupts the audio already playing, like TTS
+    kSoundPriorityMix,      // Mixed over the audio already playing
+};
+
+/* Where the bytes of an OGG file come from */
+class SoundSource {
+public:
+    virtual ~SoundSource() = default;
+    // Read up to size bytes, returns 0 at the end and -1 on error
+    virtual int Read(uint8_t* buffer, size_t size) = 0;
+};
+
+/* A sound in memory, like the embedded sounds or an asset mapped from the assets partition */
+class MemorySoundSource : public SoundSource {
+public:
+    explicit MemorySoundSource(std::string_view data) : data_(data) {}
+    int Read(uint8_t* buffer, size_t size) override;
+
+private:
+    std::string_view data_;
+    size_t offset_ = 0;
+};
+
+/* A sound downloaded while it plays, the request is sent on the first read */
+class HttpSoundSource : public SoundSource {
+public:
+    explicit HttpSoundSource(const std::string& url) : url_(url) {}
+    ~HttpSoundSource();
+    int Read(uint8_t* buffer, size_t size) override;
+
+private:
+    std::string url_;
+    std::unique_ptr<Http> http_;
+    bool failed_ = false;
+};
+
+/*
+ * Plays OGG/Opus sounds one after the other in a background task.
+ *
+ * A sound is read and demuxed a chunk at a time and its packets go to the sink as fast as
+ * the sink takes them, so only a few packets of a sound are ever in memory and the caller
+ * of Play() never blocks. A sound decoded ahead of time goes to the PCM sink whole instead.
+ * Cancel() drops the sound playing and the queued ones, the sinks get the generation of the
+ * sound so they can drop what is pushed across a Cancel().
+ */
+class SoundPlayer {
+public:
+    // Blocks until the packet is queued, returns false to stop the sound
+    using PacketSink = std::function<bool(AudioStreamPacketPtr packet, SoundPriority priority, uint32_t generation)>;
+    // Blocks until the PCM is played or buffered, returns false if the sound was stopped
+    using PcmSink = std::function<bool(const int16_t* pcm, size_t samples, SoundPriority priority, uint32_t generation)>;
+
+    SoundPlayer() = default;
+    ~SoundPlayer();
+
+    void Initialize(PacketSink sink, PcmSink pcm_sink, std::function<void()> on_idle);
+    void Play(std::unique_ptr<SoundSource> source, SoundPriority priority = kSoundPriorityNormal);
+    void Play(SoundCache::Pcm pcm, SoundPriority priority = kSoundPriorityNormal);
+    void Cancel();
+    bool IsIdle();
+    uint32_t generation() const { return generation_; }
+
+private:
+    struct Sound {
+        std::unique_ptr<SoundSource> source;
+        SoundCache::Pcm pcm;    // Instead of the source
+        SoundPriority priority = kSoundPriorityNormal;
+    };
+
+    PacketSink sink_;
+    PcmSink pcm_sink_;
+    std::function<void()> on_idle_;
+    std::deque<Sound> queue_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::atomic<uint32_t> generation_ = 0;
+    bool playing_ = false;
+    TaskHandle_t task_handle_ = nullptr;
+
+    void Enqueue(Sound&& sound);
+    void SoundTask();
+    void Stream(Sound& sound, uint32_t generation);
+};
+
+#endif // SOUND_PLAYER_H
@@ -0,0 +1,271 @@
+#include "speaker_dsp.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#define TAG "SpeakerDsp"
+
+#define COEFF_BITS 28
+// The biquads leave headroom over the int16 range, the dynamics bring the peaks back under it
+#define EQ_LIMIT (1 << 20)
+#define GAIN_BITS 16
+
+static inline int32_t ToQ28(double value) {
+    return (int32_t)std::lround(std::clamp(value, -7.99, 7.99) * (1 << COEFF_BITS));
+}
+
+static inline float DbToLinear(float db) {
+    return std::pow(10.0f, db / 20.0f);
+}
+
+SpeakerDsp::Biquad SpeakerDsp::MakeBiquad(const SpeakerEqBand& band, int sample_rate) {
+    double freq = std::clamp<double>(band.freq_hz, 20, sample_rate * 0.45);
+    double q = std::max(0.1f, band.q);
+    double w0 = 2 * M_PI * freq / sample_rate;
+    double cos_w0 = std::cos(w0);
+    double alpha = std::sin(w0) / (2 * q);
+    double a = std::pow(10.0, std::clamp(band.gain_db, -18.0f, 12.0f) / 40.0);
+    double sqrt_a_alpha = 2 * std::sqrt(a) * alpha;
+    double b0, b1, b2, a0, a1, a2;
+    // The filters of the Audio EQ Cookbook
+    switch (band.type) {
+    case kSpeakerEqLowShelf:
+        b0 = a * ((a + 1) - (a - 1) * cos_w0 + sqrt_a_alpha);
+        b1 = 2 * a * ((a - 1) - (a + 1) * cos_w0);
+        b2 = a * ((a + 1) - (a - 1) * cos_w0 - sqrt_a_alpha);
+        a0 = (a + 1) + (a - 1) * cos_w0 + sqrt_a_alpha;
+        a1 = -2 * ((a - 1) + (a + 1) * cos_w0);
+        a2 = (a + 1) + (a - 1) * cos_w0 - sqrt_a_alpha;
+        break;
+    case kSpeakerEqHighShelf:
+        b0 = a * ((a + 1) + (a - 1) * cos_w0 + sqrt_a_alpha);
+        b1 = -2 * a * ((a - 1) + (a + 1) * cos_w0);
+        b2 = a * ((a + 1) + (a - 1) * cos_w0 - sqrt_a_alpha);
+        a0 = (a + 1) - (a - 1) * cos_w0 + sqrt_a_alpha;
+        a1 = 2 * ((a - 1) - (a + 1) * cos_w0);
+        a2 = (a + 1) - (a - 1) * cos_w0 - sqrt_a_alpha;
+        break;
+    case kSpeakerEqHighPass:
+        b0 = (1 + cos_w0) / 2;
+        b1 = -(1 + cos_w0);
+        b2 = (1 + cos_w0) / 2;
+        a0 = 1 + alpha;
+        a1 = -2 * cos_w0;
+        a2 = 1 - alpha;
+        break;
+    case kSpeakerEqLowPass:
+        b0 = (1 - cos_w0) / 2;
+        b1 = 1 - cos_w0;
+        b2 = (1 - cos_w0) / 2;
+        a0 = 1 + alpha;
+        a1 = -2 * cos_w0;
+        a2 = 1 - alpha;
+        break;
+    default:
+        b0 = 1 + alpha * a;
+        b1 = -2 * cos_w0;
+        b2 = 1 - alpha * a;
+        a0 = 1 + alpha / a;
+        a1 = -2 * cos_w0;
+        a2 = 1 - alpha / a;
+        break;
+    }
+    Biquad biquad = {};
+    biquad.b0 = ToQ28(b0 / a0);
+    biquad.b1 = ToQ28(b1 / a0);
+    biquad.b2 = ToQ28(b2 / a0);
+    biquad.a1 = ToQ28(-a1 / a0);
+    biquad.a2 = ToQ28(-a2 / a0);
+    return biquad;
+}
+
+void SpeakerDsp::Configure(const SpeakerDspConfig& config, int sample_rate) {
+    sample_rate_ = sample_rate;
+    band_count_ = std::min<int>(config.bands.size(), SPEAKER_DSP_MAX_BANDS);
+    for (int i = 0; i < band_count_; i++) {
+        biquads_[i] = MakeBiquad(config.bands[i], sample_rate);
+    }
+    pre_gain_q14_ = (int32_t)(DbToLinear(std::clamp(config.pre_gain_db, -24.0f, 12.0f)) * (1 << 14));
+
+    threshold_db_ = std::min(config.threshold_db, 0.0f);
+    slope_ = config.ratio > 1 ? 1 - 1 / config.ratio : 0;
+    makeup_db_ = std::clamp(config.makeup_db, 0.0f, 12.0f);
+    ceiling_ = DbToLinear(std::min(config.ceiling_db, 0.0f));
+    float block_ms = SPEAKER_DSP_BLOCK * 1000.0f / sample_rate;
+    attack_coeff_ = 1 - std::exp(-block_ms / std::max(1, config.attack_ms));
+    release_coeff_ = 1 - std::exp(-block_ms / std::max(1, config.release_ms));
+    int lookahead_samples = config.lookahead_ms * sample_rate / 1000;
+    lookahead_blocks_ = std::clamp((lookahead_samples + SPEAKER_DSP_BLOCK - 1) / SPEAKER_DSP_BLOCK, 0,
+        SPEAKER_DSP_MAX_LOOKAHEAD_BLOCKS);
+    enabled_ = true;
+    Reset();
+    ESP_LOGI(TAG, "%d EQ bands, compressor %.1f dB %.1f:1, limiter %.1f dB, look-ahead %d samples", band_count_,
+        threshold_db_, config.ratio, config.ceiling_db, lookahead_blocks_ * SPEAKER_DSP_BLOCK);
+}
+
+void SpeakerDsp::Reset() {
+    for (auto& biquad : biquads_) {
+        biquad.x1 = biquad.x2 = biquad.y1 = biquad.y2 = 0;
+        biquad.error = 0;
+    }
+    envelope_ = 0;
+    gain_ = 1;
+    delay_.fill(0);
+    block_peaks_.fill(0);
+    delay_block_ = 0;
+    block_.fill(0);
+    output_.fill(0);
+    block_fill_ = 0;
+}
+
+void SpeakerDsp::Process(int16_t* samples, size_t count) {
+    if (!enabled_) {
+        return;
+    }
+    int64_t start_us = esp_timer_get_time();
+    for (size_t i = 0; i < count; i++) {
+        int32_t x = (int32_t)(((int64_t)samples[i] * pre_gain_q14_) >> 14);
+        for (int b = 0; b < band_count_; b++) {
+            auto& q = biquads_[b];
+            int64_t acc = q.error + (int64_t)q.b0 * x + (int64_t)q.b1 * q.x1 + (int64_t)q.b2 * q.x2 +
+                (int64_t)q.a1 * q.y1 + (int64_t)q.a2 * q.y2;
+            int32_t y = (int32_t)(acc >> COEFF_BITS);
+            // The rounding error goes into the next sample, a pole near 1 then stays exact
+            q.error = acc - ((int64_t)y << COEFF_BITS);
+            y = std::clamp(y, -EQ_LIMIT, EQ_LIMIT);
+            q.x2 = q.x1;
+            q.x1 = x;
+            q.y2 = q.y1;
+            q.y1 = y;
+            x = y;
+        }
+        // The sample of the block processed last takes the place of the new one
+        block_[block_fill_] = x;
+        samples[i] = output_[block_fill_];
+        if (++block_fill_ == SPEAKER_DSP_BLOCK) {
+            block_fill_ = 0;
+            ProcessBlock();
+        }
+    }
+    processed_samples_ += count;
+    busy_us_ += esp_timer_get_time() - start_us;
+}
+
+/*
+ * The new block goes into the look-ahead ring, and the oldest one comes out with the gain ramped
+ * to what the loudest block in the ring allows, into output_ that Process() plays while the
+ * next block fills.
+ */
+void SpeakerDsp::ProcessBlock() {
+    int ring = lookahead_blocks_ + 1;
+    int32_t* slot = &delay_[delay_block_ * SPEAKER_DSP_BLOCK];
+    int32_t peak = 0;
+    for (int i = 0; i < SPEAKER_DSP_BLOCK; i++) {
+        slot[i] = block_[i];
+        peak = std::max(peak, std::abs(block_[i]));
+    }
+    block_peaks_[delay_block_] = peak;
+    delay_block_ = (delay_block_ + 1) % ring;
+    const int32_t* oldest = &delay_[delay_block_ * SPEAKER_DSP_BLOCK];
+    int32_t ring_peak = *std::max_element(block_peaks_.begin(), block_peaks_.begin() + ring);
+
+    // The compressor follows the newest block, the limiter the loudest one still to be played
+    float level = peak / 32768.0f;
+    envelope_ += (level > envelope_ ? attack_coeff_ : release_coeff_) * (level - envelope_);
+    float gain_db = makeup_db_;
+    if (envelope_ > 0) {
+        float level_db = 20 * std::log10(envelope_);
+        if (level_db > threshold_db_) {
+            gain_db -= slope_ * (level_db - threshold_db_);
+        }
+    }
+    float target = DbToLinear(gain_db);
+    if (ring_peak > 0) {
+        target = std::min(target, ceiling_ * 32767.0f / ring_peak);
+    }
+    // Down within the block, up as slow as the release
+    float gain = target < gain_ ? target : gain_ + release_coeff_ * (target - gain_);
+    last_reduction_db_ = gain < 1 ? -20 * std::log10(gain) : 0;
+
+    int32_t gain_q = (int32_t)(gain_ * (1 << GAIN_BITS));
+    int32_t step = ((int32_t)(gain * (1 << GAIN_BITS)) - gain_q) / SPEAKER_DSP_BLOCK;
+    for (int i = 0; i < SPEAKER_DSP_BLOCK; i++) {
+        gain_q += step;
+        int32_t y = (int32_t)(((int64_t)oldest[i] * gain_q) >> GAIN_BITS);
+        output_[i] = (int16_t)std::clamp<int32_t>(y, INT16_MIN, INT16_MAX);
+    }
+    gain_ = gain;
+}
+
+bool SpeakerDsp::ParseJson(const cJSON* json, SpeakerDspConfig& config) {
+    if (!cJSON_IsObject(json)) {
+        return false;
+    }
+    auto number = [json](const char* key, auto& value) {
+        auto item = cJSON_GetObjectItem(json, key);
+        if (cJSON_IsNumber(item)) {
+            value = item->valuedouble;
+        }
+    };
+    number("pre_gain_db", config.pre_gain_db);
+    number("threshold_db", config.threshold_db);
+    number("ratio", config.ratio);
+    number("attack_ms", config.attack_ms);
+    number("release_ms", config.release_ms);
+    number("makeup_db", config.makeup_db);
+    number("ceiling_db", config.ceiling_db);
+    number("lookahead_ms", config.lookahead_ms);
+
+    auto eq = cJSON_GetObjectItem(json, "eq");
+    if (cJSON_IsArray(eq)) {
+        static const char* const kTypes[] = {"peak", "low_shelf", "high_shelf", "high_pass", "low_pass"};
+        config.bands.clear();
+        cJSON* item;
+        cJSON_ArrayForEach(item, eq) {
+            SpeakerEqBand band;
+            auto type = cJSON_GetObjectItem(item, "type");
+            auto freq = cJSON_GetObjectItem(item, "freq");
+            if (!cJSON_IsString(type) || !cJSON_IsNumber(freq)) {
+                ESP_LOGW(TAG, "An EQ band needs a type and a freq");
+                continue;
+            }
+            auto found = std::find_if(std::begin(kTypes), std::end(kTypes), [type](const char* name) {
+                return strcmp(name, type->valuestring) == 0;
+            });
+            if (found == std::end(kTypes)) {
+                ESP_LOGW(TAG, "Unknown EQ band type %s", type->valuestring);
+                continue;
+            }
+            band.type = (SpeakerEqType)(found - std::begin(kTypes));
+            band.freq_hz = freq->valueint;
+            auto gain = cJSON_GetObjectItem(item, "gain_db");
+            if (cJSON_IsNumber(gain)) {
+                band.gain_db = gain->valuedouble;
+            }
+            auto q = cJSON_GetObjectItem(item, "q");
+            if (cJSON_IsNumber(q)) {
+                band.q = q->valuedouble;
+            }
+            config.bands.push_back(band);
+        }
+    }
+    return true;
+}
+
+cJSON* SpeakerDsp::GetStatsJson() const {
+    auto json = cJSON_CreateObject();
+    cJSON_AddBoolToObject(json, "enabled", enabled_);
+    if (!enabled_) {
+        return json;
+    }
+    cJSON_AddNumberToObject(json, "bands", band_count_);
+    // The busy time over the duration of the audio it processed
+    double audio_us = sample_rate_ > 0 ? processed_samples_ * 1e6 / sample_rate_ : 0;
+    cJSON_AddNumberToObject(json, "cpu_percent", audio_us > 0 ? busy_us_ * 100.0 / audio_us : 0);
+    cJSON_AddNumberToObject(json, "gain_reduction_db", last_reduction_db_);
+    cJSON_AddNumberToObject(json, "latency_samples", (lookahead_blocks_ + 1) * SPEAKER_DSP_BLOCK);
+    return json;
+}
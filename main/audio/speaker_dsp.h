@@ -0,0 +1,107 @@
+#ifndef SPEAKER_DSP_H
+#define SPEAKER_DSP_H
+
+#include <cJSON.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#define SPEAKER_DSP_MAX_BANDS 5
+// The gain is computed once per block and ramped over it
+#define SPEAKER_DSP_BLOCK 16
+#define SPEAKER_DSP_MAX_LOOKAHEAD_BLOCKS 8
+
+enum SpeakerEqType {
+    kSpeakerEqPeak,
+    kSpeakerEqLowShelf,
+    kSpeakerEqHighShelf,
+    kSpeakerEqHighPass,
+    kSpeakerEqLowPass,
+};
+
+struct SpeakerEqBand {
+    SpeakerEqType type = kSpeakerEqPeak;
+    int freq_hz = 1000;
+    float gain_db = 0;      // Not used by the pass filters
+    float q = 0.707f;
+};
+
+struct SpeakerDspConfig {
+    std::vector<SpeakerEqBand> bands;
+    float pre_gain_db = 0;
+    // The compressor, a ratio of 1 turns it off
+    float threshold_db = -12;
+    float ratio = 2;
+    int attack_ms = 5;
+    int release_ms = 150;
+    float makeup_db = 0;
+    // The limiter, the peaks never go over the ceiling
+    float ceiling_db = -1;
+    int lookahead_ms = 3;
+};
+
+/*
+ * The speaker stage of the output: a parametric EQ for the small speakers, then a compressor
+ * and a look-ahead limiter, so a loud reply gets louder without clipping.
+ *
+ * The samples stay fixed point: the biquads run in direct form I with Q28 coefficients and
+ * error feedback, which keeps a low shelf or a high pass exact at 16 kHz. The gain of the
+ * dynamics is computed in dB once per block and ramped linearly over the block, and the
+ * signal is delayed by the look-ahead so the limiter is down before a peak is played.
+ *
+ * Not thread safe, the audio service configures it and processes with the output lock held.
+ */
+class SpeakerDsp {
+public:
+    void Configure(const SpeakerDspConfig& config, int sample_rate);
+    // Missing keys keep the values of the config passed in, false if the JSON is no object
+    static bool ParseJson(const cJSON* json, SpeakerDspConfig& config);
+    bool enabled() const { return enabled_; }
+    void Reset();
+    // Mono samples in place
+    void Process(int16_t* samples, size_t count);
+    // The CPU share of the samples processed, and the gain reduction of the last block
+    cJSON* GetStatsJson() const;
+
+private:
+    struct Biquad {
+        int32_t b0, b1, b2, a1, a2;     // Q28, a1 and a2 negated
+        int32_t x1, x2, y1, y2;
+        int64_t error;
+    };
+
+    bool enabled_ = false;
+    int sample_rate_ = 0;
+    std::array<Biquad, SPEAKER_DSP_MAX_BANDS> biquads_ = {};
+    int band_count_ = 0;
+    int32_t pre_gain_q14_ = 1 << 14;
+
+    float threshold_db_ = 0;
+    float slope_ = 0;                   // 1 - 1 / ratio
+    float makeup_db_ = 0;
+    float ceiling_ = 0;                 // Of full scale
+    float attack_coeff_ = 0;            // Per block
+    float release_coeff_ = 0;
+    float envelope_ = 0;
+    float gain_ = 1;                    // Applied at the end of the last block
+
+    // The look-ahead delay in whole blocks, and the peaks of the blocks in it
+    int lookahead_blocks_ = 0;
+    std::array<int32_t, (SPEAKER_DSP_MAX_LOOKAHEAD_BLOCKS + 1) * SPEAKER_DSP_BLOCK> delay_ = {};
+    std::array<int32_t, SPEAKER_DSP_MAX_LOOKAHEAD_BLOCKS + 1> block_peaks_ = {};
+    int delay_block_ = 0;
+    std::array<int32_t, SPEAKER_DSP_BLOCK> block_ = {};
+    std::array<int16_t, SPEAKER_DSP_BLOCK> output_ = {};
+    size_t block_fill_ = 0;
+
+    uint64_t processed_samples_ = 0;
+    uint64_t busy_us_ = 0;
+    float last_reduction_db_ = 0;
+
+    static Biquad MakeBiquad(const SpeakerEqBand& band, int sample_rate);
+    void ProcessBlock();
+};
+
+#endif // SPEAKER_DSP_H
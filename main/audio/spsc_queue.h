@@ -0,0 +1,128 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+/*
+ * Bounded lock-free single-producer / single-consumer queue.
+ *
+ * Push() may only be called from the producer task and Pop() / Reclaim() only from
+ * the consumer task. Clear() may be called from any task: it marks everything pushed
+ * so far as discarded, and the consumer releases those slots on its next Pop() or
+ * Reclaim(). Size() and Empty() never count discarded items.
+ *
+ * Indices are free-running 32-bit counters, the storage is rounded up to a power of
+ * two so that wrap-around stays correct. It holds twice the capacity, so the producer
+ * can push again right after a Clear() while the consumer still owns the discarded slots.
+ */
+template <typename T, size_t Capacity>
+class SpscQueue {
+public:
+    static_assert(Capacity > 0, "SpscQueue capacity must be positive");
+
+    SpscQueue() = default;
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    static constexpr size_t capacity() { return Capacity; }
+
+    // Producer side
+    bool Push(T&& item) {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        if (head - tail >= kStorage || head - EffectiveTail() >= Capacity) {
+            return false;
+        }
+        slots_[head & kMask] = std::move(item);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Discarded items do not count, like in Size()
+    bool Full() const {
+        uint32_t tail = EffectiveTail();
+        return head_.load(std::memory_order_acquire) - tail >= Capacity;
+    }
+
+    // Consumer side
+    bool Pop(T& item) {
+        uint32_t tail = Reclaim();
+        if (tail == head_.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(slots_[tail & kMask]);
+        slots_[tail & kMask] = T();
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Release the slots discarded by Clear(), returns the new tail
+    uint32_t Reclaim() {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        uint32_t until = discard_until_.load(std::memory_order_acquire);
+        if (static_cast<int32_t>(until - tail) <= 0) {
+            return tail;
+        }
+        while (tail != until) {
+            slots_[tail & kMask] = T();
+            ++tail;
+        }
+        tail_.store(tail, std::memory_order_release);
+        return tail;
+    }
+
+    // Any task
+    // The position of the next push
+    uint32_t Head() const {
+        return head_.load(std::memory_order_acquire);
+    }
+
+    // Items still queued ahead of a position taken with Head(), the discarded ones do not count
+    size_t CountBefore(uint32_t position) const {
+        int32_t count = static_cast<int32_t>(position - EffectiveTail());
+        return count > 0 ? count : 0;
+    }
+
+    void Clear() {
+        discard_until_.store(head_.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    size_t Size() const {
+        // Load the tail first so that a concurrent pop can never make it pass the head
+        uint32_t tail = EffectiveTail();
+        return head_.load(std::memory_order_acquire) - tail;
+    }
+
+    bool Empty() const {
+        return Size() == 0;
+    }
+
+private:
+    static constexpr size_t RoundUpPowerOfTwo(size_t n) {
+        size_t v = 1;
+        while (v < n) {
+            v <<= 1;
+        }
+        return v;
+    }
+
+    static constexpr size_t kStorage = RoundUpPowerOfTwo(Capacity * 2);
+    static constexpr uint32_t kMask = kStorage - 1;
+
+    uint32_t EffectiveTail() const {
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        uint32_t until = discard_until_.load(std::memory_order_acquire);
+        return static_cast<int32_t>(until - tail) > 0 ? until : tail;
+    }
+
+    std::array<T, kStorage> slots_ {};
+    std::atomic<uint32_t> head_ {0};
+    std::atomic<uint32_t> tail_ {0};
+    std::atomic<uint32_t> discard_until_ {0};
+};
+
+#endif // SPSC_QUEUE_H
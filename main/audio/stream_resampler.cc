@@ -0,0 +1,66 @@
+#include "stream_resampler.h"
+
+#include <esp_log.h>
+
+#define TAG "StreamResampler"
+
+StreamResampler::~StreamResampler() {
+    Close();
+}
+
+bool StreamResampler::Open(int src_rate, int dest_rate, int channels) {
+    Close();
+    esp_ae_rate_cvt_cfg_t cfg = {
+        .src_rate        = (uint32_t)src_rate,
+        .dest_rate       = (uint32_t)dest_rate,
+        .channel         = (uint8_t)channels,
+        .bits_per_sample = ESP_AUDIO_BIT16,
+        .complexity      = 2,
+        .perf_type       = ESP_AE_RATE_CVT_PERF_TYPE_SPEED,
+    };
+    auto ret = esp_ae_rate_cvt_open(&cfg, &handle_);
+    if (handle_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create resampler %d -> %d, error code: %d", src_rate, dest_rate, ret);
+        return false;
+    }
+    src_rate_ = src_rate;
+    dest_rate_ = dest_rate;
+    channels_ = channels;
+    return true;
+}
+
+void StreamResampler::Close() {
+    if (handle_ != nullptr) {
+        esp_ae_rate_cvt_close(handle_);
+        handle_ = nullptr;
+    }
+}
+
+void StreamResampler::Reset() {
+    if (handle_ != nullptr) {
+        esp_ae_rate_cvt_reset(handle_);
+    }
+}
+
+size_t StreamResampler::MaxOutputFrames(size_t input_frames) const {
+    if (handle_ == nullptr) {
+        return 0;
+    }
+    uint32_t max_frames = 0;
+    esp_ae_rate_cvt_get_max_out_sample_num(handle_, input_frames, &max_frames);
+    return max_frames;
+}
+
+size_t StreamResampler::Process(const int16_t* input, size_t input_frames, int16_t* output, size_t output_frames) {
+    if (handle_ == nullptr) {
+        return 0;
+    }
+    uint32_t actual_frames = output_frames;
+    auto ret = esp_ae_rate_cvt_process(handle_, (esp_ae_sample_t)input, input_frames,
+                                       (esp_ae_sample_t)output, &actual_frames);
+    if (ret != ESP_AE_ERR_OK) {
+        ESP_LOGE(TAG, "Failed to resample, error code: %d", ret);
+        return 0;
+    }
+    return actual_frames;
+}
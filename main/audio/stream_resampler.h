@@ -0,0 +1,45 @@
+#ifndef STREAM_RESAMPLER_H
+#define STREAM_RESAMPLER_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "esp_ae_rate_cvt.h"
+
+/*
+ * Streaming wrapper around esp_ae_rate_cvt.
+ *
+ * Process() writes straight into a caller provided buffer, so with persistent buffers
+ * on both sides the steady state never allocates. Sample counts are per channel
+ * (frames), buffers are interleaved.
+ */
+class StreamResampler {
+public:
+    StreamResampler() = default;
+    ~StreamResampler();
+    StreamResampler(const StreamResampler&) = delete;
+    StreamResampler& operator=(const StreamResampler&) = delete;
+
+    bool Open(int src_rate, int dest_rate, int channels);
+    void Close();
+    void Reset();
+
+    bool IsOpen() const { return handle_ != nullptr; }
+    int src_rate() const { return src_rate_; }
+    int dest_rate() const { return dest_rate_; }
+    int channels() const { return channels_; }
+
+    // Upper bound of the output frames produced by input_frames
+    size_t MaxOutputFrames(size_t input_frames) const;
+
+    // Returns the number of output frames written, 0 on error
+    size_t Process(const int16_t* input, size_t input_frames, int16_t* output, size_t output_frames);
+
+private:
+    esp_ae_rate_cvt_handle_t handle_ = nullptr;
+    int src_rate_ = 0;
+    int dest_rate_ = 0;
+    int channels_ = 0;
+};
+
+#endif // STREAM_RESAMPLER_H
@@ -0,0 +1,337 @@
+#include "tts_cache.h"
+#include "application.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <cstring>
+
+#define TAG "TtsCache"
+
+#define TTS_CACHE_PARTITION_LABEL "tts_cache"
+#define TTS_CACHE_MAGIC 0x31435454     // "TTC1"
+#define TTS_CACHE_SLOT_SIZE (CONFIG_TTS_CACHE_SLOT_SIZE_KB * 1024)
+// The live packets kept waiting behind a cached sentence, about 20 seconds of speech
+#define TTS_CACHE_MAX_HELD_PACKETS 320
+// The recorded sentences kept for the writer, the later ones of a long reply are not cached
+#define TTS_CACHE_MAX_PENDING_WRITES 4
+// How often the writer checks whether the reply has played out
+#define TTS_CACHE_WRITE_POLL_MS 200
+
+bool TtsCache::enabled() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Initialize();
+    return partition_ != nullptr;
+}
+
+void TtsCache::Initialize() {
+    if (initialized_) {
+        return;
+    }
+    initialized_ = true;
+    partition_ = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, TTS_CACHE_PARTITION_LABEL);
+    if (partition_ == nullptr) {
+        ESP_LOGI(TAG, "No %s partition, the replies are not cached", TTS_CACHE_PARTITION_LABEL);
+        return;
+    }
+    if (partition_->size < TTS_CACHE_SLOT_SIZE || TTS_CACHE_SLOT_SIZE % partition_->erase_size != 0) {
+        ESP_LOGE(TAG, "The %s partition does not fit slots of %d bytes", TTS_CACHE_PARTITION_LABEL, TTS_CACHE_SLOT_SIZE);
+        partition_ = nullptr;
+        return;
+    }
+
+    slots_.resize(partition_->size / TTS_CACHE_SLOT_SIZE);
+    int cached = 0;
+    for (size_t i = 0; i < slots_.size(); i++) {
+        SlotHeader header;
+        if (esp_partition_read(partition_, i * TTS_CACHE_SLOT_SIZE, &header, sizeof(header)) != ESP_OK ||
+            header.magic != TTS_CACHE_MAGIC || header.length > TTS_CACHE_SLOT_SIZE - sizeof(header)) {
+            continue;
+        }
+        header.hash[TTS_CACHE_HASH_SIZE - 1] = '\0';
+        auto& slot = slots_[i];
+        slot.hash = header.hash;
+        slot.length = header.length;
+        slot.sample_rate = header.sample_rate;
+        slot.frame_duration = header.frame_duration;
+        slot.last_used = header.sequence;
+        use_count_ = std::max(use_count_, header.sequence);
+        cached++;
+    }
+    ESP_LOGI(TAG, "%d of %u slots of %d KB cached", cached, slots_.size(), CONFIG_TTS_CACHE_SLOT_SIZE_KB);
+
+    TaskProfiles::Create(kTaskTtsCacheWriter, [](void* arg) {
+        static_cast<TtsCache*>(arg)->WriterTask();
+    }, this, &writer_task_);
+}
+
+int TtsCache::FindSlot(const std::string& hash) {
+    for (size_t i = 0; i < slots_.size(); i++) {
+        if (slots_[i].hash == hash) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool TtsCache::StartSentence(const std::string& hash) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Initialize();
+    FinishRecording(true);
+    dropping_ = false;
+    in_reply_ = true;
+    if (partition_ == nullptr || hash.empty() || hash.size() >= TTS_CACHE_HASH_SIZE) {
+        return false;
+    }
+
+    int slot = FindSlot(hash);
+    if (slot >= 0 && QueueSlot(slot)) {
+        hits_++;
+        saved_bytes_ += slots_[slot].length;
+        slots_[slot].last_used = ++use_count_;
+        dropping_ = true;
+        return true;
+    }
+    misses_++;
+    recording_hash_ = hash;
+    recording_.clear();
+    recording_sample_rate_ = 0;
+    recording_frame_duration_ = 0;
+    return false;
+}
+
+void TtsCache::EndSentence(bool complete) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    FinishRecording(complete);
+    dropping_ = false;
+    in_reply_ = false;
+    write_cv_.notify_all();
+    if (!complete) {
+        // Aborted, what the player still holds goes with the queued reply
+        queue_.clear();
+        generation_++;
+    }
+}
+
+bool TtsCache::HoldAudio(AudioStreamPacketPtr& packet) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (dropping_) {
+        return true;
+    }
+
+    if (!recording_hash_.empty()) {
+        if (recording_sample_rate_ == 0) {
+            recording_sample_rate_ = packet->sample_rate;
+            recording_frame_duration_ = packet->frame_duration;
+        }
+        size_t size = packet->payload.size();
+        if (packet->sample_rate != recording_sample_rate_ || packet->frame_duration != recording_frame_duration_ ||
+            recording_.size() + 2 + size > TTS_CACHE_SLOT_SIZE - sizeof(SlotHeader)) {
+            // Too long for a slot, or not one stream
+            recording_hash_.clear();
+            recording_.clear();
+        } else {
+            recording_.push_back(size >> 8);
+            recording_.push_back(size & 0xFF);
+            recording_.insert(recording_.end(), packet->payload.begin(), packet->payload.end());
+        }
+    }
+
+    if (!player_busy_ && queue_.empty()) {
+        return false;
+    }
+    if (queue_.size() < TTS_CACHE_MAX_HELD_PACKETS) {
+        Held held;
+        held.packet = std::move(packet);
+        queue_.push_back(std::move(held));
+        cv_.notify_all();
+    }
+    return true;
+}
+
+bool TtsCache::QueueSlot(int index) {
+    auto& slot = slots_[index];
+    SlotHeader header;
+    auto data = std::make_shared<ColdVector<uint8_t>>(slot.length);
+    size_t offset = index * TTS_CACHE_SLOT_SIZE;
+    if (esp_partition_read(partition_, offset, &header, sizeof(header)) != ESP_OK ||
+        esp_partition_read(partition_, offset + sizeof(header), data->data(), data->size()) != ESP_OK) {
+        return false;
+    }
+    uint32_t checksum = 0;
+    for (auto byte : *data) {
+        checksum += byte;
+    }
+    if (header.magic != TTS_CACHE_MAGIC || header.checksum != checksum) {
+        ESP_LOGW(TAG, "Slot %d is corrupted, dropping it", index);
+        slot = Slot();
+        return false;
+    }
+
+    if (player_task_ == nullptr) {
+        TaskProfiles::Create(kTaskTtsCachePlayer, [](void* arg) {
+            static_cast<TtsCache*>(arg)->PlayerTask();
+        }, this, &player_task_);
+    }
+    Held held;
+    held.sentence = std::move(data);
+    held.sample_rate = header.sample_rate;
+    held.frame_duration = header.frame_duration;
+    queue_.push_back(std::move(held));
+    cv_.notify_all();
+    ESP_LOGI(TAG, "Playing %s from slot %d, %lu bytes not streamed", slot.hash.c_str(), index, slot.length);
+    return true;
+}
+
+void TtsCache::PlayerTask() {
+    auto& audio_service = Application::GetInstance().GetAudioService();
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        cv_.wait(lock, [this]() { return !queue_.empty(); });
+        auto held = std::move(queue_.front());
+        queue_.pop_front();
+        player_busy_ = true;
+        uint32_t generation = generation_;
+        lock.unlock();
+
+        if (held.packet) {
+            audio_service.PushPacketToDecodeQueue(std::move(held.packet), true);
+        } else {
+            // Made into packets one at a time, the pool only has room for the queues
+            auto& data = *held.sentence;
+            size_t offset = 0;
+            while (offset + 2 <= data.size() && generation == generation_) {
+                size_t size = (data[offset] << 8) | data[offset + 1];
+                offset += 2;
+                if (offset + size > data.size()) {
+                    break;
+                }
+                auto packet = AudioStreamPacket::Create();
+                packet->sample_rate = held.sample_rate;
+                packet->frame_duration = held.frame_duration;
+                packet->payload.assign(data.begin() + offset, data.begin() + offset + size);
+                audio_service.PushPacketToDecodeQueue(std::move(packet), true);
+                offset += size;
+            }
+        }
+        lock.lock();
+        player_busy_ = !queue_.empty();
+    }
+}
+
+void TtsCache::FinishRecording(bool keep) {
+    if (recording_hash_.empty()) {
+        return;
+    }
+    std::string hash = std::move(recording_hash_);
+    recording_hash_.clear();
+    if (!keep || recording_.empty() || writer_task_ == nullptr ||
+        pending_writes_.size() >= TTS_CACHE_MAX_PENDING_WRITES) {
+        recording_.clear();
+        return;
+    }
+
+    // Written by the writer task once the reply is over
+    pending_writes_.push_back({std::move(hash), std::move(recording_), recording_sample_rate_, recording_frame_duration_});
+    recording_ = ColdVector<uint8_t>();
+    write_cv_.notify_all();
+}
+
+void TtsCache::WriterTask() {
+    auto& audio_service = Application::GetInstance().GetAudioService();
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+        write_cv_.wait(lock, [this]() { return !in_reply_ && !pending_writes_.empty(); });
+        lock.unlock();
+        // The tts stop comes while the end of the reply is still in the buffers
+        while (!audio_service.IsIdle()) {
+            vTaskDelay(pdMS_TO_TICKS(TTS_CACHE_WRITE_POLL_MS));
+        }
+        lock.lock();
+        if (in_reply_ || player_busy_) {
+            // The next reply started meanwhile
+            lock.unlock();
+            vTaskDelay(pdMS_TO_TICKS(TTS_CACHE_WRITE_POLL_MS));
+            lock.lock();
+            continue;
+        }
+        auto pending = std::move(pending_writes_.front());
+        pending_writes_.pop_front();
+        lock.unlock();
+        Write(pending.hash, pending.data, pending.sample_rate, pending.frame_duration);
+        lock.lock();
+    }
+}
+
+void TtsCache::Write(const std::string& hash, const ColdVector<uint8_t>& data, int sample_rate, int frame_duration) {
+    int index = -1;
+    uint32_t sequence;
+    {
+        // The slot is taken out of the index before its flash is erased
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (FindSlot(hash) >= 0) {
+            return;
+        }
+        for (size_t i = 0; i < slots_.size(); i++) {
+            if (slots_[i].hash.empty()) {
+                index = i;
+                break;
+            }
+            if (index < 0 || slots_[i].last_used < slots_[index].last_used) {
+                index = i;
+            }
+        }
+        slots_[index] = Slot();
+        sequence = ++use_count_;
+    }
+
+    auto start_time = esp_timer_get_time();
+    SlotHeader header = {};
+    header.magic = TTS_CACHE_MAGIC;
+    header.sequence = sequence;
+    strncpy(header.hash, hash.c_str(), sizeof(header.hash) - 1);
+    header.sample_rate = sample_rate;
+    header.frame_duration = frame_duration;
+    header.length = data.size();
+    for (auto byte : data) {
+        header.checksum += byte;
+    }
+    size_t offset = index * TTS_CACHE_SLOT_SIZE;
+    esp_err_t err = esp_partition_erase_range(partition_, offset, TTS_CACHE_SLOT_SIZE);
+    if (err == ESP_OK) {
+        err = esp_partition_write(partition_, offset + sizeof(header), data.data(), data.size());
+    }
+    if (err == ESP_OK) {
+        err = esp_partition_write(partition_, offset, &header, sizeof(header));
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write slot %d: %s", index, esp_err_to_name(err));
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& slot = slots_[index];
+    slot.hash = hash;
+    slot.length = data.size();
+    slot.sample_rate = sample_rate;
+    slot.frame_duration = frame_duration;
+    slot.last_used = sequence;
+    stores_++;
+    ESP_LOGI(TAG, "Cached %s in slot %d, %u bytes in %d ms", hash.c_str(), index, data.size(),
+        int((esp_timer_get_time() - start_time) / 1000));
+}
+
+cJSON* TtsCache::GetStatsJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto root = cJSON_CreateObject();
+    int cached = 0;
+    for (auto& slot : slots_) {
+        cached += slot.hash.empty() ? 0 : 1;
+    }
+    cJSON_AddNumberToObject(root, "slots", slots_.size());
+    cJSON_AddNumberToObject(root, "cached", cached);
+    cJSON_AddNumberToObject(root, "hits", hits_);
+    cJSON_AddNumberToObject(root, "misses", misses_);
+    cJSON_AddNumberToObject(root, "stores", stores_);
+    cJSON_AddNumberToObject(root, "saved_bytes", saved_bytes_);
+    return root;
+}
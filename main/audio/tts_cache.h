@@ -0,0 +1,142 @@
+#ifndef TTS_CACHE_H
+#define TTS_CACHE_H
+
+#include <cJSON.h>
+#include <esp_partition.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+#include "protocol.h"
+#include "memory_placement.h"
+#include "task_profile.h"
+
+// The longest content hash of a sentence kept, longer ones are not cached
+#define TTS_CACHE_HASH_SIZE 64
+
+/*
+ * Keeps the Opus packets of the replies the server sends again and again in the tts_cache
+ * partition, keyed by the content hash the server puts in the tts sentence_start message.
+ *
+ * The partition is cut into slots of CONFIG_TTS_CACHE_SLOT_SIZE_KB, one sentence each: a
+ * header with the hash and the format, then the packets as |length 2u|payload|. A sentence
+ * that is not cached is recorded while it plays and written to the least recently used slot
+ * by a writer task once the reply has stopped and played out, as erasing the flash stalls the
+ * caches the playback runs from. A cached one is read into PSRAM and played from there,
+ * the server is told to skip it and the packets of it that still come in are dropped.
+ * Only CONFIG_TTS_CACHE_SLOT_SIZE_KB of packets fit a slot, a longer sentence is not cached.
+ *
+ * The slots are rewritten whole and the header goes last, so a slot cut off by a reset is
+ * only an empty slot. The order of use is kept in memory, after a boot the slots written
+ * last count as the ones used last.
+ *
+ * While a cached sentence plays, the live packets of the sentences after it wait behind it,
+ * so the reply keeps its order. The methods may be called from the network tasks.
+ */
+class TtsCache {
+public:
+    static TtsCache& GetInstance() {
+        static TtsCache instance;
+        return instance;
+    }
+
+    bool enabled();
+    // Ends the sentence before, true if the new one plays from the cache
+    bool StartSentence(const std::string& hash);
+    // The reply ended or was aborted, a sentence recorded in full is kept
+    void EndSentence(bool complete);
+    // Takes an incoming packet that is dropped or has to wait for a cached sentence, false
+    // if the caller plays it as usual
+    bool HoldAudio(AudioStreamPacketPtr& packet);
+    // The caller owns the returned object
+    cJSON* GetStatsJson();
+
+private:
+    struct SlotHeader {
+        uint32_t magic;
+        uint32_t sequence;      // Of the write
+        char hash[TTS_CACHE_HASH_SIZE];
+        uint16_t sample_rate;
+        uint16_t frame_duration;
+        uint32_t length;        // Of the packets after the header
+        uint32_t checksum;      // Sum of the packet bytes
+    };
+
+    struct Slot {
+        std::string hash;       // Empty if the slot is free
+        uint32_t length = 0;
+        uint16_t sample_rate = 0;
+        uint16_t frame_duration = 0;
+        uint32_t last_used = 0;
+    };
+
+    // A live packet, or the packets of a cached sentence made into packets as they are played
+    struct Held {
+        AudioStreamPacketPtr packet;
+        std::shared_ptr<ColdVector<uint8_t>> sentence;
+        int sample_rate = 0;
+        int frame_duration = 0;
+    };
+
+    TtsCache() = default;
+    TtsCache(const TtsCache&) = delete;
+    TtsCache& operator=(const TtsCache&) = delete;
+
+    std::mutex mutex_;
+    bool initialized_ = false;
+    const esp_partition_t* partition_ = nullptr;
+    std::vector<Slot> slots_;
+    uint32_t use_count_ = 0;    // The sequence of the last write or hit
+
+    // The recorded sentences waiting for the reply to end, written one at a time
+    struct PendingWrite {
+        std::string hash;
+        ColdVector<uint8_t> data;
+        int sample_rate;
+        int frame_duration;
+    };
+    std::deque<PendingWrite> pending_writes_;
+    std::condition_variable write_cv_;
+    bool in_reply_ = false;     // From the first sentence_start to the tts stop or abort
+    TaskHandle_t writer_task_ = nullptr;
+
+    // The sentence being recorded
+    std::string recording_hash_;
+    ColdVector<uint8_t> recording_;
+    int recording_sample_rate_ = 0;
+    int recording_frame_duration_ = 0;
+    // The sentence started is played from the cache, its live packets are dropped
+    bool dropping_ = false;
+
+    // The packets played by the player task, in the order of the reply
+    std::deque<Held> queue_;
+    std::condition_variable cv_;
+    bool player_busy_ = false;
+    std::atomic<uint32_t> generation_ = 0;     // Changed by an abort
+    TaskHandle_t player_task_ = nullptr;
+
+    uint32_t hits_ = 0;
+    uint32_t misses_ = 0;
+    uint32_t stores_ = 0;
+    uint32_t saved_bytes_ = 0;
+
+    void Initialize();
+    int FindSlot(const std::string& hash);
+    bool QueueSlot(int slot);
+    void FinishRecording(bool keep);
+    void Write(const std::string& hash, const ColdVector<uint8_t>& data, int sample_rate, int frame_duration);
+    void PlayerTask();
+    void WriterTask();
+};
+
+#endif // TTS_CACHE_H
@@ -0,0 +1,82 @@
+#include "uplink_agc.h"
+#include "audio_dsp.h"
+
+#include <esp_timer.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+// 10 ms at 16 kHz
+#define AGC_BLOCK_SAMPLES 160
+// Per block, about 6 dB per second up and 50 dB per second down
+#define AGC_RISE_DB 0.06f
+#define AGC_FALL_DB 0.5f
+// A block below this is noise, even while the VAD still holds the speech
+#define AGC_MIN_LEVEL_DBFS -55.0f
+// The peaks stay under this after the gain
+#define AGC_PEAK_LIMIT 29000
+
+UplinkAgc::UplinkAgc(int target_dbfs, int max_gain_db)
+    : target_db_(target_dbfs), max_gain_db_(max_gain_db) {
+}
+
+void UplinkAgc::Reset() {
+    gain_db_ = 0;
+    gain_q12_ = 1 << 12;
+}
+
+void UplinkAgc::Process(int16_t* samples, size_t count, bool speech) {
+    int64_t start_us = esp_timer_get_time();
+    for (size_t offset = 0; offset < count; offset += AGC_BLOCK_SAMPLES) {
+        ProcessBlock(samples + offset, std::min<size_t>(AGC_BLOCK_SAMPLES, count - offset), speech);
+    }
+    reported_gain_db_.store(gain_db_, std::memory_order_relaxed);
+    processed_samples_.fetch_add(count, std::memory_order_relaxed);
+    busy_us_.fetch_add(esp_timer_get_time() - start_us, std::memory_order_relaxed);
+}
+
+void UplinkAgc::ProcessBlock(int16_t* samples, size_t count, bool speech) {
+    uint32_t mean_square = AudioDsp::MeanSquare(samples, count, 1);
+    float level_db = mean_square > 0 ? 10 * std::log10(mean_square / (32768.0f * 32768.0f)) : -100;
+    if (speech && level_db > AGC_MIN_LEVEL_DBFS) {
+        float wanted_db = std::clamp(target_db_ - level_db, 0.0f, max_gain_db_);
+        if (wanted_db > gain_db_) {
+            gain_db_ = std::min(wanted_db, gain_db_ + AGC_RISE_DB);
+        } else {
+            gain_db_ = std::max(wanted_db, gain_db_ - AGC_FALL_DB);
+        }
+    }
+
+    int32_t peak = 0;
+    for (size_t i = 0; i < count; i++) {
+        peak = std::max<int32_t>(peak, std::abs(samples[i]));
+    }
+    int32_t target_q12 = (int32_t)(std::pow(10.0f, gain_db_ / 20) * (1 << 12));
+    if (peak > 0 && ((int64_t)peak * target_q12 >> 12) > AGC_PEAK_LIMIT) {
+        target_q12 = std::max<int32_t>((int64_t)AGC_PEAK_LIMIT * (1 << 12) / peak, 1 << 12);
+        gain_db_ = std::min(gain_db_, 20 * std::log10(target_q12 / 4096.0f));
+    }
+
+    if (target_q12 == (1 << 12) && gain_q12_ == (1 << 12)) {
+        return;
+    }
+    int32_t step = (target_q12 - gain_q12_) / (int32_t)count;
+    int32_t gain = gain_q12_;
+    for (size_t i = 0; i < count; i++) {
+        gain += step;
+        int32_t value = (samples[i] * gain) >> 12;
+        samples[i] = (int16_t)std::clamp<int32_t>(value, INT16_MIN, INT16_MAX);
+    }
+    gain_q12_ = target_q12;
+}
+
+cJSON* UplinkAgc::GetStatsJson() const {
+    auto json = cJSON_CreateObject();
+    cJSON_AddBoolToObject(json, "enabled", true);
+    cJSON_AddNumberToObject(json, "gain_db", reported_gain_db_.load(std::memory_order_relaxed));
+    uint32_t samples = processed_samples_.load(std::memory_order_relaxed);
+    uint32_t busy_us = busy_us_.load(std::memory_order_relaxed);
+    // The busy time over the duration of the audio it processed, 16 samples per ms
+    cJSON_AddNumberToObject(json, "cpu_percent", samples > 0 ? busy_us * 100.0 * 16000 / 1e6 / samples : 0);
+    return json;
+}
@@ -0,0 +1,42 @@
+#ifndef UPLINK_AGC_H
+#define UPLINK_AGC_H
+
+#include <cJSON.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * A fixed-point AGC on the processed microphone audio, after the NS of the audio processor,
+ * enabled with CONFIG_UPLINK_AGC.
+ *
+ * The level of each 10 ms block is compared with the target, and the gain follows it only
+ * while the VAD hears speech, so a pause or the noise floor of the room is not pulled up.
+ * The gain rises slowly and falls fast, and a block whose peak would clip takes a lower gain
+ * at once. Between two blocks the gain is ramped, so it does not zipper.
+ *
+ * Used by the audio processor task only, except for GetStatsJson().
+ */
+class UplinkAgc {
+public:
+    UplinkAgc(int target_dbfs, int max_gain_db);
+
+    void Process(int16_t* samples, size_t count, bool speech);
+    void Reset();
+    // The gain and the CPU share of the samples processed, the caller owns the object
+    cJSON* GetStatsJson() const;
+
+private:
+    float target_db_;
+    float max_gain_db_;
+    float gain_db_ = 0;
+    int32_t gain_q12_ = 1 << 12;    // Of the last sample of the block before
+    std::atomic<float> reported_gain_db_ = 0;
+    std::atomic<uint32_t> processed_samples_ = 0;
+    std::atomic<uint32_t> busy_us_ = 0;
+
+    void ProcessBlock(int16_t* samples, size_t count, bool speech);
+};
+
+#endif // UPLINK_AGC_H
@@ -0,0 +1,59 @@
+#include "uplink_gate.h"
+
+#include <esp_log.h>
+
+#define TAG "UplinkGate"
+
+UplinkGate::UplinkGate(int preroll_ms, int hangover_ms, int keepalive_ms)
+    : preroll_ms_(preroll_ms), hangover_ms_(hangover_ms), keepalive_ms_(keepalive_ms),
+      dropped_(PerfCounters::GetInstance().Counter("audio.uplink_gate_dropped")),
+      keepalives_(PerfCounters::GetInstance().Counter("audio.uplink_gate_keepalives")) {
+}
+
+void UplinkGate::Process(AudioStreamPacketPtr&& packet, bool voice, const std::function<void(AudioStreamPacketPtr&&)>& send) {
+    int duration = packet->frame_duration;
+    if (voice) {
+        hangover_left_ms_ = hangover_ms_;
+    }
+    if (voice || hangover_left_ms_ > 0) {
+        if (!held_.empty()) {
+            ESP_LOGD(TAG, "Voice after %d ms of silence, %d ms of pre-roll", silence_ms_, held_ms_);
+        }
+        while (!held_.empty()) {
+            send(std::move(held_.front()));
+            held_.pop_front();
+        }
+        held_ms_ = 0;
+        silence_ms_ = 0;
+        if (!voice) {
+            hangover_left_ms_ -= duration;
+        }
+        send(std::move(packet));
+        return;
+    }
+
+    held_.push_back(std::move(packet));
+    held_ms_ += duration;
+    silence_ms_ += duration;
+    while (held_ms_ > preroll_ms_ && !held_.empty()) {
+        auto oldest = std::move(held_.front());
+        held_.pop_front();
+        held_ms_ -= oldest->frame_duration;
+        if (silence_ms_ >= keepalive_ms_ && !oldest->payload.empty()) {
+            // The TOC byte alone is a frame without data
+            oldest->payload.resize(1);
+            silence_ms_ = 0;
+            keepalives_->Add();
+            send(std::move(oldest));
+        } else {
+            dropped_->Add();
+        }
+    }
+}
+
+void UplinkGate::Reset() {
+    held_.clear();
+    held_ms_ = 0;
+    hangover_left_ms_ = 0;
+    silence_ms_ = 0;
+}
@@ -0,0 +1,43 @@
+#ifndef UPLINK_GATE_H
+#define UPLINK_GATE_H
+
+#include "protocol.h"
+#include "perf_counters.h"
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+
+/*
+ * Holds the encoded uplink back while the VAD hears no voice, enabled with CONFIG_UPLINK_VAD_GATE
+ * for the realtime listening mode, where the microphone streams the whole conversation.
+ *
+ * During a silence the newest packets are kept as pre-roll and the older ones dropped. Once the
+ * VAD hears voice the pre-roll goes out ahead of the live packets, so the onset the VAD took to
+ * notice still reaches the server, and the gate stays open for a hangover after the voice ends.
+ * Every keepalive interval of silence one dropped packet is sent cut down to its TOC byte, which
+ * an Opus decoder takes as a DTX frame and fills with comfort noise, so the server knows the
+ * stream is alive. Used by the encoder task only, the counts go to the performance counters.
+ */
+class UplinkGate {
+public:
+    UplinkGate(int preroll_ms, int hangover_ms, int keepalive_ms);
+
+    // Hands the packets to send to the callback in order
+    void Process(AudioStreamPacketPtr&& packet, bool voice, const std::function<void(AudioStreamPacketPtr&&)>& send);
+    // Drops the pre-roll, the next silence starts closed
+    void Reset();
+
+private:
+    int preroll_ms_;
+    int hangover_ms_;
+    int keepalive_ms_;
+    std::deque<AudioStreamPacketPtr> held_;
+    int held_ms_ = 0;
+    int hangover_left_ms_ = 0;
+    int silence_ms_ = 0;        // Since the last packet sent
+    PerfCounter* dropped_;
+    PerfCounter* keepalives_;
+};
+
+#endif // UPLINK_GATE_H
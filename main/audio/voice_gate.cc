@@ -0,0 +1,75 @@
+#include "voice_gate.h"
+#include "audio_dsp.h"
+
+#include <esp_log.h>
+
+#define TAG "VoiceGate"
+
+// The mean square of a chunk must be this many times the noise floor, about 6 dB
+#define VOICE_GATE_RATIO 4
+// And above this, so that a quiet room does not open the gate on every rustle
+#define VOICE_GATE_MIN_ENERGY (64 * 64)
+
+VoiceGate::VoiceGate(int preroll_ms, int hangover_ms)
+    : preroll_samples_(preroll_ms * 16), hangover_samples_(hangover_ms * 16) {
+}
+
+bool VoiceGate::Pass(std::vector<int16_t>& data, int channels) {
+    size_t frames = data.size() / channels;
+    uint32_t energy = AudioDsp::MeanSquare(data.data(), frames, channels);
+    total_chunks_++;
+
+    bool voice = energy > VOICE_GATE_MIN_ENERGY && energy > (uint64_t)noise_floor_ * VOICE_GATE_RATIO;
+    if (noise_floor_ == 0) {
+        noise_floor_ = energy;
+    } else if (!voice) {
+        noise_floor_ = noise_floor_ - noise_floor_ / 16 + energy / 16;
+    } else {
+        // Follows a lasting noise slowly, so it closes the gate again
+        noise_floor_ = noise_floor_ - noise_floor_ / 256 + energy / 256;
+    }
+
+    if (voice) {
+        hangover_left_ = hangover_samples_;
+        if (!open_) {
+            open_ = true;
+            ESP_LOGD(TAG, "Opened, energy %lu, noise floor %lu", energy, noise_floor_);
+        }
+    } else if (open_) {
+        if (hangover_left_ > frames) {
+            hangover_left_ -= frames;
+        } else {
+            open_ = false;
+            ESP_LOGI(TAG, "Closed, wake word duty cycle %d%%", duty_cycle());
+        }
+    }
+
+    if (open_) {
+        fed_chunks_++;
+        return true;
+    }
+
+    held_samples_ += frames;
+    held_.push_back(std::move(data));
+    while (held_.size() > 1 && held_samples_ - held_.front().size() / channels >= preroll_samples_) {
+        held_samples_ -= held_.front().size() / channels;
+        held_.pop_front();
+    }
+    return false;
+}
+
+void VoiceGate::Drain(const std::function<void(const std::vector<int16_t>& data)>& feed) {
+    while (!held_.empty()) {
+        feed(held_.front());
+        held_.pop_front();
+        fed_chunks_++;
+    }
+    held_samples_ = 0;
+}
+
+void VoiceGate::Reset() {
+    held_.clear();
+    held_samples_ = 0;
+    hangover_left_ = 0;
+    open_ = false;
+}
@@ -0,0 +1,47 @@
+#ifndef VOICE_GATE_H
+#define VOICE_GATE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <vector>
+
+/*
+ * A cheap energy detector in front of the wake word, enabled with CONFIG_WAKE_WORD_VOICE_GATE.
+ *
+ * Each chunk is compared with a running noise floor from the first channel. While the gate is
+ * closed the chunks are held back as pre-roll instead of being fed, so the start of the word
+ * that opened the gate still reaches the wake word. The gate stays open for a hangover after
+ * the last loud chunk. Used by the audio input task only, except for duty_cycle().
+ */
+class VoiceGate {
+public:
+    VoiceGate(int preroll_ms, int hangover_ms);
+
+    // True if the chunk is to be fed, otherwise the gate keeps it as pre-roll
+    bool Pass(std::vector<int16_t>& data, int channels);
+    // Hands the held pre-roll to the callback in order, once the gate opened
+    void Drain(const std::function<void(const std::vector<int16_t>& data)>& feed);
+    void Reset();
+
+    // The share of the chunks that were fed, in percent, may be read by any task
+    int duty_cycle() const {
+        uint32_t total = total_chunks_.load(std::memory_order_relaxed);
+        return total > 0 ? (uint64_t)fed_chunks_.load(std::memory_order_relaxed) * 100 / total : 0;
+    }
+
+private:
+    size_t preroll_samples_;
+    size_t hangover_samples_;
+    std::deque<std::vector<int16_t>> held_;
+    size_t held_samples_ = 0;
+    size_t hangover_left_ = 0;
+    uint32_t noise_floor_ = 0;
+    bool open_ = false;
+    std::atomic<uint32_t> total_chunks_ = 0;
+    std::atomic<uint32_t> fed_chunks_ = 0;
+};
+
+#endif // VOICE_GATE_H
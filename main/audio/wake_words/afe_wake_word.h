@@ -9,15 +9,15 @@
 #include <esp_nsn_models.h>
 #include <model_path.h>
 
-#include <deque>
 #include <string>
 #include <vector>
 #include <functional>
-#include <mutex>
-#include <condition_variable>
 
 #include "audio_codec.h"
 #include "wake_word.h"
+#include "wake_word_preroll.h"
+
+class AfeAudioProcessor;
 
 class AfeWakeWord : public WakeWord {
 public:
@@ -25,6 +25,9 @@ public:
     ~AfeWakeWord();
 
     bool Initialize(AudioCodec* codec, srmodel_list_t* models_list);
+    // Run on the AFE of the audio processor instead of a second one, before Initialize
+    void UseSharedAfe(AfeAudioProcessor* processor) { shared_processor_ = processor; }
+    bool IsSharedAfe() const { return shared_processor_ != nullptr; }
     void Feed(const std::vector<int16_t>& data);
     void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback);
     void Start();
@@ -36,6 +39,8 @@ public:
 
 private:
     srmodel_list_t *models_ = nullptr;
+    bool own_models_ = false;
+    bool detection_task_started_ = false;
     const esp_afe_sr_iface_t* afe_iface_ = nullptr;
     esp_afe_sr_data_t* afe_data_ = nullptr;
     char* wakenet_model_ = NULL;
@@ -44,17 +49,12 @@ private:
     std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
     AudioCodec* codec_ = nullptr;
     std::string last_detected_wake_word_;
+    AfeAudioProcessor* shared_processor_ = nullptr;
 
-    TaskHandle_t wake_word_encode_task_ = nullptr;
-    StaticTask_t* wake_word_encode_task_buffer_ = nullptr;
-    StackType_t* wake_word_encode_task_stack_ = nullptr;
-    std::deque<std::vector<int16_t>> wake_word_pcm_;
-    std::deque<std::vector<uint8_t>> wake_word_opus_;
-    std::mutex wake_word_mutex_;
-    std::condition_variable wake_word_cv_;
+    WakeWordPreroll preroll_;
 
-    void StoreWakeWordData(const int16_t* data, size_t size);
     void AudioDetectionTask();
+    void HandleResult(afe_fetch_result_t* res);
 };
 
 #endif
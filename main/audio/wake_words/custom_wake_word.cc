@@ -2,6 +2,7 @@
 #include "audio_service.h"
 #include "system_info.h"
 #include "assets.h"
+#include "model_load_meter.h"
 
 #include <esp_log.h>
 #include <esp_mn_iface.h>
@@ -11,25 +12,32 @@
 
 #define TAG "CustomWakeWord"
 
-CustomWakeWord::CustomWakeWord()
-    : wake_word_pcm_(), wake_word_opus_() {
+#if defined(CONFIG_CUSTOM_WAKE_WORD_TASK_CORE) && CONFIG_CUSTOM_WAKE_WORD_TASK_CORE >= 0
+#define CUSTOM_WAKE_WORD_TASK_CORE CONFIG_CUSTOM_WAKE_WORD_TASK_CORE
+#else
+#define CUSTOM_WAKE_WORD_TASK_CORE tskNO_AFFINITY
+#endif
+
+CustomWakeWord::CustomWakeWord() {
 }
 
 CustomWakeWord::~CustomWakeWord() {
+#if CONFIG_CUSTOM_WAKE_WORD_TASK
+    if (detection_task_ != nullptr) {
+        exiting_ = true;
+        xTaskNotifyGive(detection_task_);
+        while (!task_exited_) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+    }
+#endif
     if (multinet_model_data_ != nullptr && multinet_ != nullptr) {
         multinet_->destroy(multinet_model_data_);
         multinet_model_data_ = nullptr;
     }
 
-    if (wake_word_encode_task_stack_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_stack_);
-    }
-
-    if (wake_word_encode_task_buffer_ != nullptr) {
-        heap_caps_free(wake_word_encode_task_buffer_);
-    }
-
-    if (models_ != nullptr) {
+    // A models list passed to Initialize() belongs to the caller
+    if (models_ != nullptr && own_models_) {
         esp_srmodel_deinit(models_);
     }
 }
@@ -44,6 +52,7 @@ void CustomWakeWord::ParseWakenetModelConfig() {
         return;
     }
     cJSON* root = cJSON_ParseWithLength(static_cast<char*>(ptr), size);
+    assets.ReleaseAssetData(ptr);
     if (root == nullptr) {
         ESP_LOGE(TAG, "Failed to parse index.json");
         return;
@@ -71,8 +80,25 @@ void CustomWakeWord::ParseWakenetModelConfig() {
                     cJSON* text = cJSON_GetObjectItem(command, "text");
                     cJSON* action = cJSON_GetObjectItem(command, "action");
                     if (cJSON_IsString(command_name) && cJSON_IsString(text) && cJSON_IsString(action)) {
-                        commands_.push_back({command_name->valuestring, text->valuestring, action->valuestring});
-                        ESP_LOGI(TAG, "Command: %s, Text: %s, Action: %s", command_name->valuestring, text->valuestring, action->valuestring);
+                        Command entry = {command_name->valuestring, text->valuestring, action->valuestring};
+                        // {"action": "tool", "tool": "self.audio_speaker.set_volume", "arguments": {"volume": 80}}
+                        cJSON* tool = cJSON_GetObjectItem(command, "tool");
+                        cJSON* arguments = cJSON_GetObjectItem(command, "arguments");
+                        if (cJSON_IsString(tool)) {
+                            entry.tool = tool->valuestring;
+                        }
+                        if (cJSON_IsObject(arguments)) {
+                            char* json = cJSON_PrintUnformatted(arguments);
+                            entry.arguments = json;
+                            cJSON_free(json);
+                        }
+                        if (entry.action == "tool" && entry.tool.empty()) {
+                            ESP_LOGW(TAG, "Command %s has no tool", command_name->valuestring);
+                            continue;
+                        }
+                        ESP_LOGI(TAG, "Command: %s, Text: %s, Action: %s %s", command_name->valuestring, text->valuestring,
+                            action->valuestring, entry.tool.c_str());
+                        commands_.push_back(std::move(entry));
                     }
                 }
             }
@@ -89,6 +115,7 @@ bool CustomWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list)
     if (models_list == nullptr) {
         language_ = "cn";
         models_ = esp_srmodel_init("model");
+        own_models_ = true;
 #ifdef CONFIG_CUSTOM_WAKE_WORD
         threshold_ = CONFIG_CUSTOM_WAKE_WORD_THRESHOLD / 100.0f;
         commands_.push_back({CONFIG_CUSTOM_WAKE_WORD, CONFIG_CUSTOM_WAKE_WORD_DISPLAY, "wake"});
@@ -115,8 +142,10 @@ bool CustomWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list)
         return false;
     }
 
+    ModelLoadMeter meter;
     multinet_ = esp_mn_handle_from_name(mn_name_);
     multinet_model_data_ = multinet_->create(mn_name_, duration_);
+    meter.Finish(mn_name_);
     multinet_->set_det_threshold(multinet_model_data_, threshold_);
     esp_mn_commands_clear();
     for (int i = 0; i < commands_.size(); i++) {
@@ -125,6 +154,16 @@ bool CustomWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list)
     esp_mn_commands_update();
     
     multinet_->print_active_speech_commands(multinet_model_data_);
+
+#if CONFIG_CUSTOM_WAKE_WORD_TASK
+    if (detection_task_ == nullptr) {
+        xTaskCreatePinnedToCore([](void* arg) {
+            auto this_ = (CustomWakeWord*)arg;
+            this_->DetectionTask();
+            vTaskDelete(NULL);
+        }, "custom_wake_word", 4096, this, 3, &detection_task_, CUSTOM_WAKE_WORD_TASK_CORE);
+    }
+#endif
     return true;
 }
 
@@ -132,12 +171,19 @@ void CustomWakeWord::OnWakeWordDetected(std::function<void(const std::string& wa
     wake_word_detected_callback_ = callback;
 }
 
+void CustomWakeWord::OnCommandDetected(std::function<void(const std::string& tool, const std::string& arguments)> callback) {
+    command_detected_callback_ = callback;
+}
+
 void CustomWakeWord::Start() {
     running_ = true;
 }
 
 void CustomWakeWord::Stop() {
     running_ = false;
+#if CONFIG_CUSTOM_WAKE_WORD_TASK
+    chunks_.Clear();
+#endif
 }
 
 void CustomWakeWord::Feed(const std::vector<int16_t>& data) {
@@ -145,21 +191,56 @@ void CustomWakeWord::Feed(const std::vector<int16_t>& data) {
         return;
     }
 
-    esp_mn_state_t mn_state;
-    // If input channels is 2, we need to fetch the left channel data
-    if (codec_->input_channels() == 2) {
-        auto mono_data = std::vector<int16_t>(data.size() / 2);
-        for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
+    // With more than one input channel, fetch the first microphone
+    std::vector<int16_t> mono_data;
+    int channels = codec_->input_channels();
+    if (channels > 1) {
+        mono_data.resize(data.size() / channels);
+        for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += channels) {
             mono_data[i] = data[j];
         }
-
-        StoreWakeWordData(mono_data);
-        mn_state = multinet_->detect(multinet_model_data_, const_cast<int16_t*>(mono_data.data()));
     } else {
-        StoreWakeWordData(data);
-        mn_state = multinet_->detect(multinet_model_data_, const_cast<int16_t*>(data.data()));
+        mono_data = data;
     }
-    
+    preroll_.Store(mono_data.data(), mono_data.size());
+
+#if CONFIG_CUSTOM_WAKE_WORD_TASK
+    // A slow inference must not hold up the next I2S read, so a chunk is dropped instead
+    if (!chunks_.Push(std::move(mono_data))) {
+        dropped_chunks_++;
+        ESP_LOGW(TAG, "MultiNet is behind, %lu chunks dropped", dropped_chunks_);
+        // Also lets the task release the chunks discarded by Stop()
+        xTaskNotifyGive(detection_task_);
+        return;
+    }
+    size_t queued = chunks_.Size();
+    if (queued > max_queued_chunks_) {
+        max_queued_chunks_ = queued;
+        ESP_LOGI(TAG, "Up to %u chunks queued for MultiNet", queued);
+    }
+    xTaskNotifyGive(detection_task_);
+#else
+    Detect(mono_data.data());
+#endif
+}
+
+#if CONFIG_CUSTOM_WAKE_WORD_TASK
+void CustomWakeWord::DetectionTask() {
+    std::vector<int16_t> chunk;
+    while (!exiting_) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (chunks_.Pop(chunk)) {
+            if (running_ && !exiting_) {
+                Detect(chunk.data());
+            }
+        }
+    }
+    task_exited_ = true;
+}
+#endif
+
+void CustomWakeWord::Detect(int16_t* data) {
+    esp_mn_state_t mn_state = multinet_->detect(multinet_model_data_, data);
     if (mn_state == ESP_MN_STATE_DETECTING) {
         return;
     } else if (mn_state == ESP_MN_STATE_DETECTED) {
@@ -175,6 +256,9 @@ void CustomWakeWord::Feed(const std::vector<int16_t>& data) {
                 if (wake_word_detected_callback_) {
                     wake_word_detected_callback_(last_detected_wake_word_);
                 }
+            } else if (command.action == "tool" && command_detected_callback_) {
+                // Handled on the device, detection goes on for the next command
+                command_detected_callback_(command.tool, command.arguments);
             }
         }
         multinet_->clean(multinet_model_data_);
@@ -191,98 +275,10 @@ size_t CustomWakeWord::GetFeedSize() {
     return multinet_->get_samp_chunksize(multinet_model_data_);
 }
 
-void CustomWakeWord::StoreWakeWordData(const std::vector<int16_t>& data) {
-    // store audio data to wake_word_pcm_
-    wake_word_pcm_.push_back(data);
-    // keep about 2 seconds of data, detect duration is 30ms (sample_rate == 16000, chunksize == 512)
-    while (wake_word_pcm_.size() > 2000 / 30) {
-        wake_word_pcm_.pop_front();
-    }
-}
-
 void CustomWakeWord::EncodeWakeWordData() {
-    const size_t stack_size = 4096 * 7;
-    wake_word_opus_.clear();
-    if (wake_word_encode_task_stack_ == nullptr) {
-        wake_word_encode_task_stack_ = (StackType_t*)heap_caps_malloc(stack_size, MALLOC_CAP_SPIRAM);
-        assert(wake_word_encode_task_stack_ != nullptr);
-    }
-    if (wake_word_encode_task_buffer_ == nullptr) {
-        wake_word_encode_task_buffer_ = (StaticTask_t*)heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL);
-        assert(wake_word_encode_task_buffer_ != nullptr);
-    }
-
-    wake_word_encode_task_ = xTaskCreateStatic([](void* arg) {
-        auto this_ = (CustomWakeWord*)arg;
-        {
-            auto start_time = esp_timer_get_time();
-            // Create encoder
-            esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG();
-            void* encoder_handle = nullptr;
-            auto ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &encoder_handle);
-            if (encoder_handle == nullptr) {
-                ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
-                std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-                this_->wake_word_cv_.notify_all();
-                return;
-            }
-            // Get frame size
-            int frame_size = 0;
-            int outbuf_size = 0;
-            esp_opus_enc_get_frame_size(encoder_handle, &frame_size, &outbuf_size);
-            frame_size = frame_size / sizeof(int16_t);
-            // Encode all PCM data
-            int packets = 0;
-            std::vector<int16_t> in_buffer;
-            esp_audio_enc_in_frame_t in = {};
-            esp_audio_enc_out_frame_t out = {};
-            for (auto& pcm: this_->wake_word_pcm_) {
-                if (in_buffer.empty()) {
-                    in_buffer = std::move(pcm);
-                } else {
-                    in_buffer.reserve(in_buffer.size() + pcm.size());
-                    in_buffer.insert(in_buffer.end(), pcm.begin(), pcm.end());
-                }
-                while (in_buffer.size() >= frame_size) {
-                    std::vector<uint8_t> opus_buf(outbuf_size);
-                    in.buffer = (uint8_t *)(in_buffer.data());
-                    in.len = (uint32_t)(frame_size * sizeof(int16_t));
-                    out.buffer = opus_buf.data();
-                    out.len = outbuf_size;
-                    out.encoded_bytes = 0;
-                    ret = esp_opus_enc_process(encoder_handle, &in, &out);
-                    if (ret == ESP_AUDIO_ERR_OK) {
-                        std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-                        this_->wake_word_opus_.emplace_back(opus_buf.data(), opus_buf.data() + out.encoded_bytes);
-                        this_->wake_word_cv_.notify_all();
-                        packets++;
-                    } else {
-                        ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
-                    }
-                    in_buffer.erase(in_buffer.begin(), in_buffer.begin() + frame_size);
-                }
-            }
-            this_->wake_word_pcm_.clear();
-            // Close encoder
-            esp_opus_enc_close(encoder_handle);
-            auto end_time = esp_timer_get_time();
-            ESP_LOGI(TAG, "Encode wake word opus %d packets in %ld ms", packets, (long)((end_time - start_time) / 1000));
-
-            std::lock_guard<std::mutex> lock(this_->wake_word_mutex_);
-            this_->wake_word_opus_.push_back(std::vector<uint8_t>());
-            this_->wake_word_cv_.notify_all();
-        }
-        vTaskDelete(NULL);
-    }, "encode_wake_word", stack_size, this, 2, wake_word_encode_task_stack_, wake_word_encode_task_buffer_);
+    preroll_.Encode();
 }
 
 bool CustomWakeWord::GetWakeWordOpus(std::vector<uint8_t>& opus) {
-    std::unique_lock<std::mutex> lock(wake_word_mutex_);
-    wake_word_cv_.wait(lock, [this]() {
-        return !wake_word_opus_.empty();
-    });
-    opus.swap(wake_word_opus_.front());
-    wake_word_opus_.pop_front();
-    return !opus.empty();
+    return preroll_.GetOpus(opus);
 }
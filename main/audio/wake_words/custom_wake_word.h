@@ -1,6 +1,8 @@
 #ifndef CUSTOM_WAKE_WORD_H
 #define CUSTOM_WAKE_WORD_H
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include <esp_attr.h>
 #include <esp_mn_iface.h>
 #include <esp_mn_models.h>
@@ -10,12 +12,15 @@
 #include <string>
 #include <vector>
 #include <functional>
-#include <mutex>
-#include <condition_variable>
 #include <atomic>
 
 #include "audio_codec.h"
 #include "wake_word.h"
+#include "wake_word_preroll.h"
+#include "spsc_queue.h"
+
+// The chunks the input task may get ahead of MultiNet, about 30 ms each
+#define CUSTOM_WAKE_WORD_QUEUE_CHUNKS 8
 
 class CustomWakeWord : public WakeWord {
 public:
@@ -25,6 +30,7 @@ public:
     bool Initialize(AudioCodec* codec, srmodel_list_t* models_list);
     void Feed(const std::vector<int16_t>& data);
     void OnWakeWordDetected(std::function<void(const std::string& wake_word)> callback);
+    void OnCommandDetected(std::function<void(const std::string& tool, const std::string& arguments)> callback) override;
     void Start();
     void Stop();
     size_t GetFeedSize();
@@ -36,13 +42,16 @@ private:
     struct Command {
         std::string command;
         std::string text;
-        std::string action;
+        std::string action;     // "wake", or "tool" to call an MCP tool on the device
+        std::string tool;
+        std::string arguments;  // JSON object
     };
 
     // multinet 相关成员变量
     esp_mn_iface_t* multinet_ = nullptr;
     model_iface_data_t* multinet_model_data_ = nullptr;
     srmodel_list_t *models_ = nullptr;
+    bool own_models_ = false;
     char* mn_name_ = nullptr;
     std::string language_ = "cn";
     int duration_ = 3000;
@@ -50,20 +59,28 @@ private:
     std::deque<Command> commands_;
  
     std::function<void(const std::string& wake_word)> wake_word_detected_callback_;
+    std::function<void(const std::string& tool, const std::string& arguments)> command_detected_callback_;
     AudioCodec* codec_ = nullptr;
     std::string last_detected_wake_word_;
     std::atomic<bool> running_ = false;
 
-    TaskHandle_t wake_word_encode_task_ = nullptr;
-    StaticTask_t* wake_word_encode_task_buffer_ = nullptr;
-    StackType_t* wake_word_encode_task_stack_ = nullptr;
-    std::deque<std::vector<int16_t>> wake_word_pcm_;
-    std::deque<std::vector<uint8_t>> wake_word_opus_;
-    std::mutex wake_word_mutex_;
-    std::condition_variable wake_word_cv_;
+    WakeWordPreroll preroll_;
+
+#if CONFIG_CUSTOM_WAKE_WORD_TASK
+    // Mono chunks from the input task to the detection task
+    SpscQueue<std::vector<int16_t>, CUSTOM_WAKE_WORD_QUEUE_CHUNKS> chunks_;
+    TaskHandle_t detection_task_ = nullptr;
+    uint32_t dropped_chunks_ = 0;   // By the input task, when the queue was full
+    size_t max_queued_chunks_ = 0;
+    // The destructor stops the detection task before the model goes
+    std::atomic<bool> exiting_ = false;
+    std::atomic<bool> task_exited_ = false;
+
+    void DetectionTask();
+#endif
 
-    void StoreWakeWordData(const std::vector<int16_t>& data);
     void ParseWakenetModelConfig();
+    void Detect(int16_t* data);
 };
 
 #endif
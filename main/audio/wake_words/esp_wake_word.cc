@@ -1,4 +1,5 @@
 #include "esp_wake_word.h"
+#include "model_load_meter.h"
 #include <esp_log.h>
 
 
@@ -10,6 +11,9 @@ EspWakeWord::EspWakeWord() {
 EspWakeWord::~EspWakeWord() {
     if (wakenet_data_ != nullptr) {
         wakenet_iface_->destroy(wakenet_data_);
+    }
+    // A models list passed to Initialize() belongs to the caller
+    if (wakenet_model_ != nullptr && own_models_) {
         esp_srmodel_deinit(wakenet_model_);
     }
 }
@@ -19,6 +23,7 @@ bool EspWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list) {
 
     if (models_list == nullptr) {
         wakenet_model_ = esp_srmodel_init("model");
+        own_models_ = true;
     } else {
         wakenet_model_ = models_list;
     }
@@ -34,8 +39,10 @@ bool EspWakeWord::Initialize(AudioCodec* codec, srmodel_list_t* models_list) {
         return false;
     }
     char *model_name = wakenet_model_->model_name[0];
+    ModelLoadMeter meter;
     wakenet_iface_ = (esp_wn_iface_t*)esp_wn_handle_from_name(model_name);
     wakenet_data_ = wakenet_iface_->create(model_name, DET_MODE_95);
+    meter.Finish(model_name);
 
     int frequency = wakenet_iface_->get_samp_rate(wakenet_data_);
     int audio_chunksize = wakenet_iface_->get_samp_chunksize(wakenet_data_);
@@ -32,6 +32,7 @@ private:
     esp_wn_iface_t *wakenet_iface_ = nullptr;
     model_iface_data_t *wakenet_data_ = nullptr;
     srmodel_list_t *wakenet_model_ = nullptr;
+    bool own_models_ = false;
     AudioCodec* codec_ = nullptr;
     std::atomic<bool> running_ = false;
 
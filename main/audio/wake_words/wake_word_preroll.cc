@@ -0,0 +1,225 @@
+#include "wake_word_preroll.h"
+#include "heap_monitor.h"
+#include "audio_service.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#define TAG "WakeWordPreroll"
+
+#define PREROLL_ENCODE_TASK_STACK_SIZE (4096 * 7)
+
+#if CONFIG_WAKE_WORD_PREROLL_BACKGROUND_ENCODE
+static constexpr bool kBackgroundEncode = true;
+#else
+static constexpr bool kBackgroundEncode = false;
+#endif
+
+WakeWordPreroll::WakeWordPreroll(int duration_ms) {
+    pcm_capacity_ = kSampleRate / 1000 * duration_ms;
+    pcm_ = (int16_t*)HeapMonitor::GetInstance().Malloc(kHeapTagAudio, pcm_capacity_ * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+    if (pcm_ == nullptr) {
+        ESP_LOGW(TAG, "No PSRAM for the pre-roll buffer, using internal memory");
+        pcm_ = (int16_t*)HeapMonitor::GetInstance().Malloc(kHeapTagAudio, pcm_capacity_ * sizeof(int16_t), MALLOC_CAP_8BIT);
+    }
+    assert(pcm_ != nullptr);
+}
+
+WakeWordPreroll::~WakeWordPreroll() {
+    if (encode_task_ != nullptr) {
+        vTaskDelete(encode_task_);
+    }
+    if (encode_task_stack_ != nullptr) {
+        heap_caps_free(encode_task_stack_);
+    }
+    if (encode_task_buffer_ != nullptr) {
+        heap_caps_free(encode_task_buffer_);
+    }
+    HeapMonitor::GetInstance().Free(kHeapTagAudio, pcm_);
+}
+
+void WakeWordPreroll::Store(const int16_t* data, size_t samples) {
+    if (kBackgroundEncode && encode_task_ == nullptr) {
+        StartEncodeTask();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!kBackgroundEncode && session_encoding_) {
+        // Do not overwrite the audio being encoded, it is stopped right after detection anyway
+        return;
+    }
+    // Only the last pcm_capacity_ samples are kept
+    if (samples > pcm_capacity_) {
+        data += samples - pcm_capacity_;
+        stored_samples_ += samples - pcm_capacity_;
+        samples = pcm_capacity_;
+    }
+    size_t offset = stored_samples_ % pcm_capacity_;
+    size_t first = std::min(samples, pcm_capacity_ - offset);
+    memcpy(pcm_ + offset, data, first * sizeof(int16_t));
+    memcpy(pcm_, data + first, (samples - first) * sizeof(int16_t));
+    stored_samples_ += samples;
+    if (kBackgroundEncode) {
+        cv_.notify_all();
+    }
+}
+
+void WakeWordPreroll::Encode() {
+    if (encode_task_ == nullptr) {
+        StartEncodeTask();
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    session_active_ = true;
+    if (kBackgroundEncode) {
+        // Hand out what is already encoded, keeping a slot free for the frame in flight
+        uint64_t available = std::min<uint64_t>(packets_written_, packets_.empty() ? 0 : packets_.size() - 1);
+        packets_read_ = packets_written_ - available;
+        session_encoding_ = frame_in_flight_;
+    } else {
+        encoded_samples_ = stored_samples_ > pcm_capacity_ ? stored_samples_ - pcm_capacity_ : 0;
+        session_end_ = stored_samples_;
+        packets_read_ = packets_written_;
+        session_encoding_ = true;
+    }
+    cv_.notify_all();
+}
+
+bool WakeWordPreroll::GetOpus(std::vector<uint8_t>& opus) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!session_active_) {
+        return false;
+    }
+    cv_.wait(lock, [this]() {
+        return packets_read_ < packets_written_ || !session_encoding_;
+    });
+    if (packets_read_ < packets_written_) {
+        auto& packet = packets_[packets_read_ % packets_.size()];
+        opus.assign(packet.data.begin(), packet.data.begin() + packet.size);
+        packets_read_++;
+        return true;
+    }
+    session_active_ = false;
+    cv_.notify_all();
+    return false;
+}
+
+void WakeWordPreroll::StartEncodeTask() {
+    encode_task_stack_ = (StackType_t*)heap_caps_malloc(PREROLL_ENCODE_TASK_STACK_SIZE, MALLOC_CAP_SPIRAM);
+    assert(encode_task_stack_ != nullptr);
+    encode_task_buffer_ = (StaticTask_t*)heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL);
+    assert(encode_task_buffer_ != nullptr);
+
+    encode_task_ = xTaskCreateStatic([](void* arg) {
+        auto this_ = (WakeWordPreroll*)arg;
+        this_->EncodeTask();
+    }, "encode_wake_word", PREROLL_ENCODE_TASK_STACK_SIZE, this, 2, encode_task_stack_, encode_task_buffer_);
+}
+
+/* Wait until there is a frame to encode, returns false when an encode session has none left */
+bool WakeWordPreroll::WaitForFrame(std::unique_lock<std::mutex>& lock, int frame_size) {
+    if (kBackgroundEncode) {
+        cv_.wait(lock, [this, frame_size]() {
+            return !session_active_ && stored_samples_ - encoded_samples_ >= (uint64_t)frame_size;
+        });
+        // Skip what was overwritten while the packets were being sent
+        if (stored_samples_ - encoded_samples_ > pcm_capacity_) {
+            encoded_samples_ = stored_samples_ - pcm_capacity_;
+        }
+        return true;
+    }
+    return encoded_samples_ + frame_size <= session_end_;
+}
+
+/* Runs for the lifetime of the pre-roll, waiting for work between sessions */
+void WakeWordPreroll::EncodeTask() {
+    void* encoder_handle = nullptr;
+    int frame_size = 0;
+    int outbuf_size = 0;
+    std::vector<int16_t> frame;
+
+    while (true) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!kBackgroundEncode) {
+            cv_.wait(lock, [this]() { return session_encoding_; });
+        }
+
+        if (encoder_handle == nullptr) {
+            lock.unlock();
+            esp_opus_enc_config_t opus_enc_cfg = AS_OPUS_ENC_CONFIG();
+            auto ret = esp_opus_enc_open(&opus_enc_cfg, sizeof(esp_opus_enc_config_t), &encoder_handle);
+            lock.lock();
+            if (encoder_handle == nullptr) {
+                ESP_LOGE(TAG, "Failed to create audio encoder, error code: %d", ret);
+                session_encoding_ = false;
+                cv_.notify_all();
+                lock.unlock();
+                if (kBackgroundEncode) {
+                    vTaskDelay(pdMS_TO_TICKS(1000));
+                }
+                continue;
+            }
+            esp_opus_enc_get_frame_size(encoder_handle, &frame_size, &outbuf_size);
+            frame_size = frame_size / sizeof(int16_t);
+            frame.resize(frame_size);
+            if (packets_.empty()) {
+                // Room for the whole pre-roll, plus the frame in flight
+                packets_.resize(pcm_capacity_ / frame_size + 1);
+                for (auto& packet : packets_) {
+                    packet.data.resize(outbuf_size);
+                }
+            }
+        }
+
+        auto start_time = esp_timer_get_time();
+        int count = 0;
+        while (WaitForFrame(lock, frame_size)) {
+            size_t offset = encoded_samples_ % pcm_capacity_;
+            size_t first = std::min<size_t>(frame_size, pcm_capacity_ - offset);
+            memcpy(frame.data(), pcm_ + offset, first * sizeof(int16_t));
+            memcpy(frame.data() + first, pcm_, (frame_size - first) * sizeof(int16_t));
+            encoded_samples_ += frame_size;
+            auto& packet = packets_[packets_written_ % packets_.size()];
+            frame_in_flight_ = true;
+            lock.unlock();
+
+            esp_audio_enc_in_frame_t in = {
+                .buffer = (uint8_t *)(frame.data()),
+                .len = (uint32_t)(frame_size * sizeof(int16_t)),
+            };
+            esp_audio_enc_out_frame_t out = {
+                .buffer = packet.data.data(),
+                .len = (uint32_t)outbuf_size,
+                .encoded_bytes = 0,
+            };
+            auto ret = esp_opus_enc_process(encoder_handle, &in, &out);
+
+            lock.lock();
+            frame_in_flight_ = false;
+            if (ret == ESP_AUDIO_ERR_OK) {
+                packet.size = out.encoded_bytes;
+                packets_written_++;
+                count++;
+            } else {
+                ESP_LOGE(TAG, "Failed to encode audio, error code: %d", ret);
+            }
+            if (kBackgroundEncode && session_active_) {
+                // The frame that was in flight when the wake word was detected is the last one
+                session_encoding_ = false;
+            }
+            cv_.notify_all();
+        }
+
+        // Only an encode on demand gets here, after the last frame of the session
+        session_encoding_ = false;
+        cv_.notify_all();
+        lock.unlock();
+        esp_opus_enc_close(encoder_handle);
+        encoder_handle = nullptr;
+        ESP_LOGI(TAG, "Encode wake word opus %d packets in %ld ms", count, (long)((esp_timer_get_time() - start_time) / 1000));
+    }
+}
@@ -0,0 +1,68 @@
+#ifndef WAKE_WORD_PREROLL_H
+#define WAKE_WORD_PREROLL_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <cstdint>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+/*
+ * The last seconds of 16kHz mono PCM before a wake word, sent to the server as Opus.
+ *
+ * The PCM is kept in a fixed circular buffer in PSRAM and the packets in fixed slots,
+ * so storing audio while waiting for the wake word never touches the heap.
+ *
+ * By default Encode() starts encoding the buffered PCM in a background task, and
+ * GetOpus() returns the packets as they come out. With
+ * CONFIG_WAKE_WORD_PREROLL_BACKGROUND_ENCODE the task encodes while the audio is stored,
+ * so the packets are ready as soon as the wake word is detected.
+ */
+class WakeWordPreroll {
+public:
+    explicit WakeWordPreroll(int duration_ms = 2000);
+    ~WakeWordPreroll();
+
+    // Called from the detection task
+    void Store(const int16_t* data, size_t samples);
+    // Start handing out the packets of the audio stored so far
+    void Encode();
+    // Blocks until the next packet is ready, returns false after the last one
+    bool GetOpus(std::vector<uint8_t>& opus);
+
+private:
+    static constexpr int kSampleRate = 16000;
+
+    struct Packet {
+        std::vector<uint8_t> data;
+        size_t size = 0;
+    };
+
+    int16_t* pcm_ = nullptr;
+    size_t pcm_capacity_ = 0;
+    // Sample and packet positions only grow, the buffers are indexed modulo their size
+    uint64_t stored_samples_ = 0;
+    uint64_t encoded_samples_ = 0;
+    std::vector<Packet> packets_;
+    uint64_t packets_written_ = 0;
+    uint64_t packets_read_ = 0;
+
+    bool session_active_ = false;   // Between Encode() and the last GetOpus()
+    bool session_encoding_ = false; // The encoder still has PCM of the session to go through
+    bool frame_in_flight_ = false;
+    uint64_t session_end_ = 0;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    TaskHandle_t encode_task_ = nullptr;
+    StaticTask_t* encode_task_buffer_ = nullptr;
+    StackType_t* encode_task_stack_ = nullptr;
+
+    void StartEncodeTask();
+    void EncodeTask();
+    bool WaitForFrame(std::unique_lock<std::mutex>& lock, int frame_size);
+};
+
+#endif // WAKE_WORD_PREROLL_H
@@ -1,4 +1,14 @@
 #include "adc_battery_monitor.h"
+#include "wakeup_coalescer.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/timers.h>
+
+#define TAG "AdcBatteryMonitor"
+
+// The capacity moves by a percent in minutes, a new charging state reads it again at once
+#define BATTERY_LEVEL_CACHE_US (30 * 1000 * 1000LL)
 
 AdcBatteryMonitor::AdcBatteryMonitor(adc_unit_t adc_unit, adc_channel_t adc_channel, float upper_resistor, float lower_resistor, gpio_num_t charging_pin)
     : charging_pin_(charging_pin) {
@@ -10,7 +20,7 @@ AdcBatteryMonitor::AdcBatteryMonitor(adc_unit_t adc_unit, adc_channel_t adc_chan
             .mode = GPIO_MODE_INPUT,
             .pull_up_en = GPIO_PULLUP_DISABLE,
             .pull_down_en = GPIO_PULLDOWN_DISABLE,
-            .intr_type = GPIO_INTR_DISABLE,
+            .intr_type = GPIO_INTR_ANYEDGE,
         };
         ESP_ERROR_CHECK(gpio_config(&gpio_cfg));
     }
@@ -40,28 +50,45 @@ AdcBatteryMonitor::AdcBatteryMonitor(adc_unit_t adc_unit, adc_channel_t adc_chan
         adc_cfg.charging_detect_user_data = nullptr;
     }
     adc_battery_estimation_handle_ = adc_battery_estimation_create(&adc_cfg);
+    is_charging_ = IsCharging();
 
-    // Initialize timer
-    esp_timer_create_args_t timer_cfg = {
-        .callback = [](void *arg) {
-            AdcBatteryMonitor *self = (AdcBatteryMonitor *)arg;
-            self->CheckBatteryStatus();
-        },
-        .arg = this,
-        .name = "adc_battery_monitor",
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&timer_cfg, &timer_handle_));
-    ESP_ERROR_CHECK(esp_timer_start_periodic(timer_handle_, 1000000));
+    if (charging_pin_ != GPIO_NUM_NC) {
+        // The service may have been installed by another driver already
+        esp_err_t err = gpio_install_isr_service(0);
+        if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+            ESP_LOGE(TAG, "Failed to install the GPIO ISR service: %s", esp_err_to_name(err));
+        }
+        ESP_ERROR_CHECK(gpio_isr_handler_add(charging_pin_, OnChargingPinEdge, this));
+        return;
+    }
+
+    // Checked in the wake windows of the other periodic work
+    auto& coalescer = WakeupCoalescer::GetInstance();
+    job_ = coalescer.Add("battery", 1000, [this](int periods) {
+        CheckBatteryStatus();
+    });
+    coalescer.Start(job_);
+}
+
+void IRAM_ATTR AdcBatteryMonitor::OnChargingPinEdge(void* arg) {
+    BaseType_t woken = pdFALSE;
+    // A bouncing edge queues a few checks, each of them compares with the last state
+    xTimerPendFunctionCallFromISR([](void* arg, uint32_t) {
+        ((AdcBatteryMonitor*)arg)->CheckBatteryStatus();
+    }, arg, 0, &woken);
+    portYIELD_FROM_ISR(woken);
 }
 
 AdcBatteryMonitor::~AdcBatteryMonitor() {
+    if (charging_pin_ != GPIO_NUM_NC) {
+        gpio_isr_handler_remove(charging_pin_);
+    }
     if (adc_battery_estimation_handle_) {
         ESP_ERROR_CHECK(adc_battery_estimation_destroy(adc_battery_estimation_handle_));
     }
     
-    if (timer_handle_) {
-        esp_timer_stop(timer_handle_);
-        esp_timer_delete(timer_handle_);
+    if (job_ >= 0) {
+        WakeupCoalescer::GetInstance().Remove(job_);
     }
 }
 
@@ -93,12 +120,18 @@ uint8_t AdcBatteryMonitor::GetBatteryLevel() {
         return 100;
     }
     
+    int64_t now = esp_timer_get_time();
+    if (battery_level_time_us_ != 0 && now - battery_level_time_us_ < BATTERY_LEVEL_CACHE_US) {
+        return battery_level_;
+    }
     float capacity = 0;
     esp_err_t err = adc_battery_estimation_get_capacity(adc_battery_estimation_handle_, &capacity);
     if (err != ESP_OK) {
         return 100; // 出错时返回默认值
     }
-    return (uint8_t)capacity;
+    battery_level_ = (uint8_t)capacity;
+    battery_level_time_us_ = now;
+    return battery_level_;
 }
 
 void AdcBatteryMonitor::OnChargingStatusChanged(std::function<void(bool)> callback) {
@@ -109,6 +142,7 @@ void AdcBatteryMonitor::CheckBatteryStatus() {
     bool new_charging_status = IsCharging();
     if (new_charging_status != is_charging_) {
         is_charging_ = new_charging_status;
+        battery_level_time_us_ = 0;
         if (on_charging_status_changed_) {
             on_charging_status_changed_(is_charging_);
         }
@@ -6,6 +6,14 @@
 #include <adc_battery_estimation.h>
 #include <esp_timer.h>
 
+/*
+ * With a charging pin the charging state follows the edges of the pin, no polling: the interrupt
+ * defers the check to the FreeRTOS timer task, where the callback runs. Without one the state is
+ * estimated from the voltage, which needs the periodic samples.
+ *
+ * The level is read from the ADC on demand and kept for a while, the status bar asks for it
+ * far more often than it changes.
+ */
 class AdcBatteryMonitor {
 public:
     AdcBatteryMonitor(adc_unit_t adc_unit, adc_channel_t adc_channel, float upper_resistor, float lower_resistor, gpio_num_t charging_pin = GPIO_NUM_NC);
@@ -20,10 +28,13 @@ public:
 private:
     gpio_num_t charging_pin_;
     adc_battery_estimation_handle_t adc_battery_estimation_handle_ = nullptr;
-    esp_timer_handle_t timer_handle_ = nullptr;
+    int job_ = -1;
     bool is_charging_ = false;
+    uint8_t battery_level_ = 0;
+    int64_t battery_level_time_us_ = 0;
     std::function<void(bool)> on_charging_status_changed_;
 
+    static void OnChargingPinEdge(void* arg);
     void CheckBatteryStatus();
 };
 
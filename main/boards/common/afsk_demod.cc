@@ -1,6 +1,7 @@
 #include "afsk_demod.h"
 #include <cstring>
 #include <algorithm>
+#include <limits>
 #include "esp_log.h"
 #include "display.h"
 #include "ssid_manager.h"
@@ -12,6 +13,8 @@
 namespace audio_wifi_config
 {
     static const char *kLogTag = "AUDIO_WIFI_CONFIG";
+    // Fraction bits of the fixed point Goertzel coefficient
+    static const int kGoertzelFractionBits = 14;
 
     void ReceiveWifiCredentialsFromAudio(Application *app,
                                         WifiManager *wifi_manager,
@@ -22,6 +25,9 @@ namespace audio_wifi_config
         const int kInputSampleRate = 16000;                                    // Input sampling rate
         const float kDownsampleStep = static_cast<float>(kInputSampleRate) / static_cast<float>(kAudioSampleRate); // Downsampling step
         std::vector<int16_t> audio_data;
+        // Reused for every read, so the loop does not allocate
+        std::vector<int16_t> downsampled_data;
+        std::vector<float> probabilities;
         AudioSignalProcessor signal_processor(kAudioSampleRate, kMarkFrequency, kSpaceFrequency, kBitRate, kWindowSize);
         AudioDataBuffer data_buffer;
 
@@ -42,35 +48,32 @@ namespace audio_wifi_config
             }
 
             if (input_channels == 2) { // 如果是双声道输入，转换为单声道
-                auto mono_data = std::vector<int16_t>(audio_data.size() / 2);
-                for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-                    mono_data[i] = audio_data[j];
+                size_t mono_size = audio_data.size() / 2;
+                for (size_t i = 0, j = 0; i < mono_size; ++i, j += 2) {
+                    audio_data[i] = audio_data[j];
                 }
-                audio_data = std::move(mono_data);
+                audio_data.resize(mono_size);
             }
             
             // Downsample the audio data
-            std::vector<float> downsampled_data;
+            downsampled_data.clear();
             size_t last_index = 0;
 
             if (kDownsampleStep > 1.0f) {
-                downsampled_data.reserve(audio_data.size() / static_cast<size_t>(kDownsampleStep));
                 for (size_t i = 0; i < audio_data.size(); ++i) {
                     size_t sample_index = static_cast<size_t>(i / kDownsampleStep);
                     if ((sample_index + 1) > last_index) {
-                        downsampled_data.push_back(static_cast<float>(audio_data[i]));
+                        downsampled_data.push_back(audio_data[i]);
                         last_index = sample_index + 1;
                     }
                 }
             } else {
-                downsampled_data.reserve(audio_data.size());
-                for (int16_t sample : audio_data) {
-                    downsampled_data.push_back(static_cast<float>(sample));
-                }
+                downsampled_data.assign(audio_data.begin(), audio_data.end());
             }
             
             // Process audio samples to get probability data
-            auto probabilities = signal_processor.ProcessAudioSamples(downsampled_data);
+            probabilities.clear();
+            signal_processor.ProcessAudioSamples(downsampled_data.data(), downsampled_data.size(), probabilities);
             
             // Feed probability data to the data buffer
             if (data_buffer.ProcessProbabilityData(probabilities, 0.5f)) {
@@ -119,46 +122,36 @@ namespace audio_wifi_config
     // FrequencyDetector implementation
     FrequencyDetector::FrequencyDetector(float frequency, size_t window_size)
         : frequency_(frequency), window_size_(window_size) {
-        frequency_bin_ = std::floor(frequency_ * static_cast<float>(window_size_));
-        angular_frequency_ = 2.0f * M_PI * frequency_;
-        cos_coefficient_ = std::cos(angular_frequency_);
-        sin_coefficient_ = std::sin(angular_frequency_);
-        filter_coefficient_ = 2.0f * cos_coefficient_;
-
-        // Initialize state buffer
-        state_buffer_.push_back(0.0f);
-        state_buffer_.push_back(0.0f);
+        float angular_frequency = 2.0f * M_PI * frequency_;
+        cos_coefficient_ = std::cos(angular_frequency);
+        sin_coefficient_ = std::sin(angular_frequency);
+        filter_coefficient_ = static_cast<int32_t>(std::lround(2.0f * cos_coefficient_ * (1 << kGoertzelFractionBits)));
     }
 
     void FrequencyDetector::Reset() {
-        state_buffer_.clear();
-        state_buffer_.push_back(0.0f);
-        state_buffer_.push_back(0.0f);
+        state_1_ = 0;
+        state_2_ = 0;
     }
 
-    void FrequencyDetector::ProcessSample(float sample) {
-        if (state_buffer_.size() < 2) {
-            return;
+    void FrequencyDetector::ProcessBlock(const int16_t *samples, size_t count) {
+        // The state stays in registers for the whole block, a window of full scale samples
+        // stays far below the 32 bit range, the product is taken in 64 bits
+        int32_t s_minus_1 = state_1_;
+        int32_t s_minus_2 = state_2_;
+        const int32_t coefficient = filter_coefficient_;
+        for (size_t i = 0; i < count; ++i) {
+            int32_t s_current = samples[i] +
+                static_cast<int32_t>((static_cast<int64_t>(coefficient) * s_minus_1) >> kGoertzelFractionBits) - s_minus_2;
+            s_minus_2 = s_minus_1;
+            s_minus_1 = s_current;
         }
-
-        float s_minus_2 = state_buffer_.front();  // S[-2]
-        state_buffer_.pop_front();
-        float s_minus_1 = state_buffer_.front();  // S[-1]
-        state_buffer_.pop_front();
-
-        float s_current = sample + filter_coefficient_ * s_minus_1 - s_minus_2;
-
-        state_buffer_.push_back(s_minus_1);  // Put S[-1] back
-        state_buffer_.push_back(s_current);  // Add new S[0]
+        state_1_ = s_minus_1;
+        state_2_ = s_minus_2;
     }
 
     float FrequencyDetector::GetAmplitude() const {
-        if (state_buffer_.size() < 2) {
-            return 0.0f;
-        }
-
-        float s_minus_1 = state_buffer_[1];                      // S[-1]
-        float s_minus_2 = state_buffer_[0];                      // S[-2]
+        float s_minus_1 = static_cast<float>(state_1_);          // S[-1]
+        float s_minus_2 = static_cast<float>(state_2_);          // S[-2]
         float real_part = cos_coefficient_ * s_minus_1 - s_minus_2;  // Real part
         float imaginary_part = sin_coefficient_ * s_minus_1;         // Imaginary part
 
@@ -169,57 +162,51 @@ namespace audio_wifi_config
     // AudioSignalProcessor implementation
     AudioSignalProcessor::AudioSignalProcessor(size_t sample_rate, size_t mark_frequency, size_t space_frequency,
                                              size_t bit_rate, size_t window_size)
-        : input_buffer_size_(window_size), output_sample_count_(0) {
+        : input_buffer_(window_size, 0), input_buffer_size_(window_size), input_position_(0), input_count_(0),
+          output_sample_count_(0),
+          mark_detector_(static_cast<float>(mark_frequency) / static_cast<float>(sample_rate), window_size),
+          space_detector_(static_cast<float>(space_frequency) / static_cast<float>(sample_rate), window_size) {
         if (sample_rate % bit_rate != 0) {
             // On ESP32 we can continue execution, but log the error
             ESP_LOGW(kLogTag, "Sample rate %zu is not divisible by bit rate %zu", sample_rate, bit_rate);
         }
 
-        float normalized_mark_freq = static_cast<float>(mark_frequency) / static_cast<float>(sample_rate);
-        float normalized_space_freq = static_cast<float>(space_frequency) / static_cast<float>(sample_rate);
-
-        mark_detector_ = std::make_unique<FrequencyDetector>(normalized_mark_freq, window_size);
-        space_detector_ = std::make_unique<FrequencyDetector>(normalized_space_freq, window_size);
-
         samples_per_bit_ = sample_rate / bit_rate;  // Number of samples per bit
     }
 
-    std::vector<float> AudioSignalProcessor::ProcessAudioSamples(const std::vector<float> &samples) {
-        std::vector<float> result;
-
-        for (float sample : samples) {
-            if (input_buffer_.size() < input_buffer_size_) {
-                input_buffer_.push_back(sample);  // Just add, don't process yet
-            } else {
-                // Input buffer is full, process the data
-                input_buffer_.pop_front();   // Remove oldest sample
-                input_buffer_.push_back(sample);  // Add new sample
-                output_sample_count_++;
-
-                if (output_sample_count_ >= samples_per_bit_) {
-                    // Process all samples in the window using Goertzel algorithm
-                    for (float window_sample : input_buffer_) {
-                        mark_detector_->ProcessSample(window_sample);
-                        space_detector_->ProcessSample(window_sample);
-                    }
-
-                    float mark_amplitude = mark_detector_->GetAmplitude();   // Mark amplitude
-                    float space_amplitude = space_detector_->GetAmplitude(); // Space amplitude
-
-                    // Avoid division by zero
-                    float mark_probability = mark_amplitude / 
-                                           (space_amplitude + mark_amplitude + std::numeric_limits<float>::epsilon());
-                    result.push_back(mark_probability);
-
-                    // Reset detector windows
-                    mark_detector_->Reset();
-                    space_detector_->Reset();
-                    output_sample_count_ = 0;  // Reset output counter
-                }
+    void AudioSignalProcessor::ProcessAudioSamples(const int16_t *samples, size_t count, std::vector<float> &probabilities) {
+        for (size_t i = 0; i < count; ++i) {
+            input_buffer_[input_position_] = samples[i];
+            input_position_ = (input_position_ + 1) % input_buffer_size_;
+            if (input_count_ < input_buffer_size_) {
+                input_count_++;  // Just add, don't process until the window is full once
+                continue;
+            }
+            output_sample_count_++;
+
+            if (output_sample_count_ >= samples_per_bit_) {
+                // Process the window, oldest sample first, in the two runs of the ring buffer
+                const int16_t *oldest = input_buffer_.data() + input_position_;
+                size_t tail = input_buffer_size_ - input_position_;
+                mark_detector_.ProcessBlock(oldest, tail);
+                mark_detector_.ProcessBlock(input_buffer_.data(), input_position_);
+                space_detector_.ProcessBlock(oldest, tail);
+                space_detector_.ProcessBlock(input_buffer_.data(), input_position_);
+
+                float mark_amplitude = mark_detector_.GetAmplitude();   // Mark amplitude
+                float space_amplitude = space_detector_.GetAmplitude(); // Space amplitude
+
+                // Avoid division by zero
+                float mark_probability = mark_amplitude / 
+                                       (space_amplitude + mark_amplitude + std::numeric_limits<float>::epsilon());
+                probabilities.push_back(mark_probability);
+
+                // Reset detector windows
+                mark_detector_.Reset();
+                space_detector_.Reset();
+                output_sample_count_ = 0;  // Reset output counter
             }
         }
-
-        return result;
     }
 
     // AudioDataBuffer implementation
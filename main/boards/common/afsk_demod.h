@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <vector>
 #include <deque>
 #include <string>
@@ -25,18 +26,21 @@ namespace audio_wifi_config
     /**
      * Goertzel algorithm implementation for single frequency detection
      * Used to detect specific audio frequencies in the AFSK demodulation process
+     *
+     * Fixed point, so it keeps up on the chips without an FPU: the 16 bit samples go through
+     * a Q14 coefficient into 32 bit state, which a block keeps in registers. Only the amplitude
+     * at the end of a window is computed in float.
      */
     class FrequencyDetector
     {
     private:
         float frequency_;              // Target frequency (normalized, i.e., f / fs)
         size_t window_size_;           // Window size for analysis
-        float frequency_bin_;          // Frequency bin
-        float angular_frequency_;      // Angular frequency
         float cos_coefficient_;        // cos(w)
         float sin_coefficient_;        // sin(w)
-        float filter_coefficient_;     // 2 * cos(w)
-        std::deque<float> state_buffer_;  // Circular buffer for storing S[-1] and S[-2]
+        int32_t filter_coefficient_;   // 2 * cos(w) in Q14
+        int32_t state_1_ = 0;          // S[-1]
+        int32_t state_2_ = 0;          // S[-2]
 
     public:
         /**
@@ -52,10 +56,11 @@ namespace audio_wifi_config
         void Reset();
 
         /**
-         * Process one audio sample
-         * @param sample Input audio sample
+         * Process a block of audio samples
+         * @param samples Input audio samples
+         * @param count Number of samples
          */
-        void ProcessSample(float sample);
+        void ProcessBlock(const int16_t *samples, size_t count);
 
         /**
          * Calculate current amplitude
@@ -71,12 +76,14 @@ namespace audio_wifi_config
     class AudioSignalProcessor
     {
     private:
-        std::deque<float> input_buffer_;             // Input sample buffer
+        std::vector<int16_t> input_buffer_;          // Ring buffer of the last window of samples
         size_t input_buffer_size_;                   // Input buffer size = window size
+        size_t input_position_;                      // Where the next sample goes, the oldest one
+        size_t input_count_;                         // Samples in the ring buffer
         size_t output_sample_count_;                 // Output sample counter
         size_t samples_per_bit_;                     // Samples per bit threshold
-        std::unique_ptr<FrequencyDetector> mark_detector_;   // Mark frequency detector
-        std::unique_ptr<FrequencyDetector> space_detector_;  // Space frequency detector
+        FrequencyDetector mark_detector_;            // Mark frequency detector
+        FrequencyDetector space_detector_;           // Space frequency detector
 
     public:
         /**
@@ -92,10 +99,11 @@ namespace audio_wifi_config
 
         /**
          * Process input audio samples
-         * @param samples Input audio sample vector
-         * @return Vector of Mark probability values (0.0 to 1.0)
+         * @param samples Input audio samples
+         * @param count Number of samples
+         * @param probabilities Appended with the Mark probability values (0.0 to 1.0)
          */
-        std::vector<float> ProcessAudioSamples(const std::vector<float> &samples);
+        void ProcessAudioSamples(const int16_t *samples, size_t count, std::vector<float> &probabilities);
     };
 
     /**
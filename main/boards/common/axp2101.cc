@@ -3,14 +3,75 @@
 #include "display.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
 
 #define TAG "Axp2101"
 
+#define AXP2101_REG_STATUS2       0x01
+#define AXP2101_REG_IRQ_ENABLE0   0x40
+#define AXP2101_REG_IRQ_STATUS0   0x48
+#define AXP2101_REG_BATTERY_LEVEL 0xA4
+
+// The gauge reports a new level, VBUS and battery plugged or removed, charging started or done
+#define AXP2101_IRQ_ENABLE0_GAUGE_NEW_SOC 0b00010000
+#define AXP2101_IRQ_ENABLE1_PLUG          0b11110000
+#define AXP2101_IRQ_ENABLE2_CHARGING      0b00011000
+
+// An event lost between the clear and the read still shows within this
+#define AXP2101_IRQ_REFRESH_US (60 * 1000 * 1000LL)
+
 Axp2101::Axp2101(i2c_master_bus_handle_t i2c_bus, uint8_t addr) : I2cDevice(i2c_bus, addr) {
 }
 
+void Axp2101::EnableIrq(gpio_num_t irq_pin) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    WriteReg(AXP2101_REG_IRQ_ENABLE0, ReadReg(AXP2101_REG_IRQ_ENABLE0) | AXP2101_IRQ_ENABLE0_GAUGE_NEW_SOC);
+    WriteReg(AXP2101_REG_IRQ_ENABLE0 + 1, ReadReg(AXP2101_REG_IRQ_ENABLE0 + 1) | AXP2101_IRQ_ENABLE1_PLUG);
+    WriteReg(AXP2101_REG_IRQ_ENABLE0 + 2, ReadReg(AXP2101_REG_IRQ_ENABLE0 + 2) | AXP2101_IRQ_ENABLE2_CHARGING);
+
+    // The line is open drain and active low
+    gpio_config_t config = {
+        .pin_bit_mask = 1ULL << irq_pin,
+        .mode = GPIO_MODE_INPUT,
+        .pull_up_en = GPIO_PULLUP_ENABLE,
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .intr_type = GPIO_INTR_NEGEDGE,
+    };
+    ESP_ERROR_CHECK(gpio_config(&config));
+    esp_err_t err = gpio_install_isr_service(0);
+    if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+        ESP_LOGE(TAG, "Failed to install the GPIO ISR service: %s", esp_err_to_name(err));
+        return;
+    }
+    ESP_ERROR_CHECK(gpio_isr_handler_add(irq_pin, OnIrq, this));
+    irq_pin_ = irq_pin;
+    irq_pending_ = true;
+    ESP_LOGI(TAG, "IRQ on GPIO %d", irq_pin);
+}
+
+void IRAM_ATTR Axp2101::OnIrq(void* arg) {
+    ((Axp2101*)arg)->irq_pending_ = true;
+}
+
+uint8_t Axp2101::ReadStatus() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (irq_pin_ == GPIO_NUM_NC) {
+        return ReadReg(AXP2101_REG_STATUS2);
+    }
+    int64_t now = esp_timer_get_time();
+    if (irq_pending_.exchange(false) || now - refresh_time_us_ >= AXP2101_IRQ_REFRESH_US) {
+        // Cleared before the read, so an event after it pulls the line low again
+        static const uint8_t kClearAll[3] = {0xFF, 0xFF, 0xFF};
+        WriteRegs(AXP2101_REG_IRQ_STATUS0, kClearAll, sizeof(kClearAll));
+        status_ = ReadReg(AXP2101_REG_STATUS2);
+        battery_level_ = ReadReg(AXP2101_REG_BATTERY_LEVEL);
+        refresh_time_us_ = now;
+    }
+    return status_;
+}
+
 int Axp2101::GetBatteryCurrentDirection() {
-    return (ReadReg(0x01) & 0b01100000) >> 5;
+    return (ReadStatus() & 0b01100000) >> 5;
 }
 
 bool Axp2101::IsCharging() {
@@ -22,12 +83,17 @@ bool Axp2101::IsDischarging() {
 }
 
 bool Axp2101::IsChargingDone() {
-    uint8_t value = ReadReg(0x01);
+    uint8_t value = ReadStatus();
     return (value & 0b00000111) == 0b00000100;
 }
 
 int Axp2101::GetBatteryLevel() {
-    return ReadReg(0xA4);
+    if (irq_pin_ == GPIO_NUM_NC) {
+        return ReadReg(AXP2101_REG_BATTERY_LEVEL);
+    }
+    ReadStatus();
+    std::lock_guard<std::mutex> lock(mutex_);
+    return battery_level_;
 }
 
 float Axp2101::GetTemperature() {
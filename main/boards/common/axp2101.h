@@ -3,6 +3,10 @@
 
 #include "i2c_device.h"
 
+#include <driver/gpio.h>
+#include <atomic>
+#include <mutex>
+
 class Axp2101 : public I2cDevice {
 public:
     Axp2101(i2c_master_bus_handle_t i2c_bus, uint8_t addr);
@@ -13,7 +17,23 @@ public:
     float GetTemperature();
     void PowerOff();
 
+    /*
+     * For a board with the IRQ pin of the PMIC wired: the charger, VBUS, battery and fuel gauge
+     * events pull it low, and the status and the level are then read once on the next call
+     * instead of over I2C on every one. Without it every call reads the registers.
+     */
+    void EnableIrq(gpio_num_t irq_pin);
+
 private:
+    std::mutex mutex_;
+    gpio_num_t irq_pin_ = GPIO_NUM_NC;
+    std::atomic<bool> irq_pending_ = false;
+    uint8_t status_ = 0;
+    int battery_level_ = 0;
+    int64_t refresh_time_us_ = 0;
+
+    static void OnIrq(void* arg);
+    uint8_t ReadStatus();
     int GetBatteryCurrentDirection();
 };
 
@@ -1,11 +1,17 @@
 #include "backlight.h"
 #include "settings.h"
+#include "mcp_server.h"
 
 #include <esp_log.h>
+#include <esp_attr.h>
 #include <driver/ledc.h>
+#include <cstdlib>
 
 #define TAG "Backlight"
 
+// The transition timer steps one percent per period
+#define BACKLIGHT_STEP_MS 5
+
 
 Backlight::Backlight() {
     // 创建背光渐变定时器
@@ -58,11 +64,23 @@ void Backlight::SetBrightness(uint8_t brightness, bool permanent) {
     }
 
     target_brightness_ = brightness;
+    McpServer::InvalidateCachedResults();
+    int duration_ms = abs(target_brightness_ - brightness_) * BACKLIGHT_STEP_MS;
+    if (transition_timer_ != nullptr) {
+        esp_timer_stop(transition_timer_);
+    }
+    // 硬件渐变不占用 CPU，brightness_ 直接记为目标亮度
+    if (StartFade(brightness, duration_ms)) {
+        brightness_ = brightness;
+        ESP_LOGI(TAG, "Fade brightness to %d in %d ms", brightness, duration_ms);
+        return;
+    }
+
     step_ = (target_brightness_ > brightness_) ? 1 : -1;
 
     if (transition_timer_ != nullptr) {
         // 启动定时器，每 5ms 更新一次
-        esp_timer_start_periodic(transition_timer_, 5 * 1000);
+        esp_timer_start_periodic(transition_timer_, BACKLIGHT_STEP_MS * 1000);
     }
     ESP_LOGI(TAG, "Set brightness to %d", brightness);
 }
@@ -106,12 +124,58 @@ PwmBacklight::PwmBacklight(gpio_num_t pin, bool output_invert, uint32_t freq_hz)
         }
     };
     ESP_ERROR_CHECK(ledc_channel_config(&backlight_channel));
+
+#if CONFIG_BACKLIGHT_HARDWARE_FADE
+    // The fade service may already be installed by another LEDC user
+    esp_err_t err = ledc_fade_func_install(0);
+    if (err == ESP_OK || err == ESP_ERR_INVALID_STATE) {
+        ledc_cbs_t callbacks = {
+            .fade_cb = OnFadeEnd,
+        };
+        fade_installed_ = ledc_cb_register(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, &callbacks, this) == ESP_OK;
+    }
+    if (!fade_installed_) {
+        ESP_LOGW(TAG, "LEDC fade not available, stepping the brightness in software");
+    }
+#endif
 }
 
 PwmBacklight::~PwmBacklight() {
+#if SOC_LEDC_SUPPORT_FADE_STOP
+    if (fading_.load()) {
+        ledc_fade_stop(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0);
+    }
+#endif
     ledc_stop(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, 0);
 }
 
+bool IRAM_ATTR PwmBacklight::OnFadeEnd(const ledc_cb_param_t* param, void* arg) {
+    if (param->event == LEDC_FADE_END_EVT) {
+        static_cast<PwmBacklight*>(arg)->fading_.store(false, std::memory_order_relaxed);
+    }
+    return false;
+}
+
+bool PwmBacklight::StartFade(uint8_t brightness, int duration_ms) {
+    if (!fade_installed_) {
+        return false;
+    }
+#if SOC_LEDC_SUPPORT_FADE_STOP
+    // A new target takes over from the duty the running fade has reached
+    if (fading_.load()) {
+        ledc_fade_stop(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0);
+    }
+#endif
+    uint32_t duty_cycle = (1023 * brightness) / 100;
+    fading_.store(true);
+    if (ledc_set_fade_with_time(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, duty_cycle, duration_ms) != ESP_OK
+        || ledc_fade_start(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, LEDC_FADE_NO_WAIT) != ESP_OK) {
+        fading_.store(false);
+        return false;
+    }
+    return true;
+}
+
 void PwmBacklight::SetBrightnessImpl(uint8_t brightness) {
     // LEDC resolution set to 10bits, thus: 100% = 1023
     uint32_t duty_cycle = (1023 * brightness) / 100;
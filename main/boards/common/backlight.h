@@ -1,9 +1,11 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <functional>
 
 #include <driver/gpio.h>
+#include <driver/ledc.h>
 #include <esp_timer.h>
 
 
@@ -19,6 +21,8 @@ public:
 protected:
     void OnTransitionTimer();
     virtual void SetBrightnessImpl(uint8_t brightness) = 0;
+    // Ramps to the brightness in the hardware instead of stepping from the transition timer, false if not supported
+    virtual bool StartFade(uint8_t brightness, int duration_ms) { return false; }
 
     esp_timer_handle_t transition_timer_ = nullptr;
     uint8_t brightness_ = 0;
@@ -33,4 +37,13 @@ public:
     ~PwmBacklight();
 
     void SetBrightnessImpl(uint8_t brightness) override;
+
+protected:
+    bool StartFade(uint8_t brightness, int duration_ms) override;
+
+private:
+    bool fade_installed_ = false;
+    std::atomic<bool> fading_ = false;     // Cleared by the LEDC fade end interrupt
+
+    static bool OnFadeEnd(const ledc_cb_param_t* param, void* arg);
 };
@@ -111,7 +111,10 @@ esp_err_t Blufi::init() {
     // Start WiFi scan early to have results ready when user connects
     auto& wifi_manager = WifiManager::GetInstance();
     if (!wifi_manager.IsInitialized() || !wifi_manager.IsConfigMode()) {
-        // start scan immediately
+        // start scan immediately, it runs while BLE starts advertising
+        m_scan_should_save_ssid = true;
+        m_wifi_list_requested = false;
+        _register_scan_handler();
         start_wifi_scan();
     } else {
         ESP_LOGE(BLUFI_TAG,
@@ -146,6 +149,7 @@ esp_err_t Blufi::deinit() {
             return ESP_OK;
         }
         m_deinited = true;
+        _unregister_scan_handler();
         ret = _host_deinit();
         if (ret) {
             ESP_LOGE(BLUFI_TAG, "Host deinit failed: %s", esp_err_to_name(ret));
@@ -537,13 +541,11 @@ void Blufi::start_wifi_scan() {
     ESP_LOGI(BLUFI_TAG, "Starting dedicated WiFi scan");
 
     // Check if a scan is already in progress
-    if (m_scan_in_progress) {
+    if (m_scan_in_progress.exchange(true)) {
         ESP_LOGW(BLUFI_TAG, "Scan already in progress, skipping");
         return;
     }
 
-    m_scan_in_progress = true;
-
     // Get current WiFi mode
     wifi_mode_t current_mode;
     esp_err_t err = esp_wifi_get_mode(&current_mode);
@@ -564,12 +566,6 @@ void Blufi::start_wifi_scan() {
             m_scan_in_progress = false;
             return;
         }
-        // Register scan event handler
-        esp_event_handler_instance_t scan_event_instance;
-        esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
-                                            &Blufi::_wifi_scan_event_handler, this,
-                                            &scan_event_instance);
-
         // Start scan
         err = esp_wifi_scan_start(NULL, false);
         if (err != ESP_OK) {
@@ -594,55 +590,158 @@ void Blufi::start_wifi_scan() {
     ESP_LOGI(BLUFI_TAG, "WiFi scan started");
 }
 
-void Blufi::_send_wifi_list() {
-    if (m_ap_records.empty()) {
-        ESP_LOGW(BLUFI_TAG, "No AP records available to send");
+/* For the scans of every WiFi mode, registered once for as long as Blufi runs */
+void Blufi::_register_scan_handler() {
+    if (m_scan_event_instance != nullptr) {
         return;
     }
+    esp_err_t err = esp_event_handler_instance_register(WIFI_EVENT, WIFI_EVENT_SCAN_DONE,
+                                                        &Blufi::_wifi_scan_event_handler, this,
+                                                        &m_scan_event_instance);
+    if (err != ESP_OK) {
+        ESP_LOGE(BLUFI_TAG, "Failed to register scan handler: %s", esp_err_to_name(err));
+        m_scan_event_instance = nullptr;
+    }
+}
 
-    ESP_LOGI(BLUFI_TAG, "Sending WiFi list with %d APs", m_ap_records.size());
+void Blufi::_unregister_scan_handler() {
+    if (m_scan_event_instance != nullptr) {
+        esp_event_handler_instance_unregister(WIFI_EVENT, WIFI_EVENT_SCAN_DONE, m_scan_event_instance);
+        m_scan_event_instance = nullptr;
+    }
+}
 
+void Blufi::_send_wifi_list() {
     std::vector<esp_blufi_ap_record_t> blufi_ap_list;
-    for (const auto& ap : m_ap_records) {
-        esp_blufi_ap_record_t blufi_ap;
-        memset(&blufi_ap, 0, sizeof(blufi_ap));
-        memcpy(blufi_ap.ssid, ap.ssid, std::min((size_t)32, sizeof(ap.ssid)));
-        blufi_ap.rssi = ap.rssi;
-        blufi_ap_list.push_back(blufi_ap);
+    {
+        std::lock_guard<std::mutex> lock(m_ap_records_mutex);
+        blufi_ap_list.reserve(m_ap_records.size());
+        for (const auto& ap : m_ap_records) {
+            esp_blufi_ap_record_t blufi_ap;
+            memset(&blufi_ap, 0, sizeof(blufi_ap));
+            memcpy(blufi_ap.ssid, ap.ssid, std::min((size_t)32, sizeof(ap.ssid)));
+            blufi_ap.rssi = ap.rssi;
+            blufi_ap_list.push_back(blufi_ap);
+        }
+    }
+    if (blufi_ap_list.empty()) {
+        ESP_LOGW(BLUFI_TAG, "No AP records available to send");
+        return;
     }
 
+    ESP_LOGI(BLUFI_TAG, "Sending WiFi list with %d APs", blufi_ap_list.size());
     esp_blufi_send_wifi_list(blufi_ap_list.size(), blufi_ap_list.data());
-
-    m_ap_records.clear();
-    start_wifi_scan();
 }
 
 void Blufi::_wifi_scan_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id,
                                      void* event_data) {
     Blufi* self = static_cast<Blufi*>(arg);
 
-    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_SCAN_DONE) {
+    // The scans of the station are its own, their records are left to it
+    if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_SCAN_DONE && self->m_scan_in_progress) {
         ESP_LOGI(BLUFI_TAG, "WiFi scan done");
 
         uint16_t ap_num = 0;
         esp_wifi_scan_get_ap_num(&ap_num);
 
         if (ap_num == 0) {
+            // The last list still beats none
             ESP_LOGW(BLUFI_TAG, "No APs found");
-            self->m_ap_records.clear();
-        } else {
-            if (static_cast<Blufi*>(arg)->m_scan_should_save_ssid == true) {
-                self->m_ap_records.resize(ap_num);
-                esp_wifi_scan_get_ap_records(&ap_num, self->m_ap_records.data());
-
-                ESP_LOGI(BLUFI_TAG, "Found %d APs", ap_num);
-                for (const auto& ap : self->m_ap_records) {
-                    ESP_LOGI(BLUFI_TAG, "  SSID: %s, RSSI: %d, Authmode: %d", (char*)ap.ssid,
-                             ap.rssi, ap.authmode);
-                }
+        } else if (self->m_scan_should_save_ssid) {
+            std::vector<wifi_ap_record_t> records(ap_num);
+            esp_wifi_scan_get_ap_records(&ap_num, records.data());
+            records.resize(ap_num);
+
+            ESP_LOGI(BLUFI_TAG, "Found %d APs", ap_num);
+            for (const auto& ap : records) {
+                ESP_LOGI(BLUFI_TAG, "  SSID: %s, RSSI: %d, Authmode: %d", (char*)ap.ssid,
+                         ap.rssi, ap.authmode);
             }
+            std::lock_guard<std::mutex> lock(self->m_ap_records_mutex);
+            self->m_ap_records = std::move(records);
         }
         self->m_scan_in_progress = false;
+        if (self->m_wifi_list_requested.exchange(false) && self->m_ble_is_connected) {
+            self->_send_wifi_list();
+        }
+    }
+}
+
+void Blufi::_connect_task() {
+    // A list scan still running would hold up the one of the station
+    if (m_scan_in_progress) {
+        esp_wifi_scan_stop();
+    }
+    auto& wifi = WifiManager::GetInstance();
+    if (wifi.IsInitialized()) {
+        if (wifi.IsConfigMode()) {
+            wifi.StopConfigAp();
+        }
+        wifi.StopStation();
+        vTaskDelay(pdMS_TO_TICKS(500));
+    }
+    if (!wifi.IsInitialized() && !wifi.Initialize()) {
+        ESP_LOGE(BLUFI_TAG, "Failed to initialize WifiManager");
+        m_sta_is_connecting = false;
+        esp_blufi_send_wifi_conn_report(GetWifiModeWithFallback(wifi), ESP_BLUFI_STA_CONN_FAIL,
+                                        _get_softap_conn_num(), &m_sta_conn_info);
+        return;
+    }
+    wifi.StartStation();
+
+    constexpr int kConnectTimeoutMs = 10000;
+    constexpr int kPollMs = 100;
+    int waited_ms = 0;
+
+    while (waited_ms < kConnectTimeoutMs && !wifi.IsConnected()) {
+        vTaskDelay(pdMS_TO_TICKS(kPollMs));
+        waited_ms += kPollMs;
+    }
+
+    wifi_mode_t mode = GetWifiModeWithFallback(wifi);
+    const int softap_conn_num = _get_softap_conn_num();
+
+    if (wifi.IsConnected()) {
+        m_sta_is_connecting = false;
+        m_sta_connected = true;
+        m_sta_got_ip = true;
+        m_provisioned = true;
+
+        auto current_ssid = wifi.GetSsid();
+        if (!current_ssid.empty()) {
+            m_sta_ssid_len = static_cast<int>(
+                std::min(current_ssid.size(), sizeof(m_sta_ssid)));
+            memcpy(m_sta_ssid, current_ssid.c_str(), m_sta_ssid_len);
+        }
+
+        wifi_ap_record_t ap_info{};
+        if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
+            memcpy(m_sta_bssid, ap_info.bssid, sizeof(m_sta_bssid));
+        }
+
+        esp_blufi_extra_info_t info = {};
+        memcpy(info.sta_bssid, m_sta_bssid, sizeof(m_sta_bssid));
+        info.sta_bssid_set = true;
+        info.sta_ssid = m_sta_ssid;
+        info.sta_ssid_len = m_sta_ssid_len;
+        esp_blufi_send_wifi_conn_report(mode, ESP_BLUFI_STA_CONN_SUCCESS,
+                                        softap_conn_num, &info);
+        ESP_LOGI(BLUFI_TAG, "connected to WiFi");
+
+        if (m_ble_is_connected) {
+            esp_blufi_disconnect();
+        }
+    } else {
+        m_sta_is_connecting = false;
+        m_sta_connected = false;
+        m_sta_got_ip = false;
+
+        esp_blufi_extra_info_t info = {};
+        info.sta_ssid = m_sta_ssid;
+        info.sta_ssid_len = m_sta_ssid_len;
+        esp_blufi_send_wifi_conn_report(mode, ESP_BLUFI_STA_CONN_FAIL,
+                                        softap_conn_num, &info);
+        ESP_LOGE(BLUFI_TAG, "Failed to connect to WiFi via esp-wifi-connect");
     }
 }
 
@@ -723,82 +822,26 @@ void Blufi::_handle_event(esp_blufi_cb_event_t event, esp_blufi_cb_param_t* para
             m_sta_conn_info.sta_ssid = m_sta_ssid;
             m_sta_conn_info.sta_ssid_len = m_sta_ssid_len;
 
-            auto& wifi_manager = WifiManager::GetInstance();
-
-            if (wifi_manager.IsInitialized()) {
-                if (wifi_manager.IsConfigMode()) {
-                    wifi_manager.StopConfigAp();
+            bool known = false;
+            {
+                std::lock_guard<std::mutex> lock(m_ap_records_mutex);
+                for (const auto& ap : m_ap_records) {
+                    if (ssid == reinterpret_cast<const char*>(ap.ssid)) {
+                        known = true;
+                        break;
+                    }
                 }
-                wifi_manager.StopStation();
             }
-
-            if (!wifi_manager.IsInitialized() && !wifi_manager.Initialize()) {
-                ESP_LOGE(BLUFI_TAG, "Failed to initialize WifiManager");
-                break;
+            if (!known) {
+                ESP_LOGW(BLUFI_TAG, "%s is not in the last scan, it may be hidden", ssid.c_str());
             }
 
-            vTaskDelay(pdMS_TO_TICKS(500));
-
-            wifi_manager.StartStation();
-
+            // The phone hears at once that the test runs, the station is restarted off the BLE task
+            esp_blufi_send_wifi_conn_report(GetWifiModeWithFallback(WifiManager::GetInstance()), ESP_BLUFI_STA_CONNECTING,
+                                            _get_softap_conn_num(), &m_sta_conn_info);
             xTaskCreate(
                 [](void* ctx) {
-                    auto* self = static_cast<Blufi*>(ctx);
-                    auto& wifi = WifiManager::GetInstance();
-                    constexpr int kConnectTimeoutMs = 10000;
-                    constexpr TickType_t kDelayTick = pdMS_TO_TICKS(200);
-                    int waited_ms = 0;
-
-                    while (waited_ms < kConnectTimeoutMs && !wifi.IsConnected()) {
-                        vTaskDelay(kDelayTick);
-                        waited_ms += 200;
-                    }
-
-                    wifi_mode_t mode = GetWifiModeWithFallback(wifi);
-                    const int softap_conn_num = _get_softap_conn_num();
-
-                    if (wifi.IsConnected()) {
-                        self->m_sta_is_connecting = false;
-                        self->m_sta_connected = true;
-                        self->m_sta_got_ip = true;
-                        self->m_provisioned = true;
-
-                        auto current_ssid = wifi.GetSsid();
-                        if (!current_ssid.empty()) {
-                            self->m_sta_ssid_len = static_cast<int>(
-                                std::min(current_ssid.size(), sizeof(self->m_sta_ssid)));
-                            memcpy(self->m_sta_ssid, current_ssid.c_str(), self->m_sta_ssid_len);
-                        }
-
-                        wifi_ap_record_t ap_info{};
-                        if (esp_wifi_sta_get_ap_info(&ap_info) == ESP_OK) {
-                            memcpy(self->m_sta_bssid, ap_info.bssid, sizeof(self->m_sta_bssid));
-                        }
-
-                        esp_blufi_extra_info_t info = {};
-                        memcpy(info.sta_bssid, self->m_sta_bssid, sizeof(self->m_sta_bssid));
-                        info.sta_bssid_set = true;
-                        info.sta_ssid = self->m_sta_ssid;
-                        info.sta_ssid_len = self->m_sta_ssid_len;
-                        esp_blufi_send_wifi_conn_report(mode, ESP_BLUFI_STA_CONN_SUCCESS,
-                                                        softap_conn_num, &info);
-                        ESP_LOGI(BLUFI_TAG, "connected to WiFi");
-
-                        if (self->m_ble_is_connected) {
-                            esp_blufi_disconnect();
-                        }
-                    } else {
-                        self->m_sta_is_connecting = false;
-                        self->m_sta_connected = false;
-                        self->m_sta_got_ip = false;
-
-                        esp_blufi_extra_info_t info = {};
-                        info.sta_ssid = self->m_sta_ssid;
-                        info.sta_ssid_len = self->m_sta_ssid_len;
-                        esp_blufi_send_wifi_conn_report(mode, ESP_BLUFI_STA_CONN_FAIL,
-                                                        softap_conn_num, &info);
-                        ESP_LOGE(BLUFI_TAG, "Failed to connect to WiFi via esp-wifi-connect");
-                    }
+                    static_cast<Blufi*>(ctx)->_connect_task();
                     vTaskDelete(nullptr);
                 },
                 "blufi_wifi_conn", 4096, this, 5, nullptr);
@@ -865,10 +908,24 @@ void Blufi::_handle_event(esp_blufi_cb_event_t event, esp_blufi_cb_param_t* para
             break;
         case ESP_BLUFI_EVENT_GET_WIFI_LIST: {
             ESP_LOGI(BLUFI_TAG, "BLUFI get wifi list");
-            while (m_scan_in_progress) {
-                vTaskDelay(pdMS_TO_TICKS(500));
+            bool cached;
+            {
+                std::lock_guard<std::mutex> lock(m_ap_records_mutex);
+                cached = !m_ap_records.empty();
+            }
+            if (cached) {
+                // The list of the scan made while advertising goes out at once, a fresh one
+                // is scanned for the next request
+                _send_wifi_list();
+                start_wifi_scan();
+            } else {
+                // Sent by the scan handler, the BLE task is not held up until then
+                m_wifi_list_requested = true;
+                start_wifi_scan();
+                if (!m_scan_in_progress && m_wifi_list_requested.exchange(false)) {
+                    _send_wifi_list();
+                }
             }
-            _send_wifi_list();
             break;
         }
         default:
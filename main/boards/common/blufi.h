@@ -1,8 +1,10 @@
 #pragma once
 
 #include <aes/esp_aes.h>
+#include <atomic>
 #include <cassert>
 #include <cstring>
+#include <mutex>
 #include <vector>
 #include "esp_blufi_api.h"
 #include "esp_err.h"
@@ -84,8 +86,12 @@ private:
     static int _get_softap_conn_num();
 
     // WiFi scan methods
+    void _register_scan_handler();
+    void _unregister_scan_handler();
     void _send_wifi_list();
     void _start_dedicated_wifi_scan();
+    // Tests the credentials on a task of its own, the BLE callbacks go on meanwhile
+    void _connect_task();
     static void _wifi_scan_event_handler(void *arg, esp_event_base_t event_base, int32_t event_id,
                                          void *event_data);
 
@@ -140,8 +146,11 @@ private:
     bool m_sta_is_connecting;
     esp_blufi_extra_info_t m_sta_conn_info{};
 
-    // WiFi scan related
+    // WiFi scan related, the records of the last scan are kept for the next list request
+    std::mutex m_ap_records_mutex;
     std::vector<wifi_ap_record_t> m_ap_records;
-    bool m_scan_in_progress = false;
-    bool m_scan_should_save_ssid = true;
+    esp_event_handler_instance_t m_scan_event_instance = nullptr;
+    std::atomic<bool> m_scan_in_progress{false};
+    std::atomic<bool> m_scan_should_save_ssid{true};
+    std::atomic<bool> m_wifi_list_requested{false};     // Sent once the running scan is done
 };
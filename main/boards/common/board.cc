@@ -1,5 +1,8 @@
 #include "board.h"
 #include "system_info.h"
+#include "boot_timeline.h"
+#include "perf_profile.h"
+#include "turn_timeline.h"
 #include "settings.h"
 #include "display/display.h"
 #include "display/oled_display.h"
@@ -170,6 +173,19 @@ std::string Board::GetSystemInfoJson() {
     }
     json += R"(},)";
 
+    // The version check after a boot reports how long its stages took
+    json += R"("boot_timeline":)" + BootTimeline::GetJson() + R"(,)";
+
+    // The server tells the devices of an experiment apart by the profile they run
+    json += R"("performance_profile":")" + PerfProfile::GetInstance().id() + R"(",)";
+
+    // The later version checks report where the time of the recent turns went
+    auto turns = TurnTimeline::GetInstance().GetStatsJson();
+    auto turns_str = cJSON_PrintUnformatted(turns);
+    json += R"("turn_latency":)" + std::string(turns_str) + R"(,)";
+    cJSON_free(turns_str);
+    cJSON_Delete(turns);
+
     json += R"("board":)" + GetBoardJson();
 
     // Close the JSON object
@@ -8,11 +8,13 @@
 #include <string>
 #include <functional>
 #include <network_interface.h>
+#include <cJSON.h>
 
 #include "led/led.h"
 #include "backlight.h"
 #include "camera.h"
 #include "assets.h"
+#include "device_state.h"
 
 /**
  * Network events for unified callback
@@ -22,6 +24,7 @@ enum class NetworkEvent {
     Connecting,            // Network is connecting (data: SSID/network name)
     Connected,             // Network connected successfully (data: SSID/network name)
     Disconnected,          // Network disconnected
+    Switched,              // The board moved to its other network, which is connected (data: network name)
     WifiConfigModeEnter,   // Entered WiFi configuration mode
     WifiConfigModeExit,    // Exited WiFi configuration mode
     // Cellular modem specific events
@@ -46,6 +49,7 @@ using NetworkEventCallback = std::function<void(NetworkEvent event, const std::s
 void* create_board();
 class AudioCodec;
 class Display;
+struct SpeakerDspConfig;
 class Board {
 private:
     Board(const Board&) = delete; // 禁用拷贝构造函数
@@ -70,6 +74,8 @@ public:
     virtual Backlight* GetBacklight() { return nullptr; }
     virtual Led* GetLed();
     virtual AudioCodec* GetAudioCodec() = 0;
+    // The speaker tuning of the board for CONFIG_AUDIO_SPEAKER_DSP, false for the defaults
+    virtual bool GetSpeakerDspConfig(SpeakerDspConfig& config) { (void)config; return false; }
     virtual bool GetTemperature(float& esp32temp);
     virtual Display* GetDisplay();
     virtual Camera* GetCamera();
@@ -80,6 +86,13 @@ public:
     virtual bool GetBatteryLevel(int &level, bool& charging, bool& discharging);
     virtual std::string GetSystemInfoJson();
     virtual void SetPowerSaveLevel(PowerSaveLevel level) = 0;
+    // The device state and the messages received, for a board whose radio power save follows them
+    virtual void OnDeviceStateChanged(DeviceState state) { (void)state; }
+    virtual void OnNetworkTraffic() {}
+    // The power save modes of the network, nullptr for none, owned by the caller
+    virtual cJSON* GetNetworkPowerStatsJson() { return nullptr; }
+    // The sends of the open audio channel so far, for a board that can move to a better network
+    virtual void UpdateLinkStats(uint32_t tx_packets, uint32_t tx_failures) { (void)tx_packets; (void)tx_failures; }
     virtual std::string GetBoardJson() = 0;
     virtual std::string GetDeviceStatusJson() = 0;
 };
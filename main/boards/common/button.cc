@@ -1,4 +1,5 @@
 #include "button.h"
+#include "input_events.h"
 
 #include <button_gpio.h>
 #include <esp_log.h>
@@ -47,10 +48,7 @@ void Button::OnPressDown(std::function<void()> callback) {
     }
     on_press_down_ = callback;
     iot_button_register_cb(button_handle_, BUTTON_PRESS_DOWN, nullptr, [](void* handle, void* usr_data) {
-        Button* button = static_cast<Button*>(usr_data);
-        if (button->on_press_down_) {
-            button->on_press_down_();
-        }
+        InputEvents::GetInstance().Post(Dispatch, usr_data, BUTTON_PRESS_DOWN);
     }, this);
 }
 
@@ -60,10 +58,7 @@ void Button::OnPressUp(std::function<void()> callback) {
     }
     on_press_up_ = callback;
     iot_button_register_cb(button_handle_, BUTTON_PRESS_UP, nullptr, [](void* handle, void* usr_data) {
-        Button* button = static_cast<Button*>(usr_data);
-        if (button->on_press_up_) {
-            button->on_press_up_();
-        }
+        InputEvents::GetInstance().Post(Dispatch, usr_data, BUTTON_PRESS_UP);
     }, this);
 }
 
@@ -73,10 +68,7 @@ void Button::OnLongPress(std::function<void()> callback) {
     }
     on_long_press_ = callback;
     iot_button_register_cb(button_handle_, BUTTON_LONG_PRESS_START, nullptr, [](void* handle, void* usr_data) {
-        Button* button = static_cast<Button*>(usr_data);
-        if (button->on_long_press_) {
-            button->on_long_press_();
-        }
+        InputEvents::GetInstance().Post(Dispatch, usr_data, BUTTON_LONG_PRESS_START);
     }, this);
 }
 
@@ -86,10 +78,7 @@ void Button::OnClick(std::function<void()> callback) {
     }
     on_click_ = callback;
     iot_button_register_cb(button_handle_, BUTTON_SINGLE_CLICK, nullptr, [](void* handle, void* usr_data) {
-        Button* button = static_cast<Button*>(usr_data);
-        if (button->on_click_) {
-            button->on_click_();
-        }
+        InputEvents::GetInstance().Post(Dispatch, usr_data, BUTTON_SINGLE_CLICK);
     }, this);
 }
 
@@ -99,10 +88,7 @@ void Button::OnDoubleClick(std::function<void()> callback) {
     }
     on_double_click_ = callback;
     iot_button_register_cb(button_handle_, BUTTON_DOUBLE_CLICK, nullptr, [](void* handle, void* usr_data) {
-        Button* button = static_cast<Button*>(usr_data);
-        if (button->on_double_click_) {
-            button->on_double_click_();
-        }
+        InputEvents::GetInstance().Post(Dispatch, usr_data, BUTTON_DOUBLE_CLICK);
     }, this);
 }
 
@@ -117,9 +103,36 @@ void Button::OnMultipleClick(std::function<void()> callback, uint8_t click_count
         }
     };
     iot_button_register_cb(button_handle_, BUTTON_MULTIPLE_CLICK, &event_args, [](void* handle, void* usr_data) {
-        Button* button = static_cast<Button*>(usr_data);
-        if (button->on_multiple_click_) {
-            button->on_multiple_click_();
-        }
+        InputEvents::GetInstance().Post(Dispatch, usr_data, BUTTON_MULTIPLE_CLICK);
     }, this);
-}
\ No newline at end of file
+}
+
+void Button::Dispatch(void* target, int event) {
+    Button* button = static_cast<Button*>(target);
+    std::function<void()>* callback = nullptr;
+    switch (event) {
+    case BUTTON_PRESS_DOWN:
+        callback = &button->on_press_down_;
+        break;
+    case BUTTON_PRESS_UP:
+        callback = &button->on_press_up_;
+        break;
+    case BUTTON_LONG_PRESS_START:
+        callback = &button->on_long_press_;
+        break;
+    case BUTTON_SINGLE_CLICK:
+        callback = &button->on_click_;
+        break;
+    case BUTTON_DOUBLE_CLICK:
+        callback = &button->on_double_click_;
+        break;
+    case BUTTON_MULTIPLE_CLICK:
+        callback = &button->on_multiple_click_;
+        break;
+    default:
+        return;
+    }
+    if (*callback) {
+        (*callback)();
+    }
+}
@@ -8,6 +8,10 @@
 #include <button_gpio.h>
 #include <functional>
 
+/*
+ * The callbacks are run by the main task, from the InputEvents queue, in the order the
+ * gestures were recognized.
+ */
 class Button {
 public:
     Button(button_handle_t button_handle);
@@ -31,6 +35,8 @@ protected:
     std::function<void()> on_click_;
     std::function<void()> on_double_click_;
     std::function<void()> on_multiple_click_;
+
+    static void Dispatch(void* target, int event);
 };
 
 #if CONFIG_SOC_ADC_SUPPORTED
@@ -0,0 +1,183 @@
+#include "camera_explainer.h"
+#include "heap_monitor.h"
+
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <stdexcept>
+
+#include "board.h"
+#include "http_pool.h"
+#include "jpeg_stream.h"
+#include "system_info.h"
+
+#define TAG "CameraExplainer"
+
+CameraExplainer::~CameraExplainer() {
+    WaitForEncoder();
+}
+
+void CameraExplainer::SetUrl(const std::string& url, const std::string& token) {
+    // The kept clients carry the old Authorization header
+    if (token != token_) {
+        HttpPool::GetInstance().Clear();
+    }
+    url_ = url;
+    token_ = token;
+}
+
+void CameraExplainer::WaitForEncoder() {
+    if (encoder_thread_.joinable()) {
+        encoder_thread_.join();
+    }
+}
+
+std::string CameraExplainer::Explain(const CameraFrame& frame, const std::string& question,
+                                     std::function<void(const CameraUploadPlan&)> on_plan) {
+    if (url_.empty()) {
+        throw std::runtime_error("Image explain URL or token is not set");
+    }
+    if (frame.data == nullptr) {
+        throw std::runtime_error("No camera frame captured");
+    }
+    WaitForEncoder();
+
+    // The JPEG is uploaded straight from the encoder output, the encoder waits for the upload
+    JpegStream stream;
+    if (!stream.valid()) {
+        throw std::runtime_error("Failed to create JPEG stream");
+    }
+
+    auto plan = planner_.Plan(frame.width, frame.height);
+    if (on_plan) {
+        on_plan(plan);
+    }
+
+    // What the encoder really did, the frame is sent at full size when it can not be scaled
+    CameraUploadPlan used = plan;
+
+    // We spawn a thread to encode the image to JPEG using optimized encoder (cost about 500ms and 8KB SRAM)
+    encoder_thread_ = std::thread([frame, &stream, plan, &used]() {
+        int64_t start_time = esp_timer_get_time();
+        uint16_t w = frame.width;
+        uint16_t h = frame.height;
+        const uint8_t* src = frame.data;
+        size_t src_len = frame.len;
+        // A slow link gets a smaller photo, the frame itself stays as it is for the next preview
+        uint8_t* scaled = nullptr;
+        if (plan.divisor > 1 && frame.format != V4L2_PIX_FMT_JPEG) {
+            scaled = (uint8_t*)HeapMonitor::GetInstance().Malloc(kHeapTagCamera, frame.len / (plan.divisor * plan.divisor),
+                                                MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+            if (scaled != nullptr &&
+                DownscaleFrame(frame.data, w, h, frame.format, plan.divisor, scaled, &w, &h, &src_len)) {
+                src = scaled;
+            }
+        }
+        used.divisor = src == scaled ? plan.divisor : 1;
+        // A JPEG frame goes out as the camera encoded it, its size says nothing of the scene
+        used.model_bytes = frame.format == V4L2_PIX_FMT_JPEG ? 0 : CameraUploadPlanner::ModelBytes(w, h, plan.quality);
+        bool ok = image_to_jpeg_cb(const_cast<uint8_t*>(src), src_len, w, h, frame.format, plan.quality,
+                                   JpegStream::OnJpegOutput, &stream);
+        stream.Finish(ok);
+        if (scaled != nullptr) {
+            HeapMonitor::GetInstance().Free(kHeapTagCamera, scaled);
+        }
+        ESP_LOGI(TAG, "JPEG encoding time: %d ms", int((esp_timer_get_time() - start_time) / 1000));
+    });
+
+    // 构造multipart/form-data请求体
+    std::string boundary = "----ESP32_CAMERA_BOUNDARY";
+
+    // 配置HTTP客户端，使用分块传输编码；连接保持，下次提问复用
+    auto http = HttpPool::GetInstance().Open("POST", url_, "explain", 3, [this, &boundary](Http* http) {
+        http->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
+        http->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
+        if (!token_.empty()) {
+            http->SetHeader("Authorization", "Bearer " + token_);
+        }
+        http->SetHeader("Content-Type", "multipart/form-data; boundary=" + boundary);
+        http->SetHeader("Transfer-Encoding", "chunked");
+    });
+    if (!http) {
+        ESP_LOGE(TAG, "Failed to connect to explain URL");
+        // Let the encoder finish before the stream goes away
+        stream.Drain();
+        encoder_thread_.join();
+        throw std::runtime_error("Failed to connect to explain URL");
+    }
+
+    bool written = false;
+    {
+        // 第一块：question字段
+        std::string question_field;
+        question_field += "--" + boundary + "\r\n";
+        question_field += "Content-Disposition: form-data; name=\"question\"\r\n";
+        question_field += "\r\n";
+        question_field += question + "\r\n";
+        written = http->Write(question_field.c_str(), question_field.size()) == (int)question_field.size();
+    }
+    {
+        // 第二块：文件字段头部
+        std::string file_header;
+        file_header += "--" + boundary + "\r\n";
+        file_header += "Content-Disposition: form-data; name=\"file\"; filename=\"camera.jpg\"\r\n";
+        file_header += "Content-Type: image/jpeg\r\n";
+        file_header += "\r\n";
+        written = written && http->Write(file_header.c_str(), file_header.size()) == (int)file_header.size();
+    }
+
+    // 第三块：JPEG数据
+    int64_t upload_start = esp_timer_get_time();
+    size_t total_sent = 0;
+    const uint8_t* data;
+    size_t len;
+    while (written && stream.Read(data, len)) {
+        written = http->Write((const char*)data, len) == (int)len;
+        total_sent += len;
+        stream.Release();
+    }
+    // Wait for the encoder thread to finish, it may still be writing after a failed upload
+    stream.Drain();
+    encoder_thread_.join();
+
+    if (!written) {
+        ESP_LOGE(TAG, "Failed to write the photo to the explain URL");
+        http->Close();
+        throw std::runtime_error("Failed to upload photo");
+    }
+
+    if (!stream.succeeded() || total_sent == 0) {
+        ESP_LOGE(TAG, "JPEG encoder failed or produced empty output");
+        throw std::runtime_error("Failed to encode image to JPEG");
+    }
+
+    {
+        // 第四块：multipart尾部
+        std::string multipart_footer;
+        multipart_footer += "\r\n--" + boundary + "--\r\n";
+        written = http->Write(multipart_footer.c_str(), multipart_footer.size()) == (int)multipart_footer.size();
+    }
+    // 结束块
+    if (!written || http->Write("", 0) < 0) {
+        ESP_LOGE(TAG, "Failed to write the photo to the explain URL");
+        http->Close();
+        throw std::runtime_error("Failed to upload photo");
+    }
+    planner_.Record(used, total_sent, esp_timer_get_time() - upload_start);
+
+    if (http->GetStatusCode() != 200) {
+        ESP_LOGE(TAG, "Failed to upload photo, status code: %d", http->GetStatusCode());
+        throw std::runtime_error("Failed to upload photo");
+    }
+
+    std::string result = http->ReadAll();
+    HttpPool::GetInstance().Release(url_, "explain", 3, std::move(http));
+
+    // Get remain task stack size
+    size_t remain_stack_size = uxTaskGetStackHighWaterMark(nullptr);
+    ESP_LOGI(TAG, "Explain image size=%dx%d, compressed size=%d, remain stack size=%d, question=%s\n%s",
+             frame.width, frame.height, (int)total_sent, (int)remain_stack_size, question.c_str(), result.c_str());
+    return result;
+}
@@ -0,0 +1,45 @@
+#ifndef _CAMERA_EXPLAINER_H_
+#define _CAMERA_EXPLAINER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+
+#include "camera_upload.h"
+#include "jpg/image_to_jpeg.h"
+
+// A captured frame as a camera hands it to the explainer, it must stay valid until WaitForEncoder()
+struct CameraFrame {
+    const uint8_t* data = nullptr;
+    size_t len = 0;
+    uint16_t width = 0;
+    uint16_t height = 0;
+    v4l2_pix_fmt_t format = 0;
+};
+
+/*
+ * The explain flow shared by the cameras: the frame is scaled and encoded to JPEG in a thread of
+ * its own and streamed through a JpegStream into a chunked multipart POST to the explain URL,
+ * sized by a CameraUploadPlanner for the link.
+ */
+class CameraExplainer {
+public:
+    ~CameraExplainer();
+
+    void SetUrl(const std::string& url, const std::string& token);
+    // Waits for the encoder of the last Explain(), before the camera replaces the frame it reads
+    void WaitForEncoder();
+    // Throws std::runtime_error on failure, on_plan lets a camera that encodes the JPEG itself follow the plan
+    std::string Explain(const CameraFrame& frame, const std::string& question,
+                        std::function<void(const CameraUploadPlan&)> on_plan = nullptr);
+
+private:
+    std::string url_;
+    std::string token_;
+    std::thread encoder_thread_;
+    CameraUploadPlanner planner_;
+};
+
+#endif // _CAMERA_EXPLAINER_H_
@@ -0,0 +1,142 @@
+#include "camera_upload.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#include "board.h"
+
+#define TAG "CameraUpload"
+
+// Frames are not scaled below this width, the server would not make out much
+#define CAMERA_UPLOAD_MIN_WIDTH 160
+
+// Roughly the JPEG bits per pixel at a quality, from photos of the usual sensors
+static float JpegBitsPerPixel(int quality) {
+    return 0.4f + quality * 0.015f;
+}
+
+// The uplink of a cellular modem is far slower than Wi-Fi and the rates of the two are kept apart
+static bool IsCellularLink() {
+    auto board_type = Board::GetInstance().GetBoardType();
+    return board_type == "ml307" || board_type == "nt26";
+}
+
+CameraUploadPlan CameraUploadPlanner::Plan(uint16_t width, uint16_t height) const {
+    bool cellular = IsCellularLink();
+    uint32_t rate = cellular_ == cellular ? bytes_per_second_.load() : 0;
+    if (rate == 0 && cellular) {
+        // Until an upload has been measured on the modem
+        rate = CONFIG_XIAOZHI_CAMERA_UPLOAD_CELLULAR_KBPS * 1024;
+    }
+    size_t budget = SIZE_MAX;
+    if (rate != 0 && CONFIG_XIAOZHI_CAMERA_UPLOAD_TARGET_MS != 0) {
+        budget = (size_t)rate * CONFIG_XIAOZHI_CAMERA_UPLOAD_TARGET_MS / 1000;
+    }
+    if (CONFIG_XIAOZHI_CAMERA_UPLOAD_MAX_KB != 0) {
+        budget = std::min(budget, (size_t)CONFIG_XIAOZHI_CAMERA_UPLOAD_MAX_KB * 1024);
+    }
+
+    // From the best to the smallest, the first that fits in the budget is taken
+    const int divisors[] = {1, 1, 1, 2, 2, 2, 4, 4};
+    const int qualities[] = {
+        CONFIG_XIAOZHI_CAMERA_UPLOAD_QUALITY,
+        CONFIG_XIAOZHI_CAMERA_UPLOAD_QUALITY * 3 / 4,
+        CONFIG_XIAOZHI_CAMERA_UPLOAD_QUALITY * 11 / 20,
+        CONFIG_XIAOZHI_CAMERA_UPLOAD_QUALITY,
+        CONFIG_XIAOZHI_CAMERA_UPLOAD_QUALITY * 3 / 4,
+        CONFIG_XIAOZHI_CAMERA_UPLOAD_QUALITY * 11 / 20,
+        CONFIG_XIAOZHI_CAMERA_UPLOAD_QUALITY * 3 / 4,
+        CONFIG_XIAOZHI_CAMERA_UPLOAD_QUALITY / 2,
+    };
+    float complexity = complexity_.load();
+    CameraUploadPlan plan;
+    for (size_t i = 0; i < sizeof(divisors) / sizeof(divisors[0]); i++) {
+        if (divisors[i] > 1 && width / divisors[i] < CAMERA_UPLOAD_MIN_WIDTH) {
+            break;
+        }
+        plan.divisor = divisors[i];
+        plan.quality = qualities[i];
+        plan.model_bytes = ModelBytes(width / plan.divisor, height / plan.divisor, plan.quality);
+        if (budget == SIZE_MAX || plan.model_bytes * complexity <= budget) {
+            break;
+        }
+    }
+    plan.cellular = cellular;
+    if (budget != SIZE_MAX) {
+        ESP_LOGI(TAG, "Upload at 1/%d size, quality %d, about %u of %u bytes at %lu B/s", plan.divisor, plan.quality,
+                 (unsigned)(plan.model_bytes * complexity), (unsigned)budget, rate);
+    }
+    return plan;
+}
+
+float CameraUploadPlanner::ModelBytes(uint16_t width, uint16_t height, int quality) {
+    return (float)width * height * JpegBitsPerPixel(quality) / 8;
+}
+
+void CameraUploadPlanner::Record(const CameraUploadPlan& plan, size_t bytes, int64_t elapsed_us) {
+    if (bytes == 0 || elapsed_us <= 0) {
+        return;
+    }
+    uint32_t rate = (uint32_t)((int64_t)bytes * 1000000 / elapsed_us);
+    uint32_t last = cellular_ == plan.cellular ? bytes_per_second_.load() : 0;
+    // Smoothed, so a single slow upload does not shrink the next photo too much
+    bytes_per_second_ = last == 0 ? rate : (last + rate) / 2;
+    cellular_ = plan.cellular;
+
+    // A busy scene takes more bytes than the model, the next photos are sized for the scenes seen so far
+    if (plan.model_bytes > 0) {
+        float complexity = std::clamp(bytes / plan.model_bytes, 0.3f, 3.0f);
+        complexity_ = (complexity_.load() + complexity) / 2;
+    }
+}
+
+bool DownscaleFrame(const uint8_t* src, uint16_t width, uint16_t height, v4l2_pix_fmt_t format, int divisor,
+                    uint8_t* dst, uint16_t* out_width, uint16_t* out_height, size_t* out_len) {
+    size_t bytes_per_pixel;
+    switch (format) {
+        case V4L2_PIX_FMT_RGB565:
+        case V4L2_PIX_FMT_RGB565X:
+        case V4L2_PIX_FMT_YUYV:
+            bytes_per_pixel = 2;
+            break;
+        case V4L2_PIX_FMT_RGB24:
+            bytes_per_pixel = 3;
+            break;
+        case V4L2_PIX_FMT_GREY:
+            bytes_per_pixel = 1;
+            break;
+        default:
+            ESP_LOGW(TAG, "Can not scale format 0x%08lx", format);
+            return false;
+    }
+
+    // An even width keeps the YUYV pairs whole
+    uint16_t w = (width / divisor) & ~1;
+    uint16_t h = height / divisor;
+    for (uint16_t y = 0; y < h; y++) {
+        const uint8_t* row = src + (size_t)y * divisor * width * bytes_per_pixel;
+        uint8_t* out = dst + (size_t)y * w * bytes_per_pixel;
+        if (format == V4L2_PIX_FMT_YUYV) {
+            // A Y0 U Y1 V pair shares its chroma, so whole pairs are taken
+            for (uint16_t x = 0; x < w; x += 2) {
+                memcpy(out + x * 2, row + (size_t)x * divisor * 2, 4);
+            }
+        } else if (bytes_per_pixel == 2) {
+            auto in16 = (const uint16_t*)row;
+            auto out16 = (uint16_t*)out;
+            for (uint16_t x = 0; x < w; x++) {
+                out16[x] = in16[x * divisor];
+            }
+        } else {
+            for (uint16_t x = 0; x < w; x++) {
+                memcpy(out + x * bytes_per_pixel, row + (size_t)x * divisor * bytes_per_pixel, bytes_per_pixel);
+            }
+        }
+    }
+    *out_width = w;
+    *out_height = h;
+    *out_len = (size_t)w * h * bytes_per_pixel;
+    return true;
+}
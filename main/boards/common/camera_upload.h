@@ -0,0 +1,46 @@
+#ifndef _CAMERA_UPLOAD_H_
+#define _CAMERA_UPLOAD_H_
+
+#include "sdkconfig.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "jpg/image_to_jpeg.h"
+
+// The size and the quality of the next JPEG sent to the explain URL
+struct CameraUploadPlan {
+    int divisor = 1;    // The frame is scaled down by this, a power of two
+    int quality = CONFIG_XIAOZHI_CAMERA_UPLOAD_QUALITY;
+    float model_bytes = 0;  // The size the model expects for an average scene
+    bool cellular = false;
+};
+
+/*
+ * Picks the upload size and JPEG quality for a byte budget: what the measured uplink sends in
+ * CONFIG_XIAOZHI_CAMERA_UPLOAD_TARGET_MS, at most CONFIG_XIAOZHI_CAMERA_UPLOAD_MAX_KB. The JPEG
+ * size is estimated from the quality and corrected by how much the last photos differed from
+ * the estimate. Until an upload has been measured, Wi-Fi goes at full size and a cellular modem
+ * is taken to send CONFIG_XIAOZHI_CAMERA_UPLOAD_CELLULAR_KBPS.
+ */
+class CameraUploadPlanner {
+public:
+    CameraUploadPlan Plan(uint16_t width, uint16_t height) const;
+    // The JPEG bytes of an upload and how long it took from the first byte to the last, with
+    // the plan the frame was actually encoded with
+    void Record(const CameraUploadPlan& plan, size_t bytes, int64_t elapsed_us);
+    // The size the model expects for the pixels encoded at the quality
+    static float ModelBytes(uint16_t width, uint16_t height, int quality);
+
+private:
+    std::atomic<uint32_t> bytes_per_second_ = 0;
+    std::atomic<bool> cellular_ = false;    // The link bytes_per_second_ was measured on
+    std::atomic<float> complexity_ = 1.0f;
+};
+
+// Scales the frame down by skipping pixels, into a buffer of at least width * height * bpp / divisor²
+bool DownscaleFrame(const uint8_t* src, uint16_t width, uint16_t height, v4l2_pix_fmt_t format, int divisor,
+                    uint8_t* dst, uint16_t* out_width, uint16_t* out_height, size_t* out_len);
+
+#endif // _CAMERA_UPLOAD_H_
@@ -15,6 +15,7 @@ DualNetworkBoard::DualNetworkBoard(gpio_num_t ml307_tx_pin, gpio_num_t ml307_rx_
     
     // 从Settings加载网络类型
     network_type_ = LoadNetworkTypeFromSettings(default_net_type);
+    preferred_type_ = network_type_;
     
     // 只初始化当前网络类型对应的板卡
     InitializeCurrentBoard();
@@ -32,18 +33,42 @@ void DualNetworkBoard::SaveNetworkTypeToSettings(NetworkType type) {
     settings.SetInt("type", network_type);
 }
 
+std::unique_ptr<Board> DualNetworkBoard::CreateBoard(NetworkType type) {
+    if (type == NetworkType::ML307) {
+        ESP_LOGI(TAG, "Initialize ML307 board");
+        return std::make_unique<Ml307Board>(ml307_tx_pin_, ml307_rx_pin_, ml307_dtr_pin_);
+    }
+    ESP_LOGI(TAG, "Initialize WiFi board");
+    return std::make_unique<WifiBoard>();
+}
+
 void DualNetworkBoard::InitializeCurrentBoard() {
+    current_board_ = CreateBoard(network_type_);
+#if CONFIG_DUAL_NETWORK_HOT_STANDBY
+    // 另一个网络也初始化，作为热备份
     if (network_type_ == NetworkType::ML307) {
-        ESP_LOGI(TAG, "Initialize ML307 board");
-        current_board_ = std::make_unique<Ml307Board>(ml307_tx_pin_, ml307_rx_pin_, ml307_dtr_pin_);
+        standby_board_ = CreateBoard(NetworkType::WIFI);
+        static_cast<WifiBoard*>(standby_board_.get())->SetStandby(true);
     } else {
-        ESP_LOGI(TAG, "Initialize WiFi board");
-        current_board_ = std::make_unique<WifiBoard>();
+        standby_board_ = CreateBoard(NetworkType::ML307);
     }
+#endif
 }
 
 void DualNetworkBoard::SwitchNetworkType() {
     auto display = GetDisplay();
+#if CONFIG_DUAL_NETWORK_HOT_STANDBY
+    // The standby network takes over at once, no reboot
+    {
+        std::lock_guard<std::recursive_mutex> lock(mutex_);
+        if (standby_connected_) {
+            preferred_type_ = network_type_ == NetworkType::WIFI ? NetworkType::ML307 : NetworkType::WIFI;
+            SaveNetworkTypeToSettings(preferred_type_);
+            ScheduleSwitchToStandby("switched by the user");
+            return;
+        }
+    }
+#endif
     if (network_type_ == NetworkType::WIFI) {    
         SaveNetworkTypeToSettings(NetworkType::ML307);
         display->ShowNotification(Lang::Strings::SWITCH_TO_4G_NETWORK);
@@ -56,8 +81,115 @@ void DualNetworkBoard::SwitchNetworkType() {
     app.Reboot();
 }
 
+void DualNetworkBoard::OnBoardNetworkEvent(Board* board, NetworkEvent event, const std::string& data) {
+    std::unique_lock<std::recursive_mutex> lock(mutex_);
+    bool active = board == current_board_.get();
+    if (event == NetworkEvent::Connected || event == NetworkEvent::Disconnected) {
+        (active ? current_connected_ : standby_connected_) = event == NetworkEvent::Connected;
+        (active ? current_name_ : standby_name_) = data;
+    }
+
+    if (!active) {
+        // The events of the standby network are not shown
+        if (event != NetworkEvent::Connected) {
+            return;
+        }
+        ESP_LOGI(TAG, "Standby network connected: %s", data.c_str());
+        board->SetPowerSaveLevel(PowerSaveLevel::LOW_POWER);
+        // The preferred network takes over again between conversations
+        bool standby_preferred = network_type_ != preferred_type_;
+        if (!current_connected_) {
+            ScheduleSwitchToStandby("the active network is not connected");
+        } else if (standby_preferred && Application::GetInstance().GetDeviceState() == kDeviceStateIdle) {
+            ScheduleSwitchToStandby("the preferred network is back");
+        }
+        return;
+    }
+
+    if (event == NetworkEvent::Disconnected && standby_connected_) {
+        ScheduleSwitchToStandby("the active network was lost");
+        return;
+    }
+    if (event == NetworkEvent::Connected) {
+        reported_connected_ = true;
+    } else if (event == NetworkEvent::Disconnected) {
+        reported_connected_ = false;
+    }
+    lock.unlock();
+    if (network_event_callback_) {
+        network_event_callback_(event, data);
+    }
+}
+
+void DualNetworkBoard::ScheduleSwitchToStandby(const char* reason) {
+    // The event and button tasks only ask for it, the application moves its connections on the main task
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    if (switch_pending_) {
+        return;
+    }
+    switch_pending_ = true;
+    Application::GetInstance().Schedule([this, reason]() {
+        SwitchToStandby(reason);
+    });
+}
+
+void DualNetworkBoard::SwitchToStandby(const char* reason) {
+    std::unique_lock<std::recursive_mutex> lock(mutex_);
+    switch_pending_ = false;
+    // The standby network may have dropped since the switch was scheduled
+    if (!standby_connected_) {
+        return;
+    }
+    ESP_LOGW(TAG, "Switching to the standby network, %s", reason);
+    std::swap(current_board_, standby_board_);
+    std::swap(current_connected_, standby_connected_);
+    std::swap(current_name_, standby_name_);
+    network_type_ = network_type_ == NetworkType::WIFI ? NetworkType::ML307 : NetworkType::WIFI;
+    auto wifi_board = network_type_ == NetworkType::WIFI ? current_board_.get() : standby_board_.get();
+    static_cast<WifiBoard*>(wifi_board)->SetStandby(network_type_ != NetworkType::WIFI);
+    standby_board_->SetPowerSaveLevel(PowerSaveLevel::LOW_POWER);
+    window_ticks_ = 0;
+
+    auto display = GetDisplay();
+    display->ShowNotification(network_type_ == NetworkType::ML307 ? Lang::Strings::SWITCH_TO_4G_NETWORK : Lang::Strings::SWITCH_TO_WIFI_NETWORK);
+    if (!network_event_callback_) {
+        return;
+    }
+    // The application moves its connections over, or starts on the new network if none was connected yet
+    auto event = reported_connected_ ? NetworkEvent::Switched : NetworkEvent::Connected;
+    reported_connected_ = true;
+    std::string name = current_name_;
+    lock.unlock();
+    network_event_callback_(event, name);
+}
+
+void DualNetworkBoard::UpdateLinkStats(uint32_t tx_packets, uint32_t tx_failures) {
+#if CONFIG_DUAL_NETWORK_HOT_STANDBY
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    // The counters start over with each audio channel
+    if (window_ticks_ == 0 || tx_packets < window_packets_ || tx_failures < window_failures_) {
+        window_packets_ = tx_packets;
+        window_failures_ = tx_failures;
+        window_ticks_ = 1;
+        return;
+    }
+    if (tx_failures - window_failures_ >= CONFIG_DUAL_NETWORK_FAILOVER_FAILURES && standby_connected_) {
+        ESP_LOGW(TAG, "%lu of %lu audio sends failed", tx_failures - window_failures_, tx_packets - window_packets_);
+        window_ticks_ = 0;
+        ScheduleSwitchToStandby("the active network degraded");
+        return;
+    }
+    if (++window_ticks_ > DUAL_NETWORK_FAILOVER_WINDOW_S) {
+        window_ticks_ = 0;
+    }
+#else
+    (void)tx_packets;
+    (void)tx_failures;
+#endif
+}
  
 std::string DualNetworkBoard::GetBoardType() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
     return current_board_->GetBoardType();
 }
 
@@ -70,29 +202,65 @@ void DualNetworkBoard::StartNetwork() {
         display->SetStatus(Lang::Strings::DETECTING_MODULE);
     }
     current_board_->StartNetwork();
+    if (standby_board_) {
+        standby_board_->StartNetwork();
+    }
 }
 
 void DualNetworkBoard::SetNetworkEventCallback(NetworkEventCallback callback) {
-    // Forward the callback to the current board
-    current_board_->SetNetworkEventCallback(std::move(callback));
+    // The events of both boards come here, those of the active one are forwarded
+    network_event_callback_ = std::move(callback);
+    current_board_->SetNetworkEventCallback([this, board = current_board_.get()](NetworkEvent event, const std::string& data) {
+        OnBoardNetworkEvent(board, event, data);
+    });
+    if (standby_board_) {
+        standby_board_->SetNetworkEventCallback([this, board = standby_board_.get()](NetworkEvent event, const std::string& data) {
+            OnBoardNetworkEvent(board, event, data);
+        });
+    }
+}
+
+Board& DualNetworkBoard::GetCurrentBoard() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    return *current_board_;
 }
 
 NetworkInterface* DualNetworkBoard::GetNetwork() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
     return current_board_->GetNetwork();
 }
 
 const char* DualNetworkBoard::GetNetworkStateIcon() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
     return current_board_->GetNetworkStateIcon();
 }
 
 void DualNetworkBoard::SetPowerSaveLevel(PowerSaveLevel level) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
     current_board_->SetPowerSaveLevel(level);
 }
 
+void DualNetworkBoard::OnDeviceStateChanged(DeviceState state) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    current_board_->OnDeviceStateChanged(state);
+}
+
+void DualNetworkBoard::OnNetworkTraffic() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    current_board_->OnNetworkTraffic();
+}
+
+cJSON* DualNetworkBoard::GetNetworkPowerStatsJson() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    return current_board_->GetNetworkPowerStatsJson();
+}
+
 std::string DualNetworkBoard::GetBoardJson() {   
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
     return current_board_->GetBoardJson();
 }
 
 std::string DualNetworkBoard::GetDeviceStatusJson() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
     return current_board_->GetDeviceStatusJson();
 }
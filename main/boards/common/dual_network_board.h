@@ -5,6 +5,11 @@
 #include "wifi_board.h"
 #include "ml307_board.h"
 #include <memory>
+#include <mutex>
+#include <cstdint>
+
+// The window of the failed sends that make the active network count as degraded
+#define DUAL_NETWORK_FAILOVER_WINDOW_S 5
 
 //enum NetworkType
 enum class NetworkType {
@@ -17,7 +22,23 @@ class DualNetworkBoard : public Board {
 private:
     // 使用基类指针存储当前活动的板卡
     std::unique_ptr<Board> current_board_;
+    // Guards the boards and their state, the swap runs on the main task while the accessors run on any task
+    std::recursive_mutex mutex_;
     NetworkType network_type_ = NetworkType::ML307;  // Default to ML307
+    // 热备份的另一个网络，CONFIG_DUAL_NETWORK_HOT_STANDBY
+    std::unique_ptr<Board> standby_board_;
+    NetworkType preferred_type_ = NetworkType::ML307;
+    bool current_connected_ = false;
+    bool standby_connected_ = false;
+    std::string current_name_;
+    std::string standby_name_;
+    bool reported_connected_ = false;   // The application was told of a connected network
+    bool switch_pending_ = false;       // A switch is scheduled on the main task
+    NetworkEventCallback network_event_callback_;
+    // The sends of the audio channel at the start of the failover window
+    uint32_t window_packets_ = 0;
+    uint32_t window_failures_ = 0;
+    int window_ticks_ = 0;
 
     // ML307的引脚配置
     gpio_num_t ml307_tx_pin_;
@@ -32,6 +53,12 @@ private:
 
     // 初始化当前网络类型对应的板卡
     void InitializeCurrentBoard();
+
+    std::unique_ptr<Board> CreateBoard(NetworkType type);
+    void OnBoardNetworkEvent(Board* board, NetworkEvent event, const std::string& data);
+    // Makes the connected standby network the active one, on the main task
+    void ScheduleSwitchToStandby(const char* reason);
+    void SwitchToStandby(const char* reason);
  
 public:
     DualNetworkBoard(gpio_num_t ml307_tx_pin, gpio_num_t ml307_rx_pin, gpio_num_t ml307_dtr_pin = GPIO_NUM_NC, int32_t default_net_type = 1);
@@ -43,8 +70,8 @@ public:
     // 获取当前网络类型
     NetworkType GetNetworkType() const { return network_type_; }
     
-    // 获取当前活动的板卡引用
-    Board& GetCurrentBoard() const { return *current_board_; }
+    // 获取当前活动的板卡引用, with the hot standby it is only valid until the next switch
+    Board& GetCurrentBoard();
     
     // 重写Board接口
     virtual std::string GetBoardType() override;
@@ -53,6 +80,10 @@ public:
     virtual NetworkInterface* GetNetwork() override;
     virtual const char* GetNetworkStateIcon() override;
     virtual void SetPowerSaveLevel(PowerSaveLevel level) override;
+    virtual void OnDeviceStateChanged(DeviceState state) override;
+    virtual void OnNetworkTraffic() override;
+    virtual cJSON* GetNetworkPowerStatsJson() override;
+    virtual void UpdateLinkStats(uint32_t tx_packets, uint32_t tx_failures) override;
     virtual std::string GetBoardJson() override;
     virtual std::string GetDeviceStatusJson() override;
 };
@@ -12,24 +12,19 @@
 #include "camera.h"
 #include "esp_camera.h"
 #include "jpg/image_to_jpeg.h"
-
-struct JpegChunk
-{
-    uint8_t *data;
-    size_t len;
-};
+#include "camera_explainer.h"
 
 class Esp32Camera : public Camera
 {
 private:
     bool streaming_on_ = false;
     bool swap_bytes_enabled_ = true;  // Swap pixel byte order for RGB565, enabled by default
-    std::string explain_url_;
-    std::string explain_token_;
-    std::thread encoder_thread_;
+    CameraExplainer explainer_;
     camera_fb_t *current_fb_ = nullptr;
     uint8_t *encode_buf_ = nullptr;  // Buffer for JPEG encoding (with optional byte swap)
     size_t encode_buf_size_ = 0;
+    uint8_t *frame_data_ = nullptr;  // The RGB565 frame for the encoder, see CONFIG_XIAOZHI_CAMERA_RGB565_SWAP
+    v4l2_pix_fmt_t frame_format_ = V4L2_PIX_FMT_RGB565;
 
 public:
     Esp32Camera(const camera_config_t &config);
@@ -20,6 +20,7 @@
 #include "esp_video.h"
 #include "esp_jpeg_common.h"
 #include "jpg/image_to_jpeg.h"
+#include "jpg/byte_swap.h"
 #include "jpg/jpeg_to_image.h"
 #include "lvgl_display.h"
 #include "mcp_server.h"
@@ -32,8 +33,7 @@
 #include <esp_log.h> // should be after LOCAL_LOG_LEVEL definition
 
 #ifdef CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
-#ifdef CONFIG_IDF_TARGET_ESP32P4
-#include "driver/ppa.h"
+#ifdef CONFIG_SOC_PPA_SUPPORTED
 #if defined(CONFIG_XIAOZHI_CAMERA_IMAGE_ROTATION_ANGLE_90)
 #define IMAGE_ROTATION_ANGLE (PPA_SRM_ROTATION_ANGLE_270)
 #elif defined(CONFIG_XIAOZHI_CAMERA_IMAGE_ROTATION_ANGLE_270)
@@ -41,8 +41,7 @@
 #else
 #error "CONFIG_XIAOZHI_CAMERA_IMAGE_ROTATION_ANGLE is not set"
 #endif  // angle
-#else   // target
-#include "esp_imgfx_rotate.h"
+#else   // CONFIG_SOC_PPA_SUPPORTED
 #if defined(CONFIG_XIAOZHI_CAMERA_IMAGE_ROTATION_ANGLE_90)
 #define IMAGE_ROTATION_ANGLE (90)
 #elif defined(CONFIG_XIAOZHI_CAMERA_IMAGE_ROTATION_ANGLE_270)
@@ -50,7 +49,7 @@
 #else
 #error "CONFIG_XIAOZHI_CAMERA_IMAGE_ROTATION_ANGLE is not set"
 #endif  // angle
-#endif  // target
+#endif  // CONFIG_SOC_PPA_SUPPORTED
 #endif  // CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
 
 
@@ -276,7 +275,12 @@ EspVideo::EspVideo(const esp_video_init_config_t& config) {
 
     // 申请缓冲并mmap
     struct v4l2_requestbuffers req = {};
+#ifdef CONFIG_XIAOZHI_CAMERA_STREAMING
+    // The stream, the last capture and the driver each hold buffers
+    req.count = CONFIG_XIAOZHI_CAMERA_STREAMING_BUFFER_COUNT;
+#else
     req.count = strcmp(video_device_name, ESP_VIDEO_MIPI_CSI_DEVICE_NAME) == 0 ? 2 : 1;
+#endif  // CONFIG_XIAOZHI_CAMERA_STREAMING
     req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     req.memory = V4L2_MEMORY_MMAP;
     if (ioctl(video_fd_, VIDIOC_REQBUFS, &req) != 0) {
@@ -319,6 +323,39 @@ EspVideo::EspVideo(const esp_video_init_config_t& config) {
         }
     }
 
+    // The copies, rotations and previews go to buffers of these sizes, aligned for the PPA
+    size_t max_buffer_length = 0;
+    for (auto& b : mmap_buffers_) {
+        max_buffer_length = MAX(max_buffer_length, b.length);
+    }
+    frame_pool_.size = (MAX(max_buffer_length, (size_t)frame_.width * frame_.height * 2) + 127) & ~127;
+    frame_pool_.count = 2;
+    preview_pool_.size = ((size_t)frame_.width * frame_.height * 2 + 127) & ~127;
+    preview_pool_.count = 3;
+#ifdef CONFIG_SOC_PPA_SUPPORTED
+    ppa_client_config_t client_cfg = {
+        .oper_type = PPA_OPERATION_SRM,
+        .max_pending_trans_num = 1,
+    };
+    esp_err_t ppa_err = ppa_register_client(&client_cfg, &ppa_client_);
+    if (ppa_err != ESP_OK || ppa_client_ == nullptr) {
+        ESP_LOGE(TAG, "ppa_register_client failed: %d", (int)ppa_err);
+        ppa_client_ = nullptr;
+    }
+#endif  // CONFIG_SOC_PPA_SUPPORTED
+#ifdef CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
+#ifdef CONFIG_SOC_PPA_SUPPORTED
+    // YUYV is converted to RGB888 before the PPA rotates it
+    size_t rotate_input_size = MAX(max_buffer_length, (size_t)frame_.width * frame_.height * 3);
+#else
+    size_t rotate_input_size = max_buffer_length;
+#endif  // CONFIG_SOC_PPA_SUPPORTED
+    rotate_input_ = (uint8_t*)heap_caps_malloc(rotate_input_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT | MALLOC_CAP_CACHE_ALIGNED);
+    if (rotate_input_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate memory for rotate image");
+    }
+#endif  // CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
+
     int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     if (ioctl(video_fd_, VIDIOC_STREAMON, &type) != 0) {
         ESP_LOGE(TAG, "VIDIOC_STREAMON failed");
@@ -328,7 +365,14 @@ EspVideo::EspVideo(const esp_video_init_config_t& config) {
         return;
     }
 
-#ifdef CONFIG_ESP_VIDEO_ENABLE_ISP_VIDEO_DEVICE
+#if defined(CONFIG_XIAOZHI_CAMERA_STREAMING)
+    // The stream task keeps dequeuing, it also lets the ISP settle before the first capture
+    xTaskCreate(
+        [](void* arg) {
+            static_cast<EspVideo*>(arg)->StreamTask();
+        },
+        "CameraStream", 4096, this, 5, &stream_task_);
+#elif defined(CONFIG_ESP_VIDEO_ENABLE_ISP_VIDEO_DEVICE)
     // 当启用 ISP 时，ISP 需要一些照片来初始化参数，因此开启后后台拍摄5s照片并丢弃
     xTaskCreate(
         [](void* arg) {
@@ -363,6 +407,37 @@ EspVideo::EspVideo(const esp_video_init_config_t& config) {
 }
 
 EspVideo::~EspVideo() {
+#ifdef CONFIG_XIAOZHI_CAMERA_STREAMING
+    // Stopping the stream wakes the stream task from VIDIOC_DQBUF
+    stream_stop_ = true;
+    if (video_fd_ >= 0) {
+        int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        ioctl(video_fd_, VIDIOC_STREAMOFF, &type);
+        streaming_on_ = false;
+    }
+    for (int i = 0; i < 50 && stream_task_ != nullptr; i++) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    latest_frame_.reset();
+#endif  // CONFIG_XIAOZHI_CAMERA_STREAMING
+    explainer_.WaitForEncoder();
+    ReleaseFrame();
+#ifdef CONFIG_SOC_PPA_SUPPORTED
+    if (ppa_client_ != nullptr) {
+        ppa_unregister_client(ppa_client_);
+        ppa_client_ = nullptr;
+    }
+#endif  // CONFIG_SOC_PPA_SUPPORTED
+#ifdef CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
+    heap_caps_free(rotate_input_);
+    rotate_input_ = nullptr;
+#ifndef CONFIG_SOC_PPA_SUPPORTED
+    if (rotate_handle_ != nullptr) {
+        esp_imgfx_rotate_close(rotate_handle_);
+        rotate_handle_ = nullptr;
+    }
+#endif  // CONFIG_SOC_PPA_SUPPORTED
+#endif  // CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
     if (streaming_on_ && video_fd_ >= 0) {
         int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         ioctl(video_fd_, VIDIOC_STREAMOFF, &type);
@@ -381,353 +456,563 @@ EspVideo::~EspVideo() {
 }
 
 void EspVideo::SetExplainUrl(const std::string& url, const std::string& token) {
-    explain_url_ = url;
-    explain_token_ = token;
+    explainer_.SetUrl(url, token);
 }
 
-bool EspVideo::Capture() {
-    if (encoder_thread_.joinable()) {
-        encoder_thread_.join();
-    }
-
-    if (!streaming_on_ || video_fd_ < 0) {
-        return false;
-    }
+void EspVideo::ReleaseFrame() {
+    frame_.owner.reset();
+    frame_.data = nullptr;
+    frame_.format = 0;
+}
 
-    for (int i = 0; i < 3; i++) {
+#ifdef CONFIG_XIAOZHI_CAMERA_STREAMING
+void EspVideo::StreamTask() {
+#ifdef CONFIG_ESP_VIDEO_ENABLE_ISP_VIDEO_DEVICE
+    // 当启用 ISP 时，ISP 需要一些照片来初始化参数，因此前5s的照片丢弃
+    TickType_t ready_at = xTaskGetTickCount() + pdMS_TO_TICKS(5000);
+#else
+    TickType_t ready_at = xTaskGetTickCount();
+#endif  // CONFIG_ESP_VIDEO_ENABLE_ISP_VIDEO_DEVICE
+    uint32_t frame_count = 0;
+    while (!stream_stop_) {
         struct v4l2_buffer buf = {};
         buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
         buf.memory = V4L2_MEMORY_MMAP;
         if (ioctl(video_fd_, VIDIOC_DQBUF, &buf) != 0) {
-            ESP_LOGE(TAG, "VIDIOC_DQBUF failed");
-            return false;
+            if (!stream_stop_) {
+                ESP_LOGE(TAG, "VIDIOC_DQBUF failed in stream");
+                vTaskDelay(pdMS_TO_TICKS(10));
+            }
+            continue;
         }
-        if (i == 2) {
-            // 保存帧副本到PSRAM
-            if (frame_.data) {
-                heap_caps_free(frame_.data);
-                frame_.data = nullptr;
-                frame_.format = 0;
+        frame_count++;
+        // The buffer goes back to the driver when the last holder lets go of it
+        std::shared_ptr<struct v4l2_buffer> frame(new v4l2_buffer(buf), [this](struct v4l2_buffer* b) {
+            if (!stream_stop_ && ioctl(video_fd_, VIDIOC_QBUF, b) != 0) {
+                ESP_LOGE(TAG, "VIDIOC_QBUF failed");
             }
-            frame_.len = buf.bytesused;
-            frame_.data = (uint8_t*)heap_caps_malloc(frame_.len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-            if (!frame_.data) {
-                ESP_LOGE(TAG, "alloc frame copy failed: need allocate %lu bytes", buf.bytesused);
-                if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                    ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                }
-                return false;
+            delete b;
+        });
+        if (!streaming_on_) {
+            // Frames before the camera is ready are queued again right away
+            if ((int32_t)(xTaskGetTickCount() - ready_at) < 0) {
+                continue;
             }
+            ESP_LOGI(TAG, "Camera stream ready after %lu frames", frame_count);
+            streaming_on_ = true;
+        }
+        {
+            std::lock_guard<std::mutex> lock(stream_mutex_);
+            latest_frame_.swap(frame);
+        }
+        stream_cv_.notify_all();
+        // The frame before is released outside of the lock, unless a capture still holds it
+        frame.reset();
+    }
+    stream_task_ = nullptr;
+    vTaskDelete(NULL);
+}
+
+// Lends the V4L2 buffer to the frame when no conversion is needed, the buffer is queued again on release
+bool EspVideo::BorrowFrame(const std::shared_ptr<struct v4l2_buffer>& buf) {
+#if defined(CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE) || \
+    (defined(CONFIG_XIAOZHI_ENABLE_CAMERA_ENDIANNESS_SWAP) && !defined(CONFIG_XIAOZHI_CAMERA_RGB565_SWAP_ON_THE_FLY))
+    return false;
+#else
+    v4l2_pix_fmt_t format;
+    switch (sensor_format_) {
+#ifdef CONFIG_XIAOZHI_ENABLE_CAMERA_ENDIANNESS_SWAP
+        // Only RGB565 is lent, the encoder and the preview swap it as RGB565X
+        case V4L2_PIX_FMT_RGB565:
+            format = V4L2_PIX_FMT_RGB565X;
+            break;
+#else
+        case V4L2_PIX_FMT_RGB565:
+        case V4L2_PIX_FMT_RGB24:
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_YUV420:
+        case V4L2_PIX_FMT_GREY:
+#ifdef CONFIG_XIAOZHI_CAMERA_ALLOW_JPEG_INPUT
+        case V4L2_PIX_FMT_JPEG:
+#endif  // CONFIG_XIAOZHI_CAMERA_ALLOW_JPEG_INPUT
+#ifdef CONFIG_XIAOZHI_CAMERA_RGB565_SWAP_ON_THE_FLY
+        // The encoder and the preview swap its bytes themselves
+        case V4L2_PIX_FMT_RGB565X:
+#endif  // CONFIG_XIAOZHI_CAMERA_RGB565_SWAP_ON_THE_FLY
+            format = sensor_format_;
+            break;
+        case V4L2_PIX_FMT_YUV422P:
+            // 这个格式是 422 YUYV，不是 planer
+            format = V4L2_PIX_FMT_YUYV;
+            break;
+#endif  // CONFIG_XIAOZHI_ENABLE_CAMERA_ENDIANNESS_SWAP
+        default:
+            // RGB565X needs its bytes swapped
+            return false;
+    }
+    ReleaseFrame();
+    frame_.owner = buf;
+    frame_.data = (uint8_t*)mmap_buffers_[buf->index].start;
+    frame_.len = buf->bytesused;
+    frame_.format = format;
+    return true;
+#endif
+}
+#endif  // CONFIG_XIAOZHI_CAMERA_STREAMING
+
+std::shared_ptr<uint8_t> EspVideo::BufferPool::Acquire() {
+    for (auto& buffer : buffers) {
+        if (buffer.use_count() == 1) {
+            return buffer;
+        }
+    }
+    auto data = (uint8_t*)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT | MALLOC_CAP_CACHE_ALIGNED);
+    if (data == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes for a frame buffer", (unsigned)size);
+        return nullptr;
+    }
+    std::shared_ptr<uint8_t> buffer(data, heap_caps_free);
+    // Once every buffer of the pool is held, e.g. by previews in the chat, the extra ones are freed after use
+    if (buffers.size() < count) {
+        buffers.push_back(buffer);
+    }
+    return buffer;
+}
+
+bool EspVideo::ColorConverter::Process(const esp_imgfx_color_convert_cfg_t& config, uint8_t* input, size_t input_len,
+                                       uint8_t* output, size_t output_len) {
+    if (handle != nullptr && memcmp(&cfg, &config, sizeof(cfg)) != 0) {
+        esp_imgfx_color_convert_close(handle);
+        handle = nullptr;
+    }
+    if (handle == nullptr) {
+        esp_imgfx_err_t err = esp_imgfx_color_convert_open(&config, &handle);
+        if (err != ESP_IMGFX_ERR_OK || handle == nullptr) {
+            ESP_LOGE(TAG, "esp_imgfx_color_convert_open failed");
+            handle = nullptr;
+            return false;
+        }
+        cfg = config;
+    }
+    esp_imgfx_data_t input_data = {
+        .data = input,
+        .data_len = static_cast<uint32_t>(input_len),
+    };
+    esp_imgfx_data_t output_data = {
+        .data = output,
+        .data_len = static_cast<uint32_t>(output_len),
+    };
+    if (esp_imgfx_color_convert_process(handle, &input_data, &output_data) != ESP_IMGFX_ERR_OK) {
+        ESP_LOGE(TAG, "esp_imgfx_color_convert_process failed");
+        return false;
+    }
+    return true;
+}
+
+EspVideo::ColorConverter::~ColorConverter() {
+    if (handle != nullptr) {
+        esp_imgfx_color_convert_close(handle);
+    }
+}
+
+// Copies the frame out of the V4L2 buffer, the caller queues the buffer again
+bool EspVideo::StoreFrame(const struct v4l2_buffer& buf) {
+    // 保存帧副本到PSRAM
+    ReleaseFrame();
+    auto output = frame_pool_.Acquire();
+    if (!output) {
+        return false;
+    }
 
 #ifdef CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
-            ESP_LOGW(TAG, "mmap_buffers_[buf.index].length = %d, sensor_width = %d, sensor_height = %d",
-                     mmap_buffers_[buf.index].length, sensor_width_, sensor_height_);
+    ESP_LOGW(TAG, "mmap_buffers_[buf.index].length = %d, sensor_width = %d, sensor_height = %d",
+             mmap_buffers_[buf.index].length, sensor_width_, sensor_height_);
+    // The rotation reads the V4L2 buffer itself unless its bytes are swapped first
+    uint8_t* copy = rotate_input_;
+    if (copy == nullptr) {
+        return false;
+    }
 #else
-            ESP_LOGW(TAG, "mmap_buffers_[buf.index].length = %d, frame.width = %d, frame.height = %d",
-                     mmap_buffers_[buf.index].length, frame_.width, frame_.height);
+    ESP_LOGW(TAG, "mmap_buffers_[buf.index].length = %d, frame.width = %d, frame.height = %d",
+             mmap_buffers_[buf.index].length, frame_.width, frame_.height);
+    uint8_t* copy = output.get();
 #endif  // CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
-            ESP_LOG_BUFFER_HEXDUMP(TAG, mmap_buffers_[buf.index].start, MIN(mmap_buffers_[buf.index].length, 256),
-                                   ESP_LOG_DEBUG);
-
-            switch (sensor_format_) {
-                case V4L2_PIX_FMT_RGB565:
-                case V4L2_PIX_FMT_RGB24:
-                case V4L2_PIX_FMT_YUYV:
-                case V4L2_PIX_FMT_YUV420:
-                case V4L2_PIX_FMT_GREY:
+    ESP_LOG_BUFFER_HEXDUMP(TAG, mmap_buffers_[buf.index].start, MIN(mmap_buffers_[buf.index].length, 256),
+                           ESP_LOG_DEBUG);
+
+    uint8_t* src = (uint8_t*)mmap_buffers_[buf.index].start;
+    size_t len = MIN(buf.bytesused, mmap_buffers_[buf.index].length);
+    switch (sensor_format_) {
+        case V4L2_PIX_FMT_RGB565:
+        case V4L2_PIX_FMT_RGB24:
+        case V4L2_PIX_FMT_YUYV:
+        case V4L2_PIX_FMT_YUV420:
+        case V4L2_PIX_FMT_GREY:
 #ifdef CONFIG_XIAOZHI_CAMERA_ALLOW_JPEG_INPUT
-                case V4L2_PIX_FMT_JPEG:
+        case V4L2_PIX_FMT_JPEG:
 #endif  // CONFIG_XIAOZHI_CAMERA_ALLOW_JPEG_INPUT
+            frame_.format = sensor_format_;
+            break;
+        case V4L2_PIX_FMT_YUV422P:
+            // 这个格式是 422 YUYV，不是 planer
+            frame_.format = V4L2_PIX_FMT_YUYV;
+            break;
+        case V4L2_PIX_FMT_RGB565X:
+            // 大端序的 RGB565 需要转换为小端序
+            // 目前 esp_video 的大小端都会返回格式为 RGB565，不会返回格式为 RGB565X，此 case 用于未来版本兼容
+            frame_.format = V4L2_PIX_FMT_RGB565;
+            break;
+        default:
+            ESP_LOGE(TAG, "unsupported sensor format: 0x%08lx", sensor_format_);
+            return false;
+    }
 #ifdef CONFIG_XIAOZHI_ENABLE_CAMERA_ENDIANNESS_SWAP
-                {
-                    auto src16 = (uint16_t*)mmap_buffers_[buf.index].start;
-                    auto dst16 = (uint16_t*)frame_.data;
-                    size_t count = (size_t)mmap_buffers_[buf.index].length / 2;
-                    for (size_t i = 0; i < count; i++) {
-                        dst16[i] = __builtin_bswap16(src16[i]);
-                    }
-                }
-#else
-                    memcpy(frame_.data, mmap_buffers_[buf.index].start,
-                           MIN(mmap_buffers_[buf.index].length, frame_.len));
-#endif  // CONFIG_XIAOZHI_ENABLE_CAMERA_ENDIANNESS_SWAP
-                    frame_.format = sensor_format_;
-                    break;
-                case V4L2_PIX_FMT_YUV422P: {
-                    // 这个格式是 422 YUYV，不是 planer
-                    frame_.format = V4L2_PIX_FMT_YUYV;
-#ifdef CONFIG_XIAOZHI_ENABLE_CAMERA_ENDIANNESS_SWAP
-                    {
-                        auto src16 = (uint16_t*)mmap_buffers_[buf.index].start;
-                        auto dst16 = (uint16_t*)frame_.data;
-                        size_t count = (size_t)mmap_buffers_[buf.index].length / 2;
-                        for (size_t i = 0; i < count; i++) {
-                            dst16[i] = __builtin_bswap16(src16[i]);
-                        }
-                    }
+    bool swap_bytes = true;
 #else
-                    memcpy(frame_.data, mmap_buffers_[buf.index].start,
-                           MIN(mmap_buffers_[buf.index].length, frame_.len));
+    bool swap_bytes = sensor_format_ == V4L2_PIX_FMT_RGB565X;
 #endif  // CONFIG_XIAOZHI_ENABLE_CAMERA_ENDIANNESS_SWAP
-                    break;
-                }
-                case V4L2_PIX_FMT_RGB565X: {
-                    // 大端序的 RGB565 需要转换为小端序
-                    // 目前 esp_video 的大小端都会返回格式为 RGB565，不会返回格式为 RGB565X，此 case 用于未来版本兼容
-                    auto src16 = (uint16_t*)mmap_buffers_[buf.index].start;
-                    auto dst16 = (uint16_t*)frame_.data;
-                    size_t pixel_count = (size_t)frame_.width * (size_t)frame_.height;
-                    for (size_t i = 0; i < pixel_count; i++) {
-                        dst16[i] = __builtin_bswap16(src16[i]);
-                    }
-                    frame_.format = V4L2_PIX_FMT_RGB565;
-                    break;
-                }
-                default:
-                    ESP_LOGE(TAG, "unsupported sensor format: 0x%08lx", sensor_format_);
-                    if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                        ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                    }
-                    return false;
-            }
+#if defined(CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE) && defined(CONFIG_SOC_PPA_SUPPORTED)
+    // The PPA swaps RGB565 while it rotates, the V4L2 buffer is read as it is
+    bool ppa_byte_swap = swap_bytes && frame_.format == V4L2_PIX_FMT_RGB565;
+    swap_bytes = swap_bytes && !ppa_byte_swap;
+    // YUYV is converted into rotate_input_, so it is swapped into the frame buffer the PPA writes last
+    if (frame_.format == V4L2_PIX_FMT_YUYV) {
+        copy = output.get();
+    }
+#endif
+    if (swap_bytes) {
+        swap_bytes_16(copy, src, len / 2);
+        src = copy;
+    }
 
-#ifdef CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
-#ifndef CONFIG_SOC_PPA_SUPPORTED
-            uint8_t* rotate_dst =
-                (uint8_t*)heap_caps_aligned_alloc(64, frame_.len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-            if (rotate_dst == nullptr) {
-                ESP_LOGE(TAG, "Failed to allocate memory for rotate image");
-                if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                    ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                }
-                return false;
-            }
-            uint8_t* rotate_src = (uint8_t*)frame_.data;
-
-            esp_imgfx_rotate_cfg_t rotate_cfg = {
-                .in_res =
-                    {
-                        .width = static_cast<int16_t>(sensor_width_),
-                        .height = static_cast<int16_t>(sensor_height_),
-                    },
-                .degree = IMAGE_ROTATION_ANGLE,
-            };
-            switch (frame_.format) {
-                case V4L2_PIX_FMT_RGB565:
-                    rotate_cfg.in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB565_LE;
-                    break;
-                case V4L2_PIX_FMT_YUYV:
-                    rotate_cfg.in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB565_LE;
-                    break;
-                case V4L2_PIX_FMT_GREY:
-                    rotate_cfg.in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_Y;
-                    break;
-                case V4L2_PIX_FMT_RGB24:
-                    rotate_cfg.in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB888;
-                    break;
-                default:
-                    ESP_LOGE(TAG, "unsupported sensor format: 0x%08lx", sensor_format_);
-                    if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                        ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                    }
-                    return false;
-            }
-            esp_imgfx_rotate_handle_t rotate_handle = nullptr;
-            esp_imgfx_err_t imgfx_err = esp_imgfx_rotate_open(&rotate_cfg, &rotate_handle);
-            if (imgfx_err != ESP_IMGFX_ERR_OK || rotate_handle == nullptr) {
-                ESP_LOGE(TAG, "esp_imgfx_rotate_create failed");
-                if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                    ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                }
-                return false;
-            }
+#ifndef CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
+    if (src != output.get()) {
+        memcpy(output.get(), src, len);
+    }
+    frame_.len = len;
+#elif !defined(CONFIG_SOC_PPA_SUPPORTED)
+    esp_imgfx_pixel_fmt_t pixel_fmt;
+    switch (frame_.format) {
+        case V4L2_PIX_FMT_RGB565:
+            pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB565_LE;
+            break;
+        case V4L2_PIX_FMT_YUYV:
+            pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB565_LE;
+            break;
+        case V4L2_PIX_FMT_GREY:
+            pixel_fmt = ESP_IMGFX_PIXEL_FMT_Y;
+            break;
+        case V4L2_PIX_FMT_RGB24:
+            pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB888;
+            break;
+        default:
+            ESP_LOGE(TAG, "unsupported sensor format: 0x%08lx", sensor_format_);
+            return false;
+    }
+    // The rotator is opened once and again only if the pixel format changes
+    if (rotate_handle_ != nullptr && rotate_pixel_fmt_ != pixel_fmt) {
+        esp_imgfx_rotate_close(rotate_handle_);
+        rotate_handle_ = nullptr;
+    }
+    if (rotate_handle_ == nullptr) {
+        esp_imgfx_rotate_cfg_t rotate_cfg = {
+            .in_pixel_fmt = pixel_fmt,
+            .in_res =
+                {
+                    .width = static_cast<int16_t>(sensor_width_),
+                    .height = static_cast<int16_t>(sensor_height_),
+                },
+            .degree = IMAGE_ROTATION_ANGLE,
+        };
+        esp_imgfx_err_t imgfx_err = esp_imgfx_rotate_open(&rotate_cfg, &rotate_handle_);
+        if (imgfx_err != ESP_IMGFX_ERR_OK || rotate_handle_ == nullptr) {
+            ESP_LOGE(TAG, "esp_imgfx_rotate_create failed");
+            rotate_handle_ = nullptr;
+            return false;
+        }
+        rotate_pixel_fmt_ = pixel_fmt;
+    }
 
-            esp_imgfx_data_t rotate_input_data = {
-                .data = rotate_src,
-                .data_len = frame_.len,
-            };
-            esp_imgfx_data_t rotate_output_data = {
-                .data = rotate_dst,
-                .data_len = frame_.len,
+    esp_imgfx_data_t rotate_input_data = {
+        .data = src,
+        .data_len = static_cast<uint32_t>(len),
+    };
+    esp_imgfx_data_t rotate_output_data = {
+        .data = output.get(),
+        .data_len = static_cast<uint32_t>(len),
+    };
+    if (esp_imgfx_rotate_process(rotate_handle_, &rotate_input_data, &rotate_output_data) != ESP_IMGFX_ERR_OK) {
+        ESP_LOGE(TAG, "esp_imgfx_rotate_process failed");
+        return false;
+    }
+    frame_.len = len;
+#else   // CONFIG_SOC_PPA_SUPPORTED
+    ppa_srm_color_mode_t ppa_color_mode;
+    switch (frame_.format) {
+        case V4L2_PIX_FMT_RGB565:
+            ppa_color_mode = PPA_SRM_COLOR_MODE_RGB565;
+            break;
+        case V4L2_PIX_FMT_RGB24:
+            ppa_color_mode = PPA_SRM_COLOR_MODE_RGB888;
+            break;
+        case V4L2_PIX_FMT_YUYV: {
+            ESP_LOGW(TAG, "YUYV format is not supported for PPA rotation, using software conversion to RGB888");
+            esp_imgfx_color_convert_cfg_t convert_cfg = {
+                .in_res = {.width = static_cast<int16_t>(sensor_width_),
+                           .height = static_cast<int16_t>(sensor_height_)},
+                .in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_YUYV,
+                .out_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB888,
             };
-
-            imgfx_err = esp_imgfx_rotate_process(rotate_handle, &rotate_input_data, &rotate_output_data);
-            if (imgfx_err != ESP_IMGFX_ERR_OK) {
-                ESP_LOGE(TAG, "esp_imgfx_rotate_process failed");
-                heap_caps_free(rotate_dst);
-                rotate_dst = nullptr;
-                if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                    ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                }
-                esp_imgfx_rotate_close(rotate_handle);
-                rotate_handle = nullptr;
+            if (!rotate_converter_.Process(convert_cfg, src, len, rotate_input_, frame_.width * frame_.height * 3)) {
                 return false;
             }
+            src = rotate_input_;
+            ppa_color_mode = PPA_SRM_COLOR_MODE_RGB888;
+            break;
+        }
+        default:
+            ESP_LOGE(TAG, "unsupported sensor format for PPA rotation: 0x%08lx", sensor_format_);
+            return false;
+    }
 
-            frame_.data = rotate_dst;
+    ppa_srm_oper_config_t srm_cfg = {};
+    srm_cfg.in.buffer = (void*)src;
+    srm_cfg.in.pic_w = sensor_width_;
+    srm_cfg.in.pic_h = sensor_height_;
+    srm_cfg.in.block_w = sensor_width_;
+    srm_cfg.in.block_h = sensor_height_;
+    srm_cfg.in.block_offset_x = 0;
+    srm_cfg.in.block_offset_y = 0;
+    srm_cfg.in.srm_cm = ppa_color_mode;
+    srm_cfg.byte_swap = ppa_byte_swap;
+
+    srm_cfg.out.buffer = (void*)output.get();
+    srm_cfg.out.buffer_size = frame_pool_.size;
+    srm_cfg.out.pic_w = frame_.width;
+    srm_cfg.out.pic_h = frame_.height;
+    srm_cfg.out.block_offset_x = 0;
+    srm_cfg.out.block_offset_y = 0;
+    srm_cfg.out.srm_cm = PPA_SRM_COLOR_MODE_RGB565;
+
+    // 等比例缩放 1.0
+    srm_cfg.scale_x = 1.0f;
+    srm_cfg.scale_y = 1.0f;
+    srm_cfg.rotation_angle = IMAGE_ROTATION_ANGLE;
+    srm_cfg.mode = PPA_TRANS_MODE_BLOCKING;
+    srm_cfg.user_data = nullptr;
+
+    esp_err_t err = ppa_do_scale_rotate_mirror(ppa_client_, &srm_cfg);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "ppa_do_scale_rotate_mirror failed: %d", (int)err);
+        return false;
+    }
+    frame_.len = frame_.width * frame_.height * 2;
+    frame_.format = V4L2_PIX_FMT_RGB565;
+#endif  // CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
 
-            heap_caps_free(rotate_src);
-            rotate_src = nullptr;
+    frame_.owner = output;
+    frame_.data = output.get();
+    return true;
+}
 
-            esp_imgfx_rotate_close(rotate_handle);
-            rotate_handle = nullptr;
-#else   // CONFIG_SOC_PPA_SUPPORTED
-            uint8_t* rotate_src = nullptr;
-
-            ppa_srm_color_mode_t ppa_color_mode;
-            switch (frame_.format) {
-                case V4L2_PIX_FMT_RGB565:
-                    rotate_src = (uint8_t*)frame_.data;
-                    ppa_color_mode = PPA_SRM_COLOR_MODE_RGB565;
-                    break;
-                case V4L2_PIX_FMT_RGB24:
-                    rotate_src = (uint8_t*)frame_.data;
-                    ppa_color_mode = PPA_SRM_COLOR_MODE_RGB888;
-                    break;
-                case V4L2_PIX_FMT_YUYV: {
-                    ESP_LOGW(TAG, "YUYV format is not supported for PPA rotation, using software conversion to RGB888");
-                    rotate_src = (uint8_t*)heap_caps_malloc(frame_.width * frame_.height * 3,
-                                                            MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-                    if (rotate_src == nullptr) {
-                        ESP_LOGE(TAG, "Failed to allocate memory for rotate image");
-                        if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                            ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                        }
-                        return false;
-                    }
-                    esp_imgfx_color_convert_cfg_t convert_cfg = {
-                        .in_res = {.width = static_cast<int16_t>(frame_.width),
-                                   .height = static_cast<int16_t>(frame_.height)},
-                        .in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_YUYV,
-                        .out_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB888,
-                    };
-                    esp_imgfx_color_convert_handle_t convert_handle = nullptr;
-                    esp_imgfx_err_t err = esp_imgfx_color_convert_open(&convert_cfg, &convert_handle);
-                    if (err != ESP_IMGFX_ERR_OK || convert_handle == nullptr) {
-                        ESP_LOGE(TAG, "esp_imgfx_color_convert_open failed");
-                        heap_caps_free(rotate_src);
-                        rotate_src = nullptr;
-                        if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                            ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                        }
-                        return false;
-                    }
-                    esp_imgfx_data_t convert_input_data = {
-                        .data = frame_.data,
-                        .data_len = frame_.len,
-                    };
-                    esp_imgfx_data_t convert_output_data = {
-                        .data = rotate_src,
-                        .data_len = static_cast<uint32_t>(frame_.width * frame_.height * 3),
-                    };
-                    err = esp_imgfx_color_convert_process(convert_handle, &convert_input_data, &convert_output_data);
-                    if (err != ESP_IMGFX_ERR_OK) {
-                        ESP_LOGE(TAG, "esp_imgfx_color_convert_process failed");
-                        heap_caps_free(rotate_src);
-                        rotate_src = nullptr;
-                        esp_imgfx_color_convert_close(convert_handle);
-                        convert_handle = nullptr;
-                        if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                            ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                        }
-                        return false;
-                    }
-                    esp_imgfx_color_convert_close(convert_handle);
-                    convert_handle = nullptr;
-                    ppa_color_mode = PPA_SRM_COLOR_MODE_RGB888;
-                    heap_caps_free(frame_.data);
-                    frame_.data = rotate_src;
-                    frame_.len = frame_.width * frame_.height * 3;
-                    break;
-                }
-                default:
-                    ESP_LOGE(TAG, "unsupported sensor format for PPA rotation: 0x%08lx", sensor_format_);
-                    if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                        ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                    }
-                    return false;
-            }
+// Converts and scales the frame to RGB565 of at most the given size, in a single PPA pass where the format allows
+std::unique_ptr<LvglImage> EspVideo::CreatePreview(int max_width, int max_height) {
+    uint16_t w = frame_.width;
+    uint16_t h = frame_.height;
+    lv_color_format_t color_format = LV_COLOR_FORMAT_RGB565;
 
-            uint8_t* rotate_dst = (uint8_t*)heap_caps_malloc(
-                frame_.width * frame_.height * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT | MALLOC_CAP_CACHE_ALIGNED);
-            if (rotate_dst == nullptr) {
-                ESP_LOGE(TAG, "Failed to allocate memory for rotate image");
-                if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                    ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                }
-                return false;
+#ifdef CONFIG_XIAOZHI_CAMERA_ALLOW_JPEG_INPUT
+    if (frame_.format == V4L2_PIX_FMT_JPEG) {
+        uint8_t* out_data = nullptr;  // out data is allocated by jpeg_to_image
+        size_t out_len = 0;
+        size_t out_width = 0;
+        size_t out_height = 0;
+        size_t out_stride = 0;
+
+        esp_err_t ret = jpeg_to_image(frame_.data, frame_.len, &out_data, &out_len, &out_width, &out_height, &out_stride);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to decode JPEG image: %d (%s)", (int)ret, esp_err_to_name(ret));
+            if (out_data) {
+                heap_caps_free(out_data);
+                out_data = nullptr;
             }
+            return nullptr;
+        }
+        return std::make_unique<LvglAllocatedImage>(out_data, out_len, out_width, out_height, out_stride, color_format);
+    }
+#endif  // CONFIG_XIAOZHI_CAMERA_ALLOW_JPEG_INPUT
 
-            ppa_client_handle_t ppa_client = nullptr;
-            ppa_client_config_t client_cfg = {
-                .oper_type = PPA_OPERATION_SRM,
-                .max_pending_trans_num = 1,
-            };
-            esp_err_t err = ppa_register_client(&client_cfg, &ppa_client);
-            if (err != ESP_OK || ppa_client == nullptr) {
-                ESP_LOGE(TAG, "ppa_register_client failed: %d", (int)err);
-                heap_caps_free(rotate_dst);
-                rotate_dst = nullptr;
-                if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                    ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                }
-                return false;
-            }
+    // The frame is scaled down by a power of two to fit the display, which the PPA scales by exactly
+    int divisor = 1;
+    while (divisor < 8 && max_width > 0 && max_height > 0 && (w / divisor > max_width || h / divisor > max_height)) {
+        divisor *= 2;
+    }
+#ifdef CONFIG_SOC_PPA_SUPPORTED
+    if (ppa_client_ == nullptr) {
+        divisor = 1;
+    }
+#endif  // CONFIG_SOC_PPA_SUPPORTED
 
-            ppa_srm_rotation_angle_t ppa_angle = IMAGE_ROTATION_ANGLE;
-
-            ppa_srm_oper_config_t srm_cfg = {};
-            srm_cfg.in.buffer = (void*)rotate_src;
-            srm_cfg.in.pic_w = sensor_width_;
-            srm_cfg.in.pic_h = sensor_height_;
-            srm_cfg.in.block_w = sensor_width_;
-            srm_cfg.in.block_h = sensor_height_;
-            srm_cfg.in.block_offset_x = 0;
-            srm_cfg.in.block_offset_y = 0;
-            srm_cfg.in.srm_cm = ppa_color_mode;
-
-            srm_cfg.out.buffer = (void*)rotate_dst;
-            srm_cfg.out.buffer_size = frame_.len;
-            srm_cfg.out.pic_w = frame_.width;
-            srm_cfg.out.pic_h = frame_.height;
-            srm_cfg.out.block_offset_x = 0;
-            srm_cfg.out.block_offset_y = 0;
-            srm_cfg.out.srm_cm = PPA_SRM_COLOR_MODE_RGB565;
-
-            // 等比例缩放 1.0
-            srm_cfg.scale_x = 1.0f;
-            srm_cfg.scale_y = 1.0f;
-            srm_cfg.rotation_angle = ppa_angle;
-            srm_cfg.mode = PPA_TRANS_MODE_BLOCKING;
-            srm_cfg.user_data = nullptr;
-
-            err = ppa_do_scale_rotate_mirror(ppa_client, &srm_cfg);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "ppa_do_scale_rotate_mirror failed: %d", (int)err);
-                heap_caps_free(rotate_dst);
-                rotate_dst = nullptr;
-                (void)ppa_unregister_client(ppa_client);
-                if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
-                    ESP_LOGE(TAG, "Cleanup: VIDIOC_QBUF failed");
-                }
-                return false;
-            }
+    std::shared_ptr<void> holder = frame_.owner;
+    uint8_t* source = frame_.data;
+    bool convert = false;
+    bool swap = false;
+    switch (frame_.format) {
+        case V4L2_PIX_FMT_RGB565:
+            break;
+        case V4L2_PIX_FMT_RGB565X:
+            // Swapped while it is scaled, or after, the preview is smaller than the frame
+            swap = true;
+            break;
+        case V4L2_PIX_FMT_RGB24:
+        case V4L2_PIX_FMT_YUV420:
+#ifdef CONFIG_SOC_PPA_SUPPORTED
+            // The PPA converts these while it scales
+            convert = divisor == 1;
+#else
+            convert = true;
+#endif  // CONFIG_SOC_PPA_SUPPORTED
+            break;
+        // LVGL 显示 YUV 系的图像似乎都有问题，暂时转换为 RGB565 显示
+        case V4L2_PIX_FMT_YUYV:
+            convert = true;
+            break;
+        default:
+            ESP_LOGE(TAG, "unsupported frame format: 0x%08lx", frame_.format);
+            return nullptr;
+    }
 
-            (void)ppa_unregister_client(ppa_client);
+    if (convert) {
+        auto converted = preview_pool_.Acquire();
+        if (!converted) {
+            return nullptr;
+        }
+        esp_imgfx_color_convert_cfg_t convert_cfg = {
+            .in_res = {.width = static_cast<int16_t>(w), .height = static_cast<int16_t>(h)},
+            .in_pixel_fmt = static_cast<esp_imgfx_pixel_fmt_t>(frame_.format),
+            .out_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB565_LE,
+            .color_space_std = ESP_IMGFX_COLOR_SPACE_STD_BT601,
+        };
+        if (!preview_converter_.Process(convert_cfg, frame_.data, frame_.len, converted.get(), w * h * 2)) {
+            return nullptr;
+        }
+        holder = converted;
+        source = converted.get();
+    }
 
-            frame_.data = rotate_dst;
-            frame_.len = frame_.width * frame_.height * 2;
-            frame_.format = V4L2_PIX_FMT_RGB565;
-            heap_caps_free(rotate_src);
-            rotate_src = nullptr;
+#ifdef CONFIG_SOC_PPA_SUPPORTED
+    if (divisor > 1) {
+        ppa_srm_color_mode_t ppa_color_mode = PPA_SRM_COLOR_MODE_RGB565;
+        if (!convert && frame_.format == V4L2_PIX_FMT_RGB24) {
+            ppa_color_mode = PPA_SRM_COLOR_MODE_RGB888;
+        } else if (!convert && frame_.format == V4L2_PIX_FMT_YUV420) {
+            ppa_color_mode = PPA_SRM_COLOR_MODE_YUV420;
+        }
+        auto scaled = preview_pool_.Acquire();
+        if (!scaled) {
+            return nullptr;
+        }
+        // An even width keeps the rows 4-byte aligned for LVGL
+        uint16_t scaled_w = (w / divisor) & ~1;
+        uint16_t scaled_h = h / divisor;
+
+        ppa_srm_oper_config_t srm_cfg = {};
+        srm_cfg.in.buffer = (void*)source;
+        srm_cfg.in.pic_w = w;
+        srm_cfg.in.pic_h = h;
+        srm_cfg.in.block_w = scaled_w * divisor;
+        srm_cfg.in.block_h = scaled_h * divisor;
+        srm_cfg.in.srm_cm = ppa_color_mode;
+        srm_cfg.byte_swap = swap;
+        srm_cfg.out.buffer = (void*)scaled.get();
+        srm_cfg.out.buffer_size = preview_pool_.size;
+        srm_cfg.out.pic_w = scaled_w;
+        srm_cfg.out.pic_h = scaled_h;
+        srm_cfg.out.srm_cm = PPA_SRM_COLOR_MODE_RGB565;
+        srm_cfg.scale_x = 1.0f / divisor;
+        srm_cfg.scale_y = 1.0f / divisor;
+        srm_cfg.rotation_angle = PPA_SRM_ROTATION_ANGLE_0;
+        srm_cfg.mode = PPA_TRANS_MODE_BLOCKING;
+
+        esp_err_t err = ppa_do_scale_rotate_mirror(ppa_client_, &srm_cfg);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "ppa_do_scale_rotate_mirror failed: %d", (int)err);
+            return nullptr;
+        }
+        holder = scaled;
+        source = scaled.get();
+        w = scaled_w;
+        h = scaled_h;
+        swap = false;
+    }
+#else
+    if (divisor > 1) {
+        auto scaled = preview_pool_.Acquire();
+        size_t scaled_len = 0;
+        if (scaled && DownscaleFrame(source, w, h, V4L2_PIX_FMT_RGB565, divisor, scaled.get(), &w, &h, &scaled_len)) {
+            holder = scaled;
+            source = scaled.get();
+        }
+    }
 #endif  // CONFIG_SOC_PPA_SUPPORTED
-#endif  // CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
+
+    if (swap) {
+        if (source == frame_.data) {
+            auto swapped = preview_pool_.Acquire();
+            if (!swapped) {
+                return nullptr;
+            }
+            swap_bytes_16(swapped.get(), source, w * h);
+            holder = swapped;
+            source = swapped.get();
+        } else {
+            swap_bytes_16(source, source, w * h);
         }
+    }
+
+    size_t stride = ((w * 2) + 3) & ~3;  // 4字节对齐
+    return std::make_unique<LvglSharedImage>(holder, source, w * h * 2, w, h, stride, color_format);
+}
 
+bool EspVideo::Capture() {
+    explainer_.WaitForEncoder();
+
+    if (!streaming_on_ || video_fd_ < 0) {
+        return false;
+    }
+
+#ifdef CONFIG_XIAOZHI_CAMERA_STREAMING
+    std::shared_ptr<struct v4l2_buffer> buf;
+    {
+        // Only the first capture after start up waits, later ones take the frame at hand
+        std::unique_lock<std::mutex> lock(stream_mutex_);
+        if (!stream_cv_.wait_for(lock, std::chrono::seconds(1), [this] { return latest_frame_ != nullptr; })) {
+            ESP_LOGE(TAG, "No frame from the camera stream");
+            return false;
+        }
+        buf = latest_frame_;
+    }
+    if (!BorrowFrame(buf) && !StoreFrame(*buf)) {
+        return false;
+    }
+#else
+    for (int i = 0; i < 3; i++) {
+        struct v4l2_buffer buf = {};
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        if (ioctl(video_fd_, VIDIOC_DQBUF, &buf) != 0) {
+            ESP_LOGE(TAG, "VIDIOC_DQBUF failed");
+            return false;
+        }
+        bool stored = i != 2 || StoreFrame(buf);
         if (ioctl(video_fd_, VIDIOC_QBUF, &buf) != 0) {
             ESP_LOGE(TAG, "VIDIOC_QBUF failed");
         }
+        if (!stored) {
+            return false;
+        }
     }
+#endif  // CONFIG_XIAOZHI_CAMERA_STREAMING
 
     // 显示预览图片
     auto display = dynamic_cast<LvglDisplay*>(Board::GetInstance().GetDisplay());
@@ -736,105 +1021,10 @@ bool EspVideo::Capture() {
             ESP_LOGE(TAG, "frame.data is null");
             return false;
         }
-        uint16_t w = frame_.width;
-        uint16_t h = frame_.height;
-        size_t lvgl_image_size = frame_.len;
-        size_t stride = ((w * 2) + 3) & ~3;  // 4字节对齐
-        lv_color_format_t color_format = LV_COLOR_FORMAT_RGB565;
-        uint8_t* data = nullptr;
-
-        switch (frame_.format) {
-            // LVGL 显示 YUV 系的图像似乎都有问题，暂时转换为 RGB565 显示
-            case V4L2_PIX_FMT_YUYV:
-            case V4L2_PIX_FMT_YUV420:
-            case V4L2_PIX_FMT_RGB24: {
-                color_format = LV_COLOR_FORMAT_RGB565;
-                data = (uint8_t*)heap_caps_malloc(w * h * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-                if (data == nullptr) {
-                    ESP_LOGE(TAG, "Failed to allocate memory for preview image");
-                    return false;
-                }
-                esp_imgfx_color_convert_cfg_t convert_cfg = {
-                    .in_res = {.width = static_cast<int16_t>(frame_.width),
-                               .height = static_cast<int16_t>(frame_.height)},
-                    .in_pixel_fmt = static_cast<esp_imgfx_pixel_fmt_t>(frame_.format),
-                    .out_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB565_LE,
-                    .color_space_std = ESP_IMGFX_COLOR_SPACE_STD_BT601,
-                };
-                esp_imgfx_color_convert_handle_t convert_handle = nullptr;
-                esp_imgfx_err_t err = esp_imgfx_color_convert_open(&convert_cfg, &convert_handle);
-                if (err != ESP_IMGFX_ERR_OK || convert_handle == nullptr) {
-                    ESP_LOGE(TAG, "esp_imgfx_color_convert_open failed");
-                    heap_caps_free(data);
-                    data = nullptr;
-                    return false;
-                }
-                esp_imgfx_data_t convert_input_data = {
-                    .data = frame_.data,
-                    .data_len = frame_.len,
-                };
-                esp_imgfx_data_t convert_output_data = {
-                    .data = data,
-                    .data_len = static_cast<uint32_t>(w * h * 2),
-                };
-                err = esp_imgfx_color_convert_process(convert_handle, &convert_input_data, &convert_output_data);
-                if (err != ESP_IMGFX_ERR_OK) {
-                    ESP_LOGE(TAG, "esp_imgfx_color_convert_process failed");
-                    heap_caps_free(data);
-                    data = nullptr;
-                    esp_imgfx_color_convert_close(convert_handle);
-                    convert_handle = nullptr;
-                    return false;
-                }
-                esp_imgfx_color_convert_close(convert_handle);
-                convert_handle = nullptr;
-                lvgl_image_size = w * h * 2;
-                break;
-            }
-
-            case V4L2_PIX_FMT_RGB565:
-                data = (uint8_t*)heap_caps_malloc(w * h * 2, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-                if (data == nullptr) {
-                    ESP_LOGE(TAG, "Failed to allocate memory for preview image");
-                    return false;
-                }
-                memcpy(data, frame_.data, frame_.len);
-                lvgl_image_size = frame_.len;  // fallthrough 时兼顾 YUYV 与 RGB565
-                break;
-
-#ifdef CONFIG_XIAOZHI_CAMERA_ALLOW_JPEG_INPUT
-            case V4L2_PIX_FMT_JPEG: {
-                uint8_t* out_data = nullptr;  // out data is allocated by jpeg_to_image
-                size_t out_len = 0;
-                size_t out_width = 0;
-                size_t out_height = 0;
-                size_t out_stride = 0;
-
-                esp_err_t ret =
-                    jpeg_to_image(frame_.data, frame_.len, &out_data, &out_len, &out_width, &out_height, &out_stride);
-                if (ret != ESP_OK) {
-                    ESP_LOGE(TAG, "Failed to decode JPEG image: %d (%s)", (int)ret, esp_err_to_name(ret));
-                    if (out_data) {
-                        heap_caps_free(out_data);
-                        out_data = nullptr;
-                    }
-                    return false;
-                }
-
-                data = out_data;
-                w = out_width;
-                h = out_height;
-                lvgl_image_size = out_len;
-                stride = out_stride;
-                break;
-            }
-#endif
-            default:
-                ESP_LOGE(TAG, "unsupported frame format: 0x%08lx", frame_.format);
-                return false;
+        auto image = CreatePreview(display->width(), display->height());
+        if (!image) {
+            return false;
         }
-
-        auto image = std::make_unique<LvglAllocatedImage>(data, lvgl_image_size, w, h, stride, color_format);
         display->SetPreviewImage(std::move(image));
     }
     return true;
@@ -898,144 +1088,12 @@ bool EspVideo::SetVFlip(bool enabled) {
  * @warning 如果摄像头缓冲区为空或网络连接失败，将返回错误信息
  */
 std::string EspVideo::Explain(const std::string& question) {
-    if (explain_url_.empty()) {
-        throw std::runtime_error("Image explain URL or token is not set");
-    }
-
-    // 创建局部的 JPEG 队列, 40 entries is about to store 512 * 40 = 20480 bytes of JPEG data
-    QueueHandle_t jpeg_queue = xQueueCreate(40, sizeof(JpegChunk));
-    if (jpeg_queue == nullptr) {
-        ESP_LOGE(TAG, "Failed to create JPEG queue");
-        throw std::runtime_error("Failed to create JPEG queue");
-    }
-
-    // We spawn a thread to encode the image to JPEG using optimized encoder (cost about 500ms and 8KB SRAM)
-    encoder_thread_ = std::thread([this, jpeg_queue]() {
-        uint16_t w = frame_.width ? frame_.width : 320;
-        uint16_t h = frame_.height ? frame_.height : 240;
-        v4l2_pix_fmt_t enc_fmt = frame_.format;
-        bool ok = image_to_jpeg_cb(
-            frame_.data, frame_.len, w, h, enc_fmt, 80,
-            [](void* arg, size_t index, const void* data, size_t len) -> size_t {
-                auto jpeg_queue = static_cast<QueueHandle_t>(arg);
-                JpegChunk chunk = {.data = nullptr, .len = len};
-                if (index == 0 && data != nullptr && len > 0) {
-                    chunk.data = (uint8_t*)heap_caps_aligned_alloc(16, len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
-                    if (chunk.data == nullptr) {
-                        ESP_LOGE(TAG, "Failed to allocate %zu bytes for JPEG chunk", len);
-                        chunk.len = 0;
-                    } else {
-                        memcpy(chunk.data, data, len);
-                    }
-                } else {
-                    chunk.len = 0;  // Sentinel or error
-                }
-                xQueueSend(jpeg_queue, &chunk, portMAX_DELAY);
-                return len;
-            },
-            jpeg_queue);
-
-        if (!ok) {
-            JpegChunk chunk = {.data = nullptr, .len = 0};
-            xQueueSend(jpeg_queue, &chunk, portMAX_DELAY);
-        }
-    });
-
-    auto network = Board::GetInstance().GetNetwork();
-    auto http = network->CreateHttp(3);
-    // 构造multipart/form-data请求体
-    std::string boundary = "----ESP32_CAMERA_BOUNDARY";
-
-    // 配置HTTP客户端，使用分块传输编码
-    http->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
-    http->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
-    if (!explain_token_.empty()) {
-        http->SetHeader("Authorization", "Bearer " + explain_token_);
-    }
-    http->SetHeader("Content-Type", "multipart/form-data; boundary=" + boundary);
-    http->SetHeader("Transfer-Encoding", "chunked");
-    if (!http->Open("POST", explain_url_)) {
-        ESP_LOGE(TAG, "Failed to connect to explain URL");
-        // Clear the queue
-        encoder_thread_.join();
-        JpegChunk chunk;
-        while (xQueueReceive(jpeg_queue, &chunk, portMAX_DELAY) == pdPASS) {
-            if (chunk.data != nullptr) {
-                heap_caps_free(chunk.data);
-            } else {
-                break;
-            }
-        }
-        vQueueDelete(jpeg_queue);
-        throw std::runtime_error("Failed to connect to explain URL");
-    }
-
-    {
-        // 第一块：question字段
-        std::string question_field;
-        question_field += "--" + boundary + "\r\n";
-        question_field += "Content-Disposition: form-data; name=\"question\"\r\n";
-        question_field += "\r\n";
-        question_field += question + "\r\n";
-        http->Write(question_field.c_str(), question_field.size());
-    }
-    {
-        // 第二块：文件字段头部
-        std::string file_header;
-        file_header += "--" + boundary + "\r\n";
-        file_header += "Content-Disposition: form-data; name=\"file\"; filename=\"camera.jpg\"\r\n";
-        file_header += "Content-Type: image/jpeg\r\n";
-        file_header += "\r\n";
-        http->Write(file_header.c_str(), file_header.size());
-    }
-
-    // 第三块：JPEG数据
-    size_t total_sent = 0;
-    bool saw_terminator = false;
-    while (true) {
-        JpegChunk chunk;
-        if (xQueueReceive(jpeg_queue, &chunk, portMAX_DELAY) != pdPASS) {
-            ESP_LOGE(TAG, "Failed to receive JPEG chunk");
-            break;
-        }
-        if (chunk.data == nullptr) {
-            saw_terminator = true;
-            break;  // The last chunk
-        }
-        http->Write((const char*)chunk.data, chunk.len);
-        total_sent += chunk.len;
-        heap_caps_free(chunk.data);
-    }
-    // Wait for the encoder thread to finish
-    encoder_thread_.join();
-    // 清理队列
-    vQueueDelete(jpeg_queue);
-
-    if (!saw_terminator || total_sent == 0) {
-        ESP_LOGE(TAG, "JPEG encoder failed or produced empty output");
-        throw std::runtime_error("Failed to encode image to JPEG");
-    }
-
-    {
-        // 第四块：multipart尾部
-        std::string multipart_footer;
-        multipart_footer += "\r\n--" + boundary + "--\r\n";
-        http->Write(multipart_footer.c_str(), multipart_footer.size());
-    }
-    // 结束块
-    http->Write("", 0);
-
-    if (http->GetStatusCode() != 200) {
-        ESP_LOGE(TAG, "Failed to upload photo, status code: %d", http->GetStatusCode());
-        throw std::runtime_error("Failed to upload photo");
-    }
-
-    std::string result = http->ReadAll();
-    http->Close();
-
-    // Get remain task stack size
-    size_t remain_stack_size = uxTaskGetStackHighWaterMark(nullptr);
-    ESP_LOGI(TAG, "Explain image size=%d bytes, compressed size=%d, remain stack size=%d, question=%s\n%s",
-             (int)frame_.len, (int)total_sent, (int)remain_stack_size, question.c_str(), result.c_str());
-    return result;
+    CameraFrame frame = {
+        .data = frame_.data,
+        .len = frame_.len,
+        .width = frame_.width ? frame_.width : (uint16_t)320,
+        .height = frame_.height ? frame_.height : (uint16_t)240,
+        .format = frame_.format,
+    };
+    return explainer_.Explain(frame, question);
 }
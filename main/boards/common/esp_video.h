@@ -5,18 +5,26 @@
 #include <thread>
 #include <memory>
 #include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/task.h>
 
 #include "camera.h"
 #include "jpg/image_to_jpeg.h"
+#include "camera_explainer.h"
 #include "esp_video_init.h"
-
-struct JpegChunk {
-    uint8_t* data;
-    size_t len;
-};
+#include "linux/videodev2.h"
+#include "esp_imgfx_color_convert.h"
+#include "lvgl_image.h"
+#ifdef CONFIG_SOC_PPA_SUPPORTED
+#include "driver/ppa.h"
+#elif defined(CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE)
+#include "esp_imgfx_rotate.h"
+#endif  // CONFIG_SOC_PPA_SUPPORTED
 
 class EspVideo : public Camera {
 private:
@@ -26,6 +34,8 @@ private:
         uint16_t width = 0;
         uint16_t height = 0;
         v4l2_pix_fmt_t format = 0;
+        // Holds data, a V4L2 buffer of the stream or a buffer of the pool, the preview may share it
+        std::shared_ptr<void> owner;
     } frame_;
     v4l2_pix_fmt_t sensor_format_ = 0;
 #ifdef CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
@@ -36,9 +46,54 @@ private:
     bool streaming_on_ = false;
     struct MmapBuffer { void *start = nullptr; size_t length = 0; };
     std::vector<MmapBuffer> mmap_buffers_;
-    std::string explain_url_;
-    std::string explain_token_;
-    std::thread encoder_thread_;
+    CameraExplainer explainer_;
+
+    // Buffers sized at init, allocated on first use and handed out again once no one holds them
+    struct BufferPool {
+        std::vector<std::shared_ptr<uint8_t>> buffers;
+        size_t size = 0;
+        size_t count = 0;
+        std::shared_ptr<uint8_t> Acquire();
+    };
+    // An imgfx converter kept open while the formats stay the same
+    struct ColorConverter {
+        esp_imgfx_color_convert_handle_t handle = nullptr;
+        esp_imgfx_color_convert_cfg_t cfg = {};
+        bool Process(const esp_imgfx_color_convert_cfg_t& config, uint8_t* input, size_t input_len, uint8_t* output,
+                     size_t output_len);
+        ~ColorConverter();
+    };
+    BufferPool frame_pool_;
+    BufferPool preview_pool_;
+    ColorConverter preview_converter_;
+#ifdef CONFIG_SOC_PPA_SUPPORTED
+    ppa_client_handle_t ppa_client_ = nullptr;
+#endif  // CONFIG_SOC_PPA_SUPPORTED
+#ifdef CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
+    // The rotation input when the bytes of the V4L2 buffer are swapped or converted first
+    uint8_t* rotate_input_ = nullptr;
+#ifdef CONFIG_SOC_PPA_SUPPORTED
+    ColorConverter rotate_converter_;
+#else
+    esp_imgfx_rotate_handle_t rotate_handle_ = nullptr;
+    esp_imgfx_pixel_fmt_t rotate_pixel_fmt_ = ESP_IMGFX_PIXEL_FMT_RGB565_LE;
+#endif  // CONFIG_SOC_PPA_SUPPORTED
+#endif  // CONFIG_XIAOZHI_ENABLE_ROTATE_CAMERA_IMAGE
+#ifdef CONFIG_XIAOZHI_CAMERA_STREAMING
+    // The latest dequeued buffer, queued again once neither the stream nor a consumer holds it
+    std::shared_ptr<struct v4l2_buffer> latest_frame_;
+    std::mutex stream_mutex_;
+    std::condition_variable stream_cv_;
+    std::atomic<bool> stream_stop_ = false;
+    TaskHandle_t stream_task_ = nullptr;
+
+    void StreamTask();
+    bool BorrowFrame(const std::shared_ptr<struct v4l2_buffer>& buf);
+#endif  // CONFIG_XIAOZHI_CAMERA_STREAMING
+
+    bool StoreFrame(const struct v4l2_buffer& buf);
+    void ReleaseFrame();
+    std::unique_ptr<LvglImage> CreatePreview(int max_width, int max_height);
 
 public:
     EspVideo(const esp_video_init_config_t& config);
@@ -0,0 +1,103 @@
+#include "i2c_bus_scheduler.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <string>
+
+#define TAG "I2cBusScheduler"
+
+I2cBusScheduler::Transaction::Transaction(i2c_master_bus_handle_t bus, I2cPriority priority, size_t bytes)
+    : bytes_(bytes) {
+    auto& scheduler = I2cBusScheduler::GetInstance();
+    bus_ = scheduler.Acquire(bus, priority);
+    start_us_ = esp_timer_get_time();
+}
+
+I2cBusScheduler::Transaction::~Transaction() {
+    I2cBusScheduler::GetInstance().Release(bus_, esp_timer_get_time() - start_us_, bytes_);
+}
+
+bool I2cBusScheduler::HigherWaitingLocked(const Bus& bus, I2cPriority priority) const {
+    for (int i = 0; i < priority; i++) {
+        if (bus.waiting[i] > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int I2cBusScheduler::Acquire(i2c_master_bus_handle_t handle, I2cPriority priority) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = std::find_if(buses_.begin(), buses_.end(), [handle](const Bus& bus) {
+        return bus.handle == handle;
+    });
+    if (it == buses_.end()) {
+        buses_.push_back(Bus{handle});
+        buses_.back().window_start_us = esp_timer_get_time();
+        it = buses_.end() - 1;
+    }
+    int index = it - buses_.begin();
+    auto& bus = buses_[index];
+    if (!bus.busy && !HigherWaitingLocked(bus, priority)) {
+        bus.busy = true;
+        return index;
+    }
+
+    int64_t wait_start_us = esp_timer_get_time();
+    bus.contended++;
+    bus.waiting[priority]++;
+    // The vector only grows under the lock, the reference is taken again after each wait
+    released_.wait(lock, [this, index, priority]() {
+        auto& bus = buses_[index];
+        return !bus.busy && !HigherWaitingLocked(bus, priority);
+    });
+    auto& granted = buses_[index];
+    granted.waiting[priority]--;
+    granted.busy = true;
+    granted.max_wait_us[priority] = std::max(granted.max_wait_us[priority], esp_timer_get_time() - wait_start_us);
+    return index;
+}
+
+void I2cBusScheduler::Release(int index, int64_t busy_us, size_t bytes) {
+    bool notify;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& bus = buses_[index];
+        bus.busy = false;
+        bus.transactions++;
+        bus.bytes += bytes;
+        bus.busy_us += busy_us;
+        bus.window_busy_us += busy_us;
+        notify = std::any_of(std::begin(bus.waiting), std::end(bus.waiting), [](int count) { return count > 0; });
+    }
+    if (notify) {
+        released_.notify_all();
+    }
+}
+
+cJSON* I2cBusScheduler::GetStatsJson() {
+    static const char* const kPriorityNames[kI2cPriorityCount] = {"audio", "touch", "default"};
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now_us = esp_timer_get_time();
+    auto json = cJSON_CreateArray();
+    for (auto& bus : buses_) {
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "transactions", bus.transactions);
+        cJSON_AddNumberToObject(item, "contended", bus.contended);
+        cJSON_AddNumberToObject(item, "bytes", bus.bytes);
+        cJSON_AddNumberToObject(item, "busy_ms", bus.busy_us / 1000);
+        int64_t window_us = now_us - bus.window_start_us;
+        cJSON_AddNumberToObject(item, "utilization_percent",
+            window_us > 0 ? bus.window_busy_us * 100.0 / window_us : 0);
+        auto max_wait = cJSON_CreateObject();
+        for (int i = 0; i < kI2cPriorityCount; i++) {
+            cJSON_AddNumberToObject(max_wait, kPriorityNames[i], bus.max_wait_us[i] / 1000.0);
+        }
+        cJSON_AddItemToObject(item, "max_wait_ms", max_wait);
+        cJSON_AddItemToArray(json, item);
+        bus.window_start_us = now_us;
+        bus.window_busy_us = 0;
+    }
+    return json;
+}
@@ -0,0 +1,81 @@
+#ifndef I2C_BUS_SCHEDULER_H
+#define I2C_BUS_SCHEDULER_H
+
+#include <driver/i2c_master.h>
+#include <cJSON.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// The order a busy bus is given to the waiting devices, the lower first
+enum I2cPriority {
+    kI2cPriorityAudio = 0,  // The codec and its amplifier switches, a late one is heard
+    kI2cPriorityTouch,      // A late one is a laggy touch
+    kI2cPriorityDefault,    // The PMIC, chargers, expanders and the rest
+    kI2cPriorityCount,
+};
+
+/*
+ * Orders the transactions of the I2cDevice instances on a shared bus by priority. The driver
+ * serves the waiters of its bus lock the order they came, so a PMIC poll or an expander update
+ * could delay a touch read; here the bus goes to the highest waiting priority first. A batch of
+ * register writes of a device is one grant, nothing of another device runs between them.
+ *
+ * The devices added through esp_codec_dev or esp_lcd_touch do not go through here, their
+ * transfers still only take the driver lock.
+ *
+ * The busy time of each bus over the last stats read is reported for get_performance_stats.
+ */
+class I2cBusScheduler {
+public:
+    static I2cBusScheduler& GetInstance() {
+        static I2cBusScheduler instance;
+        return instance;
+    }
+
+    class Transaction {
+    public:
+        Transaction(i2c_master_bus_handle_t bus, I2cPriority priority, size_t bytes);
+        ~Transaction();
+        Transaction(const Transaction&) = delete;
+        Transaction& operator=(const Transaction&) = delete;
+
+    private:
+        int bus_;
+        int64_t start_us_;
+        size_t bytes_;
+    };
+
+    cJSON* GetStatsJson();
+
+private:
+    struct Bus {
+        i2c_master_bus_handle_t handle;
+        bool busy = false;
+        int waiting[kI2cPriorityCount] = {};
+        uint32_t transactions = 0;
+        uint32_t contended = 0;
+        uint64_t bytes = 0;
+        int64_t busy_us = 0;
+        int64_t max_wait_us[kI2cPriorityCount] = {};
+        // Since the last stats read, for the utilization
+        int64_t window_start_us = 0;
+        int64_t window_busy_us = 0;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable released_;
+    std::vector<Bus> buses_;
+
+    I2cBusScheduler() = default;
+    I2cBusScheduler(const I2cBusScheduler&) = delete;
+    I2cBusScheduler& operator=(const I2cBusScheduler&) = delete;
+
+    int Acquire(i2c_master_bus_handle_t handle, I2cPriority priority);
+    void Release(int bus, int64_t busy_us, size_t bytes);
+    bool HigherWaitingLocked(const Bus& bus, I2cPriority priority) const;
+};
+
+#endif // I2C_BUS_SCHEDULER_H
@@ -1,11 +1,17 @@
 #include "i2c_device.h"
 
 #include <esp_log.h>
+#include <algorithm>
+#include <cstring>
 
 #define TAG "I2cDevice"
 
+// The longest burst sent from the stack, a longer run is split
+#define I2C_DEVICE_MAX_BURST 32
 
-I2cDevice::I2cDevice(i2c_master_bus_handle_t i2c_bus, uint8_t addr) {
+
+I2cDevice::I2cDevice(i2c_master_bus_handle_t i2c_bus, uint8_t addr, I2cPriority priority)
+    : i2c_bus_(i2c_bus), priority_(priority) {
     i2c_device_config_t i2c_device_cfg = {
         .dev_addr_length = I2C_ADDR_BIT_LEN_7,
         .device_address = addr,
@@ -21,15 +27,50 @@ I2cDevice::I2cDevice(i2c_master_bus_handle_t i2c_bus, uint8_t addr) {
 
 void I2cDevice::WriteReg(uint8_t reg, uint8_t value) {
     uint8_t buffer[2] = {reg, value};
+    I2cBusScheduler::Transaction transaction(i2c_bus_, priority_, 2);
     ESP_ERROR_CHECK(i2c_master_transmit(i2c_device_, buffer, 2, 100));
 }
 
 uint8_t I2cDevice::ReadReg(uint8_t reg) {
     uint8_t buffer[1];
+    I2cBusScheduler::Transaction transaction(i2c_bus_, priority_, 2);
     ESP_ERROR_CHECK(i2c_master_transmit_receive(i2c_device_, &reg, 1, buffer, 1, 100));
     return buffer[0];
 }
 
 void I2cDevice::ReadRegs(uint8_t reg, uint8_t* buffer, size_t length) {
+    I2cBusScheduler::Transaction transaction(i2c_bus_, priority_, 1 + length);
     ESP_ERROR_CHECK(i2c_master_transmit_receive(i2c_device_, &reg, 1, buffer, length, 100));
-}
\ No newline at end of file
+}
+
+void I2cDevice::WriteRegs(uint8_t reg, const uint8_t* values, size_t length) {
+    uint8_t buffer[1 + I2C_DEVICE_MAX_BURST];
+    I2cBusScheduler::Transaction transaction(i2c_bus_, priority_, length + (length + I2C_DEVICE_MAX_BURST - 1) / I2C_DEVICE_MAX_BURST);
+    while (length > 0) {
+        size_t burst = std::min<size_t>(length, I2C_DEVICE_MAX_BURST);
+        buffer[0] = reg;
+        memcpy(buffer + 1, values, burst);
+        ESP_ERROR_CHECK(i2c_master_transmit(i2c_device_, buffer, 1 + burst, 100));
+        reg += burst;
+        values += burst;
+        length -= burst;
+    }
+}
+
+void I2cDevice::WriteRegs(const RegValue* writes, size_t count, bool auto_increment) {
+    uint8_t buffer[1 + I2C_DEVICE_MAX_BURST];
+    I2cBusScheduler::Transaction transaction(i2c_bus_, priority_, count * 2);
+    size_t i = 0;
+    while (i < count) {
+        size_t length = 1;
+        buffer[0] = writes[i].reg;
+        buffer[1] = writes[i].value;
+        while (auto_increment && i + length < count && length < I2C_DEVICE_MAX_BURST &&
+               writes[i + length].reg == (uint8_t)(writes[i].reg + length)) {
+            buffer[1 + length] = writes[i + length].value;
+            length++;
+        }
+        ESP_ERROR_CHECK(i2c_master_transmit(i2c_device_, buffer, 1 + length, 100));
+        i += length;
+    }
+}
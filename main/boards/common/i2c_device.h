@@ -3,16 +3,30 @@
 
 #include <driver/i2c_master.h>
 
+#include "i2c_bus_scheduler.h"
+
 class I2cDevice {
 public:
-    I2cDevice(i2c_master_bus_handle_t i2c_bus, uint8_t addr);
+    I2cDevice(i2c_master_bus_handle_t i2c_bus, uint8_t addr, I2cPriority priority = kI2cPriorityDefault);
 
 protected:
+    struct RegValue {
+        uint8_t reg;
+        uint8_t value;
+    };
+
+    i2c_master_bus_handle_t i2c_bus_;
     i2c_master_dev_handle_t i2c_device_;
+    I2cPriority priority_;
 
     void WriteReg(uint8_t reg, uint8_t value);
     uint8_t ReadReg(uint8_t reg);
     void ReadRegs(uint8_t reg, uint8_t* buffer, size_t length);
+    // Consecutive registers in one transfer, for a device that increments the address
+    void WriteRegs(uint8_t reg, const uint8_t* values, size_t length);
+    // In one grant of the bus, the runs of consecutive registers go as one transfer each if
+    // the device increments the address
+    void WriteRegs(const RegValue* writes, size_t count, bool auto_increment = false);
 };
 
 #endif // I2C_DEVICE_H
@@ -0,0 +1,70 @@
+#include "input_events.h"
+#include "application.h"
+#include "perf_counters.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "InputEvents"
+
+static_assert((INPUT_EVENT_QUEUE_SIZE & (INPUT_EVENT_QUEUE_SIZE - 1)) == 0, "INPUT_EVENT_QUEUE_SIZE must be a power of two");
+
+InputEvents::InputEvents() {
+    // A cell is free for the post of its index, and holds an event once its sequence is one more
+    for (uint32_t i = 0; i < INPUT_EVENT_QUEUE_SIZE; i++) {
+        cells_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    latency_ = PerfCounters::GetInstance().Histogram("input_latency_us");
+}
+
+bool InputEvents::Post(Handler handler, void* target, int value) {
+    uint32_t position = head_.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+        cell = &cells_[position & (INPUT_EVENT_QUEUE_SIZE - 1)];
+        int32_t diff = (int32_t)(cell->sequence.load(std::memory_order_acquire) - position);
+        if (diff == 0) {
+            if (head_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The main task has not taken the event posted a lap ago
+            if (dropped_.fetch_add(1, std::memory_order_relaxed) == 0) {
+                ESP_LOGW(TAG, "The input queue is full, the main task is stuck");
+            }
+            return false;
+        } else {
+            position = head_.load(std::memory_order_relaxed);
+        }
+    }
+    cell->event = {handler, target, value, esp_timer_get_time()};
+    cell->sequence.store(position + 1, std::memory_order_release);
+
+    if (!drain_scheduled_.exchange(true)) {
+        Application::GetInstance().Schedule([this]() {
+            Drain();
+        }, kSchedulePriorityUrgent);
+    }
+    return true;
+}
+
+bool InputEvents::Pop(Event& event) {
+    auto& cell = cells_[tail_ & (INPUT_EVENT_QUEUE_SIZE - 1)];
+    if (cell.sequence.load(std::memory_order_acquire) != tail_ + 1) {
+        return false;
+    }
+    event = cell.event;
+    cell.sequence.store(tail_ + INPUT_EVENT_QUEUE_SIZE, std::memory_order_release);
+    tail_++;
+    return true;
+}
+
+void InputEvents::Drain() {
+    // An event posted from here on schedules another drain
+    drain_scheduled_.store(false);
+    Event event;
+    while (Pop(event)) {
+        latency_->Record(esp_timer_get_time() - event.time_us);
+        event.handler(event.target, event.value);
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef INPUT_EVENTS_H_
+#define INPUT_EVENTS_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+class PerfHistogram;
+
+// A power of two
+#define INPUT_EVENT_QUEUE_SIZE 32
+
+/*
+ * The queue that brings the events of the buttons, the knobs and the touch panels to the main
+ * task.
+ *
+ * The drivers debounce and recognize the gestures (click, multiple click, long press) in their
+ * own timer context, and post the result here instead of running the board code there. The
+ * queue is lock free and may be posted to from several tasks. The events are handled by the
+ * main task in the order they were posted, from the urgent lane of the scheduler, so a press
+ * is handled before the queued UI refreshes however busy the main loop is.
+ *
+ * The time from a post to its handling is recorded in the "input_latency_us" histogram.
+ */
+class InputEvents {
+public:
+    // Called by the main task with the target and the value of the event
+    using Handler = void (*)(void* target, int value);
+
+    static InputEvents& GetInstance() {
+        static InputEvents instance;
+        return instance;
+    }
+
+    // From any task but an ISR. false if the queue is full, the event is dropped
+    bool Post(Handler handler, void* target, int value = 0);
+
+private:
+    struct Event {
+        Handler handler;
+        void* target;
+        int value;
+        int64_t time_us;
+    };
+
+    struct Cell {
+        std::atomic<uint32_t> sequence;
+        Event event;
+    };
+
+    std::array<Cell, INPUT_EVENT_QUEUE_SIZE> cells_;
+    std::atomic<uint32_t> head_ = 0;
+    uint32_t tail_ = 0;     // Only the main task pops
+    std::atomic<bool> drain_scheduled_ = false;
+    std::atomic<uint32_t> dropped_ = 0;
+    PerfHistogram* latency_;
+
+    InputEvents();
+    bool Pop(Event& event);
+    void Drain();
+};
+
+#endif // INPUT_EVENTS_H_
@@ -0,0 +1,83 @@
+#include "jpeg_stream.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "JpegStream"
+
+JpegStream::JpegStream() {
+    slices_ = xQueueCreate(JPEG_STREAM_QUEUE_LENGTH, sizeof(Slice));
+    released_ = xSemaphoreCreateCounting(JPEG_STREAM_QUEUE_LENGTH + 1, 0);
+    if (!valid()) {
+        ESP_LOGE(TAG, "Failed to create the JPEG stream");
+    }
+}
+
+JpegStream::~JpegStream() {
+    if (slices_ != nullptr) {
+        vQueueDelete(slices_);
+    }
+    if (released_ != nullptr) {
+        vSemaphoreDelete(released_);
+    }
+}
+
+size_t JpegStream::OnJpegOutput(void* arg, size_t index, const void* data, size_t len) {
+    // Index 1 is the end signal, the stream ends with Finish()
+    if (index == 0 && data != nullptr && len > 0) {
+        static_cast<JpegStream*>(arg)->Write(static_cast<const uint8_t*>(data), len);
+    }
+    return len;
+}
+
+void JpegStream::Write(const uint8_t* data, size_t len) {
+    // The queue blocks once the uploader is JPEG_STREAM_QUEUE_LENGTH slices behind
+    size_t pending = 0;
+    for (size_t offset = 0; offset < len; offset += JPEG_STREAM_SLICE_SIZE) {
+        Slice slice = {data + offset, std::min<size_t>(len - offset, JPEG_STREAM_SLICE_SIZE)};
+        xQueueSend(slices_, &slice, portMAX_DELAY);
+        pending++;
+        // Collect the releases on the way, so the semaphore count stays within its limit
+        while (pending > 0 && xSemaphoreTake(released_, 0) == pdTRUE) {
+            pending--;
+        }
+    }
+    // The encoder frees its buffer once this returns
+    while (pending > 0) {
+        xSemaphoreTake(released_, portMAX_DELAY);
+        pending--;
+    }
+}
+
+void JpegStream::Finish(bool ok) {
+    succeeded_ = ok;
+    Slice end = {nullptr, 0};
+    xQueueSend(slices_, &end, portMAX_DELAY);
+}
+
+bool JpegStream::Read(const uint8_t*& data, size_t& len) {
+    if (ended_) {
+        return false;
+    }
+    Slice slice;
+    xQueueReceive(slices_, &slice, portMAX_DELAY);
+    if (slice.data == nullptr) {
+        ended_ = true;
+        return false;
+    }
+    data = slice.data;
+    len = slice.len;
+    return true;
+}
+
+void JpegStream::Release() {
+    xSemaphoreGive(released_);
+}
+
+void JpegStream::Drain() {
+    const uint8_t* data;
+    size_t len;
+    while (Read(data, len)) {
+        Release();
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef _JPEG_STREAM_H_
+#define _JPEG_STREAM_H_
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// The JPEG goes to the uploader in slices of this size, at most this many queued at once
+#define JPEG_STREAM_SLICE_SIZE 4096
+#define JPEG_STREAM_QUEUE_LENGTH 4
+
+/*
+ * Hands the output of image_to_jpeg_cb() from the encoder thread to the uploader without copying it.
+ *
+ * The encoder output is cut into slices that point into the encoder buffer. The callback only
+ * returns, and lets the encoder free its buffer, once the uploader released every slice, so the
+ * encoder is held back by the upload instead of buffering the image a second time.
+ *
+ * OnJpegOutput() and Finish() are called by the encoder thread, the rest by the uploader, which
+ * must read or Drain() up to the end so the encoder thread can finish.
+ */
+class JpegStream {
+public:
+    JpegStream();
+    ~JpegStream();
+
+    bool valid() const { return slices_ != nullptr && released_ != nullptr; }
+
+    // The jpg_out_cb of image_to_jpeg_cb(), with the stream as its argument
+    static size_t OnJpegOutput(void* arg, size_t index, const void* data, size_t len);
+    // Ends the stream after image_to_jpeg_cb() returned
+    void Finish(bool ok);
+
+    // The next slice, false at the end of the stream
+    bool Read(const uint8_t*& data, size_t& len);
+    // Done with the slice from Read()
+    void Release();
+    // Releases everything up to the end of the stream
+    void Drain();
+    // Whether the encoder succeeded, valid once Read() returned false
+    bool succeeded() const { return succeeded_; }
+
+private:
+    struct Slice {
+        const uint8_t* data;    // nullptr ends the stream
+        size_t len;
+    };
+
+    QueueHandle_t slices_ = nullptr;
+    SemaphoreHandle_t released_ = nullptr;
+    std::atomic<bool> succeeded_ = false;
+    bool ended_ = false;    // Uploader only
+
+    void Write(const uint8_t* data, size_t len);
+};
+
+#endif // _JPEG_STREAM_H_
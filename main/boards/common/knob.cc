@@ -1,4 +1,5 @@
 #include "knob.h"
+#include "input_events.h"
 
 static const char* TAG = "Knob";
 
@@ -43,10 +44,11 @@ void Knob::OnRotate(std::function<void(bool)> callback) {
 }
 
 void Knob::knob_callback(void* arg, void* data) {
-    Knob* knob = static_cast<Knob*>(data);
     knob_event_t event = iot_knob_get_event(arg);
-    
-    if (knob->on_rotate_) {
-        knob->on_rotate_(event == KNOB_RIGHT);
-    }
+    InputEvents::GetInstance().Post([](void* target, int clockwise) {
+        Knob* knob = static_cast<Knob*>(target);
+        if (knob->on_rotate_) {
+            knob->on_rotate_(clockwise != 0);
+        }
+    }, data, event == KNOB_RIGHT);
 }
\ No newline at end of file
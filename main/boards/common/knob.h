@@ -6,6 +6,7 @@
 #include <esp_log.h>
 #include <iot_knob.h>
 
+// The rotations are handled by the main task, from the InputEvents queue
 class Knob {
 public:
     Knob(gpio_num_t pin_a, gpio_num_t pin_b);
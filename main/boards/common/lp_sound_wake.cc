@@ -0,0 +1,117 @@
+#include "lp_sound_wake.h"
+
+#include <esp_log.h>
+#include <esp_sleep.h>
+#include <algorithm>
+
+#if CONFIG_LP_SOUND_WAKE
+#include <ulp_lp_core.h>
+#include <ulp_lp_core_lp_adc_shared.h>
+#include "ulp_lp_sound_wake.h"
+
+extern const uint8_t lp_sound_wake_bin_start[] asm("_binary_lp_sound_wake_bin_start");
+extern const uint8_t lp_sound_wake_bin_end[] asm("_binary_lp_sound_wake_bin_end");
+#endif
+
+#define TAG "LpSoundWake"
+
+// The block the LP core measures the energy of
+#define LP_SOUND_WAKE_BLOCK_SAMPLES 64
+// Samples kept before the trigger, the size of pre_roll in ulp/lp_sound_wake.c
+#define LP_SOUND_WAKE_PRE_ROLL_SAMPLES 2048
+
+LpSoundWake::LpSoundWake(adc_unit_t adc_unit, adc_channel_t adc_channel, int sample_rate,
+    int threshold_x16, int trigger_ms)
+    : adc_unit_(adc_unit), adc_channel_(adc_channel), sample_rate_(sample_rate),
+      threshold_x16_(threshold_x16), trigger_ms_(trigger_ms) {
+}
+
+bool LpSoundWake::Supported() {
+#if CONFIG_LP_SOUND_WAKE
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool LpSoundWake::WokeBySound() {
+#if CONFIG_LP_SOUND_WAKE
+    return esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_ULP;
+#else
+    return false;
+#endif
+}
+
+bool LpSoundWake::Arm() {
+#if CONFIG_LP_SOUND_WAKE
+    esp_err_t err = lp_core_lp_adc_init(adc_unit_);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to init the LP ADC: %s", esp_err_to_name(err));
+        return false;
+    }
+    lp_core_lp_adc_chan_cfg_t channel_config = {
+        .atten = ADC_ATTEN_DB_12,
+        .bitwidth = ADC_BITWIDTH_DEFAULT,
+    };
+    err = lp_core_lp_adc_config_channel(adc_unit_, adc_channel_, &channel_config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to configure the LP ADC channel: %s", esp_err_to_name(err));
+        return false;
+    }
+    err = ulp_lp_core_load_binary(lp_sound_wake_bin_start, lp_sound_wake_bin_end - lp_sound_wake_bin_start);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to load the LP core program: %s", esp_err_to_name(err));
+        return false;
+    }
+
+    /* The loop around each read takes a few microseconds of its own, a little less delay keeps the rate */
+    ulp_adc_unit = adc_unit_;
+    ulp_adc_channel = adc_channel_;
+    ulp_sample_period_us = std::max(1, 1000000 / sample_rate_ - 2);
+    ulp_sample_rate = sample_rate_;
+    ulp_threshold_x16 = threshold_x16_;
+    ulp_trigger_blocks = std::max(1, trigger_ms_ * sample_rate_ / 1000 / LP_SOUND_WAKE_BLOCK_SAMPLES);
+
+    ulp_lp_core_cfg_t config = {
+        .wakeup_source = ULP_LP_CORE_WAKEUP_SOURCE_HP_CPU,
+    };
+    err = ulp_lp_core_run(&config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to start the LP core: %s", esp_err_to_name(err));
+        return false;
+    }
+    err = esp_sleep_enable_ulp_wakeup();
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to enable the ULP wake-up: %s", esp_err_to_name(err));
+        return false;
+    }
+    ESP_LOGI(TAG, "Listening on the LP core, %d Hz, threshold %d/16, %lu blocks",
+        sample_rate_, threshold_x16_, ulp_trigger_blocks);
+    return true;
+#else
+    ESP_LOGW(TAG, "Not supported, enable CONFIG_LP_SOUND_WAKE");
+    return false;
+#endif
+}
+
+bool LpSoundWake::ReadPreRoll(std::vector<int16_t>& pcm, int& sample_rate) {
+#if CONFIG_LP_SOUND_WAKE
+    if (!WokeBySound() || ulp_sample_rate == 0) {
+        return false;
+    }
+    sample_rate = ulp_sample_rate;
+    auto ring = (const volatile int16_t*)&ulp_pre_roll;
+    size_t count = std::min<size_t>(ulp_pre_roll_count, LP_SOUND_WAKE_PRE_ROLL_SAMPLES);
+    size_t head = ulp_pre_roll_head % LP_SOUND_WAKE_PRE_ROLL_SAMPLES;
+    size_t start = (head + LP_SOUND_WAKE_PRE_ROLL_SAMPLES - count) % LP_SOUND_WAKE_PRE_ROLL_SAMPLES;
+    pcm.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        pcm[i] = ring[(start + i) % LP_SOUND_WAKE_PRE_ROLL_SAMPLES];
+    }
+    ESP_LOGI(TAG, "Woken by sound, energy %lu over a floor of %lu, %u samples before it",
+        ulp_trigger_energy, ulp_noise_floor, count);
+    return true;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,57 @@
+#ifndef LP_SOUND_WAKE_H
+#define LP_SOUND_WAKE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <hal/adc_types.h>
+#include <sdkconfig.h>
+
+/*
+ * Sound activity wake-up from deep sleep, enabled with CONFIG_LP_SOUND_WAKE.
+ *
+ * The audio input task needs the HP cores, so a board that sleeps deeply could only be woken
+ * by a button. Arm() starts a small detector on the LP core right before the deep sleep: it
+ * samples an analog microphone (or the analog output of a microphone amplifier) on an LP ADC
+ * channel, and wakes the HP cores once the sound stays threshold_x16 / 16 times louder than
+ * the noise floor it learned for trigger_ms. The wake word then runs as usual after the boot.
+ *
+ * The LP memory survives the deep sleep, so after a wake-up by sound ReadPreRoll() returns the
+ * samples before the trigger, taken at sample_rate with the 12 bit LP ADC. The application
+ * hands them to the wake word at the boot, ahead of the microphone, so a wake word that
+ * started before the HP cores were up may still be heard.
+ *
+ * Only for boards with an analog microphone, whose config.h defines LP_SOUND_WAKE_ADC_CHANNEL,
+ * next to the SleepTimer of the board:
+ *
+ *   #if CONFIG_LP_SOUND_WAKE && defined(LP_SOUND_WAKE_ADC_CHANNEL)
+ *   sound_wake_ = new LpSoundWake(ADC_UNIT_1, LP_SOUND_WAKE_ADC_CHANNEL);
+ *   sleep_timer_->SetSoundWake(sound_wake_);
+ *   #endif
+ */
+class LpSoundWake {
+public:
+    LpSoundWake(adc_unit_t adc_unit, adc_channel_t adc_channel, int sample_rate = 4000,
+        int threshold_x16 = 64, int trigger_ms = 48);
+
+    // Always false without CONFIG_LP_SOUND_WAKE
+    static bool Supported();
+    // The last deep sleep ended because the detector heard something
+    static bool WokeBySound();
+
+    // Starts the detector and enables the ULP wake-up, call right before esp_deep_sleep_start()
+    bool Arm();
+    // The samples before the trigger, oldest first, after a wake-up by sound
+    static bool ReadPreRoll(std::vector<int16_t>& pcm, int& sample_rate);
+    int sample_rate() const { return sample_rate_; }
+
+private:
+    adc_unit_t adc_unit_;
+    adc_channel_t adc_channel_;
+    int sample_rate_;
+    int threshold_x16_;
+    int trigger_ms_;
+};
+
+#endif // LP_SOUND_WAKE_H
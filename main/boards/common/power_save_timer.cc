@@ -1,6 +1,8 @@
 #include "power_save_timer.h"
 #include "application.h"
 #include "settings.h"
+#include "wakeup_coalescer.h"
+#include "power_governor.h"
 
 #include <esp_log.h>
 
@@ -9,22 +11,14 @@
 
 PowerSaveTimer::PowerSaveTimer(int cpu_max_freq, int seconds_to_sleep, int seconds_to_shutdown)
     : cpu_max_freq_(cpu_max_freq), seconds_to_sleep_(seconds_to_sleep), seconds_to_shutdown_(seconds_to_shutdown) {
-    esp_timer_create_args_t timer_args = {
-        .callback = [](void* arg) {
-            auto self = static_cast<PowerSaveTimer*>(arg);
-            self->PowerSaveCheck();
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "power_save_timer",
-        .skip_unhandled_events = true,
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &power_save_timer_));
+    job_ = WakeupCoalescer::GetInstance().Add("power_save", 1000, [this](int periods) {
+        PowerSaveCheck(periods);
+    });
+    PowerGovernor::GetInstance().SetMaxFrequency(cpu_max_freq_);
 }
 
 PowerSaveTimer::~PowerSaveTimer() {
-    esp_timer_stop(power_save_timer_);
-    esp_timer_delete(power_save_timer_);
+    WakeupCoalescer::GetInstance().Remove(job_);
 }
 
 void PowerSaveTimer::SetEnabled(bool enabled) {
@@ -37,10 +31,10 @@ void PowerSaveTimer::SetEnabled(bool enabled) {
 
         ticks_ = 0;
         enabled_ = enabled;
-        ESP_ERROR_CHECK(esp_timer_start_periodic(power_save_timer_, 1000000));
+        WakeupCoalescer::GetInstance().Start(job_);
         ESP_LOGI(TAG, "Power save timer enabled");
     } else if (!enabled && enabled_) {
-        ESP_ERROR_CHECK(esp_timer_stop(power_save_timer_));
+        WakeupCoalescer::GetInstance().Stop(job_);
         enabled_ = enabled;
         WakeUp();
         ESP_LOGI(TAG, "Power save timer disabled");
@@ -59,18 +53,20 @@ void PowerSaveTimer::OnShutdownRequest(std::function<void()> callback) {
     on_shutdown_request_ = callback;
 }
 
-void PowerSaveTimer::PowerSaveCheck() {
+void PowerSaveTimer::PowerSaveCheck(int periods) {
     auto& app = Application::GetInstance();
     if (!in_sleep_mode_ && !app.CanEnterSleepMode()) {
         ticks_ = 0;
         return;
     }
 
-    ticks_++;
+    ticks_ += periods;
     if (seconds_to_sleep_ != -1 && ticks_ >= seconds_to_sleep_) {
         if (!in_sleep_mode_) {
             ESP_LOGI(TAG, "Enabling power save mode");
             in_sleep_mode_ = true;
+            // Nothing shows the seconds now, the periodic work may wait for long wake windows
+            WakeupCoalescer::GetInstance().SetSleeping(true);
             if (on_enter_sleep_mode_) {
                 on_enter_sleep_mode_();
             }
@@ -89,12 +85,16 @@ void PowerSaveTimer::PowerSaveCheck() {
                     codec->EnableInput(false);
                 }
 
-                esp_pm_config_t pm_config = {
-                    .max_freq_mhz = cpu_max_freq_,
-                    .min_freq_mhz = 40,
-                    .light_sleep_enable = true,
-                };
-                esp_pm_configure(&pm_config);
+                if (PowerGovernor::GetInstance().enabled()) {
+                    PowerGovernor::GetInstance().SetLightSleep(true);
+                } else {
+                    esp_pm_config_t pm_config = {
+                        .max_freq_mhz = cpu_max_freq_,
+                        .min_freq_mhz = 40,
+                        .light_sleep_enable = true,
+                    };
+                    esp_pm_configure(&pm_config);
+                }
             }
         }
     }
@@ -108,14 +108,20 @@ void PowerSaveTimer::WakeUp() {
     if (in_sleep_mode_) {
         ESP_LOGI(TAG, "Exiting power save mode");
         in_sleep_mode_ = false;
+        WakeupCoalescer::GetInstance().SetSleeping(false);
 
         if (cpu_max_freq_ != -1) {
-            esp_pm_config_t pm_config = {
-                .max_freq_mhz = cpu_max_freq_,
-                .min_freq_mhz = cpu_max_freq_,
-                .light_sleep_enable = false,
-            };
-            esp_pm_configure(&pm_config);
+            if (PowerGovernor::GetInstance().enabled()) {
+                // The governor scales the frequency while awake
+                PowerGovernor::GetInstance().SetLightSleep(false);
+            } else {
+                esp_pm_config_t pm_config = {
+                    .max_freq_mhz = cpu_max_freq_,
+                    .min_freq_mhz = cpu_max_freq_,
+                    .light_sleep_enable = false,
+                };
+                esp_pm_configure(&pm_config);
+            }
 
             // Enable wake word detection
             auto& app = Application::GetInstance();
@@ -17,9 +17,9 @@ public:
     void WakeUp();
 
 private:
-    void PowerSaveCheck();
+    void PowerSaveCheck(int periods);
 
-    esp_timer_handle_t power_save_timer_ = nullptr;
+    int job_ = -1;
     bool enabled_ = false;
     bool in_sleep_mode_ = false;
     bool is_wake_word_running_ = false;
@@ -3,6 +3,8 @@
 #include "board.h"
 #include "display.h"
 #include "settings.h"
+#include "wakeup_coalescer.h"
+#include "lp_sound_wake.h"
 
 #include <esp_log.h>
 #include <esp_sleep.h>
@@ -13,22 +15,13 @@
 
 SleepTimer::SleepTimer(int seconds_to_light_sleep, int seconds_to_deep_sleep)
     : seconds_to_light_sleep_(seconds_to_light_sleep), seconds_to_deep_sleep_(seconds_to_deep_sleep) {
-    esp_timer_create_args_t timer_args = {
-        .callback = [](void* arg) {
-            auto self = static_cast<SleepTimer*>(arg);
-            self->CheckTimer();
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "sleep_timer",
-        .skip_unhandled_events = true,
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &sleep_timer_));
+    job_ = WakeupCoalescer::GetInstance().Add("sleep", 1000, [this](int periods) {
+        CheckTimer(periods);
+    });
 }
 
 SleepTimer::~SleepTimer() {
-    esp_timer_stop(sleep_timer_);
-    esp_timer_delete(sleep_timer_);
+    WakeupCoalescer::GetInstance().Remove(job_);
 }
 
 void SleepTimer::SetEnabled(bool enabled) {
@@ -41,10 +34,10 @@ void SleepTimer::SetEnabled(bool enabled) {
 
         ticks_ = 0;
         enabled_ = enabled;
-        ESP_ERROR_CHECK(esp_timer_start_periodic(sleep_timer_, 1000000));
+        WakeupCoalescer::GetInstance().Start(job_);
         ESP_LOGI(TAG, "Sleep timer enabled");
     } else if (!enabled && enabled_) {
-        ESP_ERROR_CHECK(esp_timer_stop(sleep_timer_));
+        WakeupCoalescer::GetInstance().Stop(job_);
         enabled_ = enabled;
         WakeUp();
         ESP_LOGI(TAG, "Sleep timer disabled");
@@ -63,17 +56,18 @@ void SleepTimer::OnEnterDeepSleepMode(std::function<void()> callback) {
     on_enter_deep_sleep_mode_ = callback;
 }
 
-void SleepTimer::CheckTimer() {
+void SleepTimer::CheckTimer(int periods) {
     auto& app = Application::GetInstance();
     if (!app.CanEnterSleepMode()) {
         ticks_ = 0;
         return;
     }
 
-    ticks_++;
+    ticks_ += periods;
     if (seconds_to_light_sleep_ != -1 && ticks_ >= seconds_to_light_sleep_) {
         if (!in_light_sleep_mode_) {
             in_light_sleep_mode_ = true;
+            WakeupCoalescer::GetInstance().SetSleeping(true);
             if (on_enter_light_sleep_mode_) {
                 on_enter_light_sleep_mode_();
             }
@@ -118,6 +112,11 @@ void SleepTimer::CheckTimer() {
             on_enter_deep_sleep_mode_();
         }
 
+        // Deep sleep does not run the shutdown handlers
+        SettingsStore::GetInstance().Flush();
+        if (sound_wake_ != nullptr && !sound_wake_->Arm()) {
+            ESP_LOGW(TAG, "Sound wake-up not armed, only the other wake-up sources remain");
+        }
         esp_deep_sleep_start();
     }
 }
@@ -126,6 +125,7 @@ void SleepTimer::WakeUp() {
     ticks_ = 0;
     if (in_light_sleep_mode_) {
         in_light_sleep_mode_ = false;
+        WakeupCoalescer::GetInstance().SetSleeping(false);
         if (on_exit_light_sleep_mode_) {
             on_exit_light_sleep_mode_();
         }
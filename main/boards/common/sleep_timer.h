@@ -5,6 +5,8 @@
 #include <esp_timer.h>
 #include <esp_pm.h>
 
+class LpSoundWake;
+
 class SleepTimer {
 public:
     SleepTimer(int seconds_to_light_sleep = 20, int seconds_to_deep_sleep = -1);
@@ -14,17 +16,20 @@ public:
     void OnEnterLightSleepMode(std::function<void()> callback);
     void OnExitLightSleepMode(std::function<void()> callback);
     void OnEnterDeepSleepMode(std::function<void()> callback);
+    // Armed right before the deep sleep, so sound wakes the device too
+    void SetSoundWake(LpSoundWake* sound_wake) { sound_wake_ = sound_wake; }
     void WakeUp();
 
 private:
-    void CheckTimer();
+    void CheckTimer(int periods);
 
-    esp_timer_handle_t sleep_timer_ = nullptr;
+    int job_ = -1;
     bool enabled_ = false;
     int ticks_ = 0;
     int seconds_to_light_sleep_;
     int seconds_to_deep_sleep_;
     bool in_light_sleep_mode_ = false;
+    LpSoundWake* sound_wake_ = nullptr;
 
     std::function<void()> on_enter_light_sleep_mode_;
     std::function<void()> on_exit_light_sleep_mode_;
@@ -0,0 +1,85 @@
+/*
+ * Runs on the LP core while the HP cores are in deep sleep, see lp_sound_wake.h.
+ *
+ * The microphone is sampled at the period set by the HP core, in blocks of BLOCK_SAMPLES.
+ * The energy of a block is compared with the noise floor, which follows the quiet blocks
+ * only, and trigger_blocks loud blocks in a row wake the HP cores. The samples of the last
+ * PRE_ROLL_SAMPLES stay in pre_roll, a ring ending at pre_roll_head.
+ */
+#include <stdint.h>
+#include "ulp_lp_core_utils.h"
+#include "ulp_lp_core_lp_adc_shared.h"
+
+#define PRE_ROLL_SAMPLES 2048
+#define BLOCK_SAMPLES 64
+// Blocks to learn the noise floor before anything triggers
+#define WARMUP_BLOCKS 32
+// The DC estimate moves by 1/2^DC_SHIFT of the error per sample
+#define DC_SHIFT 6
+#define FLOOR_SHIFT 4
+
+/* Set by the HP core before it sleeps */
+volatile uint32_t adc_unit;
+volatile uint32_t adc_channel;
+volatile uint32_t sample_period_us;
+volatile uint32_t threshold_x16;        // Block energy over the noise floor that counts as loud, in 1/16
+volatile uint32_t trigger_blocks;
+volatile uint32_t sample_rate;          // Only kept for the HP core to read the pre-roll with
+
+/* Read by the HP core after the wake-up */
+volatile int16_t pre_roll[PRE_ROLL_SAMPLES];
+volatile uint32_t pre_roll_head;
+volatile uint32_t pre_roll_count;
+volatile uint32_t trigger_energy;
+volatile uint32_t noise_floor;
+
+int main(void)
+{
+    int32_t dc_q = -1;
+    uint32_t quiet = 0;
+    uint32_t loud = 0;
+    uint32_t blocks = 0;
+    pre_roll_head = 0;
+    pre_roll_count = 0;
+
+    while (1) {
+        uint32_t energy = 0;
+        for (int i = 0; i < BLOCK_SAMPLES; i++) {
+            int raw = 0;
+            lp_core_lp_adc_read_channel_raw(adc_unit, adc_channel, &raw);
+            if (dc_q < 0) {
+                dc_q = raw << DC_SHIFT;
+            }
+            dc_q += raw - (dc_q >> DC_SHIFT);
+            int32_t sample = raw - (dc_q >> DC_SHIFT);
+            energy += (uint32_t)(sample * sample) / BLOCK_SAMPLES;
+
+            /* 12 bit samples, scaled to the 16 bit range of the HP side */
+            pre_roll[pre_roll_head] = (int16_t)(sample << 4);
+            pre_roll_head = (pre_roll_head + 1) % PRE_ROLL_SAMPLES;
+            if (pre_roll_count < PRE_ROLL_SAMPLES) {
+                pre_roll_count++;
+            }
+            ulp_lp_core_delay_us(sample_period_us);
+        }
+
+        if (blocks < WARMUP_BLOCKS) {
+            blocks++;
+            quiet = blocks == 1 ? energy : quiet + ((int32_t)(energy - quiet) >> FLOOR_SHIFT);
+            continue;
+        }
+        if (energy * 16 > (quiet + 1) * threshold_x16) {
+            if (++loud >= trigger_blocks) {
+                trigger_energy = energy;
+                noise_floor = quiet;
+                ulp_lp_core_wakeup_main_processor();
+                /* Returning halts the LP core until the HP core starts it again */
+                return 0;
+            }
+        } else {
+            loud = 0;
+            quiet += (int32_t)(energy - quiet) >> FLOOR_SHIFT;
+        }
+    }
+    return 0;
+}
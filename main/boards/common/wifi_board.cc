@@ -5,6 +5,7 @@
 #include "system_info.h"
 #include "settings.h"
 #include "assets/lang_config.h"
+#include "wifi_fast_connect.h"
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -83,6 +84,10 @@ void WifiBoard::StartNetwork() {
         }
     });
 
+#if CONFIG_WIFI_FAST_CONNECT
+    WifiFastConnect::GetInstance().Start();
+#endif
+
     // Try to connect or enter config mode
     TryWifiConnect();
 }
@@ -94,8 +99,12 @@ void WifiBoard::TryWifiConnect() {
     if (have_ssid) {
         // Start connection attempt with timeout
         ESP_LOGI(TAG, "Starting WiFi connection attempt");
-        esp_timer_start_once(connect_timer_, CONNECT_TIMEOUT_SEC * 1000000ULL);
+        if (!standby_) {
+            esp_timer_start_once(connect_timer_, CONNECT_TIMEOUT_SEC * 1000000ULL);
+        }
         WifiManager::GetInstance().StartStation();
+    } else if (standby_) {
+        ESP_LOGI(TAG, "No WiFi configured for the standby network");
     } else {
         // No SSID configured, enter config mode
         // Wait for the board version to be shown
@@ -151,6 +160,9 @@ void WifiBoard::SetNetworkEventCallback(NetworkEventCallback callback) {
 
 void WifiBoard::OnWifiConnectTimeout(void* arg) {
     auto* board = static_cast<WifiBoard*>(arg);
+    if (board->standby_) {
+        return;
+    }
     ESP_LOGW(TAG, "WiFi connection timeout, entering config mode");
 
     WifiManager::GetInstance().StopStation();
@@ -197,6 +209,13 @@ void WifiBoard::StartWifiConfigMode() {
 #endif
 }
 
+void WifiBoard::SetStandby(bool standby) {
+    standby_ = standby;
+    if (standby) {
+        esp_timer_stop(connect_timer_);
+    }
+}
+
 void WifiBoard::EnterWifiConfigMode() {
     ESP_LOGI(TAG, "EnterWifiConfigMode called");
     GetDisplay()->ShowNotification(Lang::Strings::ENTERING_WIFI_CONFIG_MODE);
@@ -283,20 +302,19 @@ std::string WifiBoard::GetBoardJson() {
 }
 
 void WifiBoard::SetPowerSaveLevel(PowerSaveLevel level) {
-    WifiPowerSaveLevel wifi_level;
-    switch (level) {
-        case PowerSaveLevel::LOW_POWER:
-            wifi_level = WifiPowerSaveLevel::LOW_POWER;
-            break;
-        case PowerSaveLevel::BALANCED:
-            wifi_level = WifiPowerSaveLevel::BALANCED;
-            break;
-        case PowerSaveLevel::PERFORMANCE:
-        default:
-            wifi_level = WifiPowerSaveLevel::PERFORMANCE;
-            break;
-    }
-    WifiManager::GetInstance().SetPowerSaveLevel(wifi_level);
+    power_save_.SetLevel(level);
+}
+
+void WifiBoard::OnDeviceStateChanged(DeviceState state) {
+    power_save_.OnStateChanged(state);
+}
+
+void WifiBoard::OnNetworkTraffic() {
+    power_save_.OnTraffic();
+}
+
+cJSON* WifiBoard::GetNetworkPowerStatsJson() {
+    return power_save_.GetStatsJson();
 }
 
 std::string WifiBoard::GetDeviceStatusJson() {
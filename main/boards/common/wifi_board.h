@@ -2,6 +2,7 @@
 #define WIFI_BOARD_H
 
 #include "board.h"
+#include "wifi_power_save.h"
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
 #include <esp_timer.h>
@@ -10,7 +11,9 @@ class WifiBoard : public Board {
 protected:
     esp_timer_handle_t connect_timer_ = nullptr;
     bool in_config_mode_ = false;
+    bool standby_ = false;
     NetworkEventCallback network_event_callback_ = nullptr;
+    WifiPowerSave power_save_;
 
     virtual std::string GetBoardJson() override;
 
@@ -52,6 +55,9 @@ public:
     virtual void SetNetworkEventCallback(NetworkEventCallback callback) override;
     virtual const char* GetNetworkStateIcon() override;
     virtual void SetPowerSaveLevel(PowerSaveLevel level) override;
+    virtual void OnDeviceStateChanged(DeviceState state) override;
+    virtual void OnNetworkTraffic() override;
+    virtual cJSON* GetNetworkPowerStatsJson() override;
     virtual AudioCodec* GetAudioCodec() override { return nullptr; }
     virtual std::string GetDeviceStatusJson() override;
     
@@ -64,6 +70,12 @@ public:
      * Check if in WiFi config mode
      */
     bool IsInWifiConfigMode() const;
+
+    /**
+     * As the standby network of a DualNetworkBoard the station keeps trying to connect,
+     * it never enters config mode
+     */
+    void SetStandby(bool standby);
 };
 
 #endif // WIFI_BOARD_H
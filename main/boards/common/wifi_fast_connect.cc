@@ -0,0 +1,171 @@
+#include "wifi_fast_connect.h"
+#include "settings.h"
+
+#include <esp_log.h>
+#include <esp_rom_crc.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+#include <mbedtls/pkcs5.h>
+#include <ssid_manager.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#define TAG "WifiFastConnect"
+
+static std::string ToHex(const uint8_t* data, size_t length) {
+    std::string hex;
+    char byte[3];
+    for (size_t i = 0; i < length; i++) {
+        snprintf(byte, sizeof(byte), "%02x", data[i]);
+        hex += byte;
+    }
+    return hex;
+}
+
+static bool FromHex(const std::string& hex, uint8_t* data, size_t length) {
+    if (hex.size() != length * 2) {
+        return false;
+    }
+    for (size_t i = 0; i < length; i++) {
+        unsigned value;
+        if (sscanf(hex.c_str() + i * 2, "%2x", &value) != 1) {
+            return false;
+        }
+        data[i] = value;
+    }
+    return true;
+}
+
+// The PMK is only derived from the passphrase with PSK, SAE derives a key per connection
+static bool UsesPmk(int authmode) {
+    return authmode == WIFI_AUTH_WPA_PSK || authmode == WIFI_AUTH_WPA2_PSK || authmode == WIFI_AUTH_WPA_WPA2_PSK;
+}
+
+static uint32_t PasswordCrc(const std::string& password) {
+    return esp_rom_crc32_le(0, (const uint8_t*)password.data(), password.size());
+}
+
+void WifiFastConnect::Start() {
+    if (started_) {
+        return;
+    }
+    started_ = true;
+    esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, &WifiFastConnect::OnWifiEvent, this);
+    esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &WifiFastConnect::OnIpEvent, this);
+}
+
+void WifiFastConnect::OnWifiEvent(void* arg, esp_event_base_t base, int32_t id, void* data) {
+    auto self = static_cast<WifiFastConnect*>(arg);
+    switch (id) {
+        case WIFI_EVENT_STA_START:
+            self->Connect();
+            break;
+        case WIFI_EVENT_STA_CONNECTED:
+            self->Save(static_cast<wifi_event_sta_connected_t*>(data));
+            break;
+        case WIFI_EVENT_STA_DISCONNECTED:
+            if (self->attempting_) {
+                auto event = static_cast<wifi_event_sta_disconnected_t*>(data);
+                ESP_LOGW(TAG, "Direct connection failed, reason %d, scanning", event->reason);
+                self->attempting_ = false;
+                self->Forget();
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void WifiFastConnect::OnIpEvent(void* arg, esp_event_base_t base, int32_t id, void* data) {
+    auto self = static_cast<WifiFastConnect*>(arg);
+    if (self->attempting_) {
+        self->attempting_ = false;
+        ESP_LOGI(TAG, "Got an IP address %d ms after the direct connection started",
+                 int((esp_timer_get_time() - self->attempt_start_us_) / 1000));
+    }
+}
+
+void WifiFastConnect::Connect() {
+    Settings settings("wifi_fast");
+    auto ssid = settings.GetString("ssid");
+    if (ssid.empty()) {
+        return;
+    }
+    // The access point has to be one of the configured networks still
+    std::string password;
+    bool found = false;
+    for (const auto& item : SsidManager::GetInstance().GetSsidList()) {
+        if (item.ssid == ssid) {
+            password = item.password;
+            found = true;
+            break;
+        }
+    }
+    wifi_config_t config = {};
+    if (!found || ssid.size() > sizeof(config.sta.ssid) ||
+        !FromHex(settings.GetString("bssid"), config.sta.bssid, sizeof(config.sta.bssid))) {
+        return;
+    }
+    memcpy(config.sta.ssid, ssid.data(), ssid.size());
+    // A PMK of 64 hex digits is taken by the driver as is
+    auto pmk = settings.GetString("pmk");
+    if (!pmk.empty() && (uint32_t)settings.GetInt("password_crc") == PasswordCrc(password)) {
+        memcpy(config.sta.password, pmk.data(), std::min(pmk.size(), sizeof(config.sta.password)));
+    } else if (password.size() <= sizeof(config.sta.password)) {
+        memcpy(config.sta.password, password.data(), password.size());
+    }
+    config.sta.bssid_set = true;
+    config.sta.channel = settings.GetInt("channel");
+    config.sta.scan_method = WIFI_FAST_SCAN;
+
+    if (esp_wifi_set_config(WIFI_IF_STA, &config) != ESP_OK || esp_wifi_connect() != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to start the direct connection to %s", ssid.c_str());
+        return;
+    }
+    attempting_ = true;
+    attempt_start_us_ = esp_timer_get_time();
+    ESP_LOGI(TAG, "Connecting to %s at %s on channel %d", ssid.c_str(), settings.GetString("bssid").c_str(), config.sta.channel);
+}
+
+void WifiFastConnect::Save(const wifi_event_sta_connected_t* event) {
+    std::string ssid((const char*)event->ssid, event->ssid_len);
+    auto bssid = ToHex(event->bssid, sizeof(event->bssid));
+
+    wifi_config_t config;
+    if (esp_wifi_get_config(WIFI_IF_STA, &config) != ESP_OK) {
+        return;
+    }
+    std::string password((const char*)config.sta.password, strnlen((const char*)config.sta.password, sizeof(config.sta.password)));
+
+    Settings settings("wifi_fast", true);
+    if (settings.GetString("ssid") == ssid && settings.GetString("bssid") == bssid &&
+        settings.GetInt("channel") == event->channel) {
+        return;
+    }
+    bool same_network = settings.GetString("ssid") == ssid;
+    settings.SetString("ssid", ssid);
+    settings.SetString("bssid", bssid);
+    settings.SetInt("channel", event->channel);
+
+    // Another access point of the network the direct connection roamed to was joined with the PMK already
+    if (same_network && password.size() == 64 && !settings.GetString("pmk").empty()) {
+        ESP_LOGI(TAG, "Saved %s at %s on channel %d", ssid.c_str(), bssid.c_str(), event->channel);
+        return;
+    }
+    settings.EraseKey("pmk");
+    uint8_t pmk[32];
+    if (UsesPmk(event->authmode) && password.size() >= 8 && password.size() < 64 &&
+        mbedtls_pkcs5_pbkdf2_hmac_ext(MBEDTLS_MD_SHA1, (const unsigned char*)password.data(), password.size(),
+                                       (const unsigned char*)ssid.data(), ssid.size(), 4096, sizeof(pmk), pmk) == 0) {
+        settings.SetString("pmk", ToHex(pmk, sizeof(pmk)));
+        settings.SetInt("password_crc", PasswordCrc(password));
+    }
+    ESP_LOGI(TAG, "Saved %s at %s on channel %d", ssid.c_str(), bssid.c_str(), event->channel);
+}
+
+void WifiFastConnect::Forget() {
+    Settings settings("wifi_fast", true);
+    settings.EraseAll();
+}
@@ -0,0 +1,44 @@
+#ifndef _WIFI_FAST_CONNECT_H_
+#define _WIFI_FAST_CONNECT_H_
+
+#include <esp_event.h>
+#include <esp_wifi_types.h>
+
+#include <cstdint>
+#include <string>
+
+/*
+ * Connects the station to the access point of the last connection without a scan.
+ *
+ * The SSID, BSSID, channel and, for WPA/WPA2-PSK, the PMK of the access point are kept in NVS
+ * when the station connects. When the station starts, the access point is associated directly on
+ * its channel, with the PMK instead of the passphrase so the 4096 rounds of PBKDF2 are skipped.
+ * The scan of the station runs once the direct connection failed, and the record is then
+ * forgotten so the next start scans from the beginning.
+ *
+ * The DHCP lease is restored by lwIP with CONFIG_LWIP_DHCP_RESTORE_LAST_IP.
+ */
+class WifiFastConnect {
+public:
+    static WifiFastConnect& GetInstance() {
+        static WifiFastConnect instance;
+        return instance;
+    }
+
+    // Registers the event handlers, before the station starts
+    void Start();
+
+private:
+    bool started_ = false;
+    bool attempting_ = false;
+    int64_t attempt_start_us_ = 0;
+
+    WifiFastConnect() = default;
+    static void OnWifiEvent(void* arg, esp_event_base_t base, int32_t id, void* data);
+    static void OnIpEvent(void* arg, esp_event_base_t base, int32_t id, void* data);
+    void Connect();
+    void Save(const wifi_event_sta_connected_t* event);
+    void Forget();
+};
+
+#endif // _WIFI_FAST_CONNECT_H_
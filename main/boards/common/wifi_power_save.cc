@@ -0,0 +1,182 @@
+#include "wifi_power_save.h"
+#include "perf_profile.h"
+
+#include <esp_log.h>
+#include <esp_wifi.h>
+#include <wifi_manager.h>
+
+#define TAG "WifiPowerSave"
+
+// A beacon interval of 100 TU, the one nearly every access point uses
+#define WIFI_BEACON_INTERVAL_US 102400
+// What the station listens at when its config does not say
+#define WIFI_DEFAULT_LISTEN_INTERVAL 3
+
+#if CONFIG_WIFI_ADAPTIVE_POWER_SAVE
+static constexpr bool kAdaptive = true;
+#else
+static constexpr bool kAdaptive = false;
+#define CONFIG_WIFI_POWER_SAVE_TAIL_MS 0
+#endif
+
+WifiPowerSave::WifiPowerSave() {
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            auto self = static_cast<WifiPowerSave*>(arg);
+            std::lock_guard<std::mutex> lock(self->mutex_);
+            self->tail_ = false;
+            self->ApplyLocked();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "wifi_ps_tail",
+        .skip_unhandled_events = true,
+    };
+    esp_timer_create(&timer_args, &tail_timer_);
+}
+
+WifiPowerSave::~WifiPowerSave() {
+    if (tail_timer_ != nullptr) {
+        esp_timer_stop(tail_timer_);
+        esp_timer_delete(tail_timer_);
+    }
+}
+
+const char* WifiPowerSave::ModeName(Mode mode) {
+    switch (mode) {
+        case kModeLowPower: return "low_power";
+        case kModeBalanced: return "balanced";
+        case kModeAwake: return "awake";
+        default: return "none";
+    }
+}
+
+void WifiPowerSave::SetLevel(PowerSaveLevel level) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    level_ = level;
+    level_set_ = true;
+#if CONFIG_WIFI_ADAPTIVE_POWER_SAVE
+    /* The end of a conversation asks for the idle level, the tail runs from there */
+    if (level != PowerSaveLevel::PERFORMANCE && mode_ == kModeAwake && !active_state_) {
+        StartTailLocked();
+    }
+#endif
+    ApplyLocked();
+}
+
+void WifiPowerSave::OnStateChanged(DeviceState state) {
+#if CONFIG_WIFI_ADAPTIVE_POWER_SAVE
+    bool active = state == kDeviceStateConnecting || state == kDeviceStateListening ||
+        state == kDeviceStateSpeaking;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (active == active_state_) {
+        return;
+    }
+    active_state_ = active;
+    if (active) {
+        tail_ = false;
+        esp_timer_stop(tail_timer_);
+    } else {
+        StartTailLocked();
+    }
+    ApplyLocked();
+#else
+    (void)state;
+#endif
+}
+
+void WifiPowerSave::OnTraffic() {
+#if CONFIG_WIFI_ADAPTIVE_POWER_SAVE
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (active_state_ || mode_ == kModeNone) {
+        return;
+    }
+    if (mode_ != kModeAwake) {
+        traffic_wakeups_++;
+    }
+    StartTailLocked();
+    ApplyLocked();
+#endif
+}
+
+void WifiPowerSave::StartTailLocked() {
+    tail_ = true;
+    esp_timer_stop(tail_timer_);
+    esp_timer_start_once(tail_timer_, TailMs() * 1000LL);
+}
+
+int WifiPowerSave::TailMs() {
+    return PerfProfile::GetInstance().Get(PerfProfile::kWifiPowerSaveTailMs, CONFIG_WIFI_POWER_SAVE_TAIL_MS);
+}
+
+WifiPowerSave::Mode WifiPowerSave::TargetModeLocked() const {
+    if (level_ == PowerSaveLevel::PERFORMANCE || active_state_ || tail_) {
+        return kModeAwake;
+    }
+    return level_ == PowerSaveLevel::BALANCED ? kModeBalanced : kModeLowPower;
+}
+
+void WifiPowerSave::ApplyLocked() {
+    if (!level_set_) {
+        return;
+    }
+    Mode mode = TargetModeLocked();
+    if (mode == mode_) {
+        return;
+    }
+    int64_t now_us = esp_timer_get_time();
+    if (mode_ != kModeNone) {
+        residency_us_[mode_] += now_us - mode_start_us_;
+    }
+    mode_ = mode;
+    mode_start_us_ = now_us;
+    entries_[mode]++;
+
+    switch (mode) {
+        case kModeLowPower:
+            WifiManager::GetInstance().SetPowerSaveLevel(WifiPowerSaveLevel::LOW_POWER);
+            break;
+        case kModeBalanced:
+            WifiManager::GetInstance().SetPowerSaveLevel(WifiPowerSaveLevel::BALANCED);
+            break;
+        default:
+            WifiManager::GetInstance().SetPowerSaveLevel(WifiPowerSaveLevel::PERFORMANCE);
+            break;
+    }
+    ESP_LOGD(TAG, "Power save: %s", ModeName(mode));
+}
+
+cJSON* WifiPowerSave::GetStatsJson() {
+    wifi_config_t config = {};
+    int listen_interval = WIFI_DEFAULT_LISTEN_INTERVAL;
+    if (esp_wifi_get_config(WIFI_IF_STA, &config) == ESP_OK && config.sta.listen_interval > 0) {
+        listen_interval = config.sta.listen_interval;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now_us = esp_timer_get_time();
+    auto json = cJSON_CreateObject();
+    cJSON_AddBoolToObject(json, "adaptive", kAdaptive);
+    cJSON_AddStringToObject(json, "mode", ModeName(mode_));
+    auto modes = cJSON_CreateObject();
+    for (int i = 0; i < kModeCount; i++) {
+        auto mode = static_cast<Mode>(i);
+        int64_t residency_us = residency_us_[i] + (mode == mode_ ? now_us - mode_start_us_ : 0);
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "time_s", residency_us / 1000000);
+        cJSON_AddNumberToObject(item, "entries", entries_[i]);
+        /* A downlink packet waits for the next wake-up of the modem at most */
+        if (mode == kModeLowPower) {
+            cJSON_AddNumberToObject(item, "max_added_latency_ms", listen_interval * WIFI_BEACON_INTERVAL_US / 1000);
+        } else if (mode == kModeBalanced) {
+            cJSON_AddStringToObject(item, "max_added_latency", "dtim");
+        } else {
+            cJSON_AddNumberToObject(item, "max_added_latency_ms", 0);
+        }
+        cJSON_AddItemToObject(modes, ModeName(mode), item);
+    }
+    cJSON_AddItemToObject(json, "modes", modes);
+    cJSON_AddNumberToObject(json, "traffic_wakeups", traffic_wakeups_);
+    cJSON_AddNumberToObject(json, "tail_ms", TailMs());
+    return json;
+}
@@ -0,0 +1,70 @@
+#ifndef WIFI_POWER_SAVE_H
+#define WIFI_POWER_SAVE_H
+
+#include <cJSON.h>
+#include <esp_timer.h>
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+
+#include "board.h"
+#include "device_state.h"
+
+/*
+ * Traffic adaptive modem sleep of the WiFi station, enabled with CONFIG_WIFI_ADAPTIVE_POWER_SAVE.
+ *
+ * A modem that sleeps between beacons only hears a downlink packet at its next wake-up, which
+ * adds up to the listen interval to every TTS packet, while a modem that never sleeps burns its
+ * current all day. The level the application asks for is the one of an idle device. The radio
+ * stays awake from the wake word on (the state leaves idle) and through the conversation, and
+ * goes back to the asked level CONFIG_WIFI_POWER_SAVE_TAIL_MS after the last of it, so a follow
+ * up turn does not start on a sleeping radio. A message received while idle keeps it awake for
+ * the tail too, the server may have more to send. Asking for PERFORMANCE keeps it awake until
+ * another level is asked for.
+ *
+ * The time in each mode is kept, to pair with the current measured on the bench, with the most
+ * latency the sleep adds to a downlink packet.
+ */
+class WifiPowerSave {
+public:
+    WifiPowerSave();
+    ~WifiPowerSave();
+
+    void SetLevel(PowerSaveLevel level);
+    void OnStateChanged(DeviceState state);
+    void OnTraffic();
+    // The caller owns the object
+    cJSON* GetStatsJson();
+
+private:
+    // The applied mode, one per PowerSaveLevel plus awake for the boosts
+    enum Mode {
+        kModeLowPower,
+        kModeBalanced,
+        kModeAwake,
+        kModeCount,
+        kModeNone = kModeCount,     // Nothing applied yet
+    };
+
+    std::mutex mutex_;
+    PowerSaveLevel level_ = PowerSaveLevel::PERFORMANCE;
+    bool level_set_ = false;
+    bool active_state_ = false;     // A conversation or the wake word keeps the radio awake
+    bool tail_ = false;             // Awake for the tail after it
+    Mode mode_ = kModeNone;
+    esp_timer_handle_t tail_timer_ = nullptr;
+    int64_t mode_start_us_ = 0;
+    std::array<int64_t, kModeCount> residency_us_ = {};
+    std::array<uint32_t, kModeCount> entries_ = {};
+    uint32_t traffic_wakeups_ = 0;
+
+    static const char* ModeName(Mode mode);
+    // CONFIG_WIFI_POWER_SAVE_TAIL_MS, or the one of the PerfProfile
+    static int TailMs();
+    Mode TargetModeLocked() const;
+    void ApplyLocked();
+    void StartTailLocked();
+};
+
+#endif // WIFI_POWER_SAVE_H
@@ -273,7 +273,7 @@ public:
         TOUCH_HOLD
     };
 
-    Cst816s(i2c_master_bus_handle_t i2c_bus, uint8_t addr) : I2cDevice(i2c_bus, addr)
+    Cst816s(i2c_master_bus_handle_t i2c_bus, uint8_t addr) : I2cDevice(i2c_bus, addr, kI2cPriorityTouch)
     {
         read_buffer_ = new uint8_t[6];
         was_touched_ = false;
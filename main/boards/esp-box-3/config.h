@@ -7,6 +7,12 @@
 #define AUDIO_OUTPUT_SAMPLE_RATE 24000
 
 #define AUDIO_INPUT_REFERENCE    true
+// The ES7210 channels of the microphones, the reference is on channel 1
+#if CONFIG_USE_MULTI_MIC_AFE
+#define AUDIO_INPUT_MIC_MASK     (ESP_CODEC_DEV_MAKE_CHANNEL_MASK(0) | ESP_CODEC_DEV_MAKE_CHANNEL_MASK(2))
+#else
+#define AUDIO_INPUT_MIC_MASK     ESP_CODEC_DEV_MAKE_CHANNEL_MASK(0)
+#endif
 
 #define AUDIO_I2S_GPIO_MCLK GPIO_NUM_2
 #define AUDIO_I2S_GPIO_WS GPIO_NUM_45
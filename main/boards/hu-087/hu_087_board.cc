@@ -57,7 +57,7 @@ class Hu087Board : public WifiBoard {
                     .dc_low_on_data = 0,
                     .disable_control_phase = 0,
                 },
-            .scl_speed_hz = 400 * 1000,
+            .scl_speed_hz = OLED_I2C_SCL_SPEED_HZ,
         };
 
         ESP_ERROR_CHECK(
@@ -23,7 +23,7 @@ public:
         int y = -1;
     };
 
-    Cst2xxse(i2c_master_bus_handle_t i2c_bus, uint8_t addr) : I2cDevice(i2c_bus, addr) {
+    Cst2xxse(i2c_master_bus_handle_t i2c_bus, uint8_t addr) : I2cDevice(i2c_bus, addr, kI2cPriorityTouch) {
         uint8_t chip_id = ReadReg(0x06);
         ESP_LOGI(TAG, "Get cst2xxse chip ID: 0x%02X", chip_id);
         read_buffer_ = new uint8_t[6];
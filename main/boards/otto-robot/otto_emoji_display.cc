@@ -111,4 +111,12 @@ void OttoEmojiDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
     lv_obj_remove_flag(preview_image_, LV_OBJ_FLAG_HIDDEN);
     esp_timer_stop(preview_timer_);
     ESP_ERROR_CHECK(esp_timer_start_once(preview_timer_, PREVIEW_IMAGE_DURATION_MS * 1000));
-}
\ No newline at end of file
+}
+
+void OttoEmojiDisplay::InvalidatePreviewImage(int y, int lines) {
+    DisplayLockGuard lock(this);
+    // The preview is rotated, the band is not a band of the screen
+    if (preview_image_ != nullptr && preview_image_cached_ != nullptr) {
+        lv_obj_invalidate(preview_image_);
+    }
+}
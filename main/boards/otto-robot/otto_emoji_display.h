@@ -16,6 +16,7 @@ class OttoEmojiDisplay : public SpiLcdDisplay {
     virtual ~OttoEmojiDisplay() = default;
     virtual void SetStatus(const char* status) override;
     virtual void SetPreviewImage(std::unique_ptr<LvglImage> image) override;
+    virtual void InvalidatePreviewImage(int y, int lines) override;
 
    private:
     void InitializeOttoEmojis();
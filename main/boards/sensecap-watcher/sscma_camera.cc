@@ -6,6 +6,7 @@
 #include "system_info.h"
 #include "config.h"
 #include "settings.h"
+#include "http_pool.h"
 
 #include <esp_log.h>
 #include <esp_heap_caps.h>
@@ -679,8 +680,7 @@ std::string SscmaCamera::Explain(const std::string& question) {
         return "{\"success\": false, \"message\": \"Image explain URL or token is not set\"}";
     }
 
-    auto network = Board::GetInstance().GetNetwork();
-    auto http = network->CreateHttp(3);
+    auto http = HttpPool::GetInstance().CreateHttp(3);
     // 构造multipart/form-data请求体
     std::string boundary = "----ESP32_CAMERA_BOUNDARY";
     
@@ -716,19 +716,23 @@ std::string SscmaCamera::Explain(const std::string& question) {
     }
     
     // 第一块：question字段
-    http->Write(question_field.c_str(), question_field.size());
+    bool written = http->Write(question_field.c_str(), question_field.size()) == (int)question_field.size();
     
     // 第二块：文件字段头部
-    http->Write(file_header.c_str(), file_header.size());
+    written = written && http->Write(file_header.c_str(), file_header.size()) == (int)file_header.size();
     
     // 第三块：JPEG数据
-    http->Write((const char*)jpeg_data_.buf, jpeg_data_.len);
+    written = written && http->Write((const char*)jpeg_data_.buf, jpeg_data_.len) == (int)jpeg_data_.len;
 
     // 第四块：multipart尾部
-    http->Write(multipart_footer.c_str(), multipart_footer.size());
+    written = written && http->Write(multipart_footer.c_str(), multipart_footer.size()) == (int)multipart_footer.size();
     
     // 结束块
-    http->Write("", 0);
+    if (!written || http->Write("", 0) < 0) {
+        ESP_LOGE(TAG, "Failed to write the photo to the explain URL");
+        http->Close();
+        return "{\"success\": false, \"message\": \"Failed to upload photo\"}";
+    }
 
     if (http->GetStatusCode() != 200) {
         ESP_LOGE(TAG, "Failed to upload photo, status code: %d", http->GetStatusCode());
@@ -19,7 +19,7 @@ const Cst816x::TouchThresholdConfig& Cst816x::getThresholdConfig(int x, int y) {
     return DEFAULT_THRESHOLD;
 }
 
-Cst816x::Cst816x(i2c_master_bus_handle_t i2c_bus, uint8_t addr) : I2cDevice(i2c_bus, addr) {
+Cst816x::Cst816x(i2c_master_bus_handle_t i2c_bus, uint8_t addr) : I2cDevice(i2c_bus, addr, kI2cPriorityTouch) {
     uint8_t chip_id = ReadReg(0xA7);
     ESP_LOGI(TAG, "Get CST816x chip ID: 0x%02X", chip_id);
     read_buffer_ = new uint8_t[6];
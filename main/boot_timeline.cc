@@ -0,0 +1,59 @@
+#include "boot_timeline.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <mutex>
+#include <string>
+
+#define TAG "BootTimeline"
+
+#define MAX_BOOT_MARKS 24
+
+struct BootMark {
+    const char* milestone;
+    int64_t time_ms;
+};
+
+static std::mutex mutex;
+static BootMark marks[MAX_BOOT_MARKS];
+static int mark_count = 0;
+static bool finished = false;
+
+void BootTimeline::Mark(const char* milestone) {
+    int64_t time_ms = esp_timer_get_time() / 1000;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (finished || mark_count == MAX_BOOT_MARKS) {
+        return;
+    }
+    marks[mark_count++] = {milestone, time_ms};
+    ESP_LOGI(TAG, "%s at %lld ms", milestone, time_ms);
+}
+
+void BootTimeline::Finish() {
+    Mark("ready");
+    std::lock_guard<std::mutex> lock(mutex);
+    if (finished) {
+        return;
+    }
+    finished = true;
+
+    ESP_LOGI(TAG, "Ready for the wake word in %lld ms", marks[mark_count - 1].time_ms);
+    int64_t last_ms = 0;
+    for (int i = 0; i < mark_count; i++) {
+        ESP_LOGI(TAG, "  %-18s %6lld ms  +%lld", marks[i].milestone, marks[i].time_ms, marks[i].time_ms - last_ms);
+        last_ms = marks[i].time_ms;
+    }
+}
+
+std::string BootTimeline::GetJson() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string json = R"({"complete":)" + std::string(finished ? "true" : "false") + R"(,"marks":[)";
+    for (int i = 0; i < mark_count; i++) {
+        json += R"({"name":")" + std::string(marks[i].milestone) + R"(","ms":)" + std::to_string(marks[i].time_ms) + R"(},)";
+    }
+    if (mark_count > 0) {
+        json.pop_back(); // Remove the last comma
+    }
+    json += R"(]})";
+    return json;
+}
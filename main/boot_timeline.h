@@ -0,0 +1,20 @@
+#ifndef _BOOT_TIMELINE_H_
+#define _BOOT_TIMELINE_H_
+
+#include <string>
+
+/*
+ * Milestones of the startup, in milliseconds since the esp_timer started (shortly after
+ * the bootloader handed over). Mark() may be called from any task, the marks after
+ * Finish() are ignored, so handlers that also run after the boot can mark unconditionally.
+ */
+class BootTimeline {
+public:
+    static void Mark(const char* milestone);
+    // Marks "ready" and logs the whole timeline
+    static void Finish();
+    // The marks so far, for the version check report. complete is false until Finish()
+    static std::string GetJson();
+};
+
+#endif // _BOOT_TIMELINE_H_
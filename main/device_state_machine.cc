@@ -1,7 +1,8 @@
 #include "device_state_machine.h"
 
-#include <algorithm>
 #include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
 static const char* TAG = "StateMachine";
 
@@ -21,6 +22,8 @@ static const char* const STATE_STRINGS[] = {
     "invalid_state"
 };
 
+thread_local int DeviceStateMachine::notify_depth_ = 0;
+
 DeviceStateMachine::DeviceStateMachine() {
 }
 
@@ -131,31 +134,64 @@ bool DeviceStateMachine::TransitionTo(DeviceState new_state) {
 }
 
 int DeviceStateMachine::AddStateChangeListener(StateCallback callback) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    int id = next_listener_id_++;
-    listeners_.emplace_back(id, std::move(callback));
+    std::unique_lock<std::mutex> lock(mutex_);
+    int id = -1;
+    while (true) {
+        // A free slot first, a retired one is reused once no notification may still read it
+        bool retired = false;
+        for (int i = 0; i < DEVICE_STATE_MAX_LISTENERS && id < 0; i++) {
+            int state = listeners_[i].state.load();
+            if (state == kSlotFree) {
+                id = i;
+            }
+            retired = retired || state == kSlotRetired;
+        }
+        // A listener adding another one would wait for its own notification
+        if (id >= 0 || !retired || notify_depth_ > 0) {
+            break;
+        }
+        if (notifying_.load() == 0) {
+            for (int i = 0; i < DEVICE_STATE_MAX_LISTENERS && id < 0; i++) {
+                if (listeners_[i].state.load() == kSlotRetired) {
+                    id = i;
+                }
+            }
+            break;
+        }
+        // The listeners of the notification may take the lock themselves
+        lock.unlock();
+        vTaskDelay(1);
+        lock.lock();
+    }
+    if (id < 0) {
+        ESP_LOGE(TAG, "No room for another state listener");
+        return -1;
+    }
+
+    auto& slot = listeners_[id];
+    slot.callback = std::move(callback);
+    slot.state.store(kSlotActive, std::memory_order_release);
     return id;
 }
 
 void DeviceStateMachine::RemoveStateChangeListener(int listener_id) {
+    if (listener_id < 0 || listener_id >= DEVICE_STATE_MAX_LISTENERS) {
+        return;
+    }
     std::lock_guard<std::mutex> lock(mutex_);
-    listeners_.erase(
-        std::remove_if(listeners_.begin(), listeners_.end(),
-            [listener_id](const auto& p) { return p.first == listener_id; }),
-        listeners_.end());
+    // The callback is kept until the slot is reused, a listener may remove itself
+    int expected = kSlotActive;
+    listeners_[listener_id].state.compare_exchange_strong(expected, kSlotRetired);
 }
 
 void DeviceStateMachine::NotifyStateChange(DeviceState old_state, DeviceState new_state) {
-    std::vector<StateCallback> callbacks_copy;
-    {
-        std::lock_guard<std::mutex> lock(mutex_);
-        callbacks_copy.reserve(listeners_.size());
-        for (const auto& [id, cb] : listeners_) {
-            callbacks_copy.push_back(cb);
+    notifying_.fetch_add(1, std::memory_order_acquire);
+    notify_depth_++;
+    for (auto& slot : listeners_) {
+        if (slot.state.load(std::memory_order_acquire) == kSlotActive) {
+            slot.callback(old_state, new_state);
         }
     }
-    
-    for (const auto& cb : callbacks_copy) {
-        cb(old_state, new_state);
-    }
+    notify_depth_--;
+    notifying_.fetch_sub(1, std::memory_order_release);
 }
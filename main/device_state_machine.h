@@ -4,10 +4,11 @@
 #include <atomic>
 #include <functional>
 #include <mutex>
-#include <vector>
 
 #include "device_state.h"
 
+#define DEVICE_STATE_MAX_LISTENERS 8
+
 /**
  * DeviceStateMachine - Manages device state transitions with validation
  * 
@@ -17,7 +18,6 @@
 class DeviceStateMachine {
 public:
     DeviceStateMachine();
-    ~DeviceStateMachine() = default;
 
     // Delete copy constructor and assignment operator
     DeviceStateMachine(const DeviceStateMachine&) = delete;
@@ -49,7 +49,8 @@ public:
     /**
      * Add a state change listener (observer pattern)
      * Callback is invoked in the context of the caller of TransitionTo()
-     * @return listener id for removal
+     * A listener may add another one, it only takes a free slot then
+     * @return listener id for removal, -1 if all DEVICE_STATE_MAX_LISTENERS slots are taken
      */
     int AddStateChangeListener(StateCallback callback);
 
@@ -64,9 +65,22 @@ public:
     static const char* GetStateName(DeviceState state);
 
 private:
+    enum SlotState {
+        kSlotFree,
+        kSlotActive,
+        kSlotRetired,   // Removed, the callback may still run in a notification under way
+    };
+
+    struct ListenerSlot {
+        std::atomic<int> state{kSlotFree};
+        StateCallback callback;
+    };
+
     std::atomic<DeviceState> current_state_{kDeviceStateUnknown};
-    std::vector<std::pair<int, StateCallback>> listeners_;
-    int next_listener_id_{0};
+    // The notifications read the slots without a lock, the writers take mutex_
+    ListenerSlot listeners_[DEVICE_STATE_MAX_LISTENERS];
+    std::atomic<int> notifying_{0};
+    static thread_local int notify_depth_;      // Notifications under way on the calling task
     std::mutex mutex_;
 
     /**
@@ -0,0 +1,91 @@
+#include "chat_history.h"
+
+#include <algorithm>
+#include <cstring>
+
+ChatHistory::ChatHistory(size_t capacity) : ring_(std::min<size_t>(capacity, UINT16_MAX)) {
+}
+
+const char* ChatHistory::RoleName(Role role) {
+    switch (role) {
+    case kRoleUser:
+        return "user";
+    case kRoleAssistant:
+        return "assistant";
+    default:
+        return "system";
+    }
+}
+
+uint32_t ChatHistory::Push(const char* role, const char* text) {
+    size_t length = std::min(strlen(text), ring_.size());
+    // Keep a cut UTF-8 sequence out of the text
+    while (length > 0 && length < strlen(text) && ((uint8_t)text[length] & 0xC0) == 0x80) {
+        length--;
+    }
+    while (!entries_.empty() && ring_.size() - used_ < length) {
+        used_ -= entries_.front().length;
+        entries_.pop_front();
+    }
+
+    Entry entry = {(uint32_t)head_, (uint16_t)length, kRoleSystem};
+    if (strcmp(role, "user") == 0) {
+        entry.role = kRoleUser;
+    } else if (strcmp(role, "assistant") == 0) {
+        entry.role = kRoleAssistant;
+    }
+    size_t first = std::min(length, ring_.size() - head_);
+    memcpy(ring_.data() + head_, text, first);
+    memcpy(ring_.data(), text + first, length - first);
+    head_ = (head_ + length) % ring_.size();
+    used_ += length;
+    entries_.push_back(entry);
+    return next_number_++;
+}
+
+void ChatHistory::PopNewest() {
+    if (entries_.empty()) {
+        return;
+    }
+    head_ = entries_.back().offset;
+    used_ -= entries_.back().length;
+    entries_.pop_back();
+    next_number_--;
+}
+
+bool ChatHistory::AppendToNewest(const char* text) {
+    const char* role;
+    std::string message;
+    if (!Get(newest(), role, message)) {
+        return false;
+    }
+    message += text;
+    PopNewest();
+    Push(role, message.c_str());
+    return true;
+}
+
+bool ChatHistory::Get(uint32_t number, const char*& role, std::string& text) const {
+    if (entries_.empty() || number < oldest() || number > newest()) {
+        return false;
+    }
+    auto& entry = entries_[number - oldest()];
+    role = RoleName(entry.role);
+    size_t first = std::min<size_t>(entry.length, ring_.size() - entry.offset);
+    text.assign(ring_.data() + entry.offset, first);
+    text.append(ring_.data(), entry.length - first);
+    return true;
+}
+
+const char* ChatHistory::RoleOf(uint32_t number) const {
+    if (entries_.empty() || number < oldest() || number > newest()) {
+        return nullptr;
+    }
+    return RoleName(entries_[number - oldest()].role);
+}
+
+void ChatHistory::Clear() {
+    entries_.clear();
+    head_ = 0;
+    used_ = 0;
+}
@@ -0,0 +1,58 @@
+#ifndef _CHAT_HISTORY_H_
+#define _CHAT_HISTORY_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+
+#include "memory_placement.h"
+
+/*
+ * The text of the chat messages, kept outside of LVGL.
+ *
+ * The texts are packed back to back in a fixed byte ring, the oldest messages are dropped
+ * to make room. Messages are numbered in order, the number of the newest is newest().
+ */
+class ChatHistory {
+public:
+    explicit ChatHistory(size_t capacity);
+
+    // Returns the number of the message, a text over the capacity is cut
+    uint32_t Push(const char* role, const char* text);
+    // Drops the newest message
+    void PopNewest();
+    // Adds the text to the end of the newest message, its number stays the same
+    bool AppendToNewest(const char* text);
+    // role is one of "user", "assistant" and "system", false if the message was dropped
+    bool Get(uint32_t number, const char*& role, std::string& text) const;
+    const char* RoleOf(uint32_t number) const;
+    void Clear();
+
+    bool empty() const { return entries_.empty(); }
+    uint32_t oldest() const { return next_number_ - entries_.size(); }
+    uint32_t newest() const { return next_number_ - 1; }
+
+private:
+    enum Role : uint8_t {
+        kRoleUser,
+        kRoleAssistant,
+        kRoleSystem,
+    };
+
+    struct Entry {
+        uint32_t offset;    // In the ring
+        uint16_t length;
+        Role role;
+    };
+
+    ColdVector<char> ring_;
+    size_t head_ = 0;       // Where the next text goes
+    size_t used_ = 0;
+    std::deque<Entry> entries_;
+    uint32_t next_number_ = 1;
+
+    static const char* RoleName(Role role);
+};
+
+#endif // _CHAT_HISTORY_H_
@@ -6,6 +6,7 @@
 #include <font_awesome.h>
 
 #include "display.h"
+#include "perf_counters.h"
 #include "board.h"
 #include "application.h"
 #include "audio_codec.h"
@@ -14,6 +15,36 @@
 
 #define TAG "Display"
 
+struct DisplayLockCounters {
+    PerfHistogram* wait = PerfCounters::GetInstance().Histogram("display_lock_wait_us");
+    PerfHistogram* hold = PerfCounters::GetInstance().Histogram("display_lock_hold_us");
+    PerfCounter* long_holds = PerfCounters::GetInstance().Counter("display_lock_long_holds");
+};
+
+static DisplayLockCounters& GetDisplayLockCounters() {
+    static DisplayLockCounters counters;
+    return counters;
+}
+
+DisplayLockGuard::DisplayLockGuard(Display *display) : display_(display) {
+    int64_t start_time_us = esp_timer_get_time();
+    if (!display_->Lock(30000)) {
+        ESP_LOGE(TAG, "Failed to lock display");
+    }
+    locked_time_us_ = esp_timer_get_time();
+    GetDisplayLockCounters().wait->Record(locked_time_us_ - start_time_us);
+}
+
+DisplayLockGuard::~DisplayLockGuard() {
+    display_->Unlock();
+    auto& counters = GetDisplayLockCounters();
+    int64_t hold_us = esp_timer_get_time() - locked_time_us_;
+    counters.hold->Record(hold_us);
+    if (hold_us > DISPLAY_LOCK_LONG_HOLD_US) {
+        counters.long_holds->Add();
+    }
+}
+
 Display::Display() {
 }
 
@@ -45,6 +76,10 @@ void Display::SetChatMessage(const char* role, const char* content) {
     ESP_LOGW(TAG, "     %s", content);
 }
 
+void Display::AppendChatMessage(const char* role, const char* content) {
+    SetChatMessage(role, content);
+}
+
 void Display::ClearChatMessages() {
     // Default empty implementation, override in subclasses if needed
 }
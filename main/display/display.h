@@ -35,11 +35,15 @@ public:
     virtual void ShowNotification(const std::string &notification, int duration_ms = 3000);
     virtual void SetEmotion(const char* emotion);
     virtual void SetChatMessage(const char* role, const char* content);
+    // Grows the newest message when it is from the same role, the displays without a chat list show the content alone
+    virtual void AppendChatMessage(const char* role, const char* content);
     virtual void ClearChatMessages();
     virtual void SetTheme(Theme* theme);
     virtual Theme* GetTheme() { return current_theme_; }
     virtual void UpdateStatusBar(bool update_all = false);
     virtual void SetPowerSaveMode(bool on);
+    // While the device talks with the user the UI is refreshed at the full rate, slower otherwise
+    virtual void SetInteractive(bool interactive) {}
 
     inline int width() const { return width_; }
     inline int height() const { return height_; }
@@ -56,19 +60,22 @@ protected:
 };
 
 
+// A hold of the display lock longer than this is counted in "display_lock_long_holds"
+#define DISPLAY_LOCK_LONG_HOLD_US 20000
+
+/*
+ * The time spent waiting for the display lock and holding it is recorded in the
+ * "display_lock_wait_us" and "display_lock_hold_us" histograms. The LVGL task holds the lock
+ * while it renders, so the wait of the other tasks is the cost of the UI work to them.
+ */
 class DisplayLockGuard {
 public:
-    DisplayLockGuard(Display *display) : display_(display) {
-        if (!display_->Lock(30000)) {
-            ESP_LOGE("Display", "Failed to lock display");
-        }
-    }
-    ~DisplayLockGuard() {
-        display_->Unlock();
-    }
+    DisplayLockGuard(Display *display);
+    ~DisplayLockGuard();
 
 private:
     Display *display_;
+    int64_t locked_time_us_;
 };
 
 class NoDisplay : public Display {
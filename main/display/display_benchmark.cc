@@ -0,0 +1,489 @@
+#include "display_benchmark.h"
+
+#include <cJSON.h>
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <algorithm>
+#include <cstdio>
+#include <iterator>
+
+#define TAG "DisplayBenchmark"
+
+#define BENCHMARK_SCENE_MS 5000
+#define BENCHMARK_RECTS 6
+#define BENCHMARK_IMAGES 4
+#define BENCHMARK_IMAGE_SIZE 96
+#define BENCHMARK_JPEG_QUALITY 80
+
+#if HAVE_LVGL
+#include "assets.h"
+#include "lvgl_theme.h"
+#include "jpg/image_to_jpeg.h"
+#include "jpg/jpeg_to_image.h"
+
+struct BenchmarkState {
+    lv_display_t* display = nullptr;
+    lv_obj_t* screen = nullptr;
+    lv_obj_t* objects[std::max(BENCHMARK_RECTS, BENCHMARK_IMAGES)] = {};
+    int object_count = 0;
+    lv_draw_buf_t* image = nullptr;
+    void (*step)(uint32_t frame) = nullptr;
+    uint32_t frames = 0;
+    int64_t render_start_us = 0;
+    uint64_t render_us = 0;
+    uint32_t worst_render_us = 0;
+    uint64_t flush_bytes = 0;
+    // The lowest free heap seen in the scene, sampled after every frame and every operation
+    size_t min_free_internal = 0;
+    size_t min_free_spiram = 0;
+};
+
+/* A call of the UI or the codecs, repeated for the length of a workload */
+struct BenchmarkOps {
+    uint32_t count = 0;
+    uint64_t total_us = 0;
+    uint32_t worst_us = 0;
+};
+
+/* The buffers of the JPEG workloads */
+struct BenchmarkJpeg {
+    uint8_t* pixels = nullptr;
+    size_t pixels_len = 0;
+    uint16_t width = 0;
+    uint16_t height = 0;
+    uint8_t* jpeg = nullptr;
+    size_t jpeg_len = 0;
+};
+
+static BenchmarkState state;
+static BenchmarkJpeg jpeg;
+static const char* gif_emotions[4] = {};
+static int gif_emotion_count = 0;
+
+/* Moves the objects of the scene to the next frame, so every frame draws the whole screen again */
+static void StepFill(uint32_t frame) {
+    lv_obj_set_style_bg_color(state.screen, lv_color_hsv_to_rgb(frame * 7 % 360, 80, 90), 0);
+}
+
+static void StepBlend(uint32_t frame) {
+    int32_t width = lv_display_get_horizontal_resolution(state.display);
+    int32_t height = lv_display_get_vertical_resolution(state.display);
+    for (int i = 0; i < state.object_count; i++) {
+        int32_t x = (frame * (3 + i) + i * width / BENCHMARK_RECTS) % width;
+        int32_t y = (frame * (2 + i) + i * height / BENCHMARK_RECTS) % height;
+        lv_obj_set_pos(state.objects[i], x - width / 4, y - height / 4);
+    }
+}
+
+static void StepImage(uint32_t frame) {
+    int32_t width = lv_display_get_horizontal_resolution(state.display) - BENCHMARK_IMAGE_SIZE;
+    int32_t height = lv_display_get_vertical_resolution(state.display) - BENCHMARK_IMAGE_SIZE;
+    for (int i = 0; i < state.object_count; i++) {
+        lv_obj_set_pos(state.objects[i], (frame * (4 + i) + i * 37) % std::max<int32_t>(width, 1),
+            (frame * (3 + i) + i * 53) % std::max<int32_t>(height, 1));
+    }
+}
+
+static void StepTransform(uint32_t frame) {
+    StepImage(frame);
+    for (int i = 0; i < state.object_count; i++) {
+        lv_image_set_rotation(state.objects[i], (frame * 30 + i * 900) % 3600);
+        lv_image_set_scale(state.objects[i], 192 + (frame * 8 + i * 64) % 256);
+    }
+}
+
+static void CreateFill() {
+    state.step = StepFill;
+}
+
+static void CreateBlend() {
+    int32_t width = lv_display_get_horizontal_resolution(state.display);
+    int32_t height = lv_display_get_vertical_resolution(state.display);
+    for (int i = 0; i < BENCHMARK_RECTS; i++) {
+        auto rect = lv_obj_create(state.screen);
+        lv_obj_remove_style_all(rect);
+        lv_obj_set_size(rect, width / 2, height / 2);
+        lv_obj_set_style_radius(rect, std::min(width, height) / 8, 0);
+        lv_obj_set_style_bg_color(rect, lv_color_hsv_to_rgb(i * 360 / BENCHMARK_RECTS, 90, 100), 0);
+        lv_obj_set_style_bg_opa(rect, LV_OPA_50, 0);
+        state.objects[state.object_count++] = rect;
+    }
+    state.step = StepBlend;
+}
+
+static void CreateImages(void (*step)(uint32_t frame)) {
+    for (int i = 0; i < BENCHMARK_IMAGES; i++) {
+        auto image = lv_image_create(state.screen);
+        lv_image_set_src(image, state.image);
+        state.objects[state.object_count++] = image;
+    }
+    state.step = step;
+}
+
+static void CreateImage() {
+    CreateImages(StepImage);
+}
+
+static void CreateTransform() {
+    CreateImages(StepTransform);
+}
+
+static const struct {
+    const char* name;
+    void (*create)();
+    bool needs_image;
+} kScenes[] = {
+    {"fill", CreateFill, false},
+    {"blend", CreateBlend, false},
+    {"image", CreateImage, true},
+    {"transform", CreateTransform, true},
+};
+
+static void SampleHeap() {
+    state.min_free_internal = std::min(state.min_free_internal, heap_caps_get_free_size(MALLOC_CAP_INTERNAL));
+    state.min_free_spiram = std::min(state.min_free_spiram, heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+}
+
+static void OnRenderStart(lv_event_t* e) {
+    state.render_start_us = esp_timer_get_time();
+}
+
+static void OnFlushStart(lv_event_t* e) {
+    auto area = static_cast<const lv_area_t*>(lv_event_get_param(e));
+    if (area != nullptr && state.step != nullptr) {
+        state.flush_bytes += (uint64_t)lv_area_get_size(area) *
+            lv_color_format_get_size(lv_display_get_color_format(state.display));
+    }
+}
+
+static void OnRenderReady(lv_event_t* e) {
+    if (state.render_start_us == 0 || state.step == nullptr) {
+        return;
+    }
+    uint32_t elapsed_us = esp_timer_get_time() - state.render_start_us;
+    state.frames++;
+    state.render_us += elapsed_us;
+    state.worst_render_us = std::max(state.worst_render_us, elapsed_us);
+    SampleHeap();
+    state.step(state.frames);
+}
+
+/* The workloads draw on the UI of the assistant, nothing to move between the frames */
+static void StepNone(uint32_t frame) {
+}
+
+/* The emotions of the theme that play as GIFs, the assets are applied for them */
+static bool PrepareGif(Display* display) {
+    static const char* kEmotions[] = {"neutral", "happy", "laughing", "sad", "angry", "thinking", "surprised", "sleepy"};
+    auto& assets = Assets::GetInstance();
+    if (assets.partition_valid()) {
+        assets.Apply();
+    }
+    auto theme = static_cast<LvglTheme*>(display->GetTheme());
+    if (theme == nullptr || theme->emoji_collection() == nullptr) {
+        return false;
+    }
+    gif_emotion_count = 0;
+    for (auto emotion : kEmotions) {
+        auto image = theme->emoji_collection()->GetEmojiImage(emotion);
+        if (image != nullptr && image->IsGif() && gif_emotion_count < (int)std::size(gif_emotions)) {
+            gif_emotions[gif_emotion_count++] = emotion;
+        }
+    }
+    return gif_emotion_count > 0;
+}
+
+/* Every call opens the next GIF, the LvglGif timer plays it until the next call */
+static void OpGif(Display* display, uint32_t index) {
+    display->SetEmotion(gif_emotions[index % gif_emotion_count]);
+}
+
+static bool PrepareChat(Display* display) {
+    display->SetChatMessage("system", "");
+    return true;
+}
+
+/* Long enough to wrap, the message list scrolls once the screen is full */
+static void OpChat(Display* display, uint32_t index) {
+    char message[96];
+    snprintf(message, sizeof(message), "Benchmark message %lu, a line long enough to wrap on the narrow panels", index);
+    display->SetChatMessage(index % 2 ? "assistant" : "user", message);
+}
+
+static bool PrepareTheme(Display* display) {
+    auto& themes = LvglThemeManager::GetInstance();
+    return themes.GetTheme("light") != nullptr && themes.GetTheme("dark") != nullptr;
+}
+
+static void OpTheme(Display* display, uint32_t index) {
+    display->SetTheme(LvglThemeManager::GetInstance().GetTheme(index % 2 ? "light" : "dark"));
+}
+
+/* A screen of the test image pattern, what a screenshot sent to the server would encode */
+static bool PrepareJpegEncode(Display* display) {
+    jpeg.width = lv_display_get_horizontal_resolution(state.display);
+    jpeg.height = lv_display_get_vertical_resolution(state.display);
+    jpeg.pixels_len = jpeg.width * jpeg.height * 2;
+    jpeg.pixels = (uint8_t*)heap_caps_malloc(jpeg.pixels_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (jpeg.pixels == nullptr) {
+        jpeg.pixels = (uint8_t*)heap_caps_malloc(jpeg.pixels_len, MALLOC_CAP_8BIT);
+    }
+    if (jpeg.pixels == nullptr) {
+        return false;
+    }
+    auto pixels = reinterpret_cast<uint16_t*>(jpeg.pixels);
+    for (int y = 0; y < jpeg.height; y++) {
+        for (int x = 0; x < jpeg.width; x++) {
+            uint16_t red = x * 31 / jpeg.width;
+            uint16_t green = y * 63 / jpeg.height;
+            uint16_t blue = ((x / 8 + y / 8) % 2) ? 31 : 0;
+            pixels[y * jpeg.width + x] = (red << 11) | (green << 5) | blue;
+        }
+    }
+    return true;
+}
+
+/* The last encode is kept for the decode workload */
+static void OpJpegEncode(Display* display, uint32_t index) {
+    uint8_t* out = nullptr;
+    size_t out_len = 0;
+    if (!image_to_jpeg(jpeg.pixels, jpeg.pixels_len, jpeg.width, jpeg.height, V4L2_PIX_FMT_RGB565,
+            BENCHMARK_JPEG_QUALITY, &out, &out_len)) {
+        return;
+    }
+    if (jpeg.jpeg != nullptr) {
+        heap_caps_free(jpeg.jpeg);
+    }
+    jpeg.jpeg = out;
+    jpeg.jpeg_len = out_len;
+}
+
+static bool PrepareJpegDecode(Display* display) {
+    return jpeg.jpeg != nullptr;
+}
+
+static void OpJpegDecode(Display* display, uint32_t index) {
+    uint8_t* out = nullptr;
+    size_t out_len = 0, width = 0, height = 0, stride = 0;
+    if (jpeg_to_image(jpeg.jpeg, jpeg.jpeg_len, &out, &out_len, &width, &height, &stride) == ESP_OK) {
+        heap_caps_free(out);
+    }
+}
+
+static const struct {
+    const char* name;
+    bool (*prepare)(Display* display);
+    void (*op)(Display* display, uint32_t index);
+    uint32_t interval_ms;       // 0 runs the calls back to back
+} kWorkloads[] = {
+    {"gif", PrepareGif, OpGif, 1000},
+    {"chat", PrepareChat, OpChat, 100},
+    {"theme", PrepareTheme, OpTheme, 500},
+    {"jpeg_enc", PrepareJpegEncode, OpJpegEncode, 0},
+    {"jpeg_dec", PrepareJpegDecode, OpJpegDecode, 0},
+};
+
+static void ResetCounters() {
+    state.frames = 0;
+    state.render_us = 0;
+    state.worst_render_us = 0;
+    state.render_start_us = 0;
+    state.flush_bytes = 0;
+    state.min_free_internal = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+    state.min_free_spiram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+}
+
+/* One entry of the summary line, the counters of the scene that just ended */
+static cJSON* CreateSceneJson(const char* name, size_t free_internal, size_t free_spiram, const BenchmarkOps* ops) {
+    auto json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "name", name);
+    cJSON_AddNumberToObject(json, "frames", state.frames);
+    cJSON_AddNumberToObject(json, "fps", state.frames * 1000.0 / BENCHMARK_SCENE_MS);
+    cJSON_AddNumberToObject(json, "render_mean_us", state.frames > 0 ? (uint32_t)(state.render_us / state.frames) : 0);
+    cJSON_AddNumberToObject(json, "render_worst_us", state.worst_render_us);
+    cJSON_AddNumberToObject(json, "flush_kbps", (double)(state.flush_bytes * 1000 / BENCHMARK_SCENE_MS / 1024));
+    if (ops != nullptr) {
+        cJSON_AddNumberToObject(json, "ops", ops->count);
+        cJSON_AddNumberToObject(json, "op_mean_us", ops->count > 0 ? (uint32_t)(ops->total_us / ops->count) : 0);
+        cJSON_AddNumberToObject(json, "op_worst_us", ops->worst_us);
+    }
+    cJSON_AddNumberToObject(json, "heap_peak_internal_kb", (free_internal - std::min(free_internal, state.min_free_internal)) / 1024);
+    cJSON_AddNumberToObject(json, "heap_peak_spiram_kb", (free_spiram - std::min(free_spiram, state.min_free_spiram)) / 1024);
+    return json;
+}
+
+/* A gradient with a checker pattern, not a solid color a draw unit could take a shortcut for */
+static lv_draw_buf_t* CreateTestImage() {
+    auto image = lv_draw_buf_create(BENCHMARK_IMAGE_SIZE, BENCHMARK_IMAGE_SIZE, LV_COLOR_FORMAT_RGB565, LV_STRIDE_AUTO);
+    if (image == nullptr) {
+        return nullptr;
+    }
+    for (int y = 0; y < BENCHMARK_IMAGE_SIZE; y++) {
+        auto row = reinterpret_cast<uint16_t*>(image->data + y * image->header.stride);
+        for (int x = 0; x < BENCHMARK_IMAGE_SIZE; x++) {
+            uint16_t red = x * 31 / BENCHMARK_IMAGE_SIZE;
+            uint16_t green = y * 63 / BENCHMARK_IMAGE_SIZE;
+            uint16_t blue = ((x / 8 + y / 8) % 2) ? 31 : 0;
+            row[x] = (red << 11) | (green << 5) | blue;
+        }
+    }
+    return image;
+}
+
+void DisplayBenchmark::Run(Display* display) {
+    lv_obj_t* ui_screen;
+    {
+        DisplayLockGuard lock(display);
+        state.display = lv_display_get_default();
+        if (state.display == nullptr) {
+            ESP_LOGE(TAG, "No LVGL display to benchmark");
+            return;
+        }
+        state.image = CreateTestImage();
+        ui_screen = lv_screen_active();
+        state.screen = lv_obj_create(nullptr);
+        lv_obj_remove_style_all(state.screen);
+        lv_obj_set_style_bg_opa(state.screen, LV_OPA_COVER, 0);
+        lv_screen_load(state.screen);
+        lv_display_add_event_cb(state.display, OnRenderStart, LV_EVENT_RENDER_START, nullptr);
+        lv_display_add_event_cb(state.display, OnRenderReady, LV_EVENT_RENDER_READY, nullptr);
+        lv_display_add_event_cb(state.display, OnFlushStart, LV_EVENT_FLUSH_START, nullptr);
+        // Render as soon as the last frame is out, the panel sets the pace
+        lv_timer_set_period(lv_display_get_refr_timer(state.display), 1);
+    }
+    int32_t width = lv_display_get_horizontal_resolution(state.display);
+    int32_t height = lv_display_get_vertical_resolution(state.display);
+#if CONFIG_LV_USE_PPA
+    constexpr bool ppa = true;
+    ESP_LOGI(TAG, "%s %ldx%ld, PPA draw unit on", BOARD_NAME, width, height);
+#else
+    constexpr bool ppa = false;
+    ESP_LOGI(TAG, "%s %ldx%ld, software draw only", BOARD_NAME, width, height);
+#endif
+
+    auto summary = cJSON_CreateObject();
+    cJSON_AddStringToObject(summary, "board", BOARD_NAME);
+    cJSON_AddNumberToObject(summary, "width", width);
+    cJSON_AddNumberToObject(summary, "height", height);
+    cJSON_AddNumberToObject(summary, "bpp", lv_color_format_get_bpp(lv_display_get_color_format(state.display)));
+    cJSON_AddBoolToObject(summary, "ppa", ppa);
+    auto scenes = cJSON_AddArrayToObject(summary, "scenes");
+
+    for (auto& scene : kScenes) {
+        if (scene.needs_image && state.image == nullptr) {
+            ESP_LOGW(TAG, "%-9s skipped, no memory for the image", scene.name);
+            continue;
+        }
+        size_t free_internal = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+        size_t free_spiram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+        {
+            DisplayLockGuard lock(display);
+            ResetCounters();
+            scene.create();
+            lv_obj_invalidate(state.screen);
+        }
+        vTaskDelay(pdMS_TO_TICKS(BENCHMARK_SCENE_MS));
+        {
+            DisplayLockGuard lock(display);
+            state.step = nullptr;
+            lv_obj_clean(state.screen);
+            state.object_count = 0;
+        }
+        uint32_t frames = state.frames;
+        ESP_LOGI(TAG, "%-9s %5lu frames, %6.1f frames/s, mean render %5lu us, worst %6lu us", scene.name,
+            frames, frames * 1000.0f / BENCHMARK_SCENE_MS, frames > 0 ? (uint32_t)(state.render_us / frames) : 0,
+            state.worst_render_us);
+        cJSON_AddItemToArray(scenes, CreateSceneJson(scene.name, free_internal, free_spiram, nullptr));
+    }
+
+    // The workloads run on the UI of the assistant, at the refresh period it runs with
+    {
+        DisplayLockGuard lock(display);
+        lv_timer_set_period(lv_display_get_refr_timer(state.display), LV_DEF_REFR_PERIOD);
+        lv_screen_load(ui_screen);
+        lv_obj_delete(state.screen);
+        state.screen = nullptr;
+    }
+    // Both codecs log every call
+    esp_log_level_set("image_to_jpeg", ESP_LOG_WARN);
+    esp_log_level_set("jpeg_to_image", ESP_LOG_WARN);
+
+    for (auto& workload : kWorkloads) {
+        if (!workload.prepare(display)) {
+            ESP_LOGW(TAG, "%-9s skipped, not available on this build", workload.name);
+            continue;
+        }
+        size_t free_internal = heap_caps_get_free_size(MALLOC_CAP_INTERNAL);
+        size_t free_spiram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+        BenchmarkOps ops;
+        {
+            DisplayLockGuard lock(display);
+            ResetCounters();
+            state.step = StepNone;
+        }
+        int64_t start_us = esp_timer_get_time();
+        while (esp_timer_get_time() - start_us < BENCHMARK_SCENE_MS * 1000LL) {
+            int64_t op_start_us = esp_timer_get_time();
+            workload.op(display, ops.count);
+            uint32_t elapsed_us = esp_timer_get_time() - op_start_us;
+            ops.count++;
+            ops.total_us += elapsed_us;
+            ops.worst_us = std::max(ops.worst_us, elapsed_us);
+            {
+                DisplayLockGuard lock(display);
+                SampleHeap();
+            }
+            // Back to back calls still let the LVGL task and the idle task in
+            vTaskDelay(pdMS_TO_TICKS(std::max<uint32_t>(workload.interval_ms, 1)));
+        }
+        {
+            DisplayLockGuard lock(display);
+            state.step = nullptr;
+        }
+        ESP_LOGI(TAG, "%-9s %5lu ops, mean %6lu us, worst %7lu us, %5lu frames, %6.1f frames/s", workload.name,
+            ops.count, ops.count > 0 ? (uint32_t)(ops.total_us / ops.count) : 0, ops.worst_us, state.frames,
+            state.frames * 1000.0f / BENCHMARK_SCENE_MS);
+        cJSON_AddItemToArray(scenes, CreateSceneJson(workload.name, free_internal, free_spiram, &ops));
+    }
+
+    {
+        DisplayLockGuard lock(display);
+        lv_display_remove_event_cb_with_user_data(state.display, OnRenderStart, nullptr);
+        lv_display_remove_event_cb_with_user_data(state.display, OnRenderReady, nullptr);
+        lv_display_remove_event_cb_with_user_data(state.display, OnFlushStart, nullptr);
+        if (state.image != nullptr) {
+            lv_draw_buf_destroy(state.image);
+        }
+        // Without a pool of its own (LV_USE_STDLIB_MALLOC is clib) LVGL reports no memory
+        lv_mem_monitor_t monitor = {};
+        lv_mem_monitor(&monitor);
+        if (monitor.total_size > 0) {
+            cJSON_AddNumberToObject(summary, "lvgl_mem_peak_kb", monitor.max_used / 1024);
+        }
+    }
+    heap_caps_free(jpeg.pixels);
+    heap_caps_free(jpeg.jpeg);
+    jpeg = BenchmarkJpeg();
+    state = BenchmarkState();
+    cJSON_AddNumberToObject(summary, "heap_min_free_internal_kb", heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL) / 1024);
+    cJSON_AddNumberToObject(summary, "heap_min_free_spiram_kb", heap_caps_get_minimum_free_size(MALLOC_CAP_SPIRAM) / 1024);
+
+    // One line to grep from the monitor output and compare between the boards and the builds
+    auto line = cJSON_PrintUnformatted(summary);
+    if (line != nullptr) {
+        ESP_LOGI(TAG, "BENCHMARK %s", line);
+        cJSON_free(line);
+    }
+    cJSON_Delete(summary);
+}
+
+#else
+
+void DisplayBenchmark::Run(Display* display) {
+    ESP_LOGE(TAG, "The display benchmark needs an LVGL display");
+}
+
+#endif // HAVE_LVGL
@@ -0,0 +1,25 @@
+#ifndef DISPLAY_BENCHMARK_H
+#define DISPLAY_BENCHMARK_H
+
+#include "display.h"
+
+/*
+ * Offline benchmark of the LVGL draw pipeline, built with CONFIG_DISPLAY_BENCHMARK.
+ *
+ * Full screen scenes of fills, blended rounded rectangles, image blits and scaled and
+ * rotated images are redrawn as fast as the panel takes them. For every scene it logs the
+ * frames/s and the mean and worst render time. A build with the PPA draw unit and one
+ * without can be compared on the same board.
+ *
+ * Then a fixed workload runs on the UI of the assistant: GIF emotions played by LvglGif,
+ * chat messages that scroll the message list, theme switches, and JPEG encodes and decodes
+ * of a screen sized image. For every call it keeps the mean and worst latency. All of it
+ * ends in one "BENCHMARK {...}" JSON line with the frames/s, flush bandwidth, heap peaks and
+ * LVGL memory peak, to track each board, panel and interface between the builds.
+ */
+class DisplayBenchmark {
+public:
+    static void Run(Display* display);
+};
+
+#endif // DISPLAY_BENCHMARK_H
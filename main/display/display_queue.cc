@@ -0,0 +1,206 @@
+#include "display_queue.h"
+#include "board.h"
+#include "display.h"
+#include "task_profile.h"
+#include "perf_counters.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+
+#define TAG "DisplayQueue"
+
+static std::string ToString(const char* text) {
+    return text != nullptr ? text : "";
+}
+
+DisplayQueue::~DisplayQueue() {
+    if (task_ != nullptr) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        xTaskNotifyGive(task_);
+        while (task_ != nullptr) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+    }
+}
+
+void DisplayQueue::Start() {
+#if CONFIG_DISPLAY_ASYNC_QUEUE
+    if (task_ != nullptr) {
+        return;
+    }
+    // At the priority of the LVGL task, the commands only wait for its renders
+    if (xTaskCreate([](void* arg) {
+        static_cast<DisplayQueue*>(arg)->Task();
+        vTaskDelete(NULL);
+    }, "display_queue", DISPLAY_QUEUE_TASK_STACK_SIZE, this, TaskProfiles::Get(kTaskLvgl).priority, &task_) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the display queue task, the display is called right away");
+        task_ = nullptr;
+    }
+#endif
+}
+
+void DisplayQueue::SetStatus(const char* status) {
+    Post({kCommandStatus, "", ToString(status), 0, 0});
+}
+
+void DisplayQueue::SetEmotion(const char* emotion) {
+    Post({kCommandEmotion, "", ToString(emotion), 0, 0});
+}
+
+void DisplayQueue::ShowNotification(const char* notification, int duration_ms) {
+    Post({kCommandNotification, "", ToString(notification), duration_ms, 0});
+}
+
+void DisplayQueue::SetChatMessage(const char* role, const char* content) {
+    Post({kCommandChatMessage, ToString(role), ToString(content), 0, 0});
+}
+
+void DisplayQueue::AppendChatMessage(const char* role, const char* content) {
+    Post({kCommandAppendChatMessage, ToString(role), ToString(content), 0, 0});
+}
+
+void DisplayQueue::ClearChatMessages() {
+    Post({kCommandClearChatMessages, "", "", 0, 0});
+}
+
+void DisplayQueue::UpdateStatusBar(bool update_all) {
+    Post({kCommandUpdateStatusBar, "", "", 0, 0, update_all});
+}
+
+void DisplayQueue::SetInteractive(bool interactive) {
+    Post({kCommandInteractive, "", "", 0, 0, interactive});
+}
+
+void DisplayQueue::Post(Command command) {
+    if (task_ == nullptr) {
+        Run(command);
+        return;
+    }
+
+    command.queued_us = esp_timer_get_time();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queued_++;
+        auto superseded = commands_.end();
+        if (command.type == kCommandStatus || command.type == kCommandEmotion || command.type == kCommandNotification ||
+            command.type == kCommandUpdateStatusBar || command.type == kCommandInteractive) {
+            superseded = std::find_if(commands_.begin(), commands_.end(), [&command](const Command& queued) {
+                return queued.type == command.type;
+            });
+        } else if (command.type == kCommandChatMessage && command.role == "system") {
+            superseded = std::find_if(commands_.begin(), commands_.end(), [](const Command& queued) {
+                return queued.type == kCommandChatMessage && queued.role == "system";
+            });
+        } else if (command.type == kCommandAppendChatMessage && !commands_.empty()) {
+            // Joins the message at the end of the queue, set or appended
+            auto& last = commands_.back();
+            if ((last.type == kCommandChatMessage || last.type == kCommandAppendChatMessage) && last.role == command.role) {
+                last.text += command.text;
+                coalesced_++;
+                return;
+            }
+        } else if (command.type == kCommandClearChatMessages) {
+            // The messages still queued would be cleared right after they are shown
+            auto end = std::remove_if(commands_.begin(), commands_.end(), [](const Command& queued) {
+                return queued.type == kCommandChatMessage || queued.type == kCommandAppendChatMessage;
+            });
+            coalesced_ += commands_.end() - end;
+            commands_.erase(end, commands_.end());
+        }
+        if (superseded != commands_.end()) {
+            // The next one is run where it comes, after the commands queued before it
+            command.queued_us = superseded->queued_us;
+            if (command.type == kCommandUpdateStatusBar) {
+                command.value = command.value || superseded->value;
+            }
+            commands_.erase(superseded);
+            coalesced_++;
+        }
+        if (commands_.size() >= DISPLAY_QUEUE_MAX_COMMANDS) {
+            // The other commands are queued once each, only the chat grows
+            auto oldest = std::find_if(commands_.begin(), commands_.end(), [](const Command& queued) {
+                return queued.type == kCommandChatMessage || queued.type == kCommandAppendChatMessage ||
+                    queued.type == kCommandClearChatMessages;
+            });
+            if (oldest != commands_.end()) {
+                commands_.erase(oldest);
+                dropped_++;
+            }
+        }
+        commands_.push_back(std::move(command));
+    }
+    xTaskNotifyGive(task_);
+}
+
+void DisplayQueue::Run(const Command& command) {
+    auto display = Board::GetInstance().GetDisplay();
+    switch (command.type) {
+        case kCommandStatus:
+            display->SetStatus(command.text.c_str());
+            break;
+        case kCommandEmotion:
+            display->SetEmotion(command.text.c_str());
+            break;
+        case kCommandNotification:
+            display->ShowNotification(command.text.c_str(), command.duration_ms);
+            break;
+        case kCommandChatMessage:
+            display->SetChatMessage(command.role.c_str(), command.text.c_str());
+            break;
+        case kCommandAppendChatMessage:
+            display->AppendChatMessage(command.role.c_str(), command.text.c_str());
+            break;
+        case kCommandClearChatMessages:
+            display->ClearChatMessages();
+            break;
+        case kCommandUpdateStatusBar: {
+            static auto status_bar_time = PerfCounters::GetInstance().Histogram("display.status_bar_us");
+            int64_t start_us = esp_timer_get_time();
+            display->UpdateStatusBar(command.value);
+            status_bar_time->Record(esp_timer_get_time() - start_us);
+            break;
+        }
+        case kCommandInteractive:
+            display->SetInteractive(command.value);
+            break;
+    }
+}
+
+void DisplayQueue::Task() {
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (true) {
+            Command command;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (stopping_) {
+                    task_ = nullptr;
+                    return;
+                }
+                if (commands_.empty()) {
+                    break;
+                }
+                command = std::move(commands_.front());
+                commands_.pop_front();
+                max_wait_us_ = std::max(max_wait_us_, esp_timer_get_time() - command.queued_us);
+            }
+            Run(command);
+        }
+    }
+}
+
+cJSON* DisplayQueue::GetStatsJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto json = cJSON_CreateObject();
+    cJSON_AddBoolToObject(json, "async", task_ != nullptr);
+    cJSON_AddNumberToObject(json, "queued", queued_);
+    cJSON_AddNumberToObject(json, "coalesced", coalesced_);
+    cJSON_AddNumberToObject(json, "dropped", dropped_);
+    cJSON_AddNumberToObject(json, "pending", commands_.size());
+    cJSON_AddNumberToObject(json, "max_wait_ms", max_wait_us_ / 1000);
+    return json;
+}
@@ -0,0 +1,88 @@
+#ifndef DISPLAY_QUEUE_H
+#define DISPLAY_QUEUE_H
+
+#include <cJSON.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+
+// Commands kept at most, the oldest chat command is dropped past it
+#define DISPLAY_QUEUE_MAX_COMMANDS 32
+#define DISPLAY_QUEUE_TASK_STACK_SIZE 6144
+
+/*
+ * The Display calls of the main loop and the network callbacks, run by a task of their own.
+ *
+ * Each Display call takes the display lock, which the LVGL task holds while it renders, so a
+ * caller used to wait for a long render before it went on. With CONFIG_DISPLAY_ASYNC_QUEUE the
+ * calls return once queued and the display task waits for the lock instead. The calls run in
+ * the order they were made, except that a status, an emotion, a notification, a status bar
+ * update or an interactive switch still queued is superseded by the next one, a system message
+ * still queued by the next system message, and the text appended to the message at the end of
+ * the queue joins it. Before Start() and
+ * without the option the calls go to the display right away.
+ */
+class DisplayQueue {
+public:
+    DisplayQueue() = default;
+    ~DisplayQueue();
+    DisplayQueue(const DisplayQueue&) = delete;
+    DisplayQueue& operator=(const DisplayQueue&) = delete;
+
+    void Start();
+
+    void SetStatus(const char* status);
+    void SetEmotion(const char* emotion);
+    void ShowNotification(const char* notification, int duration_ms = 3000);
+    void ShowNotification(const std::string& notification, int duration_ms = 3000) {
+        ShowNotification(notification.c_str(), duration_ms);
+    }
+    void SetChatMessage(const char* role, const char* content);
+    void AppendChatMessage(const char* role, const char* content);
+    void ClearChatMessages();
+    void UpdateStatusBar(bool update_all = false);
+    void SetInteractive(bool interactive);
+
+    // The caller owns the returned object
+    cJSON* GetStatsJson();
+
+private:
+    enum CommandType {
+        kCommandStatus,
+        kCommandEmotion,
+        kCommandNotification,
+        kCommandChatMessage,
+        kCommandAppendChatMessage,
+        kCommandClearChatMessages,
+        kCommandUpdateStatusBar,
+        kCommandInteractive,
+    };
+
+    struct Command {
+        CommandType type;
+        std::string role;       // The role of a chat message
+        std::string text;
+        int duration_ms;
+        int64_t queued_us;
+        bool value = false;     // update_all of a status bar update, or interactive
+    };
+
+    std::mutex mutex_;
+    std::deque<Command> commands_;
+    TaskHandle_t task_ = nullptr;
+    bool stopping_ = false;
+    uint32_t queued_ = 0;
+    uint32_t coalesced_ = 0;
+    uint32_t dropped_ = 0;
+    int64_t max_wait_us_ = 0;
+
+    void Post(Command command);
+    void Run(const Command& command);
+    void Task();
+};
+
+#endif // DISPLAY_QUEUE_H
@@ -14,6 +14,7 @@
 
 // ESP-IDF headers
 #include <esp_log.h>
+#include <cJSON.h>
 #include <esp_lcd_panel_io.h>
 #include <esp_timer.h>
 #include <lvgl.h>
@@ -26,6 +27,8 @@
 #include "assets/lang_config.h"
 #include "assets.h"
 #include "board.h"
+#include "application.h"
+#include "task_profile.h"
 #include "gfx.h"
 #include "expression_emote.h"
 
@@ -58,20 +61,12 @@ static bool OnFlushIoReady(const esp_lcd_panel_io_handle_t panel_io,
     return true;
 }
 
-// Flush callback for emote
-static void OnFlushCallback(int x_start, int y_start, int x_end, int y_end, const void* data, emote_handle_t handle)
-{
-    esp_lcd_panel_handle_t panel = (esp_lcd_panel_handle_t)emote_get_user_data(handle);
-    if (panel != nullptr) {
-        esp_lcd_panel_draw_bitmap(panel, x_start, y_start, x_end, y_end, data);
-    }
-}
-
 // ============================================================================
 // Graphics Initialization Functions
 // ============================================================================
 
-static emote_handle_t InitializeEmote(const esp_lcd_panel_handle_t panel, const int width, const int height)
+static emote_handle_t InitializeEmote(const esp_lcd_panel_handle_t panel, const int width, const int height,
+    void (*flush_cb)(int, int, int, int, const void*, emote_handle_t), void* user_data)
 {
     if (!panel) {
         ESP_LOGE(TAG, "Invalid panel");
@@ -92,14 +87,15 @@ static emote_handle_t InitializeEmote(const esp_lcd_panel_handle_t panel, const
         .buffers = {
             .buf_pixels = static_cast<size_t>(width * 16),
         },
+        // The placement of the LVGL task, below the audio tasks
         .task = {
-            .task_priority = 5,
+            .task_priority = static_cast<int>(TaskProfiles::Get(kTaskLvgl).priority),
             .task_stack = 6 * 1024,
-            .task_affinity = 0,
+            .task_affinity = TaskProfiles::Get(kTaskLvgl).core,
             .task_stack_in_ext = false,
         },
-        .flush_cb = OnFlushCallback,
-        .user_data = (void*)panel,
+        .flush_cb = flush_cb,
+        .user_data = user_data,
     };
 
     emote_handle_t emote_handle = emote_init(&emote_cfg);
@@ -117,8 +113,9 @@ static emote_handle_t InitializeEmote(const esp_lcd_panel_handle_t panel, const
 
 EmoteDisplay::EmoteDisplay(const esp_lcd_panel_handle_t panel, const esp_lcd_panel_io_handle_t panel_io,
                            const int width, const int height)
+    : panel_(panel)
 {
-    emote_handle_ = InitializeEmote(panel, width, height);
+    emote_handle_ = InitializeEmote(panel, width, height, OnFlush, this);
 
     const esp_lcd_panel_io_callbacks_t cbs = {
         .on_color_trans_done = OnFlushIoReady,
@@ -134,10 +131,92 @@ EmoteDisplay::~EmoteDisplay()
     }
 }
 
+// Flush callback for emote, called for each band of a frame
+void EmoteDisplay::OnFlush(int x_start, int y_start, int x_end, int y_end, const void* data, emote_handle_t handle)
+{
+    auto display = static_cast<EmoteDisplay*>(emote_get_user_data(handle));
+    if (display == nullptr || display->panel_ == nullptr) {
+        return;
+    }
+    // The bands of a frame go down the screen, a frame may only redraw a part of it
+    if (y_start <= display->last_flush_y_) {
+        display->PaceFrame();
+    }
+    display->last_flush_y_ = y_start;
+    esp_lcd_panel_draw_bitmap(display->panel_, x_start, y_start, x_end, y_end, data);
+}
+
+/*
+ * The engine task renders the next band once the one before is flushed, so holding the first
+ * band of a frame back slows the whole animation down, decoding included.
+ */
+void EmoteDisplay::PaceFrame()
+{
+#if CONFIG_EMOTE_AUDIO_PRIORITY
+    int64_t now_us = esp_timer_get_time();
+    if (speaking_ && Application::GetInstance().GetAudioService().GetBufferedPlaybackMs() < CONFIG_EMOTE_AUDIO_PRIORITY_MS) {
+        int64_t next_us = last_frame_us_ + 1000000 / CONFIG_EMOTE_AUDIO_PRIORITY_FPS;
+        if (next_us > now_us) {
+            vTaskDelay(pdMS_TO_TICKS((next_us - now_us + 999) / 1000));
+            now_us = esp_timer_get_time();
+            if (++slowed_frames_ % 100 == 1) {
+                ESP_LOGI(TAG, "Animation slowed down for the playback, %" PRIu32 " frames", slowed_frames_);
+            }
+        }
+    }
+    last_frame_us_ = now_us;
+#endif
+}
+
+void EmoteDisplay::PrefetchAnimation(const char* emotion)
+{
+#if CONFIG_EMOTE_PREFETCH_KB > 0
+    auto& assets = Assets::GetInstance();
+    if (!assets.partition_valid()) {
+        return;
+    }
+    void* ptr = nullptr;
+    size_t size = 0;
+    if (!assets.GetAssetData("index.json", ptr, size)) {
+        return;
+    }
+    cJSON* root = cJSON_ParseWithLength(static_cast<char*>(ptr), size);
+    assets.ReleaseAssetData(ptr);
+    if (root == nullptr) {
+        return;
+    }
+    std::string file;
+    cJSON* emoji_collection = cJSON_GetObjectItem(root, "emoji_collection");
+    cJSON* item = nullptr;
+    cJSON_ArrayForEach(item, emoji_collection) {
+        cJSON* name = cJSON_GetObjectItem(item, "name");
+        cJSON* src = cJSON_GetObjectItem(item, "file");
+        if (cJSON_IsString(name) && cJSON_IsString(src) && std::strcmp(name->valuestring, emotion) == 0) {
+            file = src->valuestring;
+            break;
+        }
+    }
+    cJSON_Delete(root);
+
+    // One read per cache line pulls the head of the animation through the flash cache
+    if (!file.empty() && assets.GetAssetData(file, ptr, size)) {
+        size_t length = std::min<size_t>(size, CONFIG_EMOTE_PREFETCH_KB * 1024);
+        auto data = static_cast<const volatile uint8_t*>(ptr);
+        uint32_t sum = 0;
+        for (size_t i = 0; i < length; i += 32) {
+            sum += data[i];
+        }
+        ESP_LOGD(TAG, "Prefetched %u bytes of %s (%" PRIu32 ")", length, file.c_str(), sum);
+        assets.ReleaseAssetData(ptr);
+    }
+#endif
+}
+
 void EmoteDisplay::SetEmotion(const char* const emotion)
 {
     ESP_LOGI(TAG, "SetEmotion: %s", emotion);
     if (emote_handle_ && emotion && strlen(emotion) > 0) {
+        PrefetchAnimation(emotion);
         emote_set_anim_emoji(emote_handle_, emotion);
     }
 }
@@ -162,6 +241,9 @@ void EmoteDisplay::SetChatMessage(const char* const role, const char* const cont
 void EmoteDisplay::SetStatus(const char* const status)
 {
     ESP_LOGI(TAG, "SetStatus: %s", status);
+    if (status != nullptr) {
+        speaking_ = std::strcmp(status, Lang::Strings::SPEAKING) == 0;
+    }
     if (emote_handle_ && status && strlen(status) > 0) {
         if (std::strcmp(status, Lang::Strings::LISTENING) == 0) {
             emote_set_event_msg(emote_handle_, EMOTE_MGR_EVT_LISTEN, NULL);
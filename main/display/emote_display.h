@@ -1,6 +1,7 @@
 #pragma once
 
 #include "display.h"
+#include <atomic>
 #include <memory>
 #include <string>
 #include <esp_lcd_panel_io.h>
@@ -36,7 +37,17 @@ private:
     virtual void Unlock() override;
 
     emote_handle_t emote_handle_ = nullptr;
+    esp_lcd_panel_handle_t panel_ = nullptr;
 
+    // CONFIG_EMOTE_AUDIO_PRIORITY: the frames are paced while speaking with little buffered
+    std::atomic<bool> speaking_ = false;
+    int64_t last_frame_us_ = 0;
+    int last_flush_y_ = 0;
+    uint32_t slowed_frames_ = 0;
+
+    static void OnFlush(int x_start, int y_start, int x_end, int y_end, const void* data, emote_handle_t handle);
+    void PaceFrame();
+    void PrefetchAnimation(const char* emotion);
 };
 
 } // namespace emote
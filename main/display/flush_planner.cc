@@ -0,0 +1,204 @@
+#include "flush_planner.h"
+#include "heap_monitor.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <src/display/lv_display_private.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "FlushPlanner"
+
+FlushPlanner* FlushPlanner::planners_ = nullptr;
+
+FlushPlanner::~FlushPlanner() {
+    for (auto planner = &planners_; *planner != nullptr; planner = &(*planner)->next_) {
+        if (*planner == this) {
+            *planner = next_;
+            break;
+        }
+    }
+    if (shadow_ != nullptr) {
+        HeapMonitor::GetInstance().Free(kHeapTagDisplay, shadow_);
+    }
+}
+
+void FlushPlanner::Attach(lv_display_t* display) {
+    if (display == nullptr || display->flush_cb == nullptr || display_ != nullptr) {
+        return;
+    }
+    size_t shadow_size = lv_display_get_horizontal_resolution(display) * lv_display_get_vertical_resolution(display) * sizeof(uint16_t);
+    shadow_ = (uint16_t*)HeapMonitor::GetInstance().Malloc(kHeapTagDisplay, shadow_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (shadow_ == nullptr) {
+        ESP_LOGW(TAG, "No memory for a %u byte copy of the panel, flushes are sent as they are", shadow_size);
+        return;
+    }
+    display_ = display;
+    panel_flush_ = display->flush_cb;
+    columns_ = (lv_display_get_horizontal_resolution(display) + FLUSH_TILE_WIDTH - 1) / FLUSH_TILE_WIDTH;
+    rows_ = (lv_display_get_vertical_resolution(display) + FLUSH_TILE_HEIGHT - 1) / FLUSH_TILE_HEIGHT;
+    known_.assign(columns_ * rows_, 0);
+    window_start_us_ = esp_timer_get_time();
+
+    next_ = planners_;
+    planners_ = this;
+    lv_display_add_event_cb(display, OnInvalidateArea, LV_EVENT_INVALIDATE_AREA, this);
+    lv_display_set_flush_cb(display, OnFlush);
+    ESP_LOGI(TAG, "Tracking %ldx%ld tiles", columns_, rows_);
+}
+
+void FlushPlanner::OnInvalidateArea(lv_event_t* e) {
+    auto planner = static_cast<FlushPlanner*>(lv_event_get_user_data(e));
+    auto area = static_cast<lv_area_t*>(lv_event_get_param(e));
+    int32_t width = lv_display_get_horizontal_resolution(planner->display_);
+    int32_t height = lv_display_get_vertical_resolution(planner->display_);
+    // The area is already clipped to the screen
+    area->x1 = area->x1 / FLUSH_TILE_WIDTH * FLUSH_TILE_WIDTH;
+    area->y1 = area->y1 / FLUSH_TILE_HEIGHT * FLUSH_TILE_HEIGHT;
+    area->x2 = std::min<int32_t>((area->x2 / FLUSH_TILE_WIDTH + 1) * FLUSH_TILE_WIDTH, width) - 1;
+    area->y2 = std::min<int32_t>((area->y2 / FLUSH_TILE_HEIGHT + 1) * FLUSH_TILE_HEIGHT, height) - 1;
+}
+
+void FlushPlanner::OnFlush(lv_display_t* display, const lv_area_t* area, uint8_t* color_map) {
+    for (auto planner = planners_; planner != nullptr; planner = planner->next_) {
+        if (planner->display_ == display) {
+            planner->Flush(area, color_map);
+            return;
+        }
+    }
+    lv_display_flush_ready(display);
+}
+
+void FlushPlanner::Flush(const lv_area_t* area, uint8_t* color_map) {
+    // The flushed area is moved by the display offset, the tiles are not
+    int32_t offset_x = lv_display_get_offset_x(display_);
+    int32_t offset_y = lv_display_get_offset_y(display_);
+    int32_t x1 = area->x1 - offset_x;
+    int32_t y1 = area->y1 - offset_y;
+    int32_t x2 = area->x2 - offset_x;
+    int32_t y2 = area->y2 - offset_y;
+    int32_t width = x2 - x1 + 1;
+    int32_t height = y2 - y1 + 1;
+    size_t bytes = width * height * sizeof(uint16_t);
+
+    int32_t screen_width = lv_display_get_horizontal_resolution(display_);
+    int32_t screen_height = lv_display_get_vertical_resolution(display_);
+    bool on_grid = x1 >= 0 && y1 >= 0 && x2 < screen_width && y2 < screen_height
+        && x1 % FLUSH_TILE_WIDTH == 0 && y1 % FLUSH_TILE_HEIGHT == 0
+        && ((x2 + 1) % FLUSH_TILE_WIDTH == 0 || x2 == screen_width - 1)
+        && ((y2 + 1) % FLUSH_TILE_HEIGHT == 0 || y2 == screen_height - 1);
+    if (!on_grid) {
+        // Another rounder moved the area off the grid, send it as it is
+        ForgetTiles(x1, y1, x2, y2);
+        Count(bytes, 0);
+        panel_flush_(display_, area, color_map);
+        return;
+    }
+
+    auto pixels = reinterpret_cast<uint16_t*>(color_map);
+    int32_t changed_x1 = columns_, changed_y1 = rows_, changed_x2 = -1, changed_y2 = -1;
+    for (int32_t row = y1 / FLUSH_TILE_HEIGHT; row <= y2 / FLUSH_TILE_HEIGHT; row++) {
+        int32_t tile_y = row * FLUSH_TILE_HEIGHT;
+        int32_t tile_height = std::min<int32_t>(FLUSH_TILE_HEIGHT, y2 + 1 - tile_y);
+        for (int32_t column = x1 / FLUSH_TILE_WIDTH; column <= x2 / FLUSH_TILE_WIDTH; column++) {
+            int32_t tile_x = column * FLUSH_TILE_WIDTH;
+            int32_t tile_width = std::min<int32_t>(FLUSH_TILE_WIDTH, x2 + 1 - tile_x);
+            auto& known = known_[row * columns_ + column];
+            bool changed = UpdateTile(pixels + (tile_y - y1) * width + (tile_x - x1), width, tile_x, tile_y, tile_width, tile_height);
+            if (known && !changed) {
+                continue;
+            }
+            known = 1;
+            changed_x1 = std::min(changed_x1, column);
+            changed_x2 = std::max(changed_x2, column);
+            changed_y1 = std::min(changed_y1, row);
+            changed_y2 = std::max(changed_y2, row);
+        }
+    }
+
+    if (changed_x2 < 0) {
+        // The panel already shows these pixels
+        Count(0, bytes);
+        lv_display_flush_ready(display_);
+        return;
+    }
+
+    lv_area_t box = {
+        .x1 = changed_x1 * FLUSH_TILE_WIDTH,
+        .y1 = changed_y1 * FLUSH_TILE_HEIGHT,
+        .x2 = std::min<int32_t>((changed_x2 + 1) * FLUSH_TILE_WIDTH - 1, x2),
+        .y2 = std::min<int32_t>((changed_y2 + 1) * FLUSH_TILE_HEIGHT - 1, y2),
+    };
+    int32_t box_width = box.x2 - box.x1 + 1;
+    int32_t box_height = box.y2 - box.y1 + 1;
+    if (box_width != width || box.y1 != y1) {
+        // Pack the rows of the box at the start of the buffer, a row never moves forward
+        for (int32_t y = 0; y < box_height; y++) {
+            memmove(pixels + y * box_width, pixels + (box.y1 - y1 + y) * width + (box.x1 - x1), box_width * sizeof(uint16_t));
+        }
+    }
+    size_t box_bytes = box_width * box_height * sizeof(uint16_t);
+    Count(box_bytes, bytes - box_bytes);
+    lv_area_move(&box, offset_x, offset_y);
+    panel_flush_(display_, &box, color_map);
+}
+
+void FlushPlanner::ForgetTiles(int32_t x1, int32_t y1, int32_t x2, int32_t y2) {
+    int32_t first_row = std::max<int32_t>(y1 / FLUSH_TILE_HEIGHT, 0);
+    int32_t last_row = std::min<int32_t>(y2 / FLUSH_TILE_HEIGHT, rows_ - 1);
+    int32_t first_column = std::max<int32_t>(x1 / FLUSH_TILE_WIDTH, 0);
+    int32_t last_column = std::min<int32_t>(x2 / FLUSH_TILE_WIDTH, columns_ - 1);
+    for (int32_t row = first_row; row <= last_row; row++) {
+        for (int32_t column = first_column; column <= last_column; column++) {
+            known_[row * columns_ + column] = 0;
+        }
+    }
+}
+
+void FlushPlanner::Count(size_t sent, size_t skipped) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    flushes_++;
+    if (sent == 0) {
+        skipped_flushes_++;
+    }
+    sent_bytes_ += sent;
+    skipped_bytes_ += skipped;
+
+    int64_t now_us = esp_timer_get_time();
+    int64_t elapsed_us = now_us - window_start_us_;
+    if (elapsed_us >= 1000 * 1000) {
+        bytes_per_second_ = (uint64_t)window_bytes_ * 1000 * 1000 / elapsed_us;
+        window_bytes_ = 0;
+        window_start_us_ = now_us;
+    }
+    window_bytes_ += sent;
+}
+
+bool FlushPlanner::UpdateTile(const uint16_t* pixels, int32_t stride, int32_t x, int32_t y, int32_t width, int32_t height) {
+    int32_t screen_width = lv_display_get_horizontal_resolution(display_);
+    size_t row_bytes = width * sizeof(uint16_t);
+    bool changed = false;
+    for (int32_t row = 0; row < height; row++) {
+        auto shadow = shadow_ + (y + row) * screen_width + x;
+        auto source = pixels + row * stride;
+        if (changed || memcmp(shadow, source, row_bytes) != 0) {
+            memcpy(shadow, source, row_bytes);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+cJSON* FlushPlanner::GetStatsJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "flushes", flushes_);
+    cJSON_AddNumberToObject(root, "skipped_flushes", skipped_flushes_);
+    cJSON_AddNumberToObject(root, "sent_bytes", sent_bytes_);
+    cJSON_AddNumberToObject(root, "skipped_bytes", skipped_bytes_);
+    // Nothing was flushed for a while, the last window is stale
+    bool idle = esp_timer_get_time() - window_start_us_ >= 2 * 1000 * 1000;
+    cJSON_AddNumberToObject(root, "bytes_per_second", idle ? 0 : bytes_per_second_);
+    return root;
+}
@@ -0,0 +1,69 @@
+#ifndef _FLUSH_PLANNER_H_
+#define _FLUSH_PLANNER_H_
+
+#include <lvgl.h>
+#include <cJSON.h>
+
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// Multiples of the 2 pixel windows some panels need
+#define FLUSH_TILE_WIDTH 16
+#define FLUSH_TILE_HEIGHT 8
+
+/*
+ * Cuts down what LVGL sends to an SPI panel.
+ *
+ * The invalidated areas are rounded out to a grid of tiles, and every flush compares the tiles
+ * it covers with a copy of what the panel shows, kept in PSRAM. Only the bounding box of the
+ * tiles that changed since they were last sent goes to the panel driver, packed in place in the
+ * draw buffer, and a flush without a changed tile is not sent at all. Without the memory for
+ * the copy the flushes go to the panel as they are. LVGL rounds the height of the bands it renders with the same rounder, so
+ * the bands stay on the grid too.
+ *
+ * Attach() is called with the LVGL lock held, the flushes run in the LVGL task and
+ * GetStatsJson() may be called by any task.
+ */
+class FlushPlanner {
+public:
+    FlushPlanner() = default;
+    ~FlushPlanner();
+    FlushPlanner(const FlushPlanner&) = delete;
+    FlushPlanner& operator=(const FlushPlanner&) = delete;
+
+    // Takes over the flush callback the port has set on the display
+    void Attach(lv_display_t* display);
+    // The caller owns the returned object
+    cJSON* GetStatsJson();
+
+private:
+    lv_display_t* display_ = nullptr;
+    lv_display_flush_cb_t panel_flush_ = nullptr;
+    int32_t columns_ = 0;
+    int32_t rows_ = 0;
+    uint16_t* shadow_ = nullptr;        // The pixels on the panel, a row of the screen per line
+    std::vector<uint8_t> known_;        // Whether the shadow holds a tile, 0 until it is sent
+    FlushPlanner* next_ = nullptr;
+    static FlushPlanner* planners_;     // The flush callback has no user data
+
+    std::mutex mutex_;      // Guards the counters
+    uint32_t flushes_ = 0;
+    uint32_t skipped_flushes_ = 0;
+    uint64_t sent_bytes_ = 0;
+    uint64_t skipped_bytes_ = 0;
+    int64_t window_start_us_ = 0;
+    uint32_t window_bytes_ = 0;
+    uint32_t bytes_per_second_ = 0;
+
+    static void OnInvalidateArea(lv_event_t* e);
+    static void OnFlush(lv_display_t* display, const lv_area_t* area, uint8_t* color_map);
+    void Flush(const lv_area_t* area, uint8_t* color_map);
+    void ForgetTiles(int32_t x1, int32_t y1, int32_t x2, int32_t y2);
+    void Count(size_t sent, size_t skipped);
+    // Copies the tile into the shadow, false if the shadow already held those pixels
+    bool UpdateTile(const uint16_t* pixels, int32_t stride, int32_t x, int32_t y, int32_t width, int32_t height);
+};
+
+#endif // _FLUSH_PLANNER_H_
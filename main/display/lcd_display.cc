@@ -1,4 +1,5 @@
 #include "lcd_display.h"
+#include "task_profile.h"
 #include "gif/lvgl_gif.h"
 #include "settings.h"
 #include "lvgl_theme.h"
@@ -127,20 +128,34 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
 
     ESP_LOGI(TAG, "Initialize LVGL port");
     lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
-    port_cfg.task_priority = 1;
-#if CONFIG_SOC_CPU_CORES_NUM > 1
-    port_cfg.task_affinity = 1;
-#endif
+    port_cfg.task_priority = TaskProfiles::Get(kTaskLvgl).priority;
+    port_cfg.task_affinity = TaskProfiles::Get(kTaskLvgl).core;
     lvgl_port_init(&port_cfg);
 
+    // With two buffers LVGL renders the next band while the transfer of the last one is running
+#if CONFIG_SPI_LCD_DRAW_BUFFER_PSRAM
+    constexpr bool double_buffer = true;
+    constexpr bool buffer_in_psram = true;
+    // SPI can not DMA from PSRAM, the port copies the bands through a bounce buffer in internal RAM
+    const uint32_t trans_size = width_ * SPI_LCD_BOUNCE_BUFFER_LINES;
+#elif CONFIG_SPI_LCD_DRAW_BUFFER_DOUBLE
+    constexpr bool double_buffer = true;
+    constexpr bool buffer_in_psram = false;
+    const uint32_t trans_size = 0;
+#else
+    constexpr bool double_buffer = false;
+    constexpr bool buffer_in_psram = false;
+    const uint32_t trans_size = 0;
+#endif
+
     ESP_LOGI(TAG, "Adding LCD display");
     const lvgl_port_display_cfg_t display_cfg = {
         .io_handle = panel_io_,
         .panel_handle = panel_,
         .control_handle = nullptr,
-        .buffer_size = static_cast<uint32_t>(width_ * 20),
-        .double_buffer = false,
-        .trans_size = 0,
+        .buffer_size = static_cast<uint32_t>(width_ * CONFIG_SPI_LCD_DRAW_BUFFER_LINES),
+        .double_buffer = double_buffer,
+        .trans_size = trans_size,
         .hres = static_cast<uint32_t>(width_),
         .vres = static_cast<uint32_t>(height_),
         .monochrome = false,
@@ -151,8 +166,8 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
         },
         .color_format = LV_COLOR_FORMAT_RGB565,
         .flags = {
-            .buff_dma = 1,
-            .buff_spiram = 0,
+            .buff_dma = !buffer_in_psram,
+            .buff_spiram = buffer_in_psram,
             .sw_rotate = 0,
             .swap_bytes = 1,
             .full_refresh = 0,
@@ -170,6 +185,14 @@ SpiLcdDisplay::SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
         lv_display_set_offset(display_, offset_x, offset_y);
     }
 
+    // SPI bandwidth limits the frame rate, only the tiles that changed are sent
+    {
+        DisplayLockGuard lock(this);
+        flush_planner_.Attach(display_);
+        refresh_governor_.Attach(display_);
+        AttachTraceMarkers();
+    }
+
     SetupUI();
 }
 
@@ -191,7 +214,7 @@ RgbLcdDisplay::RgbLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
 
     ESP_LOGI(TAG, "Initialize LVGL port");
     lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
-    port_cfg.task_priority = 1;
+    port_cfg.task_priority = TaskProfiles::Get(kTaskLvgl).priority;
     port_cfg.timer_period_ms = 50;
     lvgl_port_init(&port_cfg);
 
@@ -233,6 +256,12 @@ RgbLcdDisplay::RgbLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_h
         lv_display_set_offset(display_, offset_x, offset_y);
     }
 
+    {
+        DisplayLockGuard lock(this);
+        refresh_governor_.Attach(display_);
+        AttachTraceMarkers();
+    }
+
     SetupUI();
 }
 
@@ -246,6 +275,8 @@ MipiLcdDisplay::MipiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel
 
     ESP_LOGI(TAG, "Initialize LVGL port");
     lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
+    // The MIPI panels keep the priority of the port, only the core comes from the task profile
+    port_cfg.task_affinity = TaskProfiles::Get(kTaskLvgl).core;
     lvgl_port_init(&port_cfg);
 
     ESP_LOGI(TAG, "Adding LCD display");
@@ -286,6 +317,12 @@ MipiLcdDisplay::MipiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel
         lv_display_set_offset(display_, offset_x, offset_y);
     }
 
+    {
+        DisplayLockGuard lock(this);
+        refresh_governor_.Attach(display_);
+        AttachTraceMarkers();
+    }
+
     SetupUI();
 }
 
@@ -339,6 +376,15 @@ LcdDisplay::~LcdDisplay() {
     if (display_ != nullptr) {
         lv_display_delete(display_);
     }
+    if (styles_initialized_) {
+        for (auto style : {&screen_style_, &container_style_, &bar_style_, &text_style_, &icon_style_, &low_battery_style_,
+#if CONFIG_USE_WECHAT_MESSAGE_STYLE
+                           &user_bubble_style_, &assistant_bubble_style_, &system_bubble_style_, &system_text_style_,
+#endif
+                          }) {
+            lv_style_reset(style);
+        }
+    }
 
     if (panel_ != nullptr) {
         esp_lcd_panel_del(panel_);
@@ -362,13 +408,11 @@ void LcdDisplay::SetupUI() {
 
     auto lvgl_theme = static_cast<LvglTheme*>(current_theme_);
     auto text_font = lvgl_theme->text_font()->font();
-    auto icon_font = lvgl_theme->icon_font()->font();
     auto large_icon_font = lvgl_theme->large_icon_font()->font();
 
     auto screen = lv_screen_active();
-    lv_obj_set_style_text_font(screen, text_font, 0);
-    lv_obj_set_style_text_color(screen, lvgl_theme->text_color(), 0);
-    lv_obj_set_style_bg_color(screen, lvgl_theme->background_color(), 0);
+    UpdateThemeStyles(lvgl_theme);
+    lv_obj_add_style(screen, &screen_style_, 0);
 
     /* Container */
     container_ = lv_obj_create(screen);
@@ -378,15 +422,13 @@ void LcdDisplay::SetupUI() {
     lv_obj_set_style_pad_all(container_, 0, 0);
     lv_obj_set_style_border_width(container_, 0, 0);
     lv_obj_set_style_pad_row(container_, 0, 0);
-    lv_obj_set_style_bg_color(container_, lvgl_theme->background_color(), 0);
-    lv_obj_set_style_border_color(container_, lvgl_theme->border_color(), 0);
+    lv_obj_add_style(container_, &container_style_, 0);
 
     /* Layer 1: Top bar - for status icons */
     top_bar_ = lv_obj_create(container_);
     lv_obj_set_size(top_bar_, LV_HOR_RES, LV_SIZE_CONTENT);
     lv_obj_set_style_radius(top_bar_, 0, 0);
-    lv_obj_set_style_bg_opa(top_bar_, LV_OPA_50, 0);  // 50% opacity background
-    lv_obj_set_style_bg_color(top_bar_, lvgl_theme->background_color(), 0);
+    lv_obj_add_style(top_bar_, &bar_style_, 0);  // 50% opacity background
     lv_obj_set_style_border_width(top_bar_, 0, 0);
     lv_obj_set_style_pad_all(top_bar_, 0, 0);
     lv_obj_set_style_pad_top(top_bar_, lvgl_theme->spacing(2), 0);
@@ -400,8 +442,7 @@ void LcdDisplay::SetupUI() {
     // Left icon
     network_label_ = lv_label_create(top_bar_);
     lv_label_set_text(network_label_, "");
-    lv_obj_set_style_text_font(network_label_, icon_font, 0);
-    lv_obj_set_style_text_color(network_label_, lvgl_theme->text_color(), 0);
+    lv_obj_add_style(network_label_, &icon_style_, 0);
 
     // Right icons container
     lv_obj_t* right_icons = lv_obj_create(top_bar_);
@@ -414,13 +455,11 @@ void LcdDisplay::SetupUI() {
 
     mute_label_ = lv_label_create(right_icons);
     lv_label_set_text(mute_label_, "");
-    lv_obj_set_style_text_font(mute_label_, icon_font, 0);
-    lv_obj_set_style_text_color(mute_label_, lvgl_theme->text_color(), 0);
+    lv_obj_add_style(mute_label_, &icon_style_, 0);
 
     battery_label_ = lv_label_create(right_icons);
     lv_label_set_text(battery_label_, "");
-    lv_obj_set_style_text_font(battery_label_, icon_font, 0);
-    lv_obj_set_style_text_color(battery_label_, lvgl_theme->text_color(), 0);
+    lv_obj_add_style(battery_label_, &icon_style_, 0);
     lv_obj_set_style_margin_left(battery_label_, lvgl_theme->spacing(2), 0);
 
     /* Layer 2: Status bar - for center text labels */
@@ -439,7 +478,7 @@ void LcdDisplay::SetupUI() {
     notification_label_ = lv_label_create(status_bar_);
     lv_obj_set_width(notification_label_, LV_HOR_RES * 0.8);
     lv_obj_set_style_text_align(notification_label_, LV_TEXT_ALIGN_CENTER, 0);
-    lv_obj_set_style_text_color(notification_label_, lvgl_theme->text_color(), 0);
+    lv_obj_add_style(notification_label_, &text_style_, 0);
     lv_label_set_text(notification_label_, "");
     lv_obj_align(notification_label_, LV_ALIGN_CENTER, 0, 0);
     lv_obj_add_flag(notification_label_, LV_OBJ_FLAG_HIDDEN);
@@ -448,7 +487,7 @@ void LcdDisplay::SetupUI() {
     lv_obj_set_width(status_label_, LV_HOR_RES * 0.8);
     lv_label_set_long_mode(status_label_, LV_LABEL_LONG_SCROLL_CIRCULAR);
     lv_obj_set_style_text_align(status_label_, LV_TEXT_ALIGN_CENTER, 0);
-    lv_obj_set_style_text_color(status_label_, lvgl_theme->text_color(), 0);
+    lv_obj_add_style(status_label_, &text_style_, 0);
     lv_label_set_text(status_label_, Lang::Strings::INITIALIZING);
     lv_obj_align(status_label_, LV_ALIGN_CENTER, 0, 0);
     
@@ -472,12 +511,17 @@ void LcdDisplay::SetupUI() {
 
     // We'll create chat messages dynamically in SetChatMessage
     chat_message_label_ = nullptr;
+    chat_bubbles_.clear();
+    // Older messages are filled into the bubbles when the chat is scrolled to an end
+    lv_obj_add_event_cb(content_, [](lv_event_t* e) {
+        static_cast<LcdDisplay*>(lv_event_get_user_data(e))->OnChatScroll();
+    }, LV_EVENT_SCROLL_END, this);
 
     low_battery_popup_ = lv_obj_create(screen);
     lv_obj_set_scrollbar_mode(low_battery_popup_, LV_SCROLLBAR_MODE_OFF);
     lv_obj_set_size(low_battery_popup_, LV_HOR_RES * 0.9, text_font->line_height * 2);
     lv_obj_align(low_battery_popup_, LV_ALIGN_BOTTOM_MID, 0, -lvgl_theme->spacing(4));
-    lv_obj_set_style_bg_color(low_battery_popup_, lvgl_theme->low_battery_color(), 0);
+    lv_obj_add_style(low_battery_popup_, &low_battery_style_, 0);
     lv_obj_set_style_radius(low_battery_popup_, lvgl_theme->spacing(4), 0);
     low_battery_label_ = lv_label_create(low_battery_popup_);
     lv_label_set_text(low_battery_label_, Lang::Strings::BATTERY_NEED_CHARGE);
@@ -492,58 +536,162 @@ void LcdDisplay::SetupUI() {
     emoji_label_ = lv_label_create(screen);
     lv_obj_center(emoji_label_);
     lv_obj_set_style_text_font(emoji_label_, large_icon_font, 0);
-    lv_obj_set_style_text_color(emoji_label_, lvgl_theme->text_color(), 0);
+    lv_obj_add_style(emoji_label_, &text_style_, 0);
     lv_label_set_text(emoji_label_, FONT_AWESOME_MICROCHIP_AI);
 }
-#if CONFIG_IDF_TARGET_ESP32P4
-#define  MAX_MESSAGES 40
-#else
-#define  MAX_MESSAGES 20
-#endif
+LcdDisplay::ChatBubble LcdDisplay::CreateChatBubble() {
+    auto lvgl_theme = static_cast<LvglTheme*>(current_theme_);
+    ChatBubble bubble;
+
+    // A full-width container to align the bubble in
+    bubble.container = lv_obj_create(content_);
+    lv_obj_set_width(bubble.container, LV_HOR_RES);
+    lv_obj_set_height(bubble.container, LV_SIZE_CONTENT);
+    lv_obj_set_style_bg_opa(bubble.container, LV_OPA_TRANSP, 0);
+    lv_obj_set_style_border_width(bubble.container, 0, 0);
+    lv_obj_set_style_pad_all(bubble.container, 0, 0);
+    lv_obj_set_scrollbar_mode(bubble.container, LV_SCROLLBAR_MODE_OFF);
+
+    bubble.bubble = lv_obj_create(bubble.container);
+    lv_obj_set_style_radius(bubble.bubble, 8, 0);
+    lv_obj_set_scrollbar_mode(bubble.bubble, LV_SCROLLBAR_MODE_OFF);
+    lv_obj_set_style_border_width(bubble.bubble, 0, 0);
+    lv_obj_set_style_pad_all(bubble.bubble, lvgl_theme->spacing(4), 0);
+    lv_obj_set_style_bg_opa(bubble.bubble, LV_OPA_70, 0);
+    lv_obj_set_size(bubble.bubble, LV_SIZE_CONTENT, LV_SIZE_CONTENT);
+    lv_obj_set_style_flex_grow(bubble.bubble, 0, 0);
+
+    bubble.label = lv_label_create(bubble.bubble);
+    return bubble;
+}
+
+void LcdDisplay::FillChatBubble(ChatBubble& bubble, uint32_t number) {
+    const char* role;
+    std::string text;
+    if (!chat_history_.Get(number, role, text)) {
+        return;
+    }
+    bubble.number = number;
+
+    lv_label_set_text(bubble.label, text.c_str());
+
+    // Calculate bubble width constraints
+    lv_coord_t max_width = LV_HOR_RES * 85 / 100 - 16;  // 85% of screen width
+    lv_coord_t min_width = 20;
+
+    // Let LVGL calculate the natural text width first
+    lv_obj_set_width(bubble.label, LV_SIZE_CONTENT);
+    lv_obj_update_layout(bubble.label);
+    lv_coord_t text_width = std::max<lv_coord_t>(lv_obj_get_width(bubble.label), min_width);
+    lv_obj_set_width(bubble.label, std::min(text_width, max_width));
+    lv_label_set_long_mode(bubble.label, LV_LABEL_LONG_WRAP);
+
+    // The bubble type is kept in the user data to swap the styles of a reused bubble, the role names are literals
+    auto old_role = static_cast<const char*>(lv_obj_get_user_data(bubble.bubble));
+    if (old_role == nullptr) {
+        lv_obj_add_style(bubble.bubble, BubbleStyle(role), 0);
+        lv_obj_add_style(bubble.label, BubbleTextStyle(role), 0);
+    } else if (BubbleStyle(old_role) != BubbleStyle(role)) {
+        lv_obj_replace_style(bubble.bubble, BubbleStyle(old_role), BubbleStyle(role), 0);
+        lv_obj_replace_style(bubble.label, BubbleTextStyle(old_role), BubbleTextStyle(role), 0);
+    }
+    lv_obj_set_user_data(bubble.bubble, (void*)role);
+    if (strcmp(role, "user") == 0) {
+        // User messages are right-aligned with green background
+        lv_obj_align(bubble.bubble, LV_ALIGN_RIGHT_MID, -25, 0);
+    } else if (strcmp(role, "assistant") == 0) {
+        // Assistant messages are left-aligned with white background
+        lv_obj_align(bubble.bubble, LV_ALIGN_LEFT_MID, 0, 0);
+    } else {
+        // System messages are center-aligned with light gray background
+        lv_obj_align(bubble.bubble, LV_ALIGN_CENTER, 0, 0);
+    }
+}
+
+void LcdDisplay::DeleteChatImagesAbove(lv_obj_t* container) {
+    // Image previews are not in the history, they go once they are above the oldest bubble
+    lv_obj_t* first;
+    while ((first = lv_obj_get_child(content_, 0)) != nullptr && first != container) {
+        lv_obj_del(first);
+    }
+}
+
+void LcdDisplay::ShowLatestChatMessages() {
+    // Only the bubbles are kept, they show the newest messages again
+    for (int32_t i = lv_obj_get_child_cnt(content_) - 1; i >= 0; i--) {
+        auto child = lv_obj_get_child(content_, i);
+        bool is_bubble = std::any_of(chat_bubbles_.begin(), chat_bubbles_.end(), [child](const ChatBubble& bubble) {
+            return bubble.container == child;
+        });
+        if (!is_bubble) {
+            lv_obj_del(child);
+        }
+    }
+    size_t count = std::min<size_t>(chat_history_.newest() - chat_history_.oldest() + 1, CHAT_LIVE_BUBBLES);
+    while (chat_bubbles_.size() > count) {
+        lv_obj_del(chat_bubbles_.front().container);
+        chat_bubbles_.pop_front();
+    }
+    while (chat_bubbles_.size() < count) {
+        chat_bubbles_.push_back(CreateChatBubble());
+    }
+    uint32_t number = chat_history_.newest() - chat_bubbles_.size() + 1;
+    for (auto& bubble : chat_bubbles_) {
+        FillChatBubble(bubble, number++);
+    }
+}
+
+void LcdDisplay::OnChatScroll() {
+    // Moving the bubbles scrolls the view, which ends in another scroll event
+    if (chat_bubbles_.size() < 2 || chat_recycling_) {
+        return;
+    }
+    chat_recycling_ = true;
+    int32_t pad_row = lv_obj_get_style_pad_row(content_, LV_PART_MAIN);
+    uint32_t front_number = chat_bubbles_.front().number;
+    uint32_t back_number = chat_bubbles_.back().number;
+    if (lv_obj_get_scroll_top(content_) <= 0 && !chat_history_.empty() && front_number > chat_history_.oldest()) {
+        // The bottom bubble moves to the top for the message before, the view stays where it is
+        auto bubble = chat_bubbles_.back();
+        chat_bubbles_.pop_back();
+        lv_obj_move_to_index(bubble.container, 0);
+        FillChatBubble(bubble, front_number - 1);
+        chat_bubbles_.push_front(bubble);
+        lv_obj_update_layout(content_);
+        lv_obj_scroll_to_y(content_, lv_obj_get_height(bubble.container) + pad_row, LV_ANIM_OFF);
+    } else if (lv_obj_get_scroll_bottom(content_) <= 0 && back_number < chat_history_.newest()) {
+        auto bubble = chat_bubbles_.front();
+        chat_bubbles_.pop_front();
+        DeleteChatImagesAbove(bubble.container);
+        int32_t height = lv_obj_get_height(bubble.container) + pad_row;
+        lv_obj_move_to_index(bubble.container, -1);
+        FillChatBubble(bubble, back_number + 1);
+        chat_bubbles_.push_back(bubble);
+        lv_obj_update_layout(content_);
+        lv_obj_scroll_to_y(content_, lv_obj_get_scroll_y(content_) - height, LV_ANIM_OFF);
+    }
+    chat_recycling_ = false;
+}
+
 void LcdDisplay::SetChatMessage(const char* role, const char* content) {
     DisplayLockGuard lock(this);
     if (content_ == nullptr) {
         return;
     }
-    
-    // Check if message count exceeds limit
-    uint32_t child_count = lv_obj_get_child_cnt(content_);
-    if (child_count >= MAX_MESSAGES) {
-        // Delete the oldest message (first child object)
-        lv_obj_t* first_child = lv_obj_get_child(content_, 0);
-        if (first_child != nullptr) {
-            lv_obj_del(first_child);
-            // Refresh child count after deletion
-            child_count = lv_obj_get_child_cnt(content_);
-        }
-        // Scroll to the last message immediately (get last_child after deletion)
-        if (child_count > 0) {
-            lv_obj_t* last_child = lv_obj_get_child(content_, child_count - 1);
-            if (last_child != nullptr && lv_obj_is_valid(last_child)) {
-                lv_obj_scroll_to_view_recursive(last_child, LV_ANIM_OFF);
-            }
-        }
-    }
-    
+
     // Collapse system messages (if it's a system message, check if the last message is also a system message)
     if (strcmp(role, "system") == 0) {
-        // Refresh child count to get accurate count after potential deletion above
-        child_count = lv_obj_get_child_cnt(content_);
-        if (child_count > 0) {
-            // Get the last message container
-            lv_obj_t* last_container = lv_obj_get_child(content_, child_count - 1);
-            if (last_container != nullptr && lv_obj_is_valid(last_container) && lv_obj_get_child_cnt(last_container) > 0) {
-                // Get the bubble inside the container
-                lv_obj_t* last_bubble = lv_obj_get_child(last_container, 0);
-                if (last_bubble != nullptr && lv_obj_is_valid(last_bubble)) {
-                    // Check if bubble type is system message
-                    void* bubble_type_ptr = lv_obj_get_user_data(last_bubble);
-                    if (bubble_type_ptr != nullptr && strcmp((const char*)bubble_type_ptr, "system") == 0) {
-                        // If the last message is also a system message, delete it
-                        lv_obj_del(last_container);
-                    }
+        auto last_role = chat_history_.empty() ? nullptr : chat_history_.RoleOf(chat_history_.newest());
+        if (last_role != nullptr && strcmp(last_role, "system") == 0) {
+            // If the last message is also a system message, delete it
+            if (!chat_bubbles_.empty() && chat_bubbles_.back().number == chat_history_.newest()) {
+                if (chat_message_label_ == chat_bubbles_.back().label) {
+                    chat_message_label_ = nullptr;
                 }
+                lv_obj_del(chat_bubbles_.back().container);
+                chat_bubbles_.pop_back();
             }
+            chat_history_.PopNewest();
         }
     } else {
         // Hide the centered AI logo
@@ -551,143 +699,75 @@ void LcdDisplay::SetChatMessage(const char* role, const char* content) {
     }
 
     // Avoid empty message boxes
-    if(strlen(content) == 0) {
+    if (strlen(content) == 0) {
         return;
     }
 
-    auto lvgl_theme = static_cast<LvglTheme*>(current_theme_);
-
-    // Create a message bubble
-    lv_obj_t* msg_bubble = lv_obj_create(content_);
-    lv_obj_set_style_radius(msg_bubble, 8, 0);
-    lv_obj_set_scrollbar_mode(msg_bubble, LV_SCROLLBAR_MODE_OFF);
-    lv_obj_set_style_border_width(msg_bubble, 0, 0);
-    lv_obj_set_style_pad_all(msg_bubble, lvgl_theme->spacing(4), 0);
-
-    // Create the message text
-    lv_obj_t* msg_text = lv_label_create(msg_bubble);
-    lv_label_set_text(msg_text, content);
-    
-    // Calculate bubble width constraints
-    lv_coord_t max_width = LV_HOR_RES * 85 / 100 - 16;  // 85% of screen width
-    lv_coord_t min_width = 20;  
-    
-    // Let LVGL calculate the natural text width first
-    lv_obj_set_width(msg_text, LV_SIZE_CONTENT);
-    lv_obj_update_layout(msg_text);
-    lv_coord_t text_width = lv_obj_get_width(msg_text);
-    
-    // Ensure text width is not less than minimum width
-    if (text_width < min_width) {
-        text_width = min_width;
+    bool showing_newest = chat_bubbles_.empty() || chat_history_.empty() || chat_bubbles_.back().number == chat_history_.newest();
+    uint32_t number = chat_history_.Push(role, content);
+    if (!showing_newest) {
+        // Scrolled back into the history, jump to the new message
+        ShowLatestChatMessages();
+    } else if (chat_bubbles_.size() < CHAT_LIVE_BUBBLES) {
+        chat_bubbles_.push_back(CreateChatBubble());
+        FillChatBubble(chat_bubbles_.back(), number);
+    } else {
+        // Reuse the oldest bubble for the new message
+        auto bubble = chat_bubbles_.front();
+        chat_bubbles_.pop_front();
+        DeleteChatImagesAbove(bubble.container);
+        lv_obj_move_to_index(bubble.container, -1);
+        FillChatBubble(bubble, number);
+        chat_bubbles_.push_back(bubble);
     }
 
-    // Constrain to max width
-    lv_coord_t bubble_width = (text_width < max_width) ? text_width : max_width;
-    
-    // Set message text width
-    lv_obj_set_width(msg_text, bubble_width);
-    lv_label_set_long_mode(msg_text, LV_LABEL_LONG_WRAP);
+    // Auto-scroll to the new message
+    lv_obj_scroll_to_view_recursive(chat_bubbles_.back().container, LV_ANIM_ON);
 
-    // Set bubble width
-    lv_obj_set_width(msg_bubble, bubble_width);
-    lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
+    // Store reference to the latest message label
+    chat_message_label_ = chat_bubbles_.back().label;
+}
 
-    // Set alignment and style based on message role
-    if (strcmp(role, "user") == 0) {
-        // User messages are right-aligned with green background
-        lv_obj_set_style_bg_color(msg_bubble, lvgl_theme->user_bubble_color(), 0);
-        lv_obj_set_style_bg_opa(msg_bubble, LV_OPA_70, 0);
-        // Set text color for contrast
-        lv_obj_set_style_text_color(msg_text, lvgl_theme->text_color(), 0);
-        
-        // Set custom attribute to mark bubble type
-        lv_obj_set_user_data(msg_bubble, (void*)"user");
-        
-        // Set appropriate width for content
-        lv_obj_set_width(msg_bubble, LV_SIZE_CONTENT);
-        lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
-        
-        // Don't grow
-        lv_obj_set_style_flex_grow(msg_bubble, 0, 0);
-    } else if (strcmp(role, "assistant") == 0) {
-        // Assistant messages are left-aligned with white background
-        lv_obj_set_style_bg_color(msg_bubble, lvgl_theme->assistant_bubble_color(), 0);
-        lv_obj_set_style_bg_opa(msg_bubble, LV_OPA_70, 0);
-        // Set text color for contrast
-        lv_obj_set_style_text_color(msg_text, lvgl_theme->text_color(), 0);
-        
-        // Set custom attribute to mark bubble type
-        lv_obj_set_user_data(msg_bubble, (void*)"assistant");
-        
-        // Set appropriate width for content
-        lv_obj_set_width(msg_bubble, LV_SIZE_CONTENT);
-        lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
-        
-        // Don't grow
-        lv_obj_set_style_flex_grow(msg_bubble, 0, 0);
-    } else if (strcmp(role, "system") == 0) {
-        // System messages are center-aligned with light gray background
-        lv_obj_set_style_bg_color(msg_bubble, lvgl_theme->system_bubble_color(), 0);
-        lv_obj_set_style_bg_opa(msg_bubble, LV_OPA_70, 0);
-        // Set text color for contrast
-        lv_obj_set_style_text_color(msg_text, lvgl_theme->system_text_color(), 0);
-        
-        // Set custom attribute to mark bubble type
-        lv_obj_set_user_data(msg_bubble, (void*)"system");
-        
-        // Set appropriate width for content
-        lv_obj_set_width(msg_bubble, LV_SIZE_CONTENT);
-        lv_obj_set_height(msg_bubble, LV_SIZE_CONTENT);
-        
-        // Don't grow
-        lv_obj_set_style_flex_grow(msg_bubble, 0, 0);
-    }
-    
-    // Create a full-width container for user messages to ensure right alignment
-    if (strcmp(role, "user") == 0) {
-        // Create a full-width container
-        lv_obj_t* container = lv_obj_create(content_);
-        lv_obj_set_width(container, LV_HOR_RES);
-        lv_obj_set_height(container, LV_SIZE_CONTENT);
-        
-        // Make container transparent and borderless
-        lv_obj_set_style_bg_opa(container, LV_OPA_TRANSP, 0);
-        lv_obj_set_style_border_width(container, 0, 0);
-        lv_obj_set_style_pad_all(container, 0, 0);
-        
-        // Move the message bubble into this container
-        lv_obj_set_parent(msg_bubble, container);
-        
-        // Right align the bubble in the container
-        lv_obj_align(msg_bubble, LV_ALIGN_RIGHT_MID, -25, 0);
-        
-        // Auto-scroll to this container
-        lv_obj_scroll_to_view_recursive(container, LV_ANIM_ON);
-    } else if (strcmp(role, "system") == 0) {
-        // Create full-width container for system messages to ensure center alignment
-        lv_obj_t* container = lv_obj_create(content_);
-        lv_obj_set_width(container, LV_HOR_RES);
-        lv_obj_set_height(container, LV_SIZE_CONTENT);
-        
-        lv_obj_set_style_bg_opa(container, LV_OPA_TRANSP, 0);
-        lv_obj_set_style_border_width(container, 0, 0);
-        lv_obj_set_style_pad_all(container, 0, 0);
-        
-        lv_obj_set_parent(msg_bubble, container);
-        lv_obj_align(msg_bubble, LV_ALIGN_CENTER, 0, 0);
-        lv_obj_scroll_to_view_recursive(container, LV_ANIM_ON);
-    } else {
-        // For assistant messages
-        // Left align assistant messages
-        lv_obj_align(msg_bubble, LV_ALIGN_LEFT_MID, 0, 0);
+void LcdDisplay::AppendChatMessage(const char* role, const char* content) {
+    {
+        DisplayLockGuard lock(this);
+        if (content_ == nullptr || strlen(content) == 0) {
+            return;
+        }
+        auto last_role = chat_history_.empty() ? nullptr : chat_history_.RoleOf(chat_history_.newest());
+        if (last_role != nullptr && strcmp(last_role, role) == 0 && strcmp(role, "system") != 0
+            && !chat_bubbles_.empty() && chat_bubbles_.back().number == chat_history_.newest()) {
+            auto& bubble = chat_bubbles_.back();
+            // Sentences in Latin scripts need a space between them, CJK ones do not
+            const char* text = lv_label_get_text(bubble.label);
+            size_t length = strlen(text);
+            std::string addition;
+            if (length > 0 && (uint8_t)text[length - 1] < 0x80 && text[length - 1] != ' '
+                && (uint8_t)content[0] < 0x80 && content[0] != ' ') {
+                addition = " ";
+            }
+            addition += content;
+            chat_history_.AppendToNewest(addition.c_str());
+
+            lv_coord_t max_width = LV_HOR_RES * 85 / 100 - 16;
+            if (lv_obj_get_width(bubble.label) < max_width) {
+                // Still a single line, the bubble width follows the text
+                FillChatBubble(bubble, bubble.number);
+            } else {
+                // The wrapped lines above stay as they are, only the label grows
+                lv_label_ins_text(bubble.label, LV_LABEL_POS_LAST, addition.c_str());
+            }
+            lv_obj_update_layout(content_);
 
-        // Auto-scroll to the message bubble
-        lv_obj_scroll_to_view_recursive(msg_bubble, LV_ANIM_ON);
+            // Follow the new lines without an animated scroll, which would redraw the whole list on every frame
+            int32_t below = lv_obj_get_scroll_bottom(content_);
+            if (below > 0) {
+                lv_obj_scroll_to_y(content_, lv_obj_get_scroll_y(content_) + below, LV_ANIM_OFF);
+            }
+            return;
+        }
     }
-    
-    // Store reference to the latest message label
-    chat_message_label_ = msg_text;
+    SetChatMessage(role, content);
 }
 
 void LcdDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
@@ -700,6 +780,15 @@ void LcdDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
         return;
     }
     
+    // Image previews are not kept in the history, the oldest object goes once there are too many
+    if (lv_obj_get_child_cnt(content_) >= CHAT_LIVE_BUBBLES * 2) {
+        auto first = lv_obj_get_child(content_, 0);
+        if (!chat_bubbles_.empty() && chat_bubbles_.front().container == first) {
+            chat_bubbles_.pop_front();
+        }
+        lv_obj_del(first);
+    }
+
     auto lvgl_theme = static_cast<LvglTheme*>(current_theme_);
     // Create a message bubble for image preview
     lv_obj_t* img_bubble = lv_obj_create(content_);
@@ -709,7 +798,7 @@ void LcdDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
     lv_obj_set_style_pad_all(img_bubble, lvgl_theme->spacing(4), 0);
     
     // Set image bubble background color (similar to system message)
-    lv_obj_set_style_bg_color(img_bubble, lvgl_theme->assistant_bubble_color(), 0);
+    lv_obj_add_style(img_bubble, &assistant_bubble_style_, 0);
     lv_obj_set_style_bg_opa(img_bubble, LV_OPA_70, 0);
     
     // Set custom attribute to mark bubble type
@@ -774,6 +863,15 @@ void LcdDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
     lv_obj_scroll_to_view_recursive(img_bubble, LV_ANIM_ON);
 }
 
+void LcdDisplay::InvalidatePreviewImage(int y, int lines) {
+    DisplayLockGuard lock(this);
+    // The newest image bubble is the last child of the content
+    if (content_ == nullptr || lv_obj_get_child_cnt(content_) == 0) {
+        return;
+    }
+    lv_obj_invalidate(lv_obj_get_child(content_, -1));
+}
+
 void LcdDisplay::ClearChatMessages() {
     DisplayLockGuard lock(this);
     if (content_ == nullptr) {
@@ -782,6 +880,8 @@ void LcdDisplay::ClearChatMessages() {
     
     // Use lv_obj_clean to delete all children of content_ (chat message bubbles)
     lv_obj_clean(content_);
+    chat_bubbles_.clear();
+    chat_history_.Clear();
     
     // Reset chat_message_label_ as it has been deleted
     chat_message_label_ = nullptr;
@@ -798,13 +898,11 @@ void LcdDisplay::SetupUI() {
     DisplayLockGuard lock(this);
     LvglTheme* lvgl_theme = static_cast<LvglTheme*>(current_theme_);
     auto text_font = lvgl_theme->text_font()->font();
-    auto icon_font = lvgl_theme->icon_font()->font();
     auto large_icon_font = lvgl_theme->large_icon_font()->font();
 
     auto screen = lv_screen_active();
-    lv_obj_set_style_text_font(screen, text_font, 0);
-    lv_obj_set_style_text_color(screen, lvgl_theme->text_color(), 0);
-    lv_obj_set_style_bg_color(screen, lvgl_theme->background_color(), 0);
+    UpdateThemeStyles(lvgl_theme);
+    lv_obj_add_style(screen, &screen_style_, 0);
 
     /* Container - used as background */
     container_ = lv_obj_create(screen);
@@ -812,8 +910,7 @@ void LcdDisplay::SetupUI() {
     lv_obj_set_style_radius(container_, 0, 0);
     lv_obj_set_style_pad_all(container_, 0, 0);
     lv_obj_set_style_border_width(container_, 0, 0);
-    lv_obj_set_style_bg_color(container_, lvgl_theme->background_color(), 0);
-    lv_obj_set_style_border_color(container_, lvgl_theme->border_color(), 0);
+    lv_obj_add_style(container_, &container_style_, 0);
 
     /* Bottom layer: emoji_box_ - centered display */
     emoji_box_ = lv_obj_create(screen);
@@ -825,7 +922,7 @@ void LcdDisplay::SetupUI() {
 
     emoji_label_ = lv_label_create(emoji_box_);
     lv_obj_set_style_text_font(emoji_label_, large_icon_font, 0);
-    lv_obj_set_style_text_color(emoji_label_, lvgl_theme->text_color(), 0);
+    lv_obj_add_style(emoji_label_, &text_style_, 0);
     lv_label_set_text(emoji_label_, FONT_AWESOME_MICROCHIP_AI);
 
     emoji_image_ = lv_img_create(emoji_box_);
@@ -842,8 +939,7 @@ void LcdDisplay::SetupUI() {
     top_bar_ = lv_obj_create(screen);
     lv_obj_set_size(top_bar_, LV_HOR_RES, LV_SIZE_CONTENT);
     lv_obj_set_style_radius(top_bar_, 0, 0);
-    lv_obj_set_style_bg_opa(top_bar_, LV_OPA_50, 0);  // 50% opacity background
-    lv_obj_set_style_bg_color(top_bar_, lvgl_theme->background_color(), 0);
+    lv_obj_add_style(top_bar_, &bar_style_, 0);  // 50% opacity background
     lv_obj_set_style_border_width(top_bar_, 0, 0);
     lv_obj_set_style_pad_all(top_bar_, 0, 0);
     lv_obj_set_style_pad_top(top_bar_, lvgl_theme->spacing(2), 0);
@@ -858,8 +954,7 @@ void LcdDisplay::SetupUI() {
     // Left icon
     network_label_ = lv_label_create(top_bar_);
     lv_label_set_text(network_label_, "");
-    lv_obj_set_style_text_font(network_label_, icon_font, 0);
-    lv_obj_set_style_text_color(network_label_, lvgl_theme->text_color(), 0);
+    lv_obj_add_style(network_label_, &icon_style_, 0);
 
     // Right icons container
     lv_obj_t* right_icons = lv_obj_create(top_bar_);
@@ -872,13 +967,11 @@ void LcdDisplay::SetupUI() {
 
     mute_label_ = lv_label_create(right_icons);
     lv_label_set_text(mute_label_, "");
-    lv_obj_set_style_text_font(mute_label_, icon_font, 0);
-    lv_obj_set_style_text_color(mute_label_, lvgl_theme->text_color(), 0);
+    lv_obj_add_style(mute_label_, &icon_style_, 0);
 
     battery_label_ = lv_label_create(right_icons);
     lv_label_set_text(battery_label_, "");
-    lv_obj_set_style_text_font(battery_label_, icon_font, 0);
-    lv_obj_set_style_text_color(battery_label_, lvgl_theme->text_color(), 0);
+    lv_obj_add_style(battery_label_, &icon_style_, 0);
     lv_obj_set_style_margin_left(battery_label_, lvgl_theme->spacing(2), 0);
 
     /* Layer 2: Status bar - for center text labels */
@@ -897,7 +990,7 @@ void LcdDisplay::SetupUI() {
     notification_label_ = lv_label_create(status_bar_);
     lv_obj_set_width(notification_label_, LV_HOR_RES * 0.75);
     lv_obj_set_style_text_align(notification_label_, LV_TEXT_ALIGN_CENTER, 0);
-    lv_obj_set_style_text_color(notification_label_, lvgl_theme->text_color(), 0);
+    lv_obj_add_style(notification_label_, &text_style_, 0);
     lv_label_set_text(notification_label_, "");
     lv_obj_align(notification_label_, LV_ALIGN_CENTER, 0, 0);
     lv_obj_add_flag(notification_label_, LV_OBJ_FLAG_HIDDEN);
@@ -906,7 +999,7 @@ void LcdDisplay::SetupUI() {
     lv_obj_set_width(status_label_, LV_HOR_RES * 0.75);
     lv_label_set_long_mode(status_label_, LV_LABEL_LONG_SCROLL_CIRCULAR);
     lv_obj_set_style_text_align(status_label_, LV_TEXT_ALIGN_CENTER, 0);
-    lv_obj_set_style_text_color(status_label_, lvgl_theme->text_color(), 0);
+    lv_obj_add_style(status_label_, &text_style_, 0);
     lv_label_set_text(status_label_, Lang::Strings::INITIALIZING);
     lv_obj_align(status_label_, LV_ALIGN_CENTER, 0, 0);
 
@@ -914,8 +1007,8 @@ void LcdDisplay::SetupUI() {
     bottom_bar_ = lv_obj_create(screen);
     lv_obj_set_size(bottom_bar_, LV_HOR_RES, text_font->line_height + lvgl_theme->spacing(12));
     lv_obj_set_style_radius(bottom_bar_, 0, 0);
-    lv_obj_set_style_bg_color(bottom_bar_, lvgl_theme->background_color(), 0);
-    lv_obj_set_style_text_color(bottom_bar_, lvgl_theme->text_color(), 0);
+    lv_obj_add_style(bottom_bar_, &bar_style_, 0);
+    lv_obj_add_style(bottom_bar_, &text_style_, 0);
     lv_obj_set_style_pad_all(bottom_bar_, 0, 0);
     lv_obj_set_style_pad_left(bottom_bar_, lvgl_theme->spacing(4), 0);
     lv_obj_set_style_pad_right(bottom_bar_, lvgl_theme->spacing(4), 0);
@@ -929,7 +1022,7 @@ void LcdDisplay::SetupUI() {
     lv_obj_set_width(chat_message_label_, LV_HOR_RES - lvgl_theme->spacing(8));
     lv_label_set_long_mode(chat_message_label_, LV_LABEL_LONG_SCROLL_CIRCULAR);
     lv_obj_set_style_text_align(chat_message_label_, LV_TEXT_ALIGN_CENTER, 0);
-    lv_obj_set_style_text_color(chat_message_label_, lvgl_theme->text_color(), 0);
+    lv_obj_add_style(chat_message_label_, &text_style_, 0);
     lv_obj_align(chat_message_label_, LV_ALIGN_CENTER, 0, 0);
 
     // Start scrolling after a delay (short text won't scroll)
@@ -944,7 +1037,7 @@ void LcdDisplay::SetupUI() {
     lv_obj_set_scrollbar_mode(low_battery_popup_, LV_SCROLLBAR_MODE_OFF);
     lv_obj_set_size(low_battery_popup_, LV_HOR_RES * 0.9, text_font->line_height * 2);
     lv_obj_align(low_battery_popup_, LV_ALIGN_BOTTOM_MID, 0, -lvgl_theme->spacing(4));
-    lv_obj_set_style_bg_color(low_battery_popup_, lvgl_theme->low_battery_color(), 0);
+    lv_obj_add_style(low_battery_popup_, &low_battery_style_, 0);
     lv_obj_set_style_radius(low_battery_popup_, lvgl_theme->spacing(4), 0);
     
     low_battery_label_ = lv_label_create(low_battery_popup_);
@@ -990,6 +1083,30 @@ void LcdDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
     ESP_ERROR_CHECK(esp_timer_start_once(preview_timer_, PREVIEW_IMAGE_DURATION_MS * 1000));
 }
 
+void LcdDisplay::InvalidatePreviewImage(int y, int lines) {
+    DisplayLockGuard lock(this);
+    if (preview_image_ == nullptr || preview_image_cached_ == nullptr ||
+        lv_obj_has_flag(preview_image_, LV_OBJ_FLAG_HIDDEN)) {
+        return;
+    }
+    // The image is scaled about the center of the object
+    auto img_dsc = preview_image_cached_->image_dsc();
+    int32_t scale = lv_image_get_scale(preview_image_);
+    lv_area_t coords;
+    lv_obj_get_coords(preview_image_, &coords);
+    int32_t center_x = (coords.x1 + coords.x2) / 2;
+    int32_t top = (coords.y1 + coords.y2) / 2 - (int32_t)img_dsc->header.h * scale / 512;
+    int32_t half_width = (int32_t)img_dsc->header.w * scale / 512;
+    // A pixel more on each side covers the rounding of the scaled lines
+    lv_area_t band = {
+        .x1 = center_x - half_width - 1,
+        .y1 = top + y * scale / 256 - 1,
+        .x2 = center_x + half_width + 1,
+        .y2 = top + (y + lines) * scale / 256 + 1,
+    };
+    lv_inv_area(display_, &band);
+}
+
 void LcdDisplay::SetChatMessage(const char* role, const char* content) {
     DisplayLockGuard lock(this);
     if (chat_message_label_ == nullptr) {
@@ -1078,143 +1195,76 @@ void LcdDisplay::SetEmotion(const char* emotion) {
 #endif
 }
 
-void LcdDisplay::SetTheme(Theme* theme) {
-    DisplayLockGuard lock(this);
-    
-    auto lvgl_theme = static_cast<LvglTheme*>(theme);
-    
-    // Get the active screen
-    lv_obj_t* screen = lv_screen_active();
+void LcdDisplay::UpdateThemeStyles(LvglTheme* theme) {
+    if (!styles_initialized_) {
+        for (auto style : {&screen_style_, &container_style_, &bar_style_, &text_style_, &icon_style_, &low_battery_style_,
+#if CONFIG_USE_WECHAT_MESSAGE_STYLE
+                           &user_bubble_style_, &assistant_bubble_style_, &system_bubble_style_, &system_text_style_,
+#endif
+                          }) {
+            lv_style_init(style);
+        }
+        styles_initialized_ = true;
+    }
 
-    // Set font
-    auto text_font = lvgl_theme->text_font()->font();
-    auto icon_font = lvgl_theme->icon_font()->font();
-    auto large_icon_font = lvgl_theme->large_icon_font()->font();
+    auto text_font = theme->text_font()->font();
+    lv_style_set_text_font(&screen_style_, text_font);
+    lv_style_set_text_color(&screen_style_, theme->text_color());
+    lv_style_set_bg_color(&screen_style_, theme->background_color());
 
-    if (text_font->line_height >= 40) {
-        lv_obj_set_style_text_font(mute_label_, large_icon_font, 0);
-        lv_obj_set_style_text_font(battery_label_, large_icon_font, 0);
-        lv_obj_set_style_text_font(network_label_, large_icon_font, 0);
+    // The background images come from the mmapped assets, switching to one draws it from there
+    lv_style_set_bg_color(&container_style_, theme->background_color());
+    lv_style_set_border_color(&container_style_, theme->border_color());
+    if (theme->background_image() != nullptr) {
+        lv_style_set_bg_image_src(&container_style_, theme->background_image()->image_dsc());
     } else {
-        lv_obj_set_style_text_font(mute_label_, icon_font, 0);
-        lv_obj_set_style_text_font(battery_label_, icon_font, 0);
-        lv_obj_set_style_text_font(network_label_, icon_font, 0);
+        lv_style_remove_prop(&container_style_, LV_STYLE_BG_IMAGE_SRC);
     }
 
-    // Set parent text color
-    lv_obj_set_style_text_font(screen, text_font, 0);
-    lv_obj_set_style_text_color(screen, lvgl_theme->text_color(), 0);
+    lv_style_set_bg_opa(&bar_style_, LV_OPA_50);
+    lv_style_set_bg_color(&bar_style_, theme->background_color());
+    lv_style_set_text_color(&text_style_, theme->text_color());
+    lv_style_set_text_color(&icon_style_, theme->text_color());
+    lv_style_set_text_font(&icon_style_, text_font->line_height >= 40 ? theme->large_icon_font()->font() : theme->icon_font()->font());
+    lv_style_set_bg_color(&low_battery_style_, theme->low_battery_color());
 
-    // Set background image
-    if (lvgl_theme->background_image() != nullptr) {
-        lv_obj_set_style_bg_image_src(container_, lvgl_theme->background_image()->image_dsc(), 0);
-    } else {
-        lv_obj_set_style_bg_image_src(container_, nullptr, 0);
-        lv_obj_set_style_bg_color(container_, lvgl_theme->background_color(), 0);
+#if CONFIG_USE_WECHAT_MESSAGE_STYLE
+    lv_style_set_bg_color(&user_bubble_style_, theme->user_bubble_color());
+    lv_style_set_bg_color(&assistant_bubble_style_, theme->assistant_bubble_color());
+    lv_style_set_bg_color(&system_bubble_style_, theme->system_bubble_color());
+    for (auto style : {&user_bubble_style_, &assistant_bubble_style_, &system_bubble_style_}) {
+        lv_style_set_border_color(style, theme->border_color());
     }
-    
-    // Update top bar background color with 50% opacity
-    if (top_bar_ != nullptr) {
-        lv_obj_set_style_bg_opa(top_bar_, LV_OPA_50, 0);
-        lv_obj_set_style_bg_color(top_bar_, lvgl_theme->background_color(), 0);
+    lv_style_set_text_color(&system_text_style_, theme->system_text_color());
+#endif
+}
+
+#if CONFIG_USE_WECHAT_MESSAGE_STYLE
+lv_style_t* LcdDisplay::BubbleStyle(const char* role) {
+    if (strcmp(role, "user") == 0) {
+        return &user_bubble_style_;
+    } else if (strcmp(role, "assistant") == 0) {
+        return &assistant_bubble_style_;
     }
-    
-    // Update status bar elements
-    lv_obj_set_style_text_color(network_label_, lvgl_theme->text_color(), 0);
-    lv_obj_set_style_text_color(status_label_, lvgl_theme->text_color(), 0);
-    lv_obj_set_style_text_color(notification_label_, lvgl_theme->text_color(), 0);
-    lv_obj_set_style_text_color(mute_label_, lvgl_theme->text_color(), 0);
-    lv_obj_set_style_text_color(battery_label_, lvgl_theme->text_color(), 0);
-    lv_obj_set_style_text_color(emoji_label_, lvgl_theme->text_color(), 0);
-
-    // If we have the chat message style, update all message bubbles
+    return &system_bubble_style_;
+}
+
+lv_style_t* LcdDisplay::BubbleTextStyle(const char* role) {
+    return strcmp(role, "system") == 0 ? &system_text_style_ : &text_style_;
+}
+#endif
+
+void LcdDisplay::SetTheme(Theme* theme) {
+    DisplayLockGuard lock(this);
+    auto lvgl_theme = static_cast<LvglTheme*>(theme);
+
+    // The widgets reference the styles, so only they change, then the widgets are refreshed once
+    UpdateThemeStyles(lvgl_theme);
 #if CONFIG_USE_WECHAT_MESSAGE_STYLE
     // Set content background opacity
     lv_obj_set_style_bg_opa(content_, LV_OPA_TRANSP, 0);
-
-    // Iterate through all children of content (message containers or bubbles)
-    uint32_t child_count = lv_obj_get_child_cnt(content_);
-    for (uint32_t i = 0; i < child_count; i++) {
-        lv_obj_t* obj = lv_obj_get_child(content_, i);
-        if (obj == nullptr) continue;
-        
-        lv_obj_t* bubble = nullptr;
-        
-        // Check if this object is a container or bubble
-        // If it's a container (user or system message), get its child as bubble
-        // If it's a bubble (assistant message), use it directly
-        if (lv_obj_get_child_cnt(obj) > 0) {
-            // Might be a container, check if it's a user or system message container
-            // User and system message containers are transparent
-            lv_opa_t bg_opa = lv_obj_get_style_bg_opa(obj, LV_PART_MAIN);
-            if (bg_opa == LV_OPA_TRANSP) {
-                // This is a user or system message container
-                bubble = lv_obj_get_child(obj, 0);
-            } else {
-                // This might be an assistant message bubble itself
-                bubble = obj;
-            }
-        } else {
-            // No child elements, might be other UI elements, skip
-            continue;
-        }
-        
-        if (bubble == nullptr) continue;
-        
-        // Use saved user data to identify bubble type
-        void* bubble_type_ptr = lv_obj_get_user_data(bubble);
-        if (bubble_type_ptr != nullptr) {
-            const char* bubble_type = static_cast<const char*>(bubble_type_ptr);
-            
-            // Apply correct color based on bubble type
-            if (strcmp(bubble_type, "user") == 0) {
-                lv_obj_set_style_bg_color(bubble, lvgl_theme->user_bubble_color(), 0);
-            } else if (strcmp(bubble_type, "assistant") == 0) {
-                lv_obj_set_style_bg_color(bubble, lvgl_theme->assistant_bubble_color(), 0); 
-            } else if (strcmp(bubble_type, "system") == 0) {
-                lv_obj_set_style_bg_color(bubble, lvgl_theme->system_bubble_color(), 0);
-            } else if (strcmp(bubble_type, "image") == 0) {
-                lv_obj_set_style_bg_color(bubble, lvgl_theme->system_bubble_color(), 0);
-            }
-            
-            // Update border color
-            lv_obj_set_style_border_color(bubble, lvgl_theme->border_color(), 0);
-            
-            // Update text color for the message
-            if (lv_obj_get_child_cnt(bubble) > 0) {
-                lv_obj_t* text = lv_obj_get_child(bubble, 0);
-                if (text != nullptr) {
-                    // Set text color based on bubble type
-                    if (strcmp(bubble_type, "system") == 0) {
-                        lv_obj_set_style_text_color(text, lvgl_theme->system_text_color(), 0);
-                    } else {
-                        lv_obj_set_style_text_color(text, lvgl_theme->text_color(), 0);
-                    }
-                }
-            }
-        } else {
-            ESP_LOGW(TAG, "child[%lu] Bubble type is not found", i);
-        }
-    }
-#else
-    // Simple UI mode - just update the main chat message
-    if (chat_message_label_ != nullptr) {
-        lv_obj_set_style_text_color(chat_message_label_, lvgl_theme->text_color(), 0);
-    }
-    
-    if (emoji_label_ != nullptr) {
-        lv_obj_set_style_text_color(emoji_label_, lvgl_theme->text_color(), 0);
-    }
-    
-    // Update bottom bar background color with 50% opacity
-    if (bottom_bar_ != nullptr) {
-        lv_obj_set_style_bg_opa(bottom_bar_, LV_OPA_50, 0);
-        lv_obj_set_style_bg_color(bottom_bar_, lvgl_theme->background_color(), 0);
-    }
 #endif
-    
-    // Update low battery popup
-    lv_obj_set_style_bg_color(low_battery_popup_, lvgl_theme->low_battery_color(), 0);
+    lv_obj_report_style_change(nullptr);
 
     // No errors occurred. Save theme to settings
     Display::SetTheme(lvgl_theme);
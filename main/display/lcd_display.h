@@ -2,16 +2,30 @@
 #define LCD_DISPLAY_H
 
 #include "lvgl_display.h"
+#include "lvgl_theme.h"
 #include "gif/lvgl_gif.h"
+#include "chat_history.h"
+#include "flush_planner.h"
 
 #include <esp_lcd_panel_io.h>
 #include <esp_lcd_panel_ops.h>
 #include <font_emoji.h>
 
 #include <atomic>
+#include <deque>
 #include <memory>
 
 #define PREVIEW_IMAGE_DURATION_MS 5000
+#define SPI_LCD_BOUNCE_BUFFER_LINES 10
+
+// The chat messages kept as text, and the number of them that are LVGL objects at a time
+#if CONFIG_IDF_TARGET_ESP32P4
+#define CHAT_HISTORY_SIZE (16 * 1024)
+#define CHAT_LIVE_BUBBLES 12
+#else
+#define CHAT_HISTORY_SIZE (6 * 1024)
+#define CHAT_LIVE_BUBBLES 8
+#endif
 
 
 class LcdDisplay : public LvglDisplay {
@@ -36,7 +50,42 @@ protected:
     std::unique_ptr<LvglImage> preview_image_cached_ = nullptr;
     bool hide_subtitle_ = false;  // Control whether to hide chat messages/subtitles
 
+    // The widgets share these styles, a theme change only updates them
+    bool styles_initialized_ = false;
+    lv_style_t screen_style_;       // Text font and color, background color
+    lv_style_t container_style_;    // Background color or image, border color
+    lv_style_t bar_style_;          // Half transparent background of the top and bottom bars
+    lv_style_t text_style_;
+    lv_style_t icon_style_;         // Status bar icons
+    lv_style_t low_battery_style_;
+
+#if CONFIG_USE_WECHAT_MESSAGE_STYLE
+    // A message of the chat, the bubbles are reused for other messages as the chat scrolls
+    struct ChatBubble {
+        lv_obj_t* container = nullptr;
+        lv_obj_t* bubble = nullptr;
+        lv_obj_t* label = nullptr;
+        uint32_t number = 0;    // Of the message in chat_history_
+    };
+    ChatHistory chat_history_{CHAT_HISTORY_SIZE};
+    std::deque<ChatBubble> chat_bubbles_;     // Top to bottom
+    bool chat_recycling_ = false;
+    lv_style_t user_bubble_style_;
+    lv_style_t assistant_bubble_style_;
+    lv_style_t system_bubble_style_;
+    lv_style_t system_text_style_;
+
+    lv_style_t* BubbleStyle(const char* role);
+    lv_style_t* BubbleTextStyle(const char* role);
+    ChatBubble CreateChatBubble();
+    void FillChatBubble(ChatBubble& bubble, uint32_t number);
+    void DeleteChatImagesAbove(lv_obj_t* container);
+    void ShowLatestChatMessages();
+    void OnChatScroll();
+#endif
+
     void InitializeLcdThemes();
+    void UpdateThemeStyles(LvglTheme* theme);
     void SetupUI();
     virtual bool Lock(int timeout_ms = 0) override;
     virtual void Unlock() override;
@@ -49,8 +98,12 @@ public:
     ~LcdDisplay();
     virtual void SetEmotion(const char* emotion) override;
     virtual void SetChatMessage(const char* role, const char* content) override;
+#if CONFIG_USE_WECHAT_MESSAGE_STYLE
+    virtual void AppendChatMessage(const char* role, const char* content) override;
+#endif
     virtual void ClearChatMessages() override;
     virtual void SetPreviewImage(std::unique_ptr<LvglImage> image) override;
+    virtual void InvalidatePreviewImage(int y, int lines) override;
 
     // Add theme switching function
     virtual void SetTheme(Theme* theme) override;
@@ -65,6 +118,11 @@ public:
     SpiLcdDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel,
                   int width, int height, int offset_x, int offset_y,
                   bool mirror_x, bool mirror_y, bool swap_xy);
+
+    virtual cJSON* GetFlushStatsJson() override { return flush_planner_.GetStatsJson(); }
+
+private:
+    FlushPlanner flush_planner_;
 };
 
 // RGB LCD display
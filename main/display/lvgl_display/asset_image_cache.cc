@@ -0,0 +1,433 @@
+#include "asset_image_cache.h"
+#include "heap_monitor.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_timer.h>
+#include <src/draw/lv_image_decoder_private.h>
+#if CONFIG_LV_USE_LODEPNG
+#include <src/libs/lodepng/lodepng.h>
+#endif
+#ifndef CONFIG_IDF_TARGET_ESP32
+#include "jpg/jpeg_to_image.h"
+#endif
+#include <cstring>
+#include <iterator>
+
+#define TAG "AssetImageCache"
+
+#define ASSET_IMAGE_CACHE_SIZE (CONFIG_ASSET_IMAGE_CACHE_SIZE_KB * 1024)
+#define ASSET_IMAGE_MAX_SIZE 4096   // Of a side
+
+#define QOI_HEADER_SIZE 14
+#define QOI_END_SIZE 8
+
+#define PNG_HEADER_SIZE 33          // The signature and the IHDR chunk
+#define PNG_COLOR_GRAY 0
+#define PNG_COLOR_RGB 2
+
+#define JPEG_SOI 0xd8
+#define JPEG_SOS 0xda
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_MASK 0xc0
+
+static uint32_t ReadBigEndian32(const uint8_t* data) {
+    return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+AssetImageCache::Image::~Image() {
+    if (monitored) {
+        HeapMonitor::GetInstance().Free(kHeapTagDisplay, pixels);
+    } else {
+        heap_caps_free(pixels);
+    }
+}
+
+static uint8_t* AllocatePixels(size_t size) {
+#if CONFIG_SPIRAM
+    return (uint8_t*)HeapMonitor::GetInstance().Malloc(kHeapTagDisplay, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#else
+    return (uint8_t*)HeapMonitor::GetInstance().Malloc(kHeapTagDisplay, size, MALLOC_CAP_8BIT);
+#endif
+}
+
+static void SetHeader(lv_image_header_t* header, uint32_t width, uint32_t height, lv_color_format_t cf) {
+    header->cf = cf;
+    header->w = width;
+    header->h = height;
+    header->stride = lv_draw_buf_width_to_stride(width, cf);
+}
+
+/* The size of the first frame, the markers before it are skipped by their length */
+static bool ProbeJpeg(const uint8_t* data, size_t size, uint32_t* width, uint32_t* height) {
+    if (size < 4 || data[0] != 0xff || data[1] != JPEG_SOI) {
+        return false;
+    }
+    size_t position = 2;
+    while (position + 4 <= size) {
+        if (data[position] != 0xff) {
+            return false;
+        }
+        uint8_t marker = data[position + 1];
+        if (marker == 0xff) {
+            position++;
+            continue;
+        }
+        size_t length = (data[position + 2] << 8) | data[position + 3];
+        // SOF0 to SOF15, but DHT, JPG and DAC
+        if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+            if (position + 9 > size) {
+                return false;
+            }
+            *height = (data[position + 5] << 8) | data[position + 6];
+            *width = (data[position + 7] << 8) | data[position + 8];
+            return true;
+        }
+        if (marker == JPEG_SOS) {
+            return false;
+        }
+        position += 2 + length;
+    }
+    return false;
+}
+
+AssetImageCache::Format AssetImageCache::Probe(const uint8_t* data, size_t size, lv_image_header_t* header) {
+    if (data == nullptr) {
+        return kFormatNone;
+    }
+    Format format = kFormatNone;
+    uint32_t width = 0, height = 0;
+    // Opaque images are decoded to the format of the panel, the others keep their alpha
+    lv_color_format_t cf = LV_COLOR_FORMAT_RGB565;
+    if (size >= QOI_HEADER_SIZE + QOI_END_SIZE && memcmp(data, "qoif", 4) == 0) {
+        uint8_t channels = data[12];
+        if (channels == 3 || channels == 4) {
+            format = kFormatQoi;
+            width = ReadBigEndian32(data + 4);
+            height = ReadBigEndian32(data + 8);
+            cf = channels == 4 ? LV_COLOR_FORMAT_ARGB8888 : LV_COLOR_FORMAT_RGB565;
+        }
+#if CONFIG_LV_USE_LODEPNG
+    } else if (size >= PNG_HEADER_SIZE && memcmp(data, "\x89PNG\r\n\x1a\n", 8) == 0 && memcmp(data + 12, "IHDR", 4) == 0) {
+        format = kFormatPng;
+        width = ReadBigEndian32(data + 16);
+        height = ReadBigEndian32(data + 20);
+        // A palette may be transparent
+        uint8_t color_type = data[25];
+        cf = color_type == PNG_COLOR_GRAY || color_type == PNG_COLOR_RGB ? LV_COLOR_FORMAT_RGB565 : LV_COLOR_FORMAT_ARGB8888;
+#endif
+#ifndef CONFIG_IDF_TARGET_ESP32
+    } else if (ProbeJpeg(data, size, &width, &height)) {
+        format = kFormatJpeg;
+#endif
+    }
+    if (format == kFormatNone || width == 0 || height == 0 || width > ASSET_IMAGE_MAX_SIZE || height > ASSET_IMAGE_MAX_SIZE) {
+        return kFormatNone;
+    }
+    if (header != nullptr) {
+        SetHeader(header, width, height, cf);
+    }
+    return format;
+}
+
+bool AssetImageCache::IsCompressed(const void* data, size_t size) {
+    return Probe(static_cast<const uint8_t*>(data), size, nullptr) != kFormatNone;
+}
+
+std::unique_ptr<LvglAllocatedImage> AssetImageCache::DecodeImage(const void* data, size_t size) {
+    lv_image_header_t header = {};
+    auto format = Probe(static_cast<const uint8_t*>(data), size, &header);
+    if (format == kFormatNone) {
+        return nullptr;
+    }
+    auto image = Decode(format, static_cast<const uint8_t*>(data), size, header);
+    if (image == nullptr) {
+        return nullptr;
+    }
+    // The pixels go to the returned image, which frees them
+    if (image->monitored) {
+        HeapMonitor::GetInstance().Disown(kHeapTagDisplay, image->pixels);
+    }
+    auto result = std::make_unique<LvglAllocatedImage>(image->pixels, image->size, image->draw_buf.header.w,
+        image->draw_buf.header.h, image->draw_buf.header.stride, image->draw_buf.header.cf);
+    image->pixels = nullptr;
+    return result;
+}
+
+void AssetImageCache::Register() {
+    if (decoder_ != nullptr) {
+        return;
+    }
+    decoder_ = lv_image_decoder_create();
+    if (decoder_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create the asset image decoder");
+        return;
+    }
+    lv_image_decoder_set_info_cb(decoder_, OnInfo);
+    lv_image_decoder_set_open_cb(decoder_, OnOpen);
+    lv_image_decoder_set_close_cb(decoder_, OnClose);
+}
+
+void AssetImageCache::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    index_.clear();
+    images_.clear();
+    used_ = 0;
+}
+
+lv_result_t AssetImageCache::OnInfo(lv_image_decoder_t* decoder, lv_image_decoder_dsc_t* dsc, lv_image_header_t* header) {
+    if (dsc->src_type != LV_IMAGE_SRC_VARIABLE) {
+        return LV_RESULT_INVALID;
+    }
+    auto src = static_cast<const lv_image_dsc_t*>(dsc->src);
+    return Probe(src->data, src->data_size, header) != kFormatNone ? LV_RESULT_OK : LV_RESULT_INVALID;
+}
+
+lv_result_t AssetImageCache::OnOpen(lv_image_decoder_t* decoder, lv_image_decoder_dsc_t* dsc) {
+    auto src = static_cast<const lv_image_dsc_t*>(dsc->src);
+    auto& cache = GetInstance();
+    auto image = cache.Find(src->data);
+    if (image == nullptr) {
+        int64_t start_time = esp_timer_get_time();
+        lv_image_header_t header = {};
+        auto format = Probe(src->data, src->data_size, &header);
+        image = Decode(format, src->data, src->data_size, header);
+        if (image == nullptr) {
+            return LV_RESULT_INVALID;
+        }
+        image->key = src->data;
+        {
+            std::lock_guard<std::mutex> lock(cache.mutex_);
+            cache.misses_++;
+            cache.decodes_[format]++;
+            cache.decode_us_[format] += esp_timer_get_time() - start_time;
+        }
+        cache.Store(image);
+    }
+    dsc->decoded = &image->draw_buf;
+    // Keeps the pixels while they are drawn, even if they are evicted meanwhile
+    dsc->user_data = new std::shared_ptr<Image>(image);
+    return LV_RESULT_OK;
+}
+
+void AssetImageCache::OnClose(lv_image_decoder_t* decoder, lv_image_decoder_dsc_t* dsc) {
+    delete static_cast<std::shared_ptr<Image>*>(dsc->user_data);
+    dsc->user_data = nullptr;
+}
+
+std::shared_ptr<AssetImageCache::Image> AssetImageCache::Find(const void* key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it == index_.end()) {
+        return nullptr;
+    }
+    hits_++;
+    images_.splice(images_.begin(), images_, it->second);
+    return images_.front();
+}
+
+void AssetImageCache::Store(std::shared_ptr<Image> image) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // A huge image would flush all the small ones
+    if (image->size > ASSET_IMAGE_CACHE_SIZE / 2 || index_.find(image->key) != index_.end()) {
+        return;
+    }
+    while (used_ + image->size > ASSET_IMAGE_CACHE_SIZE && !images_.empty()) {
+        auto last = std::prev(images_.end());
+        used_ -= (*last)->size;
+        index_.erase((*last)->key);
+        images_.erase(last);
+        evictions_++;
+    }
+    images_.push_front(image);
+    index_[image->key] = images_.begin();
+    used_ += image->size;
+}
+
+/* Into ARGB8888 with alpha or RGB565 without, false if the data ends early */
+static bool DecodeQoiPixels(const uint8_t* data, size_t size, uint32_t width, uint32_t height, bool alpha,
+        uint8_t* pixels, uint32_t stride) {
+    uint8_t index[64][4] = {};
+    uint8_t r = 0, g = 0, b = 0, a = 255;
+    uint32_t run = 0;
+    size_t position = QOI_HEADER_SIZE;
+    size_t end = size - QOI_END_SIZE;
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t* row = pixels + y * stride;
+        for (uint32_t x = 0; x < width; x++) {
+            if (run > 0) {
+                run--;
+            } else if (position < end) {
+                uint8_t tag = data[position++];
+                if (tag == QOI_OP_RGB) {
+                    if (position + 3 > end) {
+                        return false;
+                    }
+                    r = data[position];
+                    g = data[position + 1];
+                    b = data[position + 2];
+                    position += 3;
+                } else if (tag == QOI_OP_RGBA) {
+                    if (position + 4 > end) {
+                        return false;
+                    }
+                    r = data[position];
+                    g = data[position + 1];
+                    b = data[position + 2];
+                    a = data[position + 3];
+                    position += 4;
+                } else if ((tag & QOI_MASK) == QOI_OP_INDEX) {
+                    r = index[tag][0];
+                    g = index[tag][1];
+                    b = index[tag][2];
+                    a = index[tag][3];
+                } else if ((tag & QOI_MASK) == QOI_OP_DIFF) {
+                    r += ((tag >> 4) & 0x03) - 2;
+                    g += ((tag >> 2) & 0x03) - 2;
+                    b += (tag & 0x03) - 2;
+                } else if ((tag & QOI_MASK) == QOI_OP_LUMA) {
+                    if (position + 1 > end) {
+                        return false;
+                    }
+                    uint8_t next = data[position++];
+                    int dg = (tag & 0x3f) - 32;
+                    r += dg - 8 + ((next >> 4) & 0x0f);
+                    g += dg;
+                    b += dg - 8 + (next & 0x0f);
+                } else {
+                    run = tag & 0x3f;
+                }
+                uint8_t* entry = index[(r * 3 + g * 5 + b * 7 + a * 11) % 64];
+                entry[0] = r;
+                entry[1] = g;
+                entry[2] = b;
+                entry[3] = a;
+            }
+
+            if (alpha) {
+                uint8_t* pixel = row + x * 4;
+                pixel[0] = b;
+                pixel[1] = g;
+                pixel[2] = r;
+                pixel[3] = a;
+            } else {
+                reinterpret_cast<uint16_t*>(row)[x] = ((r & 0xf8) << 8) | ((g & 0xfc) << 3) | (b >> 3);
+            }
+        }
+    }
+
+    return true;
+}
+
+#if CONFIG_LV_USE_LODEPNG
+/* The RGBA of lodepng into ARGB8888, which LVGL keeps as BGRA, or RGB565 */
+static bool DecodePngPixels(const uint8_t* data, size_t size, uint32_t width, uint32_t height, bool alpha,
+        uint8_t* pixels, uint32_t stride) {
+    unsigned char* rgba = nullptr;
+    unsigned decoded_width = 0, decoded_height = 0;
+    unsigned error = lodepng_decode32(&rgba, &decoded_width, &decoded_height, data, size);
+    if (error != 0 || decoded_width != width || decoded_height != height) {
+        ESP_LOGE(TAG, "Failed to decode the PNG: %s", error != 0 ? lodepng_error_text(error) : "size mismatch");
+        lv_free(rgba);
+        return false;
+    }
+    for (uint32_t y = 0; y < height; y++) {
+        const uint8_t* source = rgba + y * width * 4;
+        uint8_t* row = pixels + y * stride;
+        for (uint32_t x = 0; x < width; x++, source += 4) {
+            if (alpha) {
+                uint8_t* pixel = row + x * 4;
+                pixel[0] = source[2];
+                pixel[1] = source[1];
+                pixel[2] = source[0];
+                pixel[3] = source[3];
+            } else {
+                reinterpret_cast<uint16_t*>(row)[x] = ((source[0] & 0xf8) << 8) | ((source[1] & 0xfc) << 3) | (source[2] >> 3);
+            }
+        }
+    }
+    lv_free(rgba);
+    return true;
+}
+#endif
+
+std::shared_ptr<AssetImageCache::Image> AssetImageCache::Decode(Format format, const uint8_t* data, size_t size,
+        const lv_image_header_t& header) {
+    uint32_t width = header.w;
+    uint32_t height = header.h;
+    auto cf = (lv_color_format_t)header.cf;
+    auto image = std::make_shared<Image>();
+
+#ifndef CONFIG_IDF_TARGET_ESP32
+    if (format == kFormatJpeg) {
+        // The hardware decoder may round the size up to the MCU, the extra rows and columns are not drawn
+        uint8_t* pixels = nullptr;
+        size_t pixels_size, decoded_width, decoded_height, stride;
+        esp_err_t err = jpeg_to_image(data, size, &pixels, &pixels_size, &decoded_width, &decoded_height, &stride);
+        if (err != ESP_OK || decoded_width < width || decoded_height < height) {
+            ESP_LOGE(TAG, "Failed to decode the %lux%lu JPEG: %s", width, height, esp_err_to_name(err));
+            heap_caps_free(pixels);
+            return nullptr;
+        }
+        image->monitored = false;
+        image->pixels = pixels;
+        image->size = pixels_size;
+        lv_draw_buf_init(&image->draw_buf, width, height, cf, stride, image->pixels, image->size);
+        return image;
+    }
+#endif
+
+    uint32_t stride = header.stride;
+    image->size = stride * height;
+    image->pixels = AllocatePixels(image->size);
+    if (image->pixels == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %lu bytes for a %lux%lu image", image->size, width, height);
+        return nullptr;
+    }
+
+    bool alpha = cf == LV_COLOR_FORMAT_ARGB8888;
+    bool decoded = false;
+    if (format == kFormatQoi) {
+        decoded = DecodeQoiPixels(data, size, width, height, alpha, image->pixels, stride);
+        if (!decoded) {
+            ESP_LOGE(TAG, "The %lux%lu image is truncated", width, height);
+        }
+    }
+#if CONFIG_LV_USE_LODEPNG
+    if (format == kFormatPng) {
+        decoded = DecodePngPixels(data, size, width, height, alpha, image->pixels, stride);
+    }
+#endif
+    if (!decoded) {
+        return nullptr;
+    }
+    lv_draw_buf_init(&image->draw_buf, width, height, cf, stride, image->pixels, image->size);
+    return image;
+}
+
+cJSON* AssetImageCache::GetStatsJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "images", images_.size());
+    cJSON_AddNumberToObject(root, "bytes", used_);
+    cJSON_AddNumberToObject(root, "hits", hits_);
+    cJSON_AddNumberToObject(root, "misses", misses_);
+    cJSON_AddNumberToObject(root, "evictions", evictions_);
+    cJSON_AddNumberToObject(root, "hit_rate", hits_ + misses_ > 0 ? (double)hits_ / (hits_ + misses_) : 0);
+    static const char* const kFormatNames[kFormatCount] = {"none", "qoi", "jpeg", "png"};
+    auto formats = cJSON_CreateObject();
+    for (int i = kFormatQoi; i < kFormatCount; i++) {
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "decodes", decodes_[i]);
+        cJSON_AddNumberToObject(item, "mean_decode_us", decodes_[i] > 0 ? decode_us_[i] / decodes_[i] : 0);
+        cJSON_AddItemToObject(formats, kFormatNames[i], item);
+    }
+    cJSON_AddItemToObject(root, "formats", formats);
+    return root;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <lvgl.h>
+#include <cJSON.h>
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+
+#include "lvgl_image.h"
+
+/**
+ * An LVGL image decoder for the QOI, JPEG and PNG images of the assets, with the decoded pixels
+ * in a least recently used pool of CONFIG_ASSET_IMAGE_CACHE_SIZE_KB.
+ *
+ * A compressed image is a fraction of the size of the raw CBin pixels in flash. Without the pool
+ * a JPEG or PNG background was decoded again by LVGL on every redraw and every theme change. The
+ * image is decoded when LVGL first draws it, and drawn from the pool after. JPEG goes through
+ * jpeg_to_image(), on the hardware decoder where there is one, and PNG through the lodepng of
+ * LVGL. An image larger than the pool is decoded for every draw. The images are keyed by their
+ * data, one per asset file that lives as long as the assets, so the pool is cleared when the
+ * assets are applied again.
+ *
+ * Register() is called with the LVGL lock held, the images may be drawn by the draw units of
+ * LVGL and GetStatsJson() may be called by any task.
+ */
+class AssetImageCache {
+public:
+    static AssetImageCache& GetInstance() {
+        static AssetImageCache instance;
+        return instance;
+    }
+
+    // QOI, or JPEG and PNG where they can be decoded
+    static bool IsCompressed(const void* data, size_t size);
+    // Decodes an image that is not an asset once, e.g. a preview, nullptr if it is not compressed
+    static std::unique_ptr<LvglAllocatedImage> DecodeImage(const void* data, size_t size);
+
+    void Register();
+    // The pixels in use by a draw are freed when it is done
+    void Clear();
+    // The caller owns the returned object
+    cJSON* GetStatsJson();
+
+private:
+    enum Format {
+        kFormatNone,
+        kFormatQoi,
+        kFormatJpeg,
+        kFormatPng,
+        kFormatCount,
+    };
+
+    struct Image {
+        const void* key = nullptr;
+        lv_draw_buf_t draw_buf = {};
+        uint8_t* pixels = nullptr;
+        uint32_t size = 0;
+        bool monitored = true;      // Allocated by the HeapMonitor, or by jpeg_to_image()
+        ~Image();
+    };
+
+    AssetImageCache() = default;
+
+    lv_image_decoder_t* decoder_ = nullptr;
+    std::mutex mutex_;
+    std::list<std::shared_ptr<Image>> images_;     // The most recently drawn first
+    std::unordered_map<const void*, std::list<std::shared_ptr<Image>>::iterator> index_;
+    size_t used_ = 0;
+    uint32_t hits_ = 0;
+    uint32_t misses_ = 0;
+    uint32_t evictions_ = 0;
+    uint32_t decode_us_[kFormatCount] = {};     // Of all the misses
+    uint32_t decodes_[kFormatCount] = {};
+
+    static Format Probe(const uint8_t* data, size_t size, lv_image_header_t* header);
+    static lv_result_t OnInfo(lv_image_decoder_t* decoder, lv_image_decoder_dsc_t* dsc, lv_image_header_t* header);
+    static lv_result_t OnOpen(lv_image_decoder_t* decoder, lv_image_decoder_dsc_t* dsc);
+    static void OnClose(lv_image_decoder_t* decoder, lv_image_decoder_dsc_t* dsc);
+    std::shared_ptr<Image> Find(const void* key);
+    void Store(std::shared_ptr<Image> image);
+    static std::shared_ptr<Image> Decode(Format format, const uint8_t* data, size_t size, const lv_image_header_t& header);
+};
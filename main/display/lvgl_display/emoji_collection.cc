@@ -1,19 +1,94 @@
 #include "emoji_collection.h"
 
 #include <esp_log.h>
-#include <unordered_map>
-#include <string>
+#include <cstring>
+#include <string_view>
 
 #define TAG "EmojiCollection"
 
+namespace {
+
+constexpr std::string_view kEmotionNames[EMOTION_COUNT] = {
+    "neutral", "happy", "laughing", "funny", "sad", "angry", "crying", "loving", "embarrassed", "surprised", "shocked",
+    "thinking", "winking", "cool", "relaxed", "delicious", "kissy", "confident", "sleepy", "silly", "confused",
+};
+
+// FNV-1a from a seed under which the fixed names fall into distinct slots
+constexpr uint32_t kEmotionHashSeed = 11694;
+constexpr int kEmotionSlotBits = 5;
+
+constexpr int EmotionSlot(std::string_view name) {
+    uint32_t hash = kEmotionHashSeed;
+    for (char c : name) {
+        hash = (hash ^ (uint8_t)c) * 16777619u;
+    }
+    return hash >> (32 - kEmotionSlotBits);
+}
+
+struct EmotionSlots {
+    int8_t index[1 << kEmotionSlotBits];
+    bool perfect;
+};
+
+constexpr EmotionSlots MakeEmotionSlots() {
+    EmotionSlots slots{};
+    slots.perfect = true;
+    for (auto& index : slots.index) {
+        index = -1;
+    }
+    for (int i = 0; i < EMOTION_COUNT; i++) {
+        auto& index = slots.index[EmotionSlot(kEmotionNames[i])];
+        slots.perfect = slots.perfect && index < 0;
+        index = i;
+    }
+    return slots;
+}
+
+constexpr EmotionSlots kEmotionSlots = MakeEmotionSlots();
+static_assert(kEmotionSlots.perfect, "Two emotion names share a slot, pick another kEmotionHashSeed");
+
+// The index of a fixed emotion, -1 for any other name
+int EmotionIndex(const char* name) {
+    std::string_view view(name);
+    int index = kEmotionSlots.index[EmotionSlot(view)];
+    return index >= 0 && kEmotionNames[index] == view ? index : -1;
+}
+
+} // namespace
+
 void EmojiCollection::AddEmoji(const std::string& name, LvglImage* image) {
-    emoji_collection_[name] = image;
+    int index = EmotionIndex(name.c_str());
+    LvglImage*& slot = index >= 0 ? emotions_[index].image : emoji_collection_[name];
+    delete slot;
+    slot = image;
+}
+
+void EmojiCollection::AddEmoji(const char* name, const lv_image_dsc_t* image_dsc) {
+    int index = EmotionIndex(name);
+    if (index < 0) {
+        AddEmoji(std::string(name), new LvglSourceImage(image_dsc));
+        return;
+    }
+    delete emotions_[index].image;
+    emotions_[index].image = nullptr;
+    emotions_[index].image_dsc = image_dsc;
 }
 
 const LvglImage* EmojiCollection::GetEmojiImage(const char* name) {
-    auto it = emoji_collection_.find(name);
-    if (it != emoji_collection_.end()) {
-        return it->second;
+    int index = EmotionIndex(name);
+    if (index >= 0) {
+        auto& emotion = emotions_[index];
+        if (emotion.image == nullptr && emotion.image_dsc != nullptr) {
+            emotion.image = new LvglSourceImage(emotion.image_dsc);
+        }
+        if (emotion.image != nullptr) {
+            return emotion.image;
+        }
+    } else {
+        auto it = emoji_collection_.find(name);
+        if (it != emoji_collection_.end()) {
+            return it->second;
+        }
     }
 
     ESP_LOGW(TAG, "Emoji not found: %s", name);
@@ -21,6 +96,9 @@ const LvglImage* EmojiCollection::GetEmojiImage(const char* name) {
 }
 
 EmojiCollection::~EmojiCollection() {
+    for (auto& emotion : emotions_) {
+        delete emotion.image;
+    }
     for (auto it = emoji_collection_.begin(); it != emoji_collection_.end(); ++it) {
         delete it->second;
     }
@@ -51,27 +129,27 @@ extern const lv_image_dsc_t emoji_1f61c_32; // silly
 extern const lv_image_dsc_t emoji_1f644_32; // confused
 
 Twemoji32::Twemoji32() {
-    AddEmoji("neutral", new LvglSourceImage(&emoji_1f636_32));
-    AddEmoji("happy", new LvglSourceImage(&emoji_1f642_32));
-    AddEmoji("laughing", new LvglSourceImage(&emoji_1f606_32));
-    AddEmoji("funny", new LvglSourceImage(&emoji_1f602_32));
-    AddEmoji("sad", new LvglSourceImage(&emoji_1f614_32));
-    AddEmoji("angry", new LvglSourceImage(&emoji_1f620_32));
-    AddEmoji("crying", new LvglSourceImage(&emoji_1f62d_32));
-    AddEmoji("loving", new LvglSourceImage(&emoji_1f60d_32));
-    AddEmoji("embarrassed", new LvglSourceImage(&emoji_1f633_32));
-    AddEmoji("surprised", new LvglSourceImage(&emoji_1f62f_32));
-    AddEmoji("shocked", new LvglSourceImage(&emoji_1f631_32));
-    AddEmoji("thinking", new LvglSourceImage(&emoji_1f914_32));
-    AddEmoji("winking", new LvglSourceImage(&emoji_1f609_32));
-    AddEmoji("cool", new LvglSourceImage(&emoji_1f60e_32));
-    AddEmoji("relaxed", new LvglSourceImage(&emoji_1f60c_32));
-    AddEmoji("delicious", new LvglSourceImage(&emoji_1f924_32));
-    AddEmoji("kissy", new LvglSourceImage(&emoji_1f618_32));
-    AddEmoji("confident", new LvglSourceImage(&emoji_1f60f_32));
-    AddEmoji("sleepy", new LvglSourceImage(&emoji_1f634_32));
-    AddEmoji("silly", new LvglSourceImage(&emoji_1f61c_32));
-    AddEmoji("confused", new LvglSourceImage(&emoji_1f644_32));
+    AddEmoji("neutral", &emoji_1f636_32);
+    AddEmoji("happy", &emoji_1f642_32);
+    AddEmoji("laughing", &emoji_1f606_32);
+    AddEmoji("funny", &emoji_1f602_32);
+    AddEmoji("sad", &emoji_1f614_32);
+    AddEmoji("angry", &emoji_1f620_32);
+    AddEmoji("crying", &emoji_1f62d_32);
+    AddEmoji("loving", &emoji_1f60d_32);
+    AddEmoji("embarrassed", &emoji_1f633_32);
+    AddEmoji("surprised", &emoji_1f62f_32);
+    AddEmoji("shocked", &emoji_1f631_32);
+    AddEmoji("thinking", &emoji_1f914_32);
+    AddEmoji("winking", &emoji_1f609_32);
+    AddEmoji("cool", &emoji_1f60e_32);
+    AddEmoji("relaxed", &emoji_1f60c_32);
+    AddEmoji("delicious", &emoji_1f924_32);
+    AddEmoji("kissy", &emoji_1f618_32);
+    AddEmoji("confident", &emoji_1f60f_32);
+    AddEmoji("sleepy", &emoji_1f634_32);
+    AddEmoji("silly", &emoji_1f61c_32);
+    AddEmoji("confused", &emoji_1f644_32);
 }
 
 
@@ -99,25 +177,25 @@ extern const lv_image_dsc_t emoji_1f61c_64; // silly
 extern const lv_image_dsc_t emoji_1f644_64; // confused
 
 Twemoji64::Twemoji64() {
-    AddEmoji("neutral", new LvglSourceImage(&emoji_1f636_64));
-    AddEmoji("happy", new LvglSourceImage(&emoji_1f642_64));
-    AddEmoji("laughing", new LvglSourceImage(&emoji_1f606_64));
-    AddEmoji("funny", new LvglSourceImage(&emoji_1f602_64));
-    AddEmoji("sad", new LvglSourceImage(&emoji_1f614_64));
-    AddEmoji("angry", new LvglSourceImage(&emoji_1f620_64));
-    AddEmoji("crying", new LvglSourceImage(&emoji_1f62d_64));
-    AddEmoji("loving", new LvglSourceImage(&emoji_1f60d_64));
-    AddEmoji("embarrassed", new LvglSourceImage(&emoji_1f633_64));
-    AddEmoji("surprised", new LvglSourceImage(&emoji_1f62f_64));
-    AddEmoji("shocked", new LvglSourceImage(&emoji_1f631_64));
-    AddEmoji("thinking", new LvglSourceImage(&emoji_1f914_64));
-    AddEmoji("winking", new LvglSourceImage(&emoji_1f609_64));
-    AddEmoji("cool", new LvglSourceImage(&emoji_1f60e_64));
-    AddEmoji("relaxed", new LvglSourceImage(&emoji_1f60c_64));
-    AddEmoji("delicious", new LvglSourceImage(&emoji_1f924_64));
-    AddEmoji("kissy", new LvglSourceImage(&emoji_1f618_64));
-    AddEmoji("confident", new LvglSourceImage(&emoji_1f60f_64));
-    AddEmoji("sleepy", new LvglSourceImage(&emoji_1f634_64));
-    AddEmoji("silly", new LvglSourceImage(&emoji_1f61c_64));
-    AddEmoji("confused", new LvglSourceImage(&emoji_1f644_64));
+    AddEmoji("neutral", &emoji_1f636_64);
+    AddEmoji("happy", &emoji_1f642_64);
+    AddEmoji("laughing", &emoji_1f606_64);
+    AddEmoji("funny", &emoji_1f602_64);
+    AddEmoji("sad", &emoji_1f614_64);
+    AddEmoji("angry", &emoji_1f620_64);
+    AddEmoji("crying", &emoji_1f62d_64);
+    AddEmoji("loving", &emoji_1f60d_64);
+    AddEmoji("embarrassed", &emoji_1f633_64);
+    AddEmoji("surprised", &emoji_1f62f_64);
+    AddEmoji("shocked", &emoji_1f631_64);
+    AddEmoji("thinking", &emoji_1f914_64);
+    AddEmoji("winking", &emoji_1f609_64);
+    AddEmoji("cool", &emoji_1f60e_64);
+    AddEmoji("relaxed", &emoji_1f60c_64);
+    AddEmoji("delicious", &emoji_1f924_64);
+    AddEmoji("kissy", &emoji_1f618_64);
+    AddEmoji("confident", &emoji_1f60f_64);
+    AddEmoji("sleepy", &emoji_1f634_64);
+    AddEmoji("silly", &emoji_1f61c_64);
+    AddEmoji("confused", &emoji_1f644_64);
 }
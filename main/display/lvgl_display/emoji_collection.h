@@ -6,9 +6,13 @@
 #include <lvgl.h>
 
 #include <map>
+#include <array>
 #include <string>
 #include <memory>
+#include <functional>
 
+// The emotions the server sends, looked up without building a string
+#define EMOTION_COUNT 21
 
 // Define interface for emoji collection
 class EmojiCollection {
@@ -17,8 +21,18 @@ public:
     virtual const LvglImage* GetEmojiImage(const char* name);
     virtual ~EmojiCollection();
 
+protected:
+    // The image of a fixed emotion is created on first use
+    void AddEmoji(const char* name, const lv_image_dsc_t* image_dsc);
+
 private:
-    std::map<std::string, LvglImage*> emoji_collection_;
+    struct Emotion {
+        LvglImage* image = nullptr;
+        const lv_image_dsc_t* image_dsc = nullptr;
+    };
+    std::array<Emotion, EMOTION_COUNT> emotions_;
+    // Names other than the fixed emotions, from the assets
+    std::map<std::string, LvglImage*, std::less<>> emoji_collection_;
 };
 
 class Twemoji32 : public EmojiCollection {
@@ -0,0 +1,91 @@
+#include "gif_frame_cache.h"
+#include "gifdec.h"
+#include "heap_monitor.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <cstring>
+
+#define TAG "GifFrameCache"
+
+GifFrames::~GifFrames() {
+    for (auto& frame : frames) {
+        HeapMonitor::GetInstance().Free(kHeapTagDisplay, frame.pixels);
+    }
+}
+
+bool GifFrames::Append(const uint8_t* canvas, uint32_t delay_ms) {
+    auto pixels = (uint8_t*)HeapMonitor::GetInstance().Malloc(kHeapTagDisplay, frame_size, MALLOC_CAP_SPIRAM);
+    if (pixels == nullptr) {
+        return false;
+    }
+    memcpy(pixels, canvas, frame_size);
+    frames.push_back({pixels, delay_ms});
+    return true;
+}
+
+std::shared_ptr<const GifFrames> GifFrameCache::Find(const void* data) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = gifs_.find(data);
+    return it != gifs_.end() ? it->second : nullptr;
+}
+
+bool GifFrameCache::Fits(size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return used_ + bytes <= CONFIG_GIF_FRAME_CACHE_SIZE_KB * 1024;
+}
+
+std::shared_ptr<const GifFrames> GifFrameCache::Store(const void* data, std::shared_ptr<GifFrames> frames) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = gifs_.find(data);
+    if (it != gifs_.end()) {
+        return it->second;
+    }
+    if (frames->frames.empty() || used_ + frames->bytes() > CONFIG_GIF_FRAME_CACHE_SIZE_KB * 1024) {
+        return nullptr;
+    }
+    used_ += frames->bytes();
+    ESP_LOGI(TAG, "Cached %u frames of %u bytes, %u bytes in use", frames->frames.size(), frames->frame_size, used_);
+    return gifs_[data] = std::move(frames);
+}
+
+bool GifFrameCache::Prerender(const void* data) {
+    if (Find(data) != nullptr) {
+        return true;
+    }
+    gd_GIF* gif = gd_open_gif_data(data);
+    if (gif == nullptr) {
+        return false;
+    }
+
+    auto frames = std::make_shared<GifFrames>();
+    frames->frame_size = gif->width * gif->height * 4;
+    bool complete = false;
+    while (Fits(frames->bytes() + frames->frame_size)) {
+        uint32_t position = gif->f_rw_p;
+        int result = gd_get_frame(gif);
+        if (result < 0) {
+            break;
+        }
+        // The trailer of a GIF that plays once, or the seek back to the first frame of a looping one
+        if (result == 0 || (gif->f_rw_p < position && !frames->frames.empty())) {
+            complete = true;
+            break;
+        }
+        if (frames->frames.empty()) {
+            frames->loop_count = gif->loop_count;
+        }
+        gd_render_frame(gif, gif->canvas);
+        if (!frames->Append(gif->canvas, gif->gce.delay * 10)) {
+            break;
+        }
+    }
+    gd_close_gif(gif);
+    return complete && Store(data, std::move(frames)) != nullptr;
+}
+
+void GifFrameCache::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    gifs_.clear();
+    used_ = 0;
+}
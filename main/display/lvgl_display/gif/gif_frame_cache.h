@@ -0,0 +1,68 @@
+#pragma once
+
+#include <lvgl.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+// An emotion set up to this size is decoded when the assets are applied
+#define GIF_PRERENDER_MAX_COUNT 12
+
+/**
+ * The decoded frames of one GIF, in the ARGB8888 canvas format of LvglGif
+ */
+struct GifFrames {
+    struct Frame {
+        uint8_t* pixels;
+        uint32_t delay_ms;      // How long the frame is shown
+    };
+
+    std::vector<Frame> frames;
+    size_t frame_size = 0;
+    int32_t loop_count = -1;    // Of the decoder while it plays the first loop
+
+    GifFrames() = default;
+    ~GifFrames();
+    GifFrames(const GifFrames&) = delete;
+    GifFrames& operator=(const GifFrames&) = delete;
+
+    // Copies the frame to PSRAM, false if it is out of memory
+    bool Append(const uint8_t* canvas, uint32_t delay_ms);
+    size_t bytes() const { return frames.size() * frame_size; }
+};
+
+/**
+ * Decoded frames of the GIFs, so a GIF that loops forever is decoded only once.
+ *
+ * LvglGif records the frames of its first loop here and plays them back afterwards, also in
+ * the next LvglGif for the same GIF. Prerender() decodes a whole GIF ahead. The GIFs are keyed
+ * by their data, which lives as long as the assets, and the frames stay until Clear() as long
+ * as they fit CONFIG_GIF_FRAME_CACHE_SIZE_KB.
+ */
+class GifFrameCache {
+public:
+    static GifFrameCache& GetInstance() {
+        static GifFrameCache instance;
+        return instance;
+    }
+
+    // nullptr if the frames of the GIF are not cached
+    std::shared_ptr<const GifFrames> Find(const void* data);
+    // Whether that many more bytes of frames fit the budget
+    bool Fits(size_t bytes);
+    // Returns the cached frames, nullptr if they do not fit
+    std::shared_ptr<const GifFrames> Store(const void* data, std::shared_ptr<GifFrames> frames);
+    bool Prerender(const void* data);
+    // The frames in use by an LvglGif are freed when it is done
+    void Clear();
+
+private:
+    GifFrameCache() = default;
+
+    std::mutex mutex_;
+    std::map<const void*, std::shared_ptr<const GifFrames>> gifs_;
+    size_t used_ = 0;
+};
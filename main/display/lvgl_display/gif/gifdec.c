@@ -36,6 +36,58 @@ static void f_gif_close(gd_GIF * gif);
 
 #if LV_USE_DRAW_SW_ASM == LV_DRAW_SW_ASM_HELIUM
     #include "gifdec_mve.h"
+#else
+/* The canvas is ARGB8888 and 4-byte aligned after the gd_GIF structure, so a pixel is one
+ * 32-bit store. A palette is turned into 32-bit colors once per frame instead of assembling
+ * every pixel from the RGB bytes. The ESP32-S3 PIE has no gather load for the palette
+ * lookup, this is the fast path there too. */
+#define GIFDEC_FILL_BG(dst, w, h, stride, color, opa) \
+    _gifdec_fill_bg_lut(dst, w, h, stride, color, opa)
+
+#define GIFDEC_RENDER_FRAME(dst, w, h, stride, frame, pattern, tindex) \
+    _gifdec_render_frame_lut(dst, w, h, stride, frame, pattern, tindex)
+
+static inline uint32_t _gifdec_color32(const uint8_t * color, uint8_t opa)
+{
+    return ((uint32_t) opa << 24) | ((uint32_t) color[0] << 16) | ((uint32_t) color[1] << 8) | color[2];
+}
+
+static void _gifdec_fill_bg_lut(uint8_t * dst, uint32_t w, uint16_t h, uint32_t stride, const uint8_t * color,
+                                uint8_t opa)
+{
+    uint32_t c = _gifdec_color32(color, opa);
+    for(uint16_t y = 0; y < h; y++) {
+        uint32_t * row = (uint32_t *) dst + y * stride;
+        for(uint32_t x = 0; x < w; x++) {
+            row[x] = c;
+        }
+    }
+}
+
+static void _gifdec_render_frame_lut(uint8_t * dst, uint16_t w, uint16_t h, uint16_t stride, const uint8_t * frame,
+                                     const uint8_t * pattern, uint16_t tindex)
+{
+    uint32_t lut[0x100];
+    for(int i = 0; i < 0x100; i++) {
+        lut[i] = _gifdec_color32(&pattern[i * 3], 0xFF);
+    }
+    for(uint16_t y = 0; y < h; y++) {
+        uint32_t * row = (uint32_t *) dst + y * stride;
+        const uint8_t * index = frame + y * stride;
+        if(tindex > 0xFF) {
+            for(uint16_t x = 0; x < w; x++) {
+                row[x] = lut[index[x]];
+            }
+        }
+        else {
+            for(uint16_t x = 0; x < w; x++) {
+                if(index[x] != tindex) {
+                    row[x] = lut[index[x]];
+                }
+            }
+        }
+    }
+}
 #endif
 
 static uint16_t
@@ -299,6 +351,7 @@ read_ext(gd_GIF * gif)
     }
 }
 
+#if LV_GIF_CACHE_DECODE_DATA
 static uint16_t
 get_key(gd_GIF *gif, int key_size, uint8_t *sub_len, uint8_t *shift, uint8_t *byte)
 {
@@ -328,7 +381,6 @@ get_key(gd_GIF *gif, int key_size, uint8_t *sub_len, uint8_t *shift, uint8_t *by
     return key;
 }
 
-#if LV_GIF_CACHE_DECODE_DATA
 /* Decompress image pixels.
  * Return 0 on success or -1 on out-of-memory (w.r.t. LZW code table) or parse error. */
 static int
@@ -542,12 +594,51 @@ interlaced_line_index(int h, int y)
     return y * 2 + 1;
 }
 
+/* The codes are taken from a bit buffer filled from whole sub-blocks, instead of a read per byte */
+typedef struct KeyReader {
+    uint8_t block[0xFF];
+    uint8_t length;
+    uint8_t position;
+    uint8_t nbits;
+    uint32_t bits;
+} KeyReader;
+
+static uint16_t
+read_key(gd_GIF * gif, KeyReader * reader, int key_size)
+{
+    while(reader->nbits < key_size) {
+        if(reader->position == reader->length) {
+            uint8_t sub_len = 0;
+            f_gif_read(gif, &sub_len, 1);
+            if(sub_len == 0) return 0x1000;
+            f_gif_read(gif, reader->block, sub_len);
+            reader->length = sub_len;
+            reader->position = 0;
+        }
+        reader->bits |= (uint32_t) reader->block[reader->position++] << reader->nbits;
+        reader->nbits += 8;
+    }
+    uint16_t key = reader->bits & ((1 << key_size) - 1);
+    reader->bits >>= key_size;
+    reader->nbits -= key_size;
+    return key;
+}
+
+/* The start of line y of the frame rectangle in the frame buffer */
+static uint8_t *
+frame_line(gd_GIF * gif, int y, int interlace)
+{
+    if(interlace)
+        y = interlaced_line_index((int) gif->fh, y);
+    return &gif->frame[(gif->fy + y) * gif->width + gif->fx];
+}
+
 /* Decompress image pixels.
  * Return 0 on success or -1 on out-of-memory (w.r.t. LZW code table) or parse error. */
 static int
 read_image_data(gd_GIF * gif, int interlace)
 {
-    uint8_t sub_len, shift, byte;
+    uint8_t byte = 0;
     int init_key_size, key_size, table_is_full = 0;
     int frm_off, frm_size, str_len = 0, i, p, x, y;
     uint16_t key, clear, stop;
@@ -555,6 +646,10 @@ read_image_data(gd_GIF * gif, int interlace)
     Table * table;
     Entry entry = {0};
     size_t start, end;
+    KeyReader reader;
+    /* Where frm_off is in the frame rectangle */
+    int line_x = 0, line_y = 0;
+    uint8_t * line;
 
     f_gif_read(gif, &byte, 1);
     key_size = (int) byte;
@@ -565,13 +660,16 @@ read_image_data(gd_GIF * gif, int interlace)
     clear = 1 << key_size;
     stop = clear + 1;
     table = new_table(key_size);
+    if(!table) return -1;
     key_size++;
     init_key_size = key_size;
-    sub_len = shift = 0;
-    key = get_key(gif, key_size, &sub_len, &shift, &byte); /* clear code */
+    reader.length = reader.position = reader.nbits = 0;
+    reader.bits = 0;
+    key = read_key(gif, &reader, key_size); /* clear code */
     frm_off = 0;
     ret = 0;
     frm_size = gif->fw * gif->fh;
+    line = frame_line(gif, 0, interlace);
     while(frm_off < frm_size) {
         if(key == clear) {
             key_size = init_key_size;
@@ -589,35 +687,64 @@ read_image_data(gd_GIF * gif, int interlace)
                 table_is_full = 1;
             }
         }
-        key = get_key(gif, key_size, &sub_len, &shift, &byte);
+        key = read_key(gif, &reader, key_size);
         if(key == clear) continue;
         if(key == stop || key == 0x1000) break;
         if(ret == 1) key_size++;
+        if(key >= table->nentries) {
+            ESP_LOGW(TAG, "LZW code out of the table");
+            lv_free(table);
+            return -1;
+        }
         entry = table->entries[key];
         str_len = entry.length;
-	if(frm_off + str_len > frm_size){
-		ESP_LOGW(TAG, "LZW table token overflows the frame buffer");
-		lv_free(table);
-		return -1;
-	}
-        for(i = 0; i < str_len; i++) {
-            p = frm_off + entry.length - 1;
-            x = p % gif->fw;
-            y = p / gif->fw;
-            if(interlace)
-                y = interlaced_line_index((int) gif->fh, y);
-            gif->frame[(gif->fy + y) * gif->width + gif->fx + x] = entry.suffix;
-            if(entry.prefix == 0xFFF)
-                break;
-            else
-                entry = table->entries[entry.prefix];
+        if(frm_off + str_len > frm_size) {
+            ESP_LOGW(TAG, "LZW table token overflows the frame buffer");
+            lv_free(table);
+            return -1;
+        }
+        if(line_x + str_len <= gif->fw) {
+            /* The string is within the current line, it is written back to front */
+            uint8_t * dst = line + line_x + str_len;
+            for(i = 0; i < str_len; i++) {
+                *--dst = entry.suffix;
+                if(entry.prefix == 0xFFF)
+                    break;
+                else
+                    entry = table->entries[entry.prefix];
+            }
+            line_x += str_len;
+        }
+        else {
+            for(i = 0; i < str_len; i++) {
+                p = frm_off + entry.length - 1;
+                x = p % gif->fw;
+                y = p / gif->fw;
+                if(interlace)
+                    y = interlaced_line_index((int) gif->fh, y);
+                gif->frame[(gif->fy + y) * gif->width + gif->fx + x] = entry.suffix;
+                if(entry.prefix == 0xFFF)
+                    break;
+                else
+                    entry = table->entries[entry.prefix];
+            }
+            line_x += str_len;
+            line_y += line_x / gif->fw;
+            line_x %= gif->fw;
+            if(line_y < gif->fh)
+                line = frame_line(gif, line_y, interlace);
+        }
+        if(line_x == gif->fw) {
+            line_x = 0;
+            line_y++;
+            if(line_y < gif->fh)
+                line = frame_line(gif, line_y, interlace);
         }
         frm_off += str_len;
         if(key < table->nentries - 1 && !table_is_full)
             table->entries[table->nentries - 1].suffix = entry.suffix;
     }
     lv_free(table);
-    if(key == stop) f_gif_read(gif, &sub_len, 1);  /* Must be zero! */
     f_gif_seek(gif, end, LV_FS_SEEK_SET);
     return 0;
 }
@@ -29,8 +29,14 @@ LvglGif::LvglGif(const lv_img_dsc_t* img_dsc)
     img_dsc_.data = gif_->canvas;
     img_dsc_.data_size = gif_->width * gif_->height * 4;
 
-    // Render first frame
-    if (gif_->canvas) {
+    // Render first frame, the GIF may already be decoded
+    data_ = img_dsc->data;
+    cached_frames_ = GifFrameCache::GetInstance().Find(data_);
+    if (cached_frames_ && cached_frames_->frame_size == img_dsc_.data_size) {
+        gif_->loop_count = cached_frames_->loop_count;
+        memcpy(gif_->canvas, cached_frames_->frames[0].pixels, img_dsc_.data_size);
+    } else if (gif_->canvas) {
+        cached_frames_.reset();
         gd_render_frame(gif_, gif_->canvas);
     }
 
@@ -111,8 +117,14 @@ void LvglGif::Stop() {
 
     if (gif_) {
         gd_rewind(gif_);
+        recording_.reset();
         // Render first frame without advancing
-        if (gif_->canvas) {
+        if (cached_frames_) {
+            gif_->loop_count = cached_frames_->loop_count;
+            cached_index_ = 0;
+            cached_pending_ = false;
+            memcpy(gif_->canvas, cached_frames_->frames[0].pixels, cached_frames_->frame_size);
+        } else if (gif_->canvas) {
             gd_render_frame(gif_, gif_->canvas);
         }
         ESP_LOGD(TAG, "GIF animation stopped and rewound");
@@ -188,12 +200,18 @@ void LvglGif::NextFrame() {
 
     // Check if enough time has passed for the next frame
     uint32_t elapsed = lv_tick_elaps(last_call_);
-    if (elapsed < gif_->gce.delay * 10) {
+    uint32_t delay_ms = cached_frames_ ? cached_frames_->frames[cached_index_].delay_ms : gif_->gce.delay * 10;
+    if (elapsed < delay_ms) {
         return;
     }
 
     last_call_ = lv_tick_get();
 
+    if (cached_frames_) {
+        NextCachedFrame();
+        return;
+    }
+
     // Save file position before getting next frame to detect loop
     uint32_t pos_before = gif_->f_rw_p;
 
@@ -201,6 +219,7 @@ void LvglGif::NextFrame() {
     int has_next = gd_get_frame(gif_);
     if (has_next == 0) {
         // Animation truly finished (non-infinite loop)
+        FinishRecording();
         playing_ = false;
         if (timer_) {
             lv_timer_pause(timer_);
@@ -208,21 +227,43 @@ void LvglGif::NextFrame() {
         ESP_LOGD(TAG, "GIF animation completed");
         return;
     }
+    if (has_next < 0) {
+        recording_.reset();
+    }
 
     // Detect loop by checking if file position jumped back (rewound to start)
     // This works for looping GIFs regardless of when loop_count is set
-    if (loop_delay_ms_ > 0 && gif_->f_rw_p < pos_before) {
+    bool looped = gif_->f_rw_p < pos_before;
+    if (looped || pos_before == (uint32_t)gif_->anim_start) {
+        // A whole loop was decoded, the next ones are played from its frames
+        FinishRecording();
+        if (!cached_frames_) {
+            recording_ = std::make_shared<GifFrames>();
+            recording_->frame_size = img_dsc_.data_size;
+            recording_->loop_count = gif_->loop_count;
+        }
+    }
+
+    if (loop_delay_ms_ > 0 && looped) {
         // File position decreased, meaning GIF looped back to beginning
         // Start waiting before rendering this frame
         loop_waiting_ = true;
         loop_wait_start_ = lv_tick_get();
+        cached_index_ = 0;
+        cached_pending_ = true;
         ESP_LOGD(TAG, "GIF completed one cycle, waiting %lu ms before next loop", loop_delay_ms_);
         return;
     }
 
+    if (cached_frames_) {
+        ShowCachedFrame(0);
+        return;
+    }
+
     // Render current frame
     if (gif_->canvas) {
         gd_render_frame(gif_, gif_->canvas);
+        RecordFrame();
         
         // Call frame callback if set
         if (frame_callback_) {
@@ -231,6 +272,69 @@ void LvglGif::NextFrame() {
     }
 }
 
+void LvglGif::NextCachedFrame() {
+    if (cached_pending_) {
+        cached_pending_ = false;
+        ShowCachedFrame(cached_index_);
+        return;
+    }
+
+    size_t next = cached_index_ + 1;
+    if (next < cached_frames_->frames.size()) {
+        ShowCachedFrame(next);
+        return;
+    }
+
+    // Count the loops like gd_get_frame() does at the trailer
+    if (gif_->loop_count == 1 || gif_->loop_count < 0) {
+        playing_ = false;
+        if (timer_) {
+            lv_timer_pause(timer_);
+        }
+        ESP_LOGD(TAG, "GIF animation completed");
+        return;
+    }
+    if (gif_->loop_count > 1) {
+        gif_->loop_count--;
+    }
+    if (loop_delay_ms_ > 0) {
+        loop_waiting_ = true;
+        loop_wait_start_ = lv_tick_get();
+        cached_index_ = 0;
+        cached_pending_ = true;
+        return;
+    }
+    ShowCachedFrame(0);
+}
+
+void LvglGif::ShowCachedFrame(size_t index) {
+    // Copied into the canvas, the image keeps pointing at the same pixels
+    cached_index_ = index;
+    memcpy(gif_->canvas, cached_frames_->frames[index].pixels, cached_frames_->frame_size);
+    if (frame_callback_) {
+        frame_callback_();
+    }
+}
+
+void LvglGif::RecordFrame() {
+    if (!recording_) {
+        return;
+    }
+    if (!GifFrameCache::GetInstance().Fits(recording_->bytes() + recording_->frame_size)
+        || !recording_->Append(gif_->canvas, gif_->gce.delay * 10)) {
+        recording_.reset();
+    }
+}
+
+void LvglGif::FinishRecording() {
+    if (recording_ && !recording_->frames.empty()) {
+        cached_frames_ = GifFrameCache::GetInstance().Store(data_, std::move(recording_));
+        cached_index_ = 0;
+        cached_pending_ = false;
+    }
+    recording_.reset();
+}
+
 void LvglGif::Cleanup() {
     // Stop and delete timer
     if (timer_) {
@@ -238,6 +342,9 @@ void LvglGif::Cleanup() {
         timer_ = nullptr;
     }
 
+    cached_frames_.reset();
+    recording_.reset();
+
     // Close GIF decoder
     if (gif_) {
         gd_close_gif(gif_);
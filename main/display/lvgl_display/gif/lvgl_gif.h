@@ -2,6 +2,7 @@
 
 #include "../lvgl_image.h"
 #include "gifdec.h"
+#include "gif_frame_cache.h"
 #include <lvgl.h>
 #include <memory>
 #include <functional>
@@ -104,11 +105,30 @@ private:
     
     // Frame update callback
     std::function<void()> frame_callback_;
+
+    // Decoded frames, played instead of decoding once the GIF has looped
+    const void* data_ = nullptr;
+    std::shared_ptr<const GifFrames> cached_frames_;
+    size_t cached_index_ = 0;
+    bool cached_pending_ = false;         // cached_index_ is shown next, without advancing
+    std::shared_ptr<GifFrames> recording_;
     
     /**
      * Update to next frame
      */
     void NextFrame();
+
+    /**
+     * Play the next cached frame
+     */
+    void NextCachedFrame();
+    void ShowCachedFrame(size_t index);
+
+    /**
+     * Keep the frames of the loop being decoded
+     */
+    void RecordFrame();
+    void FinishRecording();
     
     /**
      * Cleanup resources
@@ -0,0 +1,155 @@
+#include "glyph_cache.h"
+#include "heap_monitor.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <cstring>
+#include <iterator>
+
+#define TAG "GlyphCache"
+
+#define GLYPH_CACHE_SIZE (CONFIG_CBIN_FONT_GLYPH_CACHE_SIZE_KB * 1024)
+
+void GlyphCache::Attach(lv_font_t* font) {
+    if (GLYPH_CACHE_SIZE == 0 || font == nullptr || font->get_glyph_bitmap == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (fonts_.find(font) != fonts_.end()) {
+        return;
+    }
+    fonts_[font] = font->get_glyph_bitmap;
+    font->get_glyph_bitmap = GetGlyphBitmap;
+}
+
+void GlyphCache::Detach(lv_font_t* font) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = fonts_.find(font);
+    if (it == fonts_.end()) {
+        return;
+    }
+    font->get_glyph_bitmap = it->second;
+    fonts_.erase(it);
+    for (auto glyph = glyphs_.begin(); glyph != glyphs_.end();) {
+        auto next = std::next(glyph);
+        if (glyph->key.font == font) {
+            Erase(glyph);
+        }
+        glyph = next;
+    }
+}
+
+bool GlyphCache::Prewarm(const lv_font_t* font, const char* text) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (fonts_.find(font) == fonts_.end()) {
+            return false;
+        }
+    }
+
+    uint32_t offset = 0;
+    uint32_t letter;
+    int count = 0;
+    while ((letter = lv_text_encoded_next(text, &offset)) != 0) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (used_ >= GLYPH_CACHE_SIZE / 2) {
+                break;
+            }
+        }
+        lv_font_glyph_dsc_t glyph = {};
+        if (!lv_font_get_glyph_dsc(font, &glyph, letter, 0) || glyph.resolved_font != font || glyph.box_w == 0 || glyph.box_h == 0) {
+            continue;
+        }
+        // The same A8 buffer the label draw reshapes for a glyph
+        lv_draw_buf_t* draw_buf = lv_draw_buf_create(glyph.box_w, glyph.box_h, LV_COLOR_FORMAT_A8, LV_STRIDE_AUTO);
+        if (draw_buf == nullptr) {
+            break;
+        }
+        Draw(&glyph, draw_buf, false);
+        lv_draw_buf_destroy(draw_buf);
+        count++;
+    }
+    ESP_LOGI(TAG, "Prewarmed %d glyphs, %u bytes in use", count, used_);
+    return true;
+}
+
+const void* GlyphCache::GetGlyphBitmap(lv_font_glyph_dsc_t* glyph, lv_draw_buf_t* draw_buf) {
+    return GetInstance().Draw(glyph, draw_buf, true);
+}
+
+const void* GlyphCache::Draw(lv_font_glyph_dsc_t* glyph, lv_draw_buf_t* draw_buf, bool count) {
+    Key key = {glyph->resolved_font, glyph->gid.index};
+    GetBitmapCallback get_bitmap;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto font = fonts_.find(key.font);
+        if (font == fonts_.end()) {
+            return nullptr;
+        }
+        get_bitmap = font->second;
+        if (draw_buf != nullptr) {
+            auto it = index_.find(key);
+            if (it != index_.end()) {
+                auto& cached = *it->second;
+                if (draw_buf->header.stride == cached.stride && draw_buf->header.h == cached.height && draw_buf->data_size >= cached.size) {
+                    memcpy(draw_buf->data, cached.data, cached.size);
+                    glyphs_.splice(glyphs_.begin(), glyphs_, it->second);
+                    hits_ += count;
+                    return draw_buf;
+                }
+            }
+            misses_ += count;
+        }
+    }
+
+    // Only a glyph expanded into the draw buffer is kept, a raw bitmap points to the font data already
+    const void* bitmap = get_bitmap(glyph, draw_buf);
+    if (bitmap != nullptr && bitmap == draw_buf && draw_buf->header.cf == LV_COLOR_FORMAT_A8) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Store(key, draw_buf);
+    }
+    return bitmap;
+}
+
+void GlyphCache::Store(const Key& key, const lv_draw_buf_t* draw_buf) {
+    uint32_t size = draw_buf->header.stride * draw_buf->header.h;
+    // The font may have been detached meanwhile, and a huge glyph would flush the small ones
+    if (size == 0 || size > GLYPH_CACHE_SIZE / 16 || fonts_.find(key.font) == fonts_.end() || index_.find(key) != index_.end()) {
+        return;
+    }
+    while (used_ + size > GLYPH_CACHE_SIZE && !glyphs_.empty()) {
+        Erase(std::prev(glyphs_.end()));
+        evictions_++;
+    }
+#if CONFIG_SPIRAM
+    auto data = (uint8_t*)HeapMonitor::GetInstance().Malloc(kHeapTagDisplay, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#else
+    auto data = (uint8_t*)HeapMonitor::GetInstance().Malloc(kHeapTagDisplay, size, MALLOC_CAP_8BIT);
+#endif
+    if (data == nullptr) {
+        return;
+    }
+    memcpy(data, draw_buf->data, size);
+    glyphs_.push_front({key, data, size, draw_buf->header.stride, (uint16_t)draw_buf->header.h});
+    index_[key] = glyphs_.begin();
+    used_ += size;
+}
+
+void GlyphCache::Erase(std::list<Glyph>::iterator it) {
+    used_ -= it->size;
+    HeapMonitor::GetInstance().Free(kHeapTagDisplay, it->data);
+    index_.erase(it->key);
+    glyphs_.erase(it);
+}
+
+cJSON* GlyphCache::GetStatsJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "glyphs", glyphs_.size());
+    cJSON_AddNumberToObject(root, "bytes", used_);
+    cJSON_AddNumberToObject(root, "hits", hits_);
+    cJSON_AddNumberToObject(root, "misses", misses_);
+    cJSON_AddNumberToObject(root, "evictions", evictions_);
+    return root;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <lvgl.h>
+#include <cJSON.h>
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * The A8 bitmaps of the glyphs drawn from the cbin fonts, so a glyph drawn again is copied
+ * from RAM instead of being read from the mmapped flash and expanded to A8 again.
+ *
+ * A font is attached by taking over its get_glyph_bitmap callback. The glyphs of all the
+ * attached fonts share one least recently used pool of CONFIG_CBIN_FONT_GLYPH_CACHE_SIZE_KB.
+ * The bitmaps are drawn in the LVGL task, GetStatsJson() may be called by any task.
+ */
+class GlyphCache {
+public:
+    static GlyphCache& GetInstance() {
+        static GlyphCache instance;
+        return instance;
+    }
+
+    void Attach(lv_font_t* font);
+    // Drops the glyphs of the font, before it is deleted
+    void Detach(lv_font_t* font);
+    // Caches the glyphs of the text up to half of the pool, false if the font is not attached
+    bool Prewarm(const lv_font_t* font, const char* text);
+    // The caller owns the returned object
+    cJSON* GetStatsJson();
+
+private:
+    typedef const void* (*GetBitmapCallback)(lv_font_glyph_dsc_t* glyph, lv_draw_buf_t* draw_buf);
+
+    struct Key {
+        const lv_font_t* font;
+        uint32_t index;
+        bool operator==(const Key& other) const { return font == other.font && index == other.index; }
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const { return (size_t)key.font ^ (key.index * 2654435761u); }
+    };
+    struct Glyph {
+        Key key;
+        uint8_t* data;
+        uint32_t size;
+        uint32_t stride;
+        uint16_t height;
+    };
+
+    GlyphCache() = default;
+
+    std::mutex mutex_;
+    std::map<const lv_font_t*, GetBitmapCallback> fonts_;  // The callbacks the fonts came with
+    std::list<Glyph> glyphs_;                              // The most recently drawn first
+    std::unordered_map<Key, std::list<Glyph>::iterator, KeyHash> index_;
+    size_t used_ = 0;
+    uint32_t hits_ = 0;
+    uint32_t misses_ = 0;
+    uint32_t evictions_ = 0;
+
+    static const void* GetGlyphBitmap(lv_font_glyph_dsc_t* glyph, lv_draw_buf_t* draw_buf);
+    // Counts the hit or miss unless the cache is prewarming
+    const void* Draw(lv_font_glyph_dsc_t* glyph, lv_draw_buf_t* draw_buf, bool count);
+    void Store(const Key& key, const lv_draw_buf_t* draw_buf);
+    void Erase(std::list<Glyph>::iterator it);
+};
@@ -0,0 +1,47 @@
+#include "byte_swap.h"
+
+// Words over the pixels of the caller
+typedef uint32_t __attribute__((may_alias)) pixel_pair_t;
+
+// Swaps the bytes of the two pixels of a word at once
+#define SWAP_PIXEL_PAIR(x) ((((x) & 0x00ff00ffu) << 8) | (((x) >> 8) & 0x00ff00ffu))
+
+void swap_bytes_16(void* dst, const void* src, size_t count) {
+    uint16_t* d16 = (uint16_t*)dst;
+    const uint16_t* s16 = (const uint16_t*)src;
+
+    // The words of dst and src line up only if both are equally off 4-byte alignment
+    if ((((uintptr_t)d16 ^ (uintptr_t)s16) & 3) != 0) {
+        for (size_t i = 0; i < count; i++) {
+            d16[i] = __builtin_bswap16(s16[i]);
+        }
+        return;
+    }
+    if (count > 0 && ((uintptr_t)s16 & 3) != 0) {
+        *d16++ = __builtin_bswap16(*s16++);
+        count--;
+    }
+
+    pixel_pair_t* d = (pixel_pair_t*)d16;
+    const pixel_pair_t* s = (const pixel_pair_t*)s16;
+    size_t words = count / 2;
+    size_t i = 0;
+    // The loads of a group come before its stores, which keeps the swap in place correct
+    for (; i + 4 <= words; i += 4) {
+        uint32_t a = s[i];
+        uint32_t b = s[i + 1];
+        uint32_t c = s[i + 2];
+        uint32_t e = s[i + 3];
+        d[i] = SWAP_PIXEL_PAIR(a);
+        d[i + 1] = SWAP_PIXEL_PAIR(b);
+        d[i + 2] = SWAP_PIXEL_PAIR(c);
+        d[i + 3] = SWAP_PIXEL_PAIR(e);
+    }
+    for (; i < words; i++) {
+        uint32_t a = s[i];
+        d[i] = SWAP_PIXEL_PAIR(a);
+    }
+    if (count & 1) {
+        d16[count - 1] = __builtin_bswap16(s16[count - 1]);
+    }
+}
@@ -0,0 +1,26 @@
+// byte_swap.h - RGB565 等 16 位像素的字节交换
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    /**
+     * @brief 交换 count 个 16 位像素的高低字节
+     *
+     * 每次处理两个 32 位字（4 个像素），dst 与 src 可以相同（原地交换），
+     * 不能部分重叠。两者 4 字节对齐方式不同时逐像素处理。
+     *
+     * @param dst   输出
+     * @param src   输入
+     * @param count 像素数
+     */
+    void swap_bytes_16(void *dst, const void *src, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
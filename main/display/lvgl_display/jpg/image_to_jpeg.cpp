@@ -1,8 +1,11 @@
 #include <esp_attr.h>
 #include <esp_heap_caps.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <stddef.h>
 #include <string.h>
+#include <algorithm>
+#include <mutex>
 #include <utility>
 
 #include "esp_jpeg_common.h"
@@ -13,6 +16,7 @@
 #include "driver/jpeg_encode.h"
 #endif
 #include "image_to_jpeg.h"
+#include "byte_swap.h"
 
 #define TAG "image_to_jpeg"
 
@@ -242,12 +246,17 @@ static uint8_t* convert_input_to_hw_encoder_buf(const uint8_t* src, uint16_t wid
         return buf;
     }
 
-    if (format == V4L2_PIX_FMT_RGB565) {
+    if (format == V4L2_PIX_FMT_RGB565 || format == V4L2_PIX_FMT_RGB565X) {
         int sz = (int)width * (int)height * 2;
         uint8_t* buf = (uint8_t*)malloc_psram(sz);
         if (!buf)
             return NULL;
-        memcpy(buf, src, sz);
+        // The input is copied anyway, RGB565X is swapped on the way
+        if (format == V4L2_PIX_FMT_RGB565X) {
+            swap_bytes_16(buf, src, sz / 2);
+        } else {
+            memcpy(buf, src, sz);
+        }
         if (out_fmt)
             *out_fmt = JPEG_ENCODE_IN_FORMAT_RGB565;
         if (out_size)
@@ -261,10 +270,7 @@ static uint8_t* convert_input_to_hw_encoder_buf(const uint8_t* src, uint16_t wid
         uint16_t* buf = (uint16_t*)malloc_psram(sz);
         if (!buf)
             return NULL;
-        const uint16_t* bsrc = (const uint16_t*)src;
-        for (int i = 0; i < sz / 2; i++) {
-            buf[i] = __builtin_bswap16(bsrc[i]);
-        }
+        swap_bytes_16(buf, src, sz / 2);
         if (out_fmt)
             *out_fmt = JPEG_ENCODE_IN_FORMAT_YUV422;
         if (out_size)
@@ -347,6 +353,11 @@ static bool encode_with_hw_jpeg(const uint8_t* src, size_t src_len, uint16_t wid
 }
 #endif // CONFIG_XIAOZHI_ENABLE_HARDWARE_JPEG_ENCODER
 
+#ifdef CONFIG_XIAOZHI_JPEG_ENCODE_IN_BLOCKS
+static int encode_in_blocks(const uint8_t* src, uint16_t width, uint16_t height, v4l2_pix_fmt_t format,
+                            uint8_t quality, jpg_out_cb cb, void* cb_arg);
+#endif
+
 static bool encode_with_esp_new_jpeg(const uint8_t* src, size_t src_len, uint16_t width, uint16_t height,
                                      v4l2_pix_fmt_t format, uint8_t quality, uint8_t** jpg_out, size_t* jpg_out_len,
                                      jpg_out_cb cb, void* cb_arg) {
@@ -355,6 +366,17 @@ static bool encode_with_esp_new_jpeg(const uint8_t* src, size_t src_len, uint16_
     if (quality > 100)
         quality = 100;
 
+#ifdef CONFIG_XIAOZHI_JPEG_ENCODE_IN_BLOCKS
+    // The colors are converted a block at a time, without a YUYV copy of the whole frame
+    if (cb && (format == V4L2_PIX_FMT_RGB565 || format == V4L2_PIX_FMT_RGB565X || format == V4L2_PIX_FMT_RGB24)) {
+        int ret = encode_in_blocks(src, width, height, format, quality, cb, cb_arg);
+        if (ret >= 0) {
+            return ret > 0;
+        }
+        ESP_LOGW(TAG, "Failed to open the block encoder, convert the whole frame");
+    }
+#endif
+
     jpeg_pixel_format_t enc_src_type = JPEG_PIXEL_FORMAT_RGB888;
     int enc_in_size = 0;
     uint8_t* enc_in = convert_input_to_encoder_buf(src, width, height, format, &enc_src_type, &enc_in_size);
@@ -370,7 +392,12 @@ static bool encode_with_esp_new_jpeg(const uint8_t* src, size_t src_len, uint16_
     cfg.subsampling = (enc_src_type == JPEG_PIXEL_FORMAT_GRAY) ? JPEG_SUBSAMPLE_GRAY : JPEG_SUBSAMPLE_420;
     cfg.quality = quality;
     cfg.rotate = JPEG_ROTATE_0D;
+#if CONFIG_FREERTOS_UNICORE
     cfg.task_enable = false;
+#else
+    // The color conversion and DCT already use the SIMD instructions of the chip, the Huffman coding runs on the other core
+    cfg.task_enable = true;
+#endif
 
     jpeg_enc_handle_t h = NULL;
     jpeg_error_t ret = jpeg_enc_open(&cfg, &h);
@@ -424,6 +451,78 @@ static bool encode_with_esp_new_jpeg(const uint8_t* src, size_t src_len, uint16_
     return true;
 }
 
+typedef bool (*encode_fn_t)(const uint8_t* src, size_t src_len, uint16_t width, uint16_t height,
+                            v4l2_pix_fmt_t format, uint8_t quality, uint8_t** jpg_out, size_t* jpg_out_len,
+                            jpg_out_cb cb, void* cb_arg);
+
+struct jpeg_backend_t {
+    encode_fn_t encode;
+    image_to_jpeg_stats_t stats;
+};
+
+// Tried in this order until one succeeds
+static jpeg_backend_t s_backends[] = {
+#if CONFIG_XIAOZHI_ENABLE_HARDWARE_JPEG_ENCODER
+    {encode_with_hw_jpeg, {"hardware", 0, 0, 0, 0}},
+#endif
+    {encode_with_esp_new_jpeg, {"esp_new_jpeg", 0, 0, 0, 0}},
+};
+static std::mutex s_stats_mutex;
+
+// Keeps the time spent in the output callback out of the encode time
+struct timed_cb_arg_t {
+    jpg_out_cb cb;
+    void* arg;
+    int64_t cb_us;
+};
+
+static size_t timed_cb(void* arg, size_t index, const void* data, size_t len) {
+    auto timed = static_cast<timed_cb_arg_t*>(arg);
+    int64_t start_us = esp_timer_get_time();
+    size_t ret = timed->cb(timed->arg, index, data, len);
+    timed->cb_us += esp_timer_get_time() - start_us;
+    return ret;
+}
+
+static bool encode_with_backends(const uint8_t* src, size_t src_len, uint16_t width, uint16_t height,
+                                 v4l2_pix_fmt_t format, uint8_t quality, uint8_t** jpg_out, size_t* jpg_out_len,
+                                 jpg_out_cb cb, void* cb_arg) {
+    for (auto& backend : s_backends) {
+        timed_cb_arg_t timed = {cb, cb_arg, 0};
+        int64_t start_us = esp_timer_get_time();
+        bool ok = backend.encode(src, src_len, width, height, format, quality, jpg_out, jpg_out_len,
+                                 cb ? timed_cb : NULL, cb ? &timed : NULL);
+        uint32_t elapsed_us = (uint32_t)(esp_timer_get_time() - start_us - timed.cb_us);
+        {
+            std::lock_guard<std::mutex> lock(s_stats_mutex);
+            if (ok) {
+                backend.stats.count++;
+                backend.stats.last_us = elapsed_us;
+                backend.stats.total_us += elapsed_us;
+            } else {
+                backend.stats.failures++;
+            }
+        }
+        if (ok) {
+            ESP_LOGI(TAG, "Encoded %ux%u with %s in %lu ms", width, height, backend.stats.name, elapsed_us / 1000);
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t image_to_jpeg_get_stats(image_to_jpeg_stats_t* stats, size_t max_count) {
+    std::lock_guard<std::mutex> lock(s_stats_mutex);
+    size_t count = 0;
+    for (auto& backend : s_backends) {
+        if (count == max_count) {
+            break;
+        }
+        stats[count++] = backend.stats;
+    }
+    return count;
+}
+
 bool image_to_jpeg(uint8_t* src, size_t src_len, uint16_t width, uint16_t height, v4l2_pix_fmt_t format,
                    uint8_t quality, uint8_t** out, size_t* out_len) {
 #ifdef CONFIG_XIAOZHI_CAMERA_ALLOW_JPEG_INPUT
@@ -439,13 +538,7 @@ bool image_to_jpeg(uint8_t* src, size_t src_len, uint16_t width, uint16_t height
         return true;
     }
 #endif // CONFIG_XIAOZHI_CAMERA_ALLOW_JPEG_INPUT
-#if CONFIG_XIAOZHI_ENABLE_HARDWARE_JPEG_ENCODER
-    if (encode_with_hw_jpeg(src, src_len, width, height, format, quality, out, out_len, NULL, NULL)) {
-        return true;
-    }
-    // Fallback to esp_new_jpeg
-#endif
-    return encode_with_esp_new_jpeg(src, src_len, width, height, format, quality, out, out_len, NULL, NULL);
+    return encode_with_backends(src, src_len, width, height, format, quality, out, out_len, NULL, NULL);
 }
 
 bool image_to_jpeg_cb(uint8_t* src, size_t src_len, uint16_t width, uint16_t height, v4l2_pix_fmt_t format,
@@ -457,11 +550,229 @@ bool image_to_jpeg_cb(uint8_t* src, size_t src_len, uint16_t width, uint16_t hei
         return true;
     }
 #endif // CONFIG_XIAOZHI_CAMERA_ALLOW_JPEG_INPUT
-#if CONFIG_XIAOZHI_ENABLE_HARDWARE_JPEG_ENCODER
-    if (encode_with_hw_jpeg(src, src_len, width, height, format, quality, NULL, NULL, cb, arg)) {
-        return true;
+    return encode_with_backends(src, src_len, width, height, format, quality, NULL, NULL, cb, arg);
+}
+
+struct image_to_jpeg_stream {
+    jpeg_enc_handle_t encoder;
+    esp_imgfx_color_convert_handle_t converter;
+    uint16_t width;
+    uint16_t height;
+    uint16_t lines;
+    uint16_t next_line;
+    size_t src_stride;
+    int block_size;
+    uint8_t* block;
+    uint8_t* outbuf;
+    int outbuf_size;
+    int64_t encode_us;
+};
+
+image_to_jpeg_stream_t image_to_jpeg_stream_open(uint16_t width, uint16_t height, v4l2_pix_fmt_t format,
+                                                 uint8_t quality, uint16_t* lines) {
+    esp_imgfx_pixel_fmt_t in_pixel_fmt;
+    size_t bytes_per_pixel;
+    switch (format) {
+        case V4L2_PIX_FMT_RGB565:
+            in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB565_LE;
+            bytes_per_pixel = 2;
+            break;
+        case V4L2_PIX_FMT_RGB565X:
+            in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB565_BE;
+            bytes_per_pixel = 2;
+            break;
+        case V4L2_PIX_FMT_RGB24:
+            in_pixel_fmt = ESP_IMGFX_PIXEL_FMT_RGB888;
+            bytes_per_pixel = 3;
+            break;
+        default:
+            ESP_LOGE(TAG, "unsupported stream format: 0x%08lx", format);
+            return NULL;
     }
-    // Fallback to esp_new_jpeg
-#endif
-    return encode_with_esp_new_jpeg(src, src_len, width, height, format, quality, NULL, NULL, cb, arg);
+
+    auto stream = (image_to_jpeg_stream*)calloc(1, sizeof(image_to_jpeg_stream));
+    if (!stream) {
+        return NULL;
+    }
+    stream->width = width;
+    stream->height = height;
+    stream->src_stride = width * bytes_per_pixel;
+
+    jpeg_enc_config_t cfg = DEFAULT_JPEG_ENC_CONFIG();
+    cfg.width = width;
+    cfg.height = height;
+    cfg.src_type = JPEG_PIXEL_FORMAT_YCbYCr;
+    cfg.subsampling = JPEG_SUBSAMPLE_420;
+    cfg.quality = quality < 1 ? 1 : (quality > 100 ? 100 : quality);
+    cfg.rotate = JPEG_ROTATE_0D;
+    cfg.task_enable = false;
+    jpeg_error_t ret = jpeg_enc_open(&cfg, &stream->encoder);
+    if (ret != JPEG_ERR_OK) {
+        ESP_LOGE(TAG, "jpeg_enc_open failed: %d", (int)ret);
+        image_to_jpeg_stream_close(stream);
+        return NULL;
+    }
+    ret = jpeg_enc_get_block_size(stream->encoder, &stream->block_size);
+    if (ret != JPEG_ERR_OK || stream->block_size <= 0) {
+        ESP_LOGE(TAG, "jpeg_enc_get_block_size failed: %d", (int)ret);
+        image_to_jpeg_stream_close(stream);
+        return NULL;
+    }
+    // A block of YCbYCr holds whole lines of 2 bytes per pixel
+    if (stream->block_size % (width * 2) != 0) {
+        ESP_LOGE(TAG, "block of %d bytes is not whole lines of %u pixels", stream->block_size, width);
+        image_to_jpeg_stream_close(stream);
+        return NULL;
+    }
+    stream->lines = (uint16_t)(stream->block_size / (width * 2));
+
+    esp_imgfx_color_convert_cfg_t convert_cfg = {
+        .in_res = {.width = static_cast<int16_t>(width), .height = static_cast<int16_t>(stream->lines)},
+        .in_pixel_fmt = in_pixel_fmt,
+        .out_pixel_fmt = ESP_IMGFX_PIXEL_FMT_YUYV,
+        .color_space_std = ESP_IMGFX_COLOR_SPACE_STD_BT601,
+    };
+    if (esp_imgfx_color_convert_open(&convert_cfg, &stream->converter) != ESP_IMGFX_ERR_OK) {
+        ESP_LOGE(TAG, "esp_imgfx_color_convert_open failed");
+        image_to_jpeg_stream_close(stream);
+        return NULL;
+    }
+
+    // The tables and headers come out with the first block
+    stream->outbuf_size = stream->block_size + 2048;
+    stream->block = (uint8_t*)jpeg_calloc_align(stream->block_size, 16);
+    stream->outbuf = (uint8_t*)malloc_psram(stream->outbuf_size);
+    if (!stream->block || !stream->outbuf) {
+        ESP_LOGE(TAG, "alloc stream buffers failed");
+        image_to_jpeg_stream_close(stream);
+        return NULL;
+    }
+    *lines = stream->lines;
+    return stream;
+}
+
+// Converts and encodes the next block, src holds its full number of lines
+static bool stream_encode_block(image_to_jpeg_stream_t stream, const uint8_t* src, jpg_out_cb cb, void* arg) {
+    int64_t start_us = esp_timer_get_time();
+    uint16_t valid = std::min<uint16_t>(stream->lines, stream->height - stream->next_line);
+    esp_imgfx_data_t convert_input_data = {
+        .data = const_cast<uint8_t*>(src),
+        .data_len = static_cast<uint32_t>(stream->src_stride * stream->lines),
+    };
+    esp_imgfx_data_t convert_output_data = {
+        .data = stream->block,
+        .data_len = static_cast<uint32_t>(stream->block_size),
+    };
+    if (esp_imgfx_color_convert_process(stream->converter, &convert_input_data, &convert_output_data) != ESP_IMGFX_ERR_OK) {
+        ESP_LOGE(TAG, "esp_imgfx_color_convert_process failed");
+        return false;
+    }
+
+    int out_len = 0;
+    jpeg_error_t ret = jpeg_enc_process_with_block(stream->encoder, stream->block, stream->block_size, stream->outbuf,
+                                                   stream->outbuf_size, &out_len);
+    if (ret < JPEG_ERR_OK) {
+        ESP_LOGE(TAG, "jpeg_enc_process_with_block failed: %d", (int)ret);
+        return false;
+    }
+    stream->next_line += valid;
+    stream->encode_us += esp_timer_get_time() - start_us;
+
+    if (out_len > 0 && cb(arg, stream->next_line, stream->outbuf, (size_t)out_len) == 0) {
+        return false;
+    }
+    if (stream->next_line >= stream->height) {
+        cb(arg, stream->next_line, NULL, 0);  // 结束信号
+    }
+    return true;
+}
+
+bool image_to_jpeg_stream_write(image_to_jpeg_stream_t stream, uint8_t* src, jpg_out_cb cb, void* arg) {
+    if (stream->next_line >= stream->height) {
+        ESP_LOGE(TAG, "stream already complete");
+        return false;
+    }
+    // Repeat the last line into the rest of a partial block
+    uint16_t valid = std::min<uint16_t>(stream->lines, stream->height - stream->next_line);
+    for (uint16_t y = valid; y < stream->lines; y++) {
+        memcpy(src + y * stream->src_stride, src + (valid - 1) * stream->src_stride, stream->src_stride);
+    }
+    if (!stream_encode_block(stream, src, cb, arg)) {
+        return false;
+    }
+    if (stream->next_line >= stream->height) {
+        std::lock_guard<std::mutex> lock(s_stats_mutex);
+        auto& stats = s_backends[sizeof(s_backends) / sizeof(s_backends[0]) - 1].stats;
+        stats.count++;
+        stats.last_us = (uint32_t)stream->encode_us;
+        stats.total_us += stream->encode_us;
+        ESP_LOGI(TAG, "Encoded %ux%u with %s in blocks of %u lines in %lu ms", stream->width, stream->height,
+                 stats.name, stream->lines, stats.last_us / 1000);
+    }
+    return true;
+}
+
+void image_to_jpeg_stream_close(image_to_jpeg_stream_t stream) {
+    if (stream == NULL) {
+        return;
+    }
+    if (stream->encoder) {
+        jpeg_enc_close(stream->encoder);
+    }
+    if (stream->converter) {
+        esp_imgfx_color_convert_close(stream->converter);
+    }
+    if (stream->block) {
+        jpeg_free_align(stream->block);
+    }
+    free(stream->outbuf);
+    free(stream);
+}
+
+#ifdef CONFIG_XIAOZHI_JPEG_ENCODE_IN_BLOCKS
+// Hands the blocks on with the indexes of a whole frame encode, 0 for the data and 1 for the end
+struct block_cb_arg_t {
+    jpg_out_cb cb;
+    void* arg;
+};
+
+static size_t block_cb(void* arg, size_t index, const void* data, size_t len) {
+    auto forward = static_cast<block_cb_arg_t*>(arg);
+    return forward->cb(forward->arg, data ? 0 : 1, data, len);
+}
+
+// Returns -1 if the block encoder can not be opened, then nothing has gone to the callback
+static int encode_in_blocks(const uint8_t* src, uint16_t width, uint16_t height, v4l2_pix_fmt_t format,
+                            uint8_t quality, jpg_out_cb cb, void* cb_arg) {
+    uint16_t lines = 0;
+    auto stream = image_to_jpeg_stream_open(width, height, format, quality, &lines);
+    if (stream == NULL) {
+        return -1;
+    }
+    // Only a partial last block is copied, its padding must not go past the end of the frame
+    uint8_t* tail = NULL;
+    block_cb_arg_t forward = {cb, cb_arg};
+    bool ok = true;
+    for (uint16_t y = 0; y < height && ok; y += lines) {
+        const uint8_t* block = src + (size_t)y * stream->src_stride;
+        uint16_t valid = std::min<uint16_t>(lines, height - y);
+        if (valid < lines) {
+            tail = (uint8_t*)malloc_psram(stream->src_stride * lines);
+            if (tail == NULL) {
+                ESP_LOGE(TAG, "alloc last block failed");
+                ok = false;
+                break;
+            }
+            memcpy(tail, block, stream->src_stride * valid);
+            for (uint16_t i = valid; i < lines; i++) {
+                memcpy(tail + i * stream->src_stride, tail + (valid - 1) * stream->src_stride, stream->src_stride);
+            }
+            block = tail;
+        }
+        ok = stream_encode_block(stream, block, block_cb, &forward);
+    }
+    free(tail);
+    image_to_jpeg_stream_close(stream);
+    return ok ? 1 : 0;
 }
+#endif // CONFIG_XIAOZHI_JPEG_ENCODE_IN_BLOCKS
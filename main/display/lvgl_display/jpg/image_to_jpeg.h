@@ -64,6 +64,7 @@ extern "C"
      * - 节省约8KB的SRAM使用（静态变量改为堆分配）
      * - 支持流式输出，无需预分配大缓冲区
      * - 通过回调函数逐块处理JPEG数据
+     * - 开启 XIAOZHI_JPEG_ENCODE_IN_BLOCKS 时 RGB 图像按块转换颜色，不需要整帧的 YUYV 缓冲
      *
      * @param src       源图像数据
      * @param src_len   源图像数据长度
@@ -79,6 +80,61 @@ extern "C"
     bool image_to_jpeg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height,
                           v4l2_pix_fmt_t format, uint8_t quality, jpg_out_cb cb, void *arg);
 
+    // 分块编码的句柄
+    typedef struct image_to_jpeg_stream *image_to_jpeg_stream_t;
+
+    /**
+     * @brief 打开分块编码，图像按行分块送入，内存占用只与一块的大小有关
+     *
+     * @param width     图像宽度
+     * @param height    图像高度
+     * @param format    每块的图像格式，支持 RGB565、RGB565X 与 RGB24
+     * @param quality   JPEG质量 (1-100)
+     * @param lines     输出每块的行数，最后一块可以不满
+     *
+     * @return 句柄，失败时为 NULL
+     */
+    image_to_jpeg_stream_t image_to_jpeg_stream_open(uint16_t width, uint16_t height, v4l2_pix_fmt_t format,
+                                                     uint8_t quality, uint16_t *lines);
+
+    /**
+     * @brief 编码下一块，产生的JPEG数据交给回调
+     *
+     * @param stream    句柄
+     * @param src       一块的图像数据，行数为 image_to_jpeg_stream_open 输出的 lines，
+     *                  最后一块不满时其余各行的内容不限，函数可能改写这些行
+     * @param cb        输出回调函数，返回 0 时编码中止
+     * @param arg       传递给回调函数的用户参数
+     *
+     * @return true 成功, false 失败
+     */
+    bool image_to_jpeg_stream_write(image_to_jpeg_stream_t stream, uint8_t *src, jpg_out_cb cb, void *arg);
+
+    // 关闭句柄，未写完的图像被丢弃
+    void image_to_jpeg_stream_close(image_to_jpeg_stream_t stream);
+
+    // 一个编码后端的统计，耗时不含输出回调的时间
+    typedef struct
+    {
+        const char *name;  // 后端名称
+        uint32_t count;    // 成功编码的次数
+        uint32_t failures; // 失败后交给下一个后端的次数
+        uint32_t last_us;  // 最近一次编码耗时
+        uint64_t total_us; // 成功编码的总耗时
+    } image_to_jpeg_stats_t;
+
+    /**
+     * @brief 获取各编码后端的统计
+     *
+     * 编码时按顺序尝试各后端：硬件编码器（ESP32-P4），然后是 esp_new_jpeg 软件编码器。
+     *
+     * @param stats     输出的统计数组
+     * @param max_count 数组长度
+     *
+     * @return 写入的后端个数
+     */
+    size_t image_to_jpeg_get_stats(image_to_jpeg_stats_t *stats, size_t max_count);
+
 #ifdef __cplusplus
 }
 #endif
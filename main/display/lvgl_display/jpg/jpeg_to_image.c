@@ -14,7 +14,7 @@
 #endif  // CONFIG_XIAOZHI_ENABLE_CAMERA_DEBUG_MODE
 #include <esp_log.h>
 
-#ifdef CONFIG_XIAOZHI_ENABLE_HARDWARE_JPEG_DECODER
+#if CONFIG_SOC_JPEG_DECODE_SUPPORTED
 #include "driver/jpeg_decode.h"
 #endif
 
@@ -99,7 +99,7 @@ jpeg_dec_failed:
     return ret;
 }
 
-#ifdef CONFIG_XIAOZHI_ENABLE_HARDWARE_JPEG_DECODER
+#if CONFIG_SOC_JPEG_DECODE_SUPPORTED
 static esp_err_t decode_with_hardware_jpeg(const uint8_t* src, size_t src_len, uint8_t** out, size_t* out_len,
                                            size_t* width, size_t* height, size_t* stride) {
     ESP_LOGD(TAG, "Decoding JPEG with hardware decoder");
@@ -240,7 +240,129 @@ jpeg_hw_dec_failed:
     *stride = 0;
     return ret;
 }
-#endif  // CONFIG_XIAOZHI_ENABLE_HARDWARE_JPEG_DECODER
+#endif  // CONFIG_SOC_JPEG_DECODE_SUPPORTED
+
+// The smallest integer factor that brings the image within the bounds
+static size_t fit_factor(size_t width, size_t height, size_t max_width, size_t max_height) {
+    size_t factor = 1;
+    if (max_width > 0 && width > max_width) {
+        factor = MAX(factor, (width + max_width - 1) / max_width);
+    }
+    if (max_height > 0 && height > max_height) {
+        factor = MAX(factor, (height + max_height - 1) / max_height);
+    }
+    return factor;
+}
+
+// Takes every factor-th pixel of every factor-th line, the lines of src start at line src_y of the image
+static void downscale_lines(const uint8_t* src, size_t src_stride, size_t src_y, size_t lines, size_t factor,
+                            uint8_t* dst, size_t dst_width, size_t dst_height) {
+    size_t y = (src_y + factor - 1) / factor * factor;
+    for (; y < src_y + lines && y / factor < dst_height; y += factor) {
+        const uint16_t* src_line = (const uint16_t*)(src + (y - src_y) * src_stride);
+        uint16_t* dst_line = (uint16_t*)(dst + (y / factor) * dst_width * 2);
+        for (size_t x = 0; x < dst_width; x++) {
+            dst_line[x] = src_line[x * factor];
+        }
+    }
+}
+
+static esp_err_t decode_fit_with_new_jpeg(const uint8_t* src, size_t src_len, size_t max_width, size_t max_height,
+                                          uint8_t** out, size_t* out_len, size_t* width, size_t* height,
+                                          size_t* stride) {
+    ESP_LOGD(TAG, "Decoding JPEG in strips with software decoder");
+    esp_err_t ret = ESP_OK;
+    jpeg_error_t jpeg_ret = JPEG_ERR_OK;
+    uint8_t* strip = NULL;
+    uint8_t* out_buf = NULL;
+    jpeg_dec_io_t jpeg_io = {0};
+    jpeg_dec_header_info_t out_info = {0};
+
+    jpeg_dec_config_t config = DEFAULT_JPEG_DEC_CONFIG();
+    config.output_type = JPEG_PIXEL_FORMAT_RGB565_LE;
+    config.rotate = JPEG_ROTATE_0D;
+    config.block_enable = true;
+
+    jpeg_dec_handle_t jpeg_dec = NULL;
+    jpeg_ret = jpeg_dec_open(&config, &jpeg_dec);
+    if (jpeg_ret != JPEG_ERR_OK) {
+        ESP_LOGE(TAG, "Failed to open JPEG decoder");
+        ret = ESP_FAIL;
+        goto jpeg_fit_failed;
+    }
+
+    jpeg_io.inbuf = (uint8_t*)src;
+    jpeg_io.inbuf_len = (int)src_len;
+
+    jpeg_ret = jpeg_dec_parse_header(jpeg_dec, &jpeg_io, &out_info);
+    if (jpeg_ret != JPEG_ERR_OK) {
+        ESP_LOGE(TAG, "Failed to parse JPEG header");
+        ret = ESP_ERR_INVALID_ARG;
+        goto jpeg_fit_failed;
+    }
+
+    int strip_len = 0;
+    int strip_count = 0;
+    if (jpeg_dec_get_outbuf_len(jpeg_dec, &strip_len) != JPEG_ERR_OK ||
+        jpeg_dec_get_process_count(jpeg_dec, &strip_count) != JPEG_ERR_OK || strip_len <= 0) {
+        ESP_LOGE(TAG, "Failed to get the JPEG strip size");
+        ret = ESP_FAIL;
+        goto jpeg_fit_failed;
+    }
+
+    size_t src_stride = (size_t)out_info.width * 2;
+    size_t strip_lines = (size_t)strip_len / src_stride;
+    size_t factor = fit_factor(out_info.width, out_info.height, max_width, max_height);
+    size_t dst_width = MAX(out_info.width / factor, 1);
+    size_t dst_height = MAX(out_info.height / factor, 1);
+    ESP_LOGD(TAG, "JPEG %dx%d in %d strips of %zu lines, scaled down by %zu", out_info.width, out_info.height,
+             strip_count, strip_lines, factor);
+
+    strip = jpeg_calloc_align(strip_len, 16);
+    out_buf = (uint8_t*)heap_caps_malloc(dst_width * dst_height * 2, MALLOC_CAP_8BIT);
+    if (strip == NULL || out_buf == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate memory for JPEG output buffer");
+        ret = ESP_ERR_NO_MEM;
+        goto jpeg_fit_failed;
+    }
+
+    for (int i = 0; i < strip_count; i++) {
+        jpeg_io.outbuf = strip;
+        jpeg_ret = jpeg_dec_process(jpeg_dec, &jpeg_io);
+        if (jpeg_ret != JPEG_ERR_OK) {
+            ESP_LOGE(TAG, "Failed to decode JPEG strip %d", i);
+            ret = ESP_FAIL;
+            goto jpeg_fit_failed;
+        }
+        downscale_lines(strip, src_stride, i * strip_lines, strip_lines, factor, out_buf, dst_width, dst_height);
+    }
+
+    jpeg_free_align(strip);
+    jpeg_dec_close(jpeg_dec);
+    *out = out_buf;
+    *out_len = dst_width * dst_height * 2;
+    *width = dst_width;
+    *height = dst_height;
+    *stride = dst_width * 2;
+    return ESP_OK;
+
+jpeg_fit_failed:
+    if (jpeg_dec) {
+        jpeg_dec_close(jpeg_dec);
+    }
+    if (strip) {
+        jpeg_free_align(strip);
+    }
+    if (out_buf) {
+        heap_caps_free(out_buf);
+    }
+    *out = NULL;
+    *out_len = 0;
+    *width = 0;
+    *height = 0;
+    *stride = 0;
+    return ret;
+}
 
 esp_err_t jpeg_to_image(const uint8_t* src, size_t src_len, uint8_t** out, size_t* out_len, size_t* width,
                         size_t* height, size_t* stride) {
@@ -262,3 +384,211 @@ esp_err_t jpeg_to_image(const uint8_t* src, size_t src_len, uint8_t** out, size_
 #endif
     return decode_with_new_jpeg(src, src_len, out, out_len, width, height, stride);
 }
+
+esp_err_t jpeg_to_image_fit(const uint8_t* src, size_t src_len, size_t max_width, size_t max_height, uint8_t** out,
+                            size_t* out_len, size_t* width, size_t* height, size_t* stride) {
+    if (src == NULL || src_len == 0 || out == NULL || out_len == NULL || width == NULL || height == NULL ||
+        stride == NULL) {
+        ESP_LOGE(TAG, "Invalid parameters");
+        return ESP_ERR_INVALID_ARG;
+    }
+#if CONFIG_SOC_JPEG_DECODE_SUPPORTED
+    esp_err_t ret = decode_with_hardware_jpeg(src, src_len, out, out_len, width, height, stride);
+    if (ret == ESP_OK) {
+        // The lines only move back, so the image is scaled down in its own buffer
+        size_t factor = fit_factor(*width, *height, max_width, max_height);
+        if (factor > 1) {
+            size_t dst_width = MAX(*width / factor, 1);
+            size_t dst_height = MAX(*height / factor, 1);
+            for (size_t y = 0; y < dst_height; y++) {
+                downscale_lines(*out + y * factor * *stride, *stride, y * factor, 1, factor, *out, dst_width,
+                                dst_height);
+            }
+            *width = dst_width;
+            *height = dst_height;
+            *stride = dst_width * 2;
+            *out_len = dst_width * dst_height * 2;
+        }
+        return ret;
+    }
+    ESP_LOGW(TAG, "Failed to decode with hardware JPEG, fallback to software decoder");
+#endif
+    return decode_fit_with_new_jpeg(src, src_len, max_width, max_height, out, out_len, width, height, stride);
+}
+
+struct jpeg_progressive {
+    jpeg_dec_handle_t dec;
+    jpeg_dec_io_t io;
+    const uint8_t* src;
+    size_t src_len;
+    size_t header_len;
+    uint8_t* strip;
+    size_t src_stride;
+    size_t strip_lines;
+    size_t margin;
+    int strip_count;
+    int next_strip;
+    size_t factor;
+    uint8_t* out;
+    size_t out_width;
+    size_t out_height;
+};
+
+// The length of the segments up to the scan data, 0 while they have not all arrived
+static size_t header_length(const uint8_t* src, size_t available, bool* progressive) {
+    size_t pos = 2;
+    while (pos + 4 <= available) {
+        if (src[pos] != 0xFF) {
+            return 0;
+        }
+        uint8_t marker = src[pos + 1];
+        if (marker == 0xFF) {
+            pos++;  // Fill byte
+            continue;
+        }
+        if (marker == 0xC2) {
+            *progressive = true;
+        }
+        size_t len = ((size_t)src[pos + 2] << 8) | src[pos + 3];
+        if (marker == 0xDA) {
+            return pos + 2 + len <= available ? pos + 2 + len : 0;
+        }
+        pos += 2 + len;
+    }
+    return 0;
+}
+
+esp_err_t jpeg_progressive_open(const uint8_t* src, size_t available, size_t src_len, size_t max_width,
+                                size_t max_height, jpeg_progressive_t* handle, uint8_t** out, size_t* out_len,
+                                size_t* width, size_t* height, size_t* stride) {
+    if (src == NULL || src_len == 0 || available > src_len || handle == NULL || out == NULL || out_len == NULL ||
+        width == NULL || height == NULL || stride == NULL) {
+        ESP_LOGE(TAG, "Invalid parameters");
+        return ESP_ERR_INVALID_ARG;
+    }
+    *handle = NULL;
+    *out = NULL;
+    if (available < 2 || src[0] != 0xFF || src[1] != 0xD8) {
+        return available < 2 ? ESP_ERR_NOT_FINISHED : ESP_ERR_INVALID_ARG;
+    }
+    bool progressive = false;
+    size_t header_len = header_length(src, available, &progressive);
+    if (progressive) {
+        // Progressive JPEGs only show once they are complete
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (header_len == 0) {
+        return available < src_len ? ESP_ERR_NOT_FINISHED : ESP_ERR_INVALID_ARG;
+    }
+
+    struct jpeg_progressive* p = (struct jpeg_progressive*)heap_caps_calloc(1, sizeof(*p), MALLOC_CAP_8BIT);
+    if (p == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t ret = ESP_FAIL;
+    jpeg_dec_header_info_t info = {0};
+    jpeg_dec_config_t config = DEFAULT_JPEG_DEC_CONFIG();
+    config.output_type = JPEG_PIXEL_FORMAT_RGB565_LE;
+    config.rotate = JPEG_ROTATE_0D;
+    config.block_enable = true;
+    if (jpeg_dec_open(&config, &p->dec) != JPEG_ERR_OK) {
+        ESP_LOGE(TAG, "Failed to open JPEG decoder");
+        goto progressive_failed;
+    }
+    // The decoder gets the whole buffer, the strips are only decoded once their data is likely in
+    p->io.inbuf = (uint8_t*)src;
+    p->io.inbuf_len = (int)src_len;
+    if (jpeg_dec_parse_header(p->dec, &p->io, &info) != JPEG_ERR_OK) {
+        ESP_LOGE(TAG, "Failed to parse JPEG header");
+        ret = ESP_ERR_INVALID_ARG;
+        goto progressive_failed;
+    }
+    int strip_len = 0;
+    if (jpeg_dec_get_outbuf_len(p->dec, &strip_len) != JPEG_ERR_OK ||
+        jpeg_dec_get_process_count(p->dec, &p->strip_count) != JPEG_ERR_OK || strip_len <= 0 ||
+        p->strip_count <= 0) {
+        ESP_LOGE(TAG, "Failed to get the JPEG strip size");
+        goto progressive_failed;
+    }
+
+    p->src = src;
+    p->src_len = src_len;
+    p->header_len = header_len;
+    p->src_stride = (size_t)info.width * 2;
+    p->strip_lines = (size_t)strip_len / p->src_stride;
+    // The entropy coded data of a strip hardly ever exceeds its RGB888 size
+    p->margin = (size_t)info.width * p->strip_lines * 3;
+    p->factor = fit_factor(info.width, info.height, max_width, max_height);
+    p->out_width = MAX(info.width / p->factor, 1);
+    p->out_height = MAX(info.height / p->factor, 1);
+    p->strip = jpeg_calloc_align(strip_len, 16);
+    p->out = (uint8_t*)heap_caps_calloc(p->out_width * p->out_height, 2, MALLOC_CAP_8BIT);
+    if (p->strip == NULL || p->out == NULL) {
+        ESP_LOGE(TAG, "Failed to allocate memory for JPEG output buffer");
+        ret = ESP_ERR_NO_MEM;
+        goto progressive_failed;
+    }
+    ESP_LOGD(TAG, "Progressive JPEG %dx%d in %d strips of %zu lines, scaled down by %zu", info.width, info.height,
+             p->strip_count, p->strip_lines, p->factor);
+
+    *handle = p;
+    *out = p->out;
+    *out_len = p->out_width * p->out_height * 2;
+    *width = p->out_width;
+    *height = p->out_height;
+    *stride = p->out_width * 2;
+    return ESP_OK;
+
+progressive_failed:
+    if (p->out) {
+        heap_caps_free(p->out);
+    }
+    p->out = NULL;
+    jpeg_progressive_close(p);
+    return ret;
+}
+
+esp_err_t jpeg_progressive_feed(jpeg_progressive_t p, size_t available, jpeg_progressive_band_cb cb, void* arg) {
+    while (p->next_strip < p->strip_count) {
+        if (available < p->src_len) {
+            // Where the decoder says it is, or where the strip would end with evenly spread data
+            size_t consumed = p->src_len - MIN((size_t)MAX(p->io.inbuf_remain, 0), p->src_len);
+            size_t estimate = p->header_len + (p->src_len - p->header_len) * (p->next_strip + 1) / p->strip_count;
+            if (available < MAX(consumed, estimate) + p->margin) {
+                break;
+            }
+        }
+        p->io.outbuf = p->strip;
+        if (jpeg_dec_process(p->dec, &p->io) != JPEG_ERR_OK) {
+            ESP_LOGE(TAG, "Failed to decode JPEG strip %d", p->next_strip);
+            return ESP_FAIL;
+        }
+        size_t src_y = (size_t)p->next_strip * p->strip_lines;
+        downscale_lines(p->strip, p->src_stride, src_y, p->strip_lines, p->factor, p->out, p->out_width,
+                        p->out_height);
+        p->next_strip++;
+        size_t first = (src_y + p->factor - 1) / p->factor;
+        size_t end = MIN((src_y + p->strip_lines + p->factor - 1) / p->factor, p->out_height);
+        if (cb != NULL && end > first) {
+            cb(arg, first, end - first);
+        }
+    }
+    return ESP_OK;
+}
+
+bool jpeg_progressive_done(jpeg_progressive_t p) {
+    return p->next_strip >= p->strip_count;
+}
+
+void jpeg_progressive_close(jpeg_progressive_t p) {
+    if (p == NULL) {
+        return;
+    }
+    if (p->dec) {
+        jpeg_dec_close(p->dec);
+    }
+    if (p->strip) {
+        jpeg_free_align(p->strip);
+    }
+    heap_caps_free(p);
+}
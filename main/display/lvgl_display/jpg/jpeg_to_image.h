@@ -2,6 +2,9 @@
 #ifndef CONFIG_IDF_TARGET_ESP32
 
 #include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -55,6 +58,71 @@ extern "C" {
 esp_err_t jpeg_to_image(const uint8_t* src, size_t src_len, uint8_t** out, size_t* out_len, size_t* width,
                         size_t* height, size_t* stride);
 
+/**
+ * @brief Decodes a JPEG image to RGB565 that fits within the given bounds
+ *
+ * The image is scaled down by the smallest integer factor that fits it, keeping its aspect ratio.
+ * Where a hardware JPEG decoder exists the image is decoded by it and scaled down in place.
+ * Otherwise the software decoder decodes one MCU row at a time into a small strip buffer and
+ * only the sampled pixels are copied out, so no buffer of the full source size is needed.
+ *
+ * @param[in] src Pointer to the JPEG bitstream in memory
+ * @param[in] src_len Length of the JPEG bitstream in bytes
+ * @param[in] max_width Largest width of the decoded image, 0 for no limit
+ * @param[in] max_height Largest height of the decoded image, 0 for no limit
+ * @param[out] out Set to the decoded image, which the caller frees with heap_caps_free()
+ * @param[out] out_len Size of the decoded image in bytes
+ * @param[out] width Width of the decoded image in pixels
+ * @param[out] height Height of the decoded image in pixels
+ * @param[out] stride Stride of the decoded image in bytes
+ *
+ * @return The same codes as jpeg_to_image(), `*out` is NULL on failure
+ */
+esp_err_t jpeg_to_image_fit(const uint8_t* src, size_t src_len, size_t max_width, size_t max_height, uint8_t** out,
+                            size_t* out_len, size_t* width, size_t* height, size_t* stride);
+
+typedef struct jpeg_progressive* jpeg_progressive_t;
+
+// Lines [y, y + lines) of the decoded image are ready
+typedef void (*jpeg_progressive_band_cb)(void* arg, size_t y, size_t lines);
+
+/**
+ * @brief Opens a decoder that decodes a JPEG while it downloads, as jpeg_to_image_fit() would
+ *
+ * The bitstream arrives in a buffer of its full length, zeroed beyond what has arrived so far.
+ * The software decoder decodes one MCU row at a time, as soon as its data is likely to be in.
+ *
+ * @param[in] src The buffer of the bitstream, src_len bytes long
+ * @param[in] available The bytes of src that have arrived
+ * @param[in] src_len Length of the whole bitstream in bytes
+ * @param[in] max_width Largest width of the decoded image, 0 for no limit
+ * @param[in] max_height Largest height of the decoded image, 0 for no limit
+ * @param[out] handle Set to the decoder, closed with jpeg_progressive_close()
+ * @param[out] out Set to the image, black until it is decoded. The caller frees it with heap_caps_free(),
+ *             after jpeg_progressive_close()
+ * @param[out] out_len Size of the image in bytes
+ * @param[out] width Width of the image in pixels
+ * @param[out] height Height of the image in pixels
+ * @param[out] stride Stride of the image in bytes
+ *
+ * @return ESP_OK on success
+ * @return ESP_ERR_NOT_FINISHED while the headers have not all arrived, call again with more data
+ * @return ESP_ERR_NOT_SUPPORTED for a progressive JPEG, which can only be decoded once it is complete
+ * @return The other codes of jpeg_to_image() on failure
+ */
+esp_err_t jpeg_progressive_open(const uint8_t* src, size_t available, size_t src_len, size_t max_width,
+                                size_t max_height, jpeg_progressive_t* handle, uint8_t** out, size_t* out_len,
+                                size_t* width, size_t* height, size_t* stride);
+
+// Decodes the MCU rows that the available bytes allow, the callback gets each band of the image
+esp_err_t jpeg_progressive_feed(jpeg_progressive_t handle, size_t available, jpeg_progressive_band_cb cb, void* arg);
+
+// True once the whole image is decoded
+bool jpeg_progressive_done(jpeg_progressive_t handle);
+
+// Closes the decoder, the image stays with the caller
+void jpeg_progressive_close(jpeg_progressive_t handle);
+
 #ifdef __cplusplus
 }
 #endif
@@ -12,6 +12,12 @@
 #include "settings.h"
 #include "assets/lang_config.h"
 #include "jpg/image_to_jpeg.h"
+#include "trace_markers.h"
+
+#if CONFIG_LV_USE_SNAPSHOT
+#include <lvgl_private.h>
+#endif
+#include <algorithm>
 
 #define TAG "Display"
 
@@ -74,10 +80,14 @@ void LvglDisplay::SetStatus(const char* status) {
     if (status_label_ == nullptr) {
         return;
     }
-    lv_label_set_text(status_label_, status);
+    // The same text is not set again, setting it redraws the label
+    if (strcmp(lv_label_get_text(status_label_), status) != 0) {
+        lv_label_set_text(status_label_, status);
+    }
     lv_obj_remove_flag(status_label_, LV_OBJ_FLAG_HIDDEN);
     lv_obj_add_flag(notification_label_, LV_OBJ_FLAG_HIDDEN);
 
+    clock_minute_ = -1;
     last_status_update_time_ = std::chrono::system_clock::now();
 }
 
@@ -98,45 +108,48 @@ void LvglDisplay::ShowNotification(const char* notification, int duration_ms) {
     ESP_ERROR_CHECK(esp_timer_start_once(notification_timer_, duration_ms * 1000));
 }
 
+/*
+ * Called every second, and with update_all when the board or the network publish a change.
+ * The labels are only set when what they show changes, so an idle status bar redraws nothing
+ * but the clock once a minute.
+ */
 void LvglDisplay::UpdateStatusBar(bool update_all) {
     auto& app = Application::GetInstance();
     auto& board = Board::GetInstance();
     auto codec = board.GetAudioCodec();
+    if (mute_label_ == nullptr) {
+        return;
+    }
 
     // Update mute icon
-    {
+    bool muted = codec->output_volume() == 0;
+    if (muted != muted_) {
         DisplayLockGuard lock(this);
-        if (mute_label_ == nullptr) {
-            return;
-        }
-
-        // Update icon if mute state changes
-        if (codec->output_volume() == 0 && !muted_) {
-            muted_ = true;
-            lv_label_set_text(mute_label_, FONT_AWESOME_VOLUME_XMARK);
-        } else if (codec->output_volume() > 0 && muted_) {
-            muted_ = false;
-            lv_label_set_text(mute_label_, "");
-        }
+        muted_ = muted;
+        lv_label_set_text(mute_label_, muted_ ? FONT_AWESOME_VOLUME_XMARK : "");
     }
 
-    // Update time
-    if (app.GetDeviceState() == kDeviceStateIdle) {
-        if (last_status_update_time_ + std::chrono::seconds(10) < std::chrono::system_clock::now()) {
+    // Update time, a while after the last status was shown
+    if (app.GetDeviceState() == kDeviceStateIdle && last_status_update_time_ + std::chrono::seconds(10) < std::chrono::system_clock::now()) {
+        time_t now = time(NULL);
+        struct tm* tm = localtime(&now);
+        int minute = tm->tm_hour * 60 + tm->tm_min;
+        // Check if the we have already set the time
+        if (tm->tm_year < 2025 - 1900) {
+            ESP_LOGD(TAG, "System time is not set, tm_year: %d", tm->tm_year);
+        } else if (minute != clock_minute_) {
             // Set status to clock "HH:MM"
-            time_t now = time(NULL);
-            struct tm* tm = localtime(&now);
-            // Check if the we have already set the time
-            if (tm->tm_year >= 2025 - 1900) {
-                char time_str[16];
-                strftime(time_str, sizeof(time_str), "%H:%M", tm);
-                SetStatus(time_str);
-            } else {
-                ESP_LOGW(TAG, "System time is not set, tm_year: %d", tm->tm_year);
-            }
+            char time_str[16];
+            strftime(time_str, sizeof(time_str), "%H:%M", tm);
+            SetStatus(time_str);
+            clock_minute_ = minute;
         }
     }
 
+    if (!update_all && status_bar_updates_++ % STATUS_BAR_POLL_INTERVAL != 0) {
+        return;
+    }
+
     esp_pm_lock_acquire(pm_lock_);
     // Update battery icon
     int battery_level;
@@ -156,46 +169,42 @@ void LvglDisplay::UpdateStatusBar(bool update_all) {
             };
             icon = levels[battery_level / 20];
         }
-        DisplayLockGuard lock(this);
-        if (battery_label_ != nullptr && battery_icon_ != icon) {
-            battery_icon_ = icon;
-            lv_label_set_text(battery_label_, battery_icon_);
-        }
+        bool low_battery = strcmp(icon, FONT_AWESOME_BATTERY_EMPTY) == 0 && discharging;
+        if (battery_icon_ != icon || (low_battery_popup_ != nullptr && low_battery_shown_ != low_battery)) {
+            DisplayLockGuard lock(this);
+            if (battery_label_ != nullptr && battery_icon_ != icon) {
+                battery_icon_ = icon;
+                lv_label_set_text(battery_label_, battery_icon_);
+            }
 
-        if (low_battery_popup_ != nullptr) {
-            if (strcmp(icon, FONT_AWESOME_BATTERY_EMPTY) == 0 && discharging) {
-                if (lv_obj_has_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN)) { // Show if low battery popup is hidden
+            if (low_battery_popup_ != nullptr && low_battery_shown_ != low_battery) {
+                low_battery_shown_ = low_battery;
+                if (low_battery) {
                     lv_obj_remove_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
-                    app.PlaySound(Lang::Sounds::OGG_LOW_BATTERY);
-                }
-            } else {
-                // Hide the low battery popup when the battery is not empty
-                if (!lv_obj_has_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN)) { // Hide if low battery popup is shown
+                    app.PlaySound(Lang::Sounds::OGG_LOW_BATTERY, kSoundPriorityMix);
+                } else {
+                    // Hide the low battery popup when the battery is not empty
                     lv_obj_add_flag(low_battery_popup_, LV_OBJ_FLAG_HIDDEN);
                 }
             }
         }
     }
 
-    // Update network icon every 10 seconds
-    static int seconds_counter = 0;
-    if (update_all || seconds_counter++ % 10 == 0) {
-        // Don't read 4G network status during firmware upgrade to avoid occupying UART resources
-        auto device_state = Application::GetInstance().GetDeviceState();
-        static const std::vector<DeviceState> allowed_states = {
-            kDeviceStateIdle,
-            kDeviceStateStarting,
-            kDeviceStateWifiConfiguring,
-            kDeviceStateListening,
-            kDeviceStateActivating,
-        };
-        if (std::find(allowed_states.begin(), allowed_states.end(), device_state) != allowed_states.end()) {
-            icon = board.GetNetworkStateIcon();
-            if (network_label_ != nullptr && icon != nullptr && network_icon_ != icon) {
-                DisplayLockGuard lock(this);
-                network_icon_ = icon;
-                lv_label_set_text(network_label_, network_icon_);
-            }
+    // Don't read 4G network status during firmware upgrade to avoid occupying UART resources
+    auto device_state = app.GetDeviceState();
+    static const std::vector<DeviceState> allowed_states = {
+        kDeviceStateIdle,
+        kDeviceStateStarting,
+        kDeviceStateWifiConfiguring,
+        kDeviceStateListening,
+        kDeviceStateActivating,
+    };
+    if (std::find(allowed_states.begin(), allowed_states.end(), device_state) != allowed_states.end()) {
+        icon = board.GetNetworkStateIcon();
+        if (network_label_ != nullptr && icon != nullptr && network_icon_ != icon) {
+            DisplayLockGuard lock(this);
+            network_icon_ = icon;
+            lv_label_set_text(network_label_, network_icon_);
         }
     }
 
@@ -213,42 +222,155 @@ void LvglDisplay::SetPowerSaveMode(bool on) {
         SetChatMessage("system", "");
         SetEmotion("neutral");
     }
+    power_save_ = on;
+    UpdateRefreshLevel();
+}
+
+void LvglDisplay::SetInteractive(bool interactive) {
+    interactive_ = interactive;
+    UpdateRefreshLevel();
+}
+
+void LvglDisplay::UpdateRefreshLevel() {
+    DisplayLockGuard lock(this);
+    if (power_save_) {
+        refresh_governor_.SetLevel(kRefreshPowerSave);
+    } else {
+        refresh_governor_.SetLevel(interactive_ ? kRefreshActive : kRefreshIdle);
+    }
+}
+
+/* From the flush call until LVGL finds the panel done with it, the end of the DMA transfer */
+void LvglDisplay::AttachTraceMarkers() {
+#if CONFIG_TRACE_MARKERS
+    static bool flushing = false;
+    lv_display_add_event_cb(display_, [](lv_event_t* e) {
+        if (!flushing) {
+            flushing = true;
+            TRACE_BEGIN(kTraceLvglFlush);
+        }
+    }, LV_EVENT_FLUSH_START, nullptr);
+    lv_display_add_event_cb(display_, [](lv_event_t* e) {
+        if (flushing) {
+            flushing = false;
+            TRACE_END(kTraceLvglFlush);
+        }
+    }, LV_EVENT_FLUSH_WAIT_FINISH, nullptr);
+#endif
 }
 
 bool LvglDisplay::SnapshotToJpeg(std::string& jpeg_data, int quality) {
+    jpeg_data.clear();
+    return SnapshotToJpeg([&jpeg_data](const void* data, size_t size) {
+        jpeg_data.append(static_cast<const char*>(data), size);
+        return true;
+    }, quality);
+}
+
 #if CONFIG_LV_USE_SNAPSHOT
-    DisplayLockGuard lock(this);
+// Renders the lines of the screen the draw buffer covers, the way lv_snapshot_take_to_draw_buf() renders all of them
+static void RenderScreenLines(lv_obj_t* screen, lv_draw_buf_t* draw_buffer, int32_t y1) {
+    lv_area_t area;
+    lv_obj_get_coords(screen, &area);
+    area.y1 += y1;
+    area.y2 = std::min<int32_t>(area.y1 + draw_buffer->header.h - 1, area.y2);
+    lv_area_t buffer_area = area;
+    buffer_area.y2 = buffer_area.y1 + draw_buffer->header.h - 1;
+    lv_draw_buf_clear(draw_buffer, nullptr);
+
+    lv_layer_t layer;
+    lv_layer_init(&layer);
+    layer.draw_buf = draw_buffer;
+    layer.buf_area = buffer_area;
+    layer.color_format = draw_buffer->header.cf;
+    layer._clip_area = area;
+    layer.phy_clip_area = area;
+
+    lv_display_t* display = lv_obj_get_display(screen);
+    lv_display_t* refreshing = lv_refr_get_disp_refreshing();
+    lv_layer_t* layer_head = display->layer_head;
+    display->layer_head = &layer;
+    lv_refr_set_disp_refreshing(display);
+    lv_obj_redraw(&layer, screen);
+    while (layer.draw_task_head != nullptr) {
+        lv_draw_dispatch_wait_for_request();
+        lv_draw_dispatch();
+    }
+    display->layer_head = layer_head;
+    lv_refr_set_disp_refreshing(refreshing);
+}
 
-    lv_obj_t* screen = lv_screen_active();
-    lv_draw_buf_t* draw_buffer = lv_snapshot_take(screen, LV_COLOR_FORMAT_RGB565);
+static size_t ForwardJpeg(void* arg, size_t index, const void* data, size_t len) {
+    auto callback = static_cast<std::function<bool(const void*, size_t)>*>(arg);
+    if (data && len > 0 && !(*callback)(data, len)) {
+        return 0;
+    }
+    return len;
+}
+
+// Renders and encodes a band at a time, the memory in use does not grow with the screen
+static bool SnapshotToJpegInBands(Display* display, image_to_jpeg_stream_t stream, uint16_t lines, std::function<bool(const void* data, size_t size)>& callback) {
+    lv_draw_buf_t* draw_buffer = nullptr;
+    {
+        DisplayLockGuard lock(display);
+        draw_buffer = lv_draw_buf_create(display->width(), lines, LV_COLOR_FORMAT_RGB565, display->width() * 2);
+    }
     if (draw_buffer == nullptr) {
-        ESP_LOGE(TAG, "Failed to take snapshot, draw_buffer is nullptr");
+        ESP_LOGE(TAG, "Failed to create the snapshot band");
+        image_to_jpeg_stream_close(stream);
         return false;
     }
 
-    // swap bytes
-    uint16_t* data = (uint16_t*)draw_buffer->data;
-    size_t pixel_count = draw_buffer->data_size / 2;
-    for (size_t i = 0; i < pixel_count; i++) {
-        data[i] = __builtin_bswap16(data[i]);
+    // The lock is held only while a band renders, a screen that changes meanwhile shows in the later bands
+    bool ret = true;
+    for (int32_t y = 0; y < display->height() && ret; y += lines) {
+        {
+            DisplayLockGuard lock(display);
+            RenderScreenLines(lv_screen_active(), draw_buffer, y);
+        }
+        ret = image_to_jpeg_stream_write(stream, draw_buffer->data, ForwardJpeg, &callback);
     }
+    if (!ret) {
+        ESP_LOGE(TAG, "Failed to convert image to JPEG");
+    }
+    image_to_jpeg_stream_close(stream);
 
-    // Clear output string and use callback version to avoid pre-allocating large memory blocks
-    jpeg_data.clear();
+    DisplayLockGuard lock(display);
+    lv_draw_buf_destroy(draw_buffer);
+    return ret;
+}
+#endif
 
-    // Use callback-based JPEG encoder to further save memory
-    bool ret = image_to_jpeg_cb((uint8_t*)draw_buffer->data, draw_buffer->data_size, draw_buffer->header.w, draw_buffer->header.h, V4L2_PIX_FMT_RGB565, quality,
-        [](void *arg, size_t index, const void *data, size_t len) -> size_t {
-        std::string* output = static_cast<std::string*>(arg);
-        if (data && len > 0) {
-            output->append(static_cast<const char*>(data), len);
-        }
-        return len;
-    }, &jpeg_data);
+bool LvglDisplay::SnapshotToJpeg(std::function<bool(const void* data, size_t size)> callback, int quality) {
+#if CONFIG_LV_USE_SNAPSHOT
+    uint16_t lines = 0;
+    // Opened as RGB565X, the color conversion swaps the bytes as it reads them
+    auto stream = image_to_jpeg_stream_open(width_, height_, V4L2_PIX_FMT_RGB565X, quality, &lines);
+    if (stream != nullptr) {
+        return SnapshotToJpegInBands(this, stream, lines, callback);
+    }
+    ESP_LOGW(TAG, "Failed to open the JPEG stream, snapshot the whole screen");
+
+    lv_draw_buf_t* draw_buffer = nullptr;
+    {
+        DisplayLockGuard lock(this);
+        lv_obj_t* screen = lv_screen_active();
+        draw_buffer = lv_snapshot_take(screen, LV_COLOR_FORMAT_RGB565);
+    }
+    if (draw_buffer == nullptr) {
+        ESP_LOGE(TAG, "Failed to take snapshot, draw_buffer is nullptr");
+        return false;
+    }
+
+    // The snapshot is a copy of the screen, encode it without holding up the UI,
+    // the encoder hands out the JPEG in small pieces as it goes
+    bool ret = image_to_jpeg_cb((uint8_t*)draw_buffer->data, draw_buffer->data_size, draw_buffer->header.w, draw_buffer->header.h, V4L2_PIX_FMT_RGB565X, quality,
+        ForwardJpeg, &callback);
     if (!ret) {
         ESP_LOGE(TAG, "Failed to convert image to JPEG");
     }
 
+    DisplayLockGuard lock(this);
     lv_draw_buf_destroy(draw_buffer);
     return ret;
 #else
@@ -256,3 +378,4 @@ bool LvglDisplay::SnapshotToJpeg(std::string& jpeg_data, int quality) {
     return false;
 #endif
 }
+
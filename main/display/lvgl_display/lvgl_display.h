@@ -3,15 +3,21 @@
 
 #include "display.h"
 #include "lvgl_image.h"
+#include "refresh_governor.h"
 
 #include <lvgl.h>
 #include <esp_timer.h>
 #include <esp_log.h>
 #include <esp_pm.h>
+#include <cJSON.h>
 
 #include <string>
+#include <functional>
 #include <chrono>
 
+// The battery and the network are read every this many status bar updates, or when they publish a change
+#define STATUS_BAR_POLL_INTERVAL 10
+
 class LvglDisplay : public Display {
 public:
     LvglDisplay();
@@ -21,9 +27,16 @@ public:
     virtual void ShowNotification(const char* notification, int duration_ms = 3000);
     virtual void ShowNotification(const std::string &notification, int duration_ms = 3000);
     virtual void SetPreviewImage(std::unique_ptr<LvglImage> image);
+    // Redraws lines [y, y + lines) of the preview image after its pixels changed in place
+    virtual void InvalidatePreviewImage(int y, int lines) {}
     virtual void UpdateStatusBar(bool update_all = false);
     virtual void SetPowerSaveMode(bool on);
+    virtual void SetInteractive(bool interactive);
     virtual bool SnapshotToJpeg(std::string& jpeg_data, int quality = 80);
+    // Streams the JPEG to the callback as it is encoded, without the display lock, false from the callback aborts
+    virtual bool SnapshotToJpeg(std::function<bool(const void* data, size_t size)> callback, int quality = 80);
+    // Counters of the bytes sent to the panel, nullptr if the display does not track them. The caller owns the returned object
+    virtual cJSON* GetFlushStatsJson() { return nullptr; }
 
 protected:
     esp_pm_lock_handle_t pm_lock_ = nullptr;
@@ -40,6 +53,13 @@ protected:
     const char* battery_icon_ = nullptr;
     const char* network_icon_ = nullptr;
     bool muted_ = false;
+    bool low_battery_shown_ = false;
+    int status_bar_updates_ = 0;
+    int clock_minute_ = -1;     // The minute of the day the status label shows, -1 when it shows a status
+
+    RefreshGovernor refresh_governor_;     // Attached by the subclass once display_ is added
+    bool interactive_ = true;
+    bool power_save_ = false;
 
     std::chrono::system_clock::time_point last_status_update_time_;
     esp_timer_handle_t notification_timer_ = nullptr;
@@ -47,6 +67,9 @@ protected:
     friend class DisplayLockGuard;
     virtual bool Lock(int timeout_ms = 0) = 0;
     virtual void Unlock() = 0;
+    void UpdateRefreshLevel();
+    // Marks the flushes of display_ on the SystemView timeline with CONFIG_TRACE_MARKERS
+    void AttachTraceMarkers();
 };
 
 
@@ -1,13 +1,73 @@
 #include "lvgl_font.h"
+#include "glyph_cache.h"
 #include <cbin_font.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "LvglFont"
 
 
 LvglCBinFont::LvglCBinFont(void* data) {
     font_ = cbin_font_create(static_cast<uint8_t*>(data));
+    GlyphCache::GetInstance().Attach(font_);
 }
 
 LvglCBinFont::~LvglCBinFont() {
     if (font_ != nullptr) {
+        font_->fallback = nullptr;
+        GlyphCache::GetInstance().Detach(font_);
+        cbin_font_delete(font_);
+    }
+}
+
+void LvglCBinFont::SetFallback(std::shared_ptr<LvglFont> fallback) {
+    fallback_ = fallback;
+    if (font_ != nullptr) {
+        font_->fallback = fallback_ != nullptr ? fallback_->font() : nullptr;
+    }
+}
+
+LvglLazyCBinFont::LvglLazyCBinFont(void* data, const lv_font_t* primary) : data_(data) {
+    stub_.get_glyph_dsc = GetGlyphDsc;
+    stub_.get_glyph_bitmap = GetGlyphBitmap;
+    stub_.line_height = primary->line_height;
+    stub_.base_line = primary->base_line;
+    stub_.subpx = primary->subpx;
+    stub_.underline_position = primary->underline_position;
+    stub_.underline_thickness = primary->underline_thickness;
+    stub_.user_data = this;
+}
+
+LvglLazyCBinFont::~LvglLazyCBinFont() {
+    if (font_ != nullptr) {
+        GlyphCache::GetInstance().Detach(font_);
         cbin_font_delete(font_);
     }
+}
+
+lv_font_t* LvglLazyCBinFont::Load() {
+    std::call_once(load_flag_, [this]() {
+        int64_t start_us = esp_timer_get_time();
+        font_ = cbin_font_create(static_cast<uint8_t*>(data_));
+        if (font_ == nullptr) {
+            ESP_LOGE(TAG, "Failed to load the fallback font");
+            return;
+        }
+        GlyphCache::GetInstance().Attach(font_);
+        ESP_LOGI(TAG, "Loaded the fallback font in %lld ms", (esp_timer_get_time() - start_us) / 1000);
+    });
+    return font_;
+}
+
+bool LvglLazyCBinFont::GetGlyphDsc(const lv_font_t* font, lv_font_glyph_dsc_t* glyph, uint32_t letter, uint32_t letter_next) {
+    auto self = static_cast<LvglLazyCBinFont*>(font->user_data);
+    auto loaded = self->Load();
+    return loaded != nullptr && loaded->get_glyph_dsc(loaded, glyph, letter, letter_next);
+}
+
+const void* LvglLazyCBinFont::GetGlyphBitmap(lv_font_glyph_dsc_t* glyph, lv_draw_buf_t* draw_buf) {
+    // LVGL resolved the glyph to the stub, the bitmap and its release belong to the loaded font
+    auto self = static_cast<LvglLazyCBinFont*>(glyph->resolved_font->user_data);
+    glyph->resolved_font = self->font_;
+    return self->font_->get_glyph_bitmap(glyph, draw_buf);
 }
\ No newline at end of file
@@ -2,6 +2,8 @@
 
 #include <lvgl.h>
 
+#include <memory>
+#include <mutex>
 
 class LvglFont {
 public:
@@ -25,7 +27,33 @@ public:
     LvglCBinFont(void* data);
     virtual ~LvglCBinFont();
     virtual const lv_font_t* font() const override { return font_; }
+    // LVGL looks up the glyphs the font lacks in the fallback
+    void SetFallback(std::shared_ptr<LvglFont> fallback);
 
 private:
     lv_font_t* font_;
+    std::shared_ptr<LvglFont> fallback_;
+};
+
+/*
+ * A cbin font that is only parsed when LVGL first looks a glyph up in it, for the fallback of
+ * a subset text font: the glyphs of the UI strings are in the subset, the rare characters of a
+ * chat reply load the rest of the font when one of them is drawn.
+ */
+class LvglLazyCBinFont : public LvglFont {
+public:
+    // The data stays mapped as long as the font, the metrics are those of the primary font
+    LvglLazyCBinFont(void* data, const lv_font_t* primary);
+    virtual ~LvglLazyCBinFont();
+    virtual const lv_font_t* font() const override { return &stub_; }
+
+private:
+    void* data_;
+    lv_font_t stub_ = {};
+    lv_font_t* font_ = nullptr;
+    std::once_flag load_flag_;
+
+    lv_font_t* Load();
+    static bool GetGlyphDsc(const lv_font_t* font, lv_font_glyph_dsc_t* glyph, uint32_t letter, uint32_t letter_next);
+    static const void* GetGlyphBitmap(lv_font_glyph_dsc_t* glyph, lv_draw_buf_t* draw_buf);
 };
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <lvgl.h>
+#include <memory>
 
 
 // Wrap around lv_img_dsc_t
@@ -50,4 +51,15 @@ public:
 
 private:
     lv_img_dsc_t image_dsc_;
-};
\ No newline at end of file
+};
+
+// Borrows the pixels of another buffer, e.g. a camera frame, and keeps its owner alive until the image goes
+class LvglSharedImage : public LvglImage {
+public:
+    LvglSharedImage(std::shared_ptr<void> owner, const void* data, size_t size, int width, int height, int stride, int color_format);
+    virtual const lv_img_dsc_t* image_dsc() const override { return &image_dsc_; }
+
+private:
+    std::shared_ptr<void> owner_;
+    lv_img_dsc_t image_dsc_;
+};
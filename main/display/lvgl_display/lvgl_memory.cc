@@ -0,0 +1,304 @@
+#include "lvgl_memory.h"
+#include "heap_monitor.h"
+#include "perf_counters.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <multi_heap.h>
+#include <lvgl.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+#define TAG "LvglMemory"
+
+// A slab page is taken by one size class the first time the class runs out, and kept by it
+#define LVGL_MEMORY_SLAB_PAGE_SIZE 2048
+#define LVGL_MEMORY_SLAB_MAX_SIZE 256
+#define LVGL_MEMORY_UNASSIGNED 0xFF
+
+#if CONFIG_LV_USE_CUSTOM_MALLOC
+
+#ifndef CONFIG_LVGL_PSRAM_POOL_KB
+#define CONFIG_LVGL_PSRAM_POOL_KB 0
+#endif
+
+static const uint16_t kSlabClasses[] = {16, 32, 64, 128, 256};
+static constexpr int kSlabClassCount = sizeof(kSlabClasses) / sizeof(kSlabClasses[0]);
+
+struct SlabBlock {
+    SlabBlock* next;
+};
+
+static struct {
+    std::mutex mutex;
+    // The slabs
+    uint8_t* arena = nullptr;
+    size_t arena_pages = 0;
+    size_t pages_taken = 0;
+    uint8_t* page_class = nullptr;
+    SlabBlock* free_blocks[kSlabClassCount] = {};
+    uint32_t used_blocks[kSlabClassCount] = {};
+    uint32_t pages_of_class[kSlabClassCount] = {};
+    // The TLSF heap
+    uint8_t* pool = nullptr;
+    size_t pool_size = 0;
+    multi_heap_handle_t heap = nullptr;
+    // Out of the pools
+    uint32_t fallbacks = 0;
+    size_t fallback_bytes = 0;      // Allocated in all, they are not told apart when freed
+    PerfCounter* fallback_counter = nullptr;
+} s_memory;
+
+static int SlabClassOf(size_t size) {
+    for (int i = 0; i < kSlabClassCount; i++) {
+        if (size <= kSlabClasses[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static bool InArena(const void* p) {
+    auto data = static_cast<const uint8_t*>(p);
+    return s_memory.arena != nullptr && data >= s_memory.arena
+        && data < s_memory.arena + s_memory.arena_pages * LVGL_MEMORY_SLAB_PAGE_SIZE;
+}
+
+static bool InPool(const void* p) {
+    auto data = static_cast<const uint8_t*>(p);
+    return s_memory.heap != nullptr && data >= s_memory.pool && data < s_memory.pool + s_memory.pool_size;
+}
+
+// Called with the mutex held
+static void* SlabAlloc(size_t size) {
+    int slab_class = SlabClassOf(size);
+    if (slab_class < 0 || s_memory.arena == nullptr) {
+        return nullptr;
+    }
+    if (s_memory.free_blocks[slab_class] == nullptr) {
+        if (s_memory.pages_taken == s_memory.arena_pages) {
+            return nullptr;
+        }
+        size_t page = s_memory.pages_taken++;
+        s_memory.page_class[page] = slab_class;
+        s_memory.pages_of_class[slab_class]++;
+        uint8_t* start = s_memory.arena + page * LVGL_MEMORY_SLAB_PAGE_SIZE;
+        size_t block_size = kSlabClasses[slab_class];
+        for (size_t offset = 0; offset + block_size <= LVGL_MEMORY_SLAB_PAGE_SIZE; offset += block_size) {
+            auto block = reinterpret_cast<SlabBlock*>(start + offset);
+            block->next = s_memory.free_blocks[slab_class];
+            s_memory.free_blocks[slab_class] = block;
+        }
+    }
+    auto block = s_memory.free_blocks[slab_class];
+    s_memory.free_blocks[slab_class] = block->next;
+    s_memory.used_blocks[slab_class]++;
+    return block;
+}
+
+// The block size of a slab pointer
+static size_t SlabBlockSize(const void* p) {
+    size_t page = (static_cast<const uint8_t*>(p) - s_memory.arena) / LVGL_MEMORY_SLAB_PAGE_SIZE;
+    return kSlabClasses[s_memory.page_class[page]];
+}
+
+static void SlabFree(void* p) {
+    size_t page = (static_cast<uint8_t*>(p) - s_memory.arena) / LVGL_MEMORY_SLAB_PAGE_SIZE;
+    int slab_class = s_memory.page_class[page];
+    auto block = static_cast<SlabBlock*>(p);
+    block->next = s_memory.free_blocks[slab_class];
+    s_memory.free_blocks[slab_class] = block;
+    s_memory.used_blocks[slab_class]--;
+}
+
+static void* FallbackAlloc(size_t size) {
+    void* p = heap_caps_malloc(size, MALLOC_CAP_8BIT);
+    if (p != nullptr) {
+        s_memory.fallbacks++;
+        s_memory.fallback_bytes += size;
+        if (s_memory.fallback_counter != nullptr) {
+            s_memory.fallback_counter->Add();
+        }
+    }
+    return p;
+}
+
+void lv_mem_init(void) {
+    std::lock_guard<std::mutex> lock(s_memory.mutex);
+    s_memory.fallback_counter = PerfCounters::GetInstance().Counter("lvgl.pool_fallbacks");
+
+    size_t arena_size = CONFIG_LVGL_SLAB_POOL_KB * 1024;
+    if (arena_size > 0) {
+        s_memory.arena = (uint8_t*)HeapMonitor::GetInstance().Malloc(kHeapTagDisplay, arena_size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        if (s_memory.arena != nullptr) {
+            s_memory.arena_pages = arena_size / LVGL_MEMORY_SLAB_PAGE_SIZE;
+            s_memory.page_class = new uint8_t[s_memory.arena_pages];
+            memset(s_memory.page_class, LVGL_MEMORY_UNASSIGNED, s_memory.arena_pages);
+        } else {
+            ESP_LOGW(TAG, "Failed to allocate the slabs of %u KB", arena_size / 1024);
+        }
+    }
+
+    size_t pool_size = CONFIG_LVGL_PSRAM_POOL_KB * 1024;
+    if (pool_size > 0) {
+        s_memory.pool = (uint8_t*)HeapMonitor::GetInstance().Malloc(kHeapTagDisplay, pool_size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (s_memory.pool != nullptr) {
+            s_memory.heap = multi_heap_register(s_memory.pool, pool_size);
+            s_memory.pool_size = pool_size;
+        }
+        if (s_memory.heap == nullptr) {
+            ESP_LOGW(TAG, "Failed to create the PSRAM pool of %u KB", pool_size / 1024);
+        }
+    }
+    ESP_LOGI(TAG, "LVGL memory: %u KB of slabs, %u KB of PSRAM pool",
+        s_memory.arena_pages * LVGL_MEMORY_SLAB_PAGE_SIZE / 1024, s_memory.pool_size / 1024);
+}
+
+void lv_mem_deinit(void) {
+    // The objects still allocated are freed with lv_deinit(), the pools stay for the next lv_init()
+}
+
+lv_mem_pool_t lv_mem_add_pool(void* mem, size_t bytes) {
+    (void)mem;
+    (void)bytes;
+    ESP_LOGW(TAG, "Adding pools is not supported");
+    return nullptr;
+}
+
+void lv_mem_remove_pool(lv_mem_pool_t pool) {
+    (void)pool;
+}
+
+void* lv_malloc_core(size_t size) {
+    std::lock_guard<std::mutex> lock(s_memory.mutex);
+    void* p = SlabAlloc(size);
+    if (p == nullptr && s_memory.heap != nullptr) {
+        p = multi_heap_malloc(s_memory.heap, size);
+    }
+    if (p == nullptr) {
+        p = FallbackAlloc(size);
+    }
+    return p;
+}
+
+void lv_free_core(void* p) {
+    if (p == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(s_memory.mutex);
+    if (InArena(p)) {
+        SlabFree(p);
+    } else if (InPool(p)) {
+        multi_heap_free(s_memory.heap, p);
+    } else {
+        heap_caps_free(p);
+    }
+}
+
+void* lv_realloc_core(void* p, size_t new_size) {
+    if (p == nullptr) {
+        return lv_malloc_core(new_size);
+    }
+
+    size_t old_size = 0;
+    {
+        std::lock_guard<std::mutex> lock(s_memory.mutex);
+        if (InArena(p)) {
+            old_size = SlabBlockSize(p);
+            if (new_size <= old_size) {
+                return p;
+            }
+        } else if (InPool(p)) {
+            void* resized = multi_heap_realloc(s_memory.heap, p, new_size);
+            if (resized != nullptr) {
+                return resized;
+            }
+            old_size = multi_heap_get_allocated_size(s_memory.heap, p);
+        } else {
+            return heap_caps_realloc(p, new_size, MALLOC_CAP_8BIT);
+        }
+    }
+
+    // Moves out of a slab that is too small, or out of a full pool
+    void* moved = lv_malloc_core(new_size);
+    if (moved == nullptr) {
+        return nullptr;
+    }
+    memcpy(moved, p, std::min(old_size, new_size));
+    lv_free_core(p);
+    return moved;
+}
+
+void lv_mem_monitor_core(lv_mem_monitor_t* mon_p) {
+    memset(mon_p, 0, sizeof(*mon_p));
+    std::lock_guard<std::mutex> lock(s_memory.mutex);
+    if (s_memory.heap != nullptr) {
+        multi_heap_info_t info;
+        multi_heap_get_info(s_memory.heap, &info);
+        mon_p->total_size = s_memory.pool_size;
+        mon_p->free_size = info.total_free_bytes;
+        mon_p->free_biggest_size = info.largest_free_block;
+        mon_p->free_cnt = info.free_blocks;
+        mon_p->used_cnt = info.allocated_blocks;
+        mon_p->max_used = s_memory.pool_size - info.minimum_free_bytes;
+        mon_p->used_pct = 100 - info.total_free_bytes * 100 / s_memory.pool_size;
+        mon_p->frag_pct = info.total_free_bytes > 0 ? 100 - info.largest_free_block * 100 / info.total_free_bytes : 0;
+    }
+}
+
+lv_result_t lv_mem_test_core(void) {
+    std::lock_guard<std::mutex> lock(s_memory.mutex);
+    if (s_memory.heap != nullptr && !multi_heap_check(s_memory.heap, false)) {
+        return LV_RESULT_INVALID;
+    }
+    return LV_RESULT_OK;
+}
+
+cJSON* LvglMemory::GetStatsJson() {
+    lv_mem_monitor_t monitor;
+    lv_mem_monitor_core(&monitor);
+
+    auto json = cJSON_CreateObject();
+    cJSON_AddBoolToObject(json, "enabled", true);
+    auto pool = cJSON_CreateObject();
+    cJSON_AddNumberToObject(pool, "size_kb", monitor.total_size / 1024);
+    cJSON_AddNumberToObject(pool, "free_kb", monitor.free_size / 1024);
+    cJSON_AddNumberToObject(pool, "largest_free_kb", monitor.free_biggest_size / 1024);
+    cJSON_AddNumberToObject(pool, "peak_used_kb", monitor.max_used / 1024);
+    cJSON_AddNumberToObject(pool, "allocated_blocks", monitor.used_cnt);
+    cJSON_AddNumberToObject(pool, "fragmentation_pct", monitor.frag_pct);
+    cJSON_AddItemToObject(json, "psram_pool", pool);
+
+    std::lock_guard<std::mutex> lock(s_memory.mutex);
+    auto slabs = cJSON_CreateObject();
+    cJSON_AddNumberToObject(slabs, "size_kb", s_memory.arena_pages * LVGL_MEMORY_SLAB_PAGE_SIZE / 1024);
+    cJSON_AddNumberToObject(slabs, "pages_free", s_memory.arena_pages - s_memory.pages_taken);
+    auto classes = cJSON_CreateArray();
+    for (int i = 0; i < kSlabClassCount; i++) {
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "size", kSlabClasses[i]);
+        cJSON_AddNumberToObject(item, "pages", s_memory.pages_of_class[i]);
+        cJSON_AddNumberToObject(item, "used", s_memory.used_blocks[i]);
+        cJSON_AddNumberToObject(item, "capacity", s_memory.pages_of_class[i] * (LVGL_MEMORY_SLAB_PAGE_SIZE / kSlabClasses[i]));
+        cJSON_AddItemToArray(classes, item);
+    }
+    cJSON_AddItemToObject(slabs, "classes", classes);
+    cJSON_AddItemToObject(json, "slabs", slabs);
+    cJSON_AddNumberToObject(json, "fallbacks", s_memory.fallbacks);
+    cJSON_AddNumberToObject(json, "fallback_total_kb", s_memory.fallback_bytes / 1024);
+    return json;
+}
+
+#else
+
+cJSON* LvglMemory::GetStatsJson() {
+    // LVGL allocates from the system heap
+    auto json = cJSON_CreateObject();
+    cJSON_AddBoolToObject(json, "enabled", false);
+    return json;
+}
+
+#endif
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cJSON.h>
+
+/**
+ * The heap of LVGL when it is built with CONFIG_LV_USE_CUSTOM_MALLOC.
+ *
+ * The chat bubbles and labels created and deleted all day leave small holes all over the heap,
+ * until a preview image no longer finds a block large enough. With the custom malloc of LVGL
+ * its allocations stay out of the system heap: the ones up to LVGL_MEMORY_SLAB_MAX_SIZE come
+ * from size class slabs of CONFIG_LVGL_SLAB_POOL_KB in internal RAM, the larger ones (draw
+ * buffers, GIF canvases, long texts) from a TLSF heap of CONFIG_LVGL_PSRAM_POOL_KB in PSRAM.
+ * What does not fit falls back to the system heap, and is counted.
+ */
+class LvglMemory {
+public:
+    // Usage and fragmentation of the pools, the caller owns the returned object
+    static cJSON* GetStatsJson();
+};
@@ -0,0 +1,57 @@
+#include "progressive_preview.h"
+
+#ifdef CONFIG_PREVIEW_IMAGE_PROGRESSIVE
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+
+#include "lvgl_display.h"
+#include "lvgl_image.h"
+
+#define TAG "ProgressivePreview"
+
+ProgressivePreview::ProgressivePreview(LvglDisplay* display, const uint8_t* data, size_t length)
+    : display_(display), data_(data), length_(length) {
+}
+
+ProgressivePreview::~ProgressivePreview() {
+    jpeg_progressive_close(decoder_);
+}
+
+bool ProgressivePreview::Feed(size_t available) {
+    if (failed_) {
+        return false;
+    }
+    if (decoder_ == nullptr) {
+        uint8_t* pixels = nullptr;
+        size_t pixels_size, width, height, stride;
+        esp_err_t err = jpeg_progressive_open(data_, available, length_, display_->width(), display_->height(),
+                                              &decoder_, &pixels, &pixels_size, &width, &height, &stride);
+        if (err == ESP_ERR_NOT_FINISHED) {
+            return true;
+        }
+        if (err != ESP_OK) {
+            ESP_LOGW(TAG, "Can not show the image while it downloads: %s", esp_err_to_name(err));
+            failed_ = true;
+            return false;
+        }
+        pixels_ = std::shared_ptr<uint8_t>(pixels, heap_caps_free);
+        ESP_LOGI(TAG, "Showing %ux%u after %u of %u bytes", width, height, available, length_);
+        display_->SetPreviewImage(std::make_unique<LvglSharedImage>(pixels_, pixels, pixels_size, width, height,
+                                                                    stride, LV_COLOR_FORMAT_RGB565));
+    }
+    if (jpeg_progressive_feed(decoder_, available, OnBand, this) != ESP_OK) {
+        failed_ = true;
+        return false;
+    }
+    return true;
+}
+
+bool ProgressivePreview::done() const {
+    return decoder_ != nullptr && !failed_ && jpeg_progressive_done(decoder_);
+}
+
+void ProgressivePreview::OnBand(void* arg, size_t y, size_t lines) {
+    auto self = static_cast<ProgressivePreview*>(arg);
+    self->display_->InvalidatePreviewImage(y, lines);
+}
+#endif  // CONFIG_PREVIEW_IMAGE_PROGRESSIVE
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "sdkconfig.h"
+#ifdef CONFIG_PREVIEW_IMAGE_PROGRESSIVE
+
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+
+#include "jpg/jpeg_to_image.h"
+
+class LvglDisplay;
+
+/**
+ * Shows a JPEG on the preview of the display while it downloads, see CONFIG_PREVIEW_IMAGE_PROGRESSIVE.
+ *
+ * The body is read into a zeroed buffer of its full length, Feed() is called with the bytes that
+ * have arrived. Once the headers are in, the preview shows the image, black, and every decoded
+ * band of it is redrawn. The pixels are shared with the preview, so the preview may go away first.
+ */
+class ProgressivePreview {
+public:
+    ProgressivePreview(LvglDisplay* display, const uint8_t* data, size_t length);
+    ~ProgressivePreview();
+
+    // False once the image can not be shown progressively, the caller then decodes it whole
+    bool Feed(size_t available);
+    bool done() const;
+
+private:
+    LvglDisplay* display_;
+    const uint8_t* data_;
+    size_t length_;
+    jpeg_progressive_t decoder_ = nullptr;
+    std::shared_ptr<uint8_t> pixels_;
+    bool failed_ = false;
+
+    static void OnBand(void* arg, size_t y, size_t lines);
+};
+
+#endif  // CONFIG_PREVIEW_IMAGE_PROGRESSIVE
@@ -1,4 +1,5 @@
 #include "oled_display.h"
+#include "task_profile.h"
 #include "assets/lang_config.h"
 #include "lvgl_theme.h"
 #include "lvgl_font.h"
@@ -19,7 +20,7 @@ LV_FONT_DECLARE(font_awesome_30_1);
 
 OledDisplay::OledDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handle_t panel,
     int width, int height, bool mirror_x, bool mirror_y)
-    : panel_io_(panel_io), panel_(panel) {
+    : panel_io_(panel_io), panel_(panel), page_planner_(panel, width, height) {
     width_ = width;
     height_ = height;
 
@@ -38,17 +39,15 @@ OledDisplay::OledDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handl
 
     ESP_LOGI(TAG, "Initialize LVGL");
     lvgl_port_cfg_t port_cfg = ESP_LVGL_PORT_INIT_CONFIG();
-    port_cfg.task_priority = 1;
+    port_cfg.task_priority = TaskProfiles::Get(kTaskLvgl).priority;
     port_cfg.task_stack = 6144;
-#if CONFIG_SOC_CPU_CORES_NUM > 1
-    port_cfg.task_affinity = 1;
-#endif
+    port_cfg.task_affinity = TaskProfiles::Get(kTaskLvgl).core;
     lvgl_port_init(&port_cfg);
 
     ESP_LOGI(TAG, "Adding OLED display");
     const lvgl_port_display_cfg_t display_cfg = {
         .io_handle = panel_io_,
-        .panel_handle = panel_,
+        .panel_handle = page_planner_.panel(),
         .control_handle = nullptr,
         .buffer_size = static_cast<uint32_t>(width_ * height_),
         .double_buffer = false,
@@ -76,6 +75,13 @@ OledDisplay::OledDisplay(esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_handl
         return;
     }
 
+    {
+        DisplayLockGuard lock(this);
+        page_planner_.Attach(display_, panel_io_);
+        refresh_governor_.Attach(display_);
+        AttachTraceMarkers();
+    }
+
     if (height_ == 64) {
         SetupUI_128x64();
     } else {
@@ -2,15 +2,25 @@
 #define OLED_DISPLAY_H
 
 #include "lvgl_display.h"
+#include "oled_page_planner.h"
 
 #include <esp_lcd_panel_io.h>
 #include <esp_lcd_panel_ops.h>
 
+// The SCL clock of the OLED panel IO
+#if CONFIG_OLED_I2C_FAST_MODE_PLUS
+#define OLED_I2C_SCL_SPEED_HZ (1000 * 1000)
+#else
+#define OLED_I2C_SCL_SPEED_HZ (400 * 1000)
+#endif
+
 
 class OledDisplay : public LvglDisplay {
 private:
     esp_lcd_panel_io_handle_t panel_io_ = nullptr;
     esp_lcd_panel_handle_t panel_ = nullptr;
+    // I2C bandwidth limits the frame rate, only the columns of the pages that changed are sent
+    OledPagePlanner page_planner_;
 
     lv_obj_t* top_bar_ = nullptr;
     lv_obj_t* status_bar_ = nullptr;
@@ -35,6 +45,7 @@ public:
     virtual void SetChatMessage(const char* role, const char* content) override;
     virtual void SetEmotion(const char* emotion) override;
     virtual void SetTheme(Theme* theme) override;
+    virtual cJSON* GetFlushStatsJson() override { return page_planner_.GetStatsJson(); }
 };
 
 #endif // OLED_DISPLAY_H
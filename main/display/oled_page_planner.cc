@@ -0,0 +1,157 @@
+#include "oled_page_planner.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "OledPagePlanner"
+
+OledPagePlanner::OledPagePlanner(esp_lcd_panel_handle_t panel, int width, int height)
+    : panel_(panel), width_(width), pages_((height + OLED_PAGE_HEIGHT - 1) / OLED_PAGE_HEIGHT),
+      shadow_(width_ * pages_, 0), page_known_(pages_, false) {
+    base_.reset = [](esp_lcd_panel_t* panel) {
+        return esp_lcd_panel_reset(FromPanel(panel)->panel_);
+    };
+    base_.init = [](esp_lcd_panel_t* panel) {
+        auto planner = FromPanel(panel);
+        planner->page_known_.assign(planner->pages_, false);
+        return esp_lcd_panel_init(planner->panel_);
+    };
+    // The driver panel is deleted by its owner
+    base_.del = [](esp_lcd_panel_t* panel) {
+        return ESP_OK;
+    };
+    base_.draw_bitmap = [](esp_lcd_panel_t* panel, int x_start, int y_start, int x_end, int y_end, const void* color_data) {
+        return FromPanel(panel)->DrawBitmap(x_start, y_start, x_end, y_end, color_data);
+    };
+    base_.mirror = [](esp_lcd_panel_t* panel, bool x_axis, bool y_axis) {
+        auto planner = FromPanel(panel);
+        planner->page_known_.assign(planner->pages_, false);
+        return esp_lcd_panel_mirror(planner->panel_, x_axis, y_axis);
+    };
+    base_.swap_xy = [](esp_lcd_panel_t* panel, bool swap_axes) {
+        auto planner = FromPanel(panel);
+        planner->page_known_.assign(planner->pages_, false);
+        return esp_lcd_panel_swap_xy(planner->panel_, swap_axes);
+    };
+    base_.set_gap = [](esp_lcd_panel_t* panel, int x_gap, int y_gap) {
+        auto planner = FromPanel(panel);
+        planner->page_known_.assign(planner->pages_, false);
+        return esp_lcd_panel_set_gap(planner->panel_, x_gap, y_gap);
+    };
+    base_.invert_color = [](esp_lcd_panel_t* panel, bool invert_color_data) {
+        return esp_lcd_panel_invert_color(FromPanel(panel)->panel_, invert_color_data);
+    };
+    base_.disp_on_off = [](esp_lcd_panel_t* panel, bool on_off) {
+        return esp_lcd_panel_disp_on_off(FromPanel(panel)->panel_, on_off);
+    };
+    base_.disp_sleep = [](esp_lcd_panel_t* panel, bool sleep) {
+        return esp_lcd_panel_disp_sleep(FromPanel(panel)->panel_, sleep);
+    };
+    base_.user_data = this;
+}
+
+OledPagePlanner* OledPagePlanner::FromPanel(esp_lcd_panel_t* panel) {
+    return static_cast<OledPagePlanner*>(panel->user_data);
+}
+
+void OledPagePlanner::Attach(lv_display_t* display, esp_lcd_panel_io_handle_t panel_io) {
+    if (display == nullptr || display_ != nullptr) {
+        return;
+    }
+    // Replaces the callback of the port, the flush is ready once the last page is out
+    const esp_lcd_panel_io_callbacks_t callbacks = {
+        .on_color_trans_done = [](esp_lcd_panel_io_handle_t panel_io, esp_lcd_panel_io_event_data_t* edata, void* user_ctx) {
+            static_cast<OledPagePlanner*>(user_ctx)->TransferDone();
+            return false;
+        },
+    };
+    if (esp_lcd_panel_io_register_event_callbacks(panel_io, &callbacks, this) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to take over the panel IO callback, flushing the areas whole");
+        return;
+    }
+    display_ = display;
+    ESP_LOGI(TAG, "Tracking %d pages of %d columns", pages_, width_);
+}
+
+esp_err_t OledPagePlanner::DrawBitmap(int x_start, int y_start, int x_end, int y_end, const void* color_data) {
+    int width = x_end - x_start;
+    int first_page = y_start / OLED_PAGE_HEIGHT;
+    int last_page = std::min((y_end + OLED_PAGE_HEIGHT - 1) / OLED_PAGE_HEIGHT, pages_);
+    flushes_.fetch_add(1, std::memory_order_relaxed);
+    if (display_ == nullptr || y_start % OLED_PAGE_HEIGHT != 0 || x_start < 0 || x_end > width_) {
+        // Not attached yet or off the pages, sent as it is and the shadow no longer matches
+        for (int page = std::max(first_page, 0); page < last_page; page++) {
+            page_known_[page] = false;
+        }
+        sent_bytes_.fetch_add(width * (last_page - first_page), std::memory_order_relaxed);
+        if (display_ == nullptr) {
+            return esp_lcd_panel_draw_bitmap(panel_, x_start, y_start, x_end, y_end, color_data);
+        }
+        pending_.store(1);
+        esp_err_t ret = esp_lcd_panel_draw_bitmap(panel_, x_start, y_start, x_end, y_end, color_data);
+        if (ret != ESP_OK) {
+            TransferDone();
+        }
+        return ret;
+    }
+
+    auto data = static_cast<const uint8_t*>(color_data);
+    uint32_t sent = 0;
+    // Held by the flush until all of its pages are queued
+    pending_.store(1);
+    for (int page = first_page; page < last_page; page++) {
+        const uint8_t* row = data + (page - first_page) * width;
+        uint8_t* shadow = &shadow_[page * width_ + x_start];
+        int first = 0;
+        int last = width - 1;
+        if (page_known_[page]) {
+            while (first < width && row[first] == shadow[first]) {
+                first++;
+            }
+            if (first == width) {
+                continue;
+            }
+            while (row[last] == shadow[last]) {
+                last--;
+            }
+        } else if (width == width_) {
+            page_known_[page] = true;
+        }
+
+        memcpy(shadow + first, row + first, last - first + 1);
+        pending_.fetch_add(1);
+        esp_err_t ret = esp_lcd_panel_draw_bitmap(panel_, x_start + first, page * OLED_PAGE_HEIGHT,
+            x_start + last + 1, (page + 1) * OLED_PAGE_HEIGHT, row + first);
+        if (ret != ESP_OK) {
+            pending_.fetch_sub(1);
+            page_known_[page] = false;
+            continue;
+        }
+        sent += last - first + 1;
+    }
+
+    uint32_t total = width * (last_page - first_page);
+    sent_bytes_.fetch_add(sent, std::memory_order_relaxed);
+    skipped_bytes_.fetch_add(total - sent, std::memory_order_relaxed);
+    if (sent == 0) {
+        skipped_flushes_.fetch_add(1, std::memory_order_relaxed);
+    }
+    TransferDone();
+    return ESP_OK;
+}
+
+void OledPagePlanner::TransferDone() {
+    if (pending_.fetch_sub(1) == 1) {
+        lv_display_flush_ready(display_);
+    }
+}
+
+cJSON* OledPagePlanner::GetStatsJson() {
+    auto root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "flushes", flushes_.load());
+    cJSON_AddNumberToObject(root, "skipped_flushes", skipped_flushes_.load());
+    cJSON_AddNumberToObject(root, "sent_bytes", sent_bytes_.load());
+    cJSON_AddNumberToObject(root, "skipped_bytes", skipped_bytes_.load());
+    return root;
+}
@@ -0,0 +1,63 @@
+#ifndef _OLED_PAGE_PLANNER_H_
+#define _OLED_PAGE_PLANNER_H_
+
+#include <lvgl.h>
+#include <cJSON.h>
+#include <esp_lcd_panel_io.h>
+#include <esp_lcd_panel_interface.h>
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// The rows of a page of the SSD1306 and SH1106 GRAM, one byte holds a column of a page
+#define OLED_PAGE_HEIGHT 8
+
+/*
+ * Cuts down what LVGL sends to a monochrome I2C OLED.
+ *
+ * The planner sits between the LVGL port and the panel driver as a panel of its own. The port
+ * converts every flushed area to the page format of the GRAM, and the planner compares each
+ * page of it with a shadow of the GRAM. Only the columns from the first to the last changed
+ * byte of a changed page are sent, and a flush without a changed byte sends nothing. A status
+ * text or an emoji redrawn the same, or a change of a few columns inside a wide invalidated
+ * area, then costs a few bytes on the bus instead of the whole area.
+ *
+ * The planner calls the flush ready of LVGL once the last page it sent is out, so it takes
+ * over the color transfer callback of the panel IO in Attach(). The flushes run in the LVGL
+ * task and GetStatsJson() may be called by any task.
+ */
+class OledPagePlanner {
+public:
+    OledPagePlanner(esp_lcd_panel_handle_t panel, int width, int height);
+    OledPagePlanner(const OledPagePlanner&) = delete;
+    OledPagePlanner& operator=(const OledPagePlanner&) = delete;
+
+    // The panel to give to the LVGL port instead of the panel of the driver
+    esp_lcd_panel_handle_t panel() { return &base_; }
+    // Called once the port has added the display
+    void Attach(lv_display_t* display, esp_lcd_panel_io_handle_t panel_io);
+    // The caller owns the returned object
+    cJSON* GetStatsJson();
+
+private:
+    esp_lcd_panel_t base_ = {};     // Its user data points back to the planner
+    esp_lcd_panel_handle_t panel_;
+    int width_;
+    int pages_;
+    std::vector<uint8_t> shadow_;   // The GRAM as last sent
+    std::vector<bool> page_known_;  // false until the page was sent whole
+    lv_display_t* display_ = nullptr;
+    std::atomic<int> pending_ = 0;  // The transfers of the flush still in flight
+
+    std::atomic<uint32_t> flushes_ = 0;
+    std::atomic<uint32_t> skipped_flushes_ = 0;
+    std::atomic<uint32_t> sent_bytes_ = 0;
+    std::atomic<uint32_t> skipped_bytes_ = 0;
+
+    esp_err_t DrawBitmap(int x_start, int y_start, int x_end, int y_end, const void* color_data);
+    void TransferDone();
+    static OledPagePlanner* FromPanel(esp_lcd_panel_t* panel);
+};
+
+#endif // _OLED_PAGE_PLANNER_H_
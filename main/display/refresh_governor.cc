@@ -0,0 +1,57 @@
+#include "refresh_governor.h"
+
+#include <esp_log.h>
+#include <sdkconfig.h>
+
+#define TAG "RefreshGovernor"
+
+static uint32_t GetLevelPeriod(RefreshLevel level) {
+    switch (level) {
+    case kRefreshIdle:
+        return CONFIG_DISPLAY_IDLE_REFRESH_MS;
+    case kRefreshPowerSave:
+        return CONFIG_DISPLAY_POWER_SAVE_REFRESH_MS;
+    default:
+        return LV_DEF_REFR_PERIOD;
+    }
+}
+
+void RefreshGovernor::Attach(lv_display_t* display) {
+    if (display == nullptr || display_ != nullptr) {
+        return;
+    }
+    timer_ = lv_display_get_refr_timer(display);
+    if (timer_ == nullptr) {
+        return;
+    }
+    display_ = display;
+    last_invalidate_tick_ = lv_tick_get();
+    lv_display_add_event_cb(display, OnInvalidateArea, LV_EVENT_INVALIDATE_AREA, this);
+    period_ms_ = GetLevelPeriod(level_);
+    lv_timer_set_period(timer_, period_ms_);
+}
+
+void RefreshGovernor::SetLevel(RefreshLevel level) {
+    if (timer_ == nullptr || level == level_) {
+        return;
+    }
+    bool faster = GetLevelPeriod(level) < period_ms_;
+    level_ = level;
+    period_ms_ = GetLevelPeriod(level);
+    lv_timer_set_period(timer_, period_ms_);
+    // What the new state shows is rendered right away instead of at the end of the slow period
+    if (faster) {
+        lv_timer_ready(timer_);
+    }
+    ESP_LOGD(TAG, "Refresh period %lu ms", period_ms_);
+}
+
+void RefreshGovernor::OnInvalidateArea(lv_event_t* e) {
+    auto governor = static_cast<RefreshGovernor*>(lv_event_get_user_data(e));
+    uint32_t quiet_ms = lv_tick_elaps(governor->last_invalidate_tick_);
+    governor->last_invalidate_tick_ = lv_tick_get();
+    // The animations invalidate at every tick and keep the period, a lone change does not wait for it
+    if (governor->period_ms_ > LV_DEF_REFR_PERIOD && quiet_ms >= governor->period_ms_) {
+        lv_timer_ready(governor->timer_);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef _REFRESH_GOVERNOR_H_
+#define _REFRESH_GOVERNOR_H_
+
+#include <lvgl.h>
+#include <cstdint>
+
+enum RefreshLevel {
+    kRefreshActive,     // The LVGL refresh period, while connecting, listening and speaking
+    kRefreshIdle,       // CONFIG_DISPLAY_IDLE_REFRESH_MS
+    kRefreshPowerSave,  // CONFIG_DISPLAY_POWER_SAVE_REFRESH_MS
+};
+
+/*
+ * Sets the period of the refresh timer of an LVGL display from what the device is doing.
+ *
+ * An idle screen only runs its slow animations, so LVGL renders them at a longer period and
+ * the LVGL task sleeps in between. A change that comes after the screen was quiet for a whole
+ * period, like a touch, is rendered at the next run of the LVGL task instead of waiting for the
+ * period, and a continuous animation stays at the rate of the level.
+ *
+ * All the methods are called with the LVGL lock held.
+ */
+class RefreshGovernor {
+public:
+    RefreshGovernor() = default;
+    RefreshGovernor(const RefreshGovernor&) = delete;
+    RefreshGovernor& operator=(const RefreshGovernor&) = delete;
+
+    void Attach(lv_display_t* display);
+    void SetLevel(RefreshLevel level);
+    RefreshLevel level() const { return level_; }
+
+private:
+    lv_display_t* display_ = nullptr;
+    lv_timer_t* timer_ = nullptr;
+    RefreshLevel level_ = kRefreshActive;
+    uint32_t period_ms_ = LV_DEF_REFR_PERIOD;
+    uint32_t last_invalidate_tick_ = 0;
+
+    static void OnInvalidateArea(lv_event_t* e);
+};
+
+#endif // _REFRESH_GOVERNOR_H_
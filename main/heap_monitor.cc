@@ -0,0 +1,156 @@
+#include "heap_monitor.h"
+#include "memory_placement.h"
+#include "wakeup_coalescer.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cinttypes>
+
+#define TAG "HeapMonitor"
+
+static const char* const kTagNames[kHeapTagCount] = {
+    "audio",
+    "protocol",
+    "display",
+    "mcp",
+    "camera",
+    "ota",
+};
+
+HeapMonitor::HeapMonitor() {
+    auto& coalescer = WakeupCoalescer::GetInstance();
+    int job = coalescer.Add("heap_monitor", HEAP_MONITOR_SAMPLE_INTERVAL_MS, [this](int periods) {
+        Sample();
+    });
+    coalescer.Start(job);
+    Sample();
+}
+
+void* HeapMonitor::Malloc(HeapTag tag, size_t size, uint32_t caps) {
+    auto& stats = tags_[tag];
+    void* ptr = heap_caps_malloc(size, caps);
+    if (ptr == nullptr) {
+        stats.failures.fetch_add(1, std::memory_order_relaxed);
+        ESP_LOGW(TAG, "%s failed to allocate %u bytes, largest free block %u", kTagNames[tag], size,
+            heap_caps_get_largest_free_block(caps));
+        return nullptr;
+    }
+    // The allocator may round the size up
+    int32_t allocated = heap_caps_get_allocated_size(ptr);
+    int32_t bytes = stats.bytes.fetch_add(allocated, std::memory_order_relaxed) + allocated;
+    int32_t peak = stats.peak_bytes.load(std::memory_order_relaxed);
+    while (bytes > peak && !stats.peak_bytes.compare_exchange_weak(peak, bytes, std::memory_order_relaxed)) {
+    }
+    stats.allocations.fetch_add(1, std::memory_order_relaxed);
+    return ptr;
+}
+
+void HeapMonitor::Free(HeapTag tag, void* ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    tags_[tag].bytes.fetch_sub(heap_caps_get_allocated_size(ptr), std::memory_order_relaxed);
+    heap_caps_free(ptr);
+}
+
+void HeapMonitor::Disown(HeapTag tag, void* ptr) {
+    if (ptr != nullptr) {
+        tags_[tag].bytes.fetch_sub(heap_caps_get_allocated_size(ptr), std::memory_order_relaxed);
+    }
+}
+
+const HeapMonitor::RegionSample& HeapMonitor::Oldest(const Region& region) const {
+    int index = samples_ <= HEAP_MONITOR_HISTORY_SIZE ? 0 : samples_ % HEAP_MONITOR_HISTORY_SIZE;
+    return region.history[index];
+}
+
+const HeapMonitor::RegionSample& HeapMonitor::Latest(const Region& region) const {
+    return region.history[(samples_ - 1) % HEAP_MONITOR_HISTORY_SIZE];
+}
+
+void HeapMonitor::Sample() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (auto& region : regions_) {
+        auto& sample = region.history[samples_ % HEAP_MONITOR_HISTORY_SIZE];
+        sample.free = heap_caps_get_free_size(region.caps);
+        sample.largest_block = heap_caps_get_largest_free_block(region.caps);
+        if (sample.free > 0) {
+            region.lowest_largest_block = std::min(region.lowest_largest_block, sample.largest_block);
+        }
+    }
+    samples_++;
+
+    uint32_t largest_block = Latest(regions_[0]).largest_block;
+    bool low = largest_block < CONFIG_HEAP_ALERT_LARGEST_BLOCK_KB * 1024;
+    if (low && !alerted_) {
+        ESP_LOGW(TAG, "The largest free block of the internal RAM is down to %" PRIu32 " bytes of %" PRIu32 " free",
+            largest_block, Latest(regions_[0]).free);
+    }
+    alerted_ = low;
+    // The trends once a sample, the free heap itself is printed every 10 seconds
+    lock.unlock();
+    PrintStats();
+}
+
+void HeapMonitor::PrintStats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& region : regions_) {
+        const auto& latest = Latest(region);
+        if (latest.free == 0) {
+            continue;
+        }
+        const auto& oldest = Oldest(region);
+        ESP_LOGI(TAG, "%s: free %" PRIu32 ", largest block %" PRIu32 " (lowest %" PRIu32 "), fragmentation %" PRIu32
+            "%%, largest block %+d in %d min",
+            region.name, latest.free, latest.largest_block, region.lowest_largest_block,
+            100 - (uint32_t)((uint64_t)latest.largest_block * 100 / latest.free),
+            (int)latest.largest_block - (int)oldest.largest_block,
+            std::min(samples_, HEAP_MONITOR_HISTORY_SIZE) * HEAP_MONITOR_SAMPLE_INTERVAL_MS / 60000);
+    }
+    for (int i = 0; i < kHeapTagCount; i++) {
+        auto& stats = tags_[i];
+        if (stats.allocations.load() == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%s: %ld bytes, peak %ld, %lu allocations, %lu failures", kTagNames[i],
+            stats.bytes.load(), stats.peak_bytes.load(), stats.allocations.load(), stats.failures.load());
+    }
+    MemoryPolicy::PrintStats();
+}
+
+cJSON* HeapMonitor::GetStatsJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto json = cJSON_CreateObject();
+    for (const auto& region : regions_) {
+        const auto& latest = Latest(region);
+        if (latest.free == 0) {
+            continue;
+        }
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "free", latest.free);
+        cJSON_AddNumberToObject(item, "largest_block", latest.largest_block);
+        cJSON_AddNumberToObject(item, "lowest_largest_block", region.lowest_largest_block);
+        // The largest free blocks over the last hour, the oldest first
+        auto trend = cJSON_CreateArray();
+        int count = std::min(samples_, HEAP_MONITOR_HISTORY_SIZE);
+        for (int i = samples_ - count; i < samples_; i++) {
+            cJSON_AddItemToArray(trend, cJSON_CreateNumber(region.history[i % HEAP_MONITOR_HISTORY_SIZE].largest_block));
+        }
+        cJSON_AddItemToObject(item, "largest_block_trend", trend);
+        cJSON_AddItemToObject(json, region.name, item);
+    }
+    auto tags = cJSON_CreateObject();
+    for (int i = 0; i < kHeapTagCount; i++) {
+        auto& stats = tags_[i];
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "bytes", stats.bytes.load());
+        cJSON_AddNumberToObject(item, "peak_bytes", stats.peak_bytes.load());
+        cJSON_AddNumberToObject(item, "allocations", stats.allocations.load());
+        cJSON_AddNumberToObject(item, "failures", stats.failures.load());
+        cJSON_AddItemToObject(tags, kTagNames[i], item);
+    }
+    cJSON_AddItemToObject(json, "subsystems", tags);
+    cJSON_AddItemToObject(json, "placement", MemoryPolicy::GetStatsJson());
+    cJSON_AddBoolToObject(json, "alert", alerted_);
+    return json;
+}
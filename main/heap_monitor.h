@@ -0,0 +1,90 @@
+#ifndef _HEAP_MONITOR_H_
+#define _HEAP_MONITOR_H_
+
+#include <cJSON.h>
+#include <esp_heap_caps.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+#define HEAP_MONITOR_SAMPLE_INTERVAL_MS 60000
+// An hour of samples, for the trends of the largest free blocks
+#define HEAP_MONITOR_HISTORY_SIZE 60
+
+// The subsystems the large allocations are accounted to
+enum HeapTag {
+    kHeapTagAudio,
+    kHeapTagProtocol,
+    kHeapTagDisplay,    // LVGL images, glyphs and GIF frames
+    kHeapTagMcp,
+    kHeapTagCamera,
+    kHeapTagOta,
+    kHeapTagCount,
+};
+
+/*
+ * Watches the fragmentation of the internal RAM and the PSRAM, and accounts the large buffers
+ * to the subsystems that hold them.
+ *
+ * The free heap of a device that ran for days may look fine while the largest free block is too
+ * small for an OTA sector or a camera frame. The largest free block of each region is sampled
+ * every HEAP_MONITOR_SAMPLE_INTERVAL_MS and an alert is logged once the internal one falls below
+ * CONFIG_HEAP_ALERT_LARGEST_BLOCK_KB.
+ *
+ * The buffers allocated with Malloc() are freed with Free() of the same tag, or given up with
+ * Disown() when something else frees them.
+ */
+class HeapMonitor {
+public:
+    static HeapMonitor& GetInstance() {
+        static HeapMonitor instance;
+        return instance;
+    }
+
+    void* Malloc(HeapTag tag, size_t size, uint32_t caps);
+    void Free(HeapTag tag, void* ptr);
+    // The buffer is handed to an owner that frees it with heap_caps_free()
+    void Disown(HeapTag tag, void* ptr);
+
+    void Sample();
+    void PrintStats();
+    cJSON* GetStatsJson();
+
+private:
+    struct TagStats {
+        std::atomic<int32_t> bytes{0};
+        std::atomic<int32_t> peak_bytes{0};
+        std::atomic<uint32_t> allocations{0};
+        std::atomic<uint32_t> failures{0};
+    };
+
+    struct RegionSample {
+        uint32_t free;
+        uint32_t largest_block;
+    };
+
+    struct Region {
+        const char* name;
+        uint32_t caps;
+        RegionSample history[HEAP_MONITOR_HISTORY_SIZE] = {};
+        uint32_t lowest_largest_block = UINT32_MAX;
+    };
+
+    TagStats tags_[kHeapTagCount];
+    std::mutex mutex_;
+    Region regions_[2] = {
+        {"internal", MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT},
+        {"psram", MALLOC_CAP_SPIRAM},
+    };
+    int samples_ = 0;
+    bool alerted_ = false;
+
+    HeapMonitor();
+    // The oldest sample kept and the newest one
+    const RegionSample& Oldest(const Region& region) const;
+    const RegionSample& Latest(const Region& region) const;
+};
+
+#endif // _HEAP_MONITOR_H_
@@ -0,0 +1,122 @@
+#include "http_pool.h"
+#include "board.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#define TAG "HttpPool"
+
+// The scheme, host and port of the url with the profile
+static std::string PoolKey(const std::string& url, const char* profile) {
+    size_t start = url.find("://");
+    start = start == std::string::npos ? 0 : start + 3;
+    size_t end = url.find_first_of("/?#", start);
+    return url.substr(0, end) + " " + profile;
+}
+
+std::unique_ptr<Http> HttpPool::TakeIdle(const std::string& key, NetworkInterface* network, int connect_id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now = esp_timer_get_time();
+    std::unique_ptr<Http> found;
+    for (auto it = idle_.begin(); it != idle_.end();) {
+        // Expired clients, and those of a network the board switched away from, are dropped
+        if (it->network != network || now - it->idle_since_us > HTTP_POOL_IDLE_TIMEOUT_MS * 1000LL) {
+            it->http->Close();
+            it = idle_.erase(it);
+        } else if (!found && it->key == key && it->connect_id == connect_id) {
+            found = std::move(it->http);
+            it = idle_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    if (found) {
+        hits_++;
+    } else {
+        misses_++;
+    }
+    return found;
+}
+
+void HttpPool::CloseIdle(NetworkInterface* network, int connect_id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = idle_.begin(); it != idle_.end();) {
+        if (it->network == network && it->connect_id == connect_id) {
+            it->http->Close();
+            it = idle_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+std::unique_ptr<Http> HttpPool::CreateHttp(int connect_id) {
+    auto network = Board::GetInstance().GetNetwork();
+    CloseIdle(network, connect_id);
+    return network->CreateHttp(connect_id);
+}
+
+std::unique_ptr<Http> HttpPool::Open(const std::string& method, const std::string& url, const char* profile,
+                                     int connect_id, SetupCallback setup) {
+    auto network = Board::GetInstance().GetNetwork();
+    auto key = PoolKey(url, profile);
+    auto http = TakeIdle(key, network, connect_id);
+    if (http) {
+        if (http->Open(method, url)) {
+            ESP_LOGI(TAG, "Reused the connection to %s, %lu hits of %lu", key.c_str(), hits_, hits_ + misses_);
+            return http;
+        }
+        ESP_LOGW(TAG, "The kept connection to %s was closed, opening a new one", key.c_str());
+        std::lock_guard<std::mutex> lock(mutex_);
+        stale_++;
+    }
+
+    http = CreateHttp(connect_id);
+    http->SetHeader("Connection", "keep-alive");
+    if (setup) {
+        setup(http.get());
+    }
+    if (!http->Open(method, url)) {
+        return nullptr;
+    }
+    return http;
+}
+
+void HttpPool::Release(const std::string& url, const char* profile, int connect_id, std::unique_ptr<Http> http) {
+    if (!http) {
+        return;
+    }
+    auto connection = http->GetResponseHeader("Connection");
+    if (connection == "close" || connection == "Close") {
+        http->Close();
+        return;
+    }
+    // Only one idle client may hold the connect id
+    auto network = Board::GetInstance().GetNetwork();
+    CloseIdle(network, connect_id);
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (idle_.size() >= HTTP_POOL_MAX_IDLE) {
+        idle_.front().http->Close();
+        idle_.erase(idle_.begin());
+    }
+    idle_.push_back({PoolKey(url, profile), network, connect_id, std::move(http), esp_timer_get_time()});
+}
+
+void HttpPool::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& entry : idle_) {
+        entry.http->Close();
+    }
+    idle_.clear();
+}
+
+cJSON* HttpPool::GetStatsJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "hits", hits_);
+    cJSON_AddNumberToObject(root, "misses", misses_);
+    // Reused connections the server had closed, they were opened again
+    cJSON_AddNumberToObject(root, "stale", stale_);
+    cJSON_AddNumberToObject(root, "idle", idle_.size());
+    return root;
+}
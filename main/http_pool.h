@@ -0,0 +1,71 @@
+#ifndef _HTTP_POOL_H_
+#define _HTTP_POOL_H_
+
+#include <cJSON.h>
+#include <http.h>
+#include <network_interface.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Idle clients kept at most, and how long, servers close idle keep-alive connections after a minute or so
+#define HTTP_POOL_MAX_IDLE 4
+#define HTTP_POOL_IDLE_TIMEOUT_MS 30000
+
+/*
+ * Keeps the HTTP clients of finished requests so the next request to the same host reuses the
+ * kept-alive connection instead of a new TCP and TLS handshake.
+ *
+ * Clients are pooled by origin and by a profile, the name of the caller whose setup callback
+ * set their headers; a reused client keeps those headers, so a profile must not set headers
+ * that differ between its requests. A reused client that fails to open, as the server closed the
+ * connection meanwhile, is replaced by a new one.
+ *
+ * An idle client keeps its connect id, which a modem allows once at a time, so a client created
+ * with the same id, pooled or not, closes the idle one first. Code that creates its clients
+ * outside of Open() takes them from CreateHttp() for that reason.
+ */
+class HttpPool {
+public:
+    typedef std::function<void(Http* http)> SetupCallback;
+
+    static HttpPool& GetInstance() {
+        static HttpPool instance;
+        return instance;
+    }
+
+    // Opens the request, nullptr on failure; setup is called for each new client before it opens
+    std::unique_ptr<Http> Open(const std::string& method, const std::string& url, const char* profile,
+                               int connect_id, SetupCallback setup = nullptr);
+    // Keeps the client for the next request of the profile, once its response was read to the end
+    void Release(const std::string& url, const char* profile, int connect_id, std::unique_ptr<Http> http);
+    // A client that is not pooled, the idle client holding the connect id is closed first
+    std::unique_ptr<Http> CreateHttp(int connect_id);
+    void Clear();
+    cJSON* GetStatsJson();
+
+private:
+    struct Entry {
+        std::string key;
+        NetworkInterface* network;
+        int connect_id;
+        std::unique_ptr<Http> http;
+        int64_t idle_since_us;
+    };
+
+    std::mutex mutex_;
+    std::vector<Entry> idle_;
+    uint32_t hits_ = 0;
+    uint32_t misses_ = 0;
+    uint32_t stale_ = 0;
+
+    HttpPool() = default;
+    std::unique_ptr<Http> TakeIdle(const std::string& key, NetworkInterface* network, int connect_id);
+    void CloseIdle(NetworkInterface* network, int connect_id);
+};
+
+#endif // _HTTP_POOL_H_
@@ -0,0 +1,86 @@
+#include "json_arena.h"
+#include "heap_monitor.h"
+
+#include <cJSON.h>
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+
+#define TAG "JsonArena"
+
+#define JSON_ARENA_ALIGNMENT 8
+
+// cJSON is used from several tasks, the hooks are global, the scopes are per task
+static std::mutex arena_mutex;
+static uint8_t* arena = nullptr;
+static size_t arena_size = 0;
+static size_t arena_offset = 0;
+static size_t arena_live = 0;       // Allocations in the arena not freed yet
+static size_t arena_fallbacks = 0;
+static thread_local int arena_scopes = 0;     // Scopes open on the calling task
+
+JsonArena::Scope::Scope() {
+    arena_scopes++;
+}
+
+JsonArena::Scope::~Scope() {
+    arena_scopes--;
+}
+
+void JsonArena::Install(size_t size) {
+    if (arena != nullptr || size == 0) {
+        return;
+    }
+    arena = (uint8_t*)HeapMonitor::GetInstance().Malloc(kHeapTagProtocol, size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (arena == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate %u bytes for the cJSON arena", size);
+        return;
+    }
+    arena_size = size;
+    cJSON_Hooks hooks = {
+        .malloc_fn = Allocate,
+        .free_fn = Free,
+    };
+    cJSON_InitHooks(&hooks);
+    ESP_LOGI(TAG, "cJSON arena installed, %u bytes", size);
+}
+
+size_t JsonArena::fallback_count() {
+    std::lock_guard<std::mutex> lock(arena_mutex);
+    return arena_fallbacks;
+}
+
+void* JsonArena::Allocate(size_t size) {
+    if (arena_scopes == 0) {
+        return malloc(size);
+    }
+    {
+        std::lock_guard<std::mutex> lock(arena_mutex);
+        size_t aligned = (size + JSON_ARENA_ALIGNMENT - 1) & ~(size_t)(JSON_ARENA_ALIGNMENT - 1);
+        if (aligned <= arena_size - arena_offset) {
+            void* ptr = arena + arena_offset;
+            arena_offset += aligned;
+            arena_live++;
+            return ptr;
+        }
+        arena_fallbacks++;
+    }
+    return malloc(size);
+}
+
+void JsonArena::Free(void* ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    auto address = (uint8_t*)ptr;
+    if (address < arena || address >= arena + arena_size) {
+        free(ptr);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(arena_mutex);
+    if (--arena_live == 0) {
+        arena_offset = 0;
+    }
+}
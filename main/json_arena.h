@@ -0,0 +1,38 @@
+#ifndef _JSON_ARENA_H_
+#define _JSON_ARENA_H_
+
+#include <cstddef>
+
+/*
+ * A bump allocator for cJSON, so parsing and building the control messages of a
+ * conversation does not churn the heap.
+ *
+ * Only the parsers that open a Scope allocate from the arena, every other cJSON user keeps
+ * getting plain heap blocks, so a tree another module keeps alive does not fill it. The
+ * hooks are installed once and free both kinds of blocks, so they never have to be swapped.
+ *
+ * Allocations are taken from the arena in order and never freed one by one, the arena is
+ * rewound once every allocation in it has been freed. It is full while a tree is kept
+ * alive, an allocation that does not fit falls back to the heap.
+ */
+class JsonArena {
+public:
+    // Routes the cJSON allocations of the calling task to the arena while it lives
+    class Scope {
+    public:
+        Scope();
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    // Install the cJSON hooks, before any other task uses cJSON
+    static void Install(size_t size);
+    static size_t fallback_count();
+
+private:
+    static void* Allocate(size_t size);
+    static void Free(void* ptr);
+};
+
+#endif // _JSON_ARENA_H_
@@ -0,0 +1,302 @@
+#include "json_reader.h"
+
+#include <cstdlib>
+#include <cstring>
+
+static bool IsSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int HexDigit(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+JsonReader::JsonReader(Handler& handler, size_t max_token) : handler_(handler), max_token_(max_token) {
+    frames_.reserve(kMaxDepth);
+}
+
+bool JsonReader::Feed(const char* data, size_t size) {
+    for (size_t i = 0; i < size && state_ != kStateError; i++) {
+        Step(data[i]);
+    }
+    return state_ != kStateError;
+}
+
+bool JsonReader::Finish() {
+    // A number at the root ends with the document
+    if (state_ == kStateLiteral && frames_.empty()) {
+        FinishLiteral();
+    }
+    if (state_ != kStateDone && state_ != kStateError) {
+        Fail("truncated");
+    }
+    return state_ == kStateDone;
+}
+
+bool JsonReader::PathIs(std::initializer_list<std::string_view> path) const {
+    if (path.size() != depth_) {
+        return false;
+    }
+    size_t level = 0;
+    for (auto& key : path) {
+        if (frames_[level++].key != key) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool JsonReader::ToDouble(std::string_view text, double& value) {
+    if (text.empty() || text.find_first_not_of("0123456789+-.eE") != std::string_view::npos) {
+        return false;
+    }
+    std::string number(text);
+    char* end = nullptr;
+    value = strtod(number.c_str(), &end);
+    return end == number.c_str() + number.size();
+}
+
+void JsonReader::Step(char c) {
+    if (state_ == kStateString) {
+        StringChar(c);
+        return;
+    }
+    if (state_ == kStateLiteral) {
+        if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '+' || c == '-' || c == '.') {
+            Append(c);
+            return;
+        }
+        // The character after the literal belongs to the state after it
+        FinishLiteral();
+        if (state_ == kStateError) {
+            return;
+        }
+    }
+    if (IsSpace(c)) {
+        return;
+    }
+
+    switch (state_) {
+        case kStateValueOrEnd:
+            if (c == ']') {
+                Pop(true);
+                return;
+            }
+            BeginValue(c);
+            return;
+        case kStateValue:
+            BeginValue(c);
+            return;
+        case kStateKeyOrEnd:
+            if (c == '}') {
+                Pop(false);
+                return;
+            }
+            [[fallthrough]];
+        case kStateKey:
+            if (c != '"') {
+                Fail("expected a key");
+                return;
+            }
+            token_.clear();
+            reading_key_ = true;
+            state_ = kStateString;
+            return;
+        case kStateColon:
+            if (c != ':') {
+                Fail("expected a colon");
+                return;
+            }
+            state_ = kStateValue;
+            return;
+        case kStateAfterValue:
+            if (c == ',') {
+                state_ = frames_.back().array ? kStateValue : kStateKey;
+            } else if (c == ']' && frames_.back().array) {
+                Pop(true);
+            } else if (c == '}' && !frames_.back().array) {
+                Pop(false);
+            } else {
+                Fail("expected a comma");
+            }
+            return;
+        case kStateDone:
+            Fail("data after the document");
+            return;
+        default:
+            return;
+    }
+}
+
+void JsonReader::BeginValue(char c) {
+    if (c == '{' || c == '[') {
+        Push(c == '[');
+        return;
+    }
+    token_.clear();
+    if (c == '"') {
+        reading_key_ = false;
+        state_ = kStateString;
+        return;
+    }
+    if (c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' || c == 'n') {
+        Append(c);
+        state_ = kStateLiteral;
+        return;
+    }
+    Fail("expected a value");
+}
+
+void JsonReader::StringChar(char c) {
+    if (unicode_digits_ >= 0) {
+        int digit = HexDigit(c);
+        if (digit < 0) {
+            Fail("bad unicode escape");
+            return;
+        }
+        unicode_ = unicode_ << 4 | digit;
+        if (++unicode_digits_ < 4) {
+            return;
+        }
+        unicode_digits_ = -1;
+        if (unicode_ >= 0xD800 && unicode_ < 0xDC00) {
+            // The low half follows in the next escape
+            high_surrogate_ = unicode_;
+            return;
+        }
+        if (unicode_ >= 0xDC00 && unicode_ < 0xE000 && high_surrogate_ != 0) {
+            AppendUtf8(0x10000 + ((high_surrogate_ - 0xD800) << 10) + (unicode_ - 0xDC00));
+        } else {
+            AppendUtf8(unicode_);
+        }
+        high_surrogate_ = 0;
+        return;
+    }
+    if (escape_) {
+        escape_ = false;
+        switch (c) {
+            case '"':
+            case '\\':
+            case '/':
+                Append(c);
+                break;
+            case 'b': Append('\b'); break;
+            case 'f': Append('\f'); break;
+            case 'n': Append('\n'); break;
+            case 'r': Append('\r'); break;
+            case 't': Append('\t'); break;
+            case 'u':
+                unicode_digits_ = 0;
+                unicode_ = 0;
+                return;
+            default:
+                Fail("bad escape");
+                return;
+        }
+        high_surrogate_ = 0;
+        return;
+    }
+    if (c == '\\') {
+        escape_ = true;
+        return;
+    }
+    if (c == '"') {
+        high_surrogate_ = 0;
+        if (reading_key_) {
+            frames_.back().key.assign(token_);
+            state_ = kStateColon;
+            return;
+        }
+        depth_ = frames_.size();
+        handler_.OnValue(*this, kString, token_);
+        AfterValue();
+        return;
+    }
+    if ((uint8_t)c < 0x20) {
+        Fail("control character in a string");
+        return;
+    }
+    Append(c);
+}
+
+void JsonReader::FinishLiteral() {
+    Type type;
+    double number;
+    if (token_ == "true" || token_ == "false") {
+        type = kBool;
+    } else if (token_ == "null") {
+        type = kNull;
+    } else if (ToDouble(token_, number)) {
+        type = kNumber;
+    } else {
+        Fail("bad literal");
+        return;
+    }
+    depth_ = frames_.size();
+    handler_.OnValue(*this, type, token_);
+    AfterValue();
+}
+
+void JsonReader::Push(bool array) {
+    if (frames_.size() >= kMaxDepth) {
+        Fail("too deep");
+        return;
+    }
+    depth_ = frames_.size();
+    handler_.OnBegin(*this, array ? kArray : kObject);
+    frames_.push_back({array, std::string()});
+    state_ = array ? kStateValueOrEnd : kStateKeyOrEnd;
+}
+
+void JsonReader::Pop(bool array) {
+    frames_.pop_back();
+    depth_ = frames_.size();
+    handler_.OnEnd(*this, array ? kArray : kObject);
+    AfterValue();
+}
+
+void JsonReader::AfterValue() {
+    state_ = frames_.empty() ? kStateDone : kStateAfterValue;
+}
+
+void JsonReader::Append(char c) {
+    if (token_.size() >= max_token_) {
+        Fail("token too long");
+        return;
+    }
+    token_ += c;
+}
+
+void JsonReader::AppendUtf8(uint32_t code_point) {
+    if (code_point < 0x80) {
+        Append(code_point);
+    } else if (code_point < 0x800) {
+        Append(0xC0 | (code_point >> 6));
+        Append(0x80 | (code_point & 0x3F));
+    } else if (code_point < 0x10000) {
+        Append(0xE0 | (code_point >> 12));
+        Append(0x80 | ((code_point >> 6) & 0x3F));
+        Append(0x80 | (code_point & 0x3F));
+    } else {
+        Append(0xF0 | (code_point >> 18));
+        Append(0x80 | ((code_point >> 12) & 0x3F));
+        Append(0x80 | ((code_point >> 6) & 0x3F));
+        Append(0x80 | (code_point & 0x3F));
+    }
+}
+
+void JsonReader::Fail(const char* error) {
+    if (state_ != kStateError) {
+        error_ = error;
+        state_ = kStateError;
+    }
+}
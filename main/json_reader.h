@@ -0,0 +1,103 @@
+#ifndef _JSON_READER_H_
+#define _JSON_READER_H_
+
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Reads JSON as it arrives, a chunk at a time, and hands each value to a handler, for the large
+ * responses that would otherwise be read whole and parsed into a cJSON tree.
+ *
+ * Only the token being read and the keys of the open containers are kept, so the memory does not
+ * grow with the document. A string or a number longer than max_token fails the document, as does
+ * anything that is not JSON. The handler sees the path of a value, the keys from the root down,
+ * an array element has an empty key. Strings are given unescaped, the other scalars as their text.
+ */
+class JsonReader {
+public:
+    enum Type {
+        kNull,
+        kBool,
+        kNumber,
+        kString,
+        kObject,
+        kArray,
+    };
+
+    class Handler {
+    public:
+        virtual ~Handler() = default;
+        // The path is the one of the container, key(depth() - 1) is its own key
+        virtual void OnBegin(const JsonReader& reader, Type type) {}
+        virtual void OnEnd(const JsonReader& reader, Type type) {}
+        // The path is the one of the value
+        virtual void OnValue(const JsonReader& reader, Type type, std::string_view value) = 0;
+    };
+
+    JsonReader(Handler& handler, size_t max_token);
+
+    // False once the document failed, the rest is ignored
+    bool Feed(const char* data, size_t size);
+    bool Feed(std::string_view data) { return Feed(data.data(), data.size()); }
+    // True if a whole document was read
+    bool Finish();
+    const char* error() const { return error_; }
+
+    size_t depth() const { return depth_; }
+    std::string_view key(size_t level) const { return frames_[level].key; }
+    // The path is {key(0), ..., key(depth() - 1)}
+    bool PathIs(std::initializer_list<std::string_view> path) const;
+
+    static bool ToDouble(std::string_view text, double& value);
+
+private:
+    enum State {
+        kStateValue,
+        kStateValueOrEnd,       // The first element, or the end of an empty array
+        kStateKeyOrEnd,         // The first key, or the end of an empty object
+        kStateKey,
+        kStateColon,
+        kStateAfterValue,
+        kStateString,
+        kStateLiteral,
+        kStateDone,
+        kStateError,
+    };
+
+    struct Frame {
+        bool array;
+        std::string key;        // Of the member being read, empty in an array
+    };
+
+    static constexpr size_t kMaxDepth = 16;
+
+    Handler& handler_;
+    size_t max_token_;
+    std::vector<Frame> frames_;
+    size_t depth_ = 0;          // What the handler sees, the containers or the path of the value
+    State state_ = kStateValue;
+    std::string token_;
+    bool reading_key_ = false;
+    bool escape_ = false;
+    int unicode_digits_ = -1;   // Of a \u escape, -1 outside of one
+    uint32_t unicode_ = 0;
+    uint32_t high_surrogate_ = 0;
+    const char* error_ = nullptr;
+
+    void Step(char c);
+    void BeginValue(char c);
+    void StringChar(char c);
+    void FinishLiteral();
+    void Push(bool array);
+    void Pop(bool array);
+    void AfterValue();
+    void Append(char c);
+    void AppendUtf8(uint32_t code_point);
+    void Fail(const char* error);
+};
+
+#endif // _JSON_READER_H_
@@ -0,0 +1,143 @@
+#include "json_writer.h"
+
+#include <cmath>
+#include <cstdio>
+
+void JsonWriter::BeforeValue() {
+    if (after_key_) {
+        after_key_ = false;
+        return;
+    }
+    if (has_items_ & (1u << depth_)) {
+        out_ += ',';
+    }
+    has_items_ |= 1u << depth_;
+}
+
+JsonWriter& JsonWriter::BeginObject() {
+    BeforeValue();
+    out_ += '{';
+    if (depth_ < kMaxDepth) {
+        depth_++;
+    }
+    has_items_ &= ~(1u << depth_);
+    return *this;
+}
+
+JsonWriter& JsonWriter::EndObject() {
+    out_ += '}';
+    if (depth_ > 0) {
+        depth_--;
+    }
+    return *this;
+}
+
+JsonWriter& JsonWriter::BeginArray() {
+    BeforeValue();
+    out_ += '[';
+    if (depth_ < kMaxDepth) {
+        depth_++;
+    }
+    has_items_ &= ~(1u << depth_);
+    return *this;
+}
+
+JsonWriter& JsonWriter::EndArray() {
+    out_ += ']';
+    if (depth_ > 0) {
+        depth_--;
+    }
+    return *this;
+}
+
+JsonWriter& JsonWriter::Key(std::string_view key) {
+    BeforeValue();
+    out_ += '"';
+    Escape(out_, key);
+    out_ += "\":";
+    after_key_ = true;
+    return *this;
+}
+
+JsonWriter& JsonWriter::String(std::string_view value) {
+    BeforeValue();
+    out_ += '"';
+    Escape(out_, value);
+    out_ += '"';
+    return *this;
+}
+
+JsonWriter& JsonWriter::Int(int64_t value) {
+    BeforeValue();
+    out_ += std::to_string(value);
+    return *this;
+}
+
+JsonWriter& JsonWriter::Double(double value) {
+    BeforeValue();
+    if (!std::isfinite(value)) {
+        out_ += "null";
+        return *this;
+    }
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%.15g", value);
+    out_ += buffer;
+    return *this;
+}
+
+JsonWriter& JsonWriter::Bool(bool value) {
+    BeforeValue();
+    out_ += value ? "true" : "false";
+    return *this;
+}
+
+JsonWriter& JsonWriter::Raw(std::string_view json) {
+    BeforeValue();
+    out_ += json;
+    return *this;
+}
+
+JsonWriter& JsonWriter::BeginString() {
+    BeforeValue();
+    out_ += '"';
+    return *this;
+}
+
+JsonWriter& JsonWriter::AppendString(std::string_view piece) {
+    Escape(out_, piece);
+    return *this;
+}
+
+JsonWriter& JsonWriter::EndString() {
+    out_ += '"';
+    return *this;
+}
+
+void JsonWriter::Escape(std::string& out, std::string_view value) {
+    size_t start = 0;
+    for (size_t i = 0; i < value.size(); i++) {
+        unsigned char c = value[i];
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        // Copy the run of plain characters at once
+        out.append(value.data() + start, i - start);
+        start = i + 1;
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\b': out += "\\b"; break;
+        case '\f': out += "\\f"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default: {
+            char buffer[8];
+            snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+            out += buffer;
+            break;
+        }
+        }
+    }
+    out.append(value.data() + start, value.size() - start);
+}
@@ -0,0 +1,52 @@
+#ifndef _JSON_WRITER_H_
+#define _JSON_WRITER_H_
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+
+/*
+ * Writes JSON straight into a string, for the large messages that would otherwise be
+ * built as a cJSON tree, printed and copied again.
+ *
+ * The commas are added as needed, the caller keeps the nesting balanced and writes a
+ * Key() before each value in an object. A string value may be written in pieces between
+ * BeginString() and EndString(), each piece is escaped as it is appended.
+ */
+class JsonWriter {
+public:
+    explicit JsonWriter(std::string& out) : out_(out) {}
+
+    JsonWriter& BeginObject();
+    JsonWriter& EndObject();
+    JsonWriter& BeginArray();
+    JsonWriter& EndArray();
+    JsonWriter& Key(std::string_view key);
+    JsonWriter& String(std::string_view value);
+    JsonWriter& Int(int64_t value);
+    JsonWriter& Double(double value);
+    JsonWriter& Bool(bool value);
+    // A value that is already serialized JSON
+    JsonWriter& Raw(std::string_view json);
+
+    JsonWriter& BeginString();
+    JsonWriter& AppendString(std::string_view piece);
+    JsonWriter& EndString();
+
+    // For a caller that knows roughly how much it is going to write
+    void Reserve(size_t size) { out_.reserve(out_.size() + size); }
+
+    static void Escape(std::string& out, std::string_view value);
+
+private:
+    static constexpr int kMaxDepth = 31;
+
+    std::string& out_;
+    int depth_ = 0;
+    uint32_t has_items_ = 0;    // Bit n is set once the container at depth n has an item
+    bool after_key_ = false;
+
+    void BeforeValue();
+};
+
+#endif // _JSON_WRITER_H_
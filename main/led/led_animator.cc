@@ -0,0 +1,126 @@
+#include "led_animator.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+LedAnimator::LedAnimator(led_strip_handle_t strip, int leds)
+    : strip_(strip), leds_(leds), frame_(leds), shown_(leds) {
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            static_cast<LedAnimator*>(arg)->OnTimer();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "led_animator",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer_));
+}
+
+LedAnimator::~LedAnimator() {
+    esp_timer_stop(timer_);
+    esp_timer_delete(timer_);
+}
+
+void LedAnimator::Play(const LedEffect& effect) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    esp_timer_stop(timer_);
+    effect_ = effect;
+    frame_number_ = 0;
+    // The first frame is shown right away
+    bool more = RenderLocked();
+    FlushLocked();
+    if (more && effect_.type != kLedEffectSolid) {
+        esp_timer_start_periodic(timer_, std::max(effect_.interval_ms, 1) * 1000);
+    }
+}
+
+void LedAnimator::SetAll(StripColor color) {
+    LedEffect effect;
+    effect.high = color;
+    Play(effect);
+}
+
+void LedAnimator::SetPixel(int index, StripColor color) {
+    if (index < 0 || index >= leds_) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    esp_timer_stop(timer_);
+    frame_ = shown_;
+    frame_[index] = color;
+    FlushLocked();
+}
+
+void LedAnimator::OnTimer() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    frame_number_++;
+    bool more = RenderLocked();
+    FlushLocked();
+    if (!more) {
+        esp_timer_stop(timer_);
+    }
+}
+
+bool LedAnimator::RenderLocked() {
+    const auto& low = effect_.low;
+    const auto& high = effect_.high;
+    switch (effect_.type) {
+    case kLedEffectSolid:
+        std::fill(frame_.begin(), frame_.end(), high);
+        return false;
+    case kLedEffectBlink: {
+        std::fill(frame_.begin(), frame_.end(), frame_number_ % 2 == 0 ? high : low);
+        return effect_.times < 0 || frame_number_ + 1 < (uint32_t)effect_.times * 2;
+    }
+    case kLedEffectBreathe: {
+        int steps = std::max({std::abs(high.red - low.red), std::abs(high.green - low.green),
+            std::abs(high.blue - low.blue)});
+        if (steps == 0) {
+            std::fill(frame_.begin(), frame_.end(), high);
+            return false;
+        }
+        int position = frame_number_ % (2 * steps);
+        int step = position <= steps ? position : 2 * steps - position;
+        StripColor color = {
+            (uint8_t)(low.red + (high.red - low.red) * step / steps),
+            (uint8_t)(low.green + (high.green - low.green) * step / steps),
+            (uint8_t)(low.blue + (high.blue - low.blue) * step / steps),
+        };
+        std::fill(frame_.begin(), frame_.end(), color);
+        return true;
+    }
+    case kLedEffectScroll: {
+        std::fill(frame_.begin(), frame_.end(), low);
+        int offset = frame_number_ % leds_;
+        for (int i = 0; i < std::min(effect_.length, leds_); i++) {
+            frame_[(offset + i) % leds_] = high;
+        }
+        return leds_ > 1;
+    }
+    case kLedEffectFadeOut: {
+        bool lit = false;
+        for (int i = 0; i < leds_; i++) {
+            frame_[i] = {(uint8_t)(shown_[i].red / 2), (uint8_t)(shown_[i].green / 2), (uint8_t)(shown_[i].blue / 2)};
+            lit = lit || frame_[i] != StripColor();
+        }
+        return lit;
+    }
+    }
+    return false;
+}
+
+void LedAnimator::FlushLocked() {
+    bool changed = false;
+    for (int i = 0; i < leds_; i++) {
+        if (frame_[i] != shown_[i]) {
+            led_strip_set_pixel(strip_, i, frame_[i].red, frame_[i].green, frame_[i].blue);
+            shown_[i] = frame_[i];
+            changed = true;
+        }
+    }
+    // A frame like the last one is not sent again
+    if (changed) {
+        led_strip_refresh(strip_);
+    }
+}
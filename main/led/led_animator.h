@@ -0,0 +1,71 @@
+#ifndef _LED_ANIMATOR_H_
+#define _LED_ANIMATOR_H_
+
+#include <led_strip.h>
+#include <esp_timer.h>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+struct StripColor {
+    uint8_t red = 0, green = 0, blue = 0;
+
+    bool operator==(const StripColor& other) const {
+        return red == other.red && green == other.green && blue == other.blue;
+    }
+    bool operator!=(const StripColor& other) const { return !(*this == other); }
+};
+
+enum LedEffectType {
+    kLedEffectSolid,
+    kLedEffectBlink,    // high and low in turn
+    kLedEffectBreathe,  // From low to high and back
+    kLedEffectScroll,   // length pixels of high moving over low
+    kLedEffectFadeOut,  // From the colors shown to off
+};
+
+struct LedEffect {
+    LedEffectType type = kLedEffectSolid;
+    StripColor low;
+    StripColor high;
+    int interval_ms = 100;  // Between the frames
+    int length = 1;         // Of a scroll
+    int times = -1;         // Blinks, -1 for ever
+};
+
+/*
+ * Plays the effects of a LED strip, shared by the strip LEDs.
+ *
+ * An effect is a function of its frame number, each frame is computed into a frame buffer
+ * and only the pixels that changed are written to the driver before a refresh. The frame
+ * timer runs only while an effect moves: a solid color is written once, and a blink with a
+ * count or a fade out stop the timer at their last frame, so a static strip costs no CPU and
+ * no wakeups.
+ */
+class LedAnimator {
+public:
+    LedAnimator(led_strip_handle_t strip, int leds);
+    ~LedAnimator();
+
+    void Play(const LedEffect& effect);
+    // Static colors, the effect playing is stopped
+    void SetAll(StripColor color);
+    void SetPixel(int index, StripColor color);
+
+private:
+    std::mutex mutex_;
+    led_strip_handle_t strip_;
+    int leds_;
+    std::vector<StripColor> frame_;     // The frame being computed
+    std::vector<StripColor> shown_;     // The frame on the strip
+    LedEffect effect_;
+    uint32_t frame_number_ = 0;
+    esp_timer_handle_t timer_ = nullptr;
+
+    void OnTimer();
+    // Returns false once the effect has shown its last frame
+    bool RenderLocked();
+    void FlushLocked();
+};
+
+#endif // _LED_ANIMATOR_H_
@@ -8,8 +8,6 @@
 #define HIGH_BRIGHTNESS 16
 #define LOW_BRIGHTNESS 2
 
-#define BLINK_INFINITE -1
-
 
 SingleLed::SingleLed(gpio_num_t gpio) {
     // If the gpio is not connected, you should use NoLed class
@@ -27,21 +25,11 @@ SingleLed::SingleLed(gpio_num_t gpio) {
     ESP_ERROR_CHECK(led_strip_new_rmt_device(&strip_config, &rmt_config, &led_strip_));
     led_strip_clear(led_strip_);
 
-    esp_timer_create_args_t blink_timer_args = {
-        .callback = [](void *arg) {
-            auto led = static_cast<SingleLed*>(arg);
-            led->OnBlinkTimer();
-        },
-        .arg = this,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "blink_timer",
-        .skip_unhandled_events = false,
-    };
-    ESP_ERROR_CHECK(esp_timer_create(&blink_timer_args, &blink_timer_));
+    animator_ = std::make_unique<LedAnimator>(led_strip_, 1);
 }
 
 SingleLed::~SingleLed() {
-    esp_timer_stop(blink_timer_);
+    animator_.reset();
     if (led_strip_ != nullptr) {
         led_strip_del(led_strip_);
     }
@@ -49,30 +37,15 @@ SingleLed::~SingleLed() {
 
 
 void SingleLed::SetColor(uint8_t r, uint8_t g, uint8_t b) {
-    r_ = r;
-    g_ = g;
-    b_ = b;
+    color_ = {r, g, b};
 }
 
 void SingleLed::TurnOn() {
-    if (led_strip_ == nullptr) {
-        return;
-    }
-    
-    std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
-    led_strip_set_pixel(led_strip_, 0, r_, g_, b_);
-    led_strip_refresh(led_strip_);
+    animator_->SetAll(color_);
 }
 
 void SingleLed::TurnOff() {
-    if (led_strip_ == nullptr) {
-        return;
-    }
-
-    std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
-    led_strip_clear(led_strip_);
+    animator_->SetAll(StripColor());
 }
 
 void SingleLed::BlinkOnce() {
@@ -80,39 +53,16 @@ void SingleLed::BlinkOnce() {
 }
 
 void SingleLed::Blink(int times, int interval_ms) {
-    StartBlinkTask(times, interval_ms);
+    LedEffect effect;
+    effect.type = kLedEffectBlink;
+    effect.high = color_;
+    effect.interval_ms = interval_ms;
+    effect.times = times;
+    animator_->Play(effect);
 }
 
 void SingleLed::StartContinuousBlink(int interval_ms) {
-    StartBlinkTask(BLINK_INFINITE, interval_ms);
-}
-
-void SingleLed::StartBlinkTask(int times, int interval_ms) {
-    if (led_strip_ == nullptr) {
-        return;
-    }
-
-    std::lock_guard<std::mutex> lock(mutex_);
-    esp_timer_stop(blink_timer_);
-    
-    blink_counter_ = times * 2;
-    blink_interval_ms_ = interval_ms;
-    esp_timer_start_periodic(blink_timer_, interval_ms * 1000);
-}
-
-void SingleLed::OnBlinkTimer() {
-    std::lock_guard<std::mutex> lock(mutex_);
-    blink_counter_--;
-    if (blink_counter_ & 1) {
-        led_strip_set_pixel(led_strip_, 0, r_, g_, b_);
-        led_strip_refresh(led_strip_);
-    } else {
-        led_strip_clear(led_strip_);
-
-        if (blink_counter_ == 0) {
-            esp_timer_stop(blink_timer_);
-        }
-    }
+    Blink(-1, interval_ms);
 }
 
 
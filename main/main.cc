@@ -9,11 +9,24 @@
 
 #include "application.h"
 #include "system_info.h"
+#include "boot_timeline.h"
+#include "trace_markers.h"
+#if CONFIG_AUDIO_BENCHMARK
+#include "board.h"
+#include "audio_benchmark.h"
+#endif
+#if CONFIG_DISPLAY_BENCHMARK
+#include "board.h"
+#include "display_benchmark.h"
+#endif
 
 #define TAG "main"
 
 extern "C" void app_main(void)
 {
+    BootTimeline::Mark("app_main");
+    TraceMarkers::Initialize();
+
     // Initialize NVS flash for WiFi configuration
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -23,6 +36,18 @@ extern "C" void app_main(void)
     }
     ESP_ERROR_CHECK(ret);
 
+#if CONFIG_AUDIO_BENCHMARK
+    // Benchmark the audio pipeline instead of starting the assistant
+    AudioBenchmark::Run(Board::GetInstance().GetAudioCodec());
+    return;
+#endif
+
+#if CONFIG_DISPLAY_BENCHMARK
+    // Benchmark the draw pipeline of the display instead of starting the assistant
+    DisplayBenchmark::Run(Board::GetInstance().GetDisplay());
+    return;
+#endif
+
     // Initialize and run the application
     auto& app = Application::GetInstance();
     app.Initialize();
@@ -0,0 +1,171 @@
+#include "main_loop_monitor.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#define TAG "MainLoopMonitor"
+
+MainLoopMonitor::~MainLoopMonitor() {
+    if (watchdog_timer_ != nullptr) {
+        esp_timer_stop(watchdog_timer_);
+        esp_timer_delete(watchdog_timer_);
+    }
+}
+
+void MainLoopMonitor::Start(int budget_ms) {
+    budget_us_ = (int64_t)budget_ms * 1000;
+    window_start_us_ = esp_timer_get_time();
+    if (budget_ms <= 0 || watchdog_timer_ != nullptr) {
+        return;
+    }
+
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            static_cast<MainLoopMonitor*>(arg)->CheckStall();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "main_loop_watchdog",
+        .skip_unhandled_events = true
+    };
+    esp_timer_create(&timer_args, &watchdog_timer_);
+    // Check twice per budget, a stall is reported at most half a budget late
+    esp_timer_start_periodic(watchdog_timer_, std::max<int64_t>(budget_us_ / 2, 10000));
+}
+
+void MainLoopMonitor::Begin(const char* name, uint32_t line) {
+    current_name_.store(name, std::memory_order_relaxed);
+    current_line_.store(line, std::memory_order_relaxed);
+    current_reported_.store(false, std::memory_order_relaxed);
+    current_start_us_.store(esp_timer_get_time(), std::memory_order_release);
+}
+
+void MainLoopMonitor::End() {
+    int64_t start_us = current_start_us_.exchange(0, std::memory_order_relaxed);
+    if (start_us == 0) {
+        return;
+    }
+    int64_t now_us = esp_timer_get_time();
+    int64_t duration_us = now_us - start_us;
+    auto name = current_name_.load(std::memory_order_relaxed);
+    auto line = current_line_.load(std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (now_us - window_start_us_ >= kWindowUs) {
+        window_ ^= 1;
+        histograms_[window_].fill(0);
+        window_start_us_ = now_us;
+    }
+    histograms_[window_][BucketOf(duration_us)]++;
+
+    bool over_budget = budget_us_ > 0 && duration_us > budget_us_;
+    auto site = FindSite(name, line);
+    if (site != nullptr) {
+        site->count++;
+        site->total_us += duration_us;
+        site->max_us = std::max<uint32_t>(site->max_us, std::min<int64_t>(duration_us, UINT32_MAX));
+        if (over_budget) {
+            site->over_budget++;
+        }
+    }
+    if (over_budget) {
+        stalls_++;
+        ESP_LOGW(TAG, "%s:%lu took %lld ms, budget %lld ms", BaseName(name), line, duration_us / 1000, budget_us_ / 1000);
+    }
+}
+
+void MainLoopMonitor::CheckStall() {
+    int64_t start_us = current_start_us_.load(std::memory_order_acquire);
+    if (start_us == 0 || current_reported_.load(std::memory_order_relaxed)) {
+        return;
+    }
+    int64_t elapsed_us = esp_timer_get_time() - start_us;
+    if (elapsed_us <= budget_us_) {
+        return;
+    }
+    // The handler may have just finished, then the name belongs to the next one, good enough for a log
+    current_reported_.store(true, std::memory_order_relaxed);
+    ESP_LOGW(TAG, "Main loop stalled for %lld ms in %s:%lu", elapsed_us / 1000,
+        BaseName(current_name_.load(std::memory_order_relaxed)), current_line_.load(std::memory_order_relaxed));
+}
+
+MainLoopMonitor::Site* MainLoopMonitor::FindSite(const char* name, uint32_t line) {
+    // The names are literals or source locations, comparing the pointers is enough
+    for (size_t i = 0; i < site_count_; i++) {
+        if (sites_[i].name == name && sites_[i].line == line) {
+            return &sites_[i];
+        }
+    }
+    if (site_count_ == kMaxSites) {
+        if (untracked_++ == 0) {
+            ESP_LOGW(TAG, "Site table is full, %s:%lu is not tracked", BaseName(name), line);
+        }
+        return nullptr;
+    }
+    auto& site = sites_[site_count_++];
+    site.name = name;
+    site.line = line;
+    return &site;
+}
+
+size_t MainLoopMonitor::BucketOf(int64_t duration_us) {
+    size_t bucket = 0;
+    for (int64_t limit_us = 1000; bucket < kBucketCount - 1 && duration_us >= limit_us; limit_us *= 2) {
+        bucket++;
+    }
+    return bucket;
+}
+
+const char* MainLoopMonitor::BaseName(const char* path) {
+    if (path == nullptr) {
+        return "unknown";
+    }
+    auto slash = strrchr(path, '/');
+    return slash != nullptr ? slash + 1 : path;
+}
+
+cJSON* MainLoopMonitor::GetSummaryJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "budget_ms", budget_us_ / 1000);
+    cJSON_AddNumberToObject(root, "stalls", stalls_);
+
+    auto histogram = cJSON_CreateArray();
+    for (size_t i = 0; i < kBucketCount; i++) {
+        auto item = cJSON_CreateObject();
+        if (i < kBucketCount - 1) {
+            cJSON_AddNumberToObject(item, "below_ms", 1 << i);
+        }
+        cJSON_AddNumberToObject(item, "count", histograms_[0][i] + histograms_[1][i]);
+        cJSON_AddItemToArray(histogram, item);
+    }
+    cJSON_AddItemToObject(root, "histogram", histogram);
+
+    std::array<const Site*, kMaxSites> slowest;
+    for (size_t i = 0; i < site_count_; i++) {
+        slowest[i] = &sites_[i];
+    }
+    size_t top = std::min(site_count_, kTopSites);
+    std::partial_sort(slowest.begin(), slowest.begin() + top, slowest.begin() + site_count_,
+        [](const Site* a, const Site* b) { return a->max_us > b->max_us; });
+
+    auto sites = cJSON_CreateArray();
+    for (size_t i = 0; i < top; i++) {
+        auto site = slowest[i];
+        auto item = cJSON_CreateObject();
+        std::string name = BaseName(site->name);
+        if (site->line != 0) {
+            name += ":" + std::to_string(site->line);
+        }
+        cJSON_AddStringToObject(item, "site", name.c_str());
+        cJSON_AddNumberToObject(item, "count", site->count);
+        cJSON_AddNumberToObject(item, "avg_us", site->count > 0 ? site->total_us / site->count : 0);
+        cJSON_AddNumberToObject(item, "max_us", site->max_us);
+        cJSON_AddNumberToObject(item, "over_budget", site->over_budget);
+        cJSON_AddItemToArray(sites, item);
+    }
+    cJSON_AddItemToObject(root, "slowest", sites);
+    return root;
+}
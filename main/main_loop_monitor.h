@@ -0,0 +1,97 @@
+#ifndef _MAIN_LOOP_MONITOR_H_
+#define _MAIN_LOOP_MONITOR_H_
+
+#include <esp_timer.h>
+#include <cJSON.h>
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+
+#include "trace_markers.h"
+
+/*
+ * Timing of the handlers run by the main loop.
+ *
+ * Every event handler and scheduled callback runs between Begin() and End(), keyed by a
+ * name and a line (the source location of the Schedule() call). The durations go into a
+ * log2 millisecond histogram of the last one to two minutes and a table of the sites seen so far.
+ * A watchdog timer logs the site still running once it goes over the budget, so a handler
+ * that never returns is found without a debugger.
+ *
+ * Begin() and End() are called by the main task, GetSummaryJson() by any task.
+ */
+class MainLoopMonitor {
+public:
+    MainLoopMonitor() = default;
+    ~MainLoopMonitor();
+
+    // 0 disables the watchdog, the timings are still collected
+    void Start(int budget_ms);
+    void Begin(const char* name, uint32_t line = 0);
+    void End();
+    // The caller owns the returned object
+    cJSON* GetSummaryJson();
+
+private:
+    static constexpr size_t kMaxSites = 32;
+    static constexpr size_t kBucketCount = 10;         // <1, <2, <4 ... <256 ms, and the rest
+    static constexpr int64_t kWindowUs = 60 * 1000 * 1000;
+    static constexpr size_t kTopSites = 8;
+
+    struct Site {
+        const char* name = nullptr;
+        uint32_t line = 0;
+        uint32_t count = 0;
+        uint32_t over_budget = 0;
+        uint32_t max_us = 0;
+        uint64_t total_us = 0;
+    };
+
+    esp_timer_handle_t watchdog_timer_ = nullptr;
+    int64_t budget_us_ = 0;
+    uint32_t stalls_ = 0;
+
+    // The running handler, read by the watchdog
+    std::atomic<int64_t> current_start_us_ = 0;        // 0 between handlers
+    std::atomic<const char*> current_name_ = nullptr;
+    std::atomic<uint32_t> current_line_ = 0;
+    std::atomic<bool> current_reported_ = false;
+
+    std::mutex mutex_;     // Guards the histograms and the sites
+    // Two windows, the older one is dropped when the current one is a window old
+    std::array<std::array<uint32_t, kBucketCount>, 2> histograms_ = {};
+    size_t window_ = 0;
+    int64_t window_start_us_ = 0;
+
+    std::array<Site, kMaxSites> sites_;
+    size_t site_count_ = 0;
+    uint32_t untracked_ = 0;
+
+    void CheckStall();
+    Site* FindSite(const char* name, uint32_t line);
+    static size_t BucketOf(int64_t duration_us);
+    static const char* BaseName(const char* path);
+};
+
+// Times the enclosing block as one main loop handler
+class MainLoopScope {
+public:
+    MainLoopScope(MainLoopMonitor& monitor, const char* name, uint32_t line = 0) : monitor_(monitor) {
+        monitor_.Begin(name, line);
+        TRACE_BEGIN(kTraceMainLoopEvent);
+    }
+    ~MainLoopScope() {
+        TRACE_END(kTraceMainLoopEvent);
+        monitor_.End();
+    }
+    MainLoopScope(const MainLoopScope&) = delete;
+    MainLoopScope& operator=(const MainLoopScope&) = delete;
+
+private:
+    MainLoopMonitor& monitor_;
+};
+
+#endif // _MAIN_LOOP_MONITOR_H_
@@ -0,0 +1,97 @@
+#include "main_scheduler.h"
+
+#include <esp_log.h>
+#include <cstring>
+
+#define TAG "MainScheduler"
+
+bool MainScheduler::HasSource(const Lane& lane, TaskHandle_t source) {
+    for (size_t i = 0; i < lane.count; i++) {
+        if (lane.ring[(lane.head + i) % kLaneCapacity].source == source) {
+            return true;
+        }
+    }
+    for (auto& entry : lane.overflow) {
+        if (entry.source == source) {
+            return true;
+        }
+    }
+    return false;
+}
+
+MainScheduler::Entry& MainScheduler::Last(Lane& lane) {
+    if (!lane.overflow.empty()) {
+        return lane.overflow.back();
+    }
+    return lane.ring[(lane.head + lane.count - 1) % kLaneCapacity];
+}
+
+void MainScheduler::Push(MainTask&& task, SchedulePriority priority, const char* coalesce_key, const std::source_location& site) {
+    TaskHandle_t source = xTaskGetCurrentTaskHandle();
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Wait behind the tasks this source queued before in less urgent lanes
+    for (int i = kSchedulePriorityCount - 1; i > priority; i--) {
+        if (HasSource(lanes_[i], source)) {
+            priority = static_cast<SchedulePriority>(i);
+            break;
+        }
+    }
+    auto& lane = lanes_[priority];
+    if (coalesce_key != nullptr && lane.count > 0) {
+        auto& last = Last(lane);
+        if (last.key != nullptr && strcmp(last.key, coalesce_key) == 0) {
+            last.task = std::move(task);
+            last.source = source;
+            last.site = site;
+            return;
+        }
+    }
+
+    if (lane.count < kLaneCapacity) {
+        auto& entry = lane.ring[(lane.head + lane.count) % kLaneCapacity];
+        entry.task = std::move(task);
+        entry.key = coalesce_key;
+        entry.source = source;
+        entry.site = site;
+        lane.count++;
+    } else {
+        if (lane.overflow.empty()) {
+            ESP_LOGW(TAG, "Lane %d is full, queueing on the heap", priority);
+        }
+        lane.overflow.push_back({std::move(task), coalesce_key, source, site});
+    }
+    pending_++;
+}
+
+bool MainScheduler::Pop(MainTask& task, std::source_location& site) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& lane : lanes_) {
+        if (lane.count == 0) {
+            continue;
+        }
+        auto& entry = lane.ring[lane.head];
+        task = std::move(entry.task);
+        site = entry.site;
+        entry.key = nullptr;
+        entry.source = nullptr;
+        lane.head = (lane.head + 1) % kLaneCapacity;
+        lane.count--;
+        if (!lane.overflow.empty()) {
+            auto& tail = lane.ring[(lane.head + lane.count) % kLaneCapacity];
+            tail.task = std::move(lane.overflow.front().task);
+            tail.key = lane.overflow.front().key;
+            tail.source = lane.overflow.front().source;
+            tail.site = lane.overflow.front().site;
+            lane.overflow.pop_front();
+            lane.count++;
+        }
+        pending_--;
+        return true;
+    }
+    return false;
+}
+
+size_t MainScheduler::pending() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pending_;
+}
@@ -0,0 +1,150 @@
+#ifndef _MAIN_SCHEDULER_H_
+#define _MAIN_SCHEDULER_H_
+
+#include <array>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <cstddef>
+#include <utility>
+#include <type_traits>
+#include <source_location>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+/*
+ * A callable run once by the main task.
+ *
+ * The callable is stored inline like in std::function, but with room for the captures the
+ * scheduled lambdas use (a few pointers and a string), so scheduling one does not touch
+ * the heap. A larger callable still works, it is moved to the heap.
+ */
+class MainTask {
+public:
+    static constexpr size_t kInlineSize = 8 * sizeof(void*);
+
+    MainTask() = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, MainTask>>>
+    MainTask(F&& callable) {
+        using T = std::decay_t<F>;
+        if constexpr (sizeof(T) <= kInlineSize && alignof(T) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<T>) {
+            new (storage_) T(std::forward<F>(callable));
+            ops_ = &kInlineOps<T>;
+        } else {
+            *reinterpret_cast<T**>(storage_) = new T(std::forward<F>(callable));
+            ops_ = &kHeapOps<T>;
+        }
+    }
+
+    MainTask(MainTask&& other) noexcept { MoveFrom(other); }
+    MainTask& operator=(MainTask&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            MoveFrom(other);
+        }
+        return *this;
+    }
+    MainTask(const MainTask&) = delete;
+    MainTask& operator=(const MainTask&) = delete;
+    ~MainTask() { Reset(); }
+
+    explicit operator bool() const { return ops_ != nullptr; }
+    void operator()() { ops_->invoke(storage_); }
+
+    void Reset() {
+        if (ops_ != nullptr) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        void (*move)(void* to, void* from);     // Leaves from destroyed
+        void (*destroy)(void* storage);
+    };
+
+    template <typename T>
+    static constexpr Ops kInlineOps = {
+        [](void* storage) { (*static_cast<T*>(storage))(); },
+        [](void* to, void* from) {
+            new (to) T(std::move(*static_cast<T*>(from)));
+            static_cast<T*>(from)->~T();
+        },
+        [](void* storage) { static_cast<T*>(storage)->~T(); },
+    };
+
+    template <typename T>
+    static constexpr Ops kHeapOps = {
+        [](void* storage) { (**static_cast<T**>(storage))(); },
+        [](void* to, void* from) { *static_cast<T**>(to) = *static_cast<T**>(from); },
+        [](void* storage) { delete *static_cast<T**>(storage); },
+    };
+
+    alignas(std::max_align_t) unsigned char storage_[kInlineSize];
+    const Ops* ops_ = nullptr;
+
+    void MoveFrom(MainTask& other) {
+        if (other.ops_ != nullptr) {
+            other.ops_->move(storage_, other.storage_);
+            ops_ = other.ops_;
+            other.ops_ = nullptr;
+        }
+    }
+};
+
+enum SchedulePriority {
+    kSchedulePriorityUrgent,        // State changes the user is waiting on
+    kSchedulePriorityNormal,
+    kSchedulePriorityBackground,    // UI refreshes and bookkeeping, run after everything else
+    kSchedulePriorityCount,
+};
+
+/*
+ * The queue of tasks for the main task, one FIFO lane per priority.
+ *
+ * Each lane keeps its tasks in a fixed ring and only spills to the heap when the ring is full.
+ * The tasks pushed from the same FreeRTOS task run in the order they were pushed: a task goes
+ * to a less urgent lane than its priority when one already holds a task from the same source.
+ * A task pushed with a coalescing key replaces the last task of its lane if that one has the
+ * same key, so a burst of updates to the same thing runs once with the latest value, and
+ * nothing queued between them is overtaken.
+ *
+ * Push() may be called from any task, Pop() from the main task.
+ */
+class MainScheduler {
+public:
+    // site is where the task was scheduled from, a coalesced task keeps the site of the latest push
+    void Push(MainTask&& task, SchedulePriority priority, const char* coalesce_key, const std::source_location& site);
+    // Takes the oldest task of the most urgent lane that has one
+    bool Pop(MainTask& task, std::source_location& site);
+    size_t pending();
+
+private:
+    static constexpr size_t kLaneCapacity = 16;
+
+    struct Entry {
+        MainTask task;
+        const char* key = nullptr;
+        TaskHandle_t source = nullptr;
+        std::source_location site;
+    };
+
+    struct Lane {
+        std::array<Entry, kLaneCapacity> ring;
+        size_t head = 0;
+        size_t count = 0;
+        std::deque<Entry> overflow;     // Older entries stay in the ring, so the lane stays FIFO
+    };
+
+    std::mutex mutex_;
+    std::array<Lane, kSchedulePriorityCount> lanes_;
+    size_t pending_ = 0;
+
+    static bool HasSource(const Lane& lane, TaskHandle_t source);
+    static Entry& Last(Lane& lane);
+};
+
+#endif // _MAIN_SCHEDULER_H_
@@ -17,9 +17,39 @@
 #include "settings.h"
 #include "lvgl_theme.h"
 #include "lvgl_display.h"
+#include "glyph_cache.h"
+#include "lvgl_memory.h"
+#include "asset_image_cache.h"
+#include "tts_cache.h"
+#include "protocol_trace.h"
+#include "http_pool.h"
+#include "wakeup_coalescer.h"
+#include "heap_monitor.h"
+#include "turn_timeline.h"
+#include "task_profile.h"
+#include "power_governor.h"
+#include "perf_profile.h"
+#include "i2c_bus_scheduler.h"
+#include "jpg/jpeg_to_image.h"
+#include "jpg/image_to_jpeg.h"
+#include "progressive_preview.h"
 
 #define TAG "MCP"
 
+// Long running tools are called by at most this many workers, beyond the queue they are refused
+#define MCP_TOOL_WORKERS 2
+#define MCP_TOOL_QUEUE_SIZE 4
+#define MCP_TOOL_WORKER_STACK_SIZE (4096 * 2)
+// Below the main task, like the audio tasks
+#define MCP_TOOL_WORKER_PRIORITY 2
+// A tool call that runs longer is logged with its queue wait
+#define MCP_SLOW_TOOL_CALL_MS 500
+
+// The long running tools/call of the calling worker
+thread_local std::shared_ptr<McpServer::McpCall> McpServer::current_call_;
+thread_local std::shared_ptr<McpServer::McpBatch> McpServer::current_batch_;
+std::atomic<uint32_t> McpServer::cache_generation_ = 0;
+
 McpServer::McpServer() {
 }
 
@@ -28,6 +58,7 @@ McpServer::~McpServer() {
         delete tool;
     }
     tools_.clear();
+    cJSON_Delete(last_status_);
 }
 
 void McpServer::AddCommonTools() {
@@ -49,8 +80,40 @@ void McpServer::AddCommonTools() {
         "2. As the first step to control the device (e.g. turn up / down the volume of the audio speaker, etc.)",
         PropertyList(),
         [&board](const PropertyList& properties) -> ReturnValue {
-            return board.GetDeviceStatusJson();
-        });
+            auto json = cJSON_Parse(board.GetDeviceStatusJson().c_str());
+            if (json == nullptr) {
+                return board.GetDeviceStatusJson();
+            }
+            auto& app = Application::GetInstance();
+#if CONFIG_AUDIO_LATENCY_TRACE
+            cJSON_AddItemToObject(json, "audio_latency", app.GetAudioService().latency_tracer().GetStatsJson());
+            cJSON_AddItemToObject(json, "audio_power", app.GetAudioService().GetPowerStatsJson());
+#endif
+            cJSON_AddItemToObject(json, "sound_cache", app.GetAudioService().sound_cache().GetStatsJson());
+#if CONFIG_TTS_CACHE
+            cJSON_AddItemToObject(json, "tts_cache", TtsCache::GetInstance().GetStatsJson());
+#endif
+            auto stats = app.GetTransportStats();
+            auto transport = cJSON_CreateObject();
+            cJSON_AddStringToObject(transport, "network", board.GetBoardType().c_str());
+            cJSON_AddNumberToObject(transport, "rtt_ms", stats.rtt_ms);
+            cJSON_AddNumberToObject(transport, "tx_packets", stats.tx_packets);
+            cJSON_AddNumberToObject(transport, "tx_failures", stats.tx_failures);
+            cJSON_AddNumberToObject(transport, "tx_bitrate_bps", stats.tx_bitrate_bps);
+            cJSON_AddNumberToObject(transport, "send_time_us", stats.send_time_us);
+            cJSON_AddNumberToObject(transport, "rx_packets", stats.rx_packets);
+            cJSON_AddNumberToObject(transport, "rx_lost", stats.rx_lost);
+            cJSON_AddNumberToObject(transport, "rx_reordered", stats.rx_reordered);
+            cJSON_AddNumberToObject(transport, "rx_bitrate_bps", stats.rx_bitrate_bps);
+            cJSON_AddItemToObject(json, "transport", transport);
+            cJSON_AddItemToObject(json, "http_pool", HttpPool::GetInstance().GetStatsJson());
+            cJSON_AddItemToObject(json, "wakeups", WakeupCoalescer::GetInstance().GetStatsJson());
+            auto str = cJSON_PrintUnformatted(json);
+            std::string status(str);
+            cJSON_free(str);
+            cJSON_Delete(json);
+            return status;
+        })->set_cache_ttl(1000);
 
     AddTool("self.audio_speaker.set_volume", 
         "Set the volume of the audio speaker. If the current volume is unknown, you must call `self.get_device_status` tool first and then call this tool.",
@@ -115,14 +178,18 @@ void McpServer::AddCommonTools() {
                 if (!camera->Capture()) {
                     throw std::runtime_error("Failed to capture photo");
                 }
+                if (McpServer::IsCallCancelled()) {
+                    throw std::runtime_error("Cancelled");
+                }
                 auto question = properties["question"].value<std::string>();
                 return camera->Explain(question);
-            });
+            }, true)->set_exclusive(true);
     }
 #endif
 
     // Restore the original tools list to the end of the tools list
     tools_.insert(tools_.end(), original_tools.begin(), original_tools.end());
+    InvalidateToolsList();
 }
 
 void McpServer::AddUserOnlyTools() {
@@ -132,9 +199,57 @@ void McpServer::AddUserOnlyTools() {
         PropertyList(),
         [this](const PropertyList& properties) -> ReturnValue {
             auto& board = Board::GetInstance();
-            return board.GetSystemInfoJson();
+            auto json = cJSON_Parse(board.GetSystemInfoJson().c_str());
+            if (json == nullptr) {
+                return board.GetSystemInfoJson();
+            }
+            cJSON_AddItemToObject(json, "main_loop", Application::GetInstance().GetMainLoopMonitor().GetSummaryJson());
+            return json;
+        })->set_cache_ttl(5000);
+
+    AddUserOnlyTool("self.get_performance_stats",
+        "Get the performance counters of the subsystems, the CPU usage of the tasks and the MCP tool calls",
+        PropertyList(),
+        [this](const PropertyList& properties) -> ReturnValue {
+            auto json = PerfCounters::GetInstance().GetStatsJson();
+            cJSON_AddItemToObject(json, "heap", HeapMonitor::GetInstance().GetStatsJson());
+            cJSON_AddItemToObject(json, "task_stacks", TaskProfiles::GetStackUsageJson());
+            cJSON_AddItemToObject(json, "main_loop", Application::GetInstance().GetMainLoopMonitor().GetSummaryJson());
+            cJSON_AddItemToObject(json, "mcp_tools", GetToolStatsJson());
+            cJSON_AddItemToObject(json, "power", PowerGovernor::GetInstance().GetStatsJson());
+            auto network_power = Board::GetInstance().GetNetworkPowerStatsJson();
+            if (network_power != nullptr) {
+                cJSON_AddItemToObject(json, "network_power", network_power);
+            }
+            cJSON_AddItemToObject(json, "i2c_buses", I2cBusScheduler::GetInstance().GetStatsJson());
+            cJSON_AddItemToObject(json, "speaker_dsp", Application::GetInstance().GetAudioService().GetSpeakerDspStatsJson());
+            cJSON_AddItemToObject(json, "uplink_agc", Application::GetInstance().GetAudioService().GetUplinkAgcStatsJson());
+            cJSON_AddItemToObject(json, "turn_latency", TurnTimeline::GetInstance().GetStatsJson());
+            cJSON_AddItemToObject(json, "lvgl_memory", LvglMemory::GetStatsJson());
+            cJSON_AddItemToObject(json, "display_queue", Application::GetInstance().GetDisplayQueue().GetStatsJson());
+            cJSON_AddItemToObject(json, "network_tx", Application::GetInstance().GetNetworkTx().GetStatsJson());
+            cJSON_AddItemToObject(json, "performance_profile", PerfProfile::GetInstance().GetStatsJson());
+            auto processor = Application::GetInstance().GetAudioService().GetAudioProcessorStatsJson();
+            if (processor != nullptr) {
+                cJSON_AddItemToObject(json, "audio_processor", processor);
+            }
+            return json;
         });
 
+#if CONFIG_AUDIO_LATENCY_SELF_TEST
+    AddUserOnlyTool("self.audio.latency_test",
+        "Play a chirp on the speaker and record it with the microphone, to measure the output and input latency of the board "
+        "and how far the microphone lags the AEC reference. Run it in a quiet room, with nothing playing, at a normal volume.",
+        PropertyList(),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto json = Application::GetInstance().GetAudioService().RunLatencyTest();
+            if (json == nullptr) {
+                throw std::runtime_error("Audio is playing, or no memory for the recordings");
+            }
+            return json;
+        }, true)->set_exclusive(true);
+#endif
+
     AddUserOnlyTool("self.reboot", "Reboot the system",
         PropertyList(),
         [this](const PropertyList& properties) -> ReturnValue {
@@ -148,6 +263,55 @@ void McpServer::AddUserOnlyTools() {
             return true;
         });
 
+#if CONFIG_PROTOCOL_TRACE
+    if (ProtocolTrace::GetInstance().available()) {
+        AddUserOnlyTool("self.trace.start_capture", "Start recording the messages of the sessions to the trace partition, for a replay",
+            PropertyList(),
+            [](const PropertyList& properties) -> ReturnValue {
+                if (!ProtocolTrace::GetInstance().StartCapture()) {
+                    throw std::runtime_error("Failed to start the capture");
+                }
+                return true;
+            });
+
+        AddUserOnlyTool("self.trace.stop_capture", "Stop recording and save the trace",
+            PropertyList(),
+            [](const PropertyList& properties) -> ReturnValue {
+                uint32_t records = 0;
+                uint32_t bytes = 0;
+                if (!ProtocolTrace::GetInstance().StopCapture(records, bytes)) {
+                    throw std::runtime_error("No trace was saved");
+                }
+                auto json = cJSON_CreateObject();
+                cJSON_AddNumberToObject(json, "records", records);
+                cJSON_AddNumberToObject(json, "bytes", bytes);
+                return json;
+            }, true);
+
+        AddUserOnlyTool("self.trace.replay", "Reboot and replay the saved trace into the device, get the report with self.trace.get_report once it is done",
+            PropertyList(),
+            [](const PropertyList& properties) -> ReturnValue {
+                ProtocolTrace::GetInstance().RequestReplay();
+                auto& app = Application::GetInstance();
+                app.Schedule([&app]() {
+                    vTaskDelay(pdMS_TO_TICKS(1000));
+                    app.Reboot();
+                });
+                return true;
+            });
+
+        AddUserOnlyTool("self.trace.get_report", "The processing times of the last replay by message kind, with the performance counters",
+            PropertyList(),
+            [](const PropertyList& properties) -> ReturnValue {
+                auto json = ProtocolTrace::GetInstance().GetReportJson();
+                if (json == nullptr) {
+                    throw std::runtime_error("No replay has ended since the boot");
+                }
+                return json;
+            });
+    }
+#endif
+
     // Firmware upgrade
     AddUserOnlyTool("self.upgrade_firmware", "Upgrade firmware from a specific URL. This will download and install the firmware, then reboot the device.",
         PropertyList({
@@ -156,15 +320,15 @@ void McpServer::AddUserOnlyTools() {
         [this](const PropertyList& properties) -> ReturnValue {
             auto url = properties["url"].value<std::string>();
             ESP_LOGI(TAG, "User requested firmware upgrade from URL: %s", url.c_str());
-            
+
+            // The reply goes out first, the progress follows as notifications/message of "ota"
             auto& app = Application::GetInstance();
             app.Schedule([url, &app]() {
-                bool success = app.UpgradeFirmware(url);
-                if (!success) {
+                if (!app.UpgradeFirmware(url)) {
                     ESP_LOGE(TAG, "Firmware upgrade failed");
+                    McpServer::NotifyLog("ota", "Firmware upgrade failed");
                 }
             });
-            
             return true;
         });
 
@@ -183,32 +347,75 @@ void McpServer::AddUserOnlyTools() {
                 } else {
                     cJSON_AddBoolToObject(json, "monochrome", false);
                 }
+                auto flush_stats = display->GetFlushStatsJson();
+                if (flush_stats != nullptr) {
+                    cJSON_AddItemToObject(json, "flush", flush_stats);
+                }
+                cJSON_AddItemToObject(json, "glyph_cache", GlyphCache::GetInstance().GetStatsJson());
+                cJSON_AddItemToObject(json, "asset_image_cache", AssetImageCache::GetInstance().GetStatsJson());
+#ifndef CONFIG_IDF_TARGET_ESP32
+                // The encoders behind the snapshots
+                image_to_jpeg_stats_t stats[2];
+                size_t count = image_to_jpeg_get_stats(stats, 2);
+                auto encoders = cJSON_CreateArray();
+                for (size_t i = 0; i < count; i++) {
+                    auto encoder = cJSON_CreateObject();
+                    cJSON_AddStringToObject(encoder, "name", stats[i].name);
+                    cJSON_AddNumberToObject(encoder, "count", stats[i].count);
+                    cJSON_AddNumberToObject(encoder, "failures", stats[i].failures);
+                    cJSON_AddNumberToObject(encoder, "last_ms", stats[i].last_us / 1000.0);
+                    cJSON_AddNumberToObject(encoder, "average_ms", stats[i].count > 0 ? stats[i].total_us / 1000.0 / stats[i].count : 0);
+                    cJSON_AddItemToArray(encoders, encoder);
+                }
+                cJSON_AddItemToObject(json, "jpeg_encoders", encoders);
+#endif
                 return json;
             });
 
 #if CONFIG_LV_USE_SNAPSHOT
-        AddUserOnlyTool("self.screen.snapshot", "Snapshot the screen and upload it to a specific URL",
+        AddUserOnlyTool("self.screen.snapshot", "Snapshot the screen and upload it to a specific URL.\n"
+            "Without an URL the JPEG is returned as the image of the result.",
             PropertyList({
-                Property("url", kPropertyTypeString),
+                Property("url", kPropertyTypeString, std::string()),
                 Property("quality", kPropertyTypeInteger, 80, 1, 100)
             }),
             [display](const PropertyList& properties) -> ReturnValue {
                 auto url = properties["url"].value<std::string>();
                 auto quality = properties["quality"].value<int>();
 
-                std::string jpeg_data;
-                if (!display->SnapshotToJpeg(jpeg_data, quality)) {
-                    throw std::runtime_error("Failed to snapshot screen");
+                if (url.empty()) {
+                    // Sent as blob frames while it is encoded, or kept for the base64 of the reply
+                    if (McpBlobWriter::available()) {
+                        McpBlobWriter blob;
+                        bool encoded = display->SnapshotToJpeg([&blob](const void* data, size_t size) {
+                            return blob.Write(data, size);
+                        }, quality);
+                        if (!encoded || !blob.Finish()) {
+                            throw std::runtime_error("Failed to snapshot screen");
+                        }
+                        ESP_LOGI(TAG, "Sent snapshot of %u bytes as blob %lu", blob.size(), blob.id());
+                        return new ImageContent("image/jpeg", blob.id(), blob.size());
+                    }
+                    std::string jpeg;
+                    bool encoded = display->SnapshotToJpeg([&jpeg](const void* data, size_t size) {
+                        jpeg.append(static_cast<const char*>(data), size);
+                        return true;
+                    }, quality);
+                    if (!encoded) {
+                        throw std::runtime_error("Failed to snapshot screen");
+                    }
+                    return new ImageContent("image/jpeg", std::move(jpeg));
                 }
 
-                ESP_LOGI(TAG, "Upload snapshot %u bytes to %s", jpeg_data.size(), url.c_str());
-                
+                ESP_LOGI(TAG, "Upload snapshot to %s", url.c_str());
+
                 // 构造multipart/form-data请求体
                 std::string boundary = "----ESP32_SCREEN_SNAPSHOT_BOUNDARY";
-                
-                auto http = Board::GetInstance().GetNetwork()->CreateHttp(3);
-                http->SetHeader("Content-Type", "multipart/form-data; boundary=" + boundary);
-                if (!http->Open("POST", url)) {
+
+                auto http = HttpPool::GetInstance().Open("POST", url, "snapshot", 3, [&boundary](Http* http) {
+                    http->SetHeader("Content-Type", "multipart/form-data; boundary=" + boundary);
+                });
+                if (!http) {
                     throw std::runtime_error("Failed to open URL: " + url);
                 }
                 {
@@ -218,28 +425,50 @@ void McpServer::AddUserOnlyTools() {
                     file_header += "Content-Disposition: form-data; name=\"file\"; filename=\"screenshot.jpg\"\r\n";
                     file_header += "Content-Type: image/jpeg\r\n";
                     file_header += "\r\n";
-                    http->Write(file_header.c_str(), file_header.size());
+                    if (http->Write(file_header.c_str(), file_header.size()) != (int)file_header.size()) {
+                        http->Close();
+                        throw std::runtime_error("Failed to upload snapshot");
+                    }
                 }
 
-                // JPEG数据
-                http->Write((const char*)jpeg_data.data(), jpeg_data.size());
+                // JPEG数据，边编码边上传，不保存整张图片
+                size_t jpeg_size = 0;
+                bool written = true;
+                bool encoded = display->SnapshotToJpeg([&http, &jpeg_size, &written](const void* data, size_t size) {
+                    // A short write stops the encoder, the request is broken anyway
+                    written = http->Write(static_cast<const char*>(data), size) == (int)size;
+                    jpeg_size += size;
+                    return written;
+                }, quality);
+                if (!written) {
+                    http->Close();
+                    throw std::runtime_error("Failed to upload snapshot");
+                }
+                if (!encoded) {
+                    http->Close();
+                    throw std::runtime_error("Failed to snapshot screen");
+                }
+                ESP_LOGI(TAG, "Uploaded snapshot of %u bytes", jpeg_size);
 
                 {
                     // multipart尾部
                     std::string multipart_footer;
                     multipart_footer += "\r\n--" + boundary + "--\r\n";
-                    http->Write(multipart_footer.c_str(), multipart_footer.size());
+                    if (http->Write(multipart_footer.c_str(), multipart_footer.size()) != (int)multipart_footer.size() ||
+                        http->Write("", 0) < 0) {
+                        http->Close();
+                        throw std::runtime_error("Failed to upload snapshot");
+                    }
                 }
-                http->Write("", 0);
 
                 if (http->GetStatusCode() != 200) {
                     throw std::runtime_error("Unexpected status code: " + std::to_string(http->GetStatusCode()));
                 }
                 std::string result = http->ReadAll();
-                http->Close();
+                HttpPool::GetInstance().Release(url, "snapshot", 3, std::move(http));
                 ESP_LOGI(TAG, "Snapshot screen result: %s", result.c_str());
                 return true;
-            });
+            }, true)->set_exclusive(true);
         
         AddUserOnlyTool("self.screen.preview_image", "Preview an image on the screen",
             PropertyList({
@@ -247,9 +476,8 @@ void McpServer::AddUserOnlyTools() {
             }),
             [display](const PropertyList& properties) -> ReturnValue {
                 auto url = properties["url"].value<std::string>();
-                auto http = Board::GetInstance().GetNetwork()->CreateHttp(3);
-
-                if (!http->Open("GET", url)) {
+                auto http = HttpPool::GetInstance().Open("GET", url, "preview", 3);
+                if (!http) {
                     throw std::runtime_error("Failed to open URL: " + url);
                 }
                 int status_code = http->GetStatusCode();
@@ -258,28 +486,84 @@ void McpServer::AddUserOnlyTools() {
                 }
 
                 size_t content_length = http->GetBodyLength();
-                char* data = (char*)heap_caps_malloc(content_length, MALLOC_CAP_8BIT);
+                char* data = (char*)HeapMonitor::GetInstance().Malloc(kHeapTagMcp, content_length, MALLOC_CAP_8BIT);
                 if (data == nullptr) {
                     throw std::runtime_error("Failed to allocate memory for image: " + url);
                 }
+#ifdef CONFIG_PREVIEW_IMAGE_PROGRESSIVE
+                // The decoder may read ahead of the download, into zeros
+                memset(data, 0, content_length);
+                ProgressivePreview progressive(display, (const uint8_t*)data, content_length);
+                bool progressing = content_length > 0;
+#endif
                 size_t total_read = 0;
                 while (total_read < content_length) {
                     int ret = http->Read(data + total_read, content_length - total_read);
                     if (ret < 0) {
-                        heap_caps_free(data);
+                        HeapMonitor::GetInstance().Free(kHeapTagMcp, data);
                         throw std::runtime_error("Failed to download image: " + url);
                     }
                     if (ret == 0) {
                         break;
                     }
                     total_read += ret;
+                    if (McpServer::IsCallCancelled()) {
+                        HeapMonitor::GetInstance().Free(kHeapTagMcp, data);
+                        throw std::runtime_error("Cancelled");
+                    }
+                    McpServer::ReportProgress(total_read, content_length);
+#ifdef CONFIG_PREVIEW_IMAGE_PROGRESSIVE
+                    if (progressing) {
+                        progressing = progressive.Feed(total_read);
+                    }
+#endif
+                }
+                if (total_read == content_length) {
+                    HttpPool::GetInstance().Release(url, "preview", 3, std::move(http));
+                } else {
+                    http->Close();
                 }
-                http->Close();
 
-                auto image = std::make_unique<LvglAllocatedImage>(data, content_length);
+#ifdef CONFIG_PREVIEW_IMAGE_PROGRESSIVE
+                if (progressive.done()) {
+                    HeapMonitor::GetInstance().Free(kHeapTagMcp, data);
+                    return true;
+                }
+#endif
+
+                std::unique_ptr<LvglAllocatedImage> image;
+#ifndef CONFIG_IDF_TARGET_ESP32
+                if (total_read > 2 && (uint8_t)data[0] == 0xFF && (uint8_t)data[1] == 0xD8) {
+                    // Decode the JPEG once at the screen size instead of full size on every draw
+                    uint8_t* pixels = nullptr;
+                    size_t pixels_size, width, height, stride;
+                    esp_err_t err = jpeg_to_image_fit((const uint8_t*)data, total_read, display->width(), display->height(),
+                        &pixels, &pixels_size, &width, &height, &stride);
+                    HeapMonitor::GetInstance().Free(kHeapTagMcp, data);
+                    if (err != ESP_OK) {
+                        throw std::runtime_error("Failed to decode image: " + url);
+                    }
+                    image = std::make_unique<LvglAllocatedImage>(pixels, pixels_size, width, height, stride, LV_COLOR_FORMAT_RGB565);
+                }
+#endif
+                if (image == nullptr) {
+                    // A PNG or QOI is decoded once too, LVGL would decode it on every draw,
+                    // and its pixels must not be cached by their address, which is freed with the preview
+                    image = AssetImageCache::DecodeImage(data, total_read);
+                    if (image != nullptr || AssetImageCache::IsCompressed(data, total_read)) {
+                        HeapMonitor::GetInstance().Free(kHeapTagMcp, data);
+                        if (image == nullptr) {
+                            throw std::runtime_error("Failed to decode image: " + url);
+                        }
+                    }
+                }
+                if (image == nullptr) {
+                    HeapMonitor::GetInstance().Disown(kHeapTagMcp, data);
+                    image = std::make_unique<LvglAllocatedImage>(data, total_read);
+                }
                 display->SetPreviewImage(std::move(image));
                 return true;
-            });
+            }, true)->set_exclusive(true);
 #endif // CONFIG_LV_USE_SNAPSHOT
     }
 #endif // HAVE_LVGL
@@ -309,16 +593,24 @@ void McpServer::AddTool(McpTool* tool) {
 
     ESP_LOGI(TAG, "Add tool: %s%s", tool->name().c_str(), tool->user_only() ? " [user]" : "");
     tools_.push_back(tool);
+    InvalidateToolsList();
 }
 
-void McpServer::AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback) {
-    AddTool(new McpTool(name, description, properties, callback));
+McpTool* McpServer::AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback, bool long_running, uint32_t stack_size) {
+    auto tool = new McpTool(name, description, properties, callback);
+    tool->set_long_running(long_running);
+    tool->set_stack_size(stack_size);
+    AddTool(tool);
+    return tool;
 }
 
-void McpServer::AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback) {
+McpTool* McpServer::AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback, bool long_running, uint32_t stack_size) {
     auto tool = new McpTool(name, description, properties, callback);
     tool->set_user_only(true);
+    tool->set_long_running(long_running);
+    tool->set_stack_size(stack_size);
     AddTool(tool);
+    return tool;
 }
 
 void McpServer::ParseMessage(const std::string& message) {
@@ -332,6 +624,14 @@ void McpServer::ParseMessage(const std::string& message) {
 }
 
 void McpServer::ParseCapabilities(const cJSON* capabilities) {
+    auto chunking = cJSON_GetObjectItem(capabilities, "chunking");
+    if (cJSON_IsObject(chunking)) {
+        auto max_size = cJSON_GetObjectItem(chunking, "max_size");
+        if (cJSON_IsNumber(max_size) && max_size->valueint > 0) {
+            chunk_size_ = std::max(max_size->valueint, MCP_CHUNK_MIN_SIZE);
+        }
+    }
+
     auto vision = cJSON_GetObjectItem(capabilities, "vision");
     if (cJSON_IsObject(vision)) {
         auto url = cJSON_GetObjectItem(vision, "url");
@@ -351,6 +651,105 @@ void McpServer::ParseCapabilities(const cJSON* capabilities) {
 }
 
 void McpServer::ParseMessage(const cJSON* json) {
+    if (cJSON_IsArray(json)) {
+        ParseBatch(json);
+        return;
+    }
+    HandleRequest(json, nullptr);
+}
+
+bool McpServer::IsRequest(const cJSON* json) {
+    auto version = cJSON_GetObjectItem(json, "jsonrpc");
+    auto method = cJSON_GetObjectItem(json, "method");
+    auto params = cJSON_GetObjectItem(json, "params");
+    auto id = cJSON_GetObjectItem(json, "id");
+    return cJSON_IsString(version) && strcmp(version->valuestring, "2.0") == 0
+        && cJSON_IsString(method) && strncmp(method->valuestring, "notifications", 13) != 0
+        && (params == nullptr || cJSON_IsObject(params)) && cJSON_IsNumber(id);
+}
+
+void McpServer::ParseBatch(const cJSON* json) {
+    if (cJSON_GetArraySize(json) == 0) {
+        ESP_LOGE(TAG, "Empty batch");
+        return;
+    }
+
+    // Count the requests that get a reply before any of them can finish
+    auto batch = std::make_shared<McpBatch>();
+    cJSON* item;
+    cJSON_ArrayForEach(item, json) {
+        if (!IsRequest(item)) {
+            continue;
+        }
+        int id = cJSON_GetObjectItem(item, "id")->valueint;
+        // A repeated id is answered on its own
+        if (std::find(batch->ids.begin(), batch->ids.end(), id) == batch->ids.end()) {
+            batch->ids.push_back(id);
+            batch->pending++;
+        }
+    }
+
+    // The quick tools of the batch run in one go on the main task
+    std::vector<std::function<void()>> main_calls;
+    current_batch_ = batch;
+    cJSON_ArrayForEach(item, json) {
+        HandleRequest(item, &main_calls);
+    }
+    current_batch_.reset();
+    if (!main_calls.empty()) {
+        Application::GetInstance().Schedule([batch, calls = std::move(main_calls)]() {
+            current_batch_ = batch;
+            for (auto& call : calls) {
+                call();
+            }
+            current_batch_.reset();
+        });
+    }
+    AddToBatch(*batch, std::string());
+}
+
+void McpServer::SendReply(int id, std::string&& payload) {
+    auto& batch = current_batch_;
+    bool batched = false;
+    if (batch) {
+        std::lock_guard<std::mutex> lock(batch->mutex);
+        auto it = std::find(batch->ids.begin(), batch->ids.end(), id);
+        if (it != batch->ids.end()) {
+            batch->ids.erase(it);
+            batched = true;
+        }
+    }
+    if (batched) {
+        AddToBatch(*batch, std::move(payload));
+    } else if (!payload.empty()) {
+        Application::GetInstance().SendMcpMessage(std::move(payload));
+    }
+}
+
+void McpServer::AddToBatch(McpBatch& batch, std::string&& payload) {
+    std::string replies;
+    {
+        std::lock_guard<std::mutex> lock(batch.mutex);
+        if (!payload.empty()) {
+            if (batch.replies.size() > 1) {
+                batch.replies += ',';
+            }
+            batch.replies += payload;
+        }
+        if (--batch.pending > 0) {
+            return;
+        }
+        replies = std::move(batch.replies);
+        batch.ids.clear();
+    }
+    // A batch of notifications only gets no reply
+    if (replies.size() > 1) {
+        replies += ']';
+        Application::GetInstance().SendMcpMessage(std::move(replies));
+    }
+}
+
+void McpServer::HandleRequest(const cJSON* json, std::vector<std::function<void()>>* main_calls) {
     // Check JSONRPC version
     auto version = cJSON_GetObjectItem(json, "jsonrpc");
     if (version == nullptr || !cJSON_IsString(version) || strcmp(version->valuestring, "2.0") != 0) {
@@ -366,6 +765,13 @@ void McpServer::ParseMessage(const cJSON* json) {
     }
     
     auto method_str = std::string(method->valuestring);
+    if (method_str == "notifications/cancelled") {
+        auto request_id = cJSON_GetObjectItem(cJSON_GetObjectItem(json, "params"), "requestId");
+        if (cJSON_IsNumber(request_id)) {
+            CancelCall(request_id->valueint);
+        }
+        return;
+    }
     if (method_str.find("notifications") == 0) {
         return;
     }
@@ -385,14 +791,22 @@ void McpServer::ParseMessage(const cJSON* json) {
     auto id_int = id->valueint;
     
     if (method_str == "initialize") {
+        // A new session starts without subscriptions or chunking
+        status_subscribed_ = false;
+        chunk_size_ = 0;
         if (cJSON_IsObject(params)) {
             auto capabilities = cJSON_GetObjectItem(params, "capabilities");
             if (cJSON_IsObject(capabilities)) {
                 ParseCapabilities(capabilities);
             }
         }
+        Application::GetInstance().SetMcpChunkSize(chunk_size_);
         auto app_desc = esp_app_get_description();
-        std::string message = "{\"protocolVersion\":\"2024-11-05\",\"capabilities\":{\"tools\":{}},\"serverInfo\":{\"name\":\"" BOARD_NAME "\",\"version\":\"";
+        std::string message = "{\"protocolVersion\":\"2024-11-05\",\"capabilities\":{\"tools\":{},\"resources\":{\"subscribe\":true}";
+        if (chunk_size_ > 0) {
+            message += ",\"chunking\":{\"max_size\":" + std::to_string(chunk_size_) + "}";
+        }
+        message += "},\"serverInfo\":{\"name\":\"" BOARD_NAME "\",\"version\":\"";
         message += app_desc->version;
         message += "\"}}";
         ReplyResult(id_int, message);
@@ -428,7 +842,9 @@ void McpServer::ParseMessage(const cJSON* json) {
             ReplyError(id_int, "Invalid arguments");
             return;
         }
-        DoToolCall(id_int, std::string(tool_name->valuestring), tool_arguments);
+        DoToolCall(id_int, std::string(tool_name->valuestring), tool_arguments, cJSON_GetObjectItem(params, "_meta"), main_calls);
+    } else if (method_str.find("resources/") == 0) {
+        HandleResourceRequest(id_int, method_str, params);
     } else {
         ESP_LOGE(TAG, "Method not implemented: %s", method_str.c_str());
         ReplyError(id_int, "Method not implemented: " + method_str);
@@ -436,128 +852,631 @@ void McpServer::ParseMessage(const cJSON* json) {
 }
 
 void McpServer::ReplyResult(int id, const std::string& result) {
-    std::string payload = "{\"jsonrpc\":\"2.0\",\"id\":";
-    payload += std::to_string(id) + ",\"result\":";
-    payload += result;
-    payload += "}";
-    Application::GetInstance().SendMcpMessage(payload);
+    std::string payload;
+    payload.reserve(result.size() + 40);
+    JsonWriter writer(payload);
+    writer.BeginObject().Key("jsonrpc").String("2.0").Key("id").Int(id).Key("result").Raw(result).EndObject();
+    SendReply(id, std::move(payload));
 }
 
 void McpServer::ReplyError(int id, const std::string& message) {
-    std::string payload = "{\"jsonrpc\":\"2.0\",\"id\":";
-    payload += std::to_string(id);
-    payload += ",\"error\":{\"message\":\"";
-    payload += message;
-    payload += "\"}}";
-    Application::GetInstance().SendMcpMessage(payload);
+    std::string payload;
+    JsonWriter writer(payload);
+    writer.BeginObject().Key("jsonrpc").String("2.0").Key("id").Int(id)
+        .Key("error").BeginObject().Key("message").String(message).EndObject()
+        .EndObject();
+    SendReply(id, std::move(payload));
+}
+
+void McpServer::InvokeTool(McpTool* tool, const PropertyList& arguments, JsonWriter& writer, int64_t queued_time_us) {
+    auto& stats = tool->stats();
+    int64_t start_us = esp_timer_get_time();
+    uint32_t queue_ms = (start_us - queued_time_us) / 1000;
+    stats.calls.Add();
+    stats.queue_ms.Record(queue_ms);
+    try {
+        tool->Call(arguments, writer);
+    } catch (const std::exception&) {
+        stats.errors.Add();
+        uint32_t run_ms = (esp_timer_get_time() - start_us) / 1000;
+        stats.run_ms.Record(run_ms);
+        if (run_ms >= MCP_SLOW_TOOL_CALL_MS) {
+            ESP_LOGW(TAG, "Slow tool call: %s failed after %lu ms, queued %lu ms", tool->name().c_str(), run_ms, queue_ms);
+        }
+        throw;
+    }
+    uint32_t run_ms = (esp_timer_get_time() - start_us) / 1000;
+    stats.run_ms.Record(run_ms);
+    if (run_ms >= MCP_SLOW_TOOL_CALL_MS) {
+        ESP_LOGW(TAG, "Slow tool call: %s took %lu ms, queued %lu ms", tool->name().c_str(), run_ms, queue_ms);
+    }
+}
+
+cJSON* McpServer::GetToolStatsJson() {
+    auto json = cJSON_CreateObject();
+    for (auto tool : tools_) {
+        auto& stats = tool->stats();
+        if (stats.calls.value() == 0) {
+            continue;
+        }
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "calls", stats.calls.value());
+        cJSON_AddNumberToObject(item, "errors", stats.errors.value());
+        if (tool->cache_ttl_ms() > 0) {
+            cJSON_AddNumberToObject(item, "cache_hits", stats.cache_hits.value());
+        }
+        cJSON_AddItemToObject(item, "queue_ms", stats.queue_ms.GetStatsJson());
+        cJSON_AddItemToObject(item, "run_ms", stats.run_ms.GetStatsJson());
+        cJSON_AddItemToObject(json, tool->name().c_str(), item);
+    }
+    return json;
+}
+
+std::string McpServer::CallTool(int id, McpTool* tool, const PropertyList& arguments, int64_t queued_time_us) {
+    std::string payload;
+    JsonWriter writer(payload);
+    writer.BeginObject().Key("jsonrpc").String("2.0").Key("id").Int(id).Key("result");
+    if (tool->cache_ttl_ms() == 0 || arguments.size() > 0) {
+        InvokeTool(tool, arguments, writer, queued_time_us);
+        writer.EndObject();
+        return payload;
+    }
+
+    static auto cache_hits = PerfCounters::GetInstance().Counter("mcp.tool_cache_hits");
+    // Taken before the call, a change while it runs leaves its result stale
+    uint32_t generation = cache_generation_.load(std::memory_order_relaxed);
+    std::string result;
+    if (tool->GetCachedResult(generation, result)) {
+        cache_hits->Add();
+        tool->stats().calls.Add();
+        tool->stats().cache_hits.Add();
+        writer.Raw(result);
+    } else {
+        size_t start = payload.size();
+        InvokeTool(tool, arguments, writer, queued_time_us);
+        tool->SetCachedResult(generation, payload.substr(start));
+    }
+    writer.EndObject();
+    return payload;
 }
 
 void McpServer::GetToolsList(int id, const std::string& cursor, bool list_user_only_tools) {
-    const int max_payload_size = 8000;
+    std::lock_guard<std::mutex> lock(tools_list_mutex_);
+    auto& pages = tools_list_pages_[list_user_only_tools ? 1 : 0];
+    if (pages.empty()) {
+        BuildToolsList(pages, list_user_only_tools);
+    }
+
+    auto page = std::find_if(pages.begin(), pages.end(), [&cursor](const ToolsListPage& page) {
+        return page.cursor == cursor;
+    });
+    if (page == pages.end()) {
+        ESP_LOGE(TAG, "tools/list: Invalid cursor %s", cursor.c_str());
+        ReplyError(id, "Invalid cursor " + cursor);
+        return;
+    }
+    if (!page->oversized_tool.empty() && chunk_size_ == 0) {
+        // 单个tool超出大小限制，且客户端不支持分块传输，返回错误
+        ESP_LOGE(TAG, "tools/list: Failed to add tool %s because of payload size limit", page->oversized_tool.c_str());
+        ReplyError(id, "Failed to add tool " + page->oversized_tool + " because of payload size limit");
+        return;
+    }
+    ReplyResult(id, page->result);
+}
+
+void McpServer::BuildToolsList(std::vector<ToolsListPage>& pages, bool list_user_only_tools) {
+    const size_t max_payload_size = 8000;
     std::string json = "{\"tools\":[";
-    
-    bool found_cursor = cursor.empty();
-    auto it = tools_.begin();
-    std::string next_cursor = "";
-    
-    while (it != tools_.end()) {
-        // 如果我们还没有找到起始位置，继续搜索
-        if (!found_cursor) {
-            if ((*it)->name() == cursor) {
-                found_cursor = true;
-            } else {
-                ++it;
-                continue;
-            }
-        }
+    std::string cursor;
+    std::string oversized_tool;
 
-        if (!list_user_only_tools && (*it)->user_only()) {
-            ++it;
+    for (auto tool : tools_) {
+        if (!list_user_only_tools && tool->user_only()) {
             continue;
         }
-        
-        // 添加tool前检查大小
-        std::string tool_json = (*it)->to_json() + ",";
+
+        // 添加tool前检查大小，超出则从这个tool开始新的一页
+        std::string tool_json = tool->to_json();
+        if (json.back() != '[' && json.length() + tool_json.length() + 30 > max_payload_size) {
+            json.back() = ']';
+            json += ",\"nextCursor\":\"" + tool->name() + "\"}";
+            pages.push_back({cursor, std::move(json), std::move(oversized_tool)});
+            json = "{\"tools\":[";
+            cursor = tool->name();
+            oversized_tool.clear();
+        }
         if (json.length() + tool_json.length() + 30 > max_payload_size) {
-            // 如果添加这个tool会超出大小限制，设置next_cursor并退出循环
-            next_cursor = (*it)->name();
-            break;
+            // Alone on its page, only a client taking chunked messages gets it and the tools after it
+            oversized_tool = tool->name();
         }
-        
         json += tool_json;
-        ++it;
+        json += ',';
     }
-    
+
     if (json.back() == ',') {
-        json.pop_back();
+        json.back() = ']';
+    } else {
+        json += ']';
     }
-    
-    if (json.back() == '[' && !tools_.empty()) {
-        // 如果没有添加任何tool，返回错误
-        ESP_LOGE(TAG, "tools/list: Failed to add tool %s because of payload size limit", next_cursor.c_str());
-        ReplyError(id, "Failed to add tool " + next_cursor + " because of payload size limit");
-        return;
+    json += '}';
+    pages.push_back({cursor, std::move(json), std::move(oversized_tool)});
+
+    size_t bytes = 0;
+    for (auto& page : pages) {
+        bytes += page.result.size();
     }
+    ESP_LOGI(TAG, "tools/list: %u pages, %u bytes", pages.size(), bytes);
+}
 
-    if (next_cursor.empty()) {
-        json += "]}";
-    } else {
-        json += "],\"nextCursor\":\"" + next_cursor + "\"}";
+void McpServer::InvalidateToolsList() {
+    std::lock_guard<std::mutex> lock(tools_list_mutex_);
+    for (auto& pages : tools_list_pages_) {
+        pages.clear();
+        pages.shrink_to_fit();
     }
-    
-    ReplyResult(id, json);
 }
 
-void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments) {
+McpTool* McpServer::FindTool(const std::string& tool_name) {
     auto tool_iter = std::find_if(tools_.begin(), tools_.end(), 
                                  [&tool_name](const McpTool* tool) { 
                                      return tool->name() == tool_name; 
                                  });
-    
-    if (tool_iter == tools_.end()) {
+    return tool_iter != tools_.end() ? *tool_iter : nullptr;
+}
+
+bool McpServer::PrepareArguments(const McpTool* tool, const cJSON* tool_arguments, PropertyList& arguments, std::string& error) {
+    // One pass over the arguments, each one found in the sorted index of the tool
+    arguments = tool->properties();
+    uint64_t assigned = 0;
+    if (cJSON_IsObject(tool_arguments)) {
+        cJSON* value;
+        cJSON_ArrayForEach(value, tool_arguments) {
+            int index = arguments.IndexOf(value->string);
+            if (index < 0) {
+                continue;
+            }
+            auto& argument = arguments.at(index);
+            switch (argument.Assign(value)) {
+            case kPropertyAssigned:
+                assigned |= 1ULL << index;
+                break;
+            case kPropertyBelowMinimum:
+                ESP_LOGE(TAG, "tools/call: %s is below minimum allowed: %d", argument.name().c_str(), argument.min_value());
+                error = "Value is below minimum allowed: " + std::to_string(argument.min_value());
+                return false;
+            case kPropertyAboveMaximum:
+                ESP_LOGE(TAG, "tools/call: %s exceeds maximum allowed: %d", argument.name().c_str(), argument.max_value());
+                error = "Value exceeds maximum allowed: " + std::to_string(argument.max_value());
+                return false;
+            case kPropertyTypeMismatch:
+                break;
+            }
+        }
+    }
+    for (size_t i = 0; i < arguments.size(); i++) {
+        if (!arguments.at(i).has_default_value() && (assigned & (1ULL << i)) == 0) {
+            ESP_LOGE(TAG, "tools/call: Missing valid argument: %s", arguments.at(i).name().c_str());
+            error = "Missing valid argument: " + arguments.at(i).name();
+            return false;
+        }
+    }
+    return true;
+}
+
+void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, const cJSON* meta, std::vector<std::function<void()>>* main_calls) {
+    auto tool = FindTool(tool_name);
+    if (tool == nullptr) {
         ESP_LOGE(TAG, "tools/call: Unknown tool: %s", tool_name.c_str());
         ReplyError(id, "Unknown tool: " + tool_name);
         return;
     }
 
-    PropertyList arguments = (*tool_iter)->properties();
-    try {
-        for (auto& argument : arguments) {
-            bool found = false;
-            if (cJSON_IsObject(tool_arguments)) {
-                auto value = cJSON_GetObjectItem(tool_arguments, argument.name().c_str());
-                if (argument.type() == kPropertyTypeBoolean && cJSON_IsBool(value)) {
-                    argument.set_value<bool>(value->valueint == 1);
-                    found = true;
-                } else if (argument.type() == kPropertyTypeInteger && cJSON_IsNumber(value)) {
-                    argument.set_value<int>(value->valueint);
-                    found = true;
-                } else if (argument.type() == kPropertyTypeString && cJSON_IsString(value)) {
-                    argument.set_value<std::string>(value->valuestring);
-                    found = true;
-                }
+    PropertyList arguments;
+    std::string error;
+    if (!PrepareArguments(tool, tool_arguments, arguments, error)) {
+        ReplyError(id, error);
+        return;
+    }
+
+    int64_t queued_time_us = esp_timer_get_time();
+    if (!tool->long_running()) {
+        // Use main thread to call the tool
+        auto call = [this, id, tool, arguments = std::move(arguments), queued_time_us]() {
+            try {
+                SendReply(id, CallTool(id, tool, arguments, queued_time_us));
+            } catch (const std::exception& e) {
+                ESP_LOGE(TAG, "tools/call: %s", e.what());
+                ReplyError(id, e.what());
+            }
+            // The tool may have changed the volume, the brightness ...
+            if (tool->cache_ttl_ms() == 0) {
+                InvalidateCachedResults();
             }
+            CheckDeviceStatus();
+        };
+        if (main_calls != nullptr) {
+            main_calls->emplace_back(std::move(call));
+        } else {
+            Application::GetInstance().Schedule(std::move(call));
+        }
+        return;
+    }
 
-            if (!argument.has_default_value() && !found) {
-                ESP_LOGE(TAG, "tools/call: Missing valid argument: %s", argument.name().c_str());
-                ReplyError(id, "Missing valid argument: " + argument.name());
-                return;
+    auto call = std::make_shared<McpCall>();
+    call->id = id;
+    auto progress_token = cJSON_GetObjectItem(meta, "progressToken");
+    if (cJSON_IsString(progress_token) || cJSON_IsNumber(progress_token)) {
+        char* token = cJSON_PrintUnformatted(progress_token);
+        call->progress_token = token;
+        cJSON_free(token);
+    }
+    {
+        std::lock_guard<std::mutex> lock(workers_mutex_);
+        calls_[id] = call;
+    }
+
+    auto job = [this, call, batch = current_batch_, tool, arguments = std::move(arguments), queued_time_us]() {
+        current_batch_ = batch;
+        std::unique_lock<std::mutex> exclusive(exclusive_mutex_, std::defer_lock);
+        if (tool->exclusive()) {
+            exclusive.lock();
+        }
+        // Cancelled while it was queued
+        std::string payload;
+        bool replied = false;
+        if (!call->cancelled) {
+            current_call_ = call;
+            try {
+                payload = CallTool(call->id, tool, arguments, queued_time_us);
+            } catch (const std::exception& e) {
+                ESP_LOGE(TAG, "tools/call: %s", e.what());
+                if (!call->cancelled) {
+                    ReplyError(call->id, e.what());
+                    replied = true;
+                }
             }
+            current_call_.reset();
         }
-    } catch (const std::exception& e) {
-        ESP_LOGE(TAG, "tools/call: %s", e.what());
-        ReplyError(id, e.what());
+        if (exclusive.owns_lock()) {
+            exclusive.unlock();
+        }
+        {
+            std::lock_guard<std::mutex> lock(workers_mutex_);
+            auto it = calls_.find(call->id);
+            if (it != calls_.end() && it->second == call) {
+                calls_.erase(it);
+            }
+        }
+        if (!replied) {
+            // A cancelled call gets no reply, but still completes its batch
+            SendReply(call->id, call->cancelled ? std::string() : std::move(payload));
+        }
+        current_batch_.reset();
+        InvalidateCachedResults();
+        NotifyDeviceStatusChanged();
+    };
+    bool started = tool->stack_size() > 0 ? RunOnTask(std::move(job), tool->stack_size()) : RunOnWorker(std::move(job));
+    if (!started) {
+        ESP_LOGW(TAG, "tools/call: Too many tool calls in progress, refusing %s", tool_name.c_str());
+        {
+            std::lock_guard<std::mutex> lock(workers_mutex_);
+            calls_.erase(id);
+        }
+        ReplyError(id, "Too many tool calls in progress");
+    }
+}
+
+void McpServer::HandleResourceRequest(int id, const std::string& method, const cJSON* params) {
+    if (method == "resources/list") {
+        ReplyResult(id, "{\"resources\":[{\"uri\":\"" DEVICE_STATUS_URI "\",\"name\":\"device_status\","
+            "\"description\":\"The status of the audio speaker, screen, battery and network\",\"mimeType\":\"application/json\"}]}");
+        return;
+    }
+    if (method != "resources/read" && method != "resources/subscribe" && method != "resources/unsubscribe") {
+        ESP_LOGE(TAG, "Method not implemented: %s", method.c_str());
+        ReplyError(id, "Method not implemented: " + method);
+        return;
+    }
+    auto uri = cJSON_GetObjectItem(params, "uri");
+    if (!cJSON_IsString(uri) || strcmp(uri->valuestring, DEVICE_STATUS_URI) != 0) {
+        ESP_LOGE(TAG, "%s: Unknown resource", method.c_str());
+        ReplyError(id, std::string("Unknown resource: ") + (cJSON_IsString(uri) ? uri->valuestring : ""));
         return;
     }
 
-    // Use main thread to call the tool
-    auto& app = Application::GetInstance();
-    app.Schedule([this, id, tool_iter, arguments = std::move(arguments)]() {
+    if (method == "resources/read") {
+        // The board is read on the main task, like the tools
+        Application::GetInstance().Schedule([this, id, batch = current_batch_]() {
+            current_batch_ = batch;
+            std::string result;
+            JsonWriter writer(result);
+            writer.BeginObject().Key("contents").BeginArray().BeginObject()
+                .Key("uri").String(DEVICE_STATUS_URI)
+                .Key("mimeType").String("application/json")
+                .Key("text").String(Board::GetInstance().GetDeviceStatusJson())
+                .EndObject().EndArray().EndObject();
+            ReplyResult(id, result);
+            current_batch_.reset();
+        });
+        return;
+    }
+
+    bool subscribe = method == "resources/subscribe";
+    ESP_LOGI(TAG, "%s %s", subscribe ? "Subscribed to" : "Unsubscribed from", DEVICE_STATUS_URI);
+    status_subscribed_ = subscribe;
+    // Changes are counted from now on, the status is compared to a fresh copy
+    Application::GetInstance().Schedule([this]() {
+        if (last_status_ != nullptr) {
+            cJSON_Delete(last_status_);
+            last_status_ = nullptr;
+        }
+        CheckDeviceStatus();
+    });
+    ReplyResult(id, "{}");
+}
+
+void McpServer::NotifyDeviceStatusChanged() {
+    if (!status_subscribed_) {
+        return;
+    }
+    Application::GetInstance().Schedule([this]() {
+        CheckDeviceStatus();
+    }, kSchedulePriorityBackground, "mcp_device_status");
+}
+
+void McpServer::CheckDeviceStatus() {
+    if (!status_subscribed_) {
+        if (last_status_ != nullptr) {
+            cJSON_Delete(last_status_);
+            last_status_ = nullptr;
+        }
+        return;
+    }
+    auto status = cJSON_Parse(Board::GetInstance().GetDeviceStatusJson().c_str());
+    if (status == nullptr) {
+        return;
+    }
+    if (last_status_ == nullptr) {
+        last_status_ = status;
+        return;
+    }
+
+    // Only the groups that changed, a group that is gone is null
+    std::string payload;
+    JsonWriter writer(payload);
+    writer.BeginObject().Key("jsonrpc").String("2.0").Key("method").String("notifications/resources/updated")
+        .Key("params").BeginObject().Key("uri").String(DEVICE_STATUS_URI).Key("changes").BeginObject();
+    bool changed = false;
+    cJSON* group;
+    cJSON_ArrayForEach(group, status) {
+        auto last = cJSON_GetObjectItemCaseSensitive(last_status_, group->string);
+        if (last != nullptr && cJSON_Compare(group, last, true)) {
+            continue;
+        }
+        char* json = cJSON_PrintUnformatted(group);
+        writer.Key(group->string).Raw(json);
+        cJSON_free(json);
+        changed = true;
+    }
+    cJSON_ArrayForEach(group, last_status_) {
+        if (cJSON_GetObjectItemCaseSensitive(status, group->string) == nullptr) {
+            writer.Key(group->string).Raw("null");
+            changed = true;
+        }
+    }
+    writer.EndObject().EndObject().EndObject();
+    cJSON_Delete(last_status_);
+    last_status_ = status;
+    if (changed) {
+        InvalidateCachedResults();
+        Application::GetInstance().SendMcpMessage(std::move(payload));
+    }
+}
+
+void McpServer::CallLocalTool(const std::string& tool_name, const std::string& arguments_json) {
+    auto tool = FindTool(tool_name);
+    if (tool == nullptr) {
+        ESP_LOGE(TAG, "Local call: Unknown tool: %s", tool_name.c_str());
+        return;
+    }
+    auto json = cJSON_Parse(arguments_json.empty() ? "{}" : arguments_json.c_str());
+    if (!cJSON_IsObject(json)) {
+        ESP_LOGE(TAG, "Local call: Invalid arguments for %s", tool_name.c_str());
+        cJSON_Delete(json);
+        return;
+    }
+    PropertyList arguments;
+    std::string error;
+    bool prepared = PrepareArguments(tool, json, arguments, error);
+    cJSON_Delete(json);
+    if (!prepared) {
+        ESP_LOGE(TAG, "Local call: %s: %s", tool_name.c_str(), error.c_str());
+        return;
+    }
+
+    ESP_LOGI(TAG, "Local call: %s %s", tool_name.c_str(), arguments_json.c_str());
+    int64_t queued_time_us = esp_timer_get_time();
+    auto call = [this, tool, arguments = std::move(arguments), arguments_json, queued_time_us]() {
+        // The server is told afterwards, so the conversation knows what the device did
+        std::string payload;
+        JsonWriter writer(payload);
+        writer.BeginObject().Key("jsonrpc").String("2.0").Key("method").String("notifications/tools/local_call")
+            .Key("params").BeginObject().Key("name").String(tool->name())
+            .Key("arguments").Raw(arguments_json.empty() ? "{}" : arguments_json).Key("result");
         try {
-            ReplyResult(id, (*tool_iter)->Call(arguments));
+            InvokeTool(tool, arguments, writer, queued_time_us);
         } catch (const std::exception& e) {
-            ESP_LOGE(TAG, "tools/call: %s", e.what());
-            ReplyError(id, e.what());
+            ESP_LOGE(TAG, "Local call: %s: %s", tool->name().c_str(), e.what());
+            writer.BeginObject().Key("content").BeginArray().BeginObject()
+                .Key("type").String("text").Key("text").String(e.what())
+                .EndObject().EndArray().Key("isError").Bool(true).EndObject();
         }
-    });
+        writer.EndObject().EndObject();
+        Application::GetInstance().SendMcpMessage(std::move(payload));
+        if (tool->cache_ttl_ms() == 0) {
+            InvalidateCachedResults();
+        }
+        NotifyDeviceStatusChanged();
+    };
+    if (!tool->long_running()) {
+        Application::GetInstance().Schedule(std::move(call), kSchedulePriorityUrgent);
+    } else if (!RunOnWorker(std::move(call))) {
+        ESP_LOGW(TAG, "Local call: Too many tool calls in progress, dropping %s", tool_name.c_str());
+    }
+}
+
+void McpServer::CancelCall(int id) {
+    std::lock_guard<std::mutex> lock(workers_mutex_);
+    auto it = calls_.find(id);
+    if (it == calls_.end()) {
+        return;
+    }
+    ESP_LOGI(TAG, "tools/call: Cancel call %d", id);
+    it->second->cancelled = true;
+}
+
+bool McpServer::IsCallCancelled() {
+    return current_call_ && current_call_->cancelled;
+}
+
+void McpServer::ReportProgress(double progress, double total, const std::string& message) {
+    if (!current_call_ || current_call_->progress_token.empty() || current_call_->cancelled) {
+        return;
+    }
+    std::string payload;
+    JsonWriter writer(payload);
+    writer.BeginObject().Key("jsonrpc").String("2.0").Key("method").String("notifications/progress")
+        .Key("params").BeginObject()
+        .Key("progressToken").Raw(current_call_->progress_token)
+        .Key("progress").Double(progress);
+    if (total > 0) {
+        writer.Key("total").Double(total);
+    }
+    if (!message.empty()) {
+        writer.Key("message").String(message);
+    }
+    writer.EndObject().EndObject();
+    Application::GetInstance().SendMcpMessage(std::move(payload));
+}
+
+void McpServer::NotifyLog(const char* logger, const std::string& message) {
+    std::string payload;
+    JsonWriter writer(payload);
+    writer.BeginObject().Key("jsonrpc").String("2.0").Key("method").String("notifications/message")
+        .Key("params").BeginObject()
+        .Key("level").String("info")
+        .Key("logger").String(logger)
+        .Key("data").String(message)
+        .EndObject().EndObject();
+    Application::GetInstance().PostMcpMessage(std::move(payload));
+}
+
+bool McpBlobWriter::available() {
+    return Application::GetInstance().CanSendMcpBlobs();
+}
+
+McpBlobWriter::McpBlobWriter() {
+    static std::atomic<uint32_t> next_id = 1;
+    id_ = next_id++;
+    if (id_ == 0) {
+        id_ = next_id++;
+    }
+}
+
+bool McpBlobWriter::Write(const void* data, size_t size) {
+    auto bytes = static_cast<const char*>(data);
+    size_ += size;
+    while (size > 0) {
+        size_t count = std::min(size, MCP_BLOB_CHUNK_SIZE - chunk_.size());
+        chunk_.append(bytes, count);
+        bytes += count;
+        size -= count;
+        if (chunk_.size() == MCP_BLOB_CHUNK_SIZE && !Flush(false)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool McpBlobWriter::Finish() {
+    return Flush(true);
+}
+
+bool McpBlobWriter::Flush(bool final) {
+    auto& app = Application::GetInstance();
+    // A tool on a worker waits for the main task, one on the main task could only wait for itself
+    while (McpServer::current_call_ && app.mcp_blob_pending() > MCP_BLOB_MAX_PENDING) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    size_t offset = sent_;
+    sent_ += chunk_.size();
+    std::string chunk;
+    chunk.swap(chunk_);
+    return app.SendMcpBlob(id_, offset, std::move(chunk), final);
+}
+
+/* Queue a job for the workers, a worker is started if all of them are busy */
+bool McpServer::RunOnWorker(std::function<void()>&& job) {
+    {
+        std::lock_guard<std::mutex> lock(workers_mutex_);
+        if (worker_jobs_.size() >= MCP_TOOL_QUEUE_SIZE) {
+            return false;
+        }
+        worker_jobs_.push_back(std::move(job));
+        if (idle_workers_ < (int)worker_jobs_.size() && worker_count_ < MCP_TOOL_WORKERS) {
+            char name[16];
+            snprintf(name, sizeof(name), "mcp_worker_%d", worker_count_);
+            if (xTaskCreate([](void* arg) {
+                auto server = (McpServer*)arg;
+                server->WorkerTask();
+            }, name, MCP_TOOL_WORKER_STACK_SIZE, this, MCP_TOOL_WORKER_PRIORITY, nullptr) == pdPASS) {
+                worker_count_++;
+                idle_workers_++;
+            } else if (worker_count_ == 0) {
+                ESP_LOGE(TAG, "Failed to create %s", name);
+                worker_jobs_.pop_back();
+                return false;
+            }
+        }
+    }
+    workers_cv_.notify_one();
+    return true;
+}
+
+/* Start a task of its own for a job that needs a larger stack, it counts against the queue */
+bool McpServer::RunOnTask(std::function<void()>&& job, uint32_t stack_size) {
+    {
+        std::lock_guard<std::mutex> lock(workers_mutex_);
+        if (calls_.size() > MCP_TOOL_WORKERS + MCP_TOOL_QUEUE_SIZE) {
+            return false;
+        }
+    }
+    auto task_job = new std::function<void()>(std::move(job));
+    if (xTaskCreate([](void* arg) {
+        auto job = (std::function<void()>*)arg;
+        (*job)();
+        delete job;
+        vTaskDelete(NULL);
+    }, "mcp_tool", stack_size, task_job, MCP_TOOL_WORKER_PRIORITY, nullptr) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create a task with %lu bytes of stack", stack_size);
+        delete task_job;
+        return false;
+    }
+    return true;
+}
+
+void McpServer::WorkerTask() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(workers_mutex_);
+            workers_cv_.wait(lock, [this]() { return !worker_jobs_.empty(); });
+            job = std::move(worker_jobs_.front());
+            worker_jobs_.pop_front();
+            idle_workers_--;
+        }
+        job();
+        std::lock_guard<std::mutex> lock(workers_mutex_);
+        idle_workers_++;
+    }
 }
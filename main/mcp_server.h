@@ -2,6 +2,8 @@
 #define MCP_SERVER_H
 
 #include <string>
+#include <string_view>
+#include <algorithm>
 #include <vector>
 #include <map>
 #include <functional>
@@ -9,40 +11,113 @@
 #include <optional>
 #include <stdexcept>
 #include <thread>
+#include <mutex>
+#include <deque>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
 #include <mbedtls/base64.h>
 
 #include <cJSON.h>
+#include <esp_timer.h>
+
+#include "json_writer.h"
+#include "perf_counters.h"
+
+// Base64 is encoded this many bytes at a time, a multiple of 3
+#define IMAGE_CONTENT_BASE64_WINDOW 384
+
+// The bytes of a blob in one frame, and the bytes a long running tool may have queued for sending
+#define MCP_BLOB_CHUNK_SIZE 4096
+#define MCP_BLOB_MAX_PENDING (16 * 1024)
+
+// The device status resource, its subscriber is sent what changed
+#define DEVICE_STATUS_URI "device://status"
+#define DEVICE_STATUS_CHECK_INTERVAL_S 5
+
+/*
+ * Streams a blob as binary frames that an MCP reply refers to by id, so an image is neither
+ * base64 encoded nor kept whole. The frames are queued for the main task ahead of the reply,
+ * and a long running tool waits while MCP_BLOB_MAX_PENDING bytes are queued.
+ * Only for a server that accepted the blob frames, see available().
+ */
+class McpBlobWriter {
+public:
+    static bool available();
+
+    McpBlobWriter();
+    bool Write(const void* data, size_t size);
+    // Sends what is left as the last part, an empty blob is one empty part
+    bool Finish();
+    uint32_t id() const { return id_; }
+    size_t size() const { return size_; }
+
+private:
+    uint32_t id_;
+    size_t size_ = 0;
+    size_t sent_ = 0;
+    std::string chunk_;
+
+    bool Flush(bool final);
+};
 
 class ImageContent {
 private:
-    std::string encoded_data_;
+    std::string data_;
     std::string mime_type_;
-
-    static std::string Base64Encode(const std::string& data) {
-        size_t dlen = 0, olen = 0;
-        mbedtls_base64_encode((unsigned char*)nullptr, 0, &dlen, (const unsigned char*)data.data(), data.size());
-        std::string result(dlen, 0);
-        mbedtls_base64_encode((unsigned char*)result.data(), result.size(), &olen, (const unsigned char*)data.data(), data.size());
-        return result;
-    }
+    uint32_t blob_id_ = 0;
+    size_t blob_size_ = 0;
 
 public:
-    ImageContent(const std::string& mime_type, const std::string& data) {
-        mime_type_ = mime_type;
-        // base64 encode data
-        encoded_data_ = Base64Encode(data);
+    // Keeps the raw image, it is only encoded while the reply is written
+    ImageContent(const std::string& mime_type, std::string data) : data_(std::move(data)), mime_type_(mime_type) {}
+    // An image already sent by a McpBlobWriter
+    ImageContent(const std::string& mime_type, uint32_t blob_id, size_t blob_size)
+        : mime_type_(mime_type), blob_id_(blob_id), blob_size_(blob_size) {}
+
+    size_t encoded_size() const { return blob_id_ != 0 ? 0 : (data_.size() + 2) / 3 * 4; }
+
+    // Sends the raw image as a blob for the reply to refer to, false leaves it to base64
+    bool SendAsBlob() {
+        if (blob_id_ != 0) {
+            return true;
+        }
+        McpBlobWriter blob;
+        if (!blob.Write(data_.data(), data_.size()) || !blob.Finish()) {
+            return false;
+        }
+        blob_id_ = blob.id();
+        blob_size_ = blob.size();
+        data_ = std::string();
+        return true;
     }
 
-    std::string to_json() const {
-        cJSON *json = cJSON_CreateObject();
-        cJSON_AddStringToObject(json, "type", "image");
-        cJSON_AddStringToObject(json, "mimeType", mime_type_.c_str());
-        cJSON_AddStringToObject(json, "data", encoded_data_.c_str());
-        char* json_str = cJSON_PrintUnformatted(json);
-        std::string result(json_str);
-        cJSON_free(json_str);
-        cJSON_Delete(json);
-        return result;
+    // The image object serialized into a string value, the base64 goes through a small window
+    void WriteAsString(JsonWriter& writer) const {
+        std::string mime_type;
+        JsonWriter::Escape(mime_type, mime_type_);
+        writer.BeginString()
+            .AppendString("{\"type\":\"image\",\"mimeType\":\"")
+            .AppendString(mime_type);
+        if (blob_id_ != 0) {
+            writer.AppendString("\",\"blob\":{\"id\":")
+                .AppendString(std::to_string(blob_id_))
+                .AppendString(",\"size\":")
+                .AppendString(std::to_string(blob_size_))
+                .AppendString("}}")
+                .EndString();
+            return;
+        }
+        writer.AppendString("\",\"data\":\"");
+        unsigned char window[IMAGE_CONTENT_BASE64_WINDOW / 3 * 4 + 1];
+        auto data = (const unsigned char*)data_.data();
+        for (size_t offset = 0; offset < data_.size(); offset += IMAGE_CONTENT_BASE64_WINDOW) {
+            size_t length = std::min<size_t>(data_.size() - offset, IMAGE_CONTENT_BASE64_WINDOW);
+            size_t olen = 0;
+            mbedtls_base64_encode(window, sizeof(window), &olen, data + offset, length);
+            writer.AppendString(std::string_view((const char*)window, olen));
+        }
+        writer.AppendString("\"}").EndString();
     }
 };
 
@@ -55,6 +130,14 @@ enum PropertyType {
     kPropertyTypeString
 };
 
+// The outcome of assigning an argument, checked without exceptions
+enum PropertyAssignResult {
+    kPropertyAssigned,
+    kPropertyTypeMismatch,          // The property keeps its default value
+    kPropertyBelowMinimum,
+    kPropertyAboveMaximum,
+};
+
 class Property {
 private:
     std::string name_;
@@ -120,6 +203,37 @@ public:
         value_ = value;
     }
 
+    // Takes the value of a tools/call argument if its type and range match
+    PropertyAssignResult Assign(const cJSON* value) {
+        switch (type_) {
+        case kPropertyTypeBoolean:
+            if (!cJSON_IsBool(value)) {
+                return kPropertyTypeMismatch;
+            }
+            value_ = cJSON_IsTrue(value) != 0;
+            return kPropertyAssigned;
+        case kPropertyTypeInteger:
+            if (!cJSON_IsNumber(value)) {
+                return kPropertyTypeMismatch;
+            }
+            if (min_value_.has_value() && value->valueint < min_value_.value()) {
+                return kPropertyBelowMinimum;
+            }
+            if (max_value_.has_value() && value->valueint > max_value_.value()) {
+                return kPropertyAboveMaximum;
+            }
+            value_ = value->valueint;
+            return kPropertyAssigned;
+        case kPropertyTypeString:
+            if (!cJSON_IsString(value)) {
+                return kPropertyTypeMismatch;
+            }
+            value_ = std::string(value->valuestring);
+            return kPropertyAssigned;
+        }
+        return kPropertyTypeMismatch;
+    }
+
     std::string to_json() const {
         cJSON *json = cJSON_CreateObject();
         
@@ -156,25 +270,61 @@ public:
 };
 
 class PropertyList {
+public:
+    // The arguments of a call are tracked in a 64 bit mask
+    static constexpr size_t kMaxProperties = 64;
+
 private:
     std::vector<Property> properties_;
+    std::vector<uint8_t> sorted_;   // Indices of properties_ sorted by name, rebuilt when a property is added
+
+    void Index() {
+        if (properties_.size() > kMaxProperties) {
+            throw std::invalid_argument("Too many properties");
+        }
+        sorted_.resize(properties_.size());
+        for (size_t i = 0; i < sorted_.size(); i++) {
+            sorted_[i] = i;
+        }
+        std::sort(sorted_.begin(), sorted_.end(), [this](uint8_t a, uint8_t b) {
+            return properties_[a].name() < properties_[b].name();
+        });
+    }
 
 public:
     PropertyList() = default;
-    PropertyList(const std::vector<Property>& properties) : properties_(properties) {}
+    PropertyList(const std::vector<Property>& properties) : properties_(properties) {
+        Index();
+    }
     void AddProperty(const Property& property) {
         properties_.push_back(property);
+        Index();
+    }
+
+    // The position of a property, -1 if there is none with the name
+    int IndexOf(std::string_view name) const {
+        auto it = std::lower_bound(sorted_.begin(), sorted_.end(), name, [this](uint8_t index, std::string_view name) {
+            return properties_[index].name() < name;
+        });
+        if (it == sorted_.end() || properties_[*it].name() != name) {
+            return -1;
+        }
+        return *it;
     }
 
     const Property& operator[](const std::string& name) const {
-        for (const auto& property : properties_) {
-            if (property.name() == name) {
-                return property;
-            }
+        int index = IndexOf(name);
+        if (index < 0) {
+            throw std::runtime_error("Property not found: " + name);
         }
-        throw std::runtime_error("Property not found: " + name);
+        return properties_[index];
     }
 
+    // Properties keep the order they were declared in
+    size_t size() const { return properties_.size(); }
+    const Property& at(size_t index) const { return properties_[index]; }
+    Property& at(size_t index) { return properties_[index]; }
+
     auto begin() { return properties_.begin(); }
     auto end() { return properties_.end(); }
 
@@ -205,6 +355,15 @@ public:
     }
 };
 
+// The calls of one tool, for get_performance_stats
+struct McpToolStats {
+    PerfCounter calls;
+    PerfCounter errors;
+    PerfCounter cache_hits;
+    PerfHistogram queue_ms;     // From the request until the call starts, on the main task or a worker
+    PerfHistogram run_ms;       // The callback and the serialization of its result
+};
+
 class McpTool {
 private:
     std::string name_;
@@ -212,6 +371,16 @@ private:
     PropertyList properties_;
     std::function<ReturnValue(const PropertyList&)> callback_;
     bool user_only_ = false;
+    bool long_running_ = false;
+    bool exclusive_ = false;
+    uint32_t stack_size_ = 0;
+    uint32_t cache_ttl_ms_ = 0;
+    // The serialized result of the last call, see set_cache_ttl()
+    std::mutex cache_mutex_;
+    std::string cached_result_;
+    int64_t cache_expire_time_us_ = 0;
+    uint32_t cache_generation_ = 0;
+    McpToolStats stats_;
 
 public:
     McpTool(const std::string& name, 
@@ -224,10 +393,43 @@ public:
         callback_(callback) {}
 
     void set_user_only(bool user_only) { user_only_ = user_only; }
+    // A long running tool is called on a worker task, so it does not hold up the main task
+    void set_long_running(bool long_running) { long_running_ = long_running; }
+    // A long running tool with a stack size is called on a task of its own instead of a shared worker
+    void set_stack_size(uint32_t stack_size) { stack_size_ = stack_size; }
+    // Long running tools run concurrently, an exclusive one (shared hardware) never runs alongside another exclusive one
+    void set_exclusive(bool exclusive) { exclusive_ = exclusive; }
+    /*
+     * An idempotent getter without arguments may answer from its last result for ttl_ms, until
+     * McpServer::InvalidateCachedResults() is called by what changes the state it reports.
+     */
+    void set_cache_ttl(uint32_t ttl_ms) { cache_ttl_ms_ = ttl_ms; }
     inline const std::string& name() const { return name_; }
     inline const std::string& description() const { return description_; }
     inline const PropertyList& properties() const { return properties_; }
     inline bool user_only() const { return user_only_; }
+    inline bool long_running() const { return long_running_; }
+    inline uint32_t stack_size() const { return stack_size_; }
+    inline bool exclusive() const { return exclusive_; }
+    inline uint32_t cache_ttl_ms() const { return cache_ttl_ms_; }
+    inline McpToolStats& stats() { return stats_; }
+
+    // False when there is no result of the generation that is still fresh
+    bool GetCachedResult(uint32_t generation, std::string& result) {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        if (cached_result_.empty() || cache_generation_ != generation || esp_timer_get_time() >= cache_expire_time_us_) {
+            return false;
+        }
+        result = cached_result_;
+        return true;
+    }
+
+    void SetCachedResult(uint32_t generation, std::string result) {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        cached_result_ = std::move(result);
+        cache_generation_ = generation;
+        cache_expire_time_us_ = esp_timer_get_time() + cache_ttl_ms_ * 1000LL;
+    }
 
     std::string to_json() const {
         std::vector<std::string> required = properties_.GetRequired();
@@ -269,45 +471,42 @@ public:
         return result;
     }
 
-    std::string Call(const PropertyList& properties) {
+    // Writes the result object, nothing is written when the callback throws
+    void Call(const PropertyList& properties, JsonWriter& writer) {
+        static auto calls = PerfCounters::GetInstance().Counter("mcp.tool_calls");
+        static auto call_time = PerfCounters::GetInstance().Histogram("mcp.tool_call_ms");
+        calls->Add();
+        int64_t start_us = esp_timer_get_time();
         ReturnValue return_value = callback_(properties);
+        call_time->Record((esp_timer_get_time() - start_us) / 1000);
         // 返回结果
-        cJSON* result = cJSON_CreateObject();
-        cJSON* content = cJSON_CreateArray();
-
+        writer.BeginObject().Key("content").BeginArray().BeginObject();
         if (std::holds_alternative<ImageContent*>(return_value)) {
             auto image_content = std::get<ImageContent*>(return_value);
-            cJSON* image = cJSON_CreateObject();
-            cJSON_AddStringToObject(image, "type", "image");
-            cJSON_AddStringToObject(image, "image", image_content->to_json().c_str());
-            cJSON_AddItemToArray(content, image);
+            if (McpBlobWriter::available()) {
+                image_content->SendAsBlob();
+            }
+            writer.Reserve(image_content->encoded_size() + 128);
+            writer.Key("type").String("image").Key("image");
+            image_content->WriteAsString(writer);
             delete image_content;
         } else {
-            cJSON* text = cJSON_CreateObject();
-            cJSON_AddStringToObject(text, "type", "text");
+            writer.Key("type").String("text").Key("text");
             if (std::holds_alternative<std::string>(return_value)) {
-                cJSON_AddStringToObject(text, "text", std::get<std::string>(return_value).c_str());
+                writer.String(std::get<std::string>(return_value));
             } else if (std::holds_alternative<bool>(return_value)) {
-                cJSON_AddStringToObject(text, "text", std::get<bool>(return_value) ? "true" : "false");
+                writer.String(std::get<bool>(return_value) ? "true" : "false");
             } else if (std::holds_alternative<int>(return_value)) {
-                cJSON_AddStringToObject(text, "text", std::to_string(std::get<int>(return_value)).c_str());
+                writer.String(std::to_string(std::get<int>(return_value)));
             } else if (std::holds_alternative<cJSON*>(return_value)) {
                 cJSON* json = std::get<cJSON*>(return_value);
                 char* json_str = cJSON_PrintUnformatted(json);
-                cJSON_AddStringToObject(text, "text", json_str);
+                writer.String(json_str);
                 cJSON_free(json_str);
                 cJSON_Delete(json);
             }
-            cJSON_AddItemToArray(content, text);
         }
-        cJSON_AddItemToObject(result, "content", content);
-        cJSON_AddBoolToObject(result, "isError", false);
-
-        auto json_str = cJSON_PrintUnformatted(result);
-        std::string result_str(json_str);
-        cJSON_free(json_str);
-        cJSON_Delete(result);
-        return result_str;
+        writer.EndObject().EndArray().Key("isError").Bool(false).EndObject();
     }
 };
 
@@ -321,24 +520,117 @@ public:
     void AddCommonTools();
     void AddUserOnlyTools();
     void AddTool(McpTool* tool);
-    void AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
-    void AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
+    McpTool* AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback, bool long_running = false, uint32_t stack_size = 0);
+    McpTool* AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback, bool long_running = false, uint32_t stack_size = 0);
     void ParseMessage(const cJSON* json);
     void ParseMessage(const std::string& message);
 
+    /*
+     * For the long running tools, about the tools/call run by the calling task.
+     * A cancelled call gets no reply, the tool may return early. Progress is only sent to
+     * a client that asked for it with a progress token, total is left out when 0.
+     */
+    static bool IsCallCancelled();
+    static void ReportProgress(double progress, double total = 0, const std::string& message = "");
+    // A notifications/message of the device, for the work a tool started after its reply. It
+    // goes straight to the network tx, so it is sent while the main task is busy with the work.
+    static void NotifyLog(const char* logger, const std::string& message);
+
+    /*
+     * With a subscriber to DEVICE_STATUS_URI, sends notifications/resources/updated carrying the
+     * status groups (audio_speaker, battery ...) that changed since the last check.
+     * Called by the main task, periodically and after tool calls.
+     */
+    void CheckDeviceStatus();
+    // Checks from the main task soon instead of at the next period, for any task
+    void NotifyDeviceStatusChanged();
+
+    /*
+     * Calls a tool for a command recognized on the device, without a round trip to the server.
+     * arguments is a JSON object, the server gets the result in notifications/tools/local_call.
+     * May be called from any task.
+     */
+    void CallLocalTool(const std::string& tool_name, const std::string& arguments);
+
+    // Drops the cached results of the getters, for any task that changed the device state
+    static void InvalidateCachedResults() { cache_generation_.fetch_add(1, std::memory_order_relaxed); }
+
 private:
     McpServer();
     ~McpServer();
 
+    // A JSON-RPC batch, its replies go out as one array once every request in it is done
+    struct McpBatch {
+        std::mutex mutex;
+        std::vector<int> ids;       // The requests still to reply, a reply to any other id goes out alone
+        int pending = 1;            // Held at one more until every request is dispatched
+        std::string replies = "[";
+    };
+
     void ParseCapabilities(const cJSON* capabilities);
+    void ParseBatch(const cJSON* json);
+    // main_calls collects the tool calls of a batch for the main task, null to schedule each one
+    void HandleRequest(const cJSON* json, std::vector<std::function<void()>>* main_calls);
+    static bool IsRequest(const cJSON* json);
+    // An empty payload finishes a request without a reply, a request of current_batch_ finishes in it
+    void SendReply(int id, std::string&& payload);
+    void AddToBatch(McpBatch& batch, std::string&& payload);
 
     void ReplyResult(int id, const std::string& result);
     void ReplyError(int id, const std::string& message);
+    // The reply to a tools/call, serialized straight into the payload that is sent
+    std::string CallTool(int id, McpTool* tool, const PropertyList& arguments, int64_t queued_time_us);
+    // Calls the tool into its stats, the exception of a failed call is passed on
+    void InvokeTool(McpTool* tool, const PropertyList& arguments, JsonWriter& writer, int64_t queued_time_us);
+    cJSON* GetToolStatsJson();
+
+    // A page of the tools/list result, serialized once and kept until a tool is added
+    struct ToolsListPage {
+        std::string cursor;     // Name of the first tool, empty for the first page
+        std::string result;
+        std::string oversized_tool;     // The tool alone on the page that is over the payload limit, only sent in chunks
+    };
 
     void GetToolsList(int id, const std::string& cursor, bool list_user_only_tools);
-    void DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments);
+    void BuildToolsList(std::vector<ToolsListPage>& pages, bool list_user_only_tools);
+    void InvalidateToolsList();
+    McpTool* FindTool(const std::string& tool_name);
+    // Fills arguments from the JSON object, false with the reason when they do not fit the tool
+    bool PrepareArguments(const McpTool* tool, const cJSON* tool_arguments, PropertyList& arguments, std::string& error);
+    void DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, const cJSON* meta, std::vector<std::function<void()>>* main_calls);
+
+    // A long running tools/call, for notifications/cancelled and notifications/progress
+    struct McpCall {
+        int id;
+        std::string progress_token;     // Serialized JSON, empty without a token
+        std::atomic<bool> cancelled = false;
+    };
+
+    bool RunOnWorker(std::function<void()>&& job);
+    bool RunOnTask(std::function<void()>&& job, uint32_t stack_size);
+    void WorkerTask();
+    void CancelCall(int id);
+    void HandleResourceRequest(int id, const std::string& method, const cJSON* params);
 
     std::vector<McpTool*> tools_;
+    std::mutex tools_list_mutex_;
+    std::vector<ToolsListPage> tools_list_pages_[2];    // Indexed by list_user_only_tools
+    // Workers for the long running tools, started on demand
+    std::mutex workers_mutex_;
+    std::condition_variable workers_cv_;
+    std::deque<std::function<void()>> worker_jobs_;
+    int worker_count_ = 0;
+    int idle_workers_ = 0;
+    std::map<int, std::shared_ptr<McpCall>> calls_;   // Guarded by workers_mutex_
+    static thread_local std::shared_ptr<McpCall> current_call_;
+    // The batch of the request being handled, set by the task that dispatches or runs it
+    static thread_local std::shared_ptr<McpBatch> current_batch_;
+    friend class McpBlobWriter;     // Waits for the main task only on the task of a long running call
+    static std::atomic<uint32_t> cache_generation_;     // A cached result of an older one is stale
+    std::mutex exclusive_mutex_;    // Held by the running exclusive tool
+    std::atomic<bool> status_subscribed_ = false;
+    std::atomic<size_t> chunk_size_ = 0;     // Negotiated by initialize, 0 without chunking
+    cJSON* last_status_ = nullptr;      // The status last compared, main task only
 };
 
 #endif // MCP_SERVER_H
@@ -0,0 +1,126 @@
+#include "memory_placement.h"
+
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_memory_utils.h>
+#include <atomic>
+
+#define TAG "MemoryPolicy"
+
+struct PlacementStats {
+    std::atomic<int32_t> bytes{0};
+    std::atomic<int32_t> peak_bytes{0};
+    std::atomic<uint32_t> allocations{0};
+    std::atomic<uint32_t> spills{0};        // Placed in the other region
+    std::atomic<uint32_t> failures{0};
+};
+
+#if CONFIG_AUDIO_HOT_PATH_IRAM
+// From the SURROUND of main/linker.lf
+#define HOT_PATH_SYMBOLS(name) extern "C" char _##name##_start; extern "C" char _##name##_end;
+HOT_PATH_SYMBOLS(hot_audio_dsp)
+HOT_PATH_SYMBOLS(hot_audio_codec)
+HOT_PATH_SYMBOLS(hot_no_audio_codec)
+HOT_PATH_SYMBOLS(hot_audio_mixer)
+
+static size_t HotPathIramBytes() {
+    return (&_hot_audio_dsp_end - &_hot_audio_dsp_start) + (&_hot_audio_codec_end - &_hot_audio_codec_start) +
+        (&_hot_no_audio_codec_end - &_hot_no_audio_codec_start) + (&_hot_audio_mixer_end - &_hot_audio_mixer_start);
+}
+#endif
+
+extern "C" char _iram_text_start;
+extern "C" char _iram_text_end;
+
+static const char* const kPlacementNames[kPlacementCount] = {
+    "hot",
+    "cold",
+};
+
+static PlacementStats placement_stats[kPlacementCount];
+
+void* MemoryPolicy::Allocate(MemoryPlacement placement, size_t size) {
+    auto& stats = placement_stats[placement];
+    void* ptr;
+    bool spilled;
+    if (placement == kPlacementHot) {
+        ptr = heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        spilled = ptr == nullptr;
+    } else {
+#if CONFIG_SPIRAM
+        ptr = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        spilled = ptr == nullptr;
+#else
+        // Nothing to spill from without PSRAM
+        ptr = nullptr;
+        spilled = false;
+#endif
+    }
+    if (ptr == nullptr) {
+        ptr = heap_caps_malloc(size, MALLOC_CAP_8BIT);
+        if (ptr == nullptr) {
+            stats.failures.fetch_add(1, std::memory_order_relaxed);
+            ESP_LOGW(TAG, "Failed to allocate %u %s bytes", size, kPlacementNames[placement]);
+            return nullptr;
+        }
+        // The hot fallback may still land in internal RAM through the default caps
+        if (placement == kPlacementHot) {
+            spilled = esp_ptr_external_ram(ptr);
+        }
+    }
+
+    if (spilled) {
+        stats.spills.fetch_add(1, std::memory_order_relaxed);
+    }
+    int32_t allocated = heap_caps_get_allocated_size(ptr);
+    int32_t bytes = stats.bytes.fetch_add(allocated, std::memory_order_relaxed) + allocated;
+    int32_t peak = stats.peak_bytes.load(std::memory_order_relaxed);
+    while (bytes > peak && !stats.peak_bytes.compare_exchange_weak(peak, bytes, std::memory_order_relaxed)) {
+    }
+    stats.allocations.fetch_add(1, std::memory_order_relaxed);
+    return ptr;
+}
+
+void MemoryPolicy::Free(MemoryPlacement placement, void* ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    placement_stats[placement].bytes.fetch_sub(heap_caps_get_allocated_size(ptr), std::memory_order_relaxed);
+    heap_caps_free(ptr);
+}
+
+void MemoryPolicy::PrintStats() {
+    for (int i = 0; i < kPlacementCount; i++) {
+        auto& stats = placement_stats[i];
+        if (stats.allocations.load() == 0) {
+            continue;
+        }
+        ESP_LOGI(TAG, "%s: %ld bytes, peak %ld, %lu allocations, %lu spills, %lu failures", kPlacementNames[i],
+            stats.bytes.load(), stats.peak_bytes.load(), stats.allocations.load(), stats.spills.load(),
+            stats.failures.load());
+    }
+}
+
+cJSON* MemoryPolicy::GetStatsJson() {
+    auto json = cJSON_CreateObject();
+    for (int i = 0; i < kPlacementCount; i++) {
+        auto& stats = placement_stats[i];
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "bytes", stats.bytes.load());
+        cJSON_AddNumberToObject(item, "peak_bytes", stats.peak_bytes.load());
+        cJSON_AddNumberToObject(item, "allocations", stats.allocations.load());
+        cJSON_AddNumberToObject(item, "spills", stats.spills.load());
+        cJSON_AddNumberToObject(item, "failures", stats.failures.load());
+        cJSON_AddItemToObject(json, kPlacementNames[i], item);
+    }
+    // The code in IRAM, and the part of it the audio hot path takes
+    auto iram = cJSON_CreateObject();
+    cJSON_AddNumberToObject(iram, "text_bytes", &_iram_text_end - &_iram_text_start);
+#if CONFIG_AUDIO_HOT_PATH_IRAM
+    cJSON_AddNumberToObject(iram, "hot_path_bytes", HotPathIramBytes());
+#else
+    cJSON_AddNumberToObject(iram, "hot_path_bytes", 0);
+#endif
+    cJSON_AddItemToObject(json, "iram", iram);
+    return json;
+}
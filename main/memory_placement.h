@@ -0,0 +1,71 @@
+#ifndef _MEMORY_PLACEMENT_H_
+#define _MEMORY_PLACEMENT_H_
+
+#include <cJSON.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+enum MemoryPlacement {
+    kPlacementHot,      // Internal SRAM: DSP, codec and DMA buffers touched every frame
+    kPlacementCold,     // PSRAM: large buffers touched now and then, like the chat history
+    kPlacementCount,
+};
+
+/*
+ * Where the buffers of a kind go, instead of leaving it to the default allocator.
+ *
+ * On a PSRAM build malloc() puts anything over CONFIG_SPIRAM_MALLOC_ALWAYSINTERNAL into PSRAM,
+ * so a large PCM vector may end up in PSRAM and slow the audio loop down, while the chat
+ * history takes internal RAM the DMA buffers need. A hot buffer goes to the internal RAM and a
+ * cold one to PSRAM, falling back to the other region when that is full or missing. The
+ * buffers that fell back are counted as spills in the stats.
+ */
+class MemoryPolicy {
+public:
+    static void* Allocate(MemoryPlacement placement, size_t size);
+    static void Free(MemoryPlacement placement, void* ptr);
+    static void PrintStats();
+    static cJSON* GetStatsJson();
+};
+
+// An allocator for the standard containers that places their storage by the policy
+template <typename T, MemoryPlacement P>
+struct PlacementAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+        using other = PlacementAllocator<U, P>;
+    };
+
+    PlacementAllocator() = default;
+    template <typename U>
+    PlacementAllocator(const PlacementAllocator<U, P>&) {}
+
+    T* allocate(size_t n) {
+        void* ptr = MemoryPolicy::Allocate(P, n * sizeof(T));
+        if (ptr == nullptr) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        MemoryPolicy::Free(P, ptr);
+    }
+
+    template <typename U>
+    bool operator==(const PlacementAllocator<U, P>&) const { return true; }
+    template <typename U>
+    bool operator!=(const PlacementAllocator<U, P>&) const { return false; }
+};
+
+template <typename T>
+using HotVector = std::vector<T, PlacementAllocator<T, kPlacementHot>>;
+template <typename T>
+using ColdVector = std::vector<T, PlacementAllocator<T, kPlacementCold>>;
+
+#endif // _MEMORY_PLACEMENT_H_
@@ -2,6 +2,12 @@
 #include "system_info.h"
 #include "settings.h"
 #include "assets/lang_config.h"
+#include "partition_writer.h"
+#include "patch_decoder.h"
+#include "resumable_download.h"
+#include "perf_profile.h"
+#include "json_reader.h"
+#include "http_pool.h"
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -10,19 +16,226 @@
 #include <esp_partition.h>
 #include <esp_ota_ops.h>
 #include <esp_app_format.h>
+#include <esp_app_desc.h>
 #include <esp_efuse.h>
 #include <esp_efuse_table.h>
-#include <esp_heap_caps.h>
 #ifdef SOC_HMAC_SUPPORTED
 #include <esp_hmac.h>
 #endif
 
 #include <cstring>
 #include <vector>
+#include <memory>
 #include <sstream>
 #include <algorithm>
+#include <climits>
 
 #define TAG "Ota"
+#define OTA_CACHE_NAMESPACE "ota_cache"
+// NVS keeps strings up to 4000 bytes
+#define OTA_CACHE_MAX_SIZE 4000
+// The check version response is read in chunks of this size
+#define OTA_READ_CHUNK_SIZE 1024
+// The longest string of the response, e.g. a token or a URL
+#define OTA_JSON_MAX_TOKEN 2048
+
+/* A JSON number can be far out of the range of an int, casting it as is is undefined */
+static int ToInt(double number) {
+    if (number <= INT_MIN) {
+        return INT_MIN;
+    }
+    if (number >= INT_MAX) {
+        return INT_MAX;
+    }
+    return (int)number;
+}
+
+/*
+ * Takes the sections of the check version response out as the JsonReader reads them, so neither
+ * the body nor a cJSON tree of it has to be held. The mqtt and websocket settings are collected
+ * and stored once the response is complete, a truncated one changes nothing.
+ */
+class CheckVersionParser : public JsonReader::Handler {
+public:
+    struct Setting {
+        std::string key;
+        std::string string_value;   // A list of strings, like the endpoints, is kept comma separated
+        int int_value = 0;
+        bool is_int = false;
+    };
+    struct Section {
+        bool present = false;
+        std::vector<Setting> settings;
+    };
+
+    bool has_activation_message = false;
+    bool has_activation_code = false;
+    bool has_activation_challenge = false;
+    std::string activation_message;
+    std::string activation_code;
+    std::string activation_challenge;
+    int activation_timeout_ms = -1;
+    Section mqtt;
+    Section websocket;
+    bool has_server_time = false;
+    bool has_timestamp = false;
+    bool has_timezone_offset = false;
+    double timestamp = 0;
+    int timezone_offset = 0;
+    bool has_firmware = false;
+    bool has_firmware_version = false;
+    bool has_firmware_url = false;
+    bool firmware_force = false;
+    std::string firmware_version;
+    std::string firmware_url;
+    std::string firmware_patch_url;
+    cJSON* performance_profile = nullptr;   // The block is small, PerfProfile validates it as a whole
+
+    ~CheckVersionParser() {
+        cJSON_Delete(performance_profile);
+    }
+
+    void OnBegin(const JsonReader& reader, JsonReader::Type type) override {
+        bool object = type == JsonReader::kObject;
+        if (reader.depth() == 1) {
+            auto section = reader.key(0);
+            if (section == "mqtt") {
+                mqtt.present = mqtt.present || object;
+            } else if (section == "websocket") {
+                websocket.present = websocket.present || object;
+            } else if (section == "server_time") {
+                has_server_time = has_server_time || object;
+            } else if (section == "firmware") {
+                has_firmware = has_firmware || object;
+            } else if (section == "performance_profile" && performance_profile == nullptr) {
+                performance_profile = object ? cJSON_CreateObject() : cJSON_CreateArray();
+            }
+        } else if (reader.depth() == 2) {
+            auto section = SectionOf(reader);
+            if (section != nullptr && type == JsonReader::kArray) {
+                section->settings.push_back({std::string(reader.key(1))});
+                list_ = &section->settings.back();
+            } else if (reader.key(0) == "performance_profile" && cJSON_IsObject(performance_profile)) {
+                // A known field given as a block fails the validation
+                cJSON_AddItemToObject(performance_profile, std::string(reader.key(1)).c_str(), cJSON_CreateObject());
+            }
+        }
+    }
+
+    void OnEnd(const JsonReader& reader, JsonReader::Type type) override {
+        if (reader.depth() == 2) {
+            list_ = nullptr;
+        }
+    }
+
+    void OnValue(const JsonReader& reader, JsonReader::Type type, std::string_view value) override {
+        bool is_string = type == JsonReader::kString;
+        bool is_number = type == JsonReader::kNumber;
+        double number = 0;
+        if (is_number) {
+            JsonReader::ToDouble(value, number);
+        }
+
+        if (reader.depth() == 1) {
+            if (reader.key(0) == "performance_profile" && performance_profile == nullptr) {
+                performance_profile = cJSON_CreateString("");
+            }
+            return;
+        }
+        if (reader.depth() == 3) {
+            if (list_ != nullptr && is_string && SectionOf(reader) != nullptr) {
+                list_->string_value += list_->string_value.empty() ? "" : ",";
+                list_->string_value += value;
+            }
+            return;
+        }
+        if (reader.depth() != 2) {
+            return;
+        }
+
+        auto section = reader.key(0);
+        auto key = reader.key(1);
+        if (auto settings = SectionOf(reader)) {
+            if (is_string) {
+                settings->settings.push_back({std::string(key), std::string(value)});
+            } else if (is_number) {
+                settings->settings.push_back({std::string(key), std::string(), ToInt(number), true});
+            }
+        } else if (section == "activation") {
+            if (key == "message" && is_string) {
+                activation_message = value;
+                has_activation_message = true;
+            } else if (key == "code" && is_string) {
+                activation_code = value;
+                has_activation_code = true;
+            } else if (key == "challenge" && is_string) {
+                activation_challenge = value;
+                has_activation_challenge = true;
+            } else if (key == "timeout_ms" && is_number) {
+                activation_timeout_ms = ToInt(number);
+            }
+        } else if (section == "server_time" && has_server_time) {
+            if (key == "timestamp" && is_number) {
+                timestamp = number;
+                has_timestamp = true;
+            } else if (key == "timezone_offset" && is_number) {
+                timezone_offset = ToInt(number);
+                has_timezone_offset = true;
+            }
+        } else if (section == "firmware" && has_firmware) {
+            if (key == "version" && is_string) {
+                firmware_version = value;
+                has_firmware_version = true;
+            } else if (key == "url" && is_string) {
+                firmware_url = value;
+                has_firmware_url = true;
+            } else if (key == "patch_url" && is_string) {
+                firmware_patch_url = value;
+            } else if (key == "force" && is_number) {
+                firmware_force = ToInt(number) == 1;
+            }
+        } else if (section == "performance_profile" && cJSON_IsObject(performance_profile)) {
+            std::string name(key);
+            if (is_number) {
+                cJSON_AddNumberToObject(performance_profile, name.c_str(), number);
+            } else if (is_string) {
+                cJSON_AddStringToObject(performance_profile, name.c_str(), std::string(value).c_str());
+            } else if (type == JsonReader::kBool) {
+                cJSON_AddBoolToObject(performance_profile, name.c_str(), value == "true");
+            } else {
+                cJSON_AddNullToObject(performance_profile, name.c_str());
+            }
+        }
+    }
+
+private:
+    Setting* list_ = nullptr;       // The list of strings being read
+
+    Section* SectionOf(const JsonReader& reader) {
+        auto section = reader.key(0);
+        if (section == "mqtt" && mqtt.present) {
+            return &mqtt;
+        }
+        if (section == "websocket" && websocket.present) {
+            return &websocket;
+        }
+        return nullptr;
+    }
+};
+
+/* Only the values that changed are written, the store commits them together */
+static void StoreSettings(const char* ns, const CheckVersionParser::Section& section) {
+    Settings settings(ns, true);
+    for (auto& setting : section.settings) {
+        if (setting.is_int) {
+            if (settings.GetInt(setting.key) != setting.int_value) {
+                settings.SetInt(setting.key, setting.int_value);
+            }
+        } else if (settings.GetString(setting.key) != setting.string_value) {
+            settings.SetString(setting.key, setting.string_value);
+        }
+    }
+}
 
 
 Ota::Ota() {
@@ -54,8 +267,7 @@ std::string Ota::GetCheckVersionUrl() {
 
 std::unique_ptr<Http> Ota::SetupHttp() {
     auto& board = Board::GetInstance();
-    auto network = board.GetNetwork();
-    auto http = network->CreateHttp(0);
+    auto http = HttpPool::GetInstance().CreateHttp(0);
     auto user_agent = SystemInfo::GetUserAgent();
     http->SetHeader("Activation-Version", has_serial_number_ ? "2" : "1");
     http->SetHeader("Device-Id", SystemInfo::GetMacAddress().c_str());
@@ -90,6 +302,15 @@ esp_err_t Ota::CheckVersion() {
 
     auto http = SetupHttp();
 
+    // The last response is kept for the same firmware and server, a server that sends an ETag
+    // may answer 304 instead of sending it again
+    std::string cache_key = current_version_ + " " + url;
+    Settings cache(OTA_CACHE_NAMESPACE, false);
+    bool cache_valid = cache.GetString("key") == cache_key;
+    if (cache_valid && !cache.GetString("etag").empty()) {
+        http->SetHeader("If-None-Match", cache.GetString("etag"));
+    }
+
     std::string data = board.GetSystemInfoJson();
     std::string method = data.length() > 0 ? "POST" : "GET";
     http->SetContent(std::move(data));
@@ -101,104 +322,94 @@ esp_err_t Ota::CheckVersion() {
     }
 
     auto status_code = http->GetStatusCode();
-    if (status_code != 200) {
+    bool cached = status_code == 304 && cache_valid;
+    if (status_code != 200 && !cached) {
         ESP_LOGE(TAG, "Failed to check version, status code: %d", status_code);
         return status_code;
     }
 
-    data = http->ReadAll();
+    // The response is parsed as it is read, only a body small enough to be cached is kept
+    CheckVersionParser parser;
+    JsonReader reader(parser, OTA_JSON_MAX_TOKEN);
+    std::string etag;
+    std::string body;
+    bool cacheable = true;
+    if (cached) {
+        ESP_LOGI(TAG, "The check version response is not modified");
+        body = cache.GetString("response");
+        reader.Feed(body);
+    } else {
+        etag = http->GetResponseHeader("ETag");
+        auto buffer = std::make_unique<char[]>(OTA_READ_CHUNK_SIZE);
+        while (true) {
+            int ret = http->Read(buffer.get(), OTA_READ_CHUNK_SIZE);
+            if (ret < 0) {
+                ESP_LOGE(TAG, "Failed to read the check version response: %d", ret);
+                http->Close();
+                return ESP_ERR_INVALID_RESPONSE;
+            }
+            if (ret == 0 || !reader.Feed(buffer.get(), ret)) {
+                break;
+            }
+            if (cacheable && body.size() + ret < OTA_CACHE_MAX_SIZE) {
+                body.append(buffer.get(), ret);
+            } else if (cacheable) {
+                cacheable = false;
+                std::string().swap(body);
+            }
+        }
+    }
     http->Close();
 
-    // Response: { "firmware": { "version": "1.0.0", "url": "http://" } }
-    // Parse the JSON response and check if the version is newer
-    // If it is, set has_new_version_ to true and store the new version and URL
-    
-    cJSON *root = cJSON_Parse(data.c_str());
-    if (root == NULL) {
-        ESP_LOGE(TAG, "Failed to parse JSON response");
+    if (!reader.Finish()) {
+        ESP_LOGE(TAG, "Failed to parse JSON response: %s", reader.error());
         return ESP_ERR_INVALID_RESPONSE;
     }
 
-    has_activation_code_ = false;
-    has_activation_challenge_ = false;
-    cJSON *activation = cJSON_GetObjectItem(root, "activation");
-    if (cJSON_IsObject(activation)) {
-        cJSON* message = cJSON_GetObjectItem(activation, "message");
-        if (cJSON_IsString(message)) {
-            activation_message_ = message->valuestring;
-        }
-        cJSON* code = cJSON_GetObjectItem(activation, "code");
-        if (cJSON_IsString(code)) {
-            activation_code_ = code->valuestring;
-            has_activation_code_ = true;
-        }
-        cJSON* challenge = cJSON_GetObjectItem(activation, "challenge");
-        if (cJSON_IsString(challenge)) {
-            activation_challenge_ = challenge->valuestring;
-            has_activation_challenge_ = true;
-        }
-        cJSON* timeout_ms = cJSON_GetObjectItem(activation, "timeout_ms");
-        if (cJSON_IsNumber(timeout_ms)) {
-            activation_timeout_ms_ = timeout_ms->valueint;
-        }
+    // Nothing is stored before the whole response was read
+    has_activation_code_ = parser.has_activation_code;
+    has_activation_challenge_ = parser.has_activation_challenge;
+    if (parser.has_activation_message) {
+        activation_message_ = parser.activation_message;
+    }
+    if (has_activation_code_) {
+        activation_code_ = parser.activation_code;
+    }
+    if (has_activation_challenge_) {
+        activation_challenge_ = parser.activation_challenge;
+    }
+    if (parser.activation_timeout_ms >= 0) {
+        activation_timeout_ms_ = parser.activation_timeout_ms;
     }
 
-    has_mqtt_config_ = false;
-    cJSON *mqtt = cJSON_GetObjectItem(root, "mqtt");
-    if (cJSON_IsObject(mqtt)) {
-        Settings settings("mqtt", true);
-        cJSON *item = NULL;
-        cJSON_ArrayForEach(item, mqtt) {
-            if (cJSON_IsString(item)) {
-                if (settings.GetString(item->string) != item->valuestring) {
-                    settings.SetString(item->string, item->valuestring);
-                }
-            } else if (cJSON_IsNumber(item)) {
-                if (settings.GetInt(item->string) != item->valueint) {
-                    settings.SetInt(item->string, item->valueint);
-                }
-            }
-        }
-        has_mqtt_config_ = true;
+    has_mqtt_config_ = parser.mqtt.present;
+    if (has_mqtt_config_) {
+        StoreSettings("mqtt", parser.mqtt);
     } else {
         ESP_LOGI(TAG, "No mqtt section found !");
     }
 
-    has_websocket_config_ = false;
-    cJSON *websocket = cJSON_GetObjectItem(root, "websocket");
-    if (cJSON_IsObject(websocket)) {
-        Settings settings("websocket", true);
-        cJSON *item = NULL;
-        cJSON_ArrayForEach(item, websocket) {
-            if (cJSON_IsString(item)) {
-                if (settings.GetString(item->string) != item->valuestring) {
-                    settings.SetString(item->string, item->valuestring);
-                }
-            } else if (cJSON_IsNumber(item)) {
-                if (settings.GetInt(item->string) != item->valueint) {
-                    settings.SetInt(item->string, item->valueint);
-                }
-            }
-        }
-        has_websocket_config_ = true;
+    has_websocket_config_ = parser.websocket.present;
+    if (has_websocket_config_) {
+        StoreSettings("websocket", parser.websocket);
     } else {
         ESP_LOGI(TAG, "No websocket section found!");
     }
 
+    // A response without the block drops the profile, a bad block keeps the one in use
+    PerfProfile::GetInstance().Update(parser.performance_profile);
+
+    // The time in a cached response is long gone
     has_server_time_ = false;
-    cJSON *server_time = cJSON_GetObjectItem(root, "server_time");
-    if (cJSON_IsObject(server_time)) {
-        cJSON *timestamp = cJSON_GetObjectItem(server_time, "timestamp");
-        cJSON *timezone_offset = cJSON_GetObjectItem(server_time, "timezone_offset");
-        
-        if (cJSON_IsNumber(timestamp)) {
+    if (!cached && parser.has_server_time) {
+        if (parser.has_timestamp) {
             // 设置系统时间
             struct timeval tv;
-            double ts = timestamp->valuedouble;
+            double ts = parser.timestamp;
             
             // 如果有时区偏移，计算本地时间
-            if (cJSON_IsNumber(timezone_offset)) {
-                ts += (timezone_offset->valueint * 60 * 1000); // 转换分钟为毫秒
+            if (parser.has_timezone_offset) {
+                ts += (parser.timezone_offset * 60 * 1000); // 转换分钟为毫秒
             }
             
             tv.tv_sec = (time_t)(ts / 1000);  // 转换毫秒为秒
@@ -206,23 +417,22 @@ esp_err_t Ota::CheckVersion() {
             settimeofday(&tv, NULL);
             has_server_time_ = true;
         }
-    } else {
+    } else if (!cached) {
         ESP_LOGW(TAG, "No server_time section found!");
     }
 
     has_new_version_ = false;
-    cJSON *firmware = cJSON_GetObjectItem(root, "firmware");
-    if (cJSON_IsObject(firmware)) {
-        cJSON *version = cJSON_GetObjectItem(firmware, "version");
-        if (cJSON_IsString(version)) {
-            firmware_version_ = version->valuestring;
+    if (parser.has_firmware) {
+        if (parser.has_firmware_version) {
+            firmware_version_ = parser.firmware_version;
         }
-        cJSON *url = cJSON_GetObjectItem(firmware, "url");
-        if (cJSON_IsString(url)) {
-            firmware_url_ = url->valuestring;
+        if (parser.has_firmware_url) {
+            firmware_url_ = parser.firmware_url;
         }
+        // A patch against the firmware given by application.elf_sha256 in the request
+        firmware_patch_url_ = parser.firmware_patch_url;
 
-        if (cJSON_IsString(version) && cJSON_IsString(url)) {
+        if (parser.has_firmware_version && parser.has_firmware_url) {
             // Check if the version is newer, for example, 0.1.0 is newer than 0.0.1
             has_new_version_ = IsNewVersionAvailable(current_version_, firmware_version_);
             if (has_new_version_) {
@@ -231,8 +441,7 @@ esp_err_t Ota::CheckVersion() {
                 ESP_LOGI(TAG, "Current is the latest version");
             }
             // If the force flag is set to 1, the given version is forced to be installed
-            cJSON *force = cJSON_GetObjectItem(firmware, "force");
-            if (cJSON_IsNumber(force) && force->valueint == 1) {
+            if (parser.firmware_force) {
                 has_new_version_ = true;
             }
         }
@@ -240,10 +449,41 @@ esp_err_t Ota::CheckVersion() {
         ESP_LOGW(TAG, "No firmware section found!");
     }
 
-    cJSON_Delete(root);
+    // An activation is only good once, such a response is not kept
+    if (!cached) {
+        Settings writable(OTA_CACHE_NAMESPACE, true);
+        if (!has_activation_code_ && !has_activation_challenge_ && cacheable) {
+            if (cache.GetString("response") != body) {
+                writable.SetString("response", body);
+            }
+            writable.SetString("etag", etag);
+            writable.SetString("key", cache_key);
+        } else {
+            writable.EraseKey("key");
+        }
+    }
     return ESP_OK;
 }
 
+bool Ota::LoadCachedConfig() {
+    current_version_ = esp_app_get_description()->version;
+    Settings cache(OTA_CACHE_NAMESPACE, false);
+    if (cache.GetString("key") != current_version_ + " " + GetCheckVersionUrl()) {
+        return false;
+    }
+    CheckVersionParser parser;
+    JsonReader reader(parser, OTA_JSON_MAX_TOKEN);
+    reader.Feed(cache.GetString("response"));
+    if (!reader.Finish()) {
+        return false;
+    }
+    // The mqtt and websocket sections were stored in their settings when the response came
+    has_mqtt_config_ = parser.mqtt.present;
+    has_websocket_config_ = parser.websocket.present;
+    ESP_LOGI(TAG, "Using the cached %s config", has_mqtt_config_ ? "mqtt" : "websocket");
+    return has_mqtt_config_ || has_websocket_config_;
+}
+
 void Ota::MarkCurrentVersionValid() {
     auto partition = esp_ota_get_running_partition();
     if (strcmp(partition->label, "factory") == 0) {
@@ -264,7 +504,8 @@ void Ota::MarkCurrentVersionValid() {
     }
 }
 
-bool Ota::Upgrade(const std::string& firmware_url, std::function<void(int progress, size_t speed)> callback) {
+bool Ota::Upgrade(const std::string& firmware_url, std::function<void(int progress, size_t speed)> callback,
+    size_t max_speed, std::function<bool()> paused) {
     ESP_LOGI(TAG, "Upgrading firmware from %s", firmware_url.c_str());
     esp_ota_handle_t update_handle = 0;
     auto update_partition = esp_ota_get_next_update_partition(NULL);
@@ -274,97 +515,54 @@ bool Ota::Upgrade(const std::string& firmware_url, std::function<void(int progre
     }
 
     ESP_LOGI(TAG, "Writing to partition %s at offset 0x%lx", update_partition->label, update_partition->address);
-    bool image_header_checked = false;
-    std::string image_header;
-
-    auto network = Board::GetInstance().GetNetwork();
-    auto http = network->CreateHttp(0);
-    if (!http->Open("GET", firmware_url)) {
-        ESP_LOGE(TAG, "Failed to open HTTP connection");
-        return false;
-    }
-
-    if (http->GetStatusCode() != 200) {
-        ESP_LOGE(TAG, "Failed to get firmware, status code: %d", http->GetStatusCode());
-        return false;
-    }
 
-    size_t content_length = http->GetBodyLength();
-    if (content_length == 0) {
-        ESP_LOGE(TAG, "Failed to get content length");
-        return false;
-    }
-
-    constexpr size_t PAGE_SIZE = 4096;
-    char* buffer = (char*)heap_caps_malloc(PAGE_SIZE, MALLOC_CAP_INTERNAL);
-    if (buffer == nullptr) {
-        ESP_LOGE(TAG, "Failed to allocate buffer");
-        return false;
-    }
-
-    size_t buffer_offset = 0;  // Current data size in buffer
-    size_t total_read = 0, recent_read = 0;
-    auto last_calc_time = esp_timer_get_time();
-    while (true) {
-        int ret = http->Read(buffer + buffer_offset, PAGE_SIZE - buffer_offset);
-        if (ret < 0) {
-            ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
-            heap_caps_free(buffer);
-            return false;
-        }
-
-        // Calculate speed and progress every second
-        recent_read += ret;
-        total_read += ret;
-        buffer_offset += ret;
-        if (esp_timer_get_time() - last_calc_time >= 1000000 || ret == 0) {
-            size_t progress = total_read * 100 / content_length;
-            ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %uB/s", progress, total_read, content_length, recent_read);
-            if (callback) {
-                callback(progress, recent_read);
-            }
-            last_calc_time = esp_timer_get_time();
-            recent_read = 0;
-        }
-
-        if (!image_header_checked) {
-            image_header.append(buffer, buffer_offset);
-            if (image_header.size() >= sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
-                esp_app_desc_t new_app_info;
-                memcpy(&new_app_info, image_header.data() + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(esp_app_desc_t));
-
-                if (esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle)) {
-                    esp_ota_abort(update_handle);
-                    ESP_LOGE(TAG, "Failed to begin OTA");
-                    heap_caps_free(buffer);
-                    return false;
-                }
-
-                image_header_checked = true;
-                std::string().swap(image_header);
+    // The writer task writes a sector while the next one is downloaded. The OTA begins with the
+    // first sector, and again if the download starts over.
+    PartitionWriter writer([&update_handle, update_partition](const char* data, size_t offset, size_t length) -> esp_err_t {
+        if (offset == 0) {
+            if (update_handle != 0) {
+                esp_ota_abort(update_handle);
+                update_handle = 0;
             }
-        }
-
-        // Write to flash when buffer is full (4KB) or it's the last chunk
-        bool is_last_chunk = (ret == 0);
-        if (buffer_offset == PAGE_SIZE || (is_last_chunk && buffer_offset > 0)) {
-            auto err = esp_ota_write(update_handle, buffer, buffer_offset);
+            esp_err_t err = esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle);
             if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
-                esp_ota_abort(update_handle);
-                heap_caps_free(buffer);
-                return false;
+                ESP_LOGE(TAG, "Failed to begin OTA: %s", esp_err_to_name(err));
+                update_handle = 0;
+                return err;
             }
-
-            buffer_offset = 0;
         }
+        esp_err_t err = esp_ota_write(update_handle, data, length);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
+        }
+        return err;
+    });
+    if (!writer.valid()) {
+        ESP_LOGE(TAG, "Failed to create the OTA writer");
+        return false;
+    }
 
-        if (is_last_chunk) {
-            break;
+    // The firmware may come deflated, or as a patch that copies from the running firmware,
+    // which is known by its ELF SHA-256
+    auto running_partition = esp_ota_get_running_partition();
+    PatchDecoder decoder(writer, running_partition, esp_app_get_description()->app_elf_sha256);
+    ResumableDownload download(firmware_url, writer.sector_size());
+    download.SetMaxLength(update_partition->size);
+    download.SetThrottle(max_speed, paused);
+    bool success = download.Run([&decoder](const char* data, size_t length) {
+        return decoder.Write(data, length);
+    }, [&decoder]() {
+        return decoder.Reset();
+    }, callback);
+
+    // The writer task is done with the handle once flushed
+    success = success && decoder.Finish();
+    if (!writer.Flush() || !success) {
+        if (update_handle != 0) {
+            esp_ota_abort(update_handle);
         }
+        return false;
     }
-    http->Close();
-    heap_caps_free(buffer);
 
     esp_err_t err = esp_ota_end(update_handle);
     if (err != ESP_OK) {
@@ -387,6 +585,13 @@ bool Ota::Upgrade(const std::string& firmware_url, std::function<void(int progre
 }
 
 bool Ota::StartUpgrade(std::function<void(int progress, size_t speed)> callback) {
+    // The patch fails before writing anything if it is not for the running firmware
+    if (!firmware_patch_url_.empty()) {
+        if (Upgrade(firmware_patch_url_, callback)) {
+            return true;
+        }
+        ESP_LOGW(TAG, "Failed to upgrade with the patch, downloading the full firmware");
+    }
     return Upgrade(firmware_url_, callback);
 }
 
@@ -0,0 +1,122 @@
+#include "partition_writer.h"
+#include "heap_monitor.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+
+#define TAG "PartitionWriter"
+
+PartitionWriter::PartitionWriter(const esp_partition_t* partition)
+    : PartitionWriter([partition](const char* data, size_t offset, size_t length) -> esp_err_t {
+        size_t sector_size = esp_partition_get_main_flash_sector_size();
+        if (offset % sector_size != 0 || offset + sector_size > partition->size) {
+            ESP_LOGE(TAG, "Sector at offset %u exceeds partition size (%lu)", offset, partition->size);
+            return ESP_ERR_INVALID_SIZE;
+        }
+        esp_err_t err = esp_partition_erase_range(partition, offset, sector_size);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to erase sector at offset %u: %s", offset, esp_err_to_name(err));
+            return err;
+        }
+        err = esp_partition_write(partition, offset, data, length);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to write to partition at offset %u: %s", offset, esp_err_to_name(err));
+        }
+        return err;
+    }) {
+}
+
+PartitionWriter::PartitionWriter(WriteCallback write)
+    : write_(std::move(write)), sector_size_(esp_partition_get_main_flash_sector_size()) {
+    free_ = xQueueCreate(PARTITION_WRITER_BUFFER_COUNT, sizeof(char*));
+    pending_ = xQueueCreate(PARTITION_WRITER_BUFFER_COUNT + 1, sizeof(Block));
+    idle_ = xSemaphoreCreateBinary();
+    if (free_ == nullptr || pending_ == nullptr || idle_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to create the writer queues");
+        return;
+    }
+    // The flash is written from internal RAM, as a buffer in PSRAM would be copied again
+    for (auto& buffer : buffers_) {
+        buffer = (char*)HeapMonitor::GetInstance().Malloc(kHeapTagOta, sector_size_, MALLOC_CAP_INTERNAL);
+        if (buffer == nullptr) {
+            ESP_LOGE(TAG, "Failed to allocate buffer");
+            return;
+        }
+        xQueueSend(free_, &buffer, 0);
+    }
+    // The same priority as the downloader, so the two take turns while the flash is busy
+    xTaskCreate([](void* arg) {
+        auto writer = static_cast<PartitionWriter*>(arg);
+        writer->WriterTask();
+        vTaskDelete(NULL);
+    }, "partition_writer", 4096, this, uxTaskPriorityGet(nullptr), &task_);
+}
+
+PartitionWriter::~PartitionWriter() {
+    if (task_ != nullptr) {
+        stop_ = true;
+        Block stop = {nullptr, 0, 0};
+        xQueueSend(pending_, &stop, portMAX_DELAY);
+        xSemaphoreTake(idle_, portMAX_DELAY);
+    }
+    for (auto buffer : buffers_) {
+        HeapMonitor::GetInstance().Free(kHeapTagOta, buffer);
+    }
+    if (free_ != nullptr) {
+        vQueueDelete(free_);
+    }
+    if (pending_ != nullptr) {
+        vQueueDelete(pending_);
+    }
+    if (idle_ != nullptr) {
+        vSemaphoreDelete(idle_);
+    }
+}
+
+char* PartitionWriter::GetBuffer() {
+    char* buffer = nullptr;
+    xQueueReceive(free_, &buffer, portMAX_DELAY);
+    if (failed_) {
+        xQueueSend(free_, &buffer, 0);
+        return nullptr;
+    }
+    return buffer;
+}
+
+void PartitionWriter::Submit(char* buffer, size_t offset, size_t length) {
+    Block block = {buffer, offset, length};
+    xQueueSend(pending_, &block, portMAX_DELAY);
+}
+
+bool PartitionWriter::Flush() {
+    Block flush = {nullptr, 0, 0};
+    xQueueSend(pending_, &flush, portMAX_DELAY);
+    xSemaphoreTake(idle_, portMAX_DELAY);
+    return !failed_;
+}
+
+void PartitionWriter::WriterTask() {
+    while (true) {
+        Block block;
+        xQueueReceive(pending_, &block, portMAX_DELAY);
+        if (block.data == nullptr) {
+            // The writer may be deleted as soon as the semaphore is given
+            bool stop = stop_;
+            xSemaphoreGive(idle_);
+            if (stop) {
+                return;
+            }
+            continue;
+        }
+        if (!failed_) {
+            Write(block);
+        }
+        xQueueSend(free_, &block.data, portMAX_DELAY);
+    }
+}
+
+void PartitionWriter::Write(const Block& block) {
+    if (write_(block.data, block.offset, block.length) != ESP_OK) {
+        failed_ = true;
+    }
+}
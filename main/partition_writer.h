@@ -0,0 +1,67 @@
+#ifndef _PARTITION_WRITER_H_
+#define _PARTITION_WRITER_H_
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <esp_partition.h>
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+
+// The number of sector buffers, one is filled from the network while the other is written
+#define PARTITION_WRITER_BUFFER_COUNT 2
+
+/*
+ * Erases and writes a partition in a task of its own, one sector buffer at a time, or hands the
+ * sectors to a callback in that task.
+ *
+ * The downloader fills a buffer from GetBuffer() and hands it over with Submit(), then goes on
+ * reading the network into the next buffer while the sector is erased and written. Each buffer
+ * starts at a sector and only the last one may be shorter than a sector. The buffers may be
+ * submitted again at a lower offset, the sectors are erased again.
+ */
+class PartitionWriter {
+public:
+    // Called by the writer task with the blocks in the order they were submitted
+    typedef std::function<esp_err_t(const char* data, size_t offset, size_t length)> WriteCallback;
+
+    // Erases each sector of the partition before it is written
+    PartitionWriter(const esp_partition_t* partition);
+    // Leaves the writing to the callback, e.g. esp_ota_write()
+    PartitionWriter(WriteCallback write);
+    ~PartitionWriter();
+
+    bool valid() const { return task_ != nullptr; }
+    size_t sector_size() const { return sector_size_; }
+
+    // A free buffer of sector_size(), nullptr once a write failed
+    char* GetBuffer();
+    void Submit(char* buffer, size_t offset, size_t length);
+    // Waits for the submitted buffers, false if any of them failed
+    bool Flush();
+
+private:
+    struct Block {
+        char* data;
+        size_t offset;
+        size_t length;
+    };
+
+    WriteCallback write_;
+    size_t sector_size_;
+    char* buffers_[PARTITION_WRITER_BUFFER_COUNT] = {};
+    QueueHandle_t free_ = nullptr;      // Buffers to fill
+    QueueHandle_t pending_ = nullptr;   // Blocks to write, a nullptr data asks for idle_
+    SemaphoreHandle_t idle_ = nullptr;  // Given when the task got to the blocks before the request
+    TaskHandle_t task_ = nullptr;
+    std::atomic<bool> failed_ = false;
+    std::atomic<bool> stop_ = false;
+
+    void WriterTask();
+    void Write(const Block& block);
+};
+
+#endif // _PARTITION_WRITER_H_
@@ -0,0 +1,312 @@
+#include "patch_decoder.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <algorithm>
+#include <cstring>
+
+#if __has_include(<rom/miniz.h>)
+#include <rom/miniz.h>
+#define HAVE_ROM_INFLATE 1
+#else
+#define HAVE_ROM_INFLATE 0
+#endif
+
+#define TAG "PatchDecoder"
+
+#define OPERATION_COPY 0x01
+#define OPERATION_LITERAL 0x02
+#define OPERATION_ADD 0x03
+
+static uint32_t ReadUint32(const uint8_t* data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+PatchDecoder::PatchDecoder(PartitionWriter& writer, const esp_partition_t* base, const uint8_t* base_id, bool in_place)
+    : writer_(writer), base_(base), in_place_(in_place) {
+    if (base_id != nullptr) {
+        memcpy(base_id_, base_id, sizeof(base_id_));
+    }
+}
+
+PatchDecoder::~PatchDecoder() {
+    // A buffer taken from the writer goes back with the writer
+    FreeInflator();
+}
+
+bool PatchDecoder::Reset() {
+    if (in_place_ && mode_ == kModePatch && has_base_ && written_ > buffer_offset_) {
+        ESP_LOGE(TAG, "The patch has overwritten its base, it can not start over");
+        return false;
+    }
+    mode_ = kModeUnknown;
+    header_length_ = 0;
+    image_length_ = 0;
+    has_base_ = false;
+    deflate_ = false;
+    buffer_offset_ = 0;
+    written_ = 0;
+    operation_length_ = 0;
+    literal_left_ = 0;
+    add_left_ = 0;
+    FreeInflator();
+    return true;
+}
+
+bool PatchDecoder::Write(const char* data, size_t length) {
+    auto bytes = reinterpret_cast<const uint8_t*>(data);
+    if (mode_ == kModeImage) {
+        return Output(bytes, length);
+    }
+
+    // The header is collected first, it may come in pieces
+    if (mode_ == kModeUnknown || header_length_ < PATCH_HEADER_SIZE) {
+        size_t wanted = mode_ == kModeUnknown ? 4 : PATCH_HEADER_SIZE;
+        size_t size = std::min(wanted - header_length_, length);
+        memcpy(header_ + header_length_, bytes, size);
+        header_length_ += size;
+        bytes += size;
+        length -= size;
+        if (header_length_ < wanted) {
+            return true;
+        }
+        if (mode_ == kModeUnknown) {
+            if (memcmp(header_, PATCH_MAGIC, 4) != 0) {
+                mode_ = kModeImage;
+                return Output(header_, header_length_) && Output(bytes, length);
+            }
+            mode_ = kModePatch;
+            return Write(reinterpret_cast<const char*>(bytes), length);
+        }
+        if (!ParseHeader()) {
+            return false;
+        }
+    }
+
+    if (deflate_) {
+        return Inflate(bytes, length);
+    }
+    return ParseOperations(bytes, length);
+}
+
+bool PatchDecoder::Finish() {
+    if (mode_ == kModePatch) {
+        if (header_length_ < PATCH_HEADER_SIZE || written_ != image_length_ || operation_length_ > 0
+            || literal_left_ > 0 || add_left_ > 0 || (deflate_ && !inflate_done_)) {
+            ESP_LOGE(TAG, "The patch ended at %u of %lu bytes", written_, image_length_);
+            return false;
+        }
+    }
+    if (buffer_ != nullptr && buffer_offset_ > 0) {
+        writer_.Submit(buffer_, written_ - buffer_offset_, buffer_offset_);
+        buffer_ = nullptr;
+    }
+    return mode_ != kModeUnknown;
+}
+
+bool PatchDecoder::ParseHeader() {
+    uint32_t flags = ReadUint32(header_ + 4);
+    image_length_ = ReadUint32(header_ + 20);
+
+    // The copies are only valid from the image the patch was made against
+    uint8_t no_base[PATCH_BASE_ID_SIZE] = {};
+    has_base_ = memcmp(header_ + 8, no_base, PATCH_BASE_ID_SIZE) != 0;
+    if (has_base_ && (base_ == nullptr || memcmp(header_ + 8, base_id_, PATCH_BASE_ID_SIZE) != 0)) {
+        ESP_LOGE(TAG, "The patch is for the base %08lx%08lx%08lx, not %08lx%08lx%08lx",
+            ReadUint32(header_ + 8), ReadUint32(header_ + 12), ReadUint32(header_ + 16),
+            ReadUint32(base_id_), ReadUint32(base_id_ + 4), ReadUint32(base_id_ + 8));
+        return false;
+    }
+
+    deflate_ = (flags & PATCH_FLAG_DEFLATE) != 0;
+    if (!deflate_) {
+        return true;
+    }
+#if HAVE_ROM_INFLATE
+    // The window of the inflator is 32 KB, which is PSRAM if there is any
+#if CONFIG_SPIRAM
+    inflator_ = (tinfl_decompressor*)heap_caps_malloc(sizeof(tinfl_decompressor), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    window_ = (uint8_t*)heap_caps_malloc(TINFL_LZ_DICT_SIZE, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#else
+    inflator_ = (tinfl_decompressor*)heap_caps_malloc(sizeof(tinfl_decompressor), MALLOC_CAP_8BIT);
+    window_ = (uint8_t*)heap_caps_malloc(TINFL_LZ_DICT_SIZE, MALLOC_CAP_8BIT);
+#endif
+    if (inflator_ == nullptr || window_ == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate the inflator");
+        return false;
+    }
+    tinfl_init(inflator_);
+    window_offset_ = 0;
+    inflate_done_ = false;
+    return true;
+#else
+    ESP_LOGE(TAG, "Compressed patches are not supported on this chip");
+    return false;
+#endif
+}
+
+bool PatchDecoder::Inflate(const uint8_t* data, size_t length) {
+#if HAVE_ROM_INFLATE
+    while (!inflate_done_) {
+        size_t in_bytes = length;
+        size_t out_bytes = TINFL_LZ_DICT_SIZE - window_offset_;
+        tinfl_status status = tinfl_decompress(inflator_, data, &in_bytes, window_, window_ + window_offset_, &out_bytes,
+            TINFL_FLAG_HAS_MORE_INPUT | TINFL_FLAG_PARSE_ZLIB_HEADER);
+        data += in_bytes;
+        length -= in_bytes;
+        if (out_bytes > 0 && !ParseOperations(window_ + window_offset_, out_bytes)) {
+            return false;
+        }
+        window_offset_ = (window_offset_ + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+
+        if (status < TINFL_STATUS_DONE) {
+            ESP_LOGE(TAG, "Failed to inflate the patch: %d", status);
+            return false;
+        }
+        if (status == TINFL_STATUS_DONE) {
+            inflate_done_ = true;
+        } else if (status == TINFL_STATUS_NEEDS_MORE_INPUT && length == 0) {
+            return true;
+        }
+    }
+    if (length > 0) {
+        ESP_LOGE(TAG, "The patch goes on after its end");
+        return false;
+    }
+    return true;
+#else
+    (void)data;
+    (void)length;
+    return false;
+#endif
+}
+
+bool PatchDecoder::ParseOperations(const uint8_t* data, size_t length) {
+    while (length > 0) {
+        if (literal_left_ > 0) {
+            size_t size = std::min<size_t>(literal_left_, length);
+            if (!Output(data, size)) {
+                return false;
+            }
+            literal_left_ -= size;
+            data += size;
+            length -= size;
+            continue;
+        }
+        if (add_left_ > 0) {
+            size_t size = std::min<size_t>(add_left_, length);
+            if (!Copy(add_offset_, size, data)) {
+                return false;
+            }
+            add_offset_ += size;
+            add_left_ -= size;
+            data += size;
+            length -= size;
+            continue;
+        }
+
+        operation_[operation_length_++] = *data++;
+        length--;
+        if (operation_[0] == OPERATION_COPY) {
+            if (operation_length_ == 9) {
+                operation_length_ = 0;
+                if (!Copy(ReadUint32(operation_ + 1), ReadUint32(operation_ + 5), nullptr)) {
+                    return false;
+                }
+            }
+        } else if (operation_[0] == OPERATION_ADD) {
+            if (operation_length_ == 9) {
+                operation_length_ = 0;
+                add_offset_ = ReadUint32(operation_ + 1);
+                add_left_ = ReadUint32(operation_ + 5);
+            }
+        } else if (operation_[0] == OPERATION_LITERAL) {
+            if (operation_length_ == 5) {
+                operation_length_ = 0;
+                literal_left_ = ReadUint32(operation_ + 1);
+            }
+        } else {
+            ESP_LOGE(TAG, "Unknown patch operation 0x%02x at %u", operation_[0], written_);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PatchDecoder::Output(const uint8_t* data, size_t length) {
+    if (mode_ == kModePatch && length > image_length_ - written_) {
+        ESP_LOGE(TAG, "The patch writes past the image length (%lu)", image_length_);
+        return false;
+    }
+    while (length > 0) {
+        if (!NextBuffer()) {
+            return false;
+        }
+        size_t size = std::min(writer_.sector_size() - buffer_offset_, length);
+        memcpy(buffer_ + buffer_offset_, data, size);
+        buffer_offset_ += size;
+        written_ += size;
+        data += size;
+        length -= size;
+    }
+    return true;
+}
+
+bool PatchDecoder::Copy(uint32_t offset, uint32_t length, const uint8_t* differences) {
+    if (!has_base_) {
+        ESP_LOGE(TAG, "The patch copies without a base");
+        return false;
+    }
+    if (length > image_length_ - written_ || offset > base_->size || length > base_->size - offset) {
+        ESP_LOGE(TAG, "The copy of %lu bytes at 0x%lx is out of the image", length, offset);
+        return false;
+    }
+    while (length > 0) {
+        if (!NextBuffer()) {
+            return false;
+        }
+        // The sectors before the one being filled are erased already
+        if (in_place_ && offset < written_ - buffer_offset_) {
+            ESP_LOGE(TAG, "The copy at 0x%lx reads the overwritten sector before 0x%x", offset, written_ - buffer_offset_);
+            return false;
+        }
+        size_t size = std::min<size_t>(writer_.sector_size() - buffer_offset_, length);
+        esp_err_t err = esp_partition_read(base_, offset, buffer_ + buffer_offset_, size);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to read the base at 0x%lx: %s", offset, esp_err_to_name(err));
+            return false;
+        }
+        if (differences != nullptr) {
+            auto bytes = reinterpret_cast<uint8_t*>(buffer_ + buffer_offset_);
+            for (size_t i = 0; i < size; i++) {
+                bytes[i] += differences[i];
+            }
+            differences += size;
+        }
+        buffer_offset_ += size;
+        written_ += size;
+        offset += size;
+        length -= size;
+    }
+    return true;
+}
+
+bool PatchDecoder::NextBuffer() {
+    if (buffer_ != nullptr && buffer_offset_ == writer_.sector_size()) {
+        writer_.Submit(buffer_, written_ - buffer_offset_, buffer_offset_);
+        buffer_ = nullptr;
+    }
+    if (buffer_ == nullptr) {
+        // A failed write is logged by the writer
+        buffer_ = writer_.GetBuffer();
+        buffer_offset_ = 0;
+    }
+    return buffer_ != nullptr;
+}
+
+void PatchDecoder::FreeInflator() {
+    heap_caps_free(inflator_);
+    heap_caps_free(window_);
+    inflator_ = nullptr;
+    window_ = nullptr;
+}
@@ -0,0 +1,96 @@
+#ifndef _PATCH_DECODER_H_
+#define _PATCH_DECODER_H_
+
+#include "partition_writer.h"
+
+#include <esp_partition.h>
+#include <cstddef>
+#include <cstdint>
+
+// The first bytes of a patch, an assets image starts with its file count and a firmware with 0xE9
+#define PATCH_MAGIC "ZPT1"
+#define PATCH_HEADER_SIZE 24
+#define PATCH_BASE_ID_SIZE 12
+// The operations after the header are a zlib stream
+#define PATCH_FLAG_DEFLATE 0x01
+
+struct tinfl_decompressor_tag;
+
+/*
+ * Turns a downloaded image or patch into the image the writer writes, as it streams in.
+ *
+ * A file that does not start with the magic is the image itself. A patch is made by
+ * scripts/spiffs_assets/build_patch.py:
+ *
+ *   "ZPT1", u32 flags, the id of the base image (12 bytes), u32 image length
+ *   operations, deflated with PATCH_FLAG_DEFLATE:
+ *     0x01 u32 offset, u32 length            copies from the base image
+ *     0x02 u32 length, bytes                 the new bytes
+ *     0x03 u32 offset, u32 length, bytes     adds the bytes to those copied from the base image
+ *
+ * A patch with an id of zeros has no base, it is only compressed. When the new image is written
+ * over its base sector by sector, a copy may only read from the sector being written or the
+ * ones after it. The numbers are little endian.
+ */
+class PatchDecoder {
+public:
+    // A patch copies from the base partition only if its base id matches
+    PatchDecoder(PartitionWriter& writer, const esp_partition_t* base = nullptr, const uint8_t* base_id = nullptr, bool in_place = false);
+    ~PatchDecoder();
+
+    // Starts over from the start of the file, false if the patch has overwritten its base
+    bool Reset();
+    // Decodes the next downloaded bytes, false if the file is not valid or was not written
+    bool Write(const char* data, size_t length);
+    // Submits the last sector, false unless the file was complete
+    bool Finish();
+    // Whether the file is a patch, valid after the first bytes
+    bool is_patch() const { return mode_ == kModePatch; }
+
+private:
+    enum Mode {
+        kModeUnknown,   // Until the magic is in
+        kModeImage,
+        kModePatch,
+    };
+
+    PartitionWriter& writer_;
+    const esp_partition_t* base_;
+    uint8_t base_id_[PATCH_BASE_ID_SIZE] = {};
+    bool in_place_;
+    bool has_base_ = false;     // Of the patch
+    Mode mode_ = kModeUnknown;
+    uint8_t header_[PATCH_HEADER_SIZE];
+    size_t header_length_ = 0;
+    uint32_t image_length_ = 0;
+    bool deflate_ = false;
+
+    // The sector being filled
+    char* buffer_ = nullptr;
+    size_t buffer_offset_ = 0;
+    size_t written_ = 0;
+
+    // The operation being parsed
+    uint8_t operation_[9];
+    size_t operation_length_ = 0;
+    uint32_t literal_left_ = 0;
+    uint32_t add_offset_ = 0;
+    uint32_t add_left_ = 0;
+
+    // Inflating, the window is also the output buffer
+    tinfl_decompressor_tag* inflator_ = nullptr;
+    uint8_t* window_ = nullptr;
+    size_t window_offset_ = 0;
+    bool inflate_done_ = false;
+
+    bool ParseHeader();
+    bool Inflate(const uint8_t* data, size_t length);
+    bool ParseOperations(const uint8_t* data, size_t length);
+    bool Output(const uint8_t* data, size_t length);
+    // Adds the differences to the copied bytes unless they are nullptr
+    bool Copy(uint32_t offset, uint32_t length, const uint8_t* differences);
+    bool NextBuffer();
+    void FreeInflator();
+};
+
+#endif // _PATCH_DECODER_H_
@@ -0,0 +1,167 @@
+#include "perf_counters.h"
+#include "application.h"
+#include "json_writer.h"
+#include "system_info.h"
+#include "wakeup_coalescer.h"
+
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <cstdlib>
+
+#define TAG "PerfCounters"
+
+void PerfHistogram::Record(uint32_t value) {
+    int bucket = value == 0 ? 0 : 32 - __builtin_clz(value);
+    if (bucket >= PERF_HISTOGRAM_BUCKETS) {
+        bucket = PERF_HISTOGRAM_BUCKETS - 1;
+    }
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    uint32_t max = max_.load(std::memory_order_relaxed);
+    while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+cJSON* PerfHistogram::GetStatsJson() const {
+    uint32_t counts[PERF_HISTOGRAM_BUCKETS];
+    uint32_t count = 0;
+    for (int i = 0; i < PERF_HISTOGRAM_BUCKETS; i++) {
+        counts[i] = buckets_[i].load(std::memory_order_relaxed);
+        count += counts[i];
+    }
+
+    auto json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "count", count);
+    cJSON_AddNumberToObject(json, "mean", count > 0 ? sum_.load(std::memory_order_relaxed) / count : 0);
+    cJSON_AddNumberToObject(json, "max", max_.load(std::memory_order_relaxed));
+    // The percentiles are the upper bounds of their buckets
+    static const struct { const char* name; uint32_t percent; } kPercentiles[] = {
+        {"p50", 50}, {"p90", 90}, {"p99", 99},
+    };
+    for (const auto& percentile : kPercentiles) {
+        uint64_t target = ((uint64_t)count * percentile.percent + 99) / 100;
+        uint64_t seen = 0;
+        uint32_t bound = 0;
+        for (int i = 0; i < PERF_HISTOGRAM_BUCKETS && count > 0; i++) {
+            seen += counts[i];
+            if (seen >= target) {
+                bound = i == 0 ? 0 : (1u << i) - 1;
+                break;
+            }
+        }
+        cJSON_AddNumberToObject(json, percentile.name, bound);
+    }
+    return json;
+}
+
+PerfCounters::PerfCounters() {
+    auto& coalescer = WakeupCoalescer::GetInstance();
+    int sample_job = coalescer.Add("task_usage", PERF_TASK_SAMPLE_INTERVAL_MS, [this](int periods) {
+        SampleTasks();
+    });
+    coalescer.Start(sample_job);
+#if CONFIG_PERF_STATS_UPLOAD_INTERVAL_S > 0
+    int upload_job = coalescer.Add("perf_upload", CONFIG_PERF_STATS_UPLOAD_INTERVAL_S * 1000, [this](int periods) {
+        Upload();
+    });
+    coalescer.Start(upload_job);
+#endif
+}
+
+PerfCounter* PerfCounters::Counter(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& counter = counters_[name];
+    if (!counter) {
+        counter = std::make_unique<PerfCounter>();
+    }
+    return counter.get();
+}
+
+PerfGauge* PerfCounters::Gauge(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& gauge = gauges_[name];
+    if (!gauge) {
+        gauge = std::make_unique<PerfGauge>();
+    }
+    return gauge.get();
+}
+
+PerfHistogram* PerfCounters::Histogram(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& histogram = histograms_[name];
+    if (!histogram) {
+        histogram = std::make_unique<PerfHistogram>();
+    }
+    return histogram.get();
+}
+
+void PerfCounters::SampleTasks() {
+    UBaseType_t size = uxTaskGetNumberOfTasks() + 5;
+    auto tasks = (TaskStatus_t*)malloc(sizeof(TaskStatus_t) * size);
+    if (tasks == nullptr) {
+        return;
+    }
+    configRUN_TIME_COUNTER_TYPE total_run_time;
+    size = uxTaskGetSystemState(tasks, size, &total_run_time);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t elapsed = (uint64_t)(total_run_time - last_total_run_time_) * CONFIG_FREERTOS_NUMBER_OF_CORES;
+    bool first = last_total_run_time_ == 0;
+    std::map<UBaseType_t, configRUN_TIME_COUNTER_TYPE> run_times;
+    task_usage_.clear();
+    for (UBaseType_t i = 0; i < size; i++) {
+        run_times[tasks[i].xTaskNumber] = tasks[i].ulRunTimeCounter;
+        auto last = last_task_run_time_.find(tasks[i].xTaskNumber);
+        // A task created since the last sample has run for its whole counter
+        configRUN_TIME_COUNTER_TYPE run_time = tasks[i].ulRunTimeCounter;
+        if (last != last_task_run_time_.end()) {
+            run_time -= last->second;
+        }
+        if (!first && elapsed > 0) {
+            task_usage_.push_back({tasks[i].pcTaskName, (uint32_t)(run_time * 100ULL / elapsed)});
+        }
+    }
+    free(tasks);
+    last_task_run_time_ = std::move(run_times);
+    last_total_run_time_ = total_run_time;
+}
+
+cJSON* PerfCounters::GetStatsJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto json = cJSON_CreateObject();
+    auto counters = cJSON_CreateObject();
+    for (const auto& [name, counter] : counters_) {
+        cJSON_AddNumberToObject(counters, name.c_str(), counter->value());
+    }
+    cJSON_AddItemToObject(json, "counters", counters);
+    auto gauges = cJSON_CreateObject();
+    for (const auto& [name, gauge] : gauges_) {
+        cJSON_AddNumberToObject(gauges, name.c_str(), gauge->value());
+    }
+    cJSON_AddItemToObject(json, "gauges", gauges);
+    auto histograms = cJSON_CreateObject();
+    for (const auto& [name, histogram] : histograms_) {
+        cJSON_AddItemToObject(histograms, name.c_str(), histogram->GetStatsJson());
+    }
+    cJSON_AddItemToObject(json, "histograms", histograms);
+    auto tasks = cJSON_CreateObject();
+    for (const auto& task : task_usage_) {
+        cJSON_AddNumberToObject(tasks, task.name.c_str(), task.percent);
+    }
+    cJSON_AddItemToObject(json, "task_cpu_percent", tasks);
+    cJSON_AddNumberToObject(json, "free_heap", SystemInfo::GetFreeHeapSize());
+    cJSON_AddNumberToObject(json, "min_free_heap", SystemInfo::GetMinimumFreeHeapSize());
+    return json;
+}
+
+void PerfCounters::Upload() {
+    auto stats = GetStatsJson();
+    char* json = cJSON_PrintUnformatted(stats);
+    cJSON_Delete(stats);
+    std::string payload;
+    JsonWriter writer(payload);
+    writer.BeginObject().Key("jsonrpc").String("2.0").Key("method").String("notifications/performance_stats")
+        .Key("params").Raw(json).EndObject();
+    cJSON_free(json);
+    Application::GetInstance().SendMcpMessage(std::move(payload));
+}
@@ -0,0 +1,88 @@
+#ifndef _PERF_COUNTERS_H_
+#define _PERF_COUNTERS_H_
+
+#include <cJSON.h>
+#include <freertos/FreeRTOS.h>
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Bucket i of a histogram holds the values below 2^i, the last one the rest
+#define PERF_HISTOGRAM_BUCKETS 24
+#define PERF_TASK_SAMPLE_INTERVAL_MS 10000
+
+class PerfCounter {
+public:
+    void Add(uint32_t count = 1) { value_.fetch_add(count, std::memory_order_relaxed); }
+    uint32_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint32_t> value_{0};
+};
+
+class PerfGauge {
+public:
+    void Set(int32_t value) { value_.store(value, std::memory_order_relaxed); }
+    int32_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int32_t> value_{0};
+};
+
+class PerfHistogram {
+public:
+    void Record(uint32_t value);
+    cJSON* GetStatsJson() const;
+
+private:
+    std::atomic<uint32_t> buckets_[PERF_HISTOGRAM_BUCKETS] = {};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint32_t> max_{0};
+};
+
+/*
+ * The performance counters of the subsystems, for get_performance_stats when there is no serial.
+ *
+ * A subsystem looks its counters up by name once and keeps the pointer, they live as long as the
+ * firmware. Updating one is a relaxed atomic, cheap enough for the audio tasks. The CPU usage of
+ * the tasks is sampled every PERF_TASK_SAMPLE_INTERVAL_MS in the wake windows of the other
+ * periodic work.
+ */
+class PerfCounters {
+public:
+    static PerfCounters& GetInstance() {
+        static PerfCounters instance;
+        return instance;
+    }
+
+    PerfCounter* Counter(const std::string& name);
+    PerfGauge* Gauge(const std::string& name);
+    PerfHistogram* Histogram(const std::string& name);
+    cJSON* GetStatsJson();
+
+private:
+    struct TaskUsage {
+        std::string name;
+        uint32_t percent;
+    };
+
+    std::mutex mutex_;
+    std::map<std::string, std::unique_ptr<PerfCounter>> counters_;
+    std::map<std::string, std::unique_ptr<PerfGauge>> gauges_;
+    std::map<std::string, std::unique_ptr<PerfHistogram>> histograms_;
+    // The run time counters of the last sample by task number
+    std::map<UBaseType_t, configRUN_TIME_COUNTER_TYPE> last_task_run_time_;
+    configRUN_TIME_COUNTER_TYPE last_total_run_time_ = 0;
+    std::vector<TaskUsage> task_usage_;
+
+    PerfCounters();
+    void SampleTasks();
+    void Upload();
+};
+
+#endif // _PERF_COUNTERS_H_
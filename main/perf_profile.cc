@@ -0,0 +1,156 @@
+#include "perf_profile.h"
+#include "settings.h"
+#include "audio_service.h"
+
+#include <esp_log.h>
+#include <cmath>
+
+#define TAG "PerfProfile"
+
+#define PERF_PROFILE_NAMESPACE "perf_profile"
+
+// The NVS keys are the short ones, NVS takes 15 characters at most
+const PerfProfile::FieldInfo PerfProfile::kFields[kFieldCount] = {
+    { "frame_ms", "frame_ms", 20, 120, 20 },
+    { "max_complexity", "complexity", 0, 10, 1 },
+    { "jitter_min_frames", "jitter_min", 1, 8, 1 },
+    { "decode_queue_packets", "decode_queue", 4, MAX_DECODE_PACKETS_IN_QUEUE, 1 },
+    { "send_queue_packets", "send_queue", 2, MAX_SEND_PACKETS_IN_QUEUE, 1 },
+    { "channel_timeout_s", "channel_tmo", 30, 600, 1 },
+    { "wifi_power_save_tail_ms", "wifi_tail_ms", 0, 120000, 1 },
+};
+
+PerfProfile::PerfProfile() {
+    for (auto& value : values_) {
+        value = -1;
+    }
+}
+
+void PerfProfile::Load() {
+#if CONFIG_PERF_PROFILE
+    Settings settings(PERF_PROFILE_NAMESPACE, false);
+    std::lock_guard<std::mutex> lock(mutex_);
+    id_ = settings.GetString("id");
+    for (int i = 0; i < kFieldCount; i++) {
+        int value = settings.GetInt(kFields[i].nvs_key, -1);
+        // The capacities of a new firmware may be lower than the ones the profile was checked against
+        if (value >= 0 && (value < kFields[i].min || value > kFields[i].max)) {
+            ESP_LOGW(TAG, "Ignoring %s %d of the stored profile", kFields[i].key, value);
+            value = -1;
+        }
+        values_[i] = value;
+    }
+    if (!id_.empty()) {
+        ESP_LOGI(TAG, "Performance profile: %s", id_.c_str());
+    }
+#endif
+}
+
+bool PerfProfile::Update(const cJSON* block) {
+#if CONFIG_PERF_PROFILE
+    auto reject = [this](const std::string& error) {
+        ESP_LOGW(TAG, "Rejected the performance profile: %s", error.c_str());
+        std::lock_guard<std::mutex> lock(mutex_);
+        last_error_ = error;
+        rejected_++;
+        return false;
+    };
+
+    std::string id;
+    int values[kFieldCount];
+    for (int i = 0; i < kFieldCount; i++) {
+        values[i] = -1;
+    }
+    if (block != nullptr) {
+        if (!cJSON_IsObject(block)) {
+            return reject("not an object");
+        }
+        cJSON* item = cJSON_GetObjectItem(block, "id");
+        if (item != nullptr) {
+            if (!cJSON_IsString(item)) {
+                return reject("id is not a string");
+            }
+            id = item->valuestring;
+        }
+        for (int i = 0; i < kFieldCount; i++) {
+            auto& field = kFields[i];
+            item = cJSON_GetObjectItem(block, field.key);
+            if (item == nullptr) {
+                continue;
+            }
+            if (!cJSON_IsNumber(item) || item->valuedouble != std::floor(item->valuedouble)) {
+                return reject(std::string(field.key) + " is not an integer");
+            }
+            if (item->valuedouble < field.min || item->valuedouble > field.max || item->valueint % field.step != 0) {
+                return reject(std::string(field.key) + " is out of range");
+            }
+            values[i] = item->valueint;
+        }
+        // A profile is told apart from the defaults by its id
+        if (id.empty()) {
+            id = "unnamed";
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    bool changed = id != id_;
+    for (int i = 0; i < kFieldCount; i++) {
+        changed = changed || values[i] != values_[i];
+    }
+    if (!changed) {
+        return true;
+    }
+
+    Settings settings(PERF_PROFILE_NAMESPACE, true);
+    if (id.empty()) {
+        settings.EraseAll();
+    } else {
+        settings.SetString("id", id);
+        for (int i = 0; i < kFieldCount; i++) {
+            if (values[i] < 0) {
+                settings.EraseKey(kFields[i].nvs_key);
+            } else {
+                settings.SetInt(kFields[i].nvs_key, values[i]);
+            }
+        }
+    }
+    for (int i = 0; i < kFieldCount; i++) {
+        values_[i] = values[i];
+    }
+    id_ = id;
+    updates_++;
+    ESP_LOGI(TAG, "Performance profile: %s", id.empty() ? "none" : id.c_str());
+#else
+    (void)block;
+#endif
+    return true;
+}
+
+std::string PerfProfile::id() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return id_;
+}
+
+cJSON* PerfProfile::GetStatsJson() {
+    auto json = cJSON_CreateObject();
+#if CONFIG_PERF_PROFILE
+    cJSON_AddBoolToObject(json, "enabled", true);
+#else
+    cJSON_AddBoolToObject(json, "enabled", false);
+#endif
+    std::lock_guard<std::mutex> lock(mutex_);
+    cJSON_AddStringToObject(json, "id", id_.c_str());
+    auto values = cJSON_CreateObject();
+    for (int i = 0; i < kFieldCount; i++) {
+        if (values_[i] >= 0) {
+            cJSON_AddNumberToObject(values, kFields[i].key, values_[i]);
+        }
+    }
+    cJSON_AddItemToObject(json, "values", values);
+    cJSON_AddNumberToObject(json, "updates", updates_);
+    cJSON_AddNumberToObject(json, "rejected", rejected_);
+    if (!last_error_.empty()) {
+        cJSON_AddStringToObject(json, "last_error", last_error_.c_str());
+    }
+    return json;
+}
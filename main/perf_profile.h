@@ -0,0 +1,80 @@
+#ifndef _PERF_PROFILE_H_
+#define _PERF_PROFILE_H_
+
+#include <cJSON.h>
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+/*
+ * The tuning the server pushes in the performance_profile block of the check version response,
+ * enabled with CONFIG_PERF_PROFILE.
+ *
+ * The queue depths, the Opus frame duration, the encoder complexity, the jitter buffer floor and
+ * the timeouts were fixed at build time, so trying a value on a fleet took a firmware release.
+ * Every field of the block is optional, and a field left out keeps the default of the build. A
+ * block with a field of the wrong type or out of its range is rejected as a whole and the profile
+ * in use stays, so a typo does not half apply. A response without the block drops the profile,
+ * that is how an experiment ends. The profile is kept in NVS and applies from the boot on, its id
+ * goes out with the system info so the server knows which devices run it.
+ *
+ * The compile time capacities of the queues stay the upper bounds, a profile may only lower them.
+ * Get() may be called by any task, the values are read by the users when they need them.
+ */
+class PerfProfile {
+public:
+    enum Field {
+        kFrameMs,               // Of the default encoder levels, the low latency and narrowband ones keep theirs
+        kMaxComplexity,         // Caps CONFIG_AUDIO_ENCODER_MAX_COMPLEXITY
+        kJitterMinFrames,       // The least delay of the jitter buffer
+        kDecodeQueuePackets,
+        kSendQueuePackets,
+        kChannelTimeoutS,       // An audio channel without incoming data is closed after it
+        kWifiPowerSaveTailMs,
+        kFieldCount,
+    };
+
+    static PerfProfile& GetInstance() {
+        static PerfProfile instance;
+        return instance;
+    }
+
+    // Reads the profile of the last response from NVS
+    void Load();
+    // The block of a response, nullptr if there is none. False if it was rejected
+    bool Update(const cJSON* block);
+    // The value of the profile, default_value where it has none
+    int Get(Field field, int default_value) const {
+        int value = values_[field].load(std::memory_order_relaxed);
+        return value < 0 ? default_value : value;
+    }
+    // Empty without a profile
+    std::string id();
+    // The caller owns the returned object
+    cJSON* GetStatsJson();
+
+private:
+    struct FieldInfo {
+        const char* key;
+        const char* nvs_key;
+        int min;
+        int max;
+        int step;       // The value is a multiple of it
+    };
+    static const FieldInfo kFields[kFieldCount];
+
+    std::atomic<int> values_[kFieldCount];     // -1 where the profile has none
+    std::mutex mutex_;
+    std::string id_;
+    std::string last_error_;
+    uint32_t updates_ = 0;
+    uint32_t rejected_ = 0;
+
+    PerfProfile();
+    PerfProfile(const PerfProfile&) = delete;
+    PerfProfile& operator=(const PerfProfile&) = delete;
+};
+
+#endif // _PERF_PROFILE_H_
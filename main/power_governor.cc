@@ -0,0 +1,180 @@
+#include "power_governor.h"
+#include "sdkconfig.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <string>
+
+#define TAG "PowerGovernor"
+
+// The lowest frequency in light sleep, the XTAL one
+#define POWER_GOVERNOR_SLEEP_FREQ_MHZ 40
+
+#if !CONFIG_POWER_GOVERNOR
+#define CONFIG_POWER_GOVERNOR_IDLE_FREQ_MHZ CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ
+#define CONFIG_POWER_GOVERNOR_MIN_FREQ_MHZ CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ
+#endif
+
+PowerLock::~PowerLock() {
+    Hold(false);
+    if (handle_ != nullptr) {
+        esp_pm_lock_delete(handle_);
+    }
+}
+
+void PowerLock::Hold(bool hold) {
+#if CONFIG_POWER_GOVERNOR
+    if (hold == held_) {
+        return;
+    }
+    if (handle_ == nullptr) {
+        if (esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, name_, &handle_) != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to create the lock %s", name_);
+            handle_ = nullptr;
+            return;
+        }
+    }
+    held_ = hold;
+    if (hold) {
+        esp_pm_lock_acquire(handle_);
+    } else {
+        esp_pm_lock_release(handle_);
+    }
+    PowerGovernor::GetInstance().OnLockChanged(hold);
+#else
+    (void)hold;
+#endif
+}
+
+bool PowerGovernor::enabled() const {
+#if CONFIG_POWER_GOVERNOR
+    return true;
+#else
+    return false;
+#endif
+}
+
+void PowerGovernor::Start() {
+#if CONFIG_POWER_GOVERNOR
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (started_) {
+        return;
+    }
+    started_ = true;
+    last_change_us_ = esp_timer_get_time();
+    current_freq_mhz_ = held_locks_ > 0 ? top_freq_mhz() : min_freq_mhz();
+    ApplyLocked();
+    ESP_LOGI(TAG, "Scaling between %d and %d MHz", min_freq_mhz(), top_freq_mhz());
+#endif
+}
+
+void PowerGovernor::OnStateChanged(DeviceState state) {
+#if CONFIG_POWER_GOVERNOR
+    // Only the wake word runs while idle, the conversation adds the AFE, the codecs and the UI
+    bool active = state != kDeviceStateIdle && state != kDeviceStateWifiConfiguring;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (active == active_) {
+        return;
+    }
+    active_ = active;
+    if (started_) {
+        ApplyLocked();
+    }
+#else
+    (void)state;
+#endif
+}
+
+void PowerGovernor::SetMaxFrequency(int max_freq_mhz) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_freq_mhz_ = max_freq_mhz;
+    if (started_) {
+        ApplyLocked();
+    }
+}
+
+void PowerGovernor::SetLightSleep(bool enable) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (enable == light_sleep_) {
+        return;
+    }
+    light_sleep_ = enable;
+    if (started_) {
+        ApplyLocked();
+    }
+}
+
+void PowerGovernor::OnLockChanged(bool held) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    held_locks_ += held ? 1 : -1;
+    if (started_ && (held_locks_ == 0 || (held && held_locks_ == 1))) {
+        AccountLocked();
+    }
+}
+
+int PowerGovernor::top_freq_mhz() const {
+    int freq = active_ ? CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ : CONFIG_POWER_GOVERNOR_IDLE_FREQ_MHZ;
+    if (max_freq_mhz_ > 0) {
+        freq = std::min(freq, max_freq_mhz_);
+    }
+    return std::min(freq, CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ);
+}
+
+int PowerGovernor::min_freq_mhz() const {
+    if (light_sleep_) {
+        return POWER_GOVERNOR_SLEEP_FREQ_MHZ;
+    }
+    return std::min(CONFIG_POWER_GOVERNOR_MIN_FREQ_MHZ, top_freq_mhz());
+}
+
+void PowerGovernor::ApplyLocked() {
+#if CONFIG_POWER_GOVERNOR
+    esp_pm_config_t pm_config = {
+        .max_freq_mhz = top_freq_mhz(),
+        .min_freq_mhz = min_freq_mhz(),
+        .light_sleep_enable = light_sleep_,
+    };
+    esp_err_t err = esp_pm_configure(&pm_config);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to configure %d-%d MHz: %s", pm_config.min_freq_mhz, pm_config.max_freq_mhz,
+            esp_err_to_name(err));
+        return;
+    }
+    AccountLocked();
+#endif
+}
+
+/* Counts the time since the last change to the frequency it ran at, and moves on to the new one */
+void PowerGovernor::AccountLocked() {
+    int64_t now_us = esp_timer_get_time();
+    residency_us_[current_freq_mhz_] += now_us - last_change_us_;
+    last_change_us_ = now_us;
+    int freq = held_locks_ > 0 ? top_freq_mhz() : min_freq_mhz();
+    if (freq != current_freq_mhz_) {
+        current_freq_mhz_ = freq;
+        transitions_++;
+    }
+}
+
+cJSON* PowerGovernor::GetStatsJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto json = cJSON_CreateObject();
+    cJSON_AddBoolToObject(json, "enabled", started_);
+    if (!started_) {
+        return json;
+    }
+    AccountLocked();
+    cJSON_AddNumberToObject(json, "freq_mhz", current_freq_mhz_);
+    cJSON_AddNumberToObject(json, "top_freq_mhz", top_freq_mhz());
+    cJSON_AddNumberToObject(json, "min_freq_mhz", min_freq_mhz());
+    cJSON_AddBoolToObject(json, "light_sleep", light_sleep_);
+    cJSON_AddNumberToObject(json, "held_locks", held_locks_);
+    cJSON_AddNumberToObject(json, "transitions", transitions_);
+    auto residency = cJSON_CreateObject();
+    for (const auto& [freq, time_us] : residency_us_) {
+        cJSON_AddNumberToObject(residency, std::to_string(freq).c_str(), time_us / 1000);
+    }
+    cJSON_AddItemToObject(json, "residency_ms", residency);
+    return json;
+}
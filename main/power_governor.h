@@ -0,0 +1,85 @@
+#ifndef _POWER_GOVERNOR_H_
+#define _POWER_GOVERNOR_H_
+
+#include <cJSON.h>
+#include <esp_pm.h>
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+#include "device_state.h"
+
+/*
+ * Holds the CPU at its top frequency while a task does audio work, for the frequency scaling of
+ * the power governor. Hold() may be called on every loop of the task, only a change of the held
+ * state goes to esp_pm. Does nothing without CONFIG_POWER_GOVERNOR.
+ */
+class PowerLock {
+public:
+    explicit PowerLock(const char* name) : name_(name) {}
+    ~PowerLock();
+    PowerLock(const PowerLock&) = delete;
+    PowerLock& operator=(const PowerLock&) = delete;
+
+    void Hold(bool hold);
+
+private:
+    const char* name_;
+    esp_pm_lock_handle_t handle_ = nullptr;
+    bool held_ = false;
+};
+
+/*
+ * Scales the CPU frequency with the device state and the audio load.
+ *
+ * The device state picks the top frequency: CONFIG_POWER_GOVERNOR_IDLE_FREQ_MHZ while idle or
+ * configuring the WiFi, where only the wake word listens, and the default CPU frequency in a
+ * conversation. Under it the CPU runs at the top only while a PowerLock is held, the audio tasks
+ * hold theirs while they process, and drops to CONFIG_POWER_GOVERNOR_MIN_FREQ_MHZ otherwise.
+ * The I2S and LCD drivers keep the APB frequency with their own locks during their DMA.
+ *
+ * The power save timer of a battery board turns the light sleep on and off through here, and
+ * the time spent at each frequency is reported for get_performance_stats.
+ */
+class PowerGovernor {
+public:
+    static PowerGovernor& GetInstance() {
+        static PowerGovernor instance;
+        return instance;
+    }
+
+    bool enabled() const;
+    void Start();
+    void OnStateChanged(DeviceState state);
+    // The board's limit of the top frequency, -1 for none
+    void SetMaxFrequency(int max_freq_mhz);
+    void SetLightSleep(bool enable);
+    cJSON* GetStatsJson();
+
+private:
+    friend class PowerLock;
+
+    std::mutex mutex_;
+    bool started_ = false;
+    bool active_ = false;       // The state of a conversation, at the default CPU frequency
+    bool light_sleep_ = false;
+    int max_freq_mhz_ = -1;
+    int held_locks_ = 0;
+    int current_freq_mhz_ = 0;
+    int64_t last_change_us_ = 0;
+    std::map<int, int64_t> residency_us_;   // By frequency, the sleep counts to the lowest one
+    uint32_t transitions_ = 0;
+
+    PowerGovernor() = default;
+    PowerGovernor(const PowerGovernor&) = delete;
+    PowerGovernor& operator=(const PowerGovernor&) = delete;
+
+    void OnLockChanged(bool held);
+    int top_freq_mhz() const;
+    int min_freq_mhz() const;
+    void ApplyLocked();
+    void AccountLocked();
+};
+
+#endif // _POWER_GOVERNOR_H_
@@ -0,0 +1,91 @@
+#include "control_message.h"
+
+#include <cstring>
+#include <algorithm>
+
+bool ControlMessage::Parse(const uint8_t* data, size_t size, ControlMessage& message) {
+    if (size < 1) {
+        return false;
+    }
+    message = ControlMessage();
+    message.type = (ControlMessageType)data[0];
+    size_t offset = 1;
+    while (offset < size) {
+        if (size - offset < 3) {
+            return false;
+        }
+        uint8_t tag = data[offset];
+        size_t length = (data[offset + 1] << 8) | data[offset + 2];
+        offset += 3;
+        if (length > size - offset) {
+            return false;
+        }
+        auto value = (const char*)data + offset;
+        switch (tag) {
+        case kControlFieldSessionId:
+            message.session_id = std::string_view(value, length);
+            break;
+        case kControlFieldText:
+            message.text = std::string_view(value, length);
+            break;
+        case kControlFieldEmotion:
+            message.emotion = std::string_view(value, length);
+            break;
+        case kControlFieldHash:
+            message.hash = std::string_view(value, length);
+            break;
+        case kControlFieldState:
+            if (length >= 1) {
+                message.state = (ControlState)value[0];
+            }
+            break;
+        case kControlFieldMode:
+            if (length >= 1) {
+                message.mode = value[0];
+            }
+            break;
+        case kControlFieldReason:
+            if (length >= 1) {
+                message.reason = value[0];
+            }
+            break;
+        default:
+            break;
+        }
+        offset += length;
+    }
+    return true;
+}
+
+ControlState ControlMessage::ParseState(const char* state) {
+    if (state == nullptr) {
+        return kControlStateNone;
+    }
+    if (strcmp(state, "start") == 0) {
+        return kControlStateStart;
+    } else if (strcmp(state, "stop") == 0) {
+        return kControlStateStop;
+    } else if (strcmp(state, "sentence_start") == 0) {
+        return kControlStateSentenceStart;
+    } else if (strcmp(state, "detect") == 0) {
+        return kControlStateDetect;
+    } else if (strcmp(state, "cached") == 0) {
+        return kControlStateCached;
+    }
+    return kControlStateNone;
+}
+
+void ControlMessageWriter::Add(ControlField tag, std::string_view value) {
+    size_t length = std::min<size_t>(value.size(), UINT16_MAX);
+    data_.push_back((char)tag);
+    data_.push_back((char)(length >> 8));
+    data_.push_back((char)(length & 0xFF));
+    data_.append(value.data(), length);
+}
+
+void ControlMessageWriter::Add(ControlField tag, uint8_t value) {
+    data_.push_back((char)tag);
+    data_.push_back(0);
+    data_.push_back(1);
+    data_.push_back((char)value);
+}
@@ -0,0 +1,74 @@
+#ifndef CONTROL_MESSAGE_H
+#define CONTROL_MESSAGE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+/*
+ * Compact binary control messages, used instead of JSON once both sides announce the
+ * "binary_control" feature in their hellos.
+ *
+ * Format: |type 1u| then fields of |tag 1u|length 2u|value length|, the length in network order.
+ * Unknown tags are skipped, so fields can be added without breaking older peers.
+ */
+enum ControlMessageType : uint8_t {
+    kControlMessageNone = 0,
+    kControlMessageTts = 1,
+    kControlMessageStt = 2,
+    kControlMessageLlm = 3,
+    kControlMessageListen = 4,
+    kControlMessageAbort = 5,
+};
+
+enum ControlField : uint8_t {
+    kControlFieldSessionId = 1,
+    kControlFieldState = 2,     // 1 byte ControlState
+    kControlFieldText = 3,
+    kControlFieldEmotion = 4,
+    kControlFieldMode = 5,      // 1 byte ListeningMode
+    kControlFieldReason = 6,    // 1 byte AbortReason
+    kControlFieldHash = 7,      // Of the audio of a sentence, for the TTS cache
+};
+
+enum ControlState : uint8_t {
+    kControlStateNone = 0,
+    kControlStateStart = 1,
+    kControlStateStop = 2,
+    kControlStateSentenceStart = 3,
+    kControlStateDetect = 4,
+    kControlStateCached = 5,
+};
+
+struct ControlMessage {
+    ControlMessageType type = kControlMessageNone;
+    ControlState state = kControlStateNone;
+    uint8_t mode = 0;
+    uint8_t reason = 0;
+    // Point into the parsed buffer, only valid while it is
+    std::string_view session_id;
+    std::string_view text;
+    std::string_view emotion;
+    std::string_view hash;
+
+    // Parses in place without allocating, returns false if the message is malformed
+    static bool Parse(const uint8_t* data, size_t size, ControlMessage& message);
+    // The state named like in the JSON messages, kControlStateNone if unknown
+    static ControlState ParseState(const char* state);
+};
+
+/* Builds a message into a string, which the transports send as is */
+class ControlMessageWriter {
+public:
+    explicit ControlMessageWriter(ControlMessageType type) { data_.push_back((char)type); }
+
+    void Add(ControlField tag, std::string_view value);
+    void Add(ControlField tag, uint8_t value);
+    const std::string& data() const { return data_; }
+
+private:
+    std::string data_;
+};
+
+#endif // CONTROL_MESSAGE_H
@@ -0,0 +1,132 @@
+#include "message_deflate.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <algorithm>
+
+#if __has_include(<rom/miniz.h>)
+#include <rom/miniz.h>
+#define HAVE_ROM_MINIZ 1
+#else
+#define HAVE_ROM_MINIZ 0
+#endif
+
+#define TAG "MessageDeflate"
+
+// Greedy parsing with a few probes, the messages are short and the CPU is shared with the audio
+#define DEFLATE_FLAGS (32 | TDEFL_GREEDY_PARSING_FLAG)
+#define INFLATE_MIN_BUFFER_SIZE 1024
+
+MessageDeflate::~MessageDeflate() {
+    heap_caps_free(compressor_);
+    heap_caps_free(decompressor_);
+}
+
+bool MessageDeflate::available() {
+    return HAVE_ROM_MINIZ;
+}
+
+bool MessageDeflate::can_compress() {
+#if HAVE_ROM_MINIZ && CONFIG_SPIRAM
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool MessageDeflate::Compress(const std::string_view* parts, size_t count, size_t limit, std::string& output) {
+#if HAVE_ROM_MINIZ && CONFIG_SPIRAM
+    if (compressor_ == nullptr) {
+        compressor_ = heap_caps_malloc(sizeof(tdefl_compressor), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (compressor_ == nullptr) {
+            ESP_LOGE(TAG, "Failed to allocate the compressor");
+            return false;
+        }
+    }
+    auto compressor = (tdefl_compressor*)compressor_;
+    if (tdefl_init(compressor, nullptr, nullptr, DEFLATE_FLAGS) != TDEFL_STATUS_OKAY) {
+        return false;
+    }
+
+    // Only room for a result that is worth it, a larger one stops the compression early
+    output.resize(limit);
+    size_t used = 0;
+    for (size_t i = 0; i < count; i++) {
+        auto data = parts[i].data();
+        size_t left = parts[i].size();
+        tdefl_flush flush = i + 1 == count ? TDEFL_FINISH : TDEFL_NO_FLUSH;
+        while (true) {
+            size_t in_bytes = left;
+            size_t out_bytes = output.size() - used;
+            tdefl_status status = tdefl_compress(compressor, data, &in_bytes, &output[used], &out_bytes, flush);
+            data += in_bytes;
+            left -= in_bytes;
+            used += out_bytes;
+            if (status == TDEFL_STATUS_DONE) {
+                output.resize(used);
+                return true;
+            }
+            if (status != TDEFL_STATUS_OKAY || used == output.size()) {
+                return false;
+            }
+            if (left == 0 && flush == TDEFL_NO_FLUSH) {
+                break;
+            }
+        }
+    }
+    return false;
+#else
+    (void)parts;
+    (void)count;
+    (void)limit;
+    (void)output;
+    return false;
+#endif
+}
+
+bool MessageDeflate::Decompress(const uint8_t* data, size_t size, size_t max_size, std::string& output) {
+#if HAVE_ROM_MINIZ
+    if (decompressor_ == nullptr) {
+#if CONFIG_SPIRAM
+        decompressor_ = heap_caps_malloc(sizeof(tinfl_decompressor), MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+#else
+        decompressor_ = heap_caps_malloc(sizeof(tinfl_decompressor), MALLOC_CAP_8BIT);
+#endif
+        if (decompressor_ == nullptr) {
+            ESP_LOGE(TAG, "Failed to allocate the decompressor");
+            return false;
+        }
+    }
+    auto decompressor = (tinfl_decompressor*)decompressor_;
+    tinfl_init(decompressor);
+
+    // The whole message is the window, it grows until the message fits
+    output.resize(std::min(max_size, std::max<size_t>(size * 4, INFLATE_MIN_BUFFER_SIZE)));
+    size_t used = 0;
+    while (true) {
+        size_t in_bytes = size;
+        size_t out_bytes = output.size() - used;
+        auto start = (uint8_t*)output.data();
+        tinfl_status status = tinfl_decompress(decompressor, data, &in_bytes, start, start + used, &out_bytes,
+            TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+        data += in_bytes;
+        size -= in_bytes;
+        used += out_bytes;
+        if (status == TINFL_STATUS_DONE) {
+            output.resize(used);
+            return true;
+        }
+        if (status != TINFL_STATUS_HAS_MORE_OUTPUT || output.size() >= max_size) {
+            ESP_LOGE(TAG, "Failed to inflate a message: %d", status);
+            return false;
+        }
+        output.resize(std::min(max_size, output.size() * 2));
+    }
+#else
+    (void)data;
+    (void)size;
+    (void)max_size;
+    (void)output;
+    return false;
+#endif
+}
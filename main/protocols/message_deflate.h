@@ -0,0 +1,42 @@
+#ifndef MESSAGE_DEFLATE_H
+#define MESSAGE_DEFLATE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+/*
+ * Raw deflate of single text messages with the miniz of the ROM, like permessage-deflate
+ * without context takeover: every message is compressed on its own, so a lost or skipped one
+ * does not break the next.
+ *
+ * The compressor keeps its 32 KB window and hash tables, about 160 KB, so it is only made with
+ * PSRAM, without it can_compress() is false and only the incoming messages are inflated. The
+ * inflate writes straight into the message, no window beside it.
+ *
+ * Not thread safe, one instance compresses for the sending task and one inflates for the
+ * receiving one.
+ */
+class MessageDeflate {
+public:
+    MessageDeflate() = default;
+    ~MessageDeflate();
+    MessageDeflate(const MessageDeflate&) = delete;
+    MessageDeflate& operator=(const MessageDeflate&) = delete;
+
+    static bool available();
+    static bool can_compress();
+
+    // False if the message does not get smaller than limit bytes
+    bool Compress(const std::string_view* parts, size_t count, size_t limit, std::string& output);
+    // False if the data is corrupt or inflates to more than max_size bytes
+    bool Decompress(const uint8_t* data, size_t size, size_t max_size, std::string& output);
+
+private:
+    // The miniz types stay in the source, the ROM header is not for every file that includes this
+    void* compressor_ = nullptr;
+    void* decompressor_ = nullptr;
+};
+
+#endif // MESSAGE_DEFLATE_H
@@ -1,10 +1,17 @@
 #include "mqtt_protocol.h"
+#include "trace_markers.h"
 #include "board.h"
 #include "application.h"
+#include "tts_cache.h"
+#include "protocol_trace.h"
+#include "server_endpoints.h"
+#include "socket_qos.h"
 #include "settings.h"
+#include "json_arena.h"
 
 #include <esp_log.h>
 #include <cstring>
+#include <algorithm>
 #include <arpa/inet.h>
 #include "assets/lang_config.h"
 
@@ -25,7 +32,7 @@ MqttProtocol::MqttProtocol() {
                     if (*alive) {
                         protocol->StartMqttClient(false);
                     }
-                });
+                }, kSchedulePriorityBackground, "mqtt_reconnect");
             }
         },
         .arg = this,
@@ -57,6 +64,7 @@ bool MqttProtocol::Start() {
 }
 
 bool MqttProtocol::StartMqttClient(bool report_error) {
+    std::unique_lock<std::mutex> mqtt_lock(mqtt_mutex_);
     if (mqtt_ != nullptr) {
         ESP_LOGW(TAG, "Mqtt client already started");
         mqtt_.reset();
@@ -80,9 +88,11 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
 
     auto network = Board::GetInstance().GetNetwork();
     mqtt_ = network->CreateMqtt(0);
+    mqtt_lock.unlock();
     mqtt_->SetKeepAlive(keepalive_interval);
 
     mqtt_->OnDisconnected([this]() {
+        udp_reusable_ = false;
         if (on_disconnected_ != nullptr) {
             on_disconnected_();
         }
@@ -98,6 +108,20 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     });
 
     mqtt_->OnMessage([this](const std::string& topic, const std::string& payload) {
+        TRACE_SCOPE(kTraceProtocolReceive);
+#if CONFIG_PROTOCOL_TRACE
+        // HandleControl() records the control messages
+        if (!binary_control_ || payload.empty() || payload[0] == '{') {
+            ProtocolTrace::GetInstance().Record(kTraceText, payload.data(), payload.size());
+        }
+#endif
+        // A control message starts with its type byte, never with the brace of a JSON object
+        if (binary_control_ && !payload.empty() && payload[0] != '{') {
+            HandleControl((const uint8_t*)payload.data(), payload.size());
+            last_incoming_time_ = std::chrono::steady_clock::now();
+            return;
+        }
+        JsonArena::Scope arena_scope;
         cJSON* root = cJSON_Parse(payload.c_str());
         if (root == nullptr) {
             ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
@@ -131,18 +155,30 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
-    ESP_LOGI(TAG, "Connecting to endpoint %s", endpoint.c_str());
-    std::string broker_address;
-    int broker_port = 8883;
-    size_t pos = endpoint.find(':');
-    if (pos != std::string::npos) {
-        broker_address = endpoint.substr(0, pos);
-        broker_port = std::stoi(endpoint.substr(pos + 1));
-    } else {
-        broker_address = endpoint;
-    }
-    if (!mqtt_->Connect(broker_address, broker_port, client_id, username, password)) {
+    auto& server_endpoints = ServerEndpoints::GetInstance();
+    bool connected = false;
+    for (auto& candidate : server_endpoints.Order("mqtt", endpoint, settings.GetString("endpoints"), 8883)) {
+        ESP_LOGI(TAG, "Connecting to endpoint %s", candidate.c_str());
+        std::string broker_address;
+        int broker_port = 8883;
+        size_t pos = candidate.find(':');
+        if (pos != std::string::npos) {
+            broker_address = candidate.substr(0, pos);
+            broker_port = std::stoi(candidate.substr(pos + 1));
+        } else {
+            broker_address = candidate;
+        }
+        int64_t start_time = esp_timer_get_time();
+        connected = SocketQos::Open(kTrafficClassControl, [&]() {
+            return mqtt_->Connect(broker_address, broker_port, client_id, username, password);
+        });
+        server_endpoints.ReportResult("mqtt", candidate, connected, (esp_timer_get_time() - start_time) / 1000);
+        if (connected) {
+            break;
+        }
         ESP_LOGE(TAG, "Failed to connect to endpoint, code=%d", mqtt_->GetLastError());
+    }
+    if (!connected) {
         SetError(Lang::Strings::SERVER_NOT_CONNECTED);
         return false;
     }
@@ -151,11 +187,17 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     return true;
 }
 
+/* Queue the message for the control task, so a slow broker never holds up the caller */
 bool MqttProtocol::SendText(const std::string& text) {
     if (publish_topic_.empty()) {
         return false;
     }
-    if (!mqtt_->Publish(publish_topic_, text)) {
+#if CONFIG_PROTOCOL_TRACE
+    ProtocolTrace::GetInstance().Record(kTraceOutgoing | kTraceText, text.data(), text.size());
+#endif
+    // Sent by the network tx task, so a slow broker never holds up the main task
+    std::lock_guard<std::mutex> lock(mqtt_mutex_);
+    if (mqtt_ == nullptr || !mqtt_->Publish(publish_topic_, text)) {
         ESP_LOGE(TAG, "Failed to publish message: %s", text.c_str());
         SetError(Lang::Strings::SERVER_ERROR);
         return false;
@@ -163,36 +205,70 @@ bool MqttProtocol::SendText(const std::string& text) {
     return true;
 }
 
-bool MqttProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
-    std::lock_guard<std::mutex> lock(channel_mutex_);
-    if (udp_ == nullptr) {
-        return false;
+bool MqttProtocol::SendTextParts(const std::string_view* parts, size_t count) {
+    // A publish is one buffer, join the parts once
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        size += parts[i].size();
     }
+    std::string text;
+    text.reserve(size);
+    for (size_t i = 0; i < count; i++) {
+        text += parts[i];
+    }
+    return SendText(text);
+}
+
+bool MqttProtocol::SendControl(const std::string& message) {
+    // Published as is, the server tells it from JSON by the first byte
+    return SendText(message);
+}
 
-    std::string nonce(aes_nonce_);
-    *(uint16_t*)&nonce[2] = htons(packet->payload.size());
-    *(uint32_t*)&nonce[8] = htonl(packet->timestamp);
-    *(uint32_t*)&nonce[12] = htonl(++local_sequence_);
+bool MqttProtocol::SendAudio(AudioStreamPacketPtr packet) {
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    return SendAudioLocked(*packet);
+}
 
-    std::string encrypted;
-    encrypted.resize(aes_nonce_.size() + packet->payload.size());
-    memcpy(encrypted.data(), nonce.data(), nonce.size());
+size_t MqttProtocol::SendAudioBatch(AudioStreamPacketPtr* packets, size_t count) {
+    /* One lock for the whole burst of datagrams */
+    std::lock_guard<std::mutex> lock(channel_mutex_);
+    for (size_t i = 0; i < count; ++i) {
+        if (!SendAudioLocked(*packets[i])) {
+            return i;
+        }
+    }
+    return count;
+}
 
-    size_t nc_off = 0;
-    uint8_t stream_block[16] = {0};
-    if (mbedtls_aes_crypt_ctr(&aes_ctx_, packet->payload.size(), &nc_off, (uint8_t*)nonce.c_str(), stream_block,
-        (uint8_t*)packet->payload.data(), (uint8_t*)&encrypted[nonce.size()]) != 0) {
-        ESP_LOGE(TAG, "Failed to encrypt audio data");
+bool MqttProtocol::SendAudioLocked(const AudioStreamPacket& packet) {
+    if (udp_ == nullptr || !channel_opened_) {
         return false;
     }
 
-    return udp_->Send(encrypted) > 0;
+#if CONFIG_PROTOCOL_TRACE
+    ProtocolTrace::GetInstance().RecordAudio(kTraceOutgoing, packet);
+#endif
+    int64_t start_time = esp_timer_get_time();
+    size_t bytes = 0;
+    bool sent = udp_->Send(packet, &bytes);
+    NotifyTransportFeedback(sent, start_time, bytes);
+    return sent;
 }
 
 void MqttProtocol::CloseAudioChannel(bool send_goodbye) {
     {
         std::lock_guard<std::mutex> lock(channel_mutex_);
+        channel_opened_ = false;
+#if CONFIG_MQTT_UDP_KEEP_SOCKET
+        /* On a cellular modem every socket is a slow AT sequence, the next session reuses this one */
+        if (udp_ != nullptr && udp_reusable_) {
+            udp_->Pause();
+        } else {
+            udp_.reset();
+        }
+#else
         udp_.reset();
+#endif
     }
 
     ESP_LOGI(TAG, "Closing audio channel, send_goodbye: %d", send_goodbye);
@@ -221,10 +297,13 @@ bool MqttProtocol::OpenAudioChannel() {
     }
 
     error_occurred_ = false;
+    binary_control_ = false;
     session_id_ = "";
     xEventGroupClearBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
+    ResetTransportStats();
 
     auto message = GetHelloMessage();
+    MarkHelloSent();
     if (!SendText(message)) {
         return false;
     }
@@ -238,55 +317,42 @@ bool MqttProtocol::OpenAudioChannel() {
     }
 
     std::lock_guard<std::mutex> lock(channel_mutex_);
-    auto network = Board::GetInstance().GetNetwork();
-    udp_ = network->CreateUdp(2);
-    udp_->OnMessage([this](const std::string& data) {
-        /*
-         * UDP Encrypted OPUS Packet Format:
-         * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
-         * |payload payload_len|
-         */
-        if (data.size() < sizeof(aes_nonce_)) {
-            ESP_LOGE(TAG, "Invalid audio packet size: %u", data.size());
-            return;
-        }
-        if (data[0] != 0x01) {
-            ESP_LOGE(TAG, "Invalid audio packet type: %x", data[0]);
-            return;
-        }
-        uint32_t timestamp = ntohl(*(uint32_t*)&data[8]);
-        uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
-        if (sequence < remote_sequence_) {
-            ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_);
-            return;
-        }
-        if (sequence != remote_sequence_ + 1) {
-            ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
-        }
-
-        size_t decrypted_size = data.size() - aes_nonce_.size();
-        size_t nc_off = 0;
-        uint8_t stream_block[16] = {0};
-        auto nonce = (uint8_t*)data.data();
-        auto encrypted = (uint8_t*)data.data() + aes_nonce_.size();
-        auto packet = std::make_unique<AudioStreamPacket>();
-        packet->sample_rate = server_sample_rate_;
-        packet->frame_duration = server_frame_duration_;
-        packet->timestamp = timestamp;
-        packet->payload.resize(decrypted_size);
-        int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, (uint8_t*)packet->payload.data());
-        if (ret != 0) {
-            ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
-            return;
-        }
-        if (on_incoming_audio_ != nullptr) {
-            on_incoming_audio_(std::move(packet));
-        }
-        remote_sequence_ = sequence;
-        last_incoming_time_ = std::chrono::steady_clock::now();
-    });
-
-    udp_->Connect(udp_server_, udp_port_);
+    remote_sequence_ = 0;
+    bool opened;
+#if CONFIG_MQTT_UDP_KEEP_SOCKET
+    if (udp_ != nullptr && udp_reusable_ && udp_->IsConnectedTo(udp_server_, udp_port_)) {
+        opened = udp_->Rekey(udp_key_, udp_nonce_, 0);
+    } else
+#endif
+    {
+        udp_ = std::make_unique<UdpAudioChannel>();
+        opened = udp_->Open(2, udp_server_, udp_port_, udp_key_, udp_nonce_, 0, [this](AudioStreamPacketPtr packet, size_t bytes) {
+            uint32_t sequence = packet->sequence;
+            RecordIncomingAudio(bytes, sequence);
+            /* Late and reordered packets are sorted out by the jitter buffer */
+            if (sequence < remote_sequence_) {
+                ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
+            } else if (sequence != remote_sequence_ + 1) {
+                ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
+            }
+            packet->sample_rate = server_sample_rate_;
+            packet->frame_duration = server_frame_duration_;
+#if CONFIG_PROTOCOL_TRACE
+            ProtocolTrace::GetInstance().RecordAudio(kTraceAudio, *packet);
+#endif
+            if (on_incoming_audio_ != nullptr && on_incoming_audio_(std::move(packet))) {
+                remote_sequence_ = std::max(remote_sequence_, sequence);
+            }
+            last_incoming_time_ = std::chrono::steady_clock::now();
+        });
+    }
+    if (!opened) {
+        udp_.reset();
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
+    }
+    udp_reusable_ = true;
+    channel_opened_ = true;
 
     if (on_audio_channel_opened_ != nullptr) {
         on_audio_channel_opened_();
@@ -305,6 +371,21 @@ std::string MqttProtocol::GetHelloMessage() {
     cJSON_AddBoolToObject(features, "aec", true);
 #endif
     cJSON_AddBoolToObject(features, "mcp", true);
+#if CONFIG_LOCAL_ENDPOINT
+    cJSON_AddBoolToObject(features, "local_endpoint", true);
+#endif
+#if CONFIG_TTS_CACHE
+    if (TtsCache::GetInstance().enabled()) {
+        cJSON_AddBoolToObject(features, "tts_cache", true);
+    }
+#endif
+    cJSON_AddBoolToObject(features, "binary_control", true);
+#if CONFIG_AUDIO_MEDIA_STREAM
+    cJSON_AddBoolToObject(features, "media", true);
+#endif
+#if CONFIG_AUDIO_NARROWBAND_MODE
+    cJSON_AddBoolToObject(features, "narrowband", true);
+#endif
     cJSON_AddItemToObject(root, "features", features);
     cJSON* audio_params = cJSON_CreateObject();
     cJSON_AddStringToObject(audio_params, "format", "opus");
@@ -332,6 +413,10 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
 
+    ParseServerFeatures(root);
+    // Not announced, the blobs would need a topic of their own
+    blob_frames_ = false;
+
     // Get sample rate from hello message
     auto audio_params = cJSON_GetObjectItem(root, "audio_params");
     if (cJSON_IsObject(audio_params)) {
@@ -343,6 +428,8 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
         if (cJSON_IsNumber(frame_duration)) {
             server_frame_duration_ = frame_duration->valueint;
         }
+        auto channels = cJSON_GetObjectItem(audio_params, "channels");
+        server_channels_ = cJSON_IsNumber(channels) ? channels->valueint : 1;
     }
 
     auto udp = cJSON_GetObjectItem(root, "udp");
@@ -352,38 +439,12 @@ void MqttProtocol::ParseServerHello(const cJSON* root) {
     }
     udp_server_ = cJSON_GetObjectItem(udp, "server")->valuestring;
     udp_port_ = cJSON_GetObjectItem(udp, "port")->valueint;
-    auto key = cJSON_GetObjectItem(udp, "key")->valuestring;
-    auto nonce = cJSON_GetObjectItem(udp, "nonce")->valuestring;
-
-    // auto encryption = cJSON_GetObjectItem(udp, "encryption")->valuestring;
-    // ESP_LOGI(TAG, "UDP server: %s, port: %d, encryption: %s", udp_server_.c_str(), udp_port_, encryption);
-    aes_nonce_ = DecodeHexString(nonce);
-    mbedtls_aes_init(&aes_ctx_);
-    mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key).c_str(), 128);
-    local_sequence_ = 0;
-    remote_sequence_ = 0;
+    udp_key_ = cJSON_GetObjectItem(udp, "key")->valuestring;
+    udp_nonce_ = cJSON_GetObjectItem(udp, "nonce")->valuestring;
+    MarkHelloReceived();
     xEventGroupSetBits(event_group_handle_, MQTT_PROTOCOL_SERVER_HELLO_EVENT);
 }
 
-static const char hex_chars[] = "0123456789ABCDEF";
-// 辅助函数，将单个十六进制字符转换为对应的数值
-static inline uint8_t CharToHex(char c) {
-    if (c >= '0' && c <= '9') return c - '0';
-    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
-    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
-    return 0;  // 对于无效输入，返回0
-}
-
-std::string MqttProtocol::DecodeHexString(const std::string& hex_string) {
-    std::string decoded;
-    decoded.reserve(hex_string.size() / 2);
-    for (size_t i = 0; i < hex_string.size(); i += 2) {
-        char byte = (CharToHex(hex_string[i]) << 4) | CharToHex(hex_string[i + 1]);
-        decoded.push_back(byte);
-    }
-    return decoded;
-}
-
 bool MqttProtocol::IsAudioChannelOpened() const {
-    return udp_ != nullptr && !error_occurred_ && !IsTimeout();
+    return channel_opened_ && !error_occurred_ && !IsTimeout();
 }
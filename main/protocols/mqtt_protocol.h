@@ -3,12 +3,12 @@
 
 
 #include "protocol.h"
+#include "udp_audio_channel.h"
 #include <mqtt.h>
-#include <udp.h>
 #include <cJSON.h>
-#include <mbedtls/aes.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <freertos/task.h>
 #include <esp_timer.h>
 
 #include <functional>
@@ -29,7 +29,8 @@ public:
     ~MqttProtocol();
 
     bool Start() override;
-    bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) override;
+    bool SendAudio(AudioStreamPacketPtr packet) override;
+    size_t SendAudioBatch(AudioStreamPacketPtr* packets, size_t count) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel(bool send_goodbye = true) override;
     bool IsAudioChannelOpened() const override;
@@ -43,21 +44,28 @@ private:
     std::string publish_topic_;
 
     std::mutex channel_mutex_;
+    // Held while publishing, and to replace mqtt_
+    std::mutex mqtt_mutex_;
     std::unique_ptr<Mqtt> mqtt_;
-    std::unique_ptr<Udp> udp_;
-    mbedtls_aes_context aes_ctx_;
-    std::string aes_nonce_;
+    // Guarded by channel_mutex_, kept paused between the sessions of one MQTT connection
+    std::unique_ptr<UdpAudioChannel> udp_;
+    std::atomic<bool> channel_opened_ = false;
+    // Cleared when the MQTT connection drops, the next session then opens a new socket
+    std::atomic<bool> udp_reusable_ = false;
     std::string udp_server_;
     int udp_port_;
-    uint32_t local_sequence_;
+    std::string udp_key_;
+    std::string udp_nonce_;
     uint32_t remote_sequence_;
     esp_timer_handle_t reconnect_timer_;
 
     bool StartMqttClient(bool report_error=false);
+    bool SendAudioLocked(const AudioStreamPacket& packet);
     void ParseServerHello(const cJSON* root);
-    std::string DecodeHexString(const std::string& hex_string);
 
     bool SendText(const std::string& text) override;
+    bool SendTextParts(const std::string_view* parts, size_t count) override;
+    bool SendControl(const std::string& message) override;
     std::string GetHelloMessage();
 };
 
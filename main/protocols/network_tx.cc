@@ -0,0 +1,265 @@
+#include "network_tx.h"
+#include "audio_service.h"
+#include "task_profile.h"
+#include "trace_markers.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+
+#define TAG "NetworkTx"
+
+NetworkTx::~NetworkTx() {
+    if (task_ != nullptr) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        xTaskNotifyGive(task_);
+        while (task_ != nullptr) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+        }
+    }
+}
+
+void NetworkTx::Start(AudioService* audio_service, BatchSender send_batch) {
+    audio_service_ = audio_service;
+    send_batch_ = std::move(send_batch);
+#if CONFIG_NETWORK_TX_TASK
+    if (task_ != nullptr) {
+        return;
+    }
+    if (TaskProfiles::Create(kTaskNetworkTx, [](void* arg) {
+        static_cast<NetworkTx*>(arg)->Task();
+        vTaskDelete(NULL);
+    }, this, &task_) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the network tx task, the caller sends");
+        task_ = nullptr;
+    }
+#endif
+}
+
+void NetworkTx::NotifyAudio() {
+    if (task_ != nullptr) {
+        xTaskNotifyGive(task_);
+    }
+}
+
+void NetworkTx::ResetPacer() {
+#if CONFIG_UPLINK_PACER
+    pacer_reset_ = true;
+#endif
+}
+
+bool NetworkTx::Post(std::function<void()> send, Order order) {
+    return Enqueue({std::move(send), nullptr, order, 0, 0});
+}
+
+bool NetworkTx::SendAudio(AudioStreamPacketPtr packet) {
+    return Enqueue({nullptr, std::move(packet), kAfterAudio, 0, 0});
+}
+
+/*
+ * A message in the queue may be one frame of a blob or the stop of a reply, dropping it breaks
+ * what the server reads. The callers are the main loop and the audio tasks, which must not wait
+ * either, so the new message is the one rejected and the caller is told.
+ */
+bool NetworkTx::Enqueue(ControlItem item) {
+    if (task_ == nullptr) {
+        std::lock_guard<std::recursive_mutex> lock(transport_mutex_);
+        TRACE_SCOPE(kTraceProtocolSend);
+        if (item.send) {
+            item.send();
+        } else if (send_batch_) {
+            send_batch_(&item.packet, 1);
+        }
+        return true;
+    }
+
+    item.queued_us = esp_timer_get_time();
+    if (item.send && item.order == kAfterAudio) {
+        item.audio_mark = audio_service_->MarkSendQueue();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (control_.size() >= NETWORK_TX_MAX_CONTROL) {
+            control_rejected_++;
+            ESP_LOGE(TAG, "Control queue is full, the message is not sent");
+            return false;
+        }
+        if (item.order == kAhead) {
+            // Behind the messages that went ahead before it
+            auto position = std::find_if(control_.begin(), control_.end(), [](const ControlItem& queued) {
+                return queued.order != kAhead;
+            });
+            control_.insert(position, std::move(item));
+        } else {
+            control_.push_back(std::move(item));
+        }
+        control_peak_ = std::max(control_peak_, control_.size());
+    }
+    xTaskNotifyGive(task_);
+    return true;
+}
+
+bool NetworkTx::RunControl(size_t& audio_before) {
+    audio_before = SIZE_MAX;
+    while (true) {
+        ControlItem item;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (control_.empty()) {
+                return true;
+            }
+            // The messages keep their order, those behind wait as well
+            auto& front = control_.front();
+            if (front.send && front.order == kAfterAudio) {
+                size_t before = audio_service_->SendQueueBefore(front.audio_mark);
+                if (before > 0) {
+                    audio_before = before;
+                    return true;
+                }
+            }
+#if CONFIG_UPLINK_PACER
+            // The wake word audio is paced too, the messages behind it keep their order
+            if (control_.front().packet && pacer_.Budget(esp_timer_get_time()) <= 0) {
+                pacer_.OnHeld(esp_timer_get_time());
+                return false;
+            }
+#endif
+            item = std::move(control_.front());
+            control_.pop_front();
+            control_max_wait_us_ = std::max(control_max_wait_us_, esp_timer_get_time() - item.queued_us);
+        }
+        std::lock_guard<std::recursive_mutex> lock(transport_mutex_);
+        TRACE_SCOPE(kTraceProtocolSend);
+        if (item.send) {
+            item.send();
+        } else {
+            int audio_ms = item.packet->frame_duration;
+            int64_t start_us = esp_timer_get_time();
+            size_t sent = send_batch_(&item.packet, 1);
+#if CONFIG_UPLINK_PACER
+            int64_t now_us = esp_timer_get_time();
+            pacer_.OnSent(now_us, audio_ms, 1, now_us - start_us, sent == 1);
+#else
+            (void)audio_ms;
+            (void)start_us;
+            (void)sent;
+#endif
+        }
+        control_sent_++;
+    }
+}
+
+size_t NetworkTx::SendAudioBatch(AudioStreamPacketPtr* packets, size_t count) {
+    int64_t start_us = esp_timer_get_time();
+    size_t sent;
+    {
+        std::lock_guard<std::recursive_mutex> lock(transport_mutex_);
+        TRACE_SCOPE(kTraceProtocolSend);
+        sent = send_batch_(packets, count);
+    }
+    int64_t now_us = esp_timer_get_time();
+    uint32_t elapsed_us = now_us - start_us;
+    uint32_t audio_us = 0;
+    for (size_t i = 0; i < count; i++) {
+        audio_us += packets[i]->frame_duration * 1000;
+        packets[i].reset();
+    }
+#if CONFIG_UPLINK_PACER
+    pacer_.OnSent(now_us, audio_us / 1000, count, elapsed_us, sent == count);
+#endif
+
+    audio_batches_++;
+    audio_packets_ += sent;
+    audio_failed_ += count - sent;
+    max_send_us_ = std::max(max_send_us_, elapsed_us);
+    // The uplink does not keep up with the audio it is given
+    if (elapsed_us > audio_us) {
+        congested_batches_++;
+        audio_service_->ReportTransportCongestion();
+    }
+    // Once for a run of failed batches
+    if (sent < count && !audio_failing_) {
+        ESP_LOGW(TAG, "The transport took %u of %u audio packets, %lu failed in total", sent, count, audio_failed_);
+    }
+    audio_failing_ = sent < count;
+    return sent;
+}
+
+void NetworkTx::Task() {
+    AudioStreamPacketPtr packets[MAX_SEND_PACKETS_PER_BATCH];
+    TickType_t wait = portMAX_DELAY;
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, wait);
+        wait = portMAX_DELAY;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopping_) {
+                break;
+            }
+        }
+#if CONFIG_UPLINK_PACER
+        if (pacer_reset_.exchange(false)) {
+            pacer_.Reset();
+        }
+#endif
+        // The control messages go between the batches, after the audio queued before them
+        while (true) {
+            size_t max_count = MAX_SEND_PACKETS_PER_BATCH;
+            size_t audio_before;
+#if CONFIG_UPLINK_PACER
+            // The pacer wakes the task itself when the budget allows the audio that waits
+            if (!RunControl(audio_before)) {
+                wait = pdMS_TO_TICKS(pacer_.WaitMs()) + 1;
+                break;
+            }
+            int64_t now_us = esp_timer_get_time();
+            int budget_ms = pacer_.Budget(now_us);
+            if (budget_ms <= 0) {
+                pacer_.OnHeld(now_us);
+                wait = pdMS_TO_TICKS(pacer_.WaitMs()) + 1;
+                break;
+            }
+            max_count = std::clamp<size_t>((budget_ms + OPUS_FRAME_DURATION_MS - 1) / OPUS_FRAME_DURATION_MS,
+                1, MAX_SEND_PACKETS_PER_BATCH);
+#else
+            RunControl(audio_before);
+#endif
+            // No further than the audio the next message waits for
+            max_count = std::min(max_count, audio_before);
+            size_t count = audio_service_->PopPacketsFromSendQueue(packets, max_count);
+            if (count == 0) {
+#if CONFIG_UPLINK_PACER
+                pacer_.OnIdle();
+#endif
+                break;
+            }
+            if (SendAudioBatch(packets, count) < count) {
+                break;
+            }
+        }
+    }
+    task_ = nullptr;
+}
+
+cJSON* NetworkTx::GetStatsJson() {
+    auto json = cJSON_CreateObject();
+    cJSON_AddBoolToObject(json, "async", task_ != nullptr);
+    std::lock_guard<std::mutex> lock(mutex_);
+    cJSON_AddNumberToObject(json, "control_sent", control_sent_);
+    cJSON_AddNumberToObject(json, "control_rejected", control_rejected_);
+    cJSON_AddNumberToObject(json, "control_queued", control_.size());
+    cJSON_AddNumberToObject(json, "control_peak", control_peak_);
+    cJSON_AddNumberToObject(json, "control_max_wait_ms", control_max_wait_us_ / 1000);
+    cJSON_AddNumberToObject(json, "audio_batches", audio_batches_);
+    cJSON_AddNumberToObject(json, "audio_packets", audio_packets_);
+    cJSON_AddNumberToObject(json, "audio_failed", audio_failed_);
+    cJSON_AddNumberToObject(json, "congested_batches", congested_batches_);
+    cJSON_AddNumberToObject(json, "max_send_ms", max_send_us_ / 1000);
+#if CONFIG_UPLINK_PACER
+    cJSON_AddItemToObject(json, "pacer", pacer_.GetStatsJson());
+#endif
+    return json;
+}
@@ -0,0 +1,121 @@
+#ifndef NETWORK_TX_H
+#define NETWORK_TX_H
+
+#include <cJSON.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+#include "protocol.h"
+#include "uplink_pacer.h"
+
+class AudioService;
+
+// Control messages waiting at most, a post past it is rejected
+#define NETWORK_TX_MAX_CONTROL 64
+
+/*
+ * The sends to the server, run by a task of their own, enabled with CONFIG_NETWORK_TX_TASK.
+ *
+ * A websocket send blocks while the TCP send window is full, and a modem write for as long as
+ * the AT link takes, so the main loop used to stall on the audio of a slow uplink. The task
+ * sends the audio of the AudioService send queue, the ring the encoder fills, and the control
+ * messages posted from the main loop. Post() and SendAudio() return once queued, they never
+ * wait: a message that finds the queue full is rejected with false and counted, what is queued
+ * is never dropped. A control message goes after the audio encoded before it was posted, so the
+ * stop of an utterance follows its last packet. Only an abort is posted with kAhead and goes
+ * before the audio still queued, so it is not stuck behind a second of speech on a congested
+ * link. Audio sent with SendAudio(), the wake word, goes ahead of the live audio as well and
+ * keeps its order with the control messages.
+ *
+ * Each packet sent is reported to the AudioService through the transport feedback as before. A
+ * batch that takes longer to send than the audio it carries is reported as congestion too, the
+ * encoder steps down its bitrate on it.
+ *
+ * The audio, of the send queue and of the control lane alike, goes through the UplinkPacer with
+ * CONFIG_UPLINK_PACER, so the backlog of a channel open drains at a multiple of realtime.
+ *
+ * Before Start() and without the option the sends run on the caller, and the audio is left to
+ * the caller as well. The protocol is only called by one task at a time: whoever opens, closes
+ * or replaces it holds LockTransport().
+ */
+class NetworkTx {
+public:
+    using BatchSender = std::function<size_t(AudioStreamPacketPtr* packets, size_t count)>;
+
+    NetworkTx() = default;
+    ~NetworkTx();
+    NetworkTx(const NetworkTx&) = delete;
+    NetworkTx& operator=(const NetworkTx&) = delete;
+
+    // send_batch sends packets in order until one fails and returns the number sent
+    void Start(AudioService* audio_service, BatchSender send_batch);
+    inline bool running() const { return task_ != nullptr; }
+
+    // There is audio in the send queue of the AudioService
+    void NotifyAudio();
+    // An audio channel opened, the pacer learns its link again
+    void ResetPacer();
+    enum Order {
+        kAfterAudio,    // After the audio queued so far
+        kAhead,         // Before the audio still queued and the control messages that wait for it
+    };
+
+    // False if the queue was full, the message was not sent
+    bool Post(std::function<void()> send, Order order = kAfterAudio);
+    bool SendAudio(AudioStreamPacketPtr packet);
+    // Sends a batch of the send queue with the transport held, returns how many packets the
+    // transport took. The rest is counted in audio_failed and released, the transport that failed
+    // would only send it late. Called by the task, or by the caller without it.
+    size_t SendAudioBatch(AudioStreamPacketPtr* packets, size_t count);
+    // Holds off the task between two sends
+    std::unique_lock<std::recursive_mutex> LockTransport() { return std::unique_lock<std::recursive_mutex>(transport_mutex_); }
+
+    // The caller owns the returned object
+    cJSON* GetStatsJson();
+
+private:
+    struct ControlItem {
+        std::function<void()> send;
+        AudioStreamPacketPtr packet;    // Audio ordered with the control messages
+        Order order;
+        uint32_t audio_mark;            // For kAfterAudio, the end of the audio queued before it
+        int64_t queued_us;
+    };
+
+    AudioService* audio_service_ = nullptr;
+    BatchSender send_batch_;
+    std::mutex mutex_;
+    std::recursive_mutex transport_mutex_;     // The callbacks of a close may post again
+    std::deque<ControlItem> control_;
+    TaskHandle_t task_ = nullptr;
+    bool stopping_ = false;
+#if CONFIG_UPLINK_PACER
+    UplinkPacer pacer_{CONFIG_UPLINK_PACER_MAX_RATE_PERCENT, CONFIG_UPLINK_PACER_BURST_MS};
+    std::atomic<bool> pacer_reset_ = false;     // Asks the task to reset the pacer
+#endif
+
+    uint32_t control_sent_ = 0;
+    uint32_t control_rejected_ = 0;
+    size_t control_peak_ = 0;
+    int64_t control_max_wait_us_ = 0;
+    uint32_t audio_batches_ = 0;
+    uint32_t audio_packets_ = 0;
+    uint32_t audio_failed_ = 0;
+    bool audio_failing_ = false;
+    uint32_t congested_batches_ = 0;
+    uint32_t max_send_us_ = 0;
+
+    bool Enqueue(ControlItem item);
+    // False once paced audio waits at the front. audio_before is what goes ahead of the next
+    // message, SIZE_MAX if none waits for the audio
+    bool RunControl(size_t& audio_before);
+    void Task();
+};
+
+#endif // NETWORK_TX_H
@@ -1,14 +1,32 @@
 #include "protocol.h"
+#include "audio_service.h"
+#include "json_writer.h"
+#include "perf_profile.h"
+#include "protocol_trace.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+#include <cstring>
 
 #define TAG "Protocol"
 
+// Enough packets to fill the decode queue, the jitter buffer and the send queue, plus a few in flight
+static ObjectPool<AudioStreamPacket, MAX_DECODE_PACKETS_IN_QUEUE + MAX_JITTER_BUFFER_PACKETS + MAX_SEND_PACKETS_IN_QUEUE + 4> audio_stream_packet_pool;
+
+AudioStreamPacketPtr AudioStreamPacket::Create() {
+    return audio_stream_packet_pool.Acquire();
+}
+
 void Protocol::OnIncomingJson(std::function<void(const cJSON* root)> callback) {
     on_incoming_json_ = callback;
 }
 
-void Protocol::OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback) {
+void Protocol::OnIncomingControl(std::function<void(const ControlMessage& message)> callback) {
+    on_incoming_control_ = callback;
+}
+
+void Protocol::OnIncomingAudio(std::function<bool(AudioStreamPacketPtr packet)> callback) {
     on_incoming_audio_ = callback;
 }
 
@@ -32,6 +50,106 @@ void Protocol::OnDisconnected(std::function<void()> callback) {
     on_disconnected_ = callback;
 }
 
+size_t Protocol::SendAudioBatch(AudioStreamPacketPtr* packets, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        if (!SendAudio(std::move(packets[i]))) {
+            return i;
+        }
+    }
+    return count;
+}
+
+void Protocol::OnTransportFeedback(std::function<void(const TransportFeedback& feedback)> callback) {
+    on_transport_feedback_ = callback;
+}
+
+void Protocol::NotifyTransportFeedback(bool sent, int64_t send_start_time_us, size_t bytes) {
+    int64_t now_us = esp_timer_get_time();
+    uint32_t send_time_us = (uint32_t)(now_us - send_start_time_us);
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex_);
+        UpdateBitrates(now_us);
+        if (sent) {
+            stats_.tx_packets++;
+            tx_window_bytes_ += bytes;
+        } else {
+            stats_.tx_failures++;
+        }
+        // Smoothed like the RTT estimate of TCP, with a gain of 1/8
+        stats_.send_time_us = stats_.send_time_us == 0 ? send_time_us : stats_.send_time_us - stats_.send_time_us / 8 + send_time_us / 8;
+    }
+    if (on_transport_feedback_ != nullptr) {
+        TransportFeedback feedback;
+        feedback.sent = sent;
+        feedback.send_time_us = send_time_us;
+        on_transport_feedback_(feedback);
+    }
+}
+
+TransportStats Protocol::GetTransportStats() {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    UpdateBitrates(esp_timer_get_time());
+    return stats_;
+}
+
+void Protocol::ResetTransportStats() {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    uint32_t rtt_ms = stats_.rtt_ms;
+    stats_ = TransportStats();
+    stats_.rtt_ms = rtt_ms;
+    rx_highest_sequence_ = 0;
+    bitrate_window_start_us_ = esp_timer_get_time();
+    tx_window_bytes_ = 0;
+    rx_window_bytes_ = 0;
+}
+
+void Protocol::MarkHelloSent() {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    hello_sent_us_ = esp_timer_get_time();
+}
+
+void Protocol::MarkHelloReceived() {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    if (hello_sent_us_ > 0) {
+        stats_.rtt_ms = (uint32_t)((esp_timer_get_time() - hello_sent_us_) / 1000);
+        hello_sent_us_ = 0;
+    }
+}
+
+void Protocol::RecordIncomingAudio(size_t bytes, uint32_t sequence) {
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    UpdateBitrates(esp_timer_get_time());
+    stats_.rx_packets++;
+    rx_window_bytes_ += bytes;
+    if (sequence == 0) {
+        return;
+    }
+    if (rx_highest_sequence_ == 0 || sequence > rx_highest_sequence_) {
+        if (rx_highest_sequence_ != 0) {
+            stats_.rx_lost += sequence - rx_highest_sequence_ - 1;
+        }
+        rx_highest_sequence_ = sequence;
+    } else if (sequence < rx_highest_sequence_) {
+        // Counted as lost when the later packet arrived
+        stats_.rx_reordered++;
+        if (stats_.rx_lost > 0) {
+            stats_.rx_lost--;
+        }
+    }
+}
+
+void Protocol::UpdateBitrates(int64_t now_us) {
+    int64_t elapsed_us = now_us - bitrate_window_start_us_;
+    if (elapsed_us < kBitrateWindowUs) {
+        return;
+    }
+    stats_.tx_bitrate_bps = (uint32_t)((int64_t)tx_window_bytes_ * 8 * 1000000 / elapsed_us);
+    stats_.rx_bitrate_bps = (uint32_t)((int64_t)rx_window_bytes_ * 8 * 1000000 / elapsed_us);
+    bitrate_window_start_us_ = now_us;
+    tx_window_bytes_ = 0;
+    rx_window_bytes_ = 0;
+}
+
 void Protocol::SetError(const std::string& message) {
     error_occurred_ = true;
     if (on_network_error_ != nullptr) {
@@ -39,7 +157,81 @@ void Protocol::SetError(const std::string& message) {
     }
 }
 
+void Protocol::HandleControl(const uint8_t* data, size_t size) {
+#if CONFIG_PROTOCOL_TRACE
+    ProtocolTrace::GetInstance().Record(kTraceControl, data, size);
+#endif
+    ControlMessage message;
+    if (!ControlMessage::Parse(data, size, message)) {
+        ESP_LOGE(TAG, "Invalid control message, size: %u", size);
+        return;
+    }
+    if (on_incoming_control_ != nullptr) {
+        on_incoming_control_(message);
+    }
+}
+
+void Protocol::ReplayIncoming(uint8_t type, const uint8_t* data, size_t size) {
+    if (type == kTraceAudio) {
+        if (size < 4 || on_incoming_audio_ == nullptr) {
+            return;
+        }
+        auto packet = AudioStreamPacket::Create();
+        packet->sample_rate = (data[0] << 8) | data[1];
+        packet->frame_duration = (data[2] << 8) | data[3];
+        packet->payload.assign(data + 4, data + size);
+        on_incoming_audio_(std::move(packet));
+        return;
+    }
+    // MQTT publishes the control messages as they are, they never start with a brace
+    if (type == kTraceControl || (size > 0 && data[0] != '{')) {
+        HandleControl(data, size);
+        return;
+    }
+    auto root = cJSON_ParseWithLength((const char*)data, size);
+    auto message_type = cJSON_GetObjectItem(root, "type");
+    // The hello and goodbye belong to the audio channel, which the replay does not open. The
+    // MCP requests would call the tools again and send their replies, they are only logged.
+    if (cJSON_IsString(message_type) && strcmp(message_type->valuestring, "mcp") == 0) {
+        ESP_LOGI(TAG, "Replay skips an MCP message of %u bytes", size);
+    } else if (cJSON_IsString(message_type) && strcmp(message_type->valuestring, "hello") != 0 &&
+        strcmp(message_type->valuestring, "goodbye") != 0 && on_incoming_json_ != nullptr) {
+        on_incoming_json_(root);
+    }
+    cJSON_Delete(root);
+}
+
+void Protocol::ParseServerFeatures(const cJSON* root) {
+    auto features = cJSON_GetObjectItem(root, "features");
+    binary_control_ = cJSON_IsObject(features) && cJSON_IsTrue(cJSON_GetObjectItem(features, "binary_control"));
+    local_endpoint_ = !cJSON_IsFalse(cJSON_GetObjectItem(features, "local_endpoint"));
+    blob_frames_ = cJSON_IsObject(features) && cJSON_IsTrue(cJSON_GetObjectItem(features, "blob"));
+#if CONFIG_AUDIO_MEDIA_STREAM
+    media_stream_ = cJSON_IsObject(features) && cJSON_IsTrue(cJSON_GetObjectItem(features, "media"));
+#else
+    media_stream_ = false;
+#endif
+#if CONFIG_AUDIO_NARROWBAND_MODE
+    narrowband_ = cJSON_IsObject(features) && cJSON_IsTrue(cJSON_GetObjectItem(features, "narrowband"));
+#else
+    narrowband_ = false;
+#endif
+    if (binary_control_) {
+        ESP_LOGI(TAG, "Using binary control messages");
+    }
+    if (media_stream_) {
+        ESP_LOGI(TAG, "Using media streams");
+    }
+}
+
 void Protocol::SendAbortSpeaking(AbortReason reason) {
+    if (binary_control_) {
+        ControlMessageWriter writer(kControlMessageAbort);
+        writer.Add(kControlFieldSessionId, session_id_);
+        writer.Add(kControlFieldReason, (uint8_t)reason);
+        SendControl(writer.data());
+        return;
+    }
     std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"abort\"";
     if (reason == kAbortReasonWakeWordDetected) {
         message += ",\"reason\":\"wake_word_detected\"";
@@ -48,13 +240,49 @@ void Protocol::SendAbortSpeaking(AbortReason reason) {
     SendText(message);
 }
 
+void Protocol::SendTtsCached(const std::string& hash) {
+    if (binary_control_) {
+        ControlMessageWriter writer(kControlMessageTts);
+        writer.Add(kControlFieldSessionId, session_id_);
+        writer.Add(kControlFieldState, (uint8_t)kControlStateCached);
+        writer.Add(kControlFieldHash, hash);
+        SendControl(writer.data());
+        return;
+    }
+    std::string message = "{\"session_id\":\"" + session_id_ +
+                          "\",\"type\":\"tts\",\"state\":\"cached\",\"hash\":\"" + hash + "\"}";
+    SendText(message);
+}
+
+void Protocol::SendAudioProfile(bool narrowband) {
+    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"audio_params\",\"profile\":\"" +
+                          (narrowband ? "narrowband" : "wideband") + "\"}";
+    SendText(message);
+}
+
 void Protocol::SendWakeWordDetected(const std::string& wake_word) {
+    if (binary_control_) {
+        ControlMessageWriter writer(kControlMessageListen);
+        writer.Add(kControlFieldSessionId, session_id_);
+        writer.Add(kControlFieldState, (uint8_t)kControlStateDetect);
+        writer.Add(kControlFieldText, wake_word);
+        SendControl(writer.data());
+        return;
+    }
     std::string json = "{\"session_id\":\"" + session_id_ + 
                       "\",\"type\":\"listen\",\"state\":\"detect\",\"text\":\"" + wake_word + "\"}";
     SendText(json);
 }
 
 void Protocol::SendStartListening(ListeningMode mode) {
+    if (binary_control_) {
+        ControlMessageWriter writer(kControlMessageListen);
+        writer.Add(kControlFieldSessionId, session_id_);
+        writer.Add(kControlFieldState, (uint8_t)kControlStateStart);
+        writer.Add(kControlFieldMode, (uint8_t)mode);
+        SendControl(writer.data());
+        return;
+    }
     std::string message = "{\"session_id\":\"" + session_id_ + "\"";
     message += ",\"type\":\"listen\",\"state\":\"start\"";
     if (mode == kListeningModeRealtime) {
@@ -69,20 +297,86 @@ void Protocol::SendStartListening(ListeningMode mode) {
 }
 
 void Protocol::SendStopListening() {
+    if (binary_control_) {
+        ControlMessageWriter writer(kControlMessageListen);
+        writer.Add(kControlFieldSessionId, session_id_);
+        writer.Add(kControlFieldState, (uint8_t)kControlStateStop);
+        SendControl(writer.data());
+        return;
+    }
     std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"listen\",\"state\":\"stop\"}";
     SendText(message);
 }
 
 void Protocol::SendMcpMessage(const std::string& payload) {
-    std::string message = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"mcp\",\"payload\":" + payload + "}";
-    SendText(message);
+    if (mcp_chunk_size_ > 0 && payload.size() + session_id_.size() + 50 > mcp_chunk_size_) {
+        SendMcpChunks(payload);
+        return;
+    }
+    // The payload may be a large tool result, it is not copied into a message of its own
+    std::string prefix = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"mcp\",\"payload\":";
+    std::string_view parts[] = {prefix, payload, "}"};
+    SendTextParts(parts, 3);
+}
+
+/*
+ * The payload goes out as a string in numbered chunks, the receiver joins the data of a chunk_id
+ * in chunk_index order up to the final one and parses it as the payload:
+ * {"session_id":"...","type":"mcp","chunk_id":1,"chunk_index":0,"data":"{\"jsonrpc\"...","final":false}
+ */
+bool Protocol::SendMcpChunks(const std::string& payload) {
+    uint32_t id = ++mcp_chunk_id_;
+    // Room for the end of the message after the data
+    const size_t kTrailerSize = sizeof("\",\"final\":false}");
+    std::string_view rest = payload;
+    std::string frame;
+    frame.reserve(mcp_chunk_size_);
+    for (int index = 0; !rest.empty(); index++) {
+        frame = "{\"session_id\":\"" + session_id_ + "\",\"type\":\"mcp\",\"chunk_id\":" + std::to_string(id)
+            + ",\"chunk_index\":" + std::to_string(index) + ",\"data\":\"";
+        size_t data_start = frame.size();
+        while (!rest.empty()) {
+            size_t length = std::min<size_t>(rest.size(), MCP_CHUNK_WINDOW);
+            // Keep a UTF-8 sequence in one chunk
+            while (length < rest.size() && length > 1 && ((uint8_t)rest[length] & 0xC0) == 0x80) {
+                length--;
+            }
+            size_t before = frame.size();
+            JsonWriter::Escape(frame, rest.substr(0, length));
+            if (frame.size() + kTrailerSize > mcp_chunk_size_ && before > data_start) {
+                frame.resize(before);
+                break;
+            }
+            rest.remove_prefix(length);
+        }
+        frame += rest.empty() ? "\",\"final\":true}" : "\",\"final\":false}";
+        if (!SendText(frame)) {
+            ESP_LOGE(TAG, "Failed to send chunk %d of MCP message %lu", index, id);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Protocol::SendTextParts(const std::string_view* parts, size_t count) {
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        size += parts[i].size();
+    }
+    std::string text;
+    text.reserve(size);
+    for (size_t i = 0; i < count; i++) {
+        text += parts[i];
+    }
+    return SendText(text);
 }
 
 bool Protocol::IsTimeout() const {
-    const int kTimeoutSeconds = 120;
+    const int kDefaultTimeoutSeconds = 120;
+    int timeout_seconds = PerfProfile::GetInstance().Get(PerfProfile::kChannelTimeoutS, kDefaultTimeoutSeconds);
     auto now = std::chrono::steady_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::seconds>(now - last_incoming_time_);
-    bool timeout = duration.count() > kTimeoutSeconds;
+    bool timeout = duration.count() > timeout_seconds;
     if (timeout) {
         ESP_LOGE(TAG, "Channel timeout %ld seconds", (long)duration.count());
     }
@@ -3,15 +3,57 @@
 
 #include <cJSON.h>
 #include <string>
+#include <string_view>
 #include <functional>
 #include <chrono>
 #include <vector>
+#include <mutex>
+
+#include "object_pool.h"
+#include "control_message.h"
+
+struct AudioStreamPacket;
+using AudioStreamPacketPtr = PooledPtr<AudioStreamPacket>;
 
 struct AudioStreamPacket {
     int sample_rate = 0;
     int frame_duration = 0;
     uint32_t timestamp = 0;
+    uint32_t sequence = 0;      // Stream sequence number, 0 for local audio
+    int64_t trace_origin_us = 0;    // Latency tracing: capture time when sending, receive time when playing
+    int64_t trace_stage_us = 0;     // Latency tracing: when the packet entered its current stage
     std::vector<uint8_t> payload;
+
+    // Take a packet from the shared packet pool, the payload keeps the capacity of its previous use
+    static AudioStreamPacketPtr Create();
+    void Reset() {
+        sample_rate = 0;
+        frame_duration = 0;
+        timestamp = 0;
+        sequence = 0;
+        trace_origin_us = 0;
+        trace_stage_us = 0;
+        payload.clear();
+    }
+};
+
+// Reported after every audio packet handed to the transport
+struct TransportFeedback {
+    bool sent = false;
+    uint32_t send_time_us = 0;  // How long the transport blocked the sender
+};
+
+// Counted since the audio channel opened, the bitrates over the last second
+struct TransportStats {
+    uint32_t rtt_ms = 0;            // Round trip of the hello exchange, 0 before the first one
+    uint32_t tx_packets = 0;
+    uint32_t tx_failures = 0;
+    uint32_t tx_bitrate_bps = 0;
+    uint32_t send_time_us = 0;      // Smoothed time a send blocks, it grows as the transport buffer backs up
+    uint32_t rx_packets = 0;
+    uint32_t rx_lost = 0;           // Sequence gaps not filled by a late packet, 0 on transports without sequences
+    uint32_t rx_reordered = 0;      // Packets that arrived after a later one
+    uint32_t rx_bitrate_bps = 0;
 };
 
 struct BinaryProtocol2 {
@@ -30,6 +72,38 @@ struct BinaryProtocol3 {
     uint8_t payload[];
 } __attribute__((packed));
 
+// A chunk of an MCP message carries at most this many bytes of escaped payload per window
+#define MCP_CHUNK_WINDOW 64
+// The smallest chunk size a client may ask for
+#define MCP_CHUNK_MIN_SIZE 1024
+
+// Version 4 uses the BinaryProtocol3 header, a message of type 1 packs several Opus frames
+#define BINARY_PROTOCOL_TYPE_OPUS 0
+#define BINARY_PROTOCOL_TYPE_OPUS_FRAMES 1
+#define BINARY_PROTOCOL_MAX_FRAMES 16
+// Version 3 and later, a compact control message when the server accepted binary_control
+#define BINARY_PROTOCOL_TYPE_CONTROL 2
+// Version 3 and later, a JSON message as raw deflate when both hellos announced deflate
+#define BINARY_PROTOCOL_TYPE_DEFLATE_JSON 3
+// Version 3 and later, a part of a binary blob an MCP reply refers to, when both hellos announced blob
+#define BINARY_PROTOCOL_TYPE_BLOB 4
+// In the reserved byte of a BINARY_PROTOCOL_TYPE_BLOB message, the last part of the blob
+#define BINARY_PROTOCOL_BLOB_FINAL 0x01
+
+// Payload of a BINARY_PROTOCOL_TYPE_BLOB message, the bytes at offset follow the header
+struct BinaryProtocolBlob {
+    uint32_t blob_id;       // Network order, as in the reply that refers to it
+    uint32_t offset;        // Network order
+    uint8_t data[];
+} __attribute__((packed));
+
+// Payload of a BINARY_PROTOCOL_TYPE_OPUS_FRAMES message
+struct BinaryProtocol4Frames {
+    uint8_t frame_count;
+    uint8_t reserved;
+    uint16_t frame_sizes[];     // frame_count sizes in network order, followed by the frames
+} __attribute__((packed));
+
 enum AbortReason {
     kAbortReasonNone,
     kAbortReasonWakeWordDetected
@@ -51,47 +125,121 @@ public:
     inline int server_frame_duration() const {
         return server_frame_duration_;
     }
+    inline int server_channels() const {
+        return server_channels_;
+    }
+    // The server may stream music in this session, see CONFIG_AUDIO_MEDIA_STREAM
+    inline bool media_stream() const {
+        return media_stream_;
+    }
+    // The server takes the narrowband uplink in this session, see CONFIG_AUDIO_NARROWBAND_MODE
+    inline bool narrowband() const {
+        return narrowband_;
+    }
     inline const std::string& session_id() const {
         return session_id_;
     }
+    // The device may end an auto stop turn itself, unless the server hello turned it off
+    inline bool local_endpoint() const {
+        return local_endpoint_;
+    }
+    // The MCP replies may send their images as blob frames instead of base64
+    inline bool blob_frames() const {
+        return blob_frames_;
+    }
 
-    void OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback);
+    // The callback returns whether it took the packet, only those advance the stream sequence
+    void OnIncomingAudio(std::function<bool(AudioStreamPacketPtr packet)> callback);
     void OnIncomingJson(std::function<void(const cJSON* root)> callback);
+    void OnIncomingControl(std::function<void(const ControlMessage& message)> callback);
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
     void OnConnected(std::function<void()> callback);
     void OnDisconnected(std::function<void()> callback);
+    void OnTransportFeedback(std::function<void(const TransportFeedback& feedback)> callback);
 
     virtual bool Start() = 0;
     virtual bool OpenAudioChannel() = 0;
     virtual void CloseAudioChannel(bool send_goodbye = true) = 0;
     virtual bool IsAudioChannelOpened() const = 0;
-    virtual bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) = 0;
+    virtual bool SendAudio(AudioStreamPacketPtr packet) = 0;
+    // Send packets in order until one fails, returns the number of packets sent
+    virtual size_t SendAudioBatch(AudioStreamPacketPtr* packets, size_t count);
     virtual void SendWakeWordDetected(const std::string& wake_word);
     virtual void SendStartListening(ListeningMode mode);
     virtual void SendStopListening();
     virtual void SendAbortSpeaking(AbortReason reason);
+    // The sentence of the hash is played from the TTS cache, its audio need not be sent
+    virtual void SendTtsCached(const std::string& hash);
+    // The uplink moved to or from the narrowband level, the server may follow with the TTS
+    virtual void SendAudioProfile(bool narrowband);
     virtual void SendMcpMessage(const std::string& message);
+    // A part of a blob, sent ahead of the MCP reply that refers to it, only once blob_frames() is negotiated
+    virtual bool SendBlobFrame(uint32_t id, uint32_t offset, const std::string& data, bool final) { return false; }
+    // 0 sends every MCP message whole, otherwise a larger one is sent as chunks of at most this size
+    void SetMcpChunkSize(size_t size) { mcp_chunk_size_ = size; }
+    // May be called from any task
+    TransportStats GetTransportStats();
+    // Feeds a message of a ProtocolTrace to the callbacks, as if the server had sent it
+    void ReplayIncoming(uint8_t type, const uint8_t* data, size_t size);
 
 protected:
     std::function<void(const cJSON* root)> on_incoming_json_;
-    std::function<void(std::unique_ptr<AudioStreamPacket> packet)> on_incoming_audio_;
+    std::function<void(const ControlMessage& message)> on_incoming_control_;
+    std::function<bool(AudioStreamPacketPtr packet)> on_incoming_audio_;
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
     std::function<void(const std::string& message)> on_network_error_;
     std::function<void()> on_connected_;
     std::function<void()> on_disconnected_;
+    std::function<void(const TransportFeedback& feedback)> on_transport_feedback_;
 
     int server_sample_rate_ = 24000;
     int server_frame_duration_ = 60;
+    int server_channels_ = 1;
+    bool media_stream_ = false;     // Both hellos announced media
+    bool narrowband_ = false;       // Both hellos announced narrowband
     bool error_occurred_ = false;
+    bool binary_control_ = false;   // Both hellos announced binary_control
+    bool local_endpoint_ = true;
+    bool blob_frames_ = false;      // Both hellos announced blob
     std::string session_id_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
 
     virtual bool SendText(const std::string& text) = 0;
+    // Sends the parts as one text message, the default joins them for SendText()
+    virtual bool SendTextParts(const std::string_view* parts, size_t count);
+    // Send a ControlMessageWriter message, only called once binary_control_ is negotiated
+    virtual bool SendControl(const std::string& message) = 0;
+    void HandleControl(const uint8_t* data, size_t size);
+    // Reads the binary_control, local_endpoint and blob features from the server hello
+    void ParseServerFeatures(const cJSON* root);
     virtual void SetError(const std::string& message);
     virtual bool IsTimeout() const;
+    void NotifyTransportFeedback(bool sent, int64_t send_start_time_us, size_t bytes);
+    // Transport statistics, the implementations report their hello exchange and every audio packet
+    void ResetTransportStats();
+    void MarkHelloSent();
+    void MarkHelloReceived();
+    void RecordIncomingAudio(size_t bytes, uint32_t sequence);  // sequence is 0 if the transport has none
+
+private:
+    static constexpr int64_t kBitrateWindowUs = 1000000;
+
+    std::mutex stats_mutex_;
+    TransportStats stats_;
+    int64_t hello_sent_us_ = 0;
+    uint32_t rx_highest_sequence_ = 0;
+    int64_t bitrate_window_start_us_ = 0;
+    uint32_t tx_window_bytes_ = 0;
+    uint32_t rx_window_bytes_ = 0;
+
+    size_t mcp_chunk_size_ = 0;
+    uint32_t mcp_chunk_id_ = 0;
+
+    void UpdateBitrates(int64_t now_us);
+    bool SendMcpChunks(const std::string& payload);
 };
 
 #endif // PROTOCOL_H
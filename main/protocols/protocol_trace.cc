@@ -0,0 +1,296 @@
+#include "protocol_trace.h"
+#include "protocol.h"
+#include "application.h"
+#include "settings.h"
+#include "perf_counters.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+#define TAG "ProtocolTrace"
+
+#define TRACE_PARTITION_LABEL "trace"
+#define TRACE_MAGIC 0x31435254      // "TRC1"
+#define TRACE_BUFFER_SIZE (CONFIG_PROTOCOL_TRACE_BUFFER_KB * 1024)
+
+void ProtocolTrace::Initialize() {
+    if (initialized_) {
+        return;
+    }
+    initialized_ = true;
+    partition_ = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, TRACE_PARTITION_LABEL);
+    if (partition_ == nullptr) {
+        ESP_LOGI(TAG, "No %s partition, the sessions cannot be traced", TRACE_PARTITION_LABEL);
+    }
+}
+
+bool ProtocolTrace::available() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Initialize();
+    return partition_ != nullptr;
+}
+
+bool ProtocolTrace::StartCapture() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Initialize();
+    if (partition_ == nullptr) {
+        return false;
+    }
+    size_t capacity = std::min<size_t>(TRACE_BUFFER_SIZE, partition_->size - sizeof(Header));
+    buffer_.clear();
+    buffer_.reserve(capacity);
+    records_ = 0;
+    start_time_us_ = esp_timer_get_time();
+    capturing_ = true;
+    ESP_LOGI(TAG, "Capturing up to %u bytes", capacity);
+    return true;
+}
+
+bool ProtocolTrace::StopCapture(uint32_t& records, uint32_t& bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    capturing_ = false;
+    if (partition_ == nullptr || records_ == 0) {
+        return false;
+    }
+
+    auto start_time = esp_timer_get_time();
+    Header header = {};
+    header.magic = TRACE_MAGIC;
+    header.records = records_;
+    header.length = buffer_.size();
+    for (auto byte : buffer_) {
+        header.checksum += byte;
+    }
+    size_t length = sizeof(Header) + buffer_.size();
+    size_t sector_size = partition_->erase_size;
+    esp_err_t err = esp_partition_erase_range(partition_, 0, (length + sector_size - 1) / sector_size * sector_size);
+    if (err == ESP_OK) {
+        err = esp_partition_write(partition_, sizeof(Header), buffer_.data(), buffer_.size());
+    }
+    // The header goes last, a write cut off by a reset leaves no trace instead of half of one
+    if (err == ESP_OK) {
+        err = esp_partition_write(partition_, 0, &header, sizeof(Header));
+    }
+    records = records_;
+    bytes = buffer_.size();
+    buffer_ = ColdVector<uint8_t>();
+    records_ = 0;
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write the trace: %s", esp_err_to_name(err));
+        return false;
+    }
+    ESP_LOGI(TAG, "Saved %lu records, %lu bytes in %d ms", records, bytes, int((esp_timer_get_time() - start_time) / 1000));
+    return true;
+}
+
+bool ProtocolTrace::Append(uint8_t type, size_t size, const std::function<void(uint8_t* data)>& write) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!capturing_) {
+        return false;
+    }
+    if (size > UINT16_MAX || buffer_.size() + sizeof(RecordHeader) + size > buffer_.capacity()) {
+        // Full, the capture keeps what it has so far
+        capturing_ = false;
+        ESP_LOGW(TAG, "The capture buffer is full after %lu records", records_);
+        return false;
+    }
+    RecordHeader header;
+    header.time_ms = (esp_timer_get_time() - start_time_us_) / 1000;
+    header.type = type;
+    header.reserved = 0;
+    header.size = size;
+    size_t offset = buffer_.size();
+    buffer_.resize(offset + sizeof(header) + size);
+    memcpy(buffer_.data() + offset, &header, sizeof(header));
+    write(buffer_.data() + offset + sizeof(header));
+    records_++;
+    return true;
+}
+
+void ProtocolTrace::Record(uint8_t type, const void* data, size_t size) {
+    if (!capturing()) {
+        return;
+    }
+    Append(type, size, [data, size](uint8_t* out) {
+        memcpy(out, data, size);
+    });
+}
+
+void ProtocolTrace::Record(uint8_t type, const std::string_view* parts, size_t count) {
+    if (!capturing()) {
+        return;
+    }
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        size += parts[i].size();
+    }
+    Append(type, size, [parts, count](uint8_t* out) {
+        for (size_t i = 0; i < count; i++) {
+            memcpy(out, parts[i].data(), parts[i].size());
+            out += parts[i].size();
+        }
+    });
+}
+
+void ProtocolTrace::RecordAudio(uint8_t type, const AudioStreamPacket& packet) {
+    if (!capturing()) {
+        return;
+    }
+    Append(type | kTraceAudio, 4 + packet.payload.size(), [&packet](uint8_t* out) {
+        out[0] = packet.sample_rate >> 8;
+        out[1] = packet.sample_rate & 0xFF;
+        out[2] = packet.frame_duration >> 8;
+        out[3] = packet.frame_duration & 0xFF;
+        memcpy(out + 4, packet.payload.data(), packet.payload.size());
+    });
+}
+
+void ProtocolTrace::RequestReplay() {
+    Settings settings("trace", true);
+    settings.SetBool("replay", true);
+}
+
+void ProtocolTrace::StartPendingReplay(Protocol& protocol) {
+    {
+        Settings settings("trace", true);
+        if (!settings.GetBool("replay")) {
+            return;
+        }
+        // Once only, a replay that crashes the firmware does not run again
+        settings.EraseKey("replay");
+    }
+    if (!available()) {
+        return;
+    }
+    xTaskCreate([](void* arg) {
+        ProtocolTrace::GetInstance().ReplayTask(*static_cast<Protocol*>(arg));
+        vTaskDelete(NULL);
+    }, "trace_replay", 4096, &protocol, 3, nullptr);
+}
+
+std::string ProtocolTrace::KindOf(uint8_t type, const uint8_t* data, size_t size) {
+    if (type == kTraceAudio) {
+        return "audio";
+    }
+    if (type == kTraceControl || (size > 0 && data[0] != '{')) {
+        static const char* const kControlNames[] = {"none", "tts", "stt", "llm", "listen", "abort"};
+        uint8_t control = size > 0 ? data[0] : 0;
+        return std::string("control.") + (control < 6 ? kControlNames[control] : "unknown");
+    }
+    auto root = cJSON_ParseWithLength((const char*)data, size);
+    auto message_type = cJSON_GetObjectItem(root, "type");
+    std::string kind = cJSON_IsString(message_type) ? message_type->valuestring : "unknown";
+    auto state = cJSON_GetObjectItem(root, "state");
+    if (cJSON_IsString(state)) {
+        kind += std::string(".") + state->valuestring;
+    }
+    cJSON_Delete(root);
+    return kind;
+}
+
+uint32_t ProtocolTrace::WaitForMainTask() {
+    auto start_time = esp_timer_get_time();
+    SemaphoreHandle_t done = xSemaphoreCreateBinary();
+    if (done == nullptr) {
+        return 0;
+    }
+    Application::GetInstance().Schedule([done]() {
+        xSemaphoreGive(done);
+    });
+    xSemaphoreTake(done, portMAX_DELAY);
+    vSemaphoreDelete(done);
+    return esp_timer_get_time() - start_time;
+}
+
+void ProtocolTrace::ReplayTask(Protocol& protocol) {
+    Header header;
+    if (esp_partition_read(partition_, 0, &header, sizeof(header)) != ESP_OK || header.magic != TRACE_MAGIC ||
+        header.length > partition_->size - sizeof(header)) {
+        ESP_LOGW(TAG, "No trace to replay");
+        return;
+    }
+    ColdVector<uint8_t> data(header.length);
+    if (esp_partition_read(partition_, sizeof(header), data.data(), data.size()) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read the trace of %lu bytes", header.length);
+        return;
+    }
+    uint32_t checksum = 0;
+    for (auto byte : data) {
+        checksum += byte;
+    }
+    if (checksum != header.checksum) {
+        ESP_LOGE(TAG, "The trace is corrupted");
+        return;
+    }
+
+    ESP_LOGI(TAG, "Replaying %lu records", header.records);
+    std::map<std::string, Timing> timings;
+    uint32_t records = 0;
+    int64_t start_time = esp_timer_get_time();
+    size_t offset = 0;
+    while (offset + sizeof(RecordHeader) <= data.size()) {
+        RecordHeader record;
+        memcpy(&record, data.data() + offset, sizeof(record));
+        offset += sizeof(record);
+        if (offset + record.size > data.size()) {
+            break;
+        }
+        const uint8_t* payload = data.data() + offset;
+        offset += record.size;
+        if (record.type & kTraceOutgoing) {
+            continue;
+        }
+
+        // At the pace it was received, the audio would otherwise overflow the decode queue
+        int64_t delay_us = start_time + (int64_t)record.time_ms * 1000 - esp_timer_get_time();
+        if (delay_us > 1000) {
+            vTaskDelay(pdMS_TO_TICKS(delay_us / 1000));
+        }
+        auto& timing = timings[KindOf(record.type, payload, record.size)];
+        int64_t dispatch_start = esp_timer_get_time();
+        protocol.ReplayIncoming(record.type, payload, record.size);
+        uint32_t dispatch_us = esp_timer_get_time() - dispatch_start;
+        // The audio is decoded by its own task, its cost is in the audio counters of the report
+        uint32_t settle_us = record.type == kTraceAudio ? 0 : WaitForMainTask();
+        timing.count++;
+        timing.dispatch_us += dispatch_us;
+        timing.max_dispatch_us = std::max(timing.max_dispatch_us, dispatch_us);
+        timing.settle_us += settle_us;
+        timing.max_settle_us = std::max(timing.max_settle_us, settle_us);
+        records++;
+    }
+
+    auto report = cJSON_CreateObject();
+    cJSON_AddNumberToObject(report, "records", records);
+    cJSON_AddNumberToObject(report, "duration_ms", (esp_timer_get_time() - start_time) / 1000);
+    auto messages = cJSON_CreateObject();
+    for (auto& [kind, timing] : timings) {
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "count", timing.count);
+        cJSON_AddNumberToObject(item, "mean_dispatch_us", timing.dispatch_us / timing.count);
+        cJSON_AddNumberToObject(item, "max_dispatch_us", timing.max_dispatch_us);
+        cJSON_AddNumberToObject(item, "mean_settle_us", timing.settle_us / timing.count);
+        cJSON_AddNumberToObject(item, "max_settle_us", timing.max_settle_us);
+        cJSON_AddItemToObject(messages, kind.c_str(), item);
+    }
+    cJSON_AddItemToObject(report, "messages", messages);
+    cJSON_AddItemToObject(report, "perf", PerfCounters::GetInstance().GetStatsJson());
+    ESP_LOGI(TAG, "Replayed %lu records in %d ms", records, int((esp_timer_get_time() - start_time) / 1000));
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (report_ != nullptr) {
+        cJSON_Delete(report_);
+    }
+    report_ = report;
+}
+
+cJSON* ProtocolTrace::GetReportJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return report_ != nullptr ? cJSON_Duplicate(report_, true) : nullptr;
+}
@@ -0,0 +1,112 @@
+#ifndef PROTOCOL_TRACE_H
+#define PROTOCOL_TRACE_H
+
+#include <cJSON.h>
+#include <esp_partition.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+#include "memory_placement.h"
+
+class Protocol;
+struct AudioStreamPacket;
+
+enum ProtocolTraceType : uint8_t {
+    kTraceText = 0,         // A JSON message, or a control message MQTT published as text
+    kTraceControl = 1,      // A binary control message
+    kTraceAudio = 2,        // |sample_rate 2u|frame_duration 2u|payload|
+    kTraceOutgoing = 0x80,  // Or'ed in for what the device sent
+};
+
+/*
+ * Records the messages of a session to the trace partition and replays them into the
+ * application, to compare the processing cost of firmware builds on the same traffic.
+ *
+ * While a capture runs the transports hand every incoming and outgoing message to Record(),
+ * which appends it with its time to a PSRAM buffer of CONFIG_PROTOCOL_TRACE_BUFFER_KB, and
+ * the capture stops by itself once the buffer is full. StopCapture() writes the buffer to the
+ * partition, where it survives flashing another firmware.
+ *
+ * A replay runs after the next boot, before any audio channel is opened. The incoming messages
+ * are fed to the callbacks of the protocol at their recorded times, each one timed in the
+ * callback and until the main task has run what it scheduled. The outgoing ones are skipped.
+ * The times by message kind and the performance counters of the run make the report.
+ */
+class ProtocolTrace {
+public:
+    static ProtocolTrace& GetInstance() {
+        static ProtocolTrace instance;
+        return instance;
+    }
+
+    bool available();
+    bool capturing() const { return capturing_.load(std::memory_order_relaxed); }
+    bool StartCapture();
+    // Writes the capture to the partition, false if there is none
+    bool StopCapture(uint32_t& records, uint32_t& bytes);
+
+    // May be called by any task, does nothing unless a capture runs
+    void Record(uint8_t type, const void* data, size_t size);
+    void Record(uint8_t type, const std::string_view* parts, size_t count);
+    void RecordAudio(uint8_t type, const AudioStreamPacket& packet);
+
+    // The replay runs after the next boot
+    void RequestReplay();
+    // Starts the replay if one was requested, the protocol lives as long as the firmware
+    void StartPendingReplay(Protocol& protocol);
+    // The caller owns the returned object, nullptr before a replay ended
+    cJSON* GetReportJson();
+
+private:
+    struct Header {
+        uint32_t magic;
+        uint32_t records;
+        uint32_t length;        // Of the records after the header
+        uint32_t checksum;      // Sum of the record bytes
+    };
+
+    struct RecordHeader {
+        uint32_t time_ms;       // Since the capture started
+        uint8_t type;
+        uint8_t reserved;
+        uint16_t size;
+    } __attribute__((packed));
+
+    struct Timing {
+        uint32_t count = 0;
+        uint64_t dispatch_us = 0;
+        uint32_t max_dispatch_us = 0;
+        uint64_t settle_us = 0;
+        uint32_t max_settle_us = 0;
+    };
+
+    ProtocolTrace() = default;
+    ProtocolTrace(const ProtocolTrace&) = delete;
+    ProtocolTrace& operator=(const ProtocolTrace&) = delete;
+
+    const esp_partition_t* partition_ = nullptr;
+    bool initialized_ = false;
+
+    std::mutex mutex_;
+    std::atomic<bool> capturing_ = false;
+    ColdVector<uint8_t> buffer_;
+    uint32_t records_ = 0;
+    int64_t start_time_us_ = 0;
+
+    cJSON* report_ = nullptr;
+
+    void Initialize();
+    bool Append(uint8_t type, size_t size, const std::function<void(uint8_t* data)>& write);
+    void ReplayTask(Protocol& protocol);
+    // Times the main task takes for what is scheduled before
+    static uint32_t WaitForMainTask();
+    static std::string KindOf(uint8_t type, const uint8_t* data, size_t size);
+};
+
+#endif // PROTOCOL_TRACE_H
@@ -0,0 +1,255 @@
+#include "server_endpoints.h"
+#include "board.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/task.h>
+#include <lwip/netdb.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "ServerEndpoints"
+
+#define SERVER_ENDPOINT_TTL_US (CONFIG_SERVER_ENDPOINT_TTL_S * 1000000LL)
+// A race is given up after this, the endpoints are then tried in the configured order
+#define RACE_TIMEOUT_MS 5000
+#define PROBE_POLL_MS 50
+#define PROBE_TASK_STACK_SIZE 4096
+
+ServerEndpoints::Race::~Race() {
+    if (done != nullptr) {
+        vSemaphoreDelete(done);
+    }
+}
+
+std::vector<std::string> ServerEndpoints::Order(const std::string& key, const std::string& primary,
+    const std::string& alternatives, int default_port) {
+    std::vector<std::string> endpoints;
+    if (!primary.empty()) {
+        endpoints.push_back(primary);
+    }
+    size_t start = 0;
+    while (start < alternatives.size()) {
+        size_t end = alternatives.find(',', start);
+        if (end == std::string::npos) {
+            end = alternatives.size();
+        }
+        std::string endpoint = alternatives.substr(start, end - start);
+        endpoint.erase(0, endpoint.find_first_not_of(' '));
+        endpoint.erase(endpoint.find_last_not_of(' ') + 1);
+        if (!endpoint.empty() && std::find(endpoints.begin(), endpoints.end(), endpoint) == endpoints.end()) {
+            endpoints.push_back(endpoint);
+        }
+        start = end + 1;
+    }
+    if (endpoints.size() < 2) {
+        return endpoints;
+    }
+
+    int first = -1;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = preferred_.find(key);
+        if (it != preferred_.end() && esp_timer_get_time() < it->second.expire_time_us) {
+            auto found = std::find(endpoints.begin(), endpoints.end(), it->second.endpoint);
+            if (found != endpoints.end()) {
+                first = found - endpoints.begin();
+            }
+        }
+    }
+    if (first < 0 && CanRace()) {
+        first = RaceEndpoints(endpoints, default_port);
+    }
+    if (first > 0) {
+        std::rotate(endpoints.begin(), endpoints.begin() + first, endpoints.begin() + first + 1);
+    }
+    return endpoints;
+}
+
+void ServerEndpoints::ReportResult(const std::string& key, const std::string& endpoint, bool connected, uint32_t connect_ms) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = preferred_.find(key);
+    if (connected) {
+        auto& preferred = preferred_[key];
+        if (preferred.endpoint != endpoint) {
+            ESP_LOGI(TAG, "Preferring %s for %s, connected in %lu ms", endpoint.c_str(), key.c_str(), connect_ms);
+        }
+        preferred.endpoint = endpoint;
+        preferred.expire_time_us = esp_timer_get_time() + SERVER_ENDPOINT_TTL_US;
+    } else if (it != preferred_.end() && it->second.endpoint == endpoint) {
+        // Race again on the next open
+        preferred_.erase(it);
+    }
+}
+
+/* The probes use the lwIP sockets, which a modem with its own TCP stack does not go through */
+bool ServerEndpoints::CanRace() {
+    auto board_type = Board::GetInstance().GetBoardType();
+    return board_type == "wifi" || board_type == "rndis";
+}
+
+/* An URL like wss://host:port/path, or host:port as the MQTT endpoints are */
+bool ServerEndpoints::ParseEndpoint(const std::string& endpoint, int default_port, std::string& host, int& port) {
+    size_t start = 0;
+    port = default_port;
+    size_t scheme = endpoint.find("://");
+    if (scheme != std::string::npos) {
+        std::string name = endpoint.substr(0, scheme);
+        port = (name == "wss" || name == "https") ? 443 : 80;
+        start = scheme + 3;
+    }
+    size_t end = endpoint.find('/', start);
+    std::string authority = endpoint.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    size_t colon = authority.rfind(':');
+    if (colon != std::string::npos) {
+        port = atoi(authority.c_str() + colon + 1);
+        authority.resize(colon);
+    }
+    host = authority;
+    return !host.empty() && port > 0;
+}
+
+int ServerEndpoints::RaceEndpoints(const std::vector<std::string>& endpoints, int default_port) {
+    auto race = std::make_shared<Race>();
+    race->done = xSemaphoreCreateBinary();
+    if (race->done == nullptr) {
+        return -1;
+    }
+    int64_t start_time = esp_timer_get_time();
+    int delay_ms = 0;
+    for (size_t i = 0; i < endpoints.size(); i++) {
+        auto probe = new Probe{race, (int)i, "", 0, delay_ms};
+        if (!ParseEndpoint(endpoints[i], default_port, probe->host, probe->port)) {
+            ESP_LOGW(TAG, "Invalid endpoint: %s", endpoints[i].c_str());
+            delete probe;
+            continue;
+        }
+        race->pending++;
+        if (xTaskCreate([](void* arg) {
+            auto probe = (Probe*)arg;
+            ServerEndpoints::GetInstance().RunProbe(*probe);
+            delete probe;
+            vTaskDelete(NULL);
+        }, "endpoint_probe", PROBE_TASK_STACK_SIZE, probe, 2, nullptr) != pdPASS) {
+            race->pending--;
+            delete probe;
+            continue;
+        }
+        delay_ms += CONFIG_SERVER_ENDPOINT_RACE_DELAY_MS;
+    }
+    if (race->pending == 0) {
+        return -1;
+    }
+
+    xSemaphoreTake(race->done, pdMS_TO_TICKS(RACE_TIMEOUT_MS));
+    // The probes still running see the winner, or that the race was given up, and stop
+    int expected = -1;
+    race->winner.compare_exchange_strong(expected, (int)endpoints.size());
+    int winner = race->winner;
+    if (winner >= (int)endpoints.size()) {
+        ESP_LOGW(TAG, "No endpoint answered in %d ms", int((esp_timer_get_time() - start_time) / 1000));
+        return -1;
+    }
+    ESP_LOGI(TAG, "%s answered first in %d ms", endpoints[winner].c_str(), int((esp_timer_get_time() - start_time) / 1000));
+    return winner;
+}
+
+void ServerEndpoints::RunProbe(Probe& probe) {
+    auto& race = *probe.race;
+    for (int waited = 0; waited < probe.delay_ms && race.winner < 0; waited += PROBE_POLL_MS) {
+        vTaskDelay(pdMS_TO_TICKS(PROBE_POLL_MS));
+    }
+    int64_t deadline_us = esp_timer_get_time() + RACE_TIMEOUT_MS * 1000LL;
+    if (race.winner < 0) {
+        for (auto& address : Resolve(probe.host)) {
+            if (race.winner >= 0) {
+                break;
+            }
+            if (ConnectAddress(address, probe.port, race, deadline_us)) {
+                int expected = -1;
+                if (race.winner.compare_exchange_strong(expected, probe.index)) {
+                    xSemaphoreGive(race.done);
+                }
+                break;
+            }
+        }
+    }
+    if (--race.pending == 0 && race.winner < 0) {
+        xSemaphoreGive(race.done);
+    }
+}
+
+std::vector<sockaddr_storage> ServerEndpoints::Resolve(const std::string& host) {
+    int64_t now = esp_timer_get_time();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = resolved_.find(host);
+        if (it != resolved_.end() && now < it->second.expire_time_us) {
+            return it->second.addresses;
+        }
+    }
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    int err = getaddrinfo(host.c_str(), nullptr, &hints, &result);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& resolved = resolved_[host];
+    if (err != 0 || result == nullptr) {
+        // The addresses of an expired lookup still beat none
+        ESP_LOGW(TAG, "Failed to resolve %s: %d, %u cached addresses", host.c_str(), err, resolved.addresses.size());
+        return resolved.addresses;
+    }
+    resolved.addresses.clear();
+    for (auto info = result; info != nullptr; info = info->ai_next) {
+        sockaddr_storage address = {};
+        memcpy(&address, info->ai_addr, std::min<size_t>(info->ai_addrlen, sizeof(address)));
+        resolved.addresses.push_back(address);
+    }
+    resolved.expire_time_us = now + SERVER_ENDPOINT_TTL_US;
+    freeaddrinfo(result);
+    return resolved.addresses;
+}
+
+/* A non-blocking connect, given up once another probe won or the race timed out */
+bool ServerEndpoints::ConnectAddress(sockaddr_storage address, int port, Race& race, int64_t deadline_us) {
+    socklen_t length = sizeof(sockaddr_in);
+    if (address.ss_family == AF_INET) {
+        ((sockaddr_in*)&address)->sin_port = htons(port);
+#if LWIP_IPV6
+    } else if (address.ss_family == AF_INET6) {
+        ((sockaddr_in6*)&address)->sin6_port = htons(port);
+        length = sizeof(sockaddr_in6);
+#endif
+    } else {
+        return false;
+    }
+    int fd = socket(address.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (fd < 0) {
+        return false;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    bool connected = connect(fd, (sockaddr*)&address, length) == 0;
+    if (!connected && errno == EINPROGRESS) {
+        while (race.winner < 0 && esp_timer_get_time() < deadline_us) {
+            fd_set write_set;
+            FD_ZERO(&write_set);
+            FD_SET(fd, &write_set);
+            timeval timeout = {0, PROBE_POLL_MS * 1000};
+            int ready = select(fd + 1, nullptr, &write_set, nullptr, &timeout);
+            if (ready < 0) {
+                break;
+            }
+            if (ready > 0) {
+                int error = 0;
+                socklen_t error_length = sizeof(error);
+                getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length);
+                connected = error == 0;
+                break;
+            }
+        }
+    }
+    close(fd);
+    return connected;
+}
@@ -0,0 +1,84 @@
+#ifndef SERVER_ENDPOINTS_H
+#define SERVER_ENDPOINTS_H
+
+#include <lwip/sockets.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * Picks which of the server endpoints from the OTA config a protocol connects to first.
+ *
+ * The OTA config may list other endpoints next to the configured one, the "endpoints" of the
+ * websocket or mqtt section. The endpoint that last connected stays the first one tried for
+ * CONFIG_SERVER_ENDPOINT_TTL_S, so a failover is not paid again on every open. Without one,
+ * on boards where the lwIP sockets reach the server, the endpoints race happy eyeballs style:
+ * a TCP connect to the addresses of each one, started CONFIG_SERVER_ENDPOINT_RACE_DELAY_MS
+ * apart, and the first to answer is tried first. The transports connect by host name for TLS,
+ * so the race only orders them, and the addresses it resolved are cached for the TTL too, the
+ * stale ones still serve a race when the DNS does not answer.
+ *
+ * May be called by any task, a race blocks the caller until an endpoint answered.
+ */
+class ServerEndpoints {
+public:
+    static ServerEndpoints& GetInstance() {
+        static ServerEndpoints instance;
+        return instance;
+    }
+
+    // The configured endpoint and the comma separated alternatives, in the order to try them
+    std::vector<std::string> Order(const std::string& key, const std::string& primary, const std::string& alternatives,
+        int default_port);
+    void ReportResult(const std::string& key, const std::string& endpoint, bool connected, uint32_t connect_ms);
+
+private:
+    struct Preferred {
+        std::string endpoint;
+        int64_t expire_time_us = 0;
+    };
+
+    struct Resolved {
+        std::vector<sockaddr_storage> addresses;
+        int64_t expire_time_us = 0;
+    };
+
+    struct Race {
+        std::atomic<int> winner = -1;
+        std::atomic<int> pending = 0;
+        SemaphoreHandle_t done = nullptr;   // Given once there is a winner or every probe failed
+        ~Race();
+    };
+
+    struct Probe {
+        std::shared_ptr<Race> race;
+        int index;
+        std::string host;
+        int port;
+        int delay_ms;
+    };
+
+    ServerEndpoints() = default;
+    ServerEndpoints(const ServerEndpoints&) = delete;
+    ServerEndpoints& operator=(const ServerEndpoints&) = delete;
+
+    std::mutex mutex_;
+    std::map<std::string, Preferred> preferred_;
+    std::map<std::string, Resolved> resolved_;
+
+    static bool CanRace();
+    static bool ParseEndpoint(const std::string& endpoint, int default_port, std::string& host, int& port);
+    int RaceEndpoints(const std::vector<std::string>& endpoints, int default_port);
+    void RunProbe(Probe& probe);
+    std::vector<sockaddr_storage> Resolve(const std::string& host);
+    static bool ConnectAddress(sockaddr_storage address, int port, Race& race, int64_t deadline_us);
+};
+
+#endif // SERVER_ENDPOINTS_H
@@ -0,0 +1,309 @@
+#include "udp_audio_channel.h"
+#include "trace_markers.h"
+#include "board.h"
+#include "socket_qos.h"
+
+#include <esp_log.h>
+#include <cstring>
+#include <algorithm>
+#include <arpa/inet.h>
+
+#define TAG "UdpAudio"
+
+UdpAudioChannel::~UdpAudioChannel() {
+    // Stop the receiving task before the state it uses goes away
+    udp_.reset();
+    if (aes_initialized_) {
+        mbedtls_aes_free(&aes_ctx_);
+    }
+}
+
+bool UdpAudioChannel::Open(int connect_id, const std::string& server, int port, const std::string& key_hex,
+    const std::string& nonce_hex, int fec_group, PacketCallback callback) {
+    if (!SetKey(key_hex, nonce_hex, fec_group)) {
+        return false;
+    }
+    callback_ = callback;
+
+    auto network = Board::GetInstance().GetNetwork();
+    udp_ = network->CreateUdp(connect_id);
+    udp_->OnMessage([this](const std::string& data) {
+        TRACE_SCOPE(kTraceProtocolReceive);
+        OnDatagram(data);
+    });
+    if (!SocketQos::Open(kTrafficClassVoice, [this, &server, port]() { return udp_->Connect(server, port); })) {
+        ESP_LOGE(TAG, "Failed to connect to %s:%d", server.c_str(), port);
+        return false;
+    }
+    server_ = server;
+    port_ = port;
+    active_ = true;
+    ESP_LOGI(TAG, "Connected to %s:%d, fec group: %d", server.c_str(), port, fec_group_);
+    return true;
+}
+
+bool UdpAudioChannel::Rekey(const std::string& key_hex, const std::string& nonce_hex, int fec_group) {
+    std::lock_guard<std::mutex> lock(rx_mutex_);
+    if (!SetKey(key_hex, nonce_hex, fec_group)) {
+        return false;
+    }
+    rx_groups_ = {};
+    active_ = true;
+    ESP_LOGI(TAG, "Reusing the socket to %s:%d, fec group: %d", server_.c_str(), port_, fec_group_);
+    return true;
+}
+
+bool UdpAudioChannel::SetKey(const std::string& key_hex, const std::string& nonce_hex, int fec_group) {
+    active_ = false;
+    nonce_ = DecodeHexString(nonce_hex);
+    if (nonce_.size() != kHeaderSize) {
+        ESP_LOGE(TAG, "Invalid nonce size: %u", nonce_.size());
+        return false;
+    }
+    if (!aes_initialized_) {
+        mbedtls_aes_init(&aes_ctx_);
+        aes_initialized_ = true;
+    }
+    if (key_hex != key_) {
+        key_.clear();
+        if (mbedtls_aes_setkey_enc(&aes_ctx_, (const unsigned char*)DecodeHexString(key_hex).c_str(), 128) != 0) {
+            ESP_LOGE(TAG, "Invalid key");
+            return false;
+        }
+        key_ = key_hex;
+    }
+    fec_group_ = std::clamp(fec_group, 0, UDP_AUDIO_MAX_FEC_GROUP);
+    fec_group_ = fec_group_ == 1 ? 0 : fec_group_;
+    local_sequence_ = 0;
+    tx_group_count_ = 0;
+    return true;
+}
+
+bool UdpAudioChannel::Send(const AudioStreamPacket& packet, size_t* bytes) {
+    if (!SendDatagram(kPacketTypeAudio, 0, packet.timestamp, ++local_sequence_, packet.payload.data(), packet.payload.size(), bytes)) {
+        return false;
+    }
+    if (fec_group_ == 0) {
+        return true;
+    }
+    AddToParity(packet);
+    if (tx_group_count_ == fec_group_) {
+        // A lost parity packet only costs the protection of its group
+        size_t parity_bytes = 0;
+        SendDatagram(kPacketTypeParity, fec_group_, 0, tx_group_sequence_, tx_parity_.data(), tx_parity_.size(), &parity_bytes);
+        *bytes += parity_bytes;
+        tx_group_count_ = 0;
+    }
+    return true;
+}
+
+void UdpAudioChannel::AddToParity(const AudioStreamPacket& packet) {
+    if (tx_group_count_ == 0) {
+        tx_parity_.assign(kParityHeaderSize, 0);
+        tx_group_sequence_ = local_sequence_;
+    }
+    size_t size = packet.payload.size();
+    if (tx_parity_.size() < kParityHeaderSize + size) {
+        tx_parity_.resize(kParityHeaderSize + size, 0);
+    }
+    uint16_t length = htons(size);
+    uint32_t timestamp = htonl(packet.timestamp);
+    auto length_bytes = (const uint8_t*)&length;
+    auto timestamp_bytes = (const uint8_t*)&timestamp;
+    tx_parity_[0] ^= length_bytes[0];
+    tx_parity_[1] ^= length_bytes[1];
+    for (int i = 0; i < 4; i++) {
+        tx_parity_[2 + i] ^= timestamp_bytes[i];
+    }
+    auto parity = tx_parity_.data() + kParityHeaderSize;
+    for (size_t i = 0; i < size; i++) {
+        parity[i] ^= packet.payload[i];
+    }
+    tx_group_count_++;
+}
+
+bool UdpAudioChannel::SendDatagram(uint8_t type, uint8_t flags, uint32_t timestamp, uint32_t sequence,
+    const uint8_t* payload, size_t size, size_t* bytes) {
+    if (udp_ == nullptr) {
+        return false;
+    }
+    /* Build the datagram in the reused send buffer: the nonce header, then the payload encrypted into place */
+    send_buffer_.resize(kHeaderSize + size);
+    auto buffer = (uint8_t*)send_buffer_.data();
+    memcpy(buffer, nonce_.data(), kHeaderSize);
+    if (type != kPacketTypeAudio) {
+        buffer[0] = type;
+        buffer[1] = flags;
+    }
+    *(uint16_t*)&buffer[2] = htons(size);
+    *(uint32_t*)&buffer[8] = htonl(timestamp);
+    *(uint32_t*)&buffer[12] = htonl(sequence);
+
+    // mbedtls advances the counter block, so it works on a copy of the header
+    uint8_t nonce_counter[16];
+    memcpy(nonce_counter, buffer, sizeof(nonce_counter));
+    size_t nc_off = 0;
+    uint8_t stream_block[16] = {0};
+    if (mbedtls_aes_crypt_ctr(&aes_ctx_, size, &nc_off, nonce_counter, stream_block, payload, buffer + kHeaderSize) != 0) {
+        ESP_LOGE(TAG, "Failed to encrypt audio data");
+        return false;
+    }
+    *bytes = send_buffer_.size();
+    return udp_->Send(send_buffer_) > 0;
+}
+
+void UdpAudioChannel::OnDatagram(const std::string& data) {
+    std::lock_guard<std::mutex> lock(rx_mutex_);
+    if (!active_) {
+        return;
+    }
+    if (data.size() < kHeaderSize) {
+        ESP_LOGE(TAG, "Invalid audio packet size: %u", data.size());
+        return;
+    }
+    uint8_t type = data[0];
+    if (type != kPacketTypeAudio && !(type == kPacketTypeParity && fec_group_ > 0)) {
+        ESP_LOGE(TAG, "Invalid audio packet type: %x", type);
+        return;
+    }
+    uint32_t timestamp = ntohl(*(const uint32_t*)&data[8]);
+    uint32_t sequence = ntohl(*(const uint32_t*)&data[12]);
+
+    size_t decrypted_size = data.size() - kHeaderSize;
+    size_t nc_off = 0;
+    uint8_t stream_block[16] = {0};
+    // mbedtls advances the counter block, keep the received datagram untouched
+    uint8_t nonce[16];
+    memcpy(nonce, data.data(), sizeof(nonce));
+    auto encrypted = (const uint8_t*)data.data() + kHeaderSize;
+
+    if (type == kPacketTypeParity) {
+        auto group = GetRxGroup(sequence);
+        if (group == nullptr || group->first_sequence != sequence || group->has_parity) {
+            return;
+        }
+        group->parity.resize(decrypted_size);
+        if (mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, group->parity.data()) != 0
+            || decrypted_size < kParityHeaderSize) {
+            return;
+        }
+        group->has_parity = true;
+        TryRecover(*group);
+        return;
+    }
+
+    auto packet = AudioStreamPacket::Create();
+    packet->timestamp = timestamp;
+    packet->sequence = sequence;
+    packet->payload.resize(decrypted_size);
+    int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, packet->payload.data());
+    if (ret != 0) {
+        ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
+        return;
+    }
+    if (fec_group_ > 0) {
+        auto group = GetRxGroup(sequence);
+        if (group != nullptr) {
+            size_t index = sequence - group->first_sequence;
+            group->timestamps[index] = timestamp;
+            group->payloads[index].assign(packet->payload.begin(), packet->payload.end());
+            group->received |= 1u << index;
+        }
+        callback_(std::move(packet), data.size());
+        if (group != nullptr) {
+            TryRecover(*group);
+        }
+        return;
+    }
+    callback_(std::move(packet), data.size());
+}
+
+UdpAudioChannel::FecGroup* UdpAudioChannel::GetRxGroup(uint32_t sequence) {
+    if (sequence == 0) {
+        return nullptr;
+    }
+    uint32_t number = (sequence - 1) / fec_group_;
+    uint32_t first_sequence = number * fec_group_ + 1;
+    auto& group = rx_groups_[number % rx_groups_.size()];
+    if (group.first_sequence == first_sequence) {
+        return &group;
+    }
+    if (group.first_sequence > first_sequence) {
+        // Too late, the slot already holds a newer group
+        return nullptr;
+    }
+    group.first_sequence = first_sequence;
+    group.received = 0;
+    group.has_parity = false;
+    group.done = false;
+    return &group;
+}
+
+void UdpAudioChannel::TryRecover(FecGroup& group) {
+    if (group.done || !group.has_parity) {
+        return;
+    }
+    uint32_t all = (1u << fec_group_) - 1;
+    if (group.received == all) {
+        group.done = true;
+        return;
+    }
+    uint32_t missing = all & ~group.received;
+    if ((missing & (missing - 1)) != 0) {
+        // More than one packet is missing, wait for the others
+        return;
+    }
+    size_t index = __builtin_ctz(missing);
+
+    auto& parity = group.parity;
+    uint16_t length = (parity[0] << 8) | parity[1];
+    uint32_t timestamp = ((uint32_t)parity[2] << 24) | ((uint32_t)parity[3] << 16) | ((uint32_t)parity[4] << 8) | parity[5];
+    for (int i = 0; i < fec_group_; i++) {
+        if (i != (int)index) {
+            length ^= group.payloads[i].size();
+            timestamp ^= group.timestamps[i];
+        }
+    }
+    if (length > parity.size() - kParityHeaderSize) {
+        ESP_LOGW(TAG, "Invalid parity for group %lu", group.first_sequence);
+        group.done = true;
+        return;
+    }
+
+    auto packet = AudioStreamPacket::Create();
+    packet->timestamp = timestamp;
+    packet->sequence = group.first_sequence + index;
+    packet->payload.assign(parity.begin() + kParityHeaderSize, parity.begin() + kParityHeaderSize + length);
+    for (int i = 0; i < fec_group_; i++) {
+        if (i == (int)index) {
+            continue;
+        }
+        auto& payload = group.payloads[i];
+        size_t n = std::min<size_t>(payload.size(), length);
+        for (size_t j = 0; j < n; j++) {
+            packet->payload[j] ^= payload[j];
+        }
+    }
+    group.done = true;
+    recovered_packets_++;
+    ESP_LOGD(TAG, "Recovered audio packet %lu", packet->sequence);
+    callback_(std::move(packet), 0);
+}
+
+// 辅助函数，将单个十六进制字符转换为对应的数值
+static inline uint8_t CharToHex(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return 0;  // 对于无效输入，返回0
+}
+
+std::string UdpAudioChannel::DecodeHexString(const std::string& hex_string) {
+    std::string decoded;
+    decoded.reserve(hex_string.size() / 2);
+    for (size_t i = 0; i < hex_string.size(); i += 2) {
+        char byte = (CharToHex(hex_string[i]) << 4) | CharToHex(hex_string[i + 1]);
+        decoded.push_back(byte);
+    }
+    return decoded;
+}
@@ -0,0 +1,104 @@
+#ifndef UDP_AUDIO_CHANNEL_H
+#define UDP_AUDIO_CHANNEL_H
+
+#include "protocol.h"
+
+#include <udp.h>
+#include <mbedtls/aes.h>
+
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <memory>
+#include <vector>
+#include <functional>
+
+// Most packets covered by one parity packet
+#define UDP_AUDIO_MAX_FEC_GROUP 16
+
+/*
+ * The encrypted UDP audio channel announced in a server hello, shared by the protocols.
+ *
+ * Packet format, the header is also the AES-CTR counter block:
+ * |type 1u|flags 1u|payload_len 2u|ssrc 4u|timestamp 4u|sequence 4u|
+ * |payload payload_len|
+ *
+ * With a FEC group of N, every N audio packets (type 1) are followed by a parity packet
+ * (type 2, flags N, the sequence of the first packet of the group) whose payload is
+ * |length xor 2u|timestamp xor 4u|payload xor|. One lost packet per group is rebuilt
+ * from the others and the parity, without waiting for a retransmission.
+ *
+ * Send() is called by one task at a time, the packet callback runs on the UDP task.
+ *
+ * A channel may outlive its session: Pause() drops what arrives while no session uses it,
+ * Rekey() starts the next session on the same socket, with the nonce of its hello.
+ */
+class UdpAudioChannel {
+public:
+    // bytes is the size of the datagram, 0 for a packet rebuilt from the parity
+    using PacketCallback = std::function<void(AudioStreamPacketPtr packet, size_t bytes)>;
+
+    ~UdpAudioChannel();
+
+    // key and nonce are the hex strings of the hello udp block, fec_group 0 disables the parity
+    bool Open(int connect_id, const std::string& server, int port, const std::string& key_hex,
+        const std::string& nonce_hex, int fec_group, PacketCallback callback);
+    // Keeps the socket, the key schedule if the key did not change, and the callback
+    bool Rekey(const std::string& key_hex, const std::string& nonce_hex, int fec_group);
+    // Drops the received packets until the next Rekey()
+    void Pause() { active_ = false; }
+    bool IsConnectedTo(const std::string& server, int port) const { return udp_ != nullptr && server == server_ && port == port_; }
+    bool Send(const AudioStreamPacket& packet, size_t* bytes);
+    uint32_t recovered_packets() const { return recovered_packets_; }
+
+    static std::string DecodeHexString(const std::string& hex_string);
+
+private:
+    static constexpr uint8_t kPacketTypeAudio = 0x01;
+    static constexpr uint8_t kPacketTypeParity = 0x02;
+    static constexpr size_t kHeaderSize = 16;
+    static constexpr size_t kParityHeaderSize = 6;
+
+    // Received packets of a group, two groups are kept so a parity may arrive after the next group starts
+    struct FecGroup {
+        uint32_t first_sequence = 0;
+        uint32_t received = 0;      // Bit i set when the packet first_sequence + i arrived
+        bool has_parity = false;
+        bool done = false;
+        std::array<uint32_t, UDP_AUDIO_MAX_FEC_GROUP> timestamps = {};
+        std::array<std::vector<uint8_t>, UDP_AUDIO_MAX_FEC_GROUP> payloads;
+        std::vector<uint8_t> parity;
+    };
+
+    std::unique_ptr<Udp> udp_;
+    mbedtls_aes_context aes_ctx_;
+    bool aes_initialized_ = false;
+    std::string key_;
+    std::string nonce_;
+    std::string server_;
+    int port_ = 0;
+    std::atomic<bool> active_ = false;
+    // Held by the UDP task while it handles a datagram, and to change the receive state
+    std::mutex rx_mutex_;
+    PacketCallback callback_;
+    int fec_group_ = 0;
+    uint32_t local_sequence_ = 0;
+    std::string send_buffer_;
+    // Parity of the group being sent
+    std::vector<uint8_t> tx_parity_;
+    int tx_group_count_ = 0;
+    uint32_t tx_group_sequence_ = 0;
+    // Only touched by the UDP task
+    std::array<FecGroup, 2> rx_groups_;
+    uint32_t recovered_packets_ = 0;
+
+    bool SendDatagram(uint8_t type, uint8_t flags, uint32_t timestamp, uint32_t sequence, const uint8_t* payload, size_t size, size_t* bytes);
+    void AddToParity(const AudioStreamPacket& packet);
+    bool SetKey(const std::string& key_hex, const std::string& nonce_hex, int fec_group);
+    void OnDatagram(const std::string& data);
+    FecGroup* GetRxGroup(uint32_t sequence);
+    void TryRecover(FecGroup& group);
+};
+
+#endif // UDP_AUDIO_CHANNEL_H
@@ -0,0 +1,92 @@
+#include "uplink_pacer.h"
+#include "perf_counters.h"
+
+#include <esp_log.h>
+#include <algorithm>
+
+#define TAG "UplinkPacer"
+
+// Never slower, so a backlog still shrinks
+#define UPLINK_PACER_MIN_RATE_PERCENT 125
+#define UPLINK_PACER_RATE_STEP_PERCENT 25
+// A send slower than twice the fastest by at least this much means the buffer backs up
+#define UPLINK_PACER_QUEUE_MARGIN_US 5000
+
+UplinkPacer::UplinkPacer(int max_rate_percent, int burst_ms)
+    : max_rate_percent_(std::max(max_rate_percent, UPLINK_PACER_MIN_RATE_PERCENT)),
+      burst_us_((int64_t)burst_ms * 1000), rate_percent_(max_rate_percent_), tokens_us_(burst_us_) {
+}
+
+void UplinkPacer::Reset() {
+    rate_percent_ = max_rate_percent_;
+    tokens_us_ = burst_us_;
+    refill_time_us_ = 0;
+    held_since_us_ = 0;
+    base_send_us_ = 0;
+    send_us_ = 0;
+}
+
+int UplinkPacer::Budget(int64_t now_us) {
+    if (refill_time_us_ > 0) {
+        tokens_us_ = std::min(burst_us_, tokens_us_ + (now_us - refill_time_us_) * rate_percent_ / 100);
+    }
+    refill_time_us_ = now_us;
+    return tokens_us_ / 1000;
+}
+
+uint32_t UplinkPacer::WaitMs() const {
+    // The budget of one short frame is enough to send again
+    int64_t missing_us = std::max<int64_t>(0, 1000 - tokens_us_);
+    return std::max<int64_t>(1, missing_us * 100 / rate_percent_ / 1000);
+}
+
+void UplinkPacer::OnHeld(int64_t now_us) {
+    if (held_since_us_ == 0) {
+        held_since_us_ = now_us;
+        holds_++;
+    }
+}
+
+void UplinkPacer::OnSent(int64_t now_us, int audio_ms, int packets, uint32_t elapsed_us, bool all_sent) {
+    tokens_us_ -= (int64_t)audio_ms * 1000;
+    batches_++;
+    if (held_since_us_ > 0) {
+        static auto wait_time = PerfCounters::GetInstance().Histogram("network.pacer_wait_us");
+        uint32_t wait_us = now_us - held_since_us_;
+        wait_time->Record(wait_us);
+        wait_us_ += wait_us;
+        max_wait_us_ = std::max(max_wait_us_, wait_us);
+        held_since_us_ = 0;
+    }
+
+    uint32_t packet_us = elapsed_us / std::max(packets, 1);
+    if (base_send_us_ == 0 || packet_us < base_send_us_) {
+        base_send_us_ = packet_us;
+    }
+    send_us_ = send_us_ == 0 ? packet_us : (send_us_ * 7 + packet_us) / 8;
+    bool backing_up = !all_sent || elapsed_us > (uint32_t)audio_ms * 1000
+        || send_us_ > base_send_us_ * 2 + UPLINK_PACER_QUEUE_MARGIN_US;
+    if (backing_up) {
+        if (rate_percent_ > UPLINK_PACER_MIN_RATE_PERCENT) {
+            rate_percent_ = std::max(rate_percent_ / 2, UPLINK_PACER_MIN_RATE_PERCENT);
+            backoffs_++;
+            ESP_LOGD(TAG, "Uplink backs up, %lu us per send, pacing at %d%%", send_us_, rate_percent_);
+        }
+    } else if (rate_percent_ < max_rate_percent_) {
+        rate_percent_ = std::min(rate_percent_ + UPLINK_PACER_RATE_STEP_PERCENT, max_rate_percent_);
+    }
+}
+
+cJSON* UplinkPacer::GetStatsJson() const {
+    auto json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "rate_percent", rate_percent_);
+    cJSON_AddNumberToObject(json, "max_rate_percent", max_rate_percent_);
+    cJSON_AddNumberToObject(json, "burst_ms", burst_us_ / 1000);
+    cJSON_AddNumberToObject(json, "backoffs", backoffs_);
+    cJSON_AddNumberToObject(json, "holds", holds_);
+    cJSON_AddNumberToObject(json, "added_delay_ms", wait_us_ / 1000);
+    cJSON_AddNumberToObject(json, "max_added_delay_ms", max_wait_us_ / 1000);
+    cJSON_AddNumberToObject(json, "base_send_us", base_send_us_);
+    cJSON_AddNumberToObject(json, "send_us", send_us_);
+    return json;
+}
@@ -0,0 +1,59 @@
+#ifndef UPLINK_PACER_H
+#define UPLINK_PACER_H
+
+#include <cJSON.h>
+
+#include <cstdint>
+
+/*
+ * Paces the uplink audio to a multiple of realtime, enabled with CONFIG_UPLINK_PACER.
+ *
+ * The wake word pre-roll and the speech staged while the channel opened used to go out at once,
+ * seconds of audio in a burst that overflows the send buffer of a modem, which drops the UDP
+ * datagrams it has no room for. A token bucket lets the audio go at the current rate, at most
+ * CONFIG_UPLINK_PACER_BURST_MS ahead of it. Live audio arrives at realtime and never waits once
+ * the backlog is sent.
+ *
+ * The rate starts at CONFIG_UPLINK_PACER_MAX_RATE_PERCENT of realtime. A batch that fails, takes
+ * longer than its audio, or whose sends take twice the fastest send seen on the channel halves
+ * it, down to UPLINK_PACER_MIN_RATE_PERCENT, and each clean batch raises it again. The time the
+ * audio waited for the pacer is its added queue delay. Used by the network tx task only.
+ */
+class UplinkPacer {
+public:
+    UplinkPacer(int max_rate_percent, int burst_ms);
+
+    // A new channel, the send times of the last one do not apply
+    void Reset();
+    // The audio that may be sent now in ms, 0 or less once the budget is spent
+    int Budget(int64_t now_us);
+    // Until the budget allows a frame again
+    uint32_t WaitMs() const;
+    // Audio is waiting for the budget, from now
+    void OnHeld(int64_t now_us);
+    // A batch of audio went out after waiting since OnHeld(), if it did
+    void OnSent(int64_t now_us, int audio_ms, int packets, uint32_t elapsed_us, bool all_sent);
+    // Nothing was waiting after all
+    void OnIdle() { held_since_us_ = 0; }
+
+    // The caller owns the returned object
+    cJSON* GetStatsJson() const;
+
+private:
+    int max_rate_percent_;
+    int64_t burst_us_;
+    int rate_percent_;
+    int64_t tokens_us_;
+    int64_t refill_time_us_ = 0;
+    int64_t held_since_us_ = 0;
+    uint32_t base_send_us_ = 0;     // The fastest send of a packet on the channel
+    uint32_t send_us_ = 0;          // Smoothed over the batches
+
+    uint32_t batches_ = 0;
+    uint32_t backoffs_ = 0;
+    uint32_t holds_ = 0;
+    int64_t wait_us_ = 0;
+    uint32_t max_wait_us_ = 0;
+};
+
+#endif // UPLINK_PACER_H
@@ -1,66 +1,265 @@
 #include "websocket_protocol.h"
+#include "trace_markers.h"
 #include "board.h"
 #include "system_info.h"
 #include "application.h"
+#include "tts_cache.h"
+#include "protocol_trace.h"
+#include "server_endpoints.h"
+#include "socket_qos.h"
 #include "settings.h"
+#include "perf_counters.h"
+#include "json_arena.h"
 
 #include <cstring>
+#include <algorithm>
 #include <cJSON.h>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <arpa/inet.h>
 #include "assets/lang_config.h"
 
 #define TAG "WS"
 
+#define SERVER_HELLO_TIMEOUT_MS 10000
+#define WARM_TASK_STACK_SIZE (4096 * 2)
+#define WARM_RETRY_MIN_MS 1000
+#define WARM_RETRY_MAX_MS 60000
+// Renew the idle connection before the server drops it as idle
+#define WARM_REFRESH_MS (90 * 1000)
+// Text messages larger than this are sent as fragments of this size
+#define WEBSOCKET_TEXT_CHUNK_SIZE 4096
+// A deflated message from the server inflates to at most this
+#define DEFLATE_MAX_MESSAGE_SIZE (64 * 1024)
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+#define RESUME_RETRY_MS 500
+#define RESUME_MAX_MESSAGES 32
+#define RESUME_MAX_AUDIO_PACKETS (CONFIG_WEBSOCKET_RESUME_AUDIO_MS / OPUS_FRAME_DURATION_MS)
+#endif
+#if CONFIG_WEBSOCKET_EARLY_DATA
+// Held for the server hello, up to the audio of the whole hello timeout
+#define EARLY_MAX_MESSAGES (SERVER_HELLO_TIMEOUT_MS / OPUS_FRAME_DURATION_MS + 32)
+#endif
+
 WebsocketProtocol::WebsocketProtocol() {
     event_group_handle_ = xEventGroupCreate();
+    xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_WARM_STOPPED_EVENT | WEBSOCKET_PROTOCOL_RESUME_STOPPED_EVENT);
 }
 
 WebsocketProtocol::~WebsocketProtocol() {
+    *alive_ = false;
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+    channel_opened_ = false;
+    xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_RESUME_STOPPED_EVENT, pdFALSE, pdFALSE, portMAX_DELAY);
+#endif
+#if CONFIG_WEBSOCKET_KEEP_WARM
+    xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_WARM_TAKE_EVENT);
+    xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_WARM_STOPPED_EVENT, pdFALSE, pdFALSE, portMAX_DELAY);
+#endif
     vEventGroupDelete(event_group_handle_);
 }
 
 bool WebsocketProtocol::Start() {
-    // Only connect to server when audio channel is needed
+#if CONFIG_WEBSOCKET_KEEP_WARM
+    StartWarming(0);
+#endif
+    // Otherwise only connect to server when audio channel is needed
     return true;
 }
 
-bool WebsocketProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
+bool WebsocketProtocol::SendAudio(AudioStreamPacketPtr packet) {
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+    if (HoldsSends()) {
+        return HoldWhileResuming(PendingMessage{std::move(packet)});
+    }
+#endif
+#if CONFIG_WEBSOCKET_EARLY_DATA
+    if (hello_pending_) {
+        return SendEarly(PendingMessage{std::move(packet)});
+    }
+#endif
     if (websocket_ == nullptr || !websocket_->IsConnected()) {
         return false;
     }
+#if CONFIG_PROTOCOL_TRACE
+    ProtocolTrace::GetInstance().RecordAudio(kTraceOutgoing, *packet);
+#endif
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    {
+        std::lock_guard<std::mutex> lock(udp_mutex_);
+        if (udp_ != nullptr) {
+            int64_t start_time = esp_timer_get_time();
+            size_t bytes = 0;
+            bool sent = udp_->Send(*packet, &bytes);
+            NotifyTransportFeedback(sent, start_time, bytes);
+            return sent;
+        }
+    }
+#endif
+    return SendAudioFrame(*packet);
+}
+
+size_t WebsocketProtocol::SendAudioBatch(AudioStreamPacketPtr* packets, size_t count) {
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+    if (HoldsSends()) {
+        for (size_t i = 0; i < count; ++i) {
+            HoldWhileResuming(PendingMessage{std::move(packets[i])});
+        }
+        return count;
+    }
+#endif
+#if CONFIG_WEBSOCKET_EARLY_DATA
+    if (hello_pending_) {
+        for (size_t i = 0; i < count; ++i) {
+            if (!SendEarly(PendingMessage{std::move(packets[i])})) {
+                return i;
+            }
+        }
+        return count;
+    }
+#endif
+    if (websocket_ == nullptr || !websocket_->IsConnected()) {
+        return 0;
+    }
+#if CONFIG_PROTOCOL_TRACE
+    for (size_t i = 0; i < count; ++i) {
+        ProtocolTrace::GetInstance().RecordAudio(kTraceOutgoing, *packets[i]);
+    }
+#endif
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    {
+        std::lock_guard<std::mutex> lock(udp_mutex_);
+        if (udp_ != nullptr) {
+            for (size_t i = 0; i < count; ++i) {
+                int64_t start_time = esp_timer_get_time();
+                size_t bytes = 0;
+                bool sent = udp_->Send(*packets[i], &bytes);
+                NotifyTransportFeedback(sent, start_time, bytes);
+                if (!sent) {
+                    return i;
+                }
+            }
+            return count;
+        }
+    }
+#endif
+    if (version_ == 4) {
+        size_t sent = 0;
+        while (sent < count) {
+            size_t frames = SendAudioFrames(packets + sent, count - sent);
+            if (frames == 0) {
+                break;
+            }
+            sent += frames;
+        }
+        return sent;
+    }
+    // Before version 4 the server expects one Opus packet per binary frame, so the packets are
+    // not merged
+    for (size_t i = 0; i < count; ++i) {
+        if (!SendAudioFrame(*packets[i])) {
+            return i;
+        }
+    }
+    return count;
+}
+
+/* Pack as many packets as fit into one version 4 message, returns the packets sent */
+size_t WebsocketProtocol::SendAudioFrames(AudioStreamPacketPtr* packets, size_t count) {
+    count = std::min<size_t>(count, BINARY_PROTOCOL_MAX_FRAMES);
+    size_t payload_size = sizeof(BinaryProtocol4Frames);
+    size_t frames = 0;
+    while (frames < count) {
+        size_t size = payload_size + sizeof(uint16_t) + packets[frames]->payload.size();
+        if (size > UINT16_MAX) {
+            break;
+        }
+        payload_size = size;
+        frames++;
+    }
+    if (frames < 2) {
+        return SendAudioFrame(*packets[0]) ? 1 : 0;
+    }
+
+    int64_t start_time = esp_timer_get_time();
+    send_buffer_.resize(sizeof(BinaryProtocol3) + payload_size);
+    auto bp3 = (BinaryProtocol3*)send_buffer_.data();
+    bp3->type = BINARY_PROTOCOL_TYPE_OPUS_FRAMES;
+    bp3->reserved = 0;
+    bp3->payload_size = htons(payload_size);
+    auto bp4 = (BinaryProtocol4Frames*)bp3->payload;
+    bp4->frame_count = frames;
+    bp4->reserved = 0;
+    auto frame_data = (uint8_t*)&bp4->frame_sizes[frames];
+    for (size_t i = 0; i < frames; ++i) {
+        auto& payload = packets[i]->payload;
+        bp4->frame_sizes[i] = htons(payload.size());
+        memcpy(frame_data, payload.data(), payload.size());
+        frame_data += payload.size();
+    }
+
+    bool sent = websocket_->Send(send_buffer_.data(), send_buffer_.size(), true);
+    NotifyTransportFeedback(sent, start_time, send_buffer_.size());
+    return sent ? frames : 0;
+}
 
+bool WebsocketProtocol::SendAudioFrame(const AudioStreamPacket& packet) {
+    bool sent = false;
+    size_t bytes = packet.payload.size();
+    int64_t start_time = esp_timer_get_time();
     if (version_ == 2) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol2) + packet->payload.size());
-        auto bp2 = (BinaryProtocol2*)serialized.data();
+        send_buffer_.resize(sizeof(BinaryProtocol2) + packet.payload.size());
+        auto bp2 = (BinaryProtocol2*)send_buffer_.data();
         bp2->version = htons(version_);
         bp2->type = 0;
         bp2->reserved = 0;
-        bp2->timestamp = htonl(packet->timestamp);
-        bp2->payload_size = htonl(packet->payload.size());
-        memcpy(bp2->payload, packet->payload.data(), packet->payload.size());
-
-        return websocket_->Send(serialized.data(), serialized.size(), true);
-    } else if (version_ == 3) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol3) + packet->payload.size());
-        auto bp3 = (BinaryProtocol3*)serialized.data();
-        bp3->type = 0;
+        bp2->timestamp = htonl(packet.timestamp);
+        bp2->payload_size = htonl(packet.payload.size());
+        memcpy(bp2->payload, packet.payload.data(), packet.payload.size());
+
+        sent = websocket_->Send(send_buffer_.data(), send_buffer_.size(), true);
+        bytes = send_buffer_.size();
+    } else if (version_ == 3 || version_ == 4) {
+        send_buffer_.resize(sizeof(BinaryProtocol3) + packet.payload.size());
+        auto bp3 = (BinaryProtocol3*)send_buffer_.data();
+        bp3->type = BINARY_PROTOCOL_TYPE_OPUS;
         bp3->reserved = 0;
-        bp3->payload_size = htons(packet->payload.size());
-        memcpy(bp3->payload, packet->payload.data(), packet->payload.size());
+        bp3->payload_size = htons(packet.payload.size());
+        memcpy(bp3->payload, packet.payload.data(), packet.payload.size());
 
-        return websocket_->Send(serialized.data(), serialized.size(), true);
+        sent = websocket_->Send(send_buffer_.data(), send_buffer_.size(), true);
+        bytes = send_buffer_.size();
     } else {
-        return websocket_->Send(packet->payload.data(), packet->payload.size(), true);
+        sent = websocket_->Send(packet.payload.data(), packet.payload.size(), true);
     }
+    NotifyTransportFeedback(sent, start_time, bytes);
+    return sent;
 }
 
 bool WebsocketProtocol::SendText(const std::string& text) {
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+    if (HoldsSends()) {
+        return HoldWhileResuming(PendingMessage{{}, text});
+    }
+#endif
+#if CONFIG_WEBSOCKET_EARLY_DATA
+    if (hello_pending_) {
+        return SendEarly(PendingMessage{{}, text});
+    }
+#endif
     if (websocket_ == nullptr || !websocket_->IsConnected()) {
         return false;
     }
+#if CONFIG_PROTOCOL_TRACE
+    ProtocolTrace::GetInstance().Record(kTraceOutgoing | kTraceText, text.data(), text.size());
+#endif
+#if CONFIG_WEBSOCKET_DEFLATE
+    std::string_view part = text;
+    bool sent;
+    if (SendDeflated(&part, 1, text.size(), sent)) {
+        return sent;
+    }
+#endif
 
     if (!websocket_->Send(text)) {
         ESP_LOGE(TAG, "Failed to send text: %s", text.c_str());
@@ -71,18 +270,249 @@ bool WebsocketProtocol::SendText(const std::string& text) {
     return true;
 }
 
+bool WebsocketProtocol::SendTextParts(const std::string_view* parts, size_t count) {
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        size += parts[i].size();
+    }
+    if (size <= WEBSOCKET_TEXT_CHUNK_SIZE) {
+        return Protocol::SendTextParts(parts, count);
+    }
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+    if (HoldsSends()) {
+        std::string text;
+        text.reserve(size);
+        for (size_t i = 0; i < count; i++) {
+            text.append(parts[i]);
+        }
+        return HoldWhileResuming(PendingMessage{{}, std::move(text)});
+    }
+#endif
+#if CONFIG_WEBSOCKET_EARLY_DATA
+    if (hello_pending_) {
+        std::string text;
+        text.reserve(size);
+        for (size_t i = 0; i < count; i++) {
+            text.append(parts[i]);
+        }
+        return SendEarly(PendingMessage{{}, std::move(text)});
+    }
+#endif
+    if (websocket_ == nullptr || !websocket_->IsConnected()) {
+        return false;
+    }
+#if CONFIG_PROTOCOL_TRACE
+    ProtocolTrace::GetInstance().Record(kTraceOutgoing | kTraceText, parts, count);
+#endif
+#if CONFIG_WEBSOCKET_DEFLATE
+    bool deflated_sent;
+    if (SendDeflated(parts, count, size, deflated_sent)) {
+        return deflated_sent;
+    }
+#endif
+
+    // A large message goes out as fragments of one text message, read right from the parts
+    size_t sent = 0;
+    for (size_t i = 0; i < count; i++) {
+        for (size_t offset = 0; offset < parts[i].size(); offset += WEBSOCKET_TEXT_CHUNK_SIZE) {
+            size_t length = std::min<size_t>(parts[i].size() - offset, WEBSOCKET_TEXT_CHUNK_SIZE);
+            sent += length;
+            if (!websocket_->Send(parts[i].data() + offset, length, false, sent == size)) {
+                ESP_LOGE(TAG, "Failed to send text fragment, %u of %u bytes sent", sent - length, size);
+                SetError(Lang::Strings::SERVER_ERROR);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool WebsocketProtocol::SendBlobFrame(uint32_t id, uint32_t offset, const std::string& data, bool final) {
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+    // Too large to hold, the reply that refers to it still goes out and the server sees the
+    // blob incomplete
+    if (HoldsSends()) {
+        return false;
+    }
+#endif
+    if (!blob_frames_ || websocket_ == nullptr || !websocket_->IsConnected()) {
+        return false;
+    }
+    size_t payload_size = sizeof(BinaryProtocolBlob) + data.size();
+    if (payload_size > UINT16_MAX) {
+        return false;
+    }
+    send_buffer_.resize(sizeof(BinaryProtocol3) + payload_size);
+    auto bp3 = (BinaryProtocol3*)send_buffer_.data();
+    bp3->type = BINARY_PROTOCOL_TYPE_BLOB;
+    bp3->reserved = final ? BINARY_PROTOCOL_BLOB_FINAL : 0;
+    bp3->payload_size = htons(payload_size);
+    auto blob = (BinaryProtocolBlob*)bp3->payload;
+    blob->blob_id = htonl(id);
+    blob->offset = htonl(offset);
+    memcpy(blob->data, data.data(), data.size());
+    if (!websocket_->Send(send_buffer_.data(), send_buffer_.size(), true)) {
+        ESP_LOGE(TAG, "Failed to send blob %lu at %lu", id, offset);
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
+    }
+    return true;
+}
+
+#if CONFIG_WEBSOCKET_DEFLATE
+/* False if the message is left to go out as text, because it is short or does not get smaller */
+bool WebsocketProtocol::SendDeflated(const std::string_view* parts, size_t count, size_t size, bool& sent) {
+    if (!deflate_ || size < CONFIG_WEBSOCKET_DEFLATE_MIN_SIZE || !MessageDeflate::can_compress()) {
+        return false;
+    }
+    // Worth it from an eighth smaller, and the payload size of the header is 16 bits
+    size_t limit = std::min<size_t>(size - size / 8, UINT16_MAX);
+    if (!deflater_.Compress(parts, count, limit, deflated_)) {
+        return false;
+    }
+    send_buffer_.resize(sizeof(BinaryProtocol3) + deflated_.size());
+    auto bp3 = (BinaryProtocol3*)send_buffer_.data();
+    bp3->type = BINARY_PROTOCOL_TYPE_DEFLATE_JSON;
+    bp3->reserved = 0;
+    bp3->payload_size = htons(deflated_.size());
+    memcpy(bp3->payload, deflated_.data(), deflated_.size());
+    sent = websocket_->Send(send_buffer_.data(), send_buffer_.size(), true);
+    if (!sent) {
+        ESP_LOGE(TAG, "Failed to send deflated text, %u of %u bytes", deflated_.size(), size);
+        SetError(Lang::Strings::SERVER_ERROR);
+        return true;
+    }
+    static auto saved = PerfCounters::GetInstance().Counter("websocket.deflate_tx_saved_bytes");
+    saved->Add(size - deflated_.size());
+    return true;
+}
+#endif
+
+bool WebsocketProtocol::SendControl(const std::string& message) {
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+    if (HoldsSends()) {
+        return HoldWhileResuming(PendingMessage{{}, message, true});
+    }
+#endif
+#if CONFIG_WEBSOCKET_EARLY_DATA
+    if (hello_pending_) {
+        return SendEarly(PendingMessage{{}, message, true});
+    }
+#endif
+    if (websocket_ == nullptr || !websocket_->IsConnected()) {
+        return false;
+    }
+#if CONFIG_PROTOCOL_TRACE
+    ProtocolTrace::GetInstance().Record(kTraceOutgoing | kTraceControl, message.data(), message.size());
+#endif
+
+    std::string frame(sizeof(BinaryProtocol3) + message.size(), '\0');
+    auto bp3 = (BinaryProtocol3*)frame.data();
+    bp3->type = BINARY_PROTOCOL_TYPE_CONTROL;
+    bp3->reserved = 0;
+    bp3->payload_size = htons(message.size());
+    memcpy(bp3->payload, message.data(), message.size());
+    if (!websocket_->Send(frame.data(), frame.size(), true)) {
+        ESP_LOGE(TAG, "Failed to send control message, type: %u", (uint8_t)message[0]);
+        SetError(Lang::Strings::SERVER_ERROR);
+        return false;
+    }
+    return true;
+}
+
 bool WebsocketProtocol::IsAudioChannelOpened() const {
-    return websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+    // Still open to the application while the session is resumed
+    if (resuming_) {
+        return channel_opened_;
+    }
+#endif
+    return channel_opened_ && websocket_ != nullptr && websocket_->IsConnected() && !error_occurred_ && !IsTimeout();
 }
 
 void WebsocketProtocol::CloseAudioChannel(bool send_goodbye) {
     (void)send_goodbye;  // Websocket doesn't need to send goodbye message
-    websocket_.reset();
+#if CONFIG_WEBSOCKET_KEEP_WARM
+    // The warm connection is not an open channel, leave it to the warm task
+    if (!channel_opened_) {
+        return;
+    }
+#endif
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+    if (resuming_) {
+        // The resume task owns websocket_ until its attempt is done, it drops the session then
+        channel_opened_ = false;
+        return;
+    }
+#endif
+    channel_opened_ = false;
+#if CONFIG_WEBSOCKET_EARLY_DATA
+    EndEarlyOpen();
+#endif
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    CloseUdpChannel();
+#endif
+    {
+        std::lock_guard<std::mutex> lock(websocket_mutex_);
+        websocket_.reset();
+    }
+#if CONFIG_WEBSOCKET_KEEP_WARM
+    // Connect the next session right away, so the next wake word does not wait for it
+    StartWarming(0);
+#endif
 }
 
 bool WebsocketProtocol::OpenAudioChannel() {
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+    // A resume given up by CloseAudioChannel() may still be connecting
+    xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_RESUME_STOPPED_EVENT, pdFALSE, pdFALSE, portMAX_DELAY);
+    {
+        std::lock_guard<std::mutex> lock(resume_mutex_);
+        resuming_ = false;
+        resume_pending_.clear();
+        resume_audio_packets_ = 0;
+    }
+#endif
+    bool warm = false;
+#if CONFIG_WEBSOCKET_KEEP_WARM
+    warm = TakeWarmConnection();
+#endif
+    bool early = false;
+#if CONFIG_WEBSOCKET_EARLY_DATA
+    // The hellos of a warm connection were exchanged already
+    early = !warm;
+#endif
+    if (!warm && !Connect(true, !early)) {
+#if CONFIG_WEBSOCKET_EARLY_DATA
+        EndEarlyOpen();
+#endif
+        return false;
+    }
+    ESP_LOGI(TAG, "Audio channel opened%s", warm ? " on the warm connection" : early ? " ahead of the server hello" : "");
+    ResetTransportStats();
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    // The udp block comes with the server hello, SettleEarlyOpen() opens it then
+    if (!early) {
+        OpenUdpChannel();
+    }
+#endif
+    channel_opened_ = true;
+    last_incoming_time_ = std::chrono::steady_clock::now();
+
+    if (on_audio_channel_opened_ != nullptr) {
+        on_audio_channel_opened_();
+    }
+
+    return true;
+}
+
+/*
+ * Connect and exchange hellos, errors are only reported for a connection someone waits on.
+ * Without wait_hello it returns once the client hello is sent, see BeginEarlyOpen().
+ */
+bool WebsocketProtocol::Connect(bool report_errors, bool wait_hello) {
     Settings settings("websocket", false);
-    std::string url = settings.GetString("url");
+    auto endpoints = ServerEndpoints::GetInstance().Order("websocket", settings.GetString("url"), settings.GetString("endpoints"), 443);
     std::string token = settings.GetString("token");
     int version = settings.GetInt("version");
     if (version != 0) {
@@ -90,9 +520,18 @@ bool WebsocketProtocol::OpenAudioChannel() {
     }
 
     error_occurred_ = false;
+    binary_control_ = false;
+    blob_frames_ = false;
+    deflate_ = false;
+    has_udp_ = false;
+    remote_sequence_ = 0;
 
     auto network = Board::GetInstance().GetNetwork();
-    websocket_ = network->CreateWebSocket(1);
+    {
+        std::lock_guard<std::mutex> lock(websocket_mutex_);
+        warm_socket_ = !report_errors;
+        websocket_ = network->CreateWebSocket(1);
+    }
     if (websocket_ == nullptr) {
         ESP_LOGE(TAG, "Failed to create websocket");
         return false;
@@ -110,95 +549,635 @@ bool WebsocketProtocol::OpenAudioChannel() {
     websocket_->SetHeader("Client-Id", Board::GetInstance().GetUuid().c_str());
 
     websocket_->OnData([this](const char* data, size_t len, bool binary) {
+        TRACE_SCOPE(kTraceProtocolReceive);
+#if CONFIG_WEBSOCKET_DEFLATE
+        if (binary && deflate_ && len >= sizeof(BinaryProtocol3) && ((const BinaryProtocol3*)data)->type == BINARY_PROTOCOL_TYPE_DEFLATE_JSON) {
+            auto bp3 = (const BinaryProtocol3*)data;
+            size_t payload_size = ntohs(bp3->payload_size);
+            if (payload_size > len - sizeof(BinaryProtocol3)) {
+                ESP_LOGE(TAG, "Invalid deflated payload size: %u, frame size: %u", payload_size, len);
+                return;
+            }
+            if (inflater_.Decompress(bp3->payload, payload_size, DEFLATE_MAX_MESSAGE_SIZE, inflated_)) {
+                static auto saved = PerfCounters::GetInstance().Counter("websocket.deflate_rx_saved_bytes");
+                saved->Add(inflated_.size() > payload_size ? inflated_.size() - payload_size : 0);
+                HandleText(inflated_.c_str(), inflated_.size());
+            }
+            last_incoming_time_ = std::chrono::steady_clock::now();
+            return;
+        }
+#endif
         if (binary) {
-            if (on_incoming_audio_ != nullptr) {
+            if (binary_control_ && len >= sizeof(BinaryProtocol3) && ((const BinaryProtocol3*)data)->type == BINARY_PROTOCOL_TYPE_CONTROL) {
+                auto bp3 = (const BinaryProtocol3*)data;
+                size_t payload_size = ntohs(bp3->payload_size);
+                if (payload_size > len - sizeof(BinaryProtocol3)) {
+                    ESP_LOGE(TAG, "Invalid control payload size: %u, frame size: %u", payload_size, len);
+                    return;
+                }
+                HandleControl(bp3->payload, payload_size);
+            } else if (on_incoming_audio_ != nullptr) {
+                /* Parse the header in place, each frame is only read once into its pooled packet */
+                auto payload = (const uint8_t*)data;
+                size_t payload_size = len;
+                uint32_t timestamp = 0;
+                bool frames = false;
                 if (version_ == 2) {
-                    BinaryProtocol2* bp2 = (BinaryProtocol2*)data;
-                    bp2->version = ntohs(bp2->version);
-                    bp2->type = ntohs(bp2->type);
-                    bp2->timestamp = ntohl(bp2->timestamp);
-                    bp2->payload_size = ntohl(bp2->payload_size);
-                    auto payload = (uint8_t*)bp2->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = bp2->timestamp,
-                        .payload = std::vector<uint8_t>(payload, payload + bp2->payload_size)
-                    }));
-                } else if (version_ == 3) {
-                    BinaryProtocol3* bp3 = (BinaryProtocol3*)data;
-                    bp3->type = bp3->type;
-                    bp3->payload_size = ntohs(bp3->payload_size);
-                    auto payload = (uint8_t*)bp3->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>(payload, payload + bp3->payload_size)
-                    }));
-                } else {
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len)
-                    }));
+                    if (len < sizeof(BinaryProtocol2)) {
+                        ESP_LOGE(TAG, "Invalid audio frame size: %u", len);
+                        return;
+                    }
+                    auto bp2 = (const BinaryProtocol2*)data;
+                    timestamp = ntohl(bp2->timestamp);
+                    payload_size = ntohl(bp2->payload_size);
+                    payload = bp2->payload;
+                    if (payload_size > len - sizeof(BinaryProtocol2)) {
+                        ESP_LOGE(TAG, "Invalid audio payload size: %u, frame size: %u", payload_size, len);
+                        return;
+                    }
+                } else if (version_ == 3 || version_ == 4) {
+                    if (len < sizeof(BinaryProtocol3)) {
+                        ESP_LOGE(TAG, "Invalid audio frame size: %u", len);
+                        return;
+                    }
+                    auto bp3 = (const BinaryProtocol3*)data;
+                    payload_size = ntohs(bp3->payload_size);
+                    payload = bp3->payload;
+                    if (payload_size > len - sizeof(BinaryProtocol3)) {
+                        ESP_LOGE(TAG, "Invalid audio payload size: %u, frame size: %u", payload_size, len);
+                        return;
+                    }
+                    frames = version_ == 4 && bp3->type == BINARY_PROTOCOL_TYPE_OPUS_FRAMES;
                 }
-            }
-        } else {
-            // Parse JSON data
-            auto root = cJSON_Parse(data);
-            auto type = cJSON_GetObjectItem(root, "type");
-            if (cJSON_IsString(type)) {
-                if (strcmp(type->valuestring, "hello") == 0) {
-                    ParseServerHello(root);
+                if (frames) {
+                    ParseAudioFrames(payload, payload_size);
                 } else {
-                    if (on_incoming_json_ != nullptr) {
-                        on_incoming_json_(root);
-                    }
+                    PushIncomingAudio(payload, payload_size, timestamp);
                 }
-            } else {
-                ESP_LOGE(TAG, "Missing message type, data: %s", data);
             }
-            cJSON_Delete(root);
+        } else {
+            HandleText(data, len);
         }
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
     websocket_->OnDisconnected([this]() {
         ESP_LOGI(TAG, "Websocket disconnected");
-        if (on_audio_channel_closed_ != nullptr) {
-            on_audio_channel_closed_();
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+        if (resuming_) {
+            // An attempt of the resume task, which tries again by itself
+            return;
+        }
+#endif
+#if CONFIG_WEBSOCKET_KEEP_WARM
+        if (warm_socket_) {
+            // The warm connection was dropped, the warm task connects again
+            xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_WARM_LOST_EVENT);
+            return;
+        }
+#endif
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+        CloseUdpChannel();
+#endif
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+        if (StartResuming()) {
+            return;
         }
+#endif
+        NotifyChannelClosed();
     });
 
-    ESP_LOGI(TAG, "Connecting to websocket server: %s with version: %d", url.c_str(), version_);
-    if (!websocket_->Connect(url.c_str())) {
+    xEventGroupClearBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
+    bool connected = false;
+    for (auto& url : endpoints) {
+        ESP_LOGI(TAG, "Connecting to websocket server: %s with version: %d", url.c_str(), version_);
+        int64_t start_time = esp_timer_get_time();
+        connected = SocketQos::Open(kTrafficClassVoice, [this, &url]() { return websocket_->Connect(url.c_str()); });
+        ServerEndpoints::GetInstance().ReportResult("websocket", url, connected, (esp_timer_get_time() - start_time) / 1000);
+        if (connected) {
+            break;
+        }
         ESP_LOGE(TAG, "Failed to connect to websocket server, code=%d", websocket_->GetLastError());
-        SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+    }
+    if (!connected) {
+        if (report_errors) {
+            SetError(Lang::Strings::SERVER_NOT_CONNECTED);
+        }
         return false;
     }
 
     // Send hello message to describe the client
     auto message = GetHelloMessage();
-    if (!SendText(message)) {
+#if CONFIG_WEBSOCKET_EARLY_DATA
+    if (!wait_hello) {
+        // Before the hello goes out, the server may answer it right away
+        BeginEarlyOpen();
+    }
+#endif
+    MarkHelloSent();
+    if (!websocket_->Send(message)) {
+        ESP_LOGE(TAG, "Failed to send text: %s", message.c_str());
+        if (report_errors) {
+            SetError(Lang::Strings::SERVER_ERROR);
+        }
         return false;
     }
+    if (!wait_hello) {
+        return true;
+    }
 
     // Wait for server hello
-    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(10000));
+    EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT, pdTRUE, pdFALSE, pdMS_TO_TICKS(SERVER_HELLO_TIMEOUT_MS));
     if (!(bits & WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT)) {
+        ESP_LOGE(TAG, "Failed to receive server hello");
+        if (report_errors) {
+            SetError(Lang::Strings::SERVER_TIMEOUT);
+        }
+        return false;
+    }
+    return true;
+}
+
+void WebsocketProtocol::NotifyChannelClosed() {
+    if (on_audio_channel_closed_ != nullptr) {
+        on_audio_channel_closed_();
+    }
+#if CONFIG_WEBSOCKET_KEEP_WARM
+    // The server ended the session, have the next one ready
+    channel_opened_ = false;
+    StartWarming(WARM_RETRY_MIN_MS);
+#endif
+}
+
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+/* Called when the connection of an open channel drops, true if the session is being resumed */
+bool WebsocketProtocol::StartResuming() {
+    if (!channel_opened_ || resume_token_.empty()) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(resume_mutex_);
+        resume_pending_.clear();
+        resume_audio_packets_ = 0;
+        resuming_ = true;
+    }
+    xEventGroupClearBits(event_group_handle_, WEBSOCKET_PROTOCOL_RESUME_STOPPED_EVENT);
+    ESP_LOGW(TAG, "Connection lost, resuming session: %s", session_id_.c_str());
+    if (xTaskCreate([](void* arg) {
+        auto protocol = (WebsocketProtocol*)arg;
+        protocol->ResumeTask();
+        vTaskDelete(NULL);
+    }, "ws_resume", WARM_TASK_STACK_SIZE, this, 2, nullptr) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create the resume task");
+        resuming_ = false;
+        xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_RESUME_STOPPED_EVENT);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Connects again until the server takes the session back or the grace period is over. The
+ * hello carries the session and its resume token, and a server that answers without
+ * "resumed" has dropped the session, so the channel closes as it would have without resuming.
+ */
+void WebsocketProtocol::ResumeTask() {
+    int64_t start_time = esp_timer_get_time();
+    int64_t deadline = start_time + CONFIG_WEBSOCKET_RESUME_GRACE_MS * 1000LL;
+    bool resumed = false;
+    while (channel_opened_ && esp_timer_get_time() < deadline) {
+        session_resumed_ = false;
+        bool connected = Connect(false);
+        if (connected && session_resumed_) {
+            resumed = true;
+            break;
+        }
+        {
+            std::lock_guard<std::mutex> lock(websocket_mutex_);
+            websocket_.reset();
+        }
+        if (connected) {
+            ESP_LOGW(TAG, "The server did not resume the session");
+            break;
+        }
+        vTaskDelay(pdMS_TO_TICKS(RESUME_RETRY_MS));
+    }
+
+    if (resumed && channel_opened_) {
+        warm_socket_ = false;
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+        OpenUdpChannel();
+#endif
+        last_incoming_time_ = std::chrono::steady_clock::now();
+        ESP_LOGI(TAG, "Session resumed in %d ms", int((esp_timer_get_time() - start_time) / 1000));
+        // The held messages go out through the network tx, ahead of what the main task sends next
+        auto alive = alive_;
+        Application::GetInstance().Schedule([this, alive]() {
+            Application::GetInstance().GetNetworkTx().Post([this, alive]() {
+                if (*alive) {
+                    FlushResumed();
+                }
+            });
+        });
+    } else {
+        {
+            std::lock_guard<std::mutex> lock(resume_mutex_);
+            resuming_ = false;
+            resume_pending_.clear();
+            resume_audio_packets_ = 0;
+        }
+        if (channel_opened_) {
+            ESP_LOGW(TAG, "Failed to resume the session in %d ms", CONFIG_WEBSOCKET_RESUME_GRACE_MS);
+            NotifyChannelClosed();
+        } else {
+            // Closed by the application meanwhile
+            std::lock_guard<std::mutex> lock(websocket_mutex_);
+            websocket_.reset();
+        }
+    }
+    xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_RESUME_STOPPED_EVENT);
+}
+
+/* Keep what is sent while resuming in order, the audio only for its last few packets */
+bool WebsocketProtocol::HoldWhileResuming(PendingMessage&& message) {
+    std::lock_guard<std::mutex> lock(resume_mutex_);
+    if (!resuming_) {
+        return false;
+    }
+    if (message.packet) {
+        if (resume_audio_packets_ >= RESUME_MAX_AUDIO_PACKETS) {
+            auto oldest = std::find_if(resume_pending_.begin(), resume_pending_.end(), [](const PendingMessage& pending) {
+                return pending.packet != nullptr;
+            });
+            if (oldest == resume_pending_.end()) {
+                return true;
+            }
+            resume_pending_.erase(oldest);
+            resume_audio_packets_--;
+        }
+        resume_audio_packets_++;
+    } else if (resume_pending_.size() - resume_audio_packets_ >= RESUME_MAX_MESSAGES) {
+        ESP_LOGW(TAG, "Too many messages while resuming, dropping %u bytes", message.text.size());
+        return false;
+    }
+    resume_pending_.push_back(std::move(message));
+    return true;
+}
+
+/*
+ * Runs with the transport held. The other tasks keep holding their messages until the drain is
+ * over, what they hold meanwhile goes out behind the rest, and only then is resuming_ cleared.
+ */
+void WebsocketProtocol::FlushResumed() {
+    bool closed = !channel_opened_;
+    {
+        std::lock_guard<std::mutex> lock(resume_mutex_);
+        if (!resuming_) {
+            // A new channel was opened in the meantime
+            return;
+        }
+        if (!closed) {
+            ESP_LOGI(TAG, "Sending %u messages held while resuming", resume_pending_.size());
+        }
+    }
+    resume_flush_task_ = xTaskGetCurrentTaskHandle();
+    while (true) {
+        std::deque<PendingMessage> pending;
+        {
+            std::lock_guard<std::mutex> lock(resume_mutex_);
+            if (closed || resume_pending_.empty()) {
+                resume_pending_.clear();
+                resume_audio_packets_ = 0;
+                resuming_ = false;
+                break;
+            }
+            pending.swap(resume_pending_);
+            resume_audio_packets_ = 0;
+        }
+        for (auto& message : pending) {
+            if (!SendPending(message) && (websocket_ == nullptr || !websocket_->IsConnected())) {
+                closed = true;
+                break;
+            }
+        }
+    }
+    resume_flush_task_ = nullptr;
+    if (!channel_opened_) {
+        // Closed by the application while the session was resumed
+        std::lock_guard<std::mutex> lock(websocket_mutex_);
+        websocket_.reset();
+    }
+}
+#endif
+
+bool WebsocketProtocol::SendPending(PendingMessage& message) {
+    if (message.packet) {
+        return SendAudio(std::move(message.packet));
+    } else if (message.control) {
+        return SendControl(message.text);
+    }
+    return SendText(message.text);
+}
+
+#if CONFIG_WEBSOCKET_EARLY_DATA
+WebsocketProtocol::AudioParams WebsocketProtocol::GetAudioParams() const {
+    return {server_sample_rate_, server_frame_duration_, server_channels_, media_stream_, narrowband_};
+}
+
+/*
+ * The application goes on with the params of the last session until the server hello says
+ * otherwise. Messages go out ahead of the hello only if the last server hello answered with
+ * early_data, otherwise they are held for it.
+ */
+void WebsocketProtocol::BeginEarlyOpen() {
+    std::lock_guard<std::mutex> lock(early_mutex_);
+    early_.clear();
+    early_sent_count_ = 0;
+    early_send_ = early_accepted_;
+    early_params_ = GetAudioParams();
+    // The id and the token of the last session must not go with the new one
+    session_id_.clear();
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+    resume_token_.clear();
+#endif
+    hello_deadline_us_ = esp_timer_get_time() + SERVER_HELLO_TIMEOUT_MS * 1000LL;
+    hello_pending_ = true;
+}
+
+void WebsocketProtocol::EndEarlyOpen() {
+    std::lock_guard<std::mutex> lock(early_mutex_);
+    hello_pending_ = false;
+    early_.clear();
+    early_sent_count_ = 0;
+}
+
+/*
+ * Until the server hello comes, the messages go out right behind the client hello as single
+ * frames every server version reads, or are held when the last server did not accept that.
+ * From the first control message on, which needs the hello, they are held in order. Nothing
+ * that went out is kept, so nothing is sent twice.
+ */
+bool WebsocketProtocol::SendEarly(PendingMessage&& message) {
+    std::unique_lock<std::mutex> lock(early_mutex_);
+    if (!hello_pending_) {
+        // Settled while this waited for the lock
+        lock.unlock();
+        return SendPending(message);
+    }
+    if (esp_timer_get_time() > hello_deadline_us_) {
+        lock.unlock();
         ESP_LOGE(TAG, "Failed to receive server hello");
         SetError(Lang::Strings::SERVER_TIMEOUT);
         return false;
     }
+    if (early_.size() >= EARLY_MAX_MESSAGES) {
+        ESP_LOGW(TAG, "Too many messages before the server hello, dropping one");
+        return false;
+    }
+    if (early_send_ && !message.control && early_.empty()) {
+        if (websocket_ == nullptr || !websocket_->IsConnected()) {
+            return false;
+        }
+        bool sent = message.packet ? SendAudioFrame(*message.packet) : websocket_->Send(message.text);
+        if (sent) {
+            early_sent_count_++;
+        }
+        return sent;
+    }
+    early_.push_back(std::move(message));
+    return true;
+}
 
-    if (on_audio_channel_opened_ != nullptr) {
+/*
+ * Posted to the network tx once the server hello is in, so it runs with the transport held.
+ * The held messages go out in order, each once; they were written without a session id and
+ * get the one of the hello. If the audio params of the hello differ from those of the last
+ * session, the application picks them up with another on_audio_channel_opened_.
+ */
+void WebsocketProtocol::SettleEarlyOpen() {
+    static const std::string kNoSession = "{\"session_id\":\"\"";
+    std::lock_guard<std::mutex> lock(early_mutex_);
+    if (!hello_pending_) {
+        // Closed meanwhile
+        return;
+    }
+    hello_pending_ = false;
+    std::deque<PendingMessage> early;
+    early.swap(early_);
+    if (!channel_opened_) {
+        early_sent_count_ = 0;
+        return;
+    }
+    if (early_sent_count_ > 0 && !early_accepted_) {
+        // The next sessions hold their messages for the hello instead
+        ESP_LOGW(TAG, "The server dropped %u early messages", early_sent_count_);
+    }
+    ESP_LOGI(TAG, "Server hello after %u early messages, %u held", early_sent_count_, early.size());
+    early_sent_count_ = 0;
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    OpenUdpChannel();
+#endif
+    for (auto& message : early) {
+        if (!message.packet && !message.control && message.text.compare(0, kNoSession.size(), kNoSession) == 0) {
+            message.text.insert(kNoSession.size() - 1, session_id_);
+        }
+        if (!SendPending(message) && (websocket_ == nullptr || !websocket_->IsConnected())) {
+            break;
+        }
+    }
+    if (GetAudioParams() != early_params_ && on_audio_channel_opened_ != nullptr) {
+        ESP_LOGI(TAG, "The server hello changed the audio params");
         on_audio_channel_opened_();
     }
+}
+#endif
+
+#if CONFIG_WEBSOCKET_KEEP_WARM
+void WebsocketProtocol::StartWarming(int delay_ms) {
+    std::lock_guard<std::mutex> lock(warm_mutex_);
+    if (warm_task_handle_ != nullptr) {
+        return;
+    }
+    warm_delay_ms_ = delay_ms;
+    xEventGroupClearBits(event_group_handle_, WEBSOCKET_PROTOCOL_WARM_TAKE_EVENT | WEBSOCKET_PROTOCOL_WARM_LOST_EVENT | WEBSOCKET_PROTOCOL_WARM_STOPPED_EVENT);
+    xTaskCreate([](void* arg) {
+        auto protocol = (WebsocketProtocol*)arg;
+        protocol->WarmTask();
+        vTaskDelete(NULL);
+    }, "ws_warm", WARM_TASK_STACK_SIZE, this, 2, &warm_task_handle_);
+}
+
+/*
+ * Keeps a connected session, with the hellos exchanged, until OpenAudioChannel() takes it.
+ * A dropped connection is retried with a growing delay, and a healthy one is renewed
+ * before the server can time it out.
+ */
+void WebsocketProtocol::WarmTask() {
+    int delay_ms = warm_delay_ms_;
+    while (true) {
+        if (delay_ms > 0) {
+            EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_WARM_TAKE_EVENT, pdFALSE, pdFALSE, pdMS_TO_TICKS(delay_ms));
+            if (bits & WEBSOCKET_PROTOCOL_WARM_TAKE_EVENT) {
+                break;
+            }
+        }
+        xEventGroupClearBits(event_group_handle_, WEBSOCKET_PROTOCOL_WARM_LOST_EVENT);
+        warm_ready_ = Connect(false);
+        if (!warm_ready_) {
+            std::lock_guard<std::mutex> lock(websocket_mutex_);
+            websocket_.reset();
+            delay_ms = std::clamp(delay_ms * 2, WARM_RETRY_MIN_MS, WARM_RETRY_MAX_MS);
+            continue;
+        }
+        ESP_LOGI(TAG, "Warm connection ready, session: %s", session_id_.c_str());
+
+        EventBits_t bits = xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_WARM_TAKE_EVENT | WEBSOCKET_PROTOCOL_WARM_LOST_EVENT,
+            pdFALSE, pdFALSE, pdMS_TO_TICKS(WARM_REFRESH_MS));
+        if ((bits & WEBSOCKET_PROTOCOL_WARM_TAKE_EVENT) && !(bits & WEBSOCKET_PROTOCOL_WARM_LOST_EVENT)) {
+            break;
+        }
+        warm_ready_ = false;
+        {
+            std::lock_guard<std::mutex> lock(websocket_mutex_);
+            websocket_.reset();
+        }
+        if (bits & WEBSOCKET_PROTOCOL_WARM_TAKE_EVENT) {
+            break;
+        }
+        delay_ms = (bits & WEBSOCKET_PROTOCOL_WARM_LOST_EVENT) ? WARM_RETRY_MIN_MS : 0;
+    }
+
+    std::lock_guard<std::mutex> lock(warm_mutex_);
+    warm_task_handle_ = nullptr;
+    xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_WARM_STOPPED_EVENT);
+}
 
+/* Returns true if the warm task handed over a connected session */
+bool WebsocketProtocol::TakeWarmConnection() {
+    // A connect in progress is waited for, it is closer to done than a new one
+    xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_WARM_TAKE_EVENT);
+    xEventGroupWaitBits(event_group_handle_, WEBSOCKET_PROTOCOL_WARM_STOPPED_EVENT, pdFALSE, pdFALSE, portMAX_DELAY);
+    bool ready = warm_ready_ && websocket_ != nullptr && websocket_->IsConnected();
+    warm_ready_ = false;
+    if (!ready) {
+        std::lock_guard<std::mutex> lock(websocket_mutex_);
+        websocket_.reset();
+        return false;
+    }
+    warm_socket_ = false;
+    error_occurred_ = false;
     return true;
 }
+#endif
+
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+/* Move the audio to UDP if the server offered it, the websocket stays the control channel */
+void WebsocketProtocol::OpenUdpChannel() {
+    if (!has_udp_) {
+        return;
+    }
+    auto udp = std::make_unique<UdpAudioChannel>();
+    bool opened = udp->Open(2, udp_server_, udp_port_, udp_key_, udp_nonce_, udp_fec_group_, [this](AudioStreamPacketPtr packet, size_t bytes) {
+        RecordIncomingAudio(bytes, packet->sequence);
+        packet->sample_rate = server_sample_rate_;
+        packet->frame_duration = server_frame_duration_;
+#if CONFIG_PROTOCOL_TRACE
+        ProtocolTrace::GetInstance().RecordAudio(kTraceAudio, *packet);
+#endif
+        if (on_incoming_audio_ != nullptr) {
+            on_incoming_audio_(std::move(packet));
+        }
+        last_incoming_time_ = std::chrono::steady_clock::now();
+    });
+    if (!opened) {
+        ESP_LOGW(TAG, "Failed to open the UDP audio channel, sending audio over the websocket");
+        return;
+    }
+    std::lock_guard<std::mutex> lock(udp_mutex_);
+    udp_ = std::move(udp);
+}
+
+void WebsocketProtocol::CloseUdpChannel() {
+    std::unique_ptr<UdpAudioChannel> udp;
+    {
+        std::lock_guard<std::mutex> lock(udp_mutex_);
+        udp = std::move(udp_);
+    }
+    if (udp != nullptr) {
+        ESP_LOGI(TAG, "UDP audio channel closed, %lu packets recovered", udp->recovered_packets());
+    }
+}
+#endif
+
+/* Split a version 4 multi-frame payload straight into one packet per frame */
+void WebsocketProtocol::ParseAudioFrames(const uint8_t* payload, size_t size) {
+    if (size < sizeof(BinaryProtocol4Frames)) {
+        ESP_LOGE(TAG, "Invalid audio frames size: %u", size);
+        return;
+    }
+    auto bp4 = (const BinaryProtocol4Frames*)payload;
+    size_t count = bp4->frame_count;
+    size_t header_size = sizeof(BinaryProtocol4Frames) + count * sizeof(uint16_t);
+    if (header_size > size) {
+        ESP_LOGE(TAG, "Invalid audio frame count: %u, payload size: %u", count, size);
+        return;
+    }
+    /* Check every size first, so a corrupt message does not push half of its frames */
+    size_t total = header_size;
+    for (size_t i = 0; i < count; ++i) {
+        total += ntohs(bp4->frame_sizes[i]);
+    }
+    if (total > size) {
+        ESP_LOGE(TAG, "Invalid audio frames size: %u, payload size: %u", total, size);
+        return;
+    }
+    auto frame = payload + header_size;
+    for (size_t i = 0; i < count; ++i) {
+        size_t frame_size = ntohs(bp4->frame_sizes[i]);
+        PushIncomingAudio(frame, frame_size, 0);
+        frame += frame_size;
+    }
+}
+
+void WebsocketProtocol::PushIncomingAudio(const uint8_t* payload, size_t size, uint32_t timestamp) {
+    // TCP delivers in order, so there is no loss to count
+    RecordIncomingAudio(size, 0);
+    auto packet = AudioStreamPacket::Create();
+    packet->sample_rate = server_sample_rate_;
+    packet->frame_duration = server_frame_duration_;
+    packet->timestamp = timestamp;
+    packet->sequence = remote_sequence_ + 1;
+    packet->payload.assign(payload, payload + size);
+#if CONFIG_PROTOCOL_TRACE
+    ProtocolTrace::GetInstance().RecordAudio(kTraceAudio, *packet);
+#endif
+    // A frame the application drops leaves no gap for the jitter buffer to conceal
+    if (on_incoming_audio_(std::move(packet))) {
+        remote_sequence_++;
+    }
+}
+
+void WebsocketProtocol::HandleText(const char* data, size_t len) {
+    // Parse JSON data
+#if CONFIG_PROTOCOL_TRACE
+    ProtocolTrace::GetInstance().Record(kTraceText, data, len);
+#endif
+    JsonArena::Scope arena_scope;
+    auto root = cJSON_Parse(data);
+    auto type = cJSON_GetObjectItem(root, "type");
+    if (cJSON_IsString(type)) {
+        if (strcmp(type->valuestring, "hello") == 0) {
+            ParseServerHello(root);
+        } else {
+            if (on_incoming_json_ != nullptr) {
+                on_incoming_json_(root);
+            }
+        }
+    } else {
+        ESP_LOGE(TAG, "Missing message type, data: %s", data);
+    }
+    cJSON_Delete(root);
+}
 
 std::string WebsocketProtocol::GetHelloMessage() {
     // keys: message type, version, audio_params (format, sample_rate, channels)
@@ -210,8 +1189,54 @@ std::string WebsocketProtocol::GetHelloMessage() {
     cJSON_AddBoolToObject(features, "aec", true);
 #endif
     cJSON_AddBoolToObject(features, "mcp", true);
+#if CONFIG_LOCAL_ENDPOINT
+    cJSON_AddBoolToObject(features, "local_endpoint", true);
+#endif
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+    cJSON_AddBoolToObject(features, "resume", true);
+#endif
+#if CONFIG_WEBSOCKET_EARLY_DATA
+    cJSON_AddBoolToObject(features, "early_data", true);
+#endif
+#if CONFIG_TTS_CACHE
+    if (TtsCache::GetInstance().enabled()) {
+        cJSON_AddBoolToObject(features, "tts_cache", true);
+    }
+#endif
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    cJSON_AddBoolToObject(features, "udp", true);
+    cJSON_AddNumberToObject(features, "fec_group", CONFIG_WEBSOCKET_UDP_FEC_GROUP);
+#endif
+    if (version_ == 4) {
+        cJSON_AddNumberToObject(features, "max_frames_per_message", BINARY_PROTOCOL_MAX_FRAMES);
+    }
+    // Control messages need the type field of the version 3 header
+    if (version_ >= 3) {
+        cJSON_AddBoolToObject(features, "binary_control", true);
+        cJSON_AddBoolToObject(features, "blob", true);
+    }
+#if CONFIG_WEBSOCKET_DEFLATE
+    // In a version 3 header like the control messages
+    if (version_ >= 3 && MessageDeflate::available()) {
+        cJSON_AddBoolToObject(features, "deflate", true);
+    }
+#endif
+#if CONFIG_AUDIO_MEDIA_STREAM
+    cJSON_AddBoolToObject(features, "media", true);
+#endif
+#if CONFIG_AUDIO_NARROWBAND_MODE
+    cJSON_AddBoolToObject(features, "narrowband", true);
+#endif
     cJSON_AddItemToObject(root, "features", features);
     cJSON_AddStringToObject(root, "transport", "websocket");
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+    if (resuming_) {
+        cJSON* resume = cJSON_CreateObject();
+        cJSON_AddStringToObject(resume, "session_id", session_id_.c_str());
+        cJSON_AddStringToObject(resume, "token", resume_token_.c_str());
+        cJSON_AddItemToObject(root, "resume", resume);
+    }
+#endif
     cJSON* audio_params = cJSON_CreateObject();
     cJSON_AddStringToObject(audio_params, "format", "opus");
     cJSON_AddNumberToObject(audio_params, "sample_rate", 16000);
@@ -238,6 +1263,33 @@ void WebsocketProtocol::ParseServerHello(const cJSON* root) {
         ESP_LOGI(TAG, "Session ID: %s", session_id_.c_str());
     }
 
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+    // A new token with every hello, a server without one cannot resume the session
+    auto resume_token = cJSON_GetObjectItem(root, "resume_token");
+    resume_token_ = cJSON_IsString(resume_token) ? resume_token->valuestring : "";
+    session_resumed_ = cJSON_IsTrue(cJSON_GetObjectItem(root, "resumed"));
+#endif
+
+    // A server that does not answer with version 4 only knows the single frame messages
+    if (version_ == 4) {
+        auto version = cJSON_GetObjectItem(root, "version");
+        if (!cJSON_IsNumber(version) || version->valueint < 4) {
+            ESP_LOGW(TAG, "Server does not support protocol version 4, falling back to version 3");
+            version_ = 3;
+        }
+    }
+
+    if (version_ >= 3) {
+        ParseServerFeatures(root);
+#if CONFIG_WEBSOCKET_DEFLATE
+        auto features = cJSON_GetObjectItem(root, "features");
+        deflate_ = MessageDeflate::available() && cJSON_IsTrue(cJSON_GetObjectItem(features, "deflate"));
+        if (deflate_) {
+            ESP_LOGI(TAG, "Using deflated JSON messages");
+        }
+#endif
+    }
+
     auto audio_params = cJSON_GetObjectItem(root, "audio_params");
     if (cJSON_IsObject(audio_params)) {
         auto sample_rate = cJSON_GetObjectItem(audio_params, "sample_rate");
@@ -248,7 +1300,52 @@ void WebsocketProtocol::ParseServerHello(const cJSON* root) {
         if (cJSON_IsNumber(frame_duration)) {
             server_frame_duration_ = frame_duration->valueint;
         }
+        auto channels = cJSON_GetObjectItem(audio_params, "channels");
+        server_channels_ = cJSON_IsNumber(channels) ? channels->valueint : 1;
+    }
+
+#if CONFIG_WEBSOCKET_UDP_AUDIO
+    // Same udp block as the MQTT hello, with the FEC group the server picked
+    auto udp = cJSON_GetObjectItem(root, "udp");
+    if (cJSON_IsObject(udp)) {
+        auto server = cJSON_GetObjectItem(udp, "server");
+        auto port = cJSON_GetObjectItem(udp, "port");
+        auto key = cJSON_GetObjectItem(udp, "key");
+        auto nonce = cJSON_GetObjectItem(udp, "nonce");
+        if (cJSON_IsString(server) && cJSON_IsNumber(port) && cJSON_IsString(key) && cJSON_IsString(nonce)) {
+            udp_server_ = server->valuestring;
+            udp_port_ = port->valueint;
+            udp_key_ = key->valuestring;
+            udp_nonce_ = nonce->valuestring;
+            auto fec_group = cJSON_GetObjectItem(udp, "fec_group");
+            udp_fec_group_ = cJSON_IsNumber(fec_group) ? fec_group->valueint : 0;
+            has_udp_ = true;
+        } else {
+            ESP_LOGE(TAG, "Invalid udp block in server hello");
+        }
     }
+#endif
 
+#if CONFIG_WEBSOCKET_EARLY_DATA
+    {
+        // Every hello tells whether the next session may send ahead of it
+        std::lock_guard<std::mutex> lock(early_mutex_);
+        auto features = cJSON_GetObjectItem(root, "features");
+        early_accepted_ = cJSON_IsTrue(cJSON_GetObjectItem(features, "early_data"));
+    }
+    if (hello_pending_) {
+        // What the application held meanwhile is settled through the network tx, ahead of what
+        // comes next
+        auto alive = alive_;
+        Application::GetInstance().Schedule([this, alive]() {
+            Application::GetInstance().GetNetworkTx().Post([this, alive]() {
+                if (*alive) {
+                    SettleEarlyOpen();
+                }
+            });
+        });
+    }
+#endif
+    MarkHelloReceived();
     xEventGroupSetBits(event_group_handle_, WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT);
 }
@@ -3,12 +3,24 @@
 
 
 #include "protocol.h"
+#include "udp_audio_channel.h"
+#include "message_deflate.h"
 
 #include <web_socket.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/event_groups.h>
+#include <freertos/task.h>
+
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <memory>
 
 #define WEBSOCKET_PROTOCOL_SERVER_HELLO_EVENT (1 << 0)
+#define WEBSOCKET_PROTOCOL_WARM_TAKE_EVENT (1 << 1)
+#define WEBSOCKET_PROTOCOL_WARM_LOST_EVENT (1 << 2)
+#define WEBSOCKET_PROTOCOL_WARM_STOPPED_EVENT (1 << 3)
+#define WEBSOCKET_PROTOCOL_RESUME_STOPPED_EVENT (1 << 4)
 
 class WebsocketProtocol : public Protocol {
 public:
@@ -16,19 +28,114 @@ public:
     ~WebsocketProtocol();
 
     bool Start() override;
-    bool SendAudio(std::unique_ptr<AudioStreamPacket> packet) override;
+    bool SendAudio(AudioStreamPacketPtr packet) override;
+    size_t SendAudioBatch(AudioStreamPacketPtr* packets, size_t count) override;
     bool OpenAudioChannel() override;
     void CloseAudioChannel(bool send_goodbye = true) override;
     bool IsAudioChannelOpened() const override;
+    bool SendBlobFrame(uint32_t id, uint32_t offset, const std::string& data, bool final) override;
 
 private:
     EventGroupHandle_t event_group_handle_;
     std::unique_ptr<WebSocket> websocket_;
+    std::mutex websocket_mutex_;    // Held to replace websocket_, the warm task and the main task both do
+    std::atomic<bool> channel_opened_ = false;
+    // For CONFIG_WEBSOCKET_KEEP_WARM
+    std::mutex warm_mutex_;
+    TaskHandle_t warm_task_handle_ = nullptr;
+    std::atomic<bool> warm_ready_ = false;
+    std::atomic<bool> warm_socket_ = false;     // websocket_ belongs to the warm task
+    int warm_delay_ms_ = 0;
     int version_ = 1;
+    // For CONFIG_WEBSOCKET_UDP_AUDIO, the media sidecar announced in the server hello
+    bool has_udp_ = false;
+    std::string udp_server_;
+    int udp_port_ = 0;
+    std::string udp_key_;
+    std::string udp_nonce_;
+    int udp_fec_group_ = 0;
+    std::mutex udp_mutex_;
+    std::unique_ptr<UdpAudioChannel> udp_;
+    uint32_t remote_sequence_ = 0;
+    std::string send_buffer_;   // Reused for every binary frame, only touched with the transport held
+    // For CONFIG_WEBSOCKET_DEFLATE, the compressor of the sender and the inflater of the
+    // websocket task
+    bool deflate_ = false;
+    MessageDeflate deflater_;
+    MessageDeflate inflater_;
+    std::string deflated_;
+    std::string inflated_;
+    // For CONFIG_WEBSOCKET_SESSION_RESUME, what was sent while the session was being resumed
+    struct PendingMessage {
+        AudioStreamPacketPtr packet;
+        std::string text;
+        bool control = false;
+    };
+    std::string resume_token_;
+    bool session_resumed_ = false;
+    std::atomic<bool> resuming_ = false;
+    std::atomic<TaskHandle_t> resume_flush_task_ = nullptr;    // Sends through while it drains the held messages
+    std::mutex resume_mutex_;
+    std::deque<PendingMessage> resume_pending_;
+    size_t resume_audio_packets_ = 0;
+    // For CONFIG_WEBSOCKET_EARLY_DATA, what was sent or held before the server hello came
+    struct AudioParams {
+        int sample_rate;
+        int frame_duration;
+        int channels;
+        bool media;
+        bool narrowband;
+        bool operator!=(const AudioParams& other) const {
+            return sample_rate != other.sample_rate || frame_duration != other.frame_duration ||
+                channels != other.channels || media != other.media || narrowband != other.narrowband;
+        }
+    };
+    std::atomic<bool> hello_pending_ = false;
+    bool early_accepted_ = false;   // The last server hello answered with early_data
+    bool early_send_ = false;       // This session sends ahead of the hello
+    int64_t hello_deadline_us_ = 0;
+    std::mutex early_mutex_;
+    std::deque<PendingMessage> early_;  // Held until the hello, each goes out once
+    size_t early_sent_count_ = 0;
+    AudioParams early_params_ = {};
+    std::shared_ptr<std::atomic<bool>> alive_ = std::make_shared<std::atomic<bool>>(true);
 
+    bool Connect(bool report_errors, bool wait_hello = true);
+    void StartWarming(int delay_ms);
+    void WarmTask();
+    bool TakeWarmConnection();
+    bool StartResuming();
+    void ResumeTask();
+    bool HoldWhileResuming(PendingMessage&& message);
+    // The sends of the caller are held while the session is resumed
+    bool HoldsSends() const {
+#if CONFIG_WEBSOCKET_SESSION_RESUME
+        return resuming_ && resume_flush_task_ != xTaskGetCurrentTaskHandle();
+#else
+        return false;
+#endif
+    }
+    void FlushResumed();
+    bool SendPending(PendingMessage& message);
+    void BeginEarlyOpen();
+    void EndEarlyOpen();
+    bool SendEarly(PendingMessage&& message);
+    void SettleEarlyOpen();
+    AudioParams GetAudioParams() const;
+    void NotifyChannelClosed();
+    void OpenUdpChannel();
+    void CloseUdpChannel();
     void ParseServerHello(const cJSON* root);
+    void ParseAudioFrames(const uint8_t* payload, size_t size);
+    void PushIncomingAudio(const uint8_t* payload, size_t size, uint32_t timestamp);
+    bool SendAudioFrame(const AudioStreamPacket& packet);
+    size_t SendAudioFrames(AudioStreamPacketPtr* packets, size_t count);
     bool SendText(const std::string& text) override;
+    bool SendTextParts(const std::string_view* parts, size_t count) override;
+    bool SendControl(const std::string& message) override;
     std::string GetHelloMessage();
+    void HandleText(const char* data, size_t len);
+    bool SendDeflated(const std::string_view* parts, size_t count, size_t size, bool& sent);
 };
 
 #endif
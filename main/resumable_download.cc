@@ -0,0 +1,142 @@
+#include "resumable_download.h"
+#include "board.h"
+#include "http_pool.h"
+#include "socket_qos.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <algorithm>
+#include <memory>
+
+#define TAG "ResumableDownload"
+
+void ResumableDownload::Throttle(size_t recent_read, int64_t since_us) {
+    if (paused_) {
+        bool logged = false;
+        while (paused_()) {
+            if (!logged) {
+                ESP_LOGI(TAG, "Download paused");
+                logged = true;
+            }
+            vTaskDelay(pdMS_TO_TICKS(200));
+        }
+        if (logged) {
+            ESP_LOGI(TAG, "Download resumed");
+        }
+    }
+    if (max_speed_ > 0) {
+        // The bytes read this second so far ahead of the cap are slept off
+        int64_t due_us = (int64_t)recent_read * 1000000 / max_speed_;
+        int64_t elapsed_us = esp_timer_get_time() - since_us;
+        if (due_us > elapsed_us) {
+            vTaskDelay(pdMS_TO_TICKS((due_us - elapsed_us) / 1000) + 1);
+        }
+    }
+}
+
+bool ResumableDownload::Run(DataCallback on_data, RestartCallback on_restart, ProgressCallback on_progress) {
+    auto buffer = std::make_unique<char[]>(buffer_size_);
+    size_t total_read = 0;
+    size_t recent_read = 0;
+    int retries = 0;
+    auto last_calc_time = esp_timer_get_time();
+    content_length_ = 0;
+
+    while (content_length_ == 0 || total_read < content_length_) {
+        if (retries > 0) {
+            if (retries > RESUMABLE_DOWNLOAD_MAX_RETRIES) {
+                ESP_LOGE(TAG, "Failed to download after %d retries", RESUMABLE_DOWNLOAD_MAX_RETRIES);
+                return false;
+            }
+            ESP_LOGW(TAG, "Resuming the download at %u/%u, retry %d", total_read, content_length_, retries);
+            vTaskDelay(pdMS_TO_TICKS(1000 * retries));
+        }
+
+        // The first request may go over a kept connection, a resumed one has a Range header of its own
+        std::unique_ptr<Http> http;
+        bool pooled = total_read == 0;
+        if (pooled) {
+            SocketQos::Open(kTrafficClassBulk, [this, &http]() {
+                http = HttpPool::GetInstance().Open("GET", url_, "download", 0);
+                return http != nullptr;
+            });
+        } else {
+            http = HttpPool::GetInstance().CreateHttp(0);
+            http->SetHeader("Range", "bytes=" + std::to_string(total_read) + "-");
+            if (!SocketQos::Open(kTrafficClassBulk, [this, &http]() { return http->Open("GET", url_); })) {
+                http.reset();
+            }
+        }
+        if (!http) {
+            ESP_LOGE(TAG, "Failed to open HTTP connection");
+            retries++;
+            continue;
+        }
+
+        int status_code = http->GetStatusCode();
+        if (status_code == 200 && total_read > 0) {
+            ESP_LOGW(TAG, "The server does not support range requests, restarting the download");
+            if (!on_restart()) {
+                return false;
+            }
+            total_read = 0;
+        } else if (status_code != 200 && status_code != 206) {
+            ESP_LOGE(TAG, "Failed to download, status code: %d", status_code);
+            return false;
+        }
+
+        size_t body_length = http->GetBodyLength();
+        if (content_length_ == 0) {
+            content_length_ = body_length;
+            if (content_length_ == 0) {
+                ESP_LOGE(TAG, "Failed to get content length");
+                return false;
+            }
+            if (max_length_ > 0 && content_length_ > max_length_) {
+                ESP_LOGE(TAG, "The file size (%u) is larger than %u", content_length_, max_length_);
+                return false;
+            }
+        } else if (total_read + body_length != content_length_) {
+            ESP_LOGE(TAG, "The file changed on the server, %u bytes left instead of %u", body_length, content_length_ - total_read);
+            return false;
+        }
+
+        while (total_read < content_length_) {
+            Throttle(recent_read, last_calc_time);
+            int ret = http->Read(buffer.get(), std::min(buffer_size_, content_length_ - total_read));
+            if (ret <= 0) {
+                ESP_LOGW(TAG, "Failed to read HTTP data: %d", ret);
+                break;
+            }
+            retries = 0;
+            total_read += ret;
+            recent_read += ret;
+            if (!on_data(buffer.get(), ret)) {
+                return false;
+            }
+
+            // Calculate speed and progress every second
+            if (esp_timer_get_time() - last_calc_time >= 1000000 || total_read == content_length_) {
+                size_t progress = total_read * 100 / content_length_;
+                ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %u B/s", progress, total_read, content_length_, recent_read);
+                if (on_progress) {
+                    on_progress(progress, recent_read);
+                }
+                last_calc_time = esp_timer_get_time();
+                recent_read = 0;
+            }
+        }
+        if (total_read == content_length_ && pooled) {
+            HttpPool::GetInstance().Release(url_, "download", 0, std::move(http));
+        } else {
+            http->Close();
+        }
+
+        if (total_read < content_length_) {
+            retries++;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,51 @@
+#ifndef _RESUMABLE_DOWNLOAD_H_
+#define _RESUMABLE_DOWNLOAD_H_
+
+#include <functional>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+
+// A dropped connection is resumed this many times in a row before the download fails
+#define RESUMABLE_DOWNLOAD_MAX_RETRIES 5
+
+/*
+ * Downloads a file with GET and hands it to a callback in pieces.
+ *
+ * After a dropped connection or a failed read the URL is opened again with a Range header for
+ * the bytes already handed over. A server that answers that with the whole file makes the
+ * download start over, after the restart callback agreed to it.
+ */
+class ResumableDownload {
+public:
+    // false stops the download
+    typedef std::function<bool(const char* data, size_t length)> DataCallback;
+    typedef std::function<bool()> RestartCallback;
+    typedef std::function<void(int progress, size_t speed)> ProgressCallback;
+    // true holds the download before the next read
+    typedef std::function<bool()> PauseCallback;
+
+    ResumableDownload(const std::string& url, size_t buffer_size) : url_(url), buffer_size_(buffer_size) {}
+
+    // Fails a file longer than that before it is read
+    void SetMaxLength(size_t max_length) { max_length_ = max_length; }
+    // Keeps the speed under max_speed bytes per second, 0 for no cap, and holds the download
+    // while paused() is true. A connection the server drops meanwhile is resumed after it
+    void SetThrottle(size_t max_speed, PauseCallback paused) {
+        max_speed_ = max_speed;
+        paused_ = paused;
+    }
+    bool Run(DataCallback on_data, RestartCallback on_restart, ProgressCallback on_progress);
+
+    size_t content_length() const { return content_length_; }
+
+private:
+    std::string url_;
+    size_t buffer_size_;
+    size_t max_length_ = 0;
+    size_t max_speed_ = 0;
+    PauseCallback paused_;
+    size_t content_length_ = 0;
+};
+
+#endif // _RESUMABLE_DOWNLOAD_H_
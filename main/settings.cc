@@ -1,58 +1,239 @@
 #include "settings.h"
 
 #include <esp_log.h>
+#include <esp_system.h>
 #include <nvs_flash.h>
+#include <vector>
 
 #define TAG "Settings"
 
-Settings::Settings(const std::string& ns, bool read_write) : ns_(ns), read_write_(read_write) {
-    nvs_open(ns.c_str(), read_write_ ? NVS_READWRITE : NVS_READONLY, &nvs_handle_);
+SettingsStore::SettingsStore() {
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            static_cast<SettingsStore*>(arg)->Flush();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "settings_commit",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &commit_timer_));
+    esp_register_shutdown_handler([]() {
+        SettingsStore::GetInstance().Flush();
+    });
 }
 
-Settings::~Settings() {
-    if (nvs_handle_ != 0) {
-        if (read_write_ && dirty_) {
-            ESP_ERROR_CHECK(nvs_commit(nvs_handle_));
+SettingsStore::Entry* SettingsStore::Load(const std::string& ns, const std::string& key, EntryType type) {
+    auto& entry = namespaces_[ns][key];
+    // An absent key is looked up again for another type, NVS keeps the entries typed
+    if (entry.type != kEntryNone || entry.dirty || entry.loaded_as == type) {
+        return &entry;
+    }
+
+    entry.loaded_as = type;
+    nvs_handle_t handle;
+    if (nvs_open(ns.c_str(), NVS_READONLY, &handle) != ESP_OK) {
+        return &entry;
+    }
+    if (type == kEntryString) {
+        size_t length = 0;
+        if (nvs_get_str(handle, key.c_str(), nullptr, &length) == ESP_OK) {
+            entry.string_value.resize(length);
+            if (nvs_get_str(handle, key.c_str(), entry.string_value.data(), &length) == ESP_OK) {
+                while (!entry.string_value.empty() && entry.string_value.back() == '\0') {
+                    entry.string_value.pop_back();
+                }
+                entry.type = kEntryString;
+            }
+        }
+    } else if (type == kEntryInt) {
+        if (nvs_get_i32(handle, key.c_str(), &entry.int_value) == ESP_OK) {
+            entry.type = kEntryInt;
+        }
+    } else if (type == kEntryBool) {
+        uint8_t value;
+        if (nvs_get_u8(handle, key.c_str(), &value) == ESP_OK) {
+            entry.int_value = value != 0;
+            entry.type = kEntryBool;
         }
-        nvs_close(nvs_handle_);
     }
+    nvs_close(handle);
+    return &entry;
 }
 
-std::string Settings::GetString(const std::string& key, const std::string& default_value) {
-    if (nvs_handle_ == 0) {
-        return default_value;
+bool SettingsStore::GetString(const std::string& ns, const std::string& key, std::string& value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto entry = Load(ns, key, kEntryString);
+    if (entry->type != kEntryString) {
+        return false;
     }
+    value = entry->string_value;
+    return true;
+}
 
-    size_t length = 0;
-    if (nvs_get_str(nvs_handle_, key.c_str(), nullptr, &length) != ESP_OK) {
-        return default_value;
+bool SettingsStore::GetInt(const std::string& ns, const std::string& key, int32_t& value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto entry = Load(ns, key, kEntryInt);
+    if (entry->type != kEntryInt) {
+        return false;
+    }
+    value = entry->int_value;
+    return true;
+}
+
+bool SettingsStore::GetBool(const std::string& ns, const std::string& key, bool& value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto entry = Load(ns, key, kEntryBool);
+    if (entry->type != kEntryBool) {
+        return false;
+    }
+    value = entry->int_value != 0;
+    return true;
+}
+
+void SettingsStore::Store(const std::string& ns, const std::string& key, const Entry& entry) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& cached = namespaces_[ns][key];
+        // Setting the value it already has is not written
+        if (!cached.dirty && cached.type == entry.type && cached.type != kEntryNone &&
+            cached.int_value == entry.int_value && cached.string_value == entry.string_value) {
+            return;
+        }
+        cached = entry;
+        cached.dirty = true;
+    }
+    esp_timer_stop(commit_timer_);
+    esp_timer_start_once(commit_timer_, CONFIG_SETTINGS_COMMIT_DELAY_MS * 1000);
+}
+
+void SettingsStore::SetString(const std::string& ns, const std::string& key, const std::string& value) {
+    Entry entry;
+    entry.type = kEntryString;
+    entry.string_value = value;
+    Store(ns, key, entry);
+}
+
+void SettingsStore::SetInt(const std::string& ns, const std::string& key, int32_t value) {
+    Entry entry;
+    entry.type = kEntryInt;
+    entry.int_value = value;
+    Store(ns, key, entry);
+}
+
+void SettingsStore::SetBool(const std::string& ns, const std::string& key, bool value) {
+    Entry entry;
+    entry.type = kEntryBool;
+    entry.int_value = value ? 1 : 0;
+    Store(ns, key, entry);
+}
+
+void SettingsStore::EraseKey(const std::string& ns, const std::string& key) {
+    Store(ns, key, Entry());
+}
+
+void SettingsStore::EraseAll(const std::string& ns) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The pending changes of the namespace go with it
+    namespaces_.erase(ns);
+    nvs_handle_t handle;
+    if (nvs_open(ns.c_str(), NVS_READWRITE, &handle) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open namespace %s", ns.c_str());
+        return;
+    }
+    ESP_ERROR_CHECK(nvs_erase_all(handle));
+    ESP_ERROR_CHECK(nvs_commit(handle));
+    nvs_close(handle);
+}
+
+void SettingsStore::Flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    CommitLocked();
+}
+
+/* An entry stays dirty until its write is committed, a failed one is tried again after the commit delay */
+void SettingsStore::CommitLocked() {
+    bool failed = false;
+    for (auto& [ns, entries] : namespaces_) {
+        nvs_handle_t handle = 0;
+        std::vector<Entry*> written;
+        for (auto& [key, entry] : entries) {
+            if (!entry.dirty) {
+                continue;
+            }
+            if (handle == 0 && nvs_open(ns.c_str(), NVS_READWRITE, &handle) != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to open namespace %s", ns.c_str());
+                handle = 0;
+                failed = true;
+                break;
+            }
+            esp_err_t ret = ESP_OK;
+            if (entry.type == kEntryString) {
+                ret = nvs_set_str(handle, key.c_str(), entry.string_value.c_str());
+            } else if (entry.type == kEntryInt) {
+                ret = nvs_set_i32(handle, key.c_str(), entry.int_value);
+            } else if (entry.type == kEntryBool) {
+                ret = nvs_set_u8(handle, key.c_str(), entry.int_value);
+            } else {
+                ret = nvs_erase_key(handle, key.c_str());
+                if (ret == ESP_ERR_NVS_NOT_FOUND) {
+                    ret = ESP_OK;
+                }
+            }
+            if (ret != ESP_OK) {
+                ESP_LOGE(TAG, "Failed to write %s.%s: %s", ns.c_str(), key.c_str(), esp_err_to_name(ret));
+                failed = true;
+                continue;
+            }
+            written.push_back(&entry);
+        }
+        if (handle == 0) {
+            continue;
+        }
+        esp_err_t ret = nvs_commit(handle);
+        nvs_close(handle);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to commit %s: %s", ns.c_str(), esp_err_to_name(ret));
+            failed = true;
+            continue;
+        }
+        for (auto entry : written) {
+            entry->dirty = false;
+        }
+        ESP_LOGD(TAG, "Committed %u keys of %s", written.size(), ns.c_str());
+    }
+    if (failed) {
+        // Nothing else may set a value to start the timer again
+        esp_timer_stop(commit_timer_);
+        esp_timer_start_once(commit_timer_, CONFIG_SETTINGS_COMMIT_DELAY_MS * 1000);
     }
+}
+
+Settings::Settings(const std::string& ns, bool read_write) : ns_(ns), read_write_(read_write) {
+}
+
+Settings::~Settings() {
+}
 
+std::string Settings::GetString(const std::string& key, const std::string& default_value) {
     std::string value;
-    value.resize(length);
-    ESP_ERROR_CHECK(nvs_get_str(nvs_handle_, key.c_str(), value.data(), &length));
-    while (!value.empty() && value.back() == '\0') {
-        value.pop_back();
+    if (!SettingsStore::GetInstance().GetString(ns_, key, value)) {
+        return default_value;
     }
     return value;
 }
 
 void Settings::SetString(const std::string& key, const std::string& value) {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_set_str(nvs_handle_, key.c_str(), value.c_str()));
-        dirty_ = true;
+        SettingsStore::GetInstance().SetString(ns_, key, value);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
 }
 
 int32_t Settings::GetInt(const std::string& key, int32_t default_value) {
-    if (nvs_handle_ == 0) {
-        return default_value;
-    }
-
     int32_t value;
-    if (nvs_get_i32(nvs_handle_, key.c_str(), &value) != ESP_OK) {
+    if (!SettingsStore::GetInstance().GetInt(ns_, key, value)) {
         return default_value;
     }
     return value;
@@ -60,29 +241,23 @@ int32_t Settings::GetInt(const std::string& key, int32_t default_value) {
 
 void Settings::SetInt(const std::string& key, int32_t value) {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_set_i32(nvs_handle_, key.c_str(), value));
-        dirty_ = true;
+        SettingsStore::GetInstance().SetInt(ns_, key, value);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
 }
 
 bool Settings::GetBool(const std::string& key, bool default_value) {
-    if (nvs_handle_ == 0) {
+    bool value;
+    if (!SettingsStore::GetInstance().GetBool(ns_, key, value)) {
         return default_value;
     }
-
-    uint8_t value;
-    if (nvs_get_u8(nvs_handle_, key.c_str(), &value) != ESP_OK) {
-        return default_value;
-    }
-    return value != 0;
+    return value;
 }
 
 void Settings::SetBool(const std::string& key, bool value) {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_set_u8(nvs_handle_, key.c_str(), value ? 1 : 0));
-        dirty_ = true;
+        SettingsStore::GetInstance().SetBool(ns_, key, value);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
@@ -90,10 +265,7 @@ void Settings::SetBool(const std::string& key, bool value) {
 
 void Settings::EraseKey(const std::string& key) {
     if (read_write_) {
-        auto ret = nvs_erase_key(nvs_handle_, key.c_str());
-        if (ret != ESP_ERR_NVS_NOT_FOUND) {
-            ESP_ERROR_CHECK(ret);
-        }
+        SettingsStore::GetInstance().EraseKey(ns_, key);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
@@ -101,7 +273,7 @@ void Settings::EraseKey(const std::string& key) {
 
 void Settings::EraseAll() {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_erase_all(nvs_handle_));
+        SettingsStore::GetInstance().EraseAll(ns_);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
@@ -2,8 +2,62 @@
 #define SETTINGS_H
 
 #include <string>
+#include <map>
+#include <mutex>
 #include <nvs_flash.h>
+#include <esp_timer.h>
 
+/*
+ * The settings of all the namespaces in RAM, read from NVS once per key.
+ *
+ * The changes are written back CONFIG_SETTINGS_COMMIT_DELAY_MS after the last one, so a volume
+ * slider dragged across the range commits once. Flush() writes them right away, and it is
+ * called before a restart, so a setting changed just before esp_restart() is kept.
+ */
+class SettingsStore {
+public:
+    static SettingsStore& GetInstance() {
+        static SettingsStore instance;
+        return instance;
+    }
+
+    bool GetString(const std::string& ns, const std::string& key, std::string& value);
+    bool GetInt(const std::string& ns, const std::string& key, int32_t& value);
+    bool GetBool(const std::string& ns, const std::string& key, bool& value);
+    void SetString(const std::string& ns, const std::string& key, const std::string& value);
+    void SetInt(const std::string& ns, const std::string& key, int32_t value);
+    void SetBool(const std::string& ns, const std::string& key, bool value);
+    void EraseKey(const std::string& ns, const std::string& key);
+    void EraseAll(const std::string& ns);
+    void Flush();
+
+private:
+    enum EntryType {
+        kEntryNone,     // Not in NVS, or erased
+        kEntryString,
+        kEntryInt,
+        kEntryBool,
+    };
+
+    struct Entry {
+        EntryType type = kEntryNone;
+        EntryType loaded_as = kEntryNone;   // The type an absent key was looked for as
+        std::string string_value;
+        int32_t int_value = 0;
+        bool dirty = false;
+    };
+
+    std::mutex mutex_;
+    std::map<std::string, std::map<std::string, Entry>> namespaces_;
+    esp_timer_handle_t commit_timer_ = nullptr;
+
+    SettingsStore();
+    Entry* Load(const std::string& ns, const std::string& key, EntryType type);
+    void Store(const std::string& ns, const std::string& key, const Entry& entry);
+    void CommitLocked();
+};
+
+// A view of a namespace of the SettingsStore, cheap to create for each access
 class Settings {
 public:
     Settings(const std::string& ns, bool read_write = false);
@@ -20,9 +74,7 @@ public:
 
 private:
     std::string ns_;
-    nvs_handle_t nvs_handle_ = 0;
     bool read_write_ = false;
-    bool dirty_ = false;
 };
 
 #endif
@@ -0,0 +1,48 @@
+#include "socket_qos.h"
+
+#include <esp_log.h>
+#include <sdkconfig.h>
+#include <lwip/sockets.h>
+
+#include <bitset>
+
+#define TAG "SocketQos"
+
+#if CONFIG_NETWORK_QOS_MARKING
+// The DSCP in the upper six bits of the IPv4 TOS
+static int TosOf(TrafficClass traffic_class) {
+    switch (traffic_class) {
+        case kTrafficClassVoice: return 46 << 2;
+        case kTrafficClassControl: return 18 << 2;
+        default: return 8 << 2;
+    }
+}
+
+static std::bitset<CONFIG_LWIP_MAX_SOCKETS> OpenSockets() {
+    std::bitset<CONFIG_LWIP_MAX_SOCKETS> sockets;
+    for (int i = 0; i < CONFIG_LWIP_MAX_SOCKETS; i++) {
+        int type = 0;
+        socklen_t length = sizeof(type);
+        sockets[i] = getsockopt(LWIP_SOCKET_OFFSET + i, SOL_SOCKET, SO_TYPE, &type, &length) == 0;
+    }
+    return sockets;
+}
+#endif
+
+bool SocketQos::Open(TrafficClass traffic_class, const std::function<bool()>& open) {
+#if CONFIG_NETWORK_QOS_MARKING
+    auto before = OpenSockets();
+    bool result = open();
+    auto opened = OpenSockets() & ~before;
+    int tos = TosOf(traffic_class);
+    for (int i = 0; i < CONFIG_LWIP_MAX_SOCKETS; i++) {
+        if (opened[i] && setsockopt(LWIP_SOCKET_OFFSET + i, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) == 0) {
+            ESP_LOGD(TAG, "Marked socket %d with TOS 0x%02x", LWIP_SOCKET_OFFSET + i, tos);
+        }
+    }
+    return result;
+#else
+    (void)traffic_class;
+    return open();
+#endif
+}
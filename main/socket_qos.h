@@ -0,0 +1,28 @@
+#ifndef SOCKET_QOS_H
+#define SOCKET_QOS_H
+
+#include <functional>
+
+enum TrafficClass {
+    kTrafficClassBulk,      // Downloads, DSCP CS1, WMM background
+    kTrafficClassControl,   // Signalling, DSCP AF21, WMM best effort
+    kTrafficClassVoice,     // Audio, DSCP EF, WMM voice
+};
+
+/*
+ * DSCP marking of the sockets of the network, enabled with CONFIG_NETWORK_QOS_MARKING.
+ *
+ * The Udp, WebSocket, Mqtt and Http objects of the network keep their sockets to themselves, so
+ * Open() runs the call that connects one and marks the lwIP sockets that were not open before it.
+ * The WiFi driver sends what is marked EF in the voice access category of WMM, ahead of the
+ * downloads on the same device and of the best effort traffic of the others on a busy access
+ * point. A socket another task opens meanwhile gets the same mark. The sockets of a cellular
+ * modem are not lwIP sockets and are left as they are.
+ */
+class SocketQos {
+public:
+    // Returns what open returned
+    static bool Open(TrafficClass traffic_class, const std::function<bool()>& open);
+};
+
+#endif // SOCKET_QOS_H
@@ -0,0 +1,99 @@
+#include "task_profile.h"
+#include "sdkconfig.h"
+
+#include <esp_log.h>
+#include <cstdlib>
+#include <cstring>
+
+#define TAG "TaskProfiles"
+
+// The core options are only there on dual-core targets
+#if CONFIG_FREERTOS_UNICORE
+#define TASK_CORE(core) -1
+#else
+#define TASK_CORE(core) (core)
+#endif
+
+#if CONFIG_AUDIO_SPLIT_OPUS_TASKS && !CONFIG_FREERTOS_UNICORE
+#define OPUS_DECODER_CORE CONFIG_OPUS_DECODER_TASK_CORE
+#define OPUS_ENCODER_CORE CONFIG_OPUS_ENCODER_TASK_CORE
+#else
+#define OPUS_DECODER_CORE -1
+#define OPUS_ENCODER_CORE -1
+#endif
+#if CONFIG_AUDIO_SPLIT_OPUS_TASKS
+#define OPUS_DECODER_PRIORITY CONFIG_OPUS_DECODER_TASK_PRIORITY
+#define OPUS_ENCODER_PRIORITY CONFIG_OPUS_ENCODER_TASK_PRIORITY
+#else
+#define OPUS_DECODER_PRIORITY CONFIG_TASK_OPUS_CODEC_PRIORITY
+#define OPUS_ENCODER_PRIORITY CONFIG_TASK_OPUS_CODEC_PRIORITY
+#endif
+
+static const TaskProfile kTaskProfiles[kTaskCount] = {
+    {"audio_input", CONFIG_TASK_AUDIO_INPUT_STACK_SIZE, CONFIG_TASK_AUDIO_INPUT_PRIORITY, TASK_CORE(CONFIG_TASK_AUDIO_INPUT_CORE)},
+    {"audio_output", CONFIG_TASK_AUDIO_OUTPUT_STACK_SIZE, CONFIG_TASK_AUDIO_OUTPUT_PRIORITY, TASK_CORE(CONFIG_TASK_AUDIO_OUTPUT_CORE)},
+    {"opus_codec", CONFIG_TASK_OPUS_CODEC_STACK_SIZE, CONFIG_TASK_OPUS_CODEC_PRIORITY, -1},
+    {"opus_decoder", 2048 * 8, OPUS_DECODER_PRIORITY, TASK_CORE(OPUS_DECODER_CORE)},
+    {"opus_encoder", CONFIG_TASK_OPUS_CODEC_STACK_SIZE, OPUS_ENCODER_PRIORITY, TASK_CORE(OPUS_ENCODER_CORE)},
+    {"audio_communication", CONFIG_TASK_AUDIO_PROCESSOR_STACK_SIZE, CONFIG_TASK_AUDIO_PROCESSOR_PRIORITY, TASK_CORE(CONFIG_TASK_AUDIO_PROCESSOR_CORE)},
+    {"audio_detection", CONFIG_TASK_WAKE_WORD_STACK_SIZE, CONFIG_TASK_WAKE_WORD_PRIORITY, TASK_CORE(CONFIG_TASK_WAKE_WORD_CORE)},
+    {"LedEvent", CONFIG_TASK_LED_EVENT_STACK_SIZE, CONFIG_TASK_LED_EVENT_PRIORITY, -1},
+    // The stack of the LVGL task is left to each display, the port task is named "taskLVGL"
+    {"taskLVGL", 0, CONFIG_TASK_LVGL_PRIORITY, TASK_CORE(CONFIG_TASK_LVGL_CORE)},
+    {"network_tx", CONFIG_TASK_NETWORK_TX_STACK_SIZE, CONFIG_TASK_NETWORK_TX_PRIORITY, -1},
+    {"tts_cache", CONFIG_TASK_TTS_CACHE_PLAYER_STACK_SIZE, CONFIG_TASK_TTS_CACHE_PLAYER_PRIORITY, -1},
+    {"tts_cache_write", CONFIG_TASK_TTS_CACHE_WRITER_STACK_SIZE, CONFIG_TASK_TTS_CACHE_WRITER_PRIORITY, -1},
+};
+
+const TaskProfile& TaskProfiles::Get(TaskId id) {
+    return kTaskProfiles[id];
+}
+
+BaseType_t TaskProfiles::Create(TaskId id, TaskFunction_t function, void* arg, TaskHandle_t* handle) {
+    const auto& profile = kTaskProfiles[id];
+    BaseType_t ret = xTaskCreatePinnedToCore(function, profile.name, profile.stack_size, arg, profile.priority,
+        handle, profile.core >= 0 ? profile.core : tskNO_AFFINITY);
+    if (ret != pdPASS) {
+        ESP_LOGE(TAG, "Failed to create task %s with a stack of %lu bytes", profile.name, profile.stack_size);
+    }
+    return ret;
+}
+
+// Calls back with each task of the profile that is running and its stack high-water mark
+template <typename Callback>
+static void ForEachProfiledTask(Callback callback) {
+    UBaseType_t size = uxTaskGetNumberOfTasks() + 5;
+    auto tasks = (TaskStatus_t*)malloc(sizeof(TaskStatus_t) * size);
+    if (tasks == nullptr) {
+        return;
+    }
+    size = uxTaskGetSystemState(tasks, size, nullptr);
+    for (const auto& profile : kTaskProfiles) {
+        for (UBaseType_t i = 0; i < size; i++) {
+            if (strcmp(tasks[i].pcTaskName, profile.name) == 0) {
+                callback(profile, tasks[i]);
+                break;
+            }
+        }
+    }
+    free(tasks);
+}
+
+void TaskProfiles::PrintStackUsage() {
+    ForEachProfiledTask([](const TaskProfile& profile, const TaskStatus_t& task) {
+        ESP_LOGI(TAG, "%s: priority %u, core %d, stack %lu, %lu never used", profile.name, task.uxCurrentPriority,
+            profile.core, profile.stack_size, (uint32_t)task.usStackHighWaterMark);
+    });
+}
+
+cJSON* TaskProfiles::GetStackUsageJson() {
+    auto json = cJSON_CreateObject();
+    ForEachProfiledTask([json](const TaskProfile& profile, const TaskStatus_t& task) {
+        auto item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "priority", task.uxCurrentPriority);
+        cJSON_AddNumberToObject(item, "stack_size", profile.stack_size);
+        cJSON_AddNumberToObject(item, "stack_never_used", task.usStackHighWaterMark);
+        cJSON_AddItemToObject(json, profile.name, item);
+    });
+    return json;
+}
@@ -0,0 +1,50 @@
+#ifndef _TASK_PROFILE_H_
+#define _TASK_PROFILE_H_
+
+#include <cJSON.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <cstdint>
+
+// The long-running tasks of the firmware, their placement comes from the Task Topology menu
+enum TaskId {
+    kTaskAudioInput,
+    kTaskAudioOutput,
+    kTaskOpusCodec,
+    kTaskOpusDecoder,
+    kTaskOpusEncoder,
+    kTaskAudioProcessor,
+    kTaskWakeWord,
+    kTaskLedEvent,
+    kTaskLvgl,
+    kTaskNetworkTx,
+    kTaskTtsCachePlayer,
+    kTaskTtsCacheWriter,
+    kTaskCount,
+};
+
+struct TaskProfile {
+    const char* name;
+    uint32_t stack_size;
+    UBaseType_t priority;
+    int core;   // -1 to run on any core
+};
+
+/*
+ * The stack size, the priority and the core of each long-running task in one place.
+ *
+ * The defaults of each target are in sdkconfig.defaults.<target> and a board overrides them in
+ * the sdkconfig_append of its config.json, so a single-core C3 and a dual-core S3 or P4 are
+ * tuned without touching the code that starts the tasks.
+ */
+class TaskProfiles {
+public:
+    static const TaskProfile& Get(TaskId id);
+    static BaseType_t Create(TaskId id, TaskFunction_t function, void* arg, TaskHandle_t* handle = nullptr);
+    // The stack high-water marks of the tasks of the profile that are running
+    static void PrintStackUsage();
+    static cJSON* GetStackUsageJson();
+};
+
+#endif // _TASK_PROFILE_H_
@@ -0,0 +1,26 @@
+#include "trace_markers.h"
+
+#include <esp_log.h>
+
+#define TAG "TraceMarkers"
+
+void TraceMarkers::Initialize() {
+#if CONFIG_TRACE_MARKERS
+    static const char* const kNames[kTraceMarkerCount] = {
+        "i2s_read",
+        "i2s_write",
+        "afe_feed",
+        "afe_fetch",
+        "opus_encode",
+        "opus_decode",
+        "protocol_send",
+        "protocol_receive",
+        "lvgl_flush",
+        "main_loop_event",
+    };
+    for (int i = 0; i < kTraceMarkerCount; i++) {
+        SEGGER_SYSVIEW_NameMarker(i, kNames[i]);
+    }
+    ESP_LOGI(TAG, "%d SystemView markers named", kTraceMarkerCount);
+#endif
+}
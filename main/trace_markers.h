@@ -0,0 +1,64 @@
+#ifndef TRACE_MARKERS_H
+#define TRACE_MARKERS_H
+
+#include <sdkconfig.h>
+
+// The spans of the hot paths, the marker ids of the SystemView timeline
+enum TraceMarker {
+    kTraceI2sRead,
+    kTraceI2sWrite,
+    kTraceAfeFeed,
+    kTraceAfeFetch,
+    kTraceOpusEncode,
+    kTraceOpusDecode,
+    kTraceProtocolSend,
+    kTraceProtocolReceive,
+    kTraceLvglFlush,
+    kTraceMainLoopEvent,
+    kTraceMarkerCount,
+};
+
+/*
+ * Trace markers on the SEGGER SystemView timeline, enabled with CONFIG_TRACE_MARKERS.
+ *
+ * The counters of PerfCounters say how often and how long, the markers show when: each span is a
+ * MarkStart / MarkStop pair next to the task switches and interrupts SystemView records through
+ * esp_app_trace, over JTAG or the UART of the app trace. A span may start on one task and stop
+ * on another, the LVGL flush of a DMA panel stops in the transfer done callback.
+ *
+ * Without the option the macros expand to nothing, not even the arguments are evaluated.
+ */
+#if CONFIG_TRACE_MARKERS
+#include <SEGGER_SYSVIEW.h>
+
+#define TRACE_BEGIN(marker) SEGGER_SYSVIEW_MarkStart(marker)
+#define TRACE_END(marker) SEGGER_SYSVIEW_MarkStop(marker)
+
+class TraceScope {
+public:
+    explicit TraceScope(TraceMarker marker) : marker_(marker) { SEGGER_SYSVIEW_MarkStart(marker_); }
+    ~TraceScope() { SEGGER_SYSVIEW_MarkStop(marker_); }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    TraceMarker marker_;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+// Marks the rest of the enclosing block
+#define TRACE_SCOPE(marker) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(marker)
+#else
+#define TRACE_BEGIN(marker) do {} while (0)
+#define TRACE_END(marker) do {} while (0)
+#define TRACE_SCOPE(marker) do {} while (0)
+#endif
+
+class TraceMarkers {
+public:
+    // Names the markers in a recording running at boot, a later one shows the enum values as ids
+    static void Initialize();
+};
+
+#endif // TRACE_MARKERS_H
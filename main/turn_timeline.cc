@@ -0,0 +1,169 @@
+#include "turn_timeline.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <algorithm>
+
+#define TAG "TurnTimeline"
+
+static const char* const kEventNames[kTurnEventCount] = {
+    "vad_end", "stop_listening", "stt", "llm", "tts_start", "first_audio", "playback",
+};
+
+void TurnTimeline::Start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (active_) {
+        FinishLocked();
+    }
+    current_ = Turn();
+    active_ = true;
+    awaiting_audio_ = true;
+}
+
+void TurnTimeline::Mark(TurnEvent event) {
+    int64_t now_us = esp_timer_get_time();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!active_) {
+        return;
+    }
+    auto& time_us = current_.time_us;
+    if (event == kTurnEventVadEnd) {
+        // A pause in the speech is not its end, until the server answers
+        if (time_us[kTurnEventStt] == 0 && time_us[kTurnEventFirstAudio] == 0) {
+            time_us[event] = now_us;
+        }
+    } else if (time_us[event] == 0) {
+        time_us[event] = now_us;
+    }
+}
+
+void TurnTimeline::OnIncomingAudio(uint32_t server_timestamp_ms, uint32_t rtt_ms) {
+    int64_t now_us = esp_timer_get_time();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!active_ || !awaiting_audio_.exchange(false)) {
+        return;
+    }
+    current_.time_us[kTurnEventFirstAudio] = now_us;
+    current_.server_timestamp_ms = server_timestamp_ms;
+    current_.rtt_ms = rtt_ms;
+    if (server_timestamp_ms != 0) {
+        offset_samples_ms_[offset_next_] = now_us / 1000 - server_timestamp_ms - rtt_ms / 2;
+        offset_next_ = (offset_next_ + 1) % offset_samples_ms_.size();
+        offset_count_ = std::min(offset_count_ + 1, offset_samples_ms_.size());
+    }
+    awaiting_playback_ = true;
+}
+
+void TurnTimeline::OnPlayback() {
+    if (!awaiting_playback_.exchange(false)) {
+        return;
+    }
+    int64_t now_us = esp_timer_get_time();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!active_) {
+        return;
+    }
+    current_.time_us[kTurnEventPlayback] = now_us;
+    FinishLocked();
+}
+
+void TurnTimeline::FinishLocked() {
+    active_ = false;
+    awaiting_audio_ = false;
+    awaiting_playback_ = false;
+    auto& time_us = current_.time_us;
+    // Listening that nobody answered is not a turn
+    if (time_us[kTurnEventStt] == 0 && time_us[kTurnEventFirstAudio] == 0) {
+        return;
+    }
+    history_[history_next_] = current_;
+    history_next_ = (history_next_ + 1) % history_.size();
+    turn_count_++;
+
+    int64_t end_us = time_us[kTurnEventVadEnd] != 0 ? time_us[kTurnEventVadEnd] : time_us[kTurnEventStopListening];
+    if (end_us != 0 && time_us[kTurnEventPlayback] != 0) {
+        ESP_LOGI(TAG, "Speech end to reply: %lld ms, first audio after %lld ms, played %lld ms after it",
+            (time_us[kTurnEventPlayback] - end_us) / 1000, (time_us[kTurnEventFirstAudio] - end_us) / 1000,
+            (time_us[kTurnEventPlayback] - time_us[kTurnEventFirstAudio]) / 1000);
+    }
+}
+
+bool TurnTimeline::GetClockOffsetLocked(int64_t* offset_ms) {
+    if (offset_count_ < 2) {
+        return false;
+    }
+    auto begin = offset_samples_ms_.begin();
+    auto [min, max] = std::minmax_element(begin, begin + offset_count_);
+    if (*max - *min > kMaxOffsetSpreadMs) {
+        return false;
+    }
+    *offset_ms = *min;
+    return true;
+}
+
+cJSON* TurnTimeline::GetTurnJsonLocked(const Turn& turn, bool synced, int64_t offset_ms) {
+    auto json = cJSON_CreateObject();
+    auto& time_us = turn.time_us;
+    // The device side ends the turn with the stop, or the server with its VAD
+    int64_t end_us = time_us[kTurnEventVadEnd] != 0 ? time_us[kTurnEventVadEnd] : time_us[kTurnEventStopListening];
+    int64_t sent_us = time_us[kTurnEventStopListening] != 0 ? time_us[kTurnEventStopListening] : end_us;
+    if (end_us == 0) {
+        cJSON_AddStringToObject(json, "error", "No end of speech");
+        return json;
+    }
+    auto marks = cJSON_CreateObject();
+    for (int i = kTurnEventStopListening; i < kTurnEventCount; i++) {
+        if (time_us[i] != 0) {
+            cJSON_AddNumberToObject(marks, kEventNames[i], (time_us[i] - end_us) / 1000);
+        }
+    }
+    cJSON_AddItemToObject(json, "since_speech_end_ms", marks);
+
+    // The endpointer hangover before the stop
+    if (time_us[kTurnEventVadEnd] != 0 && time_us[kTurnEventStopListening] != 0) {
+        cJSON_AddNumberToObject(json, "endpoint_ms", (time_us[kTurnEventStopListening] - time_us[kTurnEventVadEnd]) / 1000);
+    }
+    if (time_us[kTurnEventFirstAudio] == 0) {
+        return json;
+    }
+    int64_t first_audio_ms = (time_us[kTurnEventFirstAudio] - sent_us) / 1000;
+    cJSON_AddNumberToObject(json, "rtt_ms", turn.rtt_ms);
+    int64_t network_ms = turn.rtt_ms;
+    if (synced && turn.server_timestamp_ms != 0) {
+        /* The uplink is taken for half the round trip, the downlink is measured */
+        int64_t server_sent_ms = (int64_t)turn.server_timestamp_ms + offset_ms;
+        int64_t downlink_ms = time_us[kTurnEventFirstAudio] / 1000 - server_sent_ms;
+        cJSON_AddNumberToObject(json, "downlink_ms", downlink_ms);
+        network_ms = turn.rtt_ms / 2 + downlink_ms;
+    }
+    cJSON_AddNumberToObject(json, "network_ms", network_ms);
+    cJSON_AddNumberToObject(json, "server_ms", first_audio_ms - network_ms);
+    if (time_us[kTurnEventPlayback] != 0) {
+        // The jitter buffer, the decoder and the output queue
+        cJSON_AddNumberToObject(json, "playback_ms", (time_us[kTurnEventPlayback] - time_us[kTurnEventFirstAudio]) / 1000);
+        cJSON_AddNumberToObject(json, "total_ms", (time_us[kTurnEventPlayback] - end_us) / 1000);
+    }
+    return json;
+}
+
+cJSON* TurnTimeline::GetStatsJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "count", turn_count_);
+    int64_t offset_ms = 0;
+    bool synced = GetClockOffsetLocked(&offset_ms);
+    if (synced) {
+        // Server clock minus the esp_timer milliseconds
+        cJSON_AddNumberToObject(json, "clock_offset_ms", -offset_ms);
+    }
+    cJSON_AddBoolToObject(json, "clock_synced", synced);
+    auto turns = cJSON_CreateArray();
+    size_t count = std::min<size_t>(turn_count_, history_.size());
+    for (size_t i = 0; i < count; i++) {
+        // Newest first
+        auto& turn = history_[(history_next_ + history_.size() - 1 - i) % history_.size()];
+        cJSON_AddItemToArray(turns, GetTurnJsonLocked(turn, synced, offset_ms));
+    }
+    cJSON_AddItemToObject(json, "turns", turns);
+    return json;
+}
@@ -0,0 +1,89 @@
+#ifndef _TURN_TIMELINE_H_
+#define _TURN_TIMELINE_H_
+
+#include <cJSON.h>
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// Completed turns kept for the report
+#define TURN_TIMELINE_HISTORY_SIZE 8
+
+enum TurnEvent {
+    kTurnEventVadEnd,           // The local VAD heard the end of the speech, the last one counts
+    kTurnEventStopListening,    // stop listening sent
+    kTurnEventStt,              // The first stt message
+    kTurnEventLlm,              // The first llm message
+    kTurnEventTtsStart,         // tts start
+    kTurnEventFirstAudio,       // The first TTS frame received
+    kTurnEventPlayback,         // That frame written to I2S, ends the turn
+    kTurnEventCount,
+};
+
+/*
+ * Where the time from the end of the speech to the first reply on the speaker goes.
+ *
+ * Start() begins a turn when the device listens, Mark() records the first time of each
+ * event, and the first write of the reply to the codec completes the turn. A turn that the
+ * next Start() interrupts is kept with the events it got.
+ *
+ * The server clock is estimated from the timestamp of the first TTS frame of each turn,
+ * the server stamps it when it is sent: the smallest receive time minus timestamp of the
+ * recent turns is the offset plus the fastest downlink, half the hello round trip is taken
+ * for that downlink. The offset is only used once the turns agree on it, the timestamp of
+ * a server that counts the stream position instead of its clock never does.
+ *
+ * Mark() and OnIncomingAudio() run on the main and network tasks, OnPlayback() on the audio
+ * output task. Both per packet calls only check an atomic when the turn does not wait for them.
+ */
+class TurnTimeline {
+public:
+    static TurnTimeline& GetInstance() {
+        static TurnTimeline instance;
+        return instance;
+    }
+
+    void Start();
+    void Mark(TurnEvent event);
+    bool awaiting_audio() const { return awaiting_audio_; }
+    // Network task: a TTS frame was received, rtt_ms is the hello round trip
+    void OnIncomingAudio(uint32_t server_timestamp_ms, uint32_t rtt_ms);
+    bool awaiting_playback() const { return awaiting_playback_; }
+    // Audio output task: audio from the server was written to the codec
+    void OnPlayback();
+
+    // {"turns":[...], "count", "clock_offset_ms"}, the caller owns the object
+    cJSON* GetStatsJson();
+
+private:
+    static constexpr int64_t kMaxOffsetSpreadMs = 1000;
+
+    struct Turn {
+        std::array<int64_t, kTurnEventCount> time_us = {};     // 0 for an event that did not happen
+        uint32_t server_timestamp_ms = 0;
+        uint32_t rtt_ms = 0;
+    };
+
+    std::mutex mutex_;
+    Turn current_;
+    bool active_ = false;
+    std::atomic<bool> awaiting_audio_ = false;
+    std::atomic<bool> awaiting_playback_ = false;
+    std::array<Turn, TURN_TIMELINE_HISTORY_SIZE> history_;
+    size_t history_next_ = 0;
+    uint32_t turn_count_ = 0;
+    // Receive time minus server timestamp of the first frames of the recent turns
+    std::array<int64_t, TURN_TIMELINE_HISTORY_SIZE> offset_samples_ms_ = {};
+    size_t offset_next_ = 0;
+    size_t offset_count_ = 0;
+
+    TurnTimeline() = default;
+    void FinishLocked();
+    bool GetClockOffsetLocked(int64_t* offset_ms);
+    cJSON* GetTurnJsonLocked(const Turn& turn, bool synced, int64_t offset_ms);
+};
+
+#endif // _TURN_TIMELINE_H_
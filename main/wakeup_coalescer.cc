@@ -0,0 +1,152 @@
+#include "wakeup_coalescer.h"
+#include "sdkconfig.h"
+
+#include <esp_log.h>
+#include <algorithm>
+#include <utility>
+
+#define TAG "WakeupCoalescer"
+
+WakeupCoalescer::WakeupCoalescer() {
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            static_cast<WakeupCoalescer*>(arg)->OnTimer();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "wakeup_window",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer_));
+    epoch_us_ = esp_timer_get_time();
+    minute_start_us_ = epoch_us_;
+}
+
+int64_t WakeupCoalescer::window_us() const {
+    if (sleeping_) {
+        int64_t beacons = std::max<int64_t>(1, CONFIG_WAKEUP_SLEEP_WINDOW_MS * 1000LL / WAKEUP_BEACON_INTERVAL_US);
+        return beacons * WAKEUP_BEACON_INTERVAL_US;
+    }
+    return WAKEUP_AWAKE_WINDOW_BEACONS * WAKEUP_BEACON_INTERVAL_US;
+}
+
+int WakeupCoalescer::Add(const char* name, int period_ms, Callback callback) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.push_back({name, period_ms * 1000LL, 0, false, std::move(callback)});
+    return jobs_.size() - 1;
+}
+
+void WakeupCoalescer::Remove(int id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_[id].active = false;
+    jobs_[id].callback = nullptr;
+    ScheduleLocked(esp_timer_get_time());
+}
+
+void WakeupCoalescer::Start(int id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int64_t now_us = esp_timer_get_time();
+    auto& job = jobs_[id];
+    if (job.active || job.callback == nullptr) {
+        return;
+    }
+    job.active = true;
+    job.due_us = now_us + job.period_us;
+    ScheduleLocked(now_us);
+}
+
+void WakeupCoalescer::Stop(int id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_[id].active = false;
+    ScheduleLocked(esp_timer_get_time());
+}
+
+void WakeupCoalescer::SetSleeping(bool sleeping) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The power save and the sleep timers both ask for it
+    if (sleeping) {
+        sleep_requests_++;
+    } else if (sleep_requests_ > 0) {
+        sleep_requests_--;
+    }
+    if (sleeping_ == (sleep_requests_ > 0)) {
+        return;
+    }
+    sleeping_ = sleep_requests_ > 0;
+    ESP_LOGI(TAG, "Wake windows of %d ms", int(window_us() / 1000));
+    // The next window is taken again, an awake job should not wait for the end of a long one
+    next_wakeup_us_ = 0;
+    ScheduleLocked(esp_timer_get_time());
+}
+
+void WakeupCoalescer::OnTimer() {
+    std::vector<std::pair<Callback, int>> due;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        int64_t now_us = esp_timer_get_time();
+        next_wakeup_us_ = 0;
+        // A job due within half a beacon interval runs in this window, the timer may fire early
+        int64_t until_us = now_us + WAKEUP_BEACON_INTERVAL_US / 2;
+        for (auto& job : jobs_) {
+            if (!job.active || job.due_us > until_us) {
+                continue;
+            }
+            int periods = 1 + std::max<int64_t>(0, now_us - job.due_us) / job.period_us;
+            job.due_us += periods * job.period_us;
+            due.emplace_back(job.callback, periods);
+        }
+
+        if (now_us - minute_start_us_ >= 60000000LL) {
+            last_minute_wakeups_ = minute_wakeups_;
+            last_minute_runs_ = minute_runs_;
+            minute_wakeups_ = 0;
+            minute_runs_ = 0;
+            minute_start_us_ = now_us;
+        }
+        wakeups_++;
+        minute_wakeups_++;
+        runs_ += due.size();
+        minute_runs_ += due.size();
+        ScheduleLocked(now_us);
+    }
+
+    for (auto& [callback, periods] : due) {
+        callback(periods);
+    }
+}
+
+void WakeupCoalescer::ScheduleLocked(int64_t now_us) {
+    int64_t earliest_us = INT64_MAX;
+    for (const auto& job : jobs_) {
+        if (job.active) {
+            earliest_us = std::min(earliest_us, job.due_us);
+        }
+    }
+    if (earliest_us == INT64_MAX) {
+        esp_timer_stop(timer_);
+        next_wakeup_us_ = 0;
+        return;
+    }
+
+    // The first window boundary at or after the earliest job, and after now
+    int64_t window = window_us();
+    int64_t target_us = std::max(earliest_us, now_us + 1);
+    int64_t wakeup_us = epoch_us_ + (target_us - epoch_us_ + window - 1) / window * window;
+    if (wakeup_us == next_wakeup_us_) {
+        return;
+    }
+    esp_timer_stop(timer_);
+    esp_timer_start_once(timer_, wakeup_us - now_us);
+    next_wakeup_us_ = wakeup_us;
+}
+
+cJSON* WakeupCoalescer::GetStatsJson() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "window_ms", window_us() / 1000);
+    cJSON_AddNumberToObject(root, "wakeups_per_minute", last_minute_wakeups_);
+    // The jobs that would have woken the CPU each if they had a timer of their own
+    cJSON_AddNumberToObject(root, "jobs_per_minute", last_minute_runs_);
+    cJSON_AddNumberToObject(root, "wakeups", wakeups_);
+    return root;
+}
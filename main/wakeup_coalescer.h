@@ -0,0 +1,76 @@
+#ifndef _WAKEUP_COALESCER_H_
+#define _WAKEUP_COALESCER_H_
+
+#include <cJSON.h>
+#include <esp_timer.h>
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// 100 TU, the beacon interval of nearly every access point
+#define WAKEUP_BEACON_INTERVAL_US 102400
+// Awake, a window of about a second for the status bar clock
+#define WAKEUP_AWAKE_WINDOW_BEACONS 10
+
+/*
+ * Runs the periodic work of the device in shared wake windows instead of on a timer each.
+ *
+ * The windows are whole beacon intervals counted from one epoch, so the CPU wakes once for all
+ * the work that is due and keeps a fixed phase to the Wi-Fi DTIM wakeups instead of drifting
+ * through them. While the device sleeps the windows stretch to CONFIG_WAKEUP_SLEEP_WINDOW_MS and
+ * a job runs once with the number of its periods that passed.
+ *
+ * The callbacks run in the esp_timer task, one after the other.
+ */
+class WakeupCoalescer {
+public:
+    typedef std::function<void(int periods)> Callback;
+
+    static WakeupCoalescer& GetInstance() {
+        static WakeupCoalescer instance;
+        return instance;
+    }
+
+    // The job is idle until started, the id stays valid until Remove()
+    int Add(const char* name, int period_ms, Callback callback);
+    void Remove(int id);
+    void Start(int id);
+    void Stop(int id);
+    // Counted, the windows stay long until every SetSleeping(true) got its SetSleeping(false)
+    void SetSleeping(bool sleeping);
+    cJSON* GetStatsJson();
+
+private:
+    struct Job {
+        const char* name;
+        int64_t period_us;
+        int64_t due_us;
+        bool active;
+        Callback callback;
+    };
+
+    std::mutex mutex_;
+    std::vector<Job> jobs_;
+    esp_timer_handle_t timer_ = nullptr;
+    int64_t epoch_us_ = 0;
+    int64_t next_wakeup_us_ = 0;
+    int sleep_requests_ = 0;
+    bool sleeping_ = false;
+    uint32_t wakeups_ = 0;
+    uint32_t runs_ = 0;
+    // Counts of the last full minute
+    int64_t minute_start_us_ = 0;
+    uint32_t minute_wakeups_ = 0;
+    uint32_t minute_runs_ = 0;
+    uint32_t last_minute_wakeups_ = 0;
+    uint32_t last_minute_runs_ = 0;
+
+    WakeupCoalescer();
+    void OnTimer();
+    void ScheduleLocked(int64_t now_us);
+    int64_t window_us() const;
+};
+
+#endif // _WAKEUP_COALESCER_H_
@@ -1,54 +1,140 @@
 import socket
+import struct
 import wave
 import argparse
 
 
 '''
   Create a UDP socket and bind it to the server's IP:8000.
-  Listen for incoming messages and print them to the console.
-  Save the audio to a WAV file.
+  Receive the records of the audio debugger taps and save each tap to a WAV file,
+  the AEC reference channels of the input to a file of their own.
+  Lost records are filled with silence, so the files stay aligned in time.
 '''
-def main(samplerate, channels):
+HEADER = struct.Struct('<HBBBBBBIIHH')
+MAGIC = 0x4441
+TAPS = ['input', 'processed', 'playback']
+ENCODING_PCM16 = 0
+ENCODING_IMA_ADPCM = 1
+
+IMA_STEPS = [
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230, 253, 279, 307,
+    337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+]
+IMA_INDEX = [-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8]
+
+
+def decode_ima_adpcm(block, frames):
+    """The samples of one channel: the first sample, the step index, a padding byte and 4-bit codes"""
+    predictor, index = struct.unpack_from('<hB', block, 0)
+    samples = []
+    for i in range(frames):
+        code = (block[4 + i // 2] >> (4 if i & 1 else 0)) & 0x0F
+        step = IMA_STEPS[index]
+        delta = step >> 3
+        if code & 4:
+            delta += step
+        if code & 2:
+            delta += step >> 1
+        if code & 1:
+            delta += step >> 2
+        predictor += -delta if code & 8 else delta
+        predictor = max(-32768, min(32767, predictor))
+        index = max(0, min(88, index + IMA_INDEX[code]))
+        samples.append(predictor)
+    return samples
+
+
+def decode_samples(encoding, payload, frames, channels):
+    """Interleaved samples of all channels"""
+    if encoding == ENCODING_PCM16:
+        return list(struct.unpack_from(f'<{frames * channels}h', payload, 0))
+    block_size = 4 + (frames + 1) // 2
+    decoded = [decode_ima_adpcm(payload[c * block_size:(c + 1) * block_size], frames) for c in range(channels)]
+    return [decoded[c][i] for i in range(frames) for c in range(channels)]
+
+
+class TapWriter:
+    def __init__(self, name, sample_rate, channels, reference_mask):
+        self.channel_groups = []
+        microphones = [c for c in range(channels) if not reference_mask & (1 << c)]
+        references = [c for c in range(channels) if reference_mask & (1 << c)]
+        for suffix, group in (('', microphones), ('_reference', references)):
+            if group:
+                filename = f"{name}{suffix}_{sample_rate}_{len(group)}.wav"
+                wav_file = wave.open(filename, "wb")
+                wav_file.setnchannels(len(group))
+                wav_file.setsampwidth(2)
+                wav_file.setframerate(sample_rate)
+                self.channel_groups.append((group, wav_file, filename))
+                print(f"Saving {name}{suffix} to {filename}")
+        self.channels = channels
+        self.sequence = None
+        self.lost = 0
+
+    def write(self, sequence, samples, frames):
+        if self.sequence is not None and sequence != self.sequence:
+            # Fill the lost records with silence of the same length
+            missing = (sequence - self.sequence) & 0xFFFFFFFF
+            self.lost += missing
+            for group, wav_file, _ in self.channel_groups:
+                wav_file.writeframes(bytes(missing * frames * len(group) * 2))
+        self.sequence = (sequence + 1) & 0xFFFFFFFF
+        for group, wav_file, _ in self.channel_groups:
+            picked = [samples[i * self.channels + c] for i in range(frames) for c in group]
+            wav_file.writeframes(struct.pack(f'<{len(picked)}h', *picked))
+
+    def close(self):
+        for _, wav_file, filename in self.channel_groups:
+            wav_file.close()
+            print(f"WAV file '{filename}' saved successfully")
+
+
+def main(port):
     # Create a UDP socket
     server_socket = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
-    server_socket.bind(('0.0.0.0', 8000))
-
-    # Create WAV file with parameters
-    filename = f"{samplerate}_{channels}.wav"
-    wav_file = wave.open(filename, "wb")
-    wav_file.setnchannels(channels)     # channels parameter
-    wav_file.setsampwidth(2)            # 2 bytes per sample (16-bit)
-    wav_file.setframerate(samplerate)   # samplerate parameter
+    server_socket.bind(('0.0.0.0', port))
+    writers = {}
 
-    print(f"Start saving audio from 0.0.0.0:8000 to {filename}...")
+    print(f"Start saving audio from 0.0.0.0:{port}...")
 
     try:
         while True:
-            # Receive a message from the client
-            message, address = server_socket.recvfrom(8000)
-            
-            # Write PCM data to WAV file
-            wav_file.writeframes(message)
-
-            # Print length of the message
-            print(f"Received {len(message)} bytes from {address}")
-    
+            # Receive a datagram of one or more records from the device
+            message, address = server_socket.recvfrom(2048)
+            position = 0
+            while position + HEADER.size <= len(message):
+                (magic, version, tap, channels, reference_mask, encoding, _,
+                    sequence, sample_rate, frames, size) = HEADER.unpack_from(message, position)
+                if magic != MAGIC or version != 1 or tap >= len(TAPS):
+                    print(f"Skipped {len(message) - position} bytes that are not a record from {address}")
+                    break
+                payload = message[position + HEADER.size:position + HEADER.size + size]
+                position += HEADER.size + size
+                # A writer per format, a tap whose format changes starts a new file
+                key = (tap, sample_rate, channels, reference_mask)
+                if key not in writers:
+                    writers[key] = TapWriter(TAPS[tap], sample_rate, channels, reference_mask)
+                writers[key].write(sequence, decode_samples(encoding, payload, frames, channels), frames)
+
     except KeyboardInterrupt:
         print("\nStopping recording...")
-    
+
     finally:
         # Close files and socket
-        wav_file.close()
+        for writer in writers.values():
+            if writer.lost:
+                print(f"{writer.lost} records were lost")
+            writer.close()
         server_socket.close()
-        print(f"WAV file '{filename}' saved successfully")
 
 
 if __name__ == "__main__":
-    parser = argparse.ArgumentParser(description='UDP音频数据接收器，保存为WAV文件')
-    parser.add_argument('--samplerate', '-s', type=int, default=16000, 
-                        help='采样率 (默认: 16000)')
-    parser.add_argument('--channels', '-c', type=int, default=2, 
-                        help='声道数 (默认: 2)')
-    
+    parser = argparse.ArgumentParser(description='UDP音频数据接收器，按采集点保存为WAV文件')
+    parser.add_argument('--port', '-p', type=int, default=8000,
+                        help='端口 (默认: 8000)')
+
     args = parser.parse_args()
-    main(args.samplerate, args.channels)
+    main(args.port)
@@ -361,8 +361,8 @@ def compute_checksum(data):
 
 
 def sort_key(filename):
-    basename, extension = os.path.splitext(filename)
-    return extension, basename
+    # The firmware binary searches the table, in the byte order of the names
+    return filename.encode('utf-8')
 
 
 def pack_assets_simple(target_path, include_path, out_file, assets_path, max_name_len=32):
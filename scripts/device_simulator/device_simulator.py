@@ -0,0 +1,295 @@
+import argparse
+import asyncio
+import glob
+import json
+import random
+import struct
+import sys
+import time
+import uuid
+
+import websockets
+
+
+'''
+  Simulate many devices against a WebSocket server in one process, to load-test the server.
+  Each device speaks the protocol of the firmware (docs/websocket.md): the same headers and
+  hello, a manual listen with a recorded utterance streamed as Opus packets in real time, then
+  waiting for the reply. The MCP initialize and tools/list calls are answered, so the server
+  treats the simulated devices as real ones.
+  The times of every round are gathered and a summary with percentiles is printed at the end.
+'''
+BINARY_PROTOCOL2 = struct.Struct('>HHIII')
+BINARY_PROTOCOL3 = struct.Struct('>BBH')
+BINARY_PROTOCOL_TYPE_OPUS_FRAMES = 1
+SERVER_HELLO_TIMEOUT = 10
+
+
+def read_opus_packets(path):
+    """The Opus packets of an Ogg file, without the OpusHead and OpusTags headers"""
+    with open(path, 'rb') as f:
+        data = f.read()
+    packets = []
+    packet = b''
+    offset = 0
+    while offset + 27 <= len(data):
+        if data[offset:offset + 4] != b'OggS':
+            raise ValueError(f'{path}: not an Ogg page at {offset}')
+        segments = data[offset + 26]
+        table = data[offset + 27:offset + 27 + segments]
+        position = offset + 27 + segments
+        for size in table:
+            packet += data[position:position + size]
+            position += size
+            # A segment shorter than 255 ends the packet
+            if size < 255:
+                packets.append(packet)
+                packet = b''
+        offset = position
+    if len(packets) < 2 or not packets[0].startswith(b'OpusHead'):
+        raise ValueError(f'{path}: not an Ogg Opus file')
+    return packets[2:]
+
+
+def percentile(values, p):
+    if not values:
+        return 0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+class Stats:
+    def __init__(self):
+        self.samples = {}
+        self.counters = {}
+
+    def add(self, name, value):
+        self.samples.setdefault(name, []).append(value)
+
+    def count(self, name, value=1):
+        self.counters[name] = self.counters.get(name, 0) + value
+
+    def print_summary(self, elapsed):
+        print(f'\n{elapsed:.1f} s')
+        for name, value in sorted(self.counters.items()):
+            print(f'  {name:<24}{value}')
+        print(f'  {"":<24}{"count":>8}{"mean":>10}{"p50":>10}{"p90":>10}{"p99":>10}{"max":>10}')
+        for name, values in sorted(self.samples.items()):
+            mean = sum(values) / len(values)
+            print(f'  {name + " (ms)":<24}{len(values):>8}{mean:>10.0f}{percentile(values, 50):>10.0f}'
+                  f'{percentile(values, 90):>10.0f}{percentile(values, 99):>10.0f}{max(values):>10.0f}')
+
+
+class SimulatedDevice:
+    def __init__(self, index, args, utterances, stats):
+        self.index = index
+        self.args = args
+        self.utterances = utterances
+        self.stats = stats
+        self.mac = '02:' + ':'.join(f'{random.randint(0, 255):02x}' for _ in range(5))
+        self.uuid = str(uuid.uuid4())
+        self.session_id = ''
+        self.server_hello = asyncio.Event()
+        self.tts_stop = asyncio.Event()
+        self.round_start = 0
+        self.listen_stop_time = 0
+        self.first_audio_time = None
+        self.stt_time = None
+
+    def elapsed_ms(self, start):
+        return (time.monotonic() - start) * 1000
+
+    def pack_audio(self, payload, timestamp):
+        version = self.args.version
+        if version == 2:
+            return BINARY_PROTOCOL2.pack(version, 0, 0, timestamp, len(payload)) + payload
+        if version == 3:
+            return BINARY_PROTOCOL3.pack(0, 0, len(payload)) + payload
+        return payload
+
+    def count_audio(self, data):
+        """The Opus packets in an incoming binary message"""
+        version = self.args.version
+        if version == 2:
+            return 1 if len(data) >= BINARY_PROTOCOL2.size else 0
+        if version >= 3 and len(data) >= BINARY_PROTOCOL3.size:
+            message_type = data[0]
+            if version == 4 and message_type == BINARY_PROTOCOL_TYPE_OPUS_FRAMES and len(data) > BINARY_PROTOCOL3.size:
+                return data[BINARY_PROTOCOL3.size]
+            return 1
+        return 1
+
+    def hello(self):
+        features = {'mcp': True}
+        if self.args.version == 4:
+            features['max_frames_per_message'] = 16
+        return json.dumps({
+            'type': 'hello',
+            'version': self.args.version,
+            'features': features,
+            'transport': 'websocket',
+            'audio_params': {
+                'format': 'opus',
+                'sample_rate': 16000,
+                'channels': 1,
+                'frame_duration': self.args.frame_duration,
+            },
+        })
+
+    async def send_json(self, ws, message):
+        message['session_id'] = self.session_id
+        await ws.send(json.dumps(message))
+
+    async def handle_mcp(self, ws, payload):
+        method = payload.get('method')
+        if 'id' not in payload:
+            return
+        if method == 'initialize':
+            result = {
+                'protocolVersion': '2024-11-05',
+                'capabilities': {'tools': {}},
+                'serverInfo': {'name': 'device-simulator', 'version': '1.0.0'},
+            }
+        elif method == 'tools/list':
+            result = {'tools': []}
+        else:
+            await self.send_json(ws, {'type': 'mcp', 'payload': {
+                'jsonrpc': '2.0', 'id': payload['id'], 'error': {'code': -32601, 'message': 'Method not found'}}})
+            return
+        await self.send_json(ws, {'type': 'mcp', 'payload': {'jsonrpc': '2.0', 'id': payload['id'], 'result': result}})
+
+    async def receive(self, ws):
+        async for message in ws:
+            if isinstance(message, bytes):
+                packets = self.count_audio(message)
+                self.stats.count('rx_audio_packets', packets)
+                self.stats.count('rx_audio_bytes', len(message))
+                if self.first_audio_time is None and self.listen_stop_time:
+                    self.first_audio_time = time.monotonic()
+                    self.stats.add('first_audio', self.elapsed_ms(self.listen_stop_time))
+                continue
+            try:
+                root = json.loads(message)
+            except ValueError:
+                self.stats.count('bad_json')
+                continue
+            message_type = root.get('type')
+            if message_type == 'hello':
+                if root.get('transport') != 'websocket':
+                    self.stats.count('bad_hello')
+                    continue
+                self.session_id = root.get('session_id', '')
+                self.server_hello.set()
+            elif message_type == 'stt':
+                if self.stt_time is None and self.listen_stop_time:
+                    self.stt_time = time.monotonic()
+                    self.stats.add('stt', self.elapsed_ms(self.listen_stop_time))
+            elif message_type == 'tts':
+                if root.get('state') == 'stop':
+                    self.tts_stop.set()
+            elif message_type == 'mcp':
+                await self.handle_mcp(ws, root.get('payload', {}))
+
+    async def connect(self):
+        headers = {
+            'Authorization': f'Bearer {self.args.token}',
+            'Protocol-Version': str(self.args.version),
+            'Device-Id': self.mac,
+            'Client-Id': self.uuid,
+        }
+        try:
+            return await websockets.connect(self.args.url, additional_headers=headers, max_size=None)
+        except TypeError:
+            # websockets before 14 names them extra_headers
+            return await websockets.connect(self.args.url, extra_headers=headers, max_size=None)
+
+    async def speak(self, ws, packets):
+        """Streams the packets at the pace of the microphone"""
+        interval = self.args.frame_duration / 1000
+        start = time.monotonic()
+        for i, packet in enumerate(packets):
+            await ws.send(self.pack_audio(packet, int(i * self.args.frame_duration)))
+            self.stats.count('tx_audio_packets')
+            delay = start + (i + 1) * interval - time.monotonic()
+            if delay > 0:
+                await asyncio.sleep(delay)
+
+    async def run_round(self, ws):
+        self.tts_stop.clear()
+        self.listen_stop_time = 0
+        self.first_audio_time = None
+        self.stt_time = None
+        self.round_start = time.monotonic()
+        await self.send_json(ws, {'type': 'listen', 'state': 'start', 'mode': 'manual'})
+        await self.speak(ws, random.choice(self.utterances))
+        await self.send_json(ws, {'type': 'listen', 'state': 'stop'})
+        self.listen_stop_time = time.monotonic()
+        try:
+            await asyncio.wait_for(self.tts_stop.wait(), self.args.reply_timeout)
+            self.stats.add('reply', self.elapsed_ms(self.listen_stop_time))
+            self.stats.count('rounds')
+        except asyncio.TimeoutError:
+            self.stats.count('reply_timeouts')
+
+    async def run(self):
+        start = time.monotonic()
+        try:
+            ws = await self.connect()
+        except Exception as e:
+            self.stats.count('connect_failures')
+            if self.args.verbose:
+                print(f'device {self.index}: connect failed: {e}', file=sys.stderr)
+            return
+        self.stats.add('connect', self.elapsed_ms(start))
+        receiver = asyncio.create_task(self.receive(ws))
+        try:
+            start = time.monotonic()
+            await ws.send(self.hello())
+            await asyncio.wait_for(self.server_hello.wait(), SERVER_HELLO_TIMEOUT)
+            self.stats.add('hello', self.elapsed_ms(start))
+            for _ in range(self.args.rounds):
+                await self.run_round(ws)
+                await asyncio.sleep(random.uniform(0, self.args.think_time))
+        except asyncio.TimeoutError:
+            self.stats.count('hello_timeouts')
+        except websockets.ConnectionClosed:
+            self.stats.count('disconnects')
+        finally:
+            receiver.cancel()
+            await ws.close()
+
+
+async def main(args):
+    paths = sorted(glob.glob(args.utterances))
+    if not paths:
+        print(f'No utterances match {args.utterances}', file=sys.stderr)
+        return 1
+    utterances = [read_opus_packets(path) for path in paths]
+    print(f'{len(utterances)} utterances, {args.devices} devices, {args.rounds} rounds each')
+
+    stats = Stats()
+    start = time.monotonic()
+    tasks = []
+    for i in range(args.devices):
+        tasks.append(asyncio.create_task(SimulatedDevice(i, args, utterances, stats).run()))
+        if args.ramp > 0:
+            await asyncio.sleep(args.ramp)
+    await asyncio.gather(*tasks)
+    stats.print_summary(time.monotonic() - start)
+    return 0
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Load-test a server with many simulated devices')
+    parser.add_argument('--url', required=True, help='WebSocket URL of the server, e.g. ws://127.0.0.1:8000/xiaozhi/v1/')
+    parser.add_argument('--token', default='test-token', help='Access token sent as the Authorization header')
+    parser.add_argument('--utterances', required=True, help='Glob of the Ogg Opus files to speak, 16 kHz mono')
+    parser.add_argument('--devices', type=int, default=10, help='Number of simulated devices')
+    parser.add_argument('--rounds', type=int, default=3, help='Utterances spoken by each device')
+    parser.add_argument('--ramp', type=float, default=0.05, help='Seconds between device starts')
+    parser.add_argument('--think-time', type=float, default=2.0, help='Longest random pause between rounds, in seconds')
+    parser.add_argument('--reply-timeout', type=float, default=30.0, help='Seconds to wait for the tts stop of a round')
+    parser.add_argument('--version', type=int, default=1, choices=[1, 2, 3, 4], help='Binary protocol version')
+    parser.add_argument('--frame-duration', type=int, default=60, help='Duration of an Opus packet in ms')
+    parser.add_argument('--verbose', action='store_true')
+    sys.exit(asyncio.run(main(parser.parse_args())))
@@ -17,6 +17,9 @@ namespace Lang {{
     // 语言元数据
     constexpr const char* CODE = "{lang_code}";
 
+    // 字符串资源用到的字符，用于预热字形缓存
+    constexpr const char* GLYPHS = "{glyphs}";
+
     // 字符串资源 (en-US as fallback for missing keys)
     namespace Strings {{
 {strings}
@@ -105,6 +108,10 @@ def generate_header(lang_code, output_path):
         value = value.replace('"', '\\"')
         strings.append(f'        constexpr const char* {key.upper()} = "{value}";')
 
+    # 去重后的可见字符，转义引号与反斜杠
+    glyphs = sorted(set(c for value in merged_strings.values() for c in value if c.isprintable() and not c.isspace()))
+    glyphs = ''.join(glyphs).replace('\\', '\\\\').replace('"', '\\"')
+
     # 收集音效文件：以 en-US 为基准，用户语言覆盖
     current_lang_dir = os.path.join(assets_dir, 'locales', lang_code)
     base_lang_dir = os.path.join(assets_dir, 'locales', 'en-US')
@@ -164,6 +171,7 @@ def generate_header(lang_code, output_path):
     content = HEADER_TEMPLATE.format(
         lang_code=lang_code,
         lang_code_for_font=lang_code.replace('-', '_').lower(),
+        glyphs=glyphs,
         strings="\n".join(sorted(strings)),
         sounds="\n".join(sorted(sounds))
     )
@@ -73,20 +73,89 @@ def process_wakenet_model(wakenet_model_dir, build_dir, assets_dir):
         return None
 
 
-def process_text_font(text_font_file, assets_dir):
-    """Process text_font parameter"""
+def process_text_font(text_font_file, assets_dir, subset=False, langs=None, corpus=None, top_chars=3000, fallback=True):
+    """Process text_font parameter, returns the font and its fallback font if any"""
     if not text_font_file:
-        return None
+        return None, None
     
-    # Copy input file to build/assets directory
     font_filename = os.path.basename(text_font_file)
     font_dst = os.path.join(assets_dir, font_filename)
+    if subset:
+        from font_subset import subset_font
+
+        # The glyphs of the strings and of the common chat text, the firmware loads the rest on demand
+        locales_dir = os.path.join(os.path.dirname(os.path.abspath(__file__)), "../../main/assets/locales")
+        fallback_filename = "font_fallback.bin" if fallback else None
+        fallback_dst = os.path.join(assets_dir, fallback_filename) if fallback else None
+        if subset_font(text_font_file, font_dst, fallback_dst, locales_dir, langs, corpus, top_chars):
+            return font_filename, fallback_filename
+        print("Warning: Shipping the whole font")
+
+    # Copy input file to build/assets directory
     copy_file(text_font_file, font_dst)
     
-    return font_filename
+    return font_filename, None
+
+
+def encode_qoi(src_file, dst_file):
+    """Encode an image as QOI, the firmware decodes it when it is first drawn"""
+    from PIL import Image
+
+    with Image.open(src_file) as img:
+        channels = 4 if img.mode in ('RGBA', 'LA', 'P') else 3
+        img = img.convert('RGBA' if channels == 4 else 'RGB')
+        width, height = img.size
+        pixels = img.tobytes()
 
+    out = bytearray(b'qoif')
+    out += width.to_bytes(4, 'big') + height.to_bytes(4, 'big') + bytes([channels, 0])
+    index = [(0, 0, 0, 0)] * 64
+    prev = (0, 0, 0, 255)
+    run = 0
+    count = width * height
+    for i in range(count):
+        offset = i * channels
+        if channels == 4:
+            px = tuple(pixels[offset:offset + 4])
+        else:
+            px = tuple(pixels[offset:offset + 3]) + (255,)
+        if px == prev:
+            run += 1
+            if run == 62 or i == count - 1:
+                out.append(0xc0 | (run - 1))
+                run = 0
+            continue
+        if run > 0:
+            out.append(0xc0 | (run - 1))
+            run = 0
+        r, g, b, a = px
+        hash_index = (r * 3 + g * 5 + b * 7 + a * 11) % 64
+        if index[hash_index] == px:
+            out.append(hash_index)
+        else:
+            index[hash_index] = px
+            if a == prev[3]:
+                dr = (r - prev[0] + 128) % 256 - 128
+                dg = (g - prev[1] + 128) % 256 - 128
+                db = (b - prev[2] + 128) % 256 - 128
+                dr_dg = dr - dg
+                db_dg = db - dg
+                if -2 <= dr <= 1 and -2 <= dg <= 1 and -2 <= db <= 1:
+                    out.append(0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2))
+                elif -32 <= dg <= 31 and -8 <= dr_dg <= 7 and -8 <= db_dg <= 7:
+                    out += bytes([0x80 | (dg + 32), ((dr_dg + 8) << 4) | (db_dg + 8)])
+                else:
+                    out += bytes([0xfe, r, g, b])
+            else:
+                out += bytes([0xff, r, g, b, a])
+        prev = px
+    out += bytes([0] * 7 + [1])
+
+    with open(dst_file, 'wb') as f:
+        f.write(out)
 
-def process_emoji_collection(emoji_collection_dir, assets_dir):
+
+def process_emoji_collection(emoji_collection_dir, assets_dir, compress_images=False):
     """Process emoji_collection parameter"""
     if not emoji_collection_dir:
         return []
@@ -97,10 +166,15 @@ def process_emoji_collection(emoji_collection_dir, assets_dir):
     for root, dirs, files in os.walk(emoji_collection_dir):
         for file in files:
             if file.lower().endswith(('.png', '.gif')):
-                # Copy file
                 src_file = os.path.join(root, file)
-                dst_file = os.path.join(assets_dir, file)
-                copy_file(src_file, dst_file)
+                if compress_images and file.lower().endswith('.png'):
+                    # QOI decodes several times faster than PNG
+                    file = os.path.splitext(file)[0] + '.qoi'
+                    encode_qoi(src_file, os.path.join(assets_dir, file))
+                else:
+                    # Copy file
+                    dst_file = os.path.join(assets_dir, file)
+                    copy_file(src_file, dst_file)
                 
                 # Get filename without extension
                 filename_without_ext = os.path.splitext(file)[0]
@@ -276,7 +350,7 @@ def process_board_collection(target_board_dir, res_path, assets_dir):
     
     return emoji_collection, icon_collection, layout_json
 
-def generate_index_json(assets_dir, srmodels, text_font, emoji_collection, icon_collection, layout_json):
+def generate_index_json(assets_dir, srmodels, text_font, emoji_collection, icon_collection, layout_json, text_font_fallback=None):
     """Generate index.json file"""
     index_data = {
         "version": 1
@@ -287,6 +361,9 @@ def generate_index_json(assets_dir, srmodels, text_font, emoji_collection, icon_
     
     if text_font:
         index_data["text_font"] = text_font
+
+    if text_font_fallback:
+        index_data["text_font_fallback"] = text_font_fallback
     
     if emoji_collection:
         index_data["emoji_collection"] = emoji_collection
@@ -316,7 +393,7 @@ def generate_config_json(build_dir, assets_dir):
         "image_file": os.path.join(workspace_dir, "build/output/assets.bin"),
         "lvgl_ver": "9.3.0",
         "assets_size": "0x400000",
-        "support_format": ".png, .gif, .jpg, .bin, .json, .eaf",
+        "support_format": ".png, .gif, .jpg, .bin, .json, .eaf, .qoi",
         "name_length": "32",
         "split_height": "0",
         "support_qoi": False,
@@ -341,10 +418,19 @@ def main():
     parser = argparse.ArgumentParser(description='Build the spiffs assets partition')
     parser.add_argument('--wakenet_model', help='Path to wakenet model directory')
     parser.add_argument('--text_font', help='Path to text font file')
+    parser.add_argument('--font_subset', action='store_true',
+                        help='Keep the glyphs of the strings and of the corpus in the text font, the others go to a fallback font')
+    parser.add_argument('--font_langs', help='Comma separated languages of the strings to keep, all the locales if not set')
+    parser.add_argument('--font_corpus', action='append', help='A chat text file for the character frequency, may repeat')
+    parser.add_argument('--font_top_chars', type=int, default=3000, help='The most frequent corpus characters to keep')
+    parser.add_argument('--no_font_fallback', action='store_true',
+                        help='Drop the glyphs out of the subset instead of shipping the fallback font')
     parser.add_argument('--emoji_collection', help='Path to emoji collection directory')
 
     parser.add_argument('--res_path', help='Path to res directory')
     parser.add_argument('--target_board', help='Path to target board directory')
+    parser.add_argument('--compress_images', action='store_true',
+                        help='Store the PNG emoji as QOI, decoded by the firmware when first drawn')
     
     args = parser.parse_args()
     
@@ -365,17 +451,19 @@ def main():
     
     # Process each parameter
     srmodels = process_wakenet_model(args.wakenet_model, build_dir, assets_dir)
-    text_font = process_text_font(args.text_font, assets_dir)
+    text_font, text_font_fallback = process_text_font(args.text_font, assets_dir, args.font_subset,
+        args.font_langs.split(',') if args.font_langs else None, args.font_corpus, args.font_top_chars,
+        not args.no_font_fallback)
 
     if(args.target_board):
         emoji_collection, icon_collection, layout_json = process_board_collection(args.target_board, args.res_path, assets_dir)
     else:
-        emoji_collection = process_emoji_collection(args.emoji_collection, assets_dir)
+        emoji_collection = process_emoji_collection(args.emoji_collection, assets_dir, args.compress_images)
         icon_collection = []
         layout_json = []
     
     # Generate index.json
-    generate_index_json(assets_dir, srmodels, text_font, emoji_collection, icon_collection, layout_json)
+    generate_index_json(assets_dir, srmodels, text_font, emoji_collection, icon_collection, layout_json, text_font_fallback)
     
     # Generate config.json
     config_path = generate_config_json(build_dir, assets_dir)
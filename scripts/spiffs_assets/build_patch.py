@@ -0,0 +1,205 @@
+#!/usr/bin/env python3
+"""
+Build a patch that turns an installed assets.bin into a new one, for Assets::Download().
+
+The patch copies the assets that did not change from the installed image and carries the
+rest, deflated. The device writes the new image over the installed one sector by sector, so
+an asset is only copied from the sector being written or a later one; an asset that moved
+further than that towards the end of the image is carried in the patch.
+
+A firmware patch for Ota::Upgrade() is made against the firmware running on the device,
+which is not overwritten, so it is matched byte by byte in the manner of bsdiff: the regions
+that mostly match are carried as the differences to the running firmware, which deflate well.
+Without a base the patch is only the deflated image.
+
+    ./build_patch.py new/assets.bin --base old/assets.bin -o assets_patch.bin
+    ./build_patch.py new/xiaozhi.bin --base old/xiaozhi.bin --firmware -o xiaozhi.patch
+    ./build_patch.py xiaozhi.bin -o xiaozhi.patch
+"""
+import argparse
+import hashlib
+import struct
+import zlib
+
+PATCH_MAGIC = b'ZPT1'
+FLAG_DEFLATE = 0x01
+OPERATION_COPY = 0x01
+OPERATION_LITERAL = 0x02
+OPERATION_ADD = 0x03
+SECTOR_SIZE = 4096
+# A shorter copy costs more than the bytes it saves
+MIN_COPY_SIZE = 64
+TABLE_ENTRY_SIZE = 44   # struct mmap_assets_table
+BASE_ID_SIZE = 12
+# esp_image_header_t, esp_image_segment_header_t and the fields of esp_app_desc_t before app_elf_sha256
+APP_DESC_OFFSET = 24 + 8
+APP_ELF_SHA256_OFFSET = APP_DESC_OFFSET + 144
+APP_DESC_MAGIC = 0xABCD5432
+# The firmware is matched by runs of this many bytes at this step of the running firmware
+MATCH_SIZE = 16
+MATCH_STEP = 4
+
+
+def read_assets(image):
+    """The offset and bytes of each asset, with its "ZZ" magic"""
+    files, _, _ = struct.unpack_from('<III', image, 0)
+    data_start = 12 + files * TABLE_ENTRY_SIZE
+    assets = []
+    for i in range(files):
+        _, size, offset, _, _ = struct.unpack_from('<32sIIHH', image, 12 + i * TABLE_ENTRY_SIZE)
+        start = data_start + offset
+        assets.append((start, image[start:start + 2 + size]))
+    return assets
+
+
+def copyable_runs(source, destination, length):
+    """The parts of a copy that read no sector the device has overwritten already"""
+    shift = destination - source
+    if shift <= 0:
+        return [(0, length)]
+    if shift >= SECTOR_SIZE:
+        return []
+    # A byte can be copied from the installed image while its sector is not erased yet
+    runs = []
+    position = 0
+    while position < length:
+        start = max(position, (destination + position) // SECTOR_SIZE * SECTOR_SIZE + shift - destination)
+        end = min(length, ((destination + position) // SECTOR_SIZE + 1) * SECTOR_SIZE - destination)
+        if start < end:
+            runs.append((start, end - start))
+        position = end
+    return runs
+
+
+def build_operations(old, new):
+    old_assets = {hashlib.sha256(data).digest(): offset for offset, data in read_assets(old)}
+    copies = []
+    for offset, data in read_assets(new):
+        source = old_assets.get(hashlib.sha256(data).digest())
+        if source is None:
+            continue
+        for start, length in copyable_runs(source, offset, len(data)):
+            if length >= MIN_COPY_SIZE:
+                copies.append((offset + start, source + start, length))
+    copies.sort()
+
+    operations = bytearray()
+    position = 0
+    copied = 0
+    for destination, source, length in copies:
+        if destination > position:
+            operations += struct.pack('<BI', OPERATION_LITERAL, destination - position)
+            operations += new[position:destination]
+        operations += struct.pack('<BII', OPERATION_COPY, source, length)
+        position = destination + length
+        copied += length
+    if position < len(new):
+        operations += struct.pack('<BI', OPERATION_LITERAL, len(new) - position)
+        operations += new[position:]
+    return bytes(operations), copied
+
+
+def firmware_base_id(image):
+    """The firmware is known by the start of its ELF SHA-256"""
+    magic, = struct.unpack_from('<I', image, APP_DESC_OFFSET)
+    if image[0] != 0xE9 or magic != APP_DESC_MAGIC:
+        raise ValueError('not an application image')
+    return image[APP_ELF_SHA256_OFFSET:APP_ELF_SHA256_OFFSET + BASE_ID_SIZE]
+
+
+def extend_match(old, new, source, destination):
+    """The length that matches best, at least half of its bytes have to be equal"""
+    score = best = length = 0
+    limit = min(len(old) - source, len(new) - destination)
+    i = 0
+    while i < limit and i - length < 256:
+        score += 2 if old[source + i] == new[destination + i] else -1
+        i += 1
+        if score > best:
+            best, length = score, i
+    return length
+
+
+def build_firmware_operations(old, new):
+    index = {}
+    for position in range(0, len(old) - MATCH_SIZE + 1, MATCH_STEP):
+        index.setdefault(old[position:position + MATCH_SIZE], position)
+
+    operations = bytearray()
+    literal_start = 0
+    position = 0
+    copied = 0
+    # The next match is first looked for where the last one left off, as code moves by blocks
+    expected = None
+    while position + MATCH_SIZE <= len(new):
+        source = None
+        if expected is not None and old[expected:expected + MATCH_SIZE] == new[position:position + MATCH_SIZE]:
+            source = expected
+        else:
+            source = index.get(new[position:position + MATCH_SIZE])
+        if source is None:
+            position += 1
+            if expected is not None:
+                expected += 1
+            continue
+        length = extend_match(old, new, source, position)
+        if position > literal_start:
+            operations += struct.pack('<BI', OPERATION_LITERAL, position - literal_start)
+            operations += new[literal_start:position]
+        differences = bytes((new[position + i] - old[source + i]) & 0xFF for i in range(length))
+        if differences.count(0) == length:
+            operations += struct.pack('<BII', OPERATION_COPY, source, length)
+        else:
+            operations += struct.pack('<BII', OPERATION_ADD, source, length) + differences
+        copied += length
+        position += length
+        literal_start = position
+        expected = source + length
+    if literal_start < len(new):
+        operations += struct.pack('<BI', OPERATION_LITERAL, len(new) - literal_start)
+        operations += new[literal_start:]
+    return bytes(operations), copied
+
+
+def build_patch(old, new, compress=True, firmware=False):
+    if old is None:
+        operations, copied = struct.pack('<BI', OPERATION_LITERAL, len(new)) + new, 0
+        base_id = bytes(BASE_ID_SIZE)
+    elif firmware:
+        operations, copied = build_firmware_operations(old, new)
+        base_id = firmware_base_id(old)
+    else:
+        operations, copied = build_operations(old, new)
+        # The installed assets are known by their header
+        base_id = old[:BASE_ID_SIZE]
+    flags = FLAG_DEFLATE if compress else 0
+    if compress:
+        operations = zlib.compress(operations, 9)
+    header = PATCH_MAGIC + struct.pack('<I', flags) + base_id + struct.pack('<I', len(new))
+    return header + operations, copied
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Build a patch for the assets or the firmware')
+    parser.add_argument('new', help='The image to install')
+    parser.add_argument('--base', help='The assets.bin or the firmware installed on the device')
+    parser.add_argument('--firmware', action='store_true', help='The images are firmware, not assets')
+    parser.add_argument('-o', '--output', default='assets_patch.bin', help='The patch file')
+    parser.add_argument('--no-compress', action='store_true', help='Do not deflate the patch')
+    args = parser.parse_args()
+
+    old = None
+    if args.base:
+        with open(args.base, 'rb') as f:
+            old = f.read()
+    with open(args.new, 'rb') as f:
+        new = f.read()
+
+    patch, copied = build_patch(old, new, not args.no_compress, args.firmware)
+    with open(args.output, 'wb') as f:
+        f.write(patch)
+    print(f'{args.output}: {len(patch)} bytes for {len(new)} bytes, {copied} bytes taken from the base')
+
+
+if __name__ == '__main__':
+    main()
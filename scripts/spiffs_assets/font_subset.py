@@ -0,0 +1,249 @@
+#!/usr/bin/env python3
+"""
+Split a cbin text font (the LVGL binary font format) into a subset font and a fallback font
+
+The subset keeps the glyphs of the strings of the languages and the most frequent characters of
+a chat text corpus, the firmware loads it when the assets are applied. The fallback has all the
+other glyphs, the firmware only loads it when a text needs one of them.
+
+Usage:
+    ./font_subset.py --font font_puhui_common_20_4.bin --langs zh-CN,en-US \
+        --corpus chat.txt --top_chars 3000 --output subset.bin --fallback fallback.bin
+"""
+
+import os
+import json
+import struct
+import argparse
+from collections import Counter
+
+# The cmap formats of lv_font_fmt_txt
+CMAP_FORMAT0_FULL = 0
+CMAP_SPARSE_FULL = 1
+CMAP_FORMAT0_TINY = 2
+CMAP_SPARSE_TINY = 3
+
+# The offsets in the data of the head table
+HEAD_TABLES_COUNT = 4
+HEAD_INDEX_TO_LOC_FORMAT = 26
+
+# A run of consecutive characters this long gets a cmap of its own without a list
+MIN_TINY_RUN = 16
+
+# Always in the subset, the digits, the Latin letters and the usual punctuation of a chat reply
+BASE_CHARS = ''.join(chr(c) for c in range(0x20, 0x7f)) + '，。！？、：；“”‘’（）《》【】…—·～'
+
+
+def align4(data):
+    return data + b'\0' * (-len(data) % 4)
+
+
+def make_table(tag, body):
+    """The length of a table includes its padding, the next table starts right after it"""
+    body = align4(bytes(body))
+    return struct.pack('<I4s', 8 + len(body), tag.encode()) + body
+
+
+def read_table(data, offset, tag):
+    """Returns the length of the table at offset, which must have the tag"""
+    if offset + 8 > len(data):
+        raise ValueError(f"No {tag} table at {offset}")
+    length, label = struct.unpack_from('<I4s', data, offset)
+    if label != tag.encode() or length < 8 or offset + length > len(data):
+        raise ValueError(f"Bad {tag} table at {offset}")
+    return length
+
+
+class CBinFont:
+    """The tables of a cbin font, and its codepoints mapped to the glyph ids"""
+
+    def __init__(self, data):
+        self.head_length = read_table(data, 0, 'head')
+        self.head = bytearray(data[:self.head_length])
+        self.tables_count = struct.unpack_from('<H', data, 8 + HEAD_TABLES_COUNT)[0]
+        loca_format = data[8 + HEAD_INDEX_TO_LOC_FORMAT]
+
+        cmap_start = self.head_length
+        cmap_length = read_table(data, cmap_start, 'cmap')
+        self.cmap = {}
+        subtables = struct.unpack_from('<I', data, cmap_start + 8)[0]
+        for i in range(subtables):
+            data_offset, range_start, range_length, glyph_id_start, entries, format_type = \
+                struct.unpack_from('<IIHHHB', data, cmap_start + 12 + i * 16)
+            base = cmap_start + data_offset
+            if format_type == CMAP_FORMAT0_TINY:
+                for rcp in range(range_length):
+                    self.cmap[range_start + rcp] = glyph_id_start + rcp
+            elif format_type == CMAP_FORMAT0_FULL:
+                for rcp in range(entries):
+                    ofs = data[base + rcp]
+                    # Unused codepoints of the range map to the first glyph
+                    if ofs != 0 or rcp == 0:
+                        self.cmap[range_start + rcp] = glyph_id_start + ofs
+            elif format_type in (CMAP_SPARSE_FULL, CMAP_SPARSE_TINY):
+                deltas = struct.unpack_from(f'<{entries}H', data, base)
+                if format_type == CMAP_SPARSE_FULL:
+                    ids = struct.unpack_from(f'<{entries}H', data, base + entries * 2)
+                else:
+                    ids = range(entries)
+                for delta, ofs in zip(deltas, ids):
+                    self.cmap[range_start + delta] = glyph_id_start + ofs
+            else:
+                raise ValueError(f"Unknown cmap format {format_type}")
+
+        loca_start = cmap_start + cmap_length
+        loca_length = read_table(data, loca_start, 'loca')
+        count = struct.unpack_from('<I', data, loca_start + 8)[0]
+        offsets = struct.unpack_from(f"<{count}{'I' if loca_format else 'H'}", data, loca_start + 12)
+
+        glyf_start = loca_start + loca_length
+        glyf_length = read_table(data, glyf_start, 'glyf')
+        self.glyphs = []
+        for i in range(count):
+            end = offsets[i + 1] if i + 1 < count else glyf_length
+            self.glyphs.append(data[glyf_start + offsets[i]:glyf_start + end])
+        self.has_kerning = self.tables_count > 4 and glyf_start + glyf_length < len(data)
+
+    def build(self, codepoints):
+        """A font of the glyphs of the codepoints, with ids in codepoint order and without kerning"""
+        codepoints = sorted(c for c in set(codepoints) if c in self.cmap)
+        glyphs = [self.glyphs[0]] + [self.glyphs[self.cmap[c]] for c in codepoints]
+
+        glyf = bytearray()
+        offsets = []
+        for glyph in glyphs:
+            offsets.append(8 + len(glyf))
+            glyf += glyph
+        glyf = make_table('glyf', glyf)
+        loca_format = 1 if offsets[-1] > 0xffff else 0
+        loca = struct.pack('<I', len(offsets)) + struct.pack(f"<{len(offsets)}{'I' if loca_format else 'H'}", *offsets)
+        loca = make_table('loca', loca)
+
+        head = bytearray(self.head)
+        struct.pack_into('<H', head, 8 + HEAD_TABLES_COUNT, 4)
+        head[8 + HEAD_INDEX_TO_LOC_FORMAT] = loca_format
+
+        return bytes(head) + build_cmap(codepoints) + loca + glyf
+
+
+def build_cmap(codepoints):
+    """The codepoints are sorted and glyph i + 1 is codepoint i, the ranges must not overlap"""
+    subtables = []      # (range_start, range_length, glyph_id_start, format, entries, data)
+    i = 0
+    block = []
+    block_id = 1
+
+    def flush():
+        if block:
+            deltas = [c - block[0] for c in block]
+            subtables.append((block[0], deltas[-1] + 1, block_id, CMAP_SPARSE_TINY, len(block),
+                              struct.pack(f'<{len(block)}H', *deltas)))
+
+    while i < len(codepoints):
+        run = 1
+        while i + run < len(codepoints) and codepoints[i + run] == codepoints[i] + run:
+            run += 1
+        if run >= MIN_TINY_RUN:
+            flush()
+            block = []
+            subtables.append((codepoints[i], run, i + 1, CMAP_FORMAT0_TINY, 0, b''))
+        else:
+            for j in range(i, i + run):
+                c = codepoints[j]
+                if block and c - block[0] > 0xffff:
+                    flush()
+                    block = []
+                if not block:
+                    block_id = j + 1
+                block.append(c)
+        i += run
+    flush()
+
+    header_length = 12 + 16 * len(subtables)
+    headers = bytearray()
+    payload = bytearray()
+    for range_start, range_length, glyph_id_start, format_type, entries, data in subtables:
+        headers += struct.pack('<IIHHHBx', header_length + len(payload), range_start, range_length,
+                               glyph_id_start, entries, format_type)
+        payload += align4(data)
+    body = struct.pack('<I', len(subtables)) + headers + payload
+    return make_table('cmap', body)
+
+
+def collect_lang_chars(locales_dir, langs):
+    """The characters of the strings of the languages, all of them if langs is empty"""
+    if langs:
+        # The firmware falls back to en-US for the strings a language lacks
+        langs = set(langs) | {'en-US'}
+    else:
+        langs = set(os.listdir(locales_dir)) if os.path.isdir(locales_dir) else set()
+    chars = set()
+    for lang in sorted(langs):
+        path = os.path.join(locales_dir, lang, 'language.json')
+        if not os.path.exists(path):
+            print(f"Warning: No strings for {lang}: {path}")
+            continue
+        with open(path, 'r', encoding='utf-8') as f:
+            strings = json.load(f).get('strings', {})
+        for text in strings.values():
+            chars.update(text)
+    return chars
+
+
+def collect_corpus_chars(corpus_files, top_chars, font):
+    """The top_chars most frequent characters of the corpus that the font has"""
+    counter = Counter()
+    for path in corpus_files or []:
+        with open(path, 'r', encoding='utf-8', errors='ignore') as f:
+            counter.update(f.read())
+    chars = [c for c, _ in counter.most_common() if ord(c) in font.cmap and not c.isspace()]
+    return set(chars[:top_chars])
+
+
+def subset_font(font_file, output_file, fallback_file, locales_dir, langs=None, corpus_files=None, top_chars=3000):
+    """
+    Writes the subset font to output_file, and the other glyphs to fallback_file unless it is None.
+    Returns False if the font is not a cbin font, the caller then ships it whole.
+    """
+    with open(font_file, 'rb') as f:
+        data = f.read()
+    try:
+        font = CBinFont(data)
+    except (ValueError, struct.error) as e:
+        print(f"Warning: {font_file} is not a cbin font that can be subset: {e}")
+        return False
+    if font.has_kerning:
+        print("Warning: The kerning of the font is dropped")
+
+    chars = set(BASE_CHARS) | collect_lang_chars(locales_dir, langs) | collect_corpus_chars(corpus_files, top_chars, font)
+    subset = {ord(c) for c in chars} & set(font.cmap)
+    subset_data = font.build(subset)
+    with open(output_file, 'wb') as f:
+        f.write(subset_data)
+    print(f"Font subset: {len(subset)} of {len(font.cmap)} glyphs, {len(subset_data)} of {len(data)} bytes")
+
+    if fallback_file:
+        rest = set(font.cmap) - subset
+        fallback_data = font.build(rest)
+        with open(fallback_file, 'wb') as f:
+            f.write(fallback_data)
+        print(f"Font fallback: {len(rest)} glyphs, {len(fallback_data)} bytes")
+    return True
+
+
+if __name__ == "__main__":
+    script_dir = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description='Split a cbin font into a subset font and a fallback font')
+    parser.add_argument('--font', required=True, help='Path to the cbin font')
+    parser.add_argument('--output', required=True, help='Path to the subset font')
+    parser.add_argument('--fallback', help='Path to the font of the other glyphs, dropped if not set')
+    parser.add_argument('--locales', default=os.path.join(script_dir, '../../main/assets/locales'),
+                        help='Path to the locales directory')
+    parser.add_argument('--langs', help='Comma separated language codes, all the locales if not set')
+    parser.add_argument('--corpus', action='append', help='A chat text file for the character frequency, may repeat')
+    parser.add_argument('--top_chars', type=int, default=3000, help='The most frequent corpus characters to keep')
+    args = parser.parse_args()
+
+    langs = args.langs.split(',') if args.langs else None
+    if not subset_font(args.font, args.output, args.fallback, args.locales, langs, args.corpus, args.top_chars):
+        raise SystemExit(1)
@@ -57,8 +57,8 @@ def compute_checksum(data):
     return checksum
 
 def sort_key(filename):
-    basename, extension = os.path.splitext(filename)
-    return extension, basename
+    # The firmware binary searches the table, in the byte order of the names
+    return filename.encode('utf-8')
 
 def download_v8_script(convert_path):
     """